@@ -0,0 +1,244 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ps/adjust/histogram.h"
+#include "ps/core/command.h"
+#include "ps/core/image_document.h"
+
+namespace ps::adjust {
+
+/**
+ * @brief Output level for every 8-bit input level (the original's TLookUpTable)
+ */
+using Lut = std::array<std::uint8_t, 256>;
+
+/**
+ * @brief Returns the table that leaves every level unchanged
+ */
+Lut identity_lut();
+
+/**
+ * @brief Returns true if @p lut leaves every level unchanged
+ */
+bool is_identity(const Lut& lut);
+
+/**
+ * @brief Returns the table that applies @p first, then @p second
+ */
+Lut compose(const Lut& first, const Lut& second);
+
+/**
+ * @brief Levels: maps [input_low, input_high] onto [output_low, output_high]
+ *        (port of TLevelsDialog.PrepareMap)
+ * @param gamma Midtone gamma; 1 is linear, larger values brighten
+ * @throws std::invalid_argument unless 0 <= input_low < input_high <= 255,
+ *         the output levels are within 0..255 and gamma > 0
+ *
+ * Levels below input_low take output_low and levels above input_high take
+ * output_high. Output levels may be reversed to invert the range. The
+ * original's gamma tables came from assembly; they are computed here as
+ * 255 × (x / 255)^(1 / gamma), with the original's smooth toe replacing the
+ * curve's vertical start when gamma > 1.
+ */
+Lut levels_lut(int input_low, int input_high, double gamma = 1.0, int output_low = 0,
+               int output_high = 255);
+
+/**
+ * @brief A point of a Curves adjustment
+ */
+struct CurvePoint {
+  int input = 0;
+  int output = 0;
+};
+
+/**
+ * @brief Curves: a natural cubic spline through @p points
+ * @throws std::invalid_argument if there are fewer than two points, two
+ *         points share an input or a level is outside 0..255
+ *
+ * Points may come in any order. Levels before the first point and after
+ * the last take their outputs; the curve is clamped to 0..255.
+ */
+Lut curves_lut(std::vector<CurvePoint> points);
+
+/**
+ * @brief Brightness/Contrast (port of TBrightnessDialog.PrepareMap)
+ * @param brightness -100..100
+ * @param contrast -100..100; 100 turns the image into a threshold at the
+ *                 pivot
+ * @param mean Pivot level: the original used the rounded mean of the
+ *             image's luminosity histogram
+ * @throws std::invalid_argument if a parameter is out of range
+ *
+ * Positive contrast steepens the line through (mean - brightness, mean),
+ * negative contrast flattens the line through (mean, mean + brightness).
+ */
+Lut brightness_contrast_lut(int brightness, int contrast, int mean);
+
+/**
+ * @brief Posterize to @p levels evenly spaced levels (2..255)
+ * @throws std::invalid_argument if levels is out of range
+ */
+Lut posterize_lut(int levels);
+
+/**
+ * @brief Invert: 255 - level
+ */
+Lut invert_lut();
+
+/**
+ * @brief Threshold: 255 from @p level up, 0 below it
+ */
+Lut threshold_lut(int level);
+
+/**
+ * @brief Equalize (port of TEqualizeCommand)
+ * @throws std::invalid_argument if the histogram has fewer than two
+ *         non-empty levels
+ *
+ * Spreads the used levels so the cumulative histogram becomes a straight
+ * line, counting each level from the middle of its population, as the
+ * original did.
+ */
+Lut equalize_lut(const Histogram& histogram);
+
+/**
+ * @brief A chain of lookup tables, fused into one table per channel
+ *
+ * Each step composes onto the tables of the steps before it, so a chain
+ * such as Levels, then Curves on the red channel, then Posterize costs one
+ * lookup per sample when applied, however long it is:
+ * @code
+ *   Adjustment adjustment("Levels");
+ *   adjustment.then(levels_lut(10, 240)).then(0, curves_lut(points));
+ * @endcode
+ */
+class Adjustment {
+ public:
+  explicit Adjustment(std::string name = "Adjust");
+
+  /**
+   * @brief Returns the name shown in the undo history
+   */
+  const std::string& name() const { return name_; }
+
+  /**
+   * @brief Applies @p lut to every channel after the steps so far
+   */
+  Adjustment& then(const Lut& lut);
+
+  /**
+   * @brief Applies @p lut to one document channel after the steps so far
+   */
+  Adjustment& then(std::size_t channel, const Lut& lut);
+
+  /**
+   * @brief Returns the fused table of a channel
+   */
+  const Lut& lut(std::size_t channel) const;
+
+  /**
+   * @brief Returns true if no channel changes
+   */
+  bool is_identity() const;
+
+ private:
+  std::string name_;
+  Lut common_;
+  std::map<std::size_t, Lut> channels_;  ///< Channels with steps of their own
+};
+
+/**
+ * @brief What apply_adjustment() adjusts
+ */
+struct AdjustmentOptions {
+  /// Channels to adjust; empty adjusts every channel
+  std::vector<std::size_t> channels;
+  /// Area to adjust; empty means the whole image
+  core::Rect area{};
+  /// Blend the result with the original by the selection mask, and adjust
+  /// only inside its bounds, when there is a selection
+  bool use_selection = true;
+};
+
+/**
+ * @brief Returns the rectangle apply_adjustment() would change
+ *
+ * Clipped as filter_area() clips it. Empty if nothing would change.
+ */
+core::Rect adjustment_area(const core::ImageDocument& doc,
+                           const AdjustmentOptions& options = {});
+
+/**
+ * @brief Applies an adjustment to channels of a document (port of
+ *        TAdjustmentCommand)
+ * @return The changed area
+ * @throws std::out_of_range if a channel index is invalid
+ * @throws std::invalid_argument if a channel is not Gray8 or Gray16
+ *
+ * Every channel is mapped through its fused table in a single pass, one
+ * buffer tile per ThreadPool task; channels whose table is the identity
+ * are skipped, as are tiles the selection does not touch. Gray16 samples
+ * go through a 65536-entry table interpolated from the 8-bit one, so
+ * 16-bit channels keep their precision. Results are blended by the
+ * selection as in apply_filter(); the area is reported with mark_dirty().
+ */
+core::Rect apply_adjustment(core::ImageDocument& doc, const Adjustment& adjustment,
+                            const AdjustmentOptions& options = {});
+
+/**
+ * @brief Undoable application of an adjustment
+ *
+ * Saves the adjusted area with save_region() first, like FilterCommand, so
+ * undo and redo swap blocks instead of recomputing.
+ */
+class AdjustmentCommand : public core::ImageCommand {
+ public:
+  AdjustmentCommand(core::ImageDocument& doc, Adjustment adjustment,
+                    AdjustmentOptions options = {});
+  ~AdjustmentCommand() override = default;
+
+  void execute() override;
+  void redo() override;
+  std::string name() const override { return adjustment_.name(); }
+
+ private:
+  Adjustment adjustment_;
+  AdjustmentOptions options_;
+};
+
+/**
+ * @brief A reduced rendering of an adjustment's result for dialogs
+ */
+struct AdjustmentPreview {
+  /// The previewed channels, in order, reduced by about factor, with the
+  /// adjustment applied (and blended by the reduced selection)
+  core::ImageDocument image;
+  int factor = 1;     ///< Integer reduction factor
+  core::Rect area{};  ///< Image area the preview shows
+};
+
+/**
+ * @brief Renders a low-resolution proxy of an adjustment's result
+ * @param doc Document to preview; it is not modified
+ * @param adjustment Adjustment to preview
+ * @param options Channels and area as for apply_adjustment(); an empty
+ *                area previews the whole image
+ * @param max_edge Largest edge of the preview in pixels (at least 1)
+ * @throws std::invalid_argument if max_edge < 1, or as apply_adjustment()
+ *
+ * The area and the selection are box-filtered down by the smallest integer
+ * factor that fits max_edge and the adjustment runs on the reduction, so
+ * dialogs such as Levels and Curves can rerun it on every slider move.
+ */
+AdjustmentPreview preview_adjustment(const core::ImageDocument& doc,
+                                     const Adjustment& adjustment,
+                                     const AdjustmentOptions& options, int max_edge);
+
+}  // namespace ps::adjust
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "ps/core/image_document.h"
+
+namespace ps::adjust {
+
+/**
+ * @brief Pixel counts per 8-bit level (the original's THistogram)
+ */
+struct Histogram {
+  std::array<std::uint64_t, 256> counts{};
+
+  /**
+   * @brief Returns the number of pixels counted
+   */
+  std::uint64_t total() const;
+
+  /**
+   * @brief Returns the mean level, or 0 for an empty histogram
+   */
+  double mean() const;
+
+  Histogram& operator+=(const Histogram& other);
+};
+
+/**
+ * @brief Histograms of a layer's pixels
+ */
+struct LayerHistogram {
+  Histogram luminosity;  ///< Gray levels, 30% red, 59% green, 11% blue
+  Histogram red;
+  Histogram green;
+  Histogram blue;
+};
+
+/**
+ * @brief Counts the levels of a channel (port of DoHistBytes)
+ * @param buffer Gray8 or Gray16 channel; Gray16 samples count by their
+ *               high byte
+ * @param selection Mask to count through, or nullptr for every pixel.
+ *                  Like the original, only pixels selected at least half
+ *                  (mask values of 128 and up) count.
+ * @throws std::invalid_argument if the format is not Gray8 or Gray16, or
+ *         the selection's size differs from the buffer's
+ *
+ * Bands of rows are counted on the ThreadPool into partial histograms
+ * that are merged at the end; within a band, alternate pixels go to
+ * separate tables so repeated levels do not serialize on one counter.
+ */
+Histogram channel_histogram(const core::ImageBuffer& buffer,
+                            const core::SelectionMask* selection = nullptr);
+
+/**
+ * @brief Counts the levels of a layer (port of DoHistLuminosity)
+ * @param layer Layer in any RGBA format
+ * @param selection As for channel_histogram()
+ *
+ * Transparent pixels are not counted; premultiplied pixels count with
+ * their color restored. Luminosity uses the original's gGrayLUT tables,
+ * so gray levels match its RGB to gray conversion exactly.
+ */
+LayerHistogram layer_histogram(const core::Layer& layer,
+                               const core::SelectionMask* selection = nullptr);
+
+/**
+ * @brief Keeps histograms of a document until the pixels they count change
+ *
+ * Dialogs such as Levels and Equalize ask for the same histograms again
+ * and again; each lookup checks ImageDocument::damaged_since() for the
+ * layer (or the channel data), the layer's revision and the selection's
+ * revision, and counts again only when one of them moved. Edits to one
+ * layer leave the other layers' entries valid. Not thread safe.
+ */
+class HistogramCache {
+ public:
+  /**
+   * @brief Returns the histogram of a document channel
+   * @param use_selection Count through the document's selection, if any
+   * @throws std::out_of_range if the index is invalid, or as
+   *         channel_histogram()
+   */
+  const Histogram& channel(const core::ImageDocument& doc, std::size_t index,
+                           bool use_selection = true);
+
+  /**
+   * @brief Returns the histograms of one of the document's layers
+   * @param use_selection Count through the document's selection, if any
+   */
+  const LayerHistogram& layer(const core::ImageDocument& doc, const core::Layer& layer,
+                              bool use_selection = true);
+
+  /**
+   * @brief Drops every entry
+   */
+  void clear();
+
+ private:
+  struct Entry {
+    const core::ImageDocument* doc = nullptr;
+    const core::Layer* layer = nullptr;  ///< nullptr for channel entries
+    std::size_t channel = 0;
+    const core::ImageBuffer* buffer = nullptr;  ///< The channel's buffer
+    core::Size size{};
+    std::uint64_t layer_revision = 0;
+    std::uint64_t selection_revision = 0;  ///< 0 when counted without one
+    std::uint64_t damage_revision = 0;
+    Histogram histogram;
+    LayerHistogram layer_histogram;
+  };
+
+  // Fills key for the current state; returns the entry if it is still valid
+  Entry* find(const core::ImageDocument& doc, const core::Layer* layer, std::size_t channel,
+              bool use_selection, Entry& key);
+  Entry& store(Entry&& key);
+
+  std::vector<Entry> entries_;
+};
+
+}  // namespace ps::adjust
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+namespace ps::core {
+
+/// Alignment of pixel storage in bytes (one cache line, enough for AVX-512)
+constexpr std::size_t kPixelAlignment = 64;
+
+/**
+ * @brief Allocator returning over-aligned memory that is default-initialized
+ *
+ * Two differences from std::allocator:
+ * - Every allocation is aligned to @p Alignment bytes, so the start of a
+ *   pixel buffer is suitable for aligned vector loads.
+ * - Value-less construct() default-initializes instead of value-initializing.
+ *   For trivial types this leaves the memory untouched, so
+ *   std::vector::resize() does not write the new elements. Callers that need
+ *   zeroed pixels must clear them explicitly.
+ */
+template <typename T, std::size_t Alignment = kPixelAlignment>
+class AlignedAllocator {
+ public:
+  using value_type = T;
+
+  template <typename U>
+  struct rebind {
+    using other = AlignedAllocator<U, Alignment>;
+  };
+
+  AlignedAllocator() noexcept = default;
+
+  template <typename U>
+  AlignedAllocator(const AlignedAllocator<U, Alignment>&) noexcept {}
+
+  T* allocate(std::size_t count) {
+    return static_cast<T*>(
+        ::operator new(count * sizeof(T), std::align_val_t(Alignment)));
+  }
+
+  void deallocate(T* ptr, std::size_t) noexcept {
+    ::operator delete(ptr, std::align_val_t(Alignment));
+  }
+
+  template <typename U>
+  void construct(U* ptr) noexcept {
+    ::new (static_cast<void*>(ptr)) U;
+  }
+
+  template <typename U, typename... Args>
+  void construct(U* ptr, Args&&... args) {
+    ::new (static_cast<void*>(ptr)) U(std::forward<Args>(args)...);
+  }
+
+  template <typename U>
+  bool operator==(const AlignedAllocator<U, Alignment>&) const noexcept {
+    return true;
+  }
+
+  template <typename U>
+  bool operator!=(const AlignedAllocator<U, Alignment>&) const noexcept {
+    return false;
+  }
+};
+
+/**
+ * @brief Byte vector used for contiguous pixel storage
+ *
+ * 64-byte aligned; resize() leaves new bytes uninitialized.
+ */
+using PixelStorage = std::vector<std::uint8_t, AlignedAllocator<std::uint8_t>>;
+
+}  // namespace ps::core
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "ps/core/aligned_allocator.h"
+
+namespace ps::core {
+
+/**
+ * @brief Snapshot of buffer pool usage
+ */
+struct BufferPoolStats {
+  std::size_t cached_bytes = 0;    ///< Capacity of idle buffers held by the pool
+  std::size_t capacity_bytes = 0;  ///< Maximum bytes the pool keeps idle
+  std::size_t hits = 0;            ///< acquire() calls served from the pool
+  std::size_t misses = 0;          ///< acquire() calls that allocated
+};
+
+/**
+ * @brief Recycles large pixel allocations between buffers
+ *
+ * Composites, flattened copies and decoded images are allocated and freed
+ * over and over with the same handful of sizes. BufferPool keeps released
+ * storage in size classes (four per power of two, so at most 25% slack) and
+ * hands it back out on the next acquire() of a similar size, avoiding both
+ * the allocator round trip and the kernel zeroing fresh pages.
+ *
+ * Only allocations of at least kMinPooledBytes are pooled; smaller requests
+ * go straight to the allocator. Idle storage is capped by capacity(); storage
+ * released beyond the cap is freed immediately.
+ *
+ * ImageBuffer uses the pool for its contiguous storage, so temporaries such
+ * as flattened copies and split layers are recycled automatically.
+ *
+ * The pool is thread-safe.
+ */
+class BufferPool {
+ public:
+  /// Smallest allocation that is recycled through the pool
+  static constexpr std::size_t kMinPooledBytes = 64 * 1024;
+
+  /**
+   * @brief Returns the process-wide buffer pool
+   */
+  static BufferPool& instance();
+
+  /**
+   * @brief Returns storage holding @p bytes bytes with unspecified contents
+   * @param bytes Requested size
+   */
+  PixelStorage acquire(std::size_t bytes);
+
+  /**
+   * @brief Returns storage to the pool
+   * @param storage Storage to recycle; left empty
+   */
+  void release(PixelStorage&& storage);
+
+  /**
+   * @brief Sets the maximum number of idle bytes the pool keeps
+   * @param bytes New cap; idle storage over the cap is freed
+   */
+  void set_capacity(std::size_t bytes);
+
+  /**
+   * @brief Returns the maximum number of idle bytes the pool keeps
+   */
+  std::size_t capacity() const;
+
+  /**
+   * @brief Frees all idle storage
+   */
+  void clear();
+
+  /**
+   * @brief Returns current pool usage figures
+   */
+  BufferPoolStats stats() const;
+
+ private:
+  BufferPool() = default;
+
+  BufferPool(const BufferPool&) = delete;
+  BufferPool& operator=(const BufferPool&) = delete;
+
+  static std::size_t class_size_for(std::size_t bytes);
+  void shrink_to(std::size_t bytes);
+
+  mutable std::mutex mutex_;
+  std::map<std::size_t, std::vector<PixelStorage>> free_lists_;  ///< By class size
+  std::size_t cached_bytes_ = 0;
+  std::size_t capacity_bytes_ = std::size_t(256) << 20;
+  std::size_t hits_ = 0;
+  std::size_t misses_ = 0;
+};
+
+}  // namespace ps::core
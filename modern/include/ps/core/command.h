@@ -1,5 +1,7 @@
 #pragma once
 
+#include <atomic>
+#include <cstddef>
 #include <memory>
 #include <string>
 #include <vector>
@@ -51,6 +53,31 @@ class Command {
    * @return true if the command changes document state
    */
   virtual bool modifies_document() const { return true; }
+
+  /**
+   * @brief Returns the number of bytes of undo state held by the command
+   *
+   * Used by UndoStack to enforce its memory budget. Must be cheap and safe
+   * to call while compress() runs on another thread.
+   */
+  virtual std::size_t memory_footprint() const { return 0; }
+
+  /**
+   * @brief Compresses undo state that is unlikely to be needed soon
+   *
+   * UndoStack calls this on its worker thread for entries that have moved
+   * away from the current history position. No other member except
+   * memory_footprint() is called while it runs. The default does nothing.
+   */
+  virtual void compress() {}
+
+  /**
+   * @brief Restores state compressed by compress()
+   *
+   * Called before undo() or redo() of a compressed command. The default
+   * does nothing.
+   */
+  virtual void decompress() {}
 };
 
 /**
@@ -60,8 +87,22 @@ class Command {
  * functionality. It saves affected channels before modification and restores
  * them during undo operations.
  *
+ * Two backup granularities are available:
+ * - save_channel() / save_all_channels() keep a copy of whole channels. Use
+ *   these for operations that rewrite the entire image.
+ * - save_region() saves only the blocks of every channel that intersect a
+ *   rectangle, and only the first time each block is touched. Interactive
+ *   tools call it before each dab so that the cost of starting a stroke and
+ *   the memory held by its undo state scale with the painted area rather
+ *   than with the document size.
+ *
+ * Region backups are swapped with the document on undo, like the buffer
+ * swapping of the original Photoshop, so after undo they hold the modified
+ * pixels and swap_regions() can redo the change without recomputing it.
+ *
  * Derived classes should:
- * - Call save_channel() or save_all_channels() before modifying pixels
+ * - Call save_channel(), save_all_channels() or save_region() before
+ *   modifying pixels
  * - Implement execute() to perform the actual pixel modifications
  */
 class ImageCommand : public Command {
@@ -78,6 +119,27 @@ class ImageCommand : public Command {
    */
   void undo() override;
 
+  /**
+   * @brief Returns the bytes held by channel and region backups
+   *
+   * Tiles shared with the document or other commands are counted in full.
+   */
+  std::size_t memory_footprint() const override;
+
+  /**
+   * @brief PackBits-compresses backups whose bytes are owned by the command
+   *
+   * Contiguous channel backups and byte-copied region blocks are compressed
+   * when that makes them smaller. Backups that share tiles are left as they
+   * are; those tiles are paged to disk by the TileCache instead.
+   */
+  void compress() override;
+
+  /**
+   * @brief Decompresses all backups compressed by compress()
+   */
+  void decompress() override;
+
  protected:
   ImageDocument& document_;  ///< The document being modified
 
@@ -86,7 +148,9 @@ class ImageCommand : public Command {
    */
   struct ChannelBackup {
     std::size_t index;   ///< Index of the backed-up channel
-    ImageBuffer buffer;  ///< Copy of the channel's pixel data
+    ImageBuffer buffer;  ///< Copy of the channel (tiles are shared copy-on-write)
+    Size packed_size{};  ///< Channel size while the backup is compressed
+    std::vector<std::uint8_t> packed;  ///< PackBits data, empty if uncompressed
   };
   std::vector<ChannelBackup> saved_channels_;  ///< List of backed-up channels
 
@@ -105,6 +169,71 @@ class ImageCommand : public Command {
    * @brief Restores all saved channels to the document
    */
   void restore_channels();
+
+  /**
+   * @brief Saves the pixels of every channel that lie in a rectangle
+   * @param x Left edge in image coordinates
+   * @param y Top edge in image coordinates
+   * @param width Width of the rectangle
+   * @param height Height of the rectangle
+   *
+   * The image is divided into blocks (one tile for tiled channels,
+   * kUndoBlockSize pixels square otherwise). Each block is saved the first
+   * time it intersects a saved rectangle; later calls covering it are free.
+   * Tiled blocks are saved by sharing the tile, so no pixels are copied until
+   * the document writes to it. The rectangle is clipped to the document.
+   */
+  void save_region(int x, int y, int width, int height);
+
+  /**
+   * @brief Exchanges saved region blocks with the document's pixels
+   *
+   * Called by undo(); calling it again re-applies the change.
+   */
+  void swap_regions();
+
+  /**
+   * @brief Returns true if save_region() has saved any blocks
+   */
+  bool has_saved_regions() const { return !saved_regions_.empty(); }
+
+  /// Block size used for region backups of contiguous channels
+  static constexpr int kUndoBlockSize = 64;
+
+ private:
+  /**
+   * @brief One saved block of a channel
+   */
+  struct BlockBackup {
+    int x = 0;       ///< Left edge of the block (clipped to the image)
+    int y = 0;       ///< Top edge of the block
+    int width = 0;   ///< Block width after clipping
+    int height = 0;  ///< Block height after clipping
+    bool shares_tile = false;     ///< Saved as a tile reference
+    bool packed = false;          ///< pixels holds PackBits data
+    std::shared_ptr<Tile> tile;   ///< Saved tile (nullptr = all zero)
+    std::vector<std::uint8_t> pixels;  ///< Saved bytes when not sharing a tile
+  };
+
+  /**
+   * @brief Saved blocks of one channel
+   */
+  struct RegionBackup {
+    std::size_t index = 0;  ///< Index of the channel
+    Size size{};            ///< Channel size when the first block was saved
+    PixelFormat format = PixelFormat::Gray8;  ///< Channel format at that time
+    int block_size = 0;     ///< Edge length of a block in pixels
+    int columns = 0;        ///< Number of block columns
+    std::vector<bool> saved;            ///< Per-block "already saved" flags
+    std::vector<BlockBackup> blocks;    ///< Saved blocks in capture order
+  };
+  std::vector<RegionBackup> saved_regions_;  ///< One entry per channel
+
+  bool compressed_ = false;                      ///< Any backup is packed
+  std::atomic<std::size_t> footprint_bytes_{0};  ///< Cached memory_footprint()
+
+  void update_footprint();
+  static void swap_block(ImageBuffer& buffer, BlockBackup& block);
 };
 
 /**
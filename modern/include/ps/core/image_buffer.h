@@ -1,10 +1,15 @@
 #pragma once
 
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "ps/core/aligned_allocator.h"
+#include "ps/core/tile.h"
+
 namespace ps::core {
 
 /**
@@ -15,45 +20,173 @@ struct Size {
   int height = 0;  ///< Height in pixels
 };
 
+/**
+ * @brief An axis-aligned pixel rectangle in document coordinates
+ */
+struct Rect {
+  int x = 0;       ///< Left edge X coordinate
+  int y = 0;       ///< Top edge Y coordinate
+  int width = 0;   ///< Width in pixels
+  int height = 0;  ///< Height in pixels
+
+  /**
+   * @brief Returns true if the rectangle covers no pixels
+   */
+  bool is_empty() const { return width <= 0 || height <= 0; }
+
+  /**
+   * @brief Returns the smallest rectangle containing both rectangles
+   *
+   * An empty rectangle does not contribute to the result.
+   */
+  Rect united(const Rect& other) const {
+    if (other.is_empty()) {
+      return *this;
+    }
+    if (is_empty()) {
+      return other;
+    }
+    const int left = x < other.x ? x : other.x;
+    const int top = y < other.y ? y : other.y;
+    const int right = x + width > other.x + other.width ? x + width
+                                                        : other.x + other.width;
+    const int bottom = y + height > other.y + other.height
+                           ? y + height
+                           : other.y + other.height;
+    return Rect{left, top, right - left, bottom - top};
+  }
+
+  /**
+   * @brief Returns the overlap of both rectangles (empty if disjoint)
+   */
+  Rect intersected(const Rect& other) const {
+    const int left = x > other.x ? x : other.x;
+    const int top = y > other.y ? y : other.y;
+    const int right = x + width < other.x + other.width ? x + width
+                                                        : other.x + other.width;
+    const int bottom = y + height < other.y + other.height
+                           ? y + height
+                           : other.y + other.height;
+    if (right <= left || bottom <= top) {
+      return Rect{};
+    }
+    return Rect{left, top, right - left, bottom - top};
+  }
+};
+
 /**
  * @brief Pixel format enumeration for image buffers
  *
  * Defines the supported pixel formats with their bit depths.
- * All formats currently use 8 bits per channel.
+ * All formats use 8 bits per channel except RGBA16Premul, Gray16 and
+ * Bitmap1.
+ *
+ * Bitmap1 packs eight pixels into each byte, leftmost in the high bit, as
+ * the original stored bitmap (halftoned) documents; a set bit is black.
+ * Indexed8 holds one palette index per pixel; the palette travels with the
+ * buffer's owner (see ps::dither::IndexedImage).
+ *
+ * The premultiplied formats are internal layer formats (see
+ * ImageDocument::set_layer_format()) that composite without dividing by
+ * alpha. Conversion to and from straight alpha happens only at the
+ * boundaries: flattening to channels, creating layers from channels, and
+ * file I/O.
  */
 enum class PixelFormat {
-  Gray8,   ///< 8-bit grayscale (1 byte per pixel)
-  RGB8,    ///< 8-bit RGB (3 bytes per pixel)
-  RGBA8,   ///< 8-bit RGBA (4 bytes per pixel)
-  CMYK8    ///< 8-bit CMYK (4 bytes per pixel)
+  Gray8,         ///< 8-bit grayscale (1 byte per pixel)
+  RGB8,          ///< 8-bit RGB (3 bytes per pixel)
+  RGBA8,         ///< 8-bit RGBA (4 bytes per pixel)
+  CMYK8,         ///< 8-bit CMYK (4 bytes per pixel)
+  RGBA8Premul,   ///< 8-bit RGBA, color premultiplied by alpha (4 bytes per pixel)
+  RGBA16Premul,  ///< 16-bit RGBA, color premultiplied by alpha, native-endian
+                 ///< (8 bytes per pixel)
+  Gray16,        ///< 16-bit grayscale, native-endian (2 bytes per pixel)
+  Bitmap1,       ///< 1-bit black and white, 8 pixels per byte
+  Indexed8       ///< 8-bit palette index (1 byte per pixel)
 };
 
 /**
  * @brief Returns the number of bytes per pixel for a given format
  * @param format The pixel format to query
- * @return Number of bytes per pixel (1, 3, or 4)
+ * @return Number of bytes per pixel (1, 2, 3, 4 or 8), or 0 for Bitmap1,
+ *         whose pixels are smaller than a byte (see row_bytes())
  */
 std::size_t bytes_per_pixel(PixelFormat format);
 
+/**
+ * @brief Returns the number of bytes holding @p width pixels of a format
+ *
+ * For Bitmap1 this rounds up to whole bytes; for every other format it is
+ * width × bytes_per_pixel().
+ */
+std::size_t row_bytes(PixelFormat format, int width);
+
+/**
+ * @brief Storage layout used by an ImageBuffer
+ */
+enum class StorageLayout {
+  Contiguous,  ///< One row-major block of memory for the whole image
+  Tiled        ///< Copy-on-write square tiles; empty tiles use no memory
+};
+
+/**
+ * @brief Whether newly allocated pixel storage is cleared
+ */
+enum class BufferInit {
+  Zero,          ///< Pixels start at zero
+  Uninitialized  ///< Contents are unspecified; the caller overwrites them
+};
+
 /**
  * @brief A buffer for storing pixel data in various formats
  *
- * ImageBuffer manages a contiguous block of memory for storing pixel data.
- * It supports multiple pixel formats (grayscale, RGB, RGBA, CMYK) and
- * handles memory allocation and resizing automatically.
+ * ImageBuffer manages the pixel storage for a channel or layer. It supports
+ * multiple pixel formats (grayscale, RGB, RGBA, CMYK) and two storage
+ * layouts:
  *
- * Memory layout is row-major: pixels are stored left-to-right, top-to-bottom.
- * For multi-channel formats, channels are interleaved (e.g., RGBRGBRGB...).
+ * - Contiguous: a single row-major block. Pixels are stored left-to-right,
+ *   top-to-bottom; multi-channel formats are interleaved (RGBRGBRGB...).
+ * - Tiled: the image is split into kTileSize × kTileSize tiles that are
+ *   allocated on first write and shared copy-on-write between copies of the
+ *   buffer. Copying a tiled buffer (e.g. for an undo snapshot) only copies
+ *   tile references; tiles are duplicated when one of the copies writes to
+ *   them. Tiles that were never written take no memory and read as zero.
+ *
+ * Contiguous storage is 64-byte aligned and recycled through BufferPool.
+ * Code that is about to overwrite every pixel (decoders, flatten, channel
+ * splits) can pass BufferInit::Uninitialized to skip clearing the memory.
+ *
+ * Code that needs to work with both layouts should walk rows in spans using
+ * pixel_row() / mutable_pixel_row() together with span_width(). data()
+ * remains available for either layout, but on a tiled buffer it is a slow
+ * path that flattens the tiles into one block.
+ *
+ * Different threads may write to different tiles (tiled layout) or rows
+ * (contiguous layout) of the same buffer concurrently, which is how the
+ * compositor fills document channels from the ThreadPool. Everything else,
+ * including data() and layout changes, needs external synchronization.
  *
  * Example usage:
  * @code
  *   ImageBuffer buffer(Size{640, 480}, PixelFormat::RGB8);
  *   std::uint8_t* pixels = buffer.data();
  *   // Access pixel at (x, y): pixels[(y * 640 + x) * 3]
+ *
+ *   ImageBuffer tiled(Size{8192, 8192}, PixelFormat::RGBA8,
+ *                     StorageLayout::Tiled);
+ *   for (int x = 0; x < 8192;) {
+ *     const int span = tiled.span_width(x);
+ *     std::uint8_t* row = tiled.mutable_pixel_row(x, 0);
+ *     // row[0 .. span * 4) is contiguous
+ *     x += span;
+ *   }
  * @endcode
  */
 class ImageBuffer {
  public:
+  /// Edge length in pixels of the tiles used by the tiled layout
+  static constexpr int kTileSize = 256;
+
   /**
    * @brief Constructs an empty buffer with zero size
    */
@@ -63,8 +196,26 @@ class ImageBuffer {
    * @brief Constructs a buffer with specified size and format
    * @param size Dimensions of the buffer
    * @param format Pixel format for the buffer
+   * @param layout Storage layout (contiguous by default)
+   * @param init Whether to zero the pixels (tiled buffers always read as
+   *             zero until written)
+   */
+  ImageBuffer(Size size, PixelFormat format,
+              StorageLayout layout = StorageLayout::Contiguous,
+              BufferInit init = BufferInit::Zero);
+
+  /**
+   * @brief Copies a buffer; tiled buffers share their tiles copy-on-write
+   */
+  ImageBuffer(const ImageBuffer& other);
+  ImageBuffer& operator=(const ImageBuffer& other);
+  ImageBuffer(ImageBuffer&& other) noexcept;
+  ImageBuffer& operator=(ImageBuffer&& other) noexcept;
+
+  /**
+   * @brief Returns contiguous storage to the BufferPool
    */
-  ImageBuffer(Size size, PixelFormat format);
+  ~ImageBuffer();
 
   /**
    * @brief Returns the dimensions of the buffer
@@ -78,36 +229,192 @@ class ImageBuffer {
    */
   PixelFormat format() const;
 
+  /**
+   * @brief Returns the storage layout of the buffer
+   */
+  StorageLayout layout() const { return layout_; }
+
+  /**
+   * @brief Returns true if the buffer uses tiled storage
+   */
+  bool is_tiled() const { return layout_ == StorageLayout::Tiled; }
+
+  /**
+   * @brief Converts the buffer to another storage layout
+   * @param layout Target layout; pixel data is preserved
+   *
+   * Converting to the tiled layout leaves all-zero tiles unallocated.
+   */
+  void set_layout(StorageLayout layout);
+
   /**
    * @brief Returns a mutable pointer to the pixel data
-   * @return Pointer to the first byte of pixel data
+   * @return Pointer to the first byte of contiguous pixel data
+   * @note On a tiled buffer this converts the buffer to the contiguous
+   *       layout first, which costs a full copy of the image.
    */
   std::uint8_t* data();
 
   /**
    * @brief Returns a const pointer to the pixel data
-   * @return Const pointer to the first byte of pixel data
+   * @return Const pointer to the first byte of contiguous pixel data
+   * @note On a tiled buffer this flattens the tiles into a cached block
+   *       that stays valid until the buffer is next modified.
    */
   const std::uint8_t* data() const;
 
   /**
-   * @brief Returns the total size of the buffer in bytes
-   * @return Size in bytes (width × height × bytes_per_pixel)
+   * @brief Returns the logical size of the image in bytes
+   * @return Size in bytes (row_bytes(format, width) × height)
    */
   std::size_t byte_size() const;
 
+  /**
+   * @brief Returns the number of bytes actually allocated for pixel data
+   *
+   * For tiled buffers only allocated tiles are counted, and a tile shared
+   * by several slots of this buffer is counted once.
+   */
+  std::size_t allocated_bytes() const;
+
   /**
    * @brief Resizes the buffer and changes its format
    * @param size New dimensions for the buffer
    * @param format New pixel format for the buffer
-   * @note Existing pixel data is discarded
+   * @param init Whether to zero the pixels of a contiguous buffer
+   * @note Existing pixel data is discarded; the layout is kept. Existing
+   *       storage is reused when it is large enough.
+   */
+  void resize(Size size, PixelFormat format, BufferInit init = BufferInit::Zero);
+
+  /**
+   * @brief Sets every byte of the buffer to a value
+   * @param value Byte value to store
+   *
+   * On a tiled buffer, filling with zero releases all tiles and filling with
+   * any other value shares a single tile between all tile slots.
+   */
+  void fill(std::uint8_t value);
+
+  /**
+   * @brief Returns the number of pixels starting at column x that are
+   *        contiguous in memory
+   *
+   * For contiguous buffers this is the rest of the row; for tiled buffers it
+   * extends to the next tile boundary or the right edge of the image.
+   */
+  int span_width(int x) const;
+
+  /**
+   * @brief Returns a read pointer to pixel (x, y)
+   *
+   * The returned pointer is valid for span_width(x) pixels. Unallocated
+   * tiles read as zero. Coordinates must be inside the buffer; in a
+   * Bitmap1 buffer, x must be a multiple of 8 here and in the other row
+   * accessors, which the tile edges always are.
+   */
+  const std::uint8_t* pixel_row(int x, int y) const;
+
+  /**
+   * @brief Returns a write pointer to pixel (x, y)
+   *
+   * The returned pointer is valid for span_width(x) pixels. On a tiled
+   * buffer the containing tile is allocated, or cloned if it is shared.
+   * Coordinates must be inside the buffer.
+   */
+  std::uint8_t* mutable_pixel_row(int x, int y);
+
+  /**
+   * @brief Copies a run of pixels from one row into caller memory
+   * @param x First column
+   * @param y Row
+   * @param count Number of pixels to copy
+   * @param dst Destination, at least row_bytes(format(), count) bytes
+   */
+  void read_pixels(int x, int y, int count, std::uint8_t* dst) const;
+
+  /**
+   * @brief Copies a run of pixels from caller memory into one row
+   * @param x First column
+   * @param y Row
+   * @param count Number of pixels to copy
+   * @param src Source, at least row_bytes(format(), count) bytes
+   *
+   * In a Bitmap1 buffer whole bytes are copied, so a run ending inside a
+   * byte also writes the rest of it.
    */
-  void resize(Size size, PixelFormat format);
+  void write_pixels(int x, int y, int count, const std::uint8_t* src);
+
+  /**
+   * @brief Returns the number of tile columns (tiled layout only)
+   */
+  int tile_columns() const { return tile_columns_; }
+
+  /**
+   * @brief Returns the number of tile rows (tiled layout only)
+   */
+  int tile_rows() const { return tile_rows_; }
+
+  /**
+   * @brief Returns the byte size of one tile for this buffer's format
+   */
+  std::size_t tile_byte_size() const;
+
+  /**
+   * @brief Returns the read-only data of a tile, or nullptr if unallocated
+   * @param tx Tile column
+   * @param ty Tile row
+   *
+   * Tile rows are kTileSize pixels apart, including tiles at the right and
+   * bottom edges that extend past the image.
+   */
+  const std::uint8_t* tile_data(int tx, int ty) const;
+
+  /**
+   * @brief Returns writable data of a tile, allocating or cloning it
+   * @param tx Tile column
+   * @param ty Tile row
+   */
+  std::uint8_t* mutable_tile_data(int tx, int ty);
+
+  /**
+   * @brief Returns a shared reference to a tile (tiled layout only)
+   * @param tx Tile column
+   * @param ty Tile row
+   * @return The tile, or nullptr if it is unallocated (all zero)
+   *
+   * Holding the reference keeps the current tile contents alive: the next
+   * write to this buffer clones the tile instead of modifying it in place.
+   */
+  std::shared_ptr<Tile> shared_tile(int tx, int ty) const;
+
+  /**
+   * @brief Exchanges a tile with the given reference (tiled layout only)
+   * @param tx Tile column
+   * @param ty Tile row
+   * @param tile Tile to install; receives the previous tile
+   */
+  void swap_tile(int tx, int ty, std::shared_ptr<Tile>& tile);
 
  private:
   Size size_{};
   PixelFormat format_ = PixelFormat::RGB8;
-  std::vector<std::uint8_t> pixels_{};
+  StorageLayout layout_ = StorageLayout::Contiguous;
+  PixelStorage pixels_{};
+
+  int tile_columns_ = 0;
+  int tile_rows_ = 0;
+  std::vector<std::shared_ptr<Tile>> tiles_{};
+
+  mutable PixelStorage flat_cache_{};
+  // Atomic so concurrent writers to different tiles can invalidate it
+  mutable std::atomic<bool> flat_cache_valid_{false};
+
+  // Bytes of a run of pixels, or of the offset to a column
+  std::size_t run_bytes(int pixels) const { return row_bytes(format_, pixels); }
+  std::shared_ptr<Tile>& writable_tile(int tx, int ty);
+  void update_tile_grid();
+  void flatten_into(std::uint8_t* dst) const;
 };
 
 }  // namespace ps::core
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+#include <deque>
 #include <memory>
 #include <string>
 #include <vector>
@@ -28,12 +30,30 @@ enum class ColorMode {
  * A channel is a named buffer of pixel data. In RGB mode, typical channels
  * are "Red", "Green", and "Blue". Additional channels can be added for
  * alpha masks or other purposes.
+ *
+ * Channels are planar: each one is a Gray8 buffer holding a single
+ * component, as in the original Photoshop. Files with 16-bit samples load
+ * into Gray16 channels, which the display and tools read at 8 bits.
  */
 struct ImageChannel {
   std::string name;   ///< Human-readable name of the channel
   ImageBuffer buffer; ///< Pixel data for this channel
 };
 
+/**
+ * @brief Every pixel of a document at some size
+ *
+ * Filled by whole-image operations that change the document's size, such
+ * as resizing, and exchanged with the document by
+ * ImageDocument::swap_pixels().
+ */
+struct DocumentPixels {
+  Size size{};
+  std::vector<ImageBuffer> channels;  ///< One per channel, in order
+  std::vector<ImageBuffer> layers;    ///< One per layer, bottom first
+  SelectionMask selection;
+};
+
 /**
  * @brief An image document with multiple channels
  *
@@ -48,9 +68,9 @@ struct ImageChannel {
  * Example usage:
  * @code
  *   ImageDocument doc(Size{800, 600}, ColorMode::RGB);
- *   doc.add_channel("Red", PixelFormat::RGB8);
- *   doc.add_channel("Green", PixelFormat::RGB8);
- *   doc.add_channel("Blue", PixelFormat::RGB8);
+ *   doc.add_channel("Red", PixelFormat::Gray8);
+ *   doc.add_channel("Green", PixelFormat::Gray8);
+ *   doc.add_channel("Blue", PixelFormat::Gray8);
  * @endcode
  */
 class ImageDocument {
@@ -74,6 +94,14 @@ class ImageDocument {
    */
   ColorMode mode() const;
 
+  /**
+   * @brief Changes the color mode without converting the channels
+   *
+   * For callers that replace the channels themselves; convert_mode()
+   * converts them. The whole image is marked dirty.
+   */
+  void set_mode(ColorMode mode);
+
   /**
    * @brief Returns a const reference to all channels
    * @return Vector of image channels
@@ -86,14 +114,61 @@ class ImageDocument {
    */
   std::vector<ImageChannel>& channels();
 
+  /**
+   * @brief Returns the storage layout used for new channels and layers
+   */
+  StorageLayout storage_layout() const { return storage_layout_; }
+
+  /**
+   * @brief Sets the storage layout for all channels and layers
+   * @param layout Layout to convert existing buffers to and to use for new ones
+   *
+   * The tiled layout makes undo snapshots and layer copies copy-on-write at
+   * tile granularity, which keeps large documents cheap to snapshot.
+   */
+  void set_storage_layout(StorageLayout layout);
+
+  /**
+   * @brief Returns the pixel format used for layers and the composite
+   */
+  PixelFormat layer_format() const { return layer_format_; }
+
+  /**
+   * @brief Sets the pixel format for all layers
+   * @param format RGBA8, RGBA8Premul or RGBA16Premul
+   * @throw std::invalid_argument if @p format is not an RGBA format
+   *
+   * Existing layers are converted and new layers are created in @p format.
+   * The premultiplied formats let the compositor blend the separable modes
+   * without dividing by alpha; RGBA16Premul also keeps the precision of
+   * deep layer stacks. Channels, file I/O and the display stay straight
+   * RGBA8 and convert at those boundaries.
+   */
+  void set_layer_format(PixelFormat format);
+
   /**
    * @brief Adds a new channel to the document
    * @param name Human-readable name for the channel
    * @param format Pixel format for the channel buffer
    * @return Reference to the newly created channel
+   *
+   * The document is marked dirty, so caches keyed on a channel's buffer
+   * do not mistake the new channel for a removed one.
    */
   ImageChannel& add_channel(const std::string& name, PixelFormat format);
 
+  /**
+   * @brief Adds a channel that takes over existing pixel data
+   * @param name Human-readable name for the channel
+   * @param buffer Pixels for the channel; converted to the document's layout
+   * @return Reference to the newly created channel
+   * @throw std::invalid_argument if the buffer size differs from the document
+   *
+   * Lets loaders decode straight into a buffer instead of filling a new
+   * zeroed channel and copying. The document is marked dirty.
+   */
+  ImageChannel& add_channel(const std::string& name, ImageBuffer buffer);
+
   /**
    * @brief Returns a mutable reference to a channel by index
    * @param index Zero-based index of the channel
@@ -199,6 +274,14 @@ class ImageDocument {
    *
    * This composites all visible layers and updates the channel buffers.
    * Useful for operations that work with the legacy channel-based system.
+   * In RGB mode the first three channels receive the red, green and blue
+   * planes as Gray8 buffers; other modes leave the channels untouched.
+   *
+   * The document is processed tile by tile on the ThreadPool, compositing
+   * the full layer stack for each tile while it is in cache. The result
+   * does not depend on the thread count. Layers are blended with the same
+   * kernels, opacity and blend modes as composite(), so the channels hold
+   * exactly its color. The channels are marked dirty.
    */
   void flatten_to_channels();
 
@@ -209,13 +292,145 @@ class ImageDocument {
    */
   void channels_to_layer(const std::string& name = "Background");
 
+  /**
+   * @brief Returns an independent copy of the document's pixels and layers
+   *
+   * Channels, layers and the selection are copied buffer by buffer, so a
+   * tiled document shares its tiles with the snapshot until either side
+   * writes to them. The snapshot starts with no damage history and an
+   * empty composite cache. A background save writes from a snapshot while
+   * editing continues on the original.
+   */
+  ImageDocument snapshot() const;
+
+  /**
+   * @brief Exchanges every channel, layer and selection pixel with @p pixels
+   * @param pixels Replacement pixels; receives the document's current ones
+   * @throws std::invalid_argument if the channel or layer counts differ, or
+   *         a buffer's size differs from pixels.size
+   *
+   * The document takes pixels.size, keeping its channel names, layer
+   * properties and active layer. The whole image is marked dirty and the
+   * composite rebuilt. Calling it again with the same object restores the
+   * previous state, which is how size-changing commands undo.
+   */
+  void swap_pixels(DocumentPixels& pixels);
+
+  /**
+   * @brief Records that pixels in an area have changed
+   * @param area Changed area; clipped to the document bounds
+   * @param layer Layer whose pixels changed, or nullptr for channel data
+   *
+   * Tools and commands call this after writing pixels. Each call advances
+   * damage_revision(); consumers such as the composite cache and texture
+   * uploaders remember the revision they last saw and ask damage_since()
+   * what to refresh.
+   */
+  void mark_dirty(const Rect& area, const Layer* layer = nullptr);
+
+  /**
+   * @brief Returns the current damage revision
+   */
+  std::uint64_t damage_revision() const { return damage_revision_; }
+
+  /**
+   * @brief Returns the bounding box of all damage after @p revision
+   * @param revision A value previously returned by damage_revision()
+   * @return Union of the areas marked since then; the whole document if the
+   *         damage log no longer reaches back that far
+   */
+  Rect damage_since(std::uint64_t revision) const;
+
+  /**
+   * @brief Returns whether damage after @p revision may have touched a layer
+   * @param revision A value previously returned by damage_revision()
+   * @param layer Layer to ask about, or nullptr for the channel data
+   *
+   * Damage marked without a layer counts for every layer. True whenever the
+   * damage log no longer reaches back to @p revision. Lets caches of one
+   * layer, such as histograms, survive edits to other layers.
+   */
+  bool damaged_since(std::uint64_t revision, const Layer* layer) const;
+
+  /**
+   * @brief Returns the composite of all visible layers
+   *
+   * The composite is stored in layer_format(), so it is premultiplied when
+   * the layers are.
+   *
+   * The result is cached. The layers below the active layer are kept
+   * composited separately, so damage on the active layer only re-blends
+   * the active layer and the layers above it, and only inside the damaged
+   * area. Layer property changes (Layer::revision()) and changes to the
+   * layer stack or the active layer rebuild the affected caches.
+   *
+   * Layer pixel edits must be reported with mark_dirty(); edits that are
+   * not reported need invalidate_composite().
+   *
+   * @return Composite of the document size; transparent if there are no
+   *         visible layers
+   */
+  const ImageBuffer& composite() const;
+
+  /**
+   * @brief Discards the cached composite so the next composite() rebuilds it
+   */
+  void invalidate_composite();
+
+  /**
+   * @brief Returns a value that changes whenever composite() rebuilds the
+   *        whole composite
+   *
+   * Consumers derived from the composite, such as mip levels, rebuild when
+   * this changes and otherwise refresh only damage_since() their last
+   * revision. Values are unique across documents. Call composite() first
+   * so the value is current.
+   */
+  std::uint64_t composite_generation() const { return composite_cache_.generation; }
+
  private:
+  /// Damage entries kept before older revisions report the whole document
+  static constexpr std::size_t kMaxDamageEntries = 256;
+
+  struct DamageEntry {
+    std::uint64_t revision = 0;
+    Rect area{};
+    const Layer* layer = nullptr;
+  };
+
+  struct LayerState {
+    const Layer* layer = nullptr;
+    std::uint64_t revision = 0;
+  };
+
+  // Cached composites for composite()
+  struct CompositeCache {
+    ImageBuffer below{Size{}, PixelFormat::RGBA8};  ///< Layers under the active one
+    ImageBuffer full{Size{}, PixelFormat::RGBA8};   ///< All visible layers
+    std::vector<LayerState> stack;  ///< Layer stack the caches were built from
+    int active_index = -1;
+    std::uint64_t revision = 0;     ///< Damage revision folded into the caches
+    std::uint64_t generation = 0;   ///< Changes on every full rebuild of full
+    bool valid = false;
+  };
+
+  void composite_region(ImageBuffer& dst, const ImageBuffer* base,
+                        std::size_t first_layer, std::size_t end_layer,
+                        const Rect& area) const;
+
   Size size_{};
   ColorMode mode_ = ColorMode::RGB;
+  StorageLayout storage_layout_ = StorageLayout::Contiguous;
+  PixelFormat layer_format_ = PixelFormat::RGBA8;
   std::vector<ImageChannel> channels_{};
   SelectionMask selection_{};
   std::vector<std::unique_ptr<Layer>> layers_{};
   int active_layer_index_ = -1;
+
+  std::uint64_t damage_revision_ = 0;
+  std::uint64_t damage_floor_ = 0;  ///< Newest revision dropped from the log
+  std::deque<DamageEntry> damage_log_{};
+  mutable CompositeCache composite_cache_{};
 };
 
 }  // namespace ps::core
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+
+#include "ps/core/image_buffer.h"
+
+namespace ps::core {
+
+/**
+ * @brief Compile-time description of a PixelFormat
+ *
+ * Sample is the type of one component and kComponents the number of
+ * components per pixel, so a pixel is kComponents consecutive Samples.
+ */
+template <PixelFormat Format>
+struct FormatTraits;
+
+template <>
+struct FormatTraits<PixelFormat::Gray8> {
+  using Sample = std::uint8_t;
+  static constexpr int kComponents = 1;
+};
+
+template <>
+struct FormatTraits<PixelFormat::RGB8> {
+  using Sample = std::uint8_t;
+  static constexpr int kComponents = 3;
+};
+
+template <>
+struct FormatTraits<PixelFormat::RGBA8> {
+  using Sample = std::uint8_t;
+  static constexpr int kComponents = 4;
+};
+
+template <>
+struct FormatTraits<PixelFormat::CMYK8> {
+  using Sample = std::uint8_t;
+  static constexpr int kComponents = 4;
+};
+
+template <>
+struct FormatTraits<PixelFormat::RGBA8Premul> {
+  using Sample = std::uint8_t;
+  static constexpr int kComponents = 4;
+};
+
+template <>
+struct FormatTraits<PixelFormat::RGBA16Premul> {
+  using Sample = std::uint16_t;
+  static constexpr int kComponents = 4;
+};
+
+template <>
+struct FormatTraits<PixelFormat::Gray16> {
+  using Sample = std::uint16_t;
+  static constexpr int kComponents = 1;
+};
+
+template <>
+struct FormatTraits<PixelFormat::Indexed8> {
+  using Sample = std::uint8_t;
+  static constexpr int kComponents = 1;
+};
+
+/// Tag passed to the callback of dispatch_format()
+template <PixelFormat Format>
+using FormatTag = std::integral_constant<PixelFormat, Format>;
+
+/**
+ * @brief Calls @p fn with the FormatTag of a runtime PixelFormat
+ *
+ * This is the one switch on the format; @p fn is a generic lambda that is
+ * instantiated once per format, so the loops inside it know the pixel
+ * layout at compile time. Bitmap1 has no whole-byte pixels to view and
+ * throws std::invalid_argument.
+ *
+ * Example usage:
+ * @code
+ *   dispatch_format(buffer.format(), [&](auto format) {
+ *     ImageView<decltype(format)::value> view(buffer);
+ *     // ...
+ *   });
+ * @endcode
+ */
+template <typename Fn>
+decltype(auto) dispatch_format(PixelFormat format, Fn&& fn) {
+  switch (format) {
+    case PixelFormat::Gray8:
+      return fn(FormatTag<PixelFormat::Gray8>{});
+    case PixelFormat::RGB8:
+      return fn(FormatTag<PixelFormat::RGB8>{});
+    case PixelFormat::RGBA8:
+      return fn(FormatTag<PixelFormat::RGBA8>{});
+    case PixelFormat::CMYK8:
+      return fn(FormatTag<PixelFormat::CMYK8>{});
+    case PixelFormat::RGBA8Premul:
+      return fn(FormatTag<PixelFormat::RGBA8Premul>{});
+    case PixelFormat::RGBA16Premul:
+      return fn(FormatTag<PixelFormat::RGBA16Premul>{});
+    case PixelFormat::Gray16:
+      return fn(FormatTag<PixelFormat::Gray16>{});
+    case PixelFormat::Indexed8:
+      return fn(FormatTag<PixelFormat::Indexed8>{});
+    case PixelFormat::Bitmap1:
+      break;
+  }
+  throw std::invalid_argument("dispatch_format: no per-pixel view of this pixel format");
+}
+
+/**
+ * @brief Typed view of a rectangle of an ImageBuffer
+ *
+ * Coordinates passed to the view are relative to its region of interest
+ * (ROI), and rows come back as typed Sample pointers, so code written
+ * against a view has no bytes_per_pixel() arithmetic or format switches in
+ * its loops. The view does not own the pixels; it must not outlive the
+ * buffer, and its format must match the buffer's.
+ *
+ * Contiguous buffers expose every ROI row as one run with a fixed
+ * stride(). Tiled buffers are only contiguous within a tile, so rows are
+ * walked as spans with for_each_span(), which works for both layouts.
+ * Views over a non-const buffer return mutable rows; on a tiled buffer
+ * these allocate or unshare the tiles they touch, as
+ * ImageBuffer::mutable_pixel_row() does.
+ *
+ * Example usage:
+ * @code
+ *   ImageView<PixelFormat::RGBA8> view(buffer, Rect{x, y, w, h});
+ *   for (int row = 0; row < view.height(); ++row) {
+ *     view.for_each_span(row, [&](int x, const std::uint8_t* pixels, int count) {
+ *       // pixels[0 .. count * 4) are columns x .. x + count of the ROI
+ *     });
+ *   }
+ * @endcode
+ */
+template <PixelFormat Format, typename Buffer = const ImageBuffer>
+class ImageView {
+  static_assert(std::is_same_v<std::remove_const_t<Buffer>, ImageBuffer>,
+                "ImageView wraps an ImageBuffer");
+
+ public:
+  using Traits = FormatTraits<Format>;
+  using Sample = std::conditional_t<std::is_const_v<Buffer>,
+                                    const typename Traits::Sample,
+                                    typename Traits::Sample>;
+
+  /// Components per pixel
+  static constexpr int kComponents = Traits::kComponents;
+
+  /**
+   * @brief Views the whole buffer
+   * @throw std::invalid_argument if the buffer has another format
+   */
+  explicit ImageView(Buffer& buffer)
+      : ImageView(buffer, Rect{0, 0, buffer.size().width, buffer.size().height}) {}
+
+  /**
+   * @brief Views a rectangle of the buffer, clipped to its bounds
+   * @throw std::invalid_argument if the buffer has another format
+   */
+  ImageView(Buffer& buffer, const Rect& roi)
+      : buffer_(&buffer),
+        roi_(roi.intersected(Rect{0, 0, buffer.size().width, buffer.size().height})) {
+    if (buffer.format() != Format) {
+      throw std::invalid_argument("ImageView: pixel format mismatch");
+    }
+    if (!buffer.is_tiled()) {
+      stride_ = static_cast<std::ptrdiff_t>(buffer.size().width) * kComponents;
+    }
+  }
+
+  /**
+   * @brief Returns the ROI in buffer coordinates
+   */
+  const Rect& roi() const { return roi_; }
+
+  int width() const { return roi_.width; }
+  int height() const { return roi_.height; }
+
+  /**
+   * @brief Returns true if every ROI row is one run in memory
+   */
+  bool contiguous() const { return stride_ != 0; }
+
+  /**
+   * @brief Returns the distance between rows in Samples (contiguous() only)
+   */
+  std::ptrdiff_t stride() const { return stride_; }
+
+  /**
+   * @brief Returns the first pixel of ROI row @p y (contiguous() only)
+   *
+   * Row y + 1 starts stride() Samples further.
+   */
+  Sample* row(int y) const { return pixel(0, y); }
+
+  /**
+   * @brief Returns ROI pixel (x, y)
+   *
+   * Valid for the rest of the row on contiguous buffers and up to the next
+   * tile boundary on tiled ones.
+   */
+  Sample* pixel(int x, int y) const {
+    return reinterpret_cast<Sample*>(fetch_row(roi_.x + x, roi_.y + y));
+  }
+
+  /**
+   * @brief Calls fn(x, pixels, count) for each contiguous run of ROI row @p y
+   *
+   * @p x is the ROI column of pixels[0]; the runs cover the row left to
+   * right. A contiguous buffer yields one run per row.
+   */
+  template <typename Fn>
+  void for_each_span(int y, Fn&& fn) const {
+    const int row_y = roi_.y + y;
+    const int right = roi_.x + roi_.width;
+    for (int x = roi_.x; x < right;) {
+      const int count = contiguous() ? right - x : std::min(right - x, buffer_->span_width(x));
+      fn(x - roi_.x, reinterpret_cast<Sample*>(fetch_row(x, row_y)), count);
+      x += count;
+    }
+  }
+
+ private:
+  auto fetch_row(int x, int y) const {
+    if constexpr (std::is_const_v<Buffer>) {
+      return buffer_->pixel_row(x, y);
+    } else {
+      return buffer_->mutable_pixel_row(x, y);
+    }
+  }
+
+  Buffer* buffer_;
+  Rect roi_;
+  std::ptrdiff_t stride_ = 0;  ///< 0 for tiled buffers
+};
+
+/// ImageView whose rows can be written
+template <PixelFormat Format>
+using MutableImageView = ImageView<Format, ImageBuffer>;
+
+/**
+ * @brief Converts a sample to 8 bits, keeping its most significant byte
+ */
+inline std::uint8_t to_byte(std::uint8_t sample) { return sample; }
+inline std::uint8_t to_byte(std::uint16_t sample) {
+  return static_cast<std::uint8_t>(sample >> 8);
+}
+
+}  // namespace ps::core
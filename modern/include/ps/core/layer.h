@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <memory>
 #include <string>
 
@@ -38,11 +39,19 @@ enum class BlendMode {
 class Layer {
  public:
   /**
-   * @brief Constructs a layer with specified size and name
+   * @brief Constructs a transparent layer with specified size and name
    * @param size Dimensions of the layer in pixels
    * @param name Human-readable name for the layer
+   * @param layout Storage layout for the layer's pixel buffer
+   * @param init Pass BufferInit::Uninitialized when every pixel is about to
+   *             be overwritten; the layer is then not transparent
+   * @param format RGBA8, RGBA8Premul or RGBA16Premul
+   * @throws std::invalid_argument if @p format is not an RGBA format
    */
-  explicit Layer(Size size, const std::string& name = "Layer");
+  explicit Layer(Size size, const std::string& name = "Layer",
+                 StorageLayout layout = StorageLayout::Contiguous,
+                 BufferInit init = BufferInit::Zero,
+                 PixelFormat format = PixelFormat::RGBA8);
 
   /**
    * @brief Returns the layer's name
@@ -62,7 +71,7 @@ class Layer {
   /**
    * @brief Sets the layer's visibility
    */
-  void set_visible(bool visible) { visible_ = visible; }
+  void set_visible(bool visible);
 
   /**
    * @brief Returns the layer's opacity (0-100)
@@ -82,17 +91,42 @@ class Layer {
   /**
    * @brief Sets the layer's blend mode
    */
-  void set_blend_mode(BlendMode mode) { blend_mode_ = mode; }
+  void set_blend_mode(BlendMode mode);
+
+  /**
+   * @brief Returns the revision of the layer's compositing properties
+   *
+   * Revisions are unique across all layers and change whenever visibility,
+   * opacity or blend mode is set, so a cached composite can detect
+   * property changes and replaced layers by comparing revisions. Pixel
+   * edits are reported separately through ImageDocument::mark_dirty().
+   */
+  std::uint64_t revision() const { return revision_; }
 
   /**
    * @brief Returns the layer's size
    */
   Size size() const { return size_; }
 
+  /**
+   * @brief Returns the pixel format of the layer's buffer
+   */
+  PixelFormat format() const { return buffer_.format(); }
+
+  /**
+   * @brief Converts the layer's pixels to another RGBA format
+   * @param format RGBA8, RGBA8Premul or RGBA16Premul
+   * @throws std::invalid_argument if @p format is not an RGBA format
+   *
+   * Converting to a premultiplied format and back is exact for opaque
+   * pixels; translucent 8-bit pixels may lose low color bits.
+   */
+  void set_format(PixelFormat format);
+
   /**
    * @brief Returns a const reference to the layer's image buffer
    *
-   * The buffer stores RGBA8 pixel data for the entire layer.
+   * The buffer stores pixel data for the entire layer in format().
    */
   const ImageBuffer& buffer() const { return buffer_; }
 
@@ -101,11 +135,22 @@ class Layer {
    */
   ImageBuffer& buffer() { return buffer_; }
 
+  /**
+   * @brief Exchanges the layer's pixels with another buffer
+   * @param buffer RGBA buffer of any size; receives the old pixels
+   * @throws std::invalid_argument if @p buffer is not in an RGBA format
+   *
+   * The layer takes the buffer's size. Changes revision(), since the
+   * layer's size may have changed.
+   */
+  void swap_buffer(ImageBuffer& buffer);
+
  private:
   std::string name_;
   bool visible_ = true;
   int opacity_ = 100;  // 0-100
   BlendMode blend_mode_ = BlendMode::Normal;
+  std::uint64_t revision_ = 0;
   Size size_;
   ImageBuffer buffer_;
 };
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace ps::core {
+
+/**
+ * @brief Compresses bytes with the PackBits run-length scheme
+ *
+ * PackBits is the RLE codec used by the original Photoshop for its file
+ * formats and by TIFF. Each packet starts with a signed header byte n:
+ * - 0..127: the next n + 1 bytes are copied literally
+ * - -1..-127: the next byte is repeated 1 - n times
+ * - -128: no-op
+ *
+ * Runs are emitted for three or more equal bytes; shorter repeats stay in
+ * literal packets. Worst-case output is input size + input size / 128 + 1.
+ *
+ * @param data Bytes to compress
+ * @param size Number of bytes
+ * @return Encoded stream
+ */
+std::vector<std::uint8_t> packbits_encode(const std::uint8_t* data, std::size_t size);
+
+/**
+ * @brief Appends PackBits-encoded bytes to an existing stream
+ * @param data Bytes to compress
+ * @param size Number of bytes
+ * @param out Stream to append to
+ */
+void packbits_encode(const std::uint8_t* data, std::size_t size,
+                     std::vector<std::uint8_t>& out);
+
+/**
+ * @brief Decompresses a PackBits stream into a buffer of known size
+ * @param src Encoded stream
+ * @param src_size Length of the encoded stream
+ * @param dst Destination buffer
+ * @param dst_size Expected number of decoded bytes
+ * @return Number of encoded bytes consumed, or 0 if the stream is truncated
+ *         or would overflow dst
+ */
+std::size_t packbits_decode(const std::uint8_t* src, std::size_t src_size,
+                            std::uint8_t* dst, std::size_t dst_size);
+
+}  // namespace ps::core
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+#include "ps/core/image_document.h"
+#include "ps/core/image_view.h"
+#include "ps/core/separation.h"
+
+namespace ps::core {
+
+/**
+ * @brief How a document's channels combine into color
+ */
+enum class ChannelLayout {
+  None,  ///< Too few channels for the mode; every pixel reads as black
+  Gray,  ///< One gray channel
+  RGB,   ///< Red, green and blue channels
+  RGBA,  ///< Red, green, blue and a fourth channel used as alpha
+  CMYK   ///< Cyan, magenta, yellow and black channels
+};
+
+/**
+ * @brief Returns how the channels of @p doc combine into color
+ */
+inline ChannelLayout channel_layout(const ImageDocument& doc) {
+  const std::size_t count = doc.channels().size();
+  switch (doc.mode()) {
+    case ColorMode::Grayscale:
+      return count >= 1 ? ChannelLayout::Gray : ChannelLayout::None;
+    case ColorMode::RGB:
+      return count >= 4 ? ChannelLayout::RGBA
+                        : count == 3 ? ChannelLayout::RGB : ChannelLayout::None;
+    case ColorMode::CMYK:
+      return count >= 4 ? ChannelLayout::CMYK : ChannelLayout::None;
+  }
+  return ChannelLayout::None;
+}
+
+/**
+ * @brief Reads a document's channels as color, with the layout known at
+ *        compile time
+ *
+ * read_planes() copies a run of each color channel into byte planes, one
+ * plane of @p count bytes after the other, taking the first component of
+ * each channel pixel. rgb() and alpha() then turn plane values into color
+ * with no switch on the mode, so loops over them are instantiated (and
+ * vectorized) per layout. Callers pick the instantiation once with
+ * dispatch_channels().
+ *
+ * CMYK converts through the SeparationTables of the current
+ * separation_setup(), fetched once when the accessor is made, so display
+ * and sampling are table lookups.
+ *
+ * Example usage:
+ * @code
+ *   dispatch_channels(doc, [&](const auto& pixels) {
+ *     pixels.read_planes(y, x0, count, planes);
+ *     for (int i = 0; i < count; ++i) {
+ *       int r, g, b;
+ *       pixels.rgb(planes, count, i, r, g, b);
+ *     }
+ *   });
+ * @endcode
+ */
+template <ChannelLayout Layout>
+class PixelAccessor {
+ public:
+  /// Planes read_planes() fills
+  static constexpr int kPlanes = Layout == ChannelLayout::None   ? 0
+                                 : Layout == ChannelLayout::Gray ? 1
+                                 : Layout == ChannelLayout::RGB  ? 3
+                                                                 : 4;
+
+  /**
+   * @brief Accesses the channels of @p doc, which must have this layout
+   */
+  explicit PixelAccessor(const ImageDocument& doc)
+      : PixelAccessor(doc, Layout == ChannelLayout::CMYK
+                               ? separation_tables(separation_setup())
+                               : nullptr) {}
+
+  /**
+   * @brief Accesses the channels of @p doc, converting CMYK through @p tables
+   */
+  PixelAccessor(const ImageDocument& doc, std::shared_ptr<const SeparationTables> tables)
+      : separation_(std::move(tables)) {
+    const auto& channels = doc.channels();
+    for (int c = 0; c < kPlanes; ++c) {
+      buffers_[c] = &channels[static_cast<std::size_t>(c)].buffer;
+    }
+  }
+
+  /**
+   * @brief Copies @p count pixels of row @p y from column @p x0 into planes
+   * @param planes At least kPlanes * count bytes; plane c starts at
+   *               planes + c * count
+   */
+  void read_planes(int y, int x0, int count, std::uint8_t* planes) const {
+    for (int c = 0; c < kPlanes; ++c) {
+      const ImageBuffer& buffer = *buffers_[c];
+      std::uint8_t* plane = planes + static_cast<std::size_t>(c) * count;
+      dispatch_format(buffer.format(), [&](auto format) {
+        using View = ImageView<decltype(format)::value>;
+        const View view(buffer, Rect{x0, y, count, 1});
+        view.for_each_span(0, [&](int x, const typename View::Sample* pixels, int n) {
+          if constexpr (View::kComponents == 1 &&
+                        sizeof(typename View::Sample) == 1) {
+            std::memcpy(plane + x, pixels, static_cast<std::size_t>(n));
+          } else {
+            for (int i = 0; i < n; ++i) {
+              plane[x + i] = to_byte(pixels[static_cast<std::size_t>(i) * View::kComponents]);
+            }
+          }
+        });
+      });
+    }
+  }
+
+  /**
+   * @brief Returns the color of pixel @p i of planes filled by read_planes()
+   * @param count The count passed to read_planes()
+   */
+  void rgb(const std::uint8_t* planes, std::size_t count, std::size_t i,
+           int& r, int& g, int& b) const {
+    if constexpr (Layout == ChannelLayout::None) {
+      r = g = b = 0;
+    } else if constexpr (Layout == ChannelLayout::Gray) {
+      r = g = b = planes[i];
+    } else if constexpr (Layout == ChannelLayout::CMYK) {
+      separation_->cmyk_to_rgb(planes[i], planes[count + i], planes[2 * count + i],
+                               planes[3 * count + i], r, g, b);
+    } else {
+      r = planes[i];
+      g = planes[count + i];
+      b = planes[2 * count + i];
+    }
+  }
+
+  /**
+   * @brief Returns the alpha of pixel @p i; 255 unless the layout is RGBA
+   */
+  static int alpha(const std::uint8_t* planes, std::size_t count, std::size_t i) {
+    if constexpr (Layout == ChannelLayout::RGBA) {
+      return planes[3 * count + i];
+    } else {
+      return 255;
+    }
+  }
+
+  /**
+   * @brief Converts planes filled by read_planes() to interleaved RGBA
+   * @param rgba At least 4 * count bytes
+   */
+  void to_rgba(const std::uint8_t* planes, int count, std::uint8_t* rgba) const {
+    const std::size_t n = static_cast<std::size_t>(count);
+    if constexpr (Layout == ChannelLayout::CMYK) {
+      separation_->cmyk_to_rgba(planes, planes + n, planes + 2 * n, planes + 3 * n, rgba,
+                                count);
+      return;
+    }
+    for (std::size_t i = 0; i < n; ++i, rgba += 4) {
+      int r, g, b;
+      rgb(planes, n, i, r, g, b);
+      rgba[0] = static_cast<std::uint8_t>(r);
+      rgba[1] = static_cast<std::uint8_t>(g);
+      rgba[2] = static_cast<std::uint8_t>(b);
+      rgba[3] = static_cast<std::uint8_t>(alpha(planes, n, i));
+    }
+  }
+
+ private:
+  const ImageBuffer* buffers_[4] = {};
+  std::shared_ptr<const SeparationTables> separation_;  ///< CMYK only
+};
+
+/**
+ * @brief Calls @p fn with the PixelAccessor matching the channels of @p doc
+ *
+ * The one switch on the color mode; @p fn is a generic lambda instantiated
+ * once per ChannelLayout. Dispatch outside the row loop, not per pixel.
+ */
+template <typename Fn>
+decltype(auto) dispatch_channels(const ImageDocument& doc, Fn&& fn) {
+  switch (channel_layout(doc)) {
+    case ChannelLayout::None:
+      return fn(PixelAccessor<ChannelLayout::None>(doc));
+    case ChannelLayout::Gray:
+      return fn(PixelAccessor<ChannelLayout::Gray>(doc));
+    case ChannelLayout::RGB:
+      return fn(PixelAccessor<ChannelLayout::RGB>(doc));
+    case ChannelLayout::RGBA:
+      return fn(PixelAccessor<ChannelLayout::RGBA>(doc));
+    case ChannelLayout::CMYK:
+      return fn(PixelAccessor<ChannelLayout::CMYK>(doc));
+  }
+  throw std::invalid_argument("dispatch_channels: unknown channel layout");
+}
+
+}  // namespace ps::core
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+
+#include "ps/core/image_buffer.h"
+
+namespace ps::core {
+
+/**
+ * @brief Returns true for the RGBA formats layers can be stored in
+ *
+ * These are RGBA8 (straight alpha), RGBA8Premul and RGBA16Premul.
+ */
+bool is_rgba_format(PixelFormat format);
+
+/**
+ * @brief Returns true for the premultiplied-alpha formats
+ */
+bool is_premultiplied(PixelFormat format);
+
+/**
+ * @brief Converts a run of RGBA pixels between layer formats
+ *
+ * Straight-to-premultiplied conversion rounds to nearest. Converting back
+ * divides by alpha and is exact for opaque pixels; pixels with zero alpha
+ * become transparent black.
+ *
+ * @param src Source pixels in @p src_format
+ * @param src_format Source format (see is_rgba_format())
+ * @param dst Destination pixels in @p dst_format; may equal @p src when
+ *            both formats have the same size
+ * @param dst_format Destination format (see is_rgba_format())
+ * @param count Number of pixels
+ * @throws std::invalid_argument if either format is not an RGBA format
+ */
+void convert_rgba_span(const std::uint8_t* src, PixelFormat src_format,
+                       std::uint8_t* dst, PixelFormat dst_format, int count);
+
+/**
+ * @brief Returns a copy of an RGBA buffer converted to another layer format
+ * @param src Source buffer (see is_rgba_format())
+ * @param format Destination format (see is_rgba_format())
+ * @return Buffer with the same size and layout as @p src
+ * @throws std::invalid_argument if either format is not an RGBA format
+ */
+ImageBuffer convert_rgba_buffer(const ImageBuffer& src, PixelFormat format);
+
+}  // namespace ps::core
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "ps/core/command.h"
+#include "ps/core/image_buffer.h"
+#include "ps/core/image_document.h"
+
+namespace ps::core {
+
+/**
+ * @brief Reconstruction filters for resampling
+ */
+enum class ResampleFilter {
+  Nearest,   ///< Nearest source pixel (the original's "sample" mode)
+  Box,       ///< Area average when reducing
+  Bilinear,  ///< Triangle filter (the original's "interpolate" mode)
+  Bicubic,   ///< Keys cubic with a = -0.5
+  Lanczos3,  ///< Windowed sinc over three lobes
+};
+
+/**
+ * @brief Precomputed weights for resampling one axis (port of TResizeTable)
+ *
+ * Target pixel i is the weighted sum of source pixels
+ * first(i) .. first(i) + taps() - 1 with weights(i). When reducing, the
+ * filter is stretched by the reduction so it averages every source pixel
+ * it covers. Taps past the source edges fold onto the edge pixels, so the
+ * range always lies inside the source and the weights sum to one. Every
+ * target pixel has the same number of taps (unused ones weigh zero), which
+ * keeps the passes branch-free.
+ */
+class ResampleTable {
+ public:
+  /**
+   * @brief Builds the table that maps source_size pixels onto target_size
+   * @throws std::invalid_argument if either size is less than 1
+   */
+  ResampleTable(int source_size, int target_size, ResampleFilter filter);
+
+  /**
+   * @brief Builds a table with an explicit scale
+   * @param scale Target pixels per source pixel
+   *
+   * For mappings whose sizes are rounded, such as MipPyramid's levels of
+   * ceil(size / 2) pixels, which reduce by exactly 0.5.
+   */
+  ResampleTable(int source_size, int target_size, ResampleFilter filter, double scale);
+
+  int source_size() const { return source_size_; }
+  int target_size() const { return static_cast<int>(first_.size()); }
+  int taps() const { return taps_; }
+  int first(int index) const { return first_[static_cast<std::size_t>(index)]; }
+  const float* weights(int index) const {
+    return weights_.data() + static_cast<std::size_t>(index) * taps_;
+  }
+
+ private:
+  int source_size_ = 0;
+  int taps_ = 0;
+  std::vector<int> first_;
+  std::vector<float> weights_;
+};
+
+/**
+ * @brief Supplies source pixels to resample() in the target's format
+ *
+ * Called as reader(x, y, count, out) from several threads at once.
+ */
+using ResampleReader = std::function<void(int x, int y, int count, std::uint8_t* out)>;
+
+/**
+ * @brief Resamples part of a buffer into another
+ * @param source Buffer being resampled; its size must match the tables
+ * @param target Receives the pixels inside @p area
+ * @param columns Horizontal table, source width onto target width
+ * @param rows Vertical table, source height onto target height
+ * @param area Target pixels to compute; clipped to the target
+ * @param reader Reads source pixels converted to the target's format, or
+ *               empty to read the source directly
+ * @throws std::invalid_argument if the tables do not match the buffers, or
+ *         the formats differ and there is no reader
+ *
+ * Bands of target rows run on the ThreadPool. Each band resamples the
+ * source rows it needs horizontally into float rows, then combines them
+ * vertically with one multiply-add per tap over whole rows; the row loops
+ * vectorize. Results are rounded to the nearest value and clamped. Works
+ * on every PixelFormat; premultiplied formats should be resampled as such.
+ */
+void resample(const ImageBuffer& source, ImageBuffer& target, const ResampleTable& columns,
+              const ResampleTable& rows, const Rect& area, const ResampleReader& reader = {});
+
+/**
+ * @brief Returns a resampled copy of a buffer in the same format and layout
+ * @throws std::invalid_argument if @p size is empty
+ */
+ImageBuffer resized(const ImageBuffer& source, Size size, ResampleFilter filter);
+
+/**
+ * @brief Resamples every channel, layer and the selection of a document
+ *
+ * Port of TResizeCommand. RGBA8 layers are premultiplied while they are
+ * resampled, so transparent pixels do not bleed their color into visible
+ * ones. The selection is resampled as a gray image. The resampled pixels
+ * are computed once; undo and redo exchange them with the document's
+ * through ImageDocument::swap_pixels().
+ */
+class ResizeCommand : public Command {
+ public:
+  /**
+   * @throws std::invalid_argument if @p size is empty
+   */
+  ResizeCommand(ImageDocument& doc, Size size, ResampleFilter filter = ResampleFilter::Bicubic);
+  ~ResizeCommand() override = default;
+
+  void execute() override;
+  void undo() override;
+  void redo() override;
+  std::string name() const override { return "Resize"; }
+  std::size_t memory_footprint() const override;
+
+ private:
+  ImageDocument& document_;
+  Size size_;
+  ResampleFilter filter_;
+  bool resampled_ = false;
+  DocumentPixels pixels_;  ///< The pixels not currently in the document
+};
+
+}  // namespace ps::core
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
+#include <vector>
 
 #include "ps/core/command.h"
 #include "ps/core/selection_mask.h"
@@ -9,23 +11,50 @@ namespace ps::core {
 
 /**
  * @brief Command that captures selection mask changes for undo/redo
+ *
+ * The command keeps the rectangle in which the masks differ and the XOR of
+ * the two masks over it, PackBits-compressed row by row. Undo and redo XOR
+ * it into the document selection. Masks that store no pixels (empty,
+ * all-selected, or a single rectangle; see SelectionMask) are kept as
+ * copies instead and restored by assignment, which keeps the document mask
+ * compact too.
  */
 class SelectionCommand : public Command {
  public:
+  /**
+   * @brief Records the change from @p before to @p after
+   * @param doc Document whose selection changes
+   * @param before Selection before the change
+   * @param after Selection after the change
+   * @param label Name shown in the undo history
+   *
+   * The document selection may hold either mask. execute() only changes it
+   * if it does not already hold @p after, so tools that modified the
+   * selection themselves can push the command as well.
+   */
   SelectionCommand(ImageDocument& doc,
-                   SelectionMask before,
-                   SelectionMask after,
+                   const SelectionMask& before,
+                   const SelectionMask& after,
                    std::string label);
   ~SelectionCommand() override = default;
 
   void execute() override;
   void undo() override;
   std::string name() const override { return label_; }
+  std::size_t memory_footprint() const override;
 
  private:
+  // XORs the difference into the document selection
+  void toggle();
+
   ImageDocument& document_;
-  SelectionMask before_;
-  SelectionMask after_;
+  Rect area_{};                      ///< Where before and after differ
+  std::vector<std::uint8_t> xor_{};  ///< PackBits rows of before ^ after
+  SelectionMask before_{};           ///< Set if before stores no pixels
+  SelectionMask after_{};            ///< Set if after stores no pixels
+  bool keep_before_ = false;
+  bool keep_after_ = false;
+  bool applied_ = false;             ///< The document holds after
   std::string label_;
 };
 
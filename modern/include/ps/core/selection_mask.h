@@ -1,20 +1,49 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <vector>
 
 #include "ps/core/image_buffer.h"
 
 namespace ps::core {
 
+/**
+ * @brief Falloff of SelectionMask::feather()
+ */
+enum class FeatherShape {
+  Box,      ///< Average over a (2r+1) x (2r+1) square
+  Gaussian  ///< Gaussian blur with the variance of that square
+};
+
 /**
  * @brief Alpha mask describing the current selection
  *
  * SelectionMask stores per-pixel selection strength (0-255) for the document.
  * Values greater than zero are considered selected.
+ *
+ * Only a rectangular extent of the mask is stored; every pixel outside it
+ * has the same value. A rectangle filled into an empty mask is stored as
+ * its extent and value alone, so marquee drags, inversion and per-pixel
+ * queries cost no more than the selected region. Copies share the stored
+ * pixels until one of them is modified, which keeps undo snapshots
+ * (SelectionCommand) cheap.
+ *
+ * The bounding box and outline of the selected pixels are computed on
+ * first use after a modification and cached until the next one.
  */
 class SelectionMask {
  public:
+  /**
+   * @brief Horizontal run of outline pixels, columns [x0, x1) of row y
+   */
+  struct OutlineRun {
+    int y = 0;
+    int x0 = 0;
+    int x1 = 0;
+  };
+
   SelectionMask() = default;
   explicit SelectionMask(Size size);
 
@@ -55,10 +84,70 @@ class SelectionMask {
    */
   bool is_selected(int x, int y) const { return at(x, y) > 0; }
 
+  /**
+   * @brief Copies the values of part of a row
+   * @param x First column; columns outside the mask read as 0
+   * @param y Row; rows outside the mask read as 0
+   * @param width Number of values to copy
+   * @param out Receives @p width values
+   */
+  void read_row(int x, int y, int width, std::uint8_t* out) const;
+
+  /**
+   * @brief Overwrites the values of part of a row
+   * @param x First column; columns outside the mask are skipped
+   * @param y Row; nothing is written for rows outside the mask
+   * @param width Number of values
+   * @param values @p width new values
+   */
+  void write_row(int x, int y, int width, const std::uint8_t* values);
+
+  /**
+   * @brief Returns the smallest rectangle containing every pixel whose value
+   *        differs from @p other
+   * @param other Mask of the same size
+   * @return Empty rect if the masks are equal
+   *
+   * Only the stored parts of the masks are compared, and copies that still
+   * share their pixels compare in constant time.
+   */
+  Rect difference_bounds(const SelectionMask& other) const;
+
+  /**
+   * @brief Returns the number of bytes of stored mask pixels
+   *
+   * Copies that still share their pixels each report them.
+   */
+  std::size_t memory_footprint() const;
+
+  /**
+   * @brief Returns a value that changes whenever the mask is modified
+   *
+   * Revisions are unique across masks and are copied with the mask, so two
+   * masks with the same revision hold the same selection. Display code
+   * compares revisions to skip redrawing an unchanged selection.
+   */
+  std::uint64_t revision() const { return revision_; }
+
   /**
    * @brief Returns true if any pixel is selected
    */
-  bool has_selection() const;
+  bool has_selection() const { return !bounds().is_empty(); }
+
+  /**
+   * @brief Returns the smallest rectangle containing every selected pixel
+   * @return Empty rect if nothing is selected
+   */
+  Rect bounds() const;
+
+  /**
+   * @brief Returns the selection outline as runs sorted by row, then column
+   *
+   * Outline pixels are selected pixels with an unselected 4-neighbour;
+   * pixels outside the mask count as unselected. These are the pixels the
+   * marching ants are drawn on.
+   */
+  const std::vector<OutlineRun>& outline() const;
 
   /**
    * @brief Fills a rectangular region with the given value
@@ -77,29 +166,71 @@ class SelectionMask {
 
   /**
    * @brief Softens selection edges by applying a blur radius
+   * @param radius Blur radius in pixels
+   * @param shape Box average or Gaussian falloff
+   *
+   * Runs in time independent of the radius.
    */
-  void feather(int radius);
+  void feather(int radius, FeatherShape shape = FeatherShape::Box);
 
   /**
    * @brief Expands the selection outward by the given radius
+   *
+   * Selects every pixel within Euclidean distance @p radius of a selected
+   * pixel, in time independent of the radius.
    */
   void grow(int radius);
 
   /**
    * @brief Contracts the selection inward by the given radius
+   *
+   * Keeps the selected pixels farther than @p radius from any unselected
+   * pixel, in time independent of the radius.
    */
   void shrink(int radius);
 
  private:
   Size size_{};
-  std::vector<std::uint8_t> mask_{};
-
-  int index_for(int x, int y) const { return y * size_.width + x; }
-  std::uint8_t at_unchecked(int x, int y) const {
-    return mask_[index_for(x, y)];
-  }
-  void set_unchecked(int x, int y, std::uint8_t value) {
-    mask_[index_for(x, y)] = value;
+  // Pixels outside extent_ have the value outside_. Inside it they are
+  // stored row by row in pixels_, or all equal solid_ while pixels_ is
+  // null. pixels_ is shared between copies until one is modified.
+  Rect extent_{};
+  std::uint8_t outside_ = 0;
+  std::uint8_t solid_ = 0;
+  std::shared_ptr<std::vector<std::uint8_t>> pixels_{};
+  std::uint64_t revision_ = 0;
+
+  // Bounds and outline derived from extent_, outside_/solid_ and the shared
+  // pixels_, valid while the cached revision equals revision_
+  mutable Rect bounds_{};
+  mutable std::uint64_t bounds_revision_ = 0;
+  mutable std::vector<OutlineRun> outline_{};
+  mutable std::uint64_t outline_revision_ = 0;
+
+  // Grows extent_ to cover area, filling new pixels with outside_. With
+  // pad, sides that move grow further to make repeated growth cheap.
+  void include(const Rect& area, bool pad);
+
+  // Makes pixels_ stored and unshared; returns its data
+  std::uint8_t* writable_pixels();
+
+  // Stores every pixel an operation reaching margin pixels may change;
+  // returns false if none is stored (the mask is uniform)
+  bool store_neighbourhood(int margin);
+
+  // Run on the stored pixels, which must cover everything they change
+  void feather_box(int radius);
+  void feather_gaussian(int radius);
+
+  // Sets each pixel to 255 where select(value, squared distance to the
+  // nearest selected or unselected pixel) holds and to 0 elsewhere
+  template <typename Select>
+  void threshold_distance(bool to_selected, Select select);
+
+  // Index into pixels_ of a pixel inside extent_
+  std::size_t index_for(int x, int y) const {
+    return static_cast<std::size_t>(y - extent_.y) * static_cast<std::size_t>(extent_.width) +
+           static_cast<std::size_t>(x - extent_.x);
   }
 };
 
@@ -0,0 +1,283 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ps/core/command.h"
+#include "ps/core/image_document.h"
+
+namespace ps::core {
+
+/**
+ * @brief How much of the gray component black ink replaces (the original's
+ *        Black Generation menu)
+ */
+enum class BlackGeneration {
+  None,     ///< Cyan, magenta and yellow only
+  Light,    ///< Black from 40% gray up
+  Medium,   ///< Black from 20% gray up
+  Heavy,    ///< Black from 10% gray up
+  Maximum,  ///< Every gray component is printed with black
+};
+
+/**
+ * @brief Parameters of RGB to CMYK separation (the original's
+ *        TSeparationSetup)
+ *
+ * Inks are modelled as ideal process colors: each of cyan, magenta and
+ * yellow absorbs one of red, green and blue, and black absorbs all three.
+ * Dot gain darkens mid-tones as presses do. Without dot gain, inks display
+ * as r = (255 - c) × (255 - k) / 255, rounded, as they did before.
+ */
+struct SeparationSetup {
+  /// Percent a 50% dot gains on press, -25..25
+  int dot_gain = 0;
+  BlackGeneration black_generation = BlackGeneration::Medium;
+  /// Largest black ink, percent
+  int black_ink_limit = 100;
+  /// Largest sum of the four inks, percent (the original's Ink Maximum),
+  /// 200..400
+  int total_ink_limit = 300;
+  /// Percent of the removed colors added back in the shadows (UCA), 0..100
+  int undercolor_addition = 0;
+
+  bool operator==(const SeparationSetup& other) const;
+  bool operator!=(const SeparationSetup& other) const { return !(*this == other); }
+};
+
+/**
+ * @brief Separates one color by evaluating the ink model directly (port of
+ *        SolveForCMYK)
+ * @throws std::invalid_argument if a setup parameter is out of range
+ *
+ * Black replaces the gray component according to the black generation,
+ * cyan, magenta and yellow are solved for what remains and undercolor is
+ * added back in the shadows. Over the total ink limit, more of the gray
+ * component moves into black, which keeps the color; only past the black
+ * limit do the colored inks give way. Slow; SeparationTables samples it.
+ */
+void solve_cmyk(const SeparationSetup& setup, int r, int g, int b, int& c, int& m, int& y,
+                int& k);
+
+/**
+ * @brief Returns the displayed color of inks by evaluating the ink model
+ *        directly (port of SolveForRGB)
+ * @throws std::invalid_argument if a setup parameter is out of range
+ */
+void solve_rgb(const SeparationSetup& setup, int c, int m, int y, int k, int& r, int& g,
+               int& b);
+
+/**
+ * @brief Lookup tables sampling the ink model of one SeparationSetup
+ *
+ * RGB to CMYK uses a 3D grid of kGridNodes nodes per axis of 8.8
+ * fixed-point values, interpolated within the tetrahedron around a color,
+ * which is exact at the nodes and reads four nodes. The grid is built on
+ * the ThreadPool.
+ *
+ * CMYK to RGB, which display runs for every visible pixel, needs no grid:
+ * each displayed primary depends only on its own ink and black, so one
+ * 256 × 256 table of ink × black levels holds the model's result for
+ * every pair and a pixel costs three byte loads.
+ *
+ * Immutable and thread safe once built; get them from separation_tables(),
+ * which keeps them per setup.
+ */
+class SeparationTables {
+ public:
+  /// Nodes per axis
+  static constexpr int kGridNodes = 17;
+
+  /**
+   * @throws std::invalid_argument if a setup parameter is out of range
+   */
+  explicit SeparationTables(const SeparationSetup& setup);
+
+  const SeparationSetup& setup() const { return setup_; }
+
+  /**
+   * @brief Separates one color
+   */
+  void rgb_to_cmyk(int r, int g, int b, int& c, int& m, int& y, int& k) const {
+    Corner corner[3];
+    find_corner(r, corner[0], kGridNodes * kGridNodes);
+    find_corner(g, corner[1], kGridNodes);
+    find_corner(b, corner[2], 1);
+    int out[4];
+    interpolate<3, 4>(to_cmyk_.data(), corner, out);
+    c = out[0];
+    m = out[1];
+    y = out[2];
+    k = out[3];
+  }
+
+  /**
+   * @brief Returns the displayed color of inks, exactly as solve_rgb()
+   */
+  void cmyk_to_rgb(int c, int m, int y, int k, int& r, int& g, int& b) const {
+    const std::uint8_t* row = shade_row(k);
+    r = row[c];
+    g = row[m];
+    b = row[y];
+  }
+
+  /**
+   * @brief Separates @p count pixels of red, green and blue planes into
+   *        cyan, magenta, yellow and black planes
+   */
+  void rgb_to_cmyk(const std::uint8_t* r, const std::uint8_t* g, const std::uint8_t* b,
+                   std::uint8_t* c, std::uint8_t* m, std::uint8_t* y, std::uint8_t* k,
+                   int count) const;
+
+  /**
+   * @brief Converts @p count pixels of ink planes to opaque interleaved RGBA
+   * @param rgba At least 4 * count bytes
+   */
+  void cmyk_to_rgba(const std::uint8_t* c, const std::uint8_t* m, const std::uint8_t* y,
+                    const std::uint8_t* k, std::uint8_t* rgba, int count) const;
+
+ private:
+  // One axis of the cell around a value: the offset of its lower node and
+  // the weight of the upper one, 0..255
+  struct Corner {
+    int offset;
+    int weight;
+    int stride;
+  };
+
+  static void find_corner(int value, Corner& corner, int stride) {
+    // Nodes are 255 / 16 apart; the last node falls into the last cell at
+    // full weight
+    const int position = value * (kGridNodes - 1);
+    int cell = position / 255;
+    int weight = position - cell * 255;
+    if (cell == kGridNodes - 1) {
+      cell -= 1;
+      weight = 255;
+    }
+    corner.offset = cell * stride;
+    corner.weight = weight;
+    corner.stride = stride;
+  }
+
+  // Walks from the cell's lower node along the axes in order of falling
+  // weight; the Dims + 1 nodes visited span the simplex holding the value.
+  // The order is found by ranking rather than sorting, which has no
+  // branches to mispredict on noisy images.
+  template <int Dims, int Outputs>
+  static void interpolate(const std::uint16_t* nodes, const Corner* corner, int* out) {
+    int index = 0;
+    int weight[Dims + 1];
+    int stride[Dims];
+    for (int i = 0; i < Dims; ++i) {
+      index += corner[i].offset;
+      int rank = 0;
+      for (int j = 0; j < Dims; ++j) {
+        rank += (corner[j].weight > corner[i].weight) |
+                ((corner[j].weight == corner[i].weight) & (j < i));
+      }
+      weight[rank] = corner[i].weight;
+      stride[rank] = corner[i].stride;
+    }
+    weight[Dims] = 0;
+    int sum[Outputs] = {};
+    int upper = 255;
+    for (int d = 0; d <= Dims; ++d) {
+      const int share = upper - weight[d];
+      const std::uint16_t* node = nodes + static_cast<std::size_t>(index) * Outputs;
+      for (int o = 0; o < Outputs; ++o) {
+        sum[o] += share * node[o];
+      }
+      if (d < Dims) {
+        index += stride[d];
+      }
+      upper = weight[d];
+    }
+    for (int o = 0; o < Outputs; ++o) {
+      // Nodes are 8.8 fixed point and the shares sum to 255
+      out[o] = (sum[o] + 255 * 128) / (255 * 256);
+    }
+  }
+
+  const std::uint8_t* shade_row(int k) const {
+    return shades_.data() + static_cast<std::size_t>(k) * 256;
+  }
+
+  SeparationSetup setup_;
+  std::vector<std::uint16_t> to_cmyk_;  ///< 4 values per RGB node
+  std::vector<std::uint8_t> shades_;    ///< Displayed level, [black][ink]
+};
+
+/**
+ * @brief Returns the tables of a setup, building them on first use
+ * @throws std::invalid_argument if a setup parameter is out of range
+ *
+ * The tables of the last few setups are kept, so switching back and forth
+ * in a dialog does not rebuild them.
+ */
+std::shared_ptr<const SeparationTables> separation_tables(const SeparationSetup& setup);
+
+/**
+ * @brief Returns the setup used to display and convert CMYK documents (the
+ *        original's gPreferences.fSeparation)
+ */
+SeparationSetup separation_setup();
+
+/**
+ * @brief Changes the setup used to display and convert CMYK documents
+ * @throws std::invalid_argument if a parameter is out of range
+ *
+ * Documents already displayed keep their cached rendering until they are
+ * redrawn.
+ */
+void set_separation_setup(const SeparationSetup& setup);
+
+/**
+ * @brief Converts a document's channels to another color mode
+ * @param doc Document to convert
+ * @param mode CMYK from Grayscale or RGB; RGB or Grayscale from CMYK
+ * @param setup Separation to use
+ * @throws std::invalid_argument for other conversions, or if the document
+ *         lacks the channels of its mode
+ *
+ * Port of ConvertRGB2CMYK, ConvertCMYK2RGB and ConvertCMYK2Gray. The
+ * channels are replaced by Gray8 channels of the new mode, converted
+ * through the setup's tables in bands of rows on the ThreadPool; a fourth
+ * (alpha) RGB channel is kept after the inks. Layers are not changed.
+ * Converting to the current mode does nothing.
+ */
+void convert_mode(ImageDocument& doc, ColorMode mode,
+                  const SeparationSetup& setup = separation_setup());
+
+/**
+ * @brief Undoable color mode conversion
+ *
+ * Keeps the document's channels and mode; undo and redo exchange them
+ * with the converted ones.
+ */
+class ModeCommand : public Command {
+ public:
+  ModeCommand(ImageDocument& doc, ColorMode mode,
+              const SeparationSetup& setup = separation_setup());
+  ~ModeCommand() override = default;
+
+  void execute() override;
+  void undo() override;
+  void redo() override;
+  std::string name() const override;
+  std::size_t memory_footprint() const override;
+
+ private:
+  void exchange();
+
+  ImageDocument& document_;
+  ColorMode mode_;
+  ColorMode other_mode_;  ///< The mode not currently in the document
+  SeparationSetup setup_;
+  std::vector<ImageChannel> channels_;  ///< The channels not in the document
+};
+
+}  // namespace ps::core
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+namespace ps::core {
+
+/**
+ * @brief Bounded lock-free queue for one producer and one consumer thread
+ *
+ * A ring of Capacity slots indexed by two counters: the producer only
+ * advances tail_, the consumer only advances head_, and each publishes its
+ * counter with release ordering after touching a slot. Neither side ever
+ * blocks or allocates. The counters sit on separate cache lines so the two
+ * threads do not contend for one.
+ *
+ * try_push() must only be called from one thread and try_pop() from one
+ * other thread; empty() may be called from either.
+ *
+ * Example usage:
+ * @code
+ *   SpscQueue<Event, 1024> queue;
+ *   // producer:
+ *   while (!queue.try_push(event)) std::this_thread::yield();
+ *   // consumer:
+ *   Event e;
+ *   while (queue.try_pop(e)) handle(e);
+ * @endcode
+ */
+template <typename T, std::size_t Capacity>
+class SpscQueue {
+  static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+                "SpscQueue capacity must be a power of two");
+
+ public:
+  /**
+   * @brief Appends a value
+   * @return false if the queue is full
+   */
+  bool try_push(const T& value) {
+    const std::size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == Capacity) {
+      return false;
+    }
+    slots_[tail & (Capacity - 1)] = value;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief Removes the oldest value
+   * @param value Receives the value
+   * @return false if the queue is empty
+   */
+  bool try_pop(T& value) {
+    const std::size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    value = slots_[head & (Capacity - 1)];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief Returns true if no value is queued
+   */
+  bool empty() const {
+    return head_.load(std::memory_order_acquire) ==
+           tail_.load(std::memory_order_acquire);
+  }
+
+ private:
+  alignas(64) std::atomic<std::size_t> head_{0};  ///< Next slot to pop
+  alignas(64) std::atomic<std::size_t> tail_{0};  ///< Next slot to push
+  std::array<T, Capacity> slots_{};
+};
+
+}  // namespace ps::core
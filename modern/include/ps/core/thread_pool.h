@@ -0,0 +1,96 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ps::core {
+
+/**
+ * @brief Fixed pool of worker threads for data-parallel loops
+ *
+ * ThreadPool runs the per-tile and per-band loops of the compositor and
+ * other whole-image operations on all cores. parallel_for() splits an index
+ * range into chunks that the calling thread and the workers claim from a
+ * shared counter, so uneven chunks balance out without per-chunk queueing.
+ *
+ * The thread count includes the calling thread. A count of 1 is the
+ * deterministic mode: no worker threads exist and every chunk runs inline
+ * on the caller in ascending order, which keeps tests and profiles
+ * reproducible. The default count is std::thread::hardware_concurrency().
+ *
+ * parallel_for() called from inside a parallel_for() body runs inline, so
+ * nested loops cannot deadlock the pool. The first exception thrown by a
+ * body is rethrown on the calling thread once all chunks have finished.
+ *
+ * Example usage:
+ * @code
+ *   ThreadPool::instance().parallel_for(0, height, 16, [&](int y0, int y1) {
+ *     for (int y = y0; y < y1; ++y) {
+ *       process_row(y);
+ *     }
+ *   });
+ * @endcode
+ */
+class ThreadPool {
+ public:
+  /**
+   * @brief Returns the process-wide thread pool
+   */
+  static ThreadPool& instance();
+
+  /**
+   * @brief Sets the number of threads used by parallel_for()
+   * @param count Thread count including the caller; 0 selects
+   *              std::thread::hardware_concurrency(), 1 runs everything
+   *              on the calling thread
+   *
+   * Must not be called while a parallel_for() is running.
+   */
+  void set_thread_count(std::size_t count);
+
+  /**
+   * @brief Returns the number of threads used by parallel_for()
+   */
+  std::size_t thread_count() const;
+
+  /**
+   * @brief Runs @p body over [begin, end) in chunks of @p grain indices
+   * @param begin First index
+   * @param end One past the last index
+   * @param grain Indices per chunk (at least 1)
+   * @param body Called as body(chunk_begin, chunk_end) for each chunk
+   *
+   * Blocks until every chunk has run.
+   */
+  void parallel_for(int begin, int end, int grain,
+                    const std::function<void(int, int)>& body);
+
+ private:
+  struct Loop;
+
+  ThreadPool();
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  void start_workers(std::size_t count);
+  void stop_workers();
+  void worker_main();
+  static void run_chunks(Loop& loop);
+
+  mutable std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  std::deque<Loop*> loops_;  ///< Loops that may still have unclaimed chunks
+  std::vector<std::thread> workers_;
+  std::size_t thread_count_ = 1;
+  bool stop_ = false;
+};
+
+}  // namespace ps::core
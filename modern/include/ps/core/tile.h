@@ -0,0 +1,140 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace ps::core {
+
+class TileCache;
+
+/**
+ * @brief Supplies the pixels of tiles that are decoded on first access
+ *
+ * A document file opened lazily creates its tiles with a source and a key
+ * (for example the file offset of the tile's compressed data) instead of
+ * reading them. read_tile() is called the first time a tile's pixels are
+ * needed, possibly on several threads at once, and again if the cache
+ * later drops the decoded pixels.
+ */
+class TileSource {
+ public:
+  virtual ~TileSource() = default;
+
+  /**
+   * @brief Decodes the tile identified by key into dst
+   * @param key Key passed to the Tile constructor or set_source()
+   * @param dst Destination of exactly byte_size bytes
+   * @throws std::runtime_error if the data cannot be read
+   */
+  virtual void read_tile(std::uint64_t key, std::uint8_t* dst,
+                         std::size_t byte_size) const = 0;
+};
+
+/**
+ * @brief A fixed-size block of pixel data used by tiled image buffers
+ *
+ * Tiles are shared between ImageBuffer instances through std::shared_ptr.
+ * A buffer that needs to write into a tile that is also referenced elsewhere
+ * (for example by an undo snapshot) clones the tile first, so copying a
+ * tiled buffer only costs the tiles that are modified afterwards.
+ *
+ * Every tile is registered with the TileCache, which may page cold tiles
+ * out to a scratch file when a memory budget is set. Accessing data()
+ * pages the tile back in transparently; the mutable accessor also marks
+ * the tile dirty so its next eviction rewrites the scratch copy.
+ *
+ * A freshly constructed tile is zero-filled. A tile constructed with a
+ * TileSource starts out paged out and is decoded on first access; while its
+ * pixels still match the source, the cache drops them instead of writing
+ * them to the scratch file.
+ */
+class Tile {
+ public:
+  /**
+   * @brief Allocates a zero-filled tile
+   * @param byte_size Size of the tile's pixel storage in bytes
+   */
+  explicit Tile(std::size_t byte_size);
+
+  /**
+   * @brief Creates a tile whose pixels are read from a source when needed
+   * @param byte_size Size of the tile's pixel storage in bytes
+   * @param source Source that decodes the pixels
+   * @param key Identifies the tile to the source
+   */
+  Tile(std::size_t byte_size, std::shared_ptr<const TileSource> source, std::uint64_t key);
+
+  /**
+   * @brief Creates a deep copy of another tile's pixel data
+   */
+  Tile(const Tile& other);
+
+  Tile& operator=(const Tile&) = delete;
+
+  ~Tile();
+
+  /**
+   * @brief Returns the size of the tile storage in bytes
+   */
+  std::size_t byte_size() const { return byte_size_; }
+
+  /**
+   * @brief Returns a mutable pointer to the tile's pixel data
+   *
+   * Pages the tile in if necessary and marks it dirty.
+   */
+  std::uint8_t* data();
+
+  /**
+   * @brief Returns a const pointer to the tile's pixel data
+   *
+   * Pages the tile in if necessary.
+   */
+  const std::uint8_t* data() const;
+
+  /**
+   * @brief Returns true if the tile's pixels are currently in memory
+   */
+  bool resident() const {
+    return data_.load(std::memory_order_acquire) != nullptr;
+  }
+
+  /**
+   * @brief Returns the source the tile's pixels still match, or nullptr
+   * @param key Receives the tile's key in that source
+   *
+   * Writing through the mutable data() detaches the tile from its source.
+   */
+  std::shared_ptr<const TileSource> source(std::uint64_t& key) const;
+
+  /**
+   * @brief Records that the tile's current pixels are stored in a source
+   *
+   * Used after a save wrote the tile, so the file can page it back in and
+   * the next save can skip it. The caller guarantees the pixels are not
+   * being written concurrently.
+   */
+  void set_source(std::shared_ptr<const TileSource> source, std::uint64_t key) const;
+
+ private:
+  friend class TileCache;
+
+  std::size_t byte_size_ = 0;
+  mutable std::atomic<std::uint8_t*> data_{nullptr};
+
+  // Paging state, guarded by the TileCache mutex except where noted
+  mutable std::atomic<std::uint64_t> last_used_{0};  ///< Cache epoch of last access
+  mutable std::atomic<bool> dirty_{true};  ///< Memory and scratch copy differ
+  std::int64_t scratch_offset_ = -1;       ///< Slot in the scratch file, or -1
+  std::size_t registry_index_ = 0;         ///< Position in the cache registry
+  mutable std::shared_ptr<const TileSource> source_;  ///< Lazy origin, or null
+  mutable std::uint64_t source_key_ = 0;
+  /// The pixels equal the source's; cleared by the mutable data()
+  mutable std::atomic<bool> source_current_{false};
+
+  std::uint8_t* resident_data() const;
+};
+
+}  // namespace ps::core
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ps/core/tile.h"
+
+namespace ps::core {
+
+/**
+ * @brief Snapshot of tile cache memory usage
+ */
+struct TileCacheStats {
+  std::size_t resident_bytes = 0;  ///< Tile bytes currently held in memory
+  std::size_t paged_bytes = 0;     ///< Tile bytes only on disk (scratch or source file)
+  std::size_t budget_bytes = 0;    ///< Configured budget (0 = unlimited)
+  std::size_t tile_count = 0;      ///< Number of live tiles
+};
+
+/**
+ * @brief Disk-backed pager for image tiles
+ *
+ * TileCache is the modern counterpart of the legacy UVMemory page manager.
+ * Every Tile registers itself here. When a memory budget is configured,
+ * trim() writes the least recently used tiles to a scratch file and frees
+ * their memory; the next access to such a tile reads it back in.
+ *
+ * As with TVMPageInfo, each tile tracks whether its memory and disk copies
+ * differ (dirty), so a clean tile that was paged in and only read can be
+ * dropped again without rewriting it. Recency is tracked with an epoch that
+ * advances on every trim(): tiles touched since the previous trim are the
+ * newest, and eviction proceeds from the oldest epoch forward.
+ *
+ * Tiles created from a TileSource (a lazily opened document file) start
+ * paged out and are decoded on first access. While their pixels still match
+ * the source, trim() simply frees them; they never use the scratch file.
+ *
+ * Paging only applies to tiled ImageBuffers; contiguous buffers always stay
+ * in memory.
+ *
+ * @warning trim() frees tile memory, so pointers previously returned by
+ *          Tile::data() or ImageBuffer::pixel_row() become invalid. Call it
+ *          only at points where no other code is holding such pointers,
+ *          e.g. between UI frames.
+ *
+ * Example usage:
+ * @code
+ *   auto& cache = TileCache::instance();
+ *   cache.set_memory_budget(std::size_t(8) << 30);  // 8 GB
+ *   // ... once per frame / after each command:
+ *   cache.trim();
+ * @endcode
+ */
+class TileCache {
+ public:
+  /**
+   * @brief Returns the process-wide tile cache
+   */
+  static TileCache& instance();
+
+  /**
+   * @brief Sets the memory budget for resident tiles
+   * @param bytes Budget in bytes; 0 disables paging
+   */
+  void set_memory_budget(std::size_t bytes);
+
+  /**
+   * @brief Returns the memory budget in bytes (0 = unlimited)
+   */
+  std::size_t memory_budget() const;
+
+  /**
+   * @brief Sets the directory used for the scratch file
+   * @param directory Directory path; empty uses the system temp directory
+   *
+   * Takes effect the next time the scratch file is created, i.e. before the
+   * first tile is paged out.
+   */
+  void set_scratch_directory(const std::string& directory);
+
+  /**
+   * @brief Returns current memory usage figures
+   */
+  TileCacheStats stats() const;
+
+  /**
+   * @brief Pages out least recently used tiles until the budget is met
+   * @return Number of bytes released from memory
+   *
+   * Tiles that cannot be written to the scratch file stay resident.
+   */
+  std::size_t trim();
+
+ private:
+  friend class Tile;
+
+  TileCache() = default;
+  ~TileCache();
+
+  TileCache(const TileCache&) = delete;
+  TileCache& operator=(const TileCache&) = delete;
+
+  void register_tile(Tile* tile);
+  void unregister_tile(Tile* tile);
+  std::uint8_t* page_in(const Tile& tile);
+  std::uint64_t epoch() const { return epoch_.load(std::memory_order_relaxed); }
+
+  bool page_out(Tile* tile);
+  bool open_scratch_file();
+  std::int64_t allocate_slot(std::size_t byte_size);
+  void release_slot(std::int64_t offset, std::size_t byte_size);
+
+  mutable std::mutex mutex_;
+  std::vector<Tile*> tiles_;
+  std::atomic<std::uint64_t> epoch_{1};
+
+  std::size_t budget_bytes_ = 0;
+  std::size_t resident_bytes_ = 0;
+  std::size_t paged_bytes_ = 0;
+
+  std::string scratch_directory_;
+  std::FILE* scratch_file_ = nullptr;
+  int scratch_fd_ = -1;
+  std::int64_t scratch_end_ = 0;
+  std::unordered_map<std::size_t, std::vector<std::int64_t>> free_slots_;
+};
+
+}  // namespace ps::core
@@ -1,8 +1,12 @@
 #pragma once
 
+#include <condition_variable>
 #include <cstddef>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "ps/core/command.h"
@@ -14,7 +18,8 @@ namespace ps::core {
  *
  * UndoStack maintains a linear history of executed commands and provides
  * undo/redo functionality. It implements a classic undo stack with:
- * - Configurable maximum depth to limit memory usage
+ * - Configurable maximum depth and memory budget to limit memory usage
+ * - Background compression of entries away from the current position
  * - Linear history (undoing then executing a new command clears redo history)
  * - Command name queries for UI display
  *
@@ -22,9 +27,17 @@ namespace ps::core {
  * in the command history. Commands before the index can be undone, and
  * commands at or after the index can be redone.
  *
+ * Commands more than uncompressed_depth() steps from the current position
+ * are handed to a worker thread that calls Command::compress(). They are
+ * decompressed on demand when they are undone or redone. When a memory
+ * budget is set, the oldest commands are discarded until the summed
+ * Command::memory_footprint() fits; entries still waiting for compression
+ * count at their uncompressed size.
+ *
  * Example usage:
  * @code
  *   UndoStack stack(50);  // Max 50 levels of undo
+ *   stack.set_memory_budget(std::size_t(512) << 20);  // and at most 512 MB
  *   stack.push(std::make_unique<FillCommand>(...));
  *   stack.undo();  // Undo the fill
  *   stack.redo();  // Redo the fill
@@ -38,6 +51,14 @@ class UndoStack {
    */
   explicit UndoStack(std::size_t max_depth = 100);
 
+  /**
+   * @brief Stops the compression worker and destroys all commands
+   */
+  ~UndoStack();
+
+  UndoStack(const UndoStack&) = delete;
+  UndoStack& operator=(const UndoStack&) = delete;
+
   /**
    * @brief Pushes a new command onto the stack and executes it
    * @param cmd Unique pointer to the command to execute
@@ -121,12 +142,62 @@ class UndoStack {
    */
   void set_max_depth(std::size_t depth);
 
+  /**
+   * @brief Returns the memory budget in bytes (0 = unlimited)
+   */
+  std::size_t memory_budget() const { return memory_budget_; }
+
+  /**
+   * @brief Sets the memory budget for the history
+   * @param bytes Maximum summed memory footprint; 0 disables the limit
+   *
+   * The most recent undoable command is always kept, even if it alone
+   * exceeds the budget.
+   */
+  void set_memory_budget(std::size_t bytes);
+
+  /**
+   * @brief Returns the summed memory footprint of all commands in bytes
+   */
+  std::size_t memory_usage() const;
+
+  /**
+   * @brief Returns how many steps around the current position stay uncompressed
+   */
+  std::size_t uncompressed_depth() const { return uncompressed_depth_; }
+
+  /**
+   * @brief Sets how many steps around the current position stay uncompressed
+   * @param depth Number of undo (and redo) steps kept ready for immediate use
+   */
+  void set_uncompressed_depth(std::size_t depth);
+
+  /**
+   * @brief Blocks until all pending background compression has finished
+   */
+  void wait_for_compression();
+
  private:
   std::vector<std::unique_ptr<Command>> commands_;
   std::size_t current_index_;
   std::size_t max_depth_;
+  std::size_t memory_budget_ = 0;
+  std::size_t uncompressed_depth_ = 2;
+
+  // Background compression; the queue holds commands owned by commands_
+  std::mutex compress_mutex_;
+  std::condition_variable compress_cv_;
+  std::deque<Command*> compress_queue_;
+  Command* compressing_ = nullptr;
+  bool stop_worker_ = false;
+  std::thread worker_;
 
   void trim_to_max_depth();
+  void trim_to_budget();
+  void erase_commands(std::size_t first, std::size_t last);
+  void schedule_compression(std::size_t index);
+  void claim(Command* cmd);
+  void compression_worker();
 };
 
 }  // namespace ps::core
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "ps/core/image_buffer.h"
+#include "ps/core/image_document.h"
+
+namespace ps::dither {
+
+/**
+ * @brief Dot shape of a halftone screen (the original's screen shapes)
+ */
+enum class ScreenShape {
+  Round,    ///< Round dots that join into a checkerboard at 50%
+  Ellipse,  ///< Elliptical dots that join along one axis first
+  Line,     ///< Parallel lines
+  Square,   ///< Square dots
+  Cross,    ///< Crosses
+};
+
+/**
+ * @brief Parameters of a halftone screen (the original's THalftoneSpec)
+ */
+struct HalftoneScreen {
+  /// Pixels from one dot to the next, the output resolution divided by the
+  /// screen frequency; clamped to 1..64 like the original
+  double period = 6.0;
+  /// Screen angle in degrees, counterclockwise from horizontal
+  double angle = 45.0;
+  ScreenShape shape = ScreenShape::Round;
+};
+
+/**
+ * @brief A tile of thresholds repeated across the image (the original's
+ *        screen arrays from MakeScreen)
+ *
+ * A pixel turns black when its darkness, 255 minus its level, exceeds the
+ * threshold at its position modulo the tile size. The thresholds of a tile
+ * are ranks spread evenly over 0..255, so a flat area of level v comes out
+ * (255 - v) / 255 black.
+ */
+class Screen {
+ public:
+  /**
+   * @brief One threshold at 50% (the original's 50% Threshold)
+   */
+  static Screen threshold();
+
+  /**
+   * @brief The 8 × 8 Bayer matrix, a dispersed ordered dither (the
+   *        original's Pattern Dither)
+   */
+  static Screen pattern();
+
+  /**
+   * @brief A clustered-dot screen at an angle (port of FindScreen and
+   *        ComputeScreen)
+   *
+   * As in the original, the dot spacing is rounded to a whole-pixel step
+   * (j, k) along the screen angle, searched outwards from the requested
+   * one until the tile that repeats the screen exactly fits 512 pixels.
+   * The pixels of each dot are ranked by the shape's spot function, ties
+   * broken so the dots of a tile grow in turn.
+   */
+  static Screen halftone(const HalftoneScreen& screen);
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+  /**
+   * @brief Returns row @p y (modulo the height) of the tile
+   */
+  const std::uint8_t* row(int y) const {
+    return thresholds_.data() + static_cast<std::size_t>(y % height_) * width_;
+  }
+
+ private:
+  Screen(int width, int height, std::vector<std::uint8_t> thresholds);
+
+  int width_;
+  int height_;
+  std::vector<std::uint8_t> thresholds_;
+};
+
+/**
+ * @brief How continuous tones become black and white or palette colors
+ *        (the original's bitmap conversion methods)
+ */
+enum class DitherMethod {
+  Threshold,  ///< No dither: 50% threshold, or the nearest palette color
+  Pattern,    ///< Ordered dither with the 8 × 8 Bayer matrix
+  Diffusion,  ///< Floyd-Steinberg error diffusion
+  Halftone,   ///< Halftone screen (bitmaps only)
+};
+
+/**
+ * @brief Options of bitmap conversion
+ */
+struct BitmapOptions {
+  DitherMethod method = DitherMethod::Diffusion;
+  HalftoneScreen screen;  ///< Used by DitherMethod::Halftone
+};
+
+/**
+ * @brief Converts a gray channel to a 1-bit bitmap (port of HalftoneArea)
+ * @param gray Gray8 channel
+ * @param options Conversion method
+ * @return Bitmap1 buffer of the channel's size and layout
+ * @throws std::invalid_argument if the channel is not Gray8
+ *
+ * Screens (Threshold, Pattern, Halftone) run in tile-aligned bands on the
+ * ThreadPool, comparing whole rows against repeated threshold rows in a
+ * loop compiled for AVX2 and SSE4.1 where available. Error diffusion runs
+ * as a wavefront: workers take rows in order and each one advances in
+ * column blocks as soon as the row above has passed them, so rows overlap
+ * across threads while every pixel sees the same errors as a sequential
+ * pass. Tiles that come out all white are not kept, and a bitmap takes an
+ * eighth of the memory of its channel.
+ */
+core::ImageBuffer to_bitmap(const core::ImageBuffer& gray, const BitmapOptions& options = {});
+
+/**
+ * @brief Screens a gray channel to a 1-bit bitmap with any threshold tile
+ * @throws std::invalid_argument if the channel is not Gray8
+ */
+core::ImageBuffer screen_bitmap(const core::ImageBuffer& gray, const Screen& screen);
+
+/**
+ * @brief Expands a bitmap to a Gray8 channel of black (0) and white (255)
+ *        pixels, for display and proofing
+ * @throws std::invalid_argument if the buffer is not Bitmap1
+ */
+core::ImageBuffer bitmap_to_gray(const core::ImageBuffer& bitmap);
+
+/**
+ * @brief Colors of an indexed image
+ */
+using Palette = std::vector<std::array<std::uint8_t, 3>>;
+
+/**
+ * @brief Returns @p levels steps of each of red, green and blue, blue
+ *        varying fastest (6 gives the 216-color uniform palette)
+ * @throws std::invalid_argument unless 2 <= levels <= 6
+ */
+Palette uniform_palette(int levels = 6);
+
+/**
+ * @brief An Indexed8 buffer with its palette
+ */
+struct IndexedImage {
+  core::ImageBuffer indices;
+  Palette palette;
+};
+
+/**
+ * @brief Converts a document's channels to palette colors
+ * @param doc Grayscale, RGB or CMYK document
+ * @param palette 1..256 colors
+ * @param method Threshold (nearest color), Pattern or Diffusion
+ * @throws std::invalid_argument for an empty or oversized palette, the
+ *         Halftone method, or a document lacking the channels of its mode
+ *
+ * Colors are matched through a 32 × 32 × 32 inverse color map built once
+ * per call. Pattern offsets each color by the Bayer matrix scaled to the
+ * palette's spacing before matching; Diffusion spreads each channel's
+ * error with the same wavefront schedule as to_bitmap().
+ */
+IndexedImage to_indexed(const core::ImageDocument& doc, const Palette& palette,
+                        DitherMethod method = DitherMethod::Diffusion);
+
+}  // namespace ps::dither
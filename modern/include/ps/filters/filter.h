@@ -0,0 +1,161 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ps/core/command.h"
+#include "ps/core/image_document.h"
+
+namespace ps::filters {
+
+/**
+ * @brief One tile handed to Filter::process()
+ *
+ * src points at the tile's top-left source sample. Rows are src_stride
+ * samples apart and the samples are valid for Filter::halo() pixels on
+ * every side of the tile; past the image edges they repeat the edge
+ * pixels, as CopyRow did for the original's 3 by 3 filters. The filter
+ * writes width × height results to dst, whose rows are dst_stride samples
+ * apart. Neither buffer aliases the document.
+ */
+template <typename Sample>
+struct FilterTile {
+  const Sample* src = nullptr;
+  std::ptrdiff_t src_stride = 0;
+  Sample* dst = nullptr;
+  std::ptrdiff_t dst_stride = 0;
+  int width = 0;
+  int height = 0;
+  core::Rect area{};   ///< Where the tile lies in the image
+  int max_value = 255; ///< Largest sample value: 255 or 65535
+};
+
+/**
+ * @brief A neighbourhood operation on single channels (port of TFilterCommand)
+ *
+ * Filters see one tile of one Gray8 or Gray16 channel at a time and must
+ * produce its pixels from the tile's source and halo alone. process() is
+ * called concurrently for different tiles, so it must not modify the
+ * filter.
+ */
+class Filter {
+ public:
+  virtual ~Filter() = default;
+
+  /**
+   * @brief Returns the name shown in menus and the undo history
+   */
+  virtual std::string name() const = 0;
+
+  /**
+   * @brief Returns how many pixels around a tile process() reads
+   */
+  virtual int halo() const = 0;
+
+  virtual void process(const FilterTile<std::uint8_t>& tile) const = 0;
+  virtual void process(const FilterTile<std::uint16_t>& tile) const = 0;
+
+  /**
+   * @brief Returns the filter to apply to an image scaled by @p factor
+   *
+   * Used by preview_filter(): a blur of radius 8 previewed at factor 0.25
+   * becomes a blur of radius 2, so the proxy looks like a reduction of the
+   * full-size result. Filters without a size return a copy of themselves.
+   */
+  virtual std::unique_ptr<Filter> scaled(double factor) const = 0;
+};
+
+/**
+ * @brief What apply_filter() filters
+ */
+struct FilterOptions {
+  /// Channels to filter; empty filters every channel
+  std::vector<std::size_t> channels;
+  /// Area to filter; empty means the whole image
+  core::Rect area{};
+  /// Blend the result with the original by the selection mask, and filter
+  /// only inside its bounds, when there is a selection
+  bool use_selection = true;
+};
+
+/**
+ * @brief Returns the rectangle apply_filter() would change
+ *
+ * options.area (or the whole image) clipped to the image and, with
+ * use_selection, to the selection's bounds. Empty if nothing would change.
+ */
+core::Rect filter_area(const core::ImageDocument& doc, const FilterOptions& options = {});
+
+/**
+ * @brief Runs a filter over channels of a document
+ * @return The changed area, as filter_area() returns it
+ * @throws std::out_of_range if a channel index is invalid
+ * @throws std::invalid_argument if a channel is not Gray8 or Gray16
+ *
+ * Each channel's area and a halo around it are first copied (in parallel,
+ * with the image edges repeated) into one padded plane, so tiles read
+ * their neighbours' original pixels however the work is split. The area
+ * is then cut along the ImageBuffer::kTileSize grid and the tiles are
+ * filtered on the ThreadPool. Tiles the selection does not touch are
+ * skipped; elsewhere each result is blended with the original as
+ * original + (result - original) × mask / 255 and written back, one
+ * buffer tile per task. The area is reported with mark_dirty().
+ */
+core::Rect apply_filter(core::ImageDocument& doc, const Filter& filter,
+                        const FilterOptions& options = {});
+
+/**
+ * @brief Undoable application of a filter
+ *
+ * Saves the filtered area of every channel with save_region() (sharing the
+ * tiles of tiled channels) before filtering, so undo swaps the original
+ * blocks back and redo swaps the result in again without refiltering.
+ */
+class FilterCommand : public core::ImageCommand {
+ public:
+  FilterCommand(core::ImageDocument& doc, std::shared_ptr<const Filter> filter,
+                FilterOptions options = {});
+  ~FilterCommand() override = default;
+
+  void execute() override;
+  void redo() override;
+  std::string name() const override { return filter_->name(); }
+
+ private:
+  std::shared_ptr<const Filter> filter_;
+  FilterOptions options_;
+};
+
+/**
+ * @brief A reduced rendering of a filter's result for dialogs
+ */
+struct FilterPreview {
+  /// The previewed channels, in order, at 1 / factor of their size, with
+  /// the filter applied (and blended by the reduced selection)
+  core::ImageDocument image;
+  int factor = 1;    ///< Integer reduction factor
+  core::Rect area{}; ///< Image area the preview shows
+};
+
+/**
+ * @brief Renders a low-resolution proxy of a filter's result
+ * @param doc Document to preview; it is not modified
+ * @param filter Filter at full resolution
+ * @param options Channels and area as for apply_filter(); an empty area
+ *                previews the whole image
+ * @param max_edge Largest edge of the preview in pixels (at least 1)
+ * @throws std::invalid_argument if max_edge < 1, or as apply_filter()
+ *
+ * The area and a margin for the scaled filter's halo are box-reduced by
+ * the smallest integer factor that fits max_edge, the selection with them,
+ * and filter.scaled(1.0 / factor) is run on the reduction. The cost
+ * depends on max_edge rather than on the size of the area, so dialogs can
+ * rerun it on every parameter change.
+ */
+FilterPreview preview_filter(const core::ImageDocument& doc, const Filter& filter,
+                             const FilterOptions& options, int max_edge);
+
+}  // namespace ps::filters
@@ -1,25 +1,202 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <string>
+#include <vector>
 
 #include "ps/core/image_document.h"
 
 namespace ps::io {
 
+/**
+ * @brief Called while a document loads, each time a band of rows is decoded
+ * @param document The document being loaded; its channels exist from the
+ *                 first call, and rows not reported yet are undefined
+ * @param rows The full-width band just decoded
+ *
+ * Lets a viewer show a large image while it is still loading. The callback
+ * runs on the loading thread between bands and must not keep the document.
+ */
+using LoadProgress =
+    std::function<void(const ps::core::ImageDocument& document, const ps::core::Rect& rows)>;
+
+/**
+ * @brief Options for ImageFormat::load()
+ */
+struct LoadOptions {
+  /// Storage layout given to the document's channels
+  ps::core::StorageLayout layout = ps::core::StorageLayout::Contiguous;
+  LoadProgress progress;  ///< Optional progress callback
+};
+
+/**
+ * @brief Called while a document saves, each time a band of rows is written
+ * @param rows The full-width band just encoded
+ *
+ * Runs on the saving thread; throwing from it aborts the save and removes
+ * the partial file.
+ */
+using SaveProgress = std::function<void(const ps::core::Rect& rows)>;
+
+/**
+ * @brief Row predictor applied before compression
+ *
+ * The values match the PNG filter types. Adaptive picks, per row, the
+ * filter whose residuals have the smallest sum of magnitudes.
+ */
+enum class RowFilter { None, Sub, Up, Average, Paeth, Adaptive };
+
+/**
+ * @brief Options for ImageFormat::save()
+ *
+ * Formats ignore settings that they do not compress with.
+ */
+struct SaveOptions {
+  int compression_level = 6;               ///< zlib level: 0 stores, 1 fastest, 9 smallest
+  RowFilter filter = RowFilter::Adaptive;  ///< Predictor for filtered formats
+  SaveProgress progress;                   ///< Optional progress callback
+};
+
+/**
+ * @brief What a file holds, read from its headers without decoding pixels
+ */
+struct ImageInfo {
+  std::string format;  ///< name() of the format that read the file
+  ps::core::Size size{};
+  ps::core::ColorMode mode = ps::core::ColorMode::RGB;
+  int bit_depth = 8;      ///< Bits per sample as stored in the file (1, 8 or 16)
+  int channel_count = 0;  ///< Channels the loaded document has, extra ones included
+  int layer_count = 0;    ///< Layers the loaded document has
+};
+
 class ImageFormat {
  public:
+  /// Leading bytes of a file passed to can_read_signature()
+  static constexpr std::size_t kSignatureSize = 16;
+
   virtual ~ImageFormat() = default;
 
   virtual std::string name() const = 0;
   virtual bool can_read(const std::string& path) const = 0;
+
+  /**
+   * @brief Recognizes the format from the first bytes of a file
+   * @param header Up to kSignatureSize bytes from the start of the file
+   * @param size Number of bytes in @p header; less for short files
+   *
+   * ImageIO asks this before falling back to can_read(), so a file loads
+   * with the right format whatever its extension. Formats without a
+   * signature keep the default, which recognizes nothing.
+   */
+  virtual bool can_read_signature(const std::uint8_t* /*header*/, std::size_t /*size*/) const {
+    return false;
+  }
+
+  /**
+   * @brief Describes a file from its headers, without decoding any pixels
+   */
+  virtual ImageInfo probe(const std::string& path) const = 0;
+
+  /**
+   * @brief Loads a reduced copy of the image's channels
+   * @param max_edge Longest edge of the result; smaller images keep their size
+   *
+   * The result has the channels of load(), box-filtered to
+   * thumbnail_size(), and no layers. The default loads the whole image and
+   * reduces it; formats override this to read an embedded reduced image or
+   * to reduce rows as they are decoded.
+   */
+  virtual ps::core::ImageDocument load_thumbnail(const std::string& path, int max_edge) const;
   virtual bool can_write(const std::string& path,
                          const ps::core::ImageDocument& document) const = 0;
 
-  virtual ps::core::ImageDocument load(const std::string& path) const = 0;
-  virtual void save(const std::string& path,
-                    const ps::core::ImageDocument& document) const = 0;
+  ps::core::ImageDocument load(const std::string& path) const {
+    return load(path, LoadOptions{});
+  }
+  virtual ps::core::ImageDocument load(const std::string& path,
+                                       const LoadOptions& options) const = 0;
+  void save(const std::string& path, const ps::core::ImageDocument& document) const {
+    save(path, document, SaveOptions{});
+  }
+  virtual void save(const std::string& path, const ps::core::ImageDocument& document,
+                    const SaveOptions& options) const = 0;
 };
 
 std::string file_extension(const std::string& path);
 
+/**
+ * @brief Returns the size of a thumbnail of an image of @p size
+ *
+ * Keeps the aspect ratio, with the longest edge at most @p max_edge and
+ * every edge at least 1. Images that already fit keep their size.
+ * @throw std::invalid_argument if @p max_edge is not positive
+ */
+ps::core::Size thumbnail_size(ps::core::Size size, int max_edge);
+
+/**
+ * @brief Box-filters rows of an image into a thumbnail as they are decoded
+ *
+ * Each thumbnail pixel averages the block of source pixels that maps onto
+ * it, so formats can feed rows straight from their decoder and never hold
+ * the full-size image. Rows of each channel must arrive top to bottom;
+ * different channels may be fed from different threads.
+ *
+ * Example usage:
+ * @code
+ *   ImageDocument thumbnail(thumbnail_size(size, 256), mode);
+ *   thumbnail.add_channel("Gray", PixelFormat::Gray8);
+ *   ThumbnailBuilder builder(size, thumbnail);
+ *   for (int y = 0; y < size.height; ++y) {
+ *     builder.add_row(0, y, decoded_row, 1);
+ *   }
+ * @endcode
+ */
+class ThumbnailBuilder {
+ public:
+  /**
+   * @param source_size Size of the image being reduced
+   * @param thumbnail Document whose channels receive the reduced rows; its
+   *                  size sets the reduction and must not exceed source_size
+   */
+  ThumbnailBuilder(ps::core::Size source_size, ps::core::ImageDocument& thumbnail);
+
+  /**
+   * @brief Adds source row @p y of a channel
+   * @param channel Index of the thumbnail channel
+   * @param row Samples of the channel's pixel format
+   * @param stride Distance, in samples, from one pixel to the next
+   *
+   * 8-bit channel formats take the uint8_t overload, 16-bit ones the
+   * uint16_t one.
+   */
+  void add_row(int channel, int y, const std::uint8_t* row, std::size_t stride);
+  void add_row(int channel, int y, const std::uint16_t* row, std::size_t stride);
+
+ private:
+  struct ChannelState {
+    int components = 1;
+    std::vector<std::uint64_t> sums;  ///< Per thumbnail sample of the current row
+  };
+
+  template <typename Sample>
+  void accumulate(int channel, int y, const Sample* row, std::size_t stride);
+
+  ps::core::ImageDocument& thumbnail_;
+  ps::core::Size source_size_;
+  std::vector<int> column_of_;        ///< Thumbnail column of each source column
+  std::vector<int> row_of_;           ///< Thumbnail row of each source row
+  std::vector<std::uint32_t> column_counts_;
+  std::vector<std::uint32_t> row_counts_;
+  std::vector<ChannelState> channels_;
+};
+
+/**
+ * @brief Reduces the channels of a loaded document to a thumbnail
+ *
+ * Channels are reduced in parallel on the ThreadPool.
+ */
+ps::core::ImageDocument make_thumbnail(const ps::core::ImageDocument& document, int max_edge);
+
 }  // namespace ps::io
@@ -6,6 +6,7 @@
 
 #include "ps/core/image_document.h"
 #include "ps/io/image_format.h"
+#include "ps/io/io_task.h"
 
 namespace ps::io {
 
@@ -13,11 +14,61 @@ class ImageIO {
  public:
   void register_format(std::unique_ptr<ImageFormat> format);
 
-  ps::core::ImageDocument load(const std::string& path) const;
-  void save(const std::string& path, const ps::core::ImageDocument& document) const;
+  ps::core::ImageDocument load(const std::string& path,
+                               const LoadOptions& options = {}) const;
+  void save(const std::string& path, const ps::core::ImageDocument& document,
+            const SaveOptions& options = {}) const;
+
+  /**
+   * @brief Describes a file from its headers, without decoding pixels
+   *
+   * Cheap enough to call on every file of a folder: each format reads only
+   * its header (and, for native documents, the tile index).
+   */
+  ImageInfo probe(const std::string& path) const;
+
+  /**
+   * @brief Loads a reduced copy of a file's channels
+   * @param max_edge Longest edge of the thumbnail in pixels
+   *
+   * See ImageFormat::load_thumbnail(). Formats take the cheapest route they
+   * have: an embedded reduced-resolution image, the first Adam7 pass of an
+   * interlaced PNG, or reducing rows as they decode.
+   */
+  ps::core::ImageDocument load_thumbnail(const std::string& path, int max_edge) const;
+
+  /**
+   * @brief Loads a document on the IOWorkerPool
+   *
+   * Returns at once; several loads run concurrently, one per I/O worker.
+   * options.progress, if set, is called on the worker with the partially
+   * decoded document as in load().
+   */
+  LoadTask load_async(const std::string& path, LoadOptions options = {},
+                      IOCallbacks callbacks = {}) const;
+
+  /**
+   * @brief Saves a snapshot of the document on the IOWorkerPool
+   *
+   * The document is copied with ImageDocument::snapshot() before this
+   * returns, so it can be edited, or destroyed, while the file is written.
+   * Tiled documents share their tiles with the snapshot, which makes the
+   * copy cheap; contiguous documents are copied in full.
+   */
+  SaveTask save_async(const std::string& path, const ps::core::ImageDocument& document,
+                      SaveOptions options = {}, IOCallbacks callbacks = {}) const;
 
  private:
-  std::vector<std::unique_ptr<ImageFormat>> formats_{};
+  using FormatList = std::vector<std::shared_ptr<const ImageFormat>>;
+
+  // Picks the format whose signature matches the file's first bytes, then
+  // the first one that accepts the extension
+  static const ImageFormat& reader_for(const FormatList& formats, const std::string& path);
+  static const ImageFormat& writer_for(const FormatList& formats, const std::string& path,
+                                       const ps::core::ImageDocument& document);
+
+  // Shared so that background tasks keep the formats they use alive
+  FormatList formats_{};
 };
 
 ImageIO create_default_image_io();
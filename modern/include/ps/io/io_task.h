@@ -0,0 +1,187 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+#include "ps/core/image_document.h"
+
+namespace ps::io {
+
+/**
+ * @brief Thrown by LoadTask::take() and SaveTask::get() after cancel()
+ */
+class IOCancelled : public std::runtime_error {
+ public:
+  IOCancelled() : std::runtime_error("I/O task was cancelled") {}
+};
+
+/**
+ * @brief Lifecycle of a background load or save
+ */
+enum class IOStatus {
+  Queued,     ///< Waiting for a free I/O worker
+  Running,    ///< Reading or writing the file
+  Succeeded,  ///< Finished; the result is ready
+  Failed,     ///< The format threw; error() has the message
+  Cancelled   ///< cancel() was called, or the pool shut down first
+};
+
+/**
+ * @brief Optional callbacks of a background load or save
+ *
+ * Both run on the I/O worker thread. A UI should post them to its own
+ * event loop rather than touch widgets directly. An exception thrown by
+ * progress fails the operation; completed must not throw.
+ */
+struct IOCallbacks {
+  /// Called with the fraction done, 0 to 1, after each band of rows
+  std::function<void(float fraction)> progress;
+  /// Called once with the final status, after waiters have been released
+  std::function<void(IOStatus status)> completed;
+};
+
+/**
+ * @brief Handle to a load or save running on the IOWorkerPool
+ *
+ * Handles are cheap to copy and all copies refer to the same operation.
+ * Dropping every handle does not stop the operation; call cancel() for
+ * that. Cancellation is cooperative: the format stops at its next band
+ * of rows, and a cancelled save removes its partial file.
+ */
+class IOTask {
+ public:
+  IOTask() = default;
+
+  /**
+   * @brief Returns true if the handle refers to an operation
+   */
+  bool valid() const { return state_ != nullptr; }
+
+  /**
+   * @brief Returns where the operation is in its lifecycle
+   */
+  IOStatus status() const;
+
+  /**
+   * @brief Returns true once the operation succeeded, failed or was cancelled
+   */
+  bool done() const;
+
+  /**
+   * @brief Returns the fraction done, 0 to 1
+   *
+   * Loads report the bottom of the last decoded band; interlaced files
+   * start again from the top for each pass.
+   */
+  float progress() const;
+
+  /**
+   * @brief Asks the operation to stop; it may still finish if nearly done
+   */
+  void cancel();
+
+  /**
+   * @brief Blocks until done()
+   */
+  void wait() const;
+
+  /**
+   * @brief Blocks until done() or the timeout passes
+   * @return done()
+   */
+  bool wait_for(std::chrono::milliseconds timeout) const;
+
+  /**
+   * @brief Returns the failure message, or an empty string
+   */
+  std::string error() const;
+
+ protected:
+  /// Shared by every handle and the worker running the operation
+  struct State {
+    mutable std::mutex mutex;
+    mutable std::condition_variable done_cv;
+    IOStatus status = IOStatus::Queued;  ///< Guarded by mutex
+    std::exception_ptr exception;        ///< Guarded by mutex
+    std::string error;                   ///< Guarded by mutex
+    std::atomic<float> progress{0.0f};
+    std::atomic<bool> cancel_requested{false};
+    std::optional<ps::core::ImageDocument> document;  ///< Load result
+    IOCallbacks callbacks;
+  };
+
+  explicit IOTask(std::shared_ptr<State> state) : state_(std::move(state)) {}
+
+  /**
+   * @brief Blocks until done and rethrows a failure or cancellation
+   */
+  void rethrow_failure() const;
+
+  /**
+   * @brief Queues an operation on the IOWorkerPool
+   * @param body The operation; receives a progress reporter to call with
+   *             the fraction done, which throws IOCancelled once cancel()
+   *             has been called
+   */
+  static std::shared_ptr<State> submit(
+      IOCallbacks callbacks,
+      std::function<void(State& state, const std::function<void(float)>& report)> body);
+
+  std::shared_ptr<State> state_;
+
+  friend class ImageIO;
+};
+
+/**
+ * @brief Handle to a document loading in the background
+ *
+ * Example usage:
+ * @code
+ *   LoadTask task = io.load_async("photo.png");
+ *   // ... keep the UI responsive, poll task.progress() ...
+ *   ImageDocument document = task.take();
+ * @endcode
+ */
+class LoadTask : public IOTask {
+ public:
+  LoadTask() = default;
+
+  /**
+   * @brief Waits for the load and moves the document out
+   *
+   * Throws the format's exception on failure and IOCancelled after
+   * cancellation. The document can be taken once.
+   */
+  ps::core::ImageDocument take();
+
+ private:
+  explicit LoadTask(std::shared_ptr<State> state) : IOTask(std::move(state)) {}
+  friend class ImageIO;
+};
+
+/**
+ * @brief Handle to a document saving in the background
+ */
+class SaveTask : public IOTask {
+ public:
+  SaveTask() = default;
+
+  /**
+   * @brief Waits for the save; throws like LoadTask::take()
+   */
+  void get() const;
+
+ private:
+  explicit SaveTask(std::shared_ptr<State> state) : IOTask(std::move(state)) {}
+  friend class ImageIO;
+};
+
+}  // namespace ps::io
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ps::io {
+
+/**
+ * @brief Worker threads that run file loads and saves off the UI thread
+ *
+ * Unlike core::ThreadPool, which splits one loop across all cores, this
+ * pool runs independent jobs, one per thread, in submission order. A few
+ * threads are enough to keep several files loading at once while disk and
+ * decoder time overlap; the decoders themselves may still use the
+ * ThreadPool.
+ *
+ * When the pool is destroyed, running jobs finish and jobs that never
+ * started are called with cancelled set, so their waiters are released.
+ *
+ * Example usage:
+ * @code
+ *   IOWorkerPool::instance().submit([](bool cancelled) {
+ *     if (!cancelled) load_file();
+ *   });
+ * @endcode
+ */
+class IOWorkerPool {
+ public:
+  /// Upper bound on the number of worker threads
+  static constexpr std::size_t kMaxThreads = 4;
+
+  /// A queued job; cancelled is true if the pool shut down before it ran
+  using Job = std::function<void(bool cancelled)>;
+
+  /**
+   * @brief Returns the process-wide I/O pool
+   */
+  static IOWorkerPool& instance();
+
+  /**
+   * @brief Starts min(kMaxThreads, hardware threads) workers, at least two
+   */
+  IOWorkerPool();
+
+  /**
+   * @brief Finishes running jobs and cancels queued ones
+   */
+  ~IOWorkerPool();
+
+  IOWorkerPool(const IOWorkerPool&) = delete;
+  IOWorkerPool& operator=(const IOWorkerPool&) = delete;
+
+  /**
+   * @brief Queues a job to run on the next free worker
+   */
+  void submit(Job job);
+
+  /**
+   * @brief Returns the number of worker threads
+   */
+  std::size_t thread_count() const { return workers_.size(); }
+
+ private:
+  void worker_main();
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Job> jobs_;
+  bool stop_ = false;
+  std::vector<std::thread> workers_;
+};
+
+}  // namespace ps::io
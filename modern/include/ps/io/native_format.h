@@ -0,0 +1,72 @@
+#pragma once
+
+#include "ps/io/image_format.h"
+
+namespace ps::io {
+
+/**
+ * @brief The editor's own layered, tiled document format (.psn)
+ *
+ * A native file keeps everything PNG flattens away: channels, layers with
+ * their name, visibility, opacity and blend mode, the layer format, the
+ * active layer and the selection. Pixels are stored as one zlib blob per
+ * ImageBuffer::kTileSize tile, addressed by a tile index at the end of the
+ * file:
+ *
+ *   header (magic, version, index offset) | tile blobs ... | index
+ *
+ * Opening a file memory-maps it and reads only the index; every tile
+ * becomes a core::Tile backed by the mapping and is decoded the first time
+ * something touches its pixels. Opening therefore costs the same for a
+ * small image and a multi-gigabyte layered document.
+ *
+ * Saving back to the file a document was opened from is incremental: tiles
+ * whose pixels still match the file keep their blobs, only changed tiles
+ * are compressed (on the ThreadPool) and appended, and a new index is
+ * written before the header is pointed at it. Once more than half of the
+ * file is unreferenced blobs, or when saving anywhere else, the file is
+ * rewritten through a temporary file and renamed into place. After a save
+ * the document's tiles refer to the saved file, so unchanged tiles can be
+ * dropped from memory and the next save only writes what changed.
+ *
+ * Samples are stored in the machine's byte order; files from a machine of
+ * the other byte order are rejected.
+ */
+class NativeFormat : public ImageFormat {
+ public:
+  std::string name() const override;
+  bool can_read(const std::string& path) const override;
+  bool can_write(const std::string& path,
+                 const ps::core::ImageDocument& document) const override;
+  bool can_read_signature(const std::uint8_t* header, std::size_t size) const override;
+
+  /**
+   * @brief Reads the header and the document fields of the index
+   */
+  ImageInfo probe(const std::string& path) const override;
+
+  using ImageFormat::load;
+  using ImageFormat::save;
+
+  /**
+   * @brief Opens a native file, decoding tiles lazily
+   *
+   * Channels and layers always use the tiled layout, whatever
+   * options.layout says, since that is what lets tiles load on demand.
+   * options.progress is called once, with the whole image, after the index
+   * is read.
+   */
+  ps::core::ImageDocument load(const std::string& path,
+                               const LoadOptions& options) const override;
+
+  /**
+   * @brief Writes the document, incrementally when possible
+   *
+   * Uses options.compression_level for new tiles. Progress reports the
+   * share of tiles written as a band of rows from the top.
+   */
+  void save(const std::string& path, const ps::core::ImageDocument& document,
+            const SaveOptions& options) const override;
+};
+
+}  // namespace ps::io
@@ -10,10 +10,49 @@ class PNGFormat : public ImageFormat {
   bool can_read(const std::string& path) const override;
   bool can_write(const std::string& path,
                  const ps::core::ImageDocument& document) const override;
+  bool can_read_signature(const std::uint8_t* header, std::size_t size) const override;
 
-  ps::core::ImageDocument load(const std::string& path) const override;
-  void save(const std::string& path,
-            const ps::core::ImageDocument& document) const override;
+  /**
+   * @brief Reads the IHDR and the chunks before the first IDAT
+   */
+  ImageInfo probe(const std::string& path) const override;
+
+  /**
+   * @brief Reduces rows as they are decoded, without a full-size image
+   *
+   * For interlaced files only the first Adam7 pass (1/8 scale) is decoded
+   * when it is large enough for the thumbnail.
+   */
+  ps::core::ImageDocument load_thumbnail(const std::string& path, int max_edge) const override;
+
+  using ImageFormat::load;
+  using ImageFormat::save;
+
+  /**
+   * @brief Decodes a PNG row by row straight into the document's channels
+   *
+   * Samples keep their bit depth: 16-bit files load into Gray16 channels.
+   * Palette images expand to RGB and transparency to an alpha channel;
+   * gray below 8 bits expands to Gray8. Progress is reported every
+   * ImageBuffer::kTileSize rows, once per pass for interlaced files.
+   */
+  ps::core::ImageDocument load(const std::string& path,
+                               const LoadOptions& options) const override;
+  /**
+   * @brief Encodes the document's channels row by row
+   *
+   * Gray8 or Gray16 planes become gray or RGB samples, plus alpha when the
+   * mode's channels are followed by one more of the same format; a single
+   * RGB8 or RGBA8 channel is written as is.
+   *
+   * Rows are filtered and deflated in blocks of about 256 KB on the
+   * ThreadPool; the blocks' raw deflate streams, each primed with the end
+   * of the block before, are joined into one zlib stream with a combined
+   * Adler-32. The file does not depend on the thread count. Progress is
+   * reported after each batch of blocks is written.
+   */
+  void save(const std::string& path, const ps::core::ImageDocument& document,
+            const SaveOptions& options) const override;
 };
 
 }  // namespace ps::io
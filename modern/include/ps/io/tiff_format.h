@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+
+#include "ps/io/image_format.h"
+
+namespace ps::io {
+
+/**
+ * @brief TIFF compression schemes, with their Compression tag values
+ */
+enum class TIFFCompression : std::uint16_t {
+  None = 1,
+  LZW = 5,
+  Deflate = 8,
+  PackBits = 32773,
+};
+
+/**
+ * @brief How TIFFFormat writes files
+ *
+ * Counterpart of the original's TIFF options dialog, which chose the byte
+ * order and whether to compress with LZW. Files are always written in the
+ * machine's byte order, so 16-bit samples need no swapping.
+ */
+struct TIFFWriteOptions {
+  TIFFCompression compression = TIFFCompression::LZW;
+  /// Tile edge in pixels, a multiple of 16; 0 writes strips instead
+  int tile_size = 0;
+  /// Apply horizontal differencing (Predictor 2) before LZW or Deflate
+  bool predictor = true;
+};
+
+/**
+ * @brief Baseline TIFF reader and writer (port of TTIFFormat)
+ *
+ * Reads the first image of classic and BigTIFF files in either byte order:
+ * 1-bit bilevel, 8- and 16-bit gray, RGB, CMYK and 8-bit palette images,
+ * chunky or planar, in strips or tiles, uncompressed or compressed with
+ * LZW, PackBits or Deflate, with or without horizontal differencing.
+ * Samples past the color ones load as extra channels.
+ *
+ * The file is memory-mapped and its strips or tiles are decoded in
+ * parallel on the ThreadPool, a batch of rows at a time, then copied into
+ * the document's channels. Uncompressed strips are split into smaller
+ * pieces so that a single-strip file decodes in parallel too.
+ */
+class TIFFFormat : public ImageFormat {
+ public:
+  explicit TIFFFormat(TIFFWriteOptions write_options = {});
+
+  std::string name() const override;
+  bool can_read(const std::string& path) const override;
+  bool can_write(const std::string& path,
+                 const ps::core::ImageDocument& document) const override;
+  bool can_read_signature(const std::uint8_t* header, std::size_t size) const override;
+
+  /**
+   * @brief Reads the first image's directory and its strip or tile tables
+   */
+  ImageInfo probe(const std::string& path) const override;
+
+  /**
+   * @brief Decodes the smallest suitable image and reduces it band by band
+   *
+   * A reduced-resolution image later in the file (NewSubfileType 1) that
+   * is at least as large as the thumbnail is decoded in place of the main
+   * one. Strips or tiles are decoded a batch at a time and fed to a
+   * ThumbnailBuilder, so the full-size image is never held.
+   */
+  ps::core::ImageDocument load_thumbnail(const std::string& path, int max_edge) const override;
+
+  using ImageFormat::load;
+  using ImageFormat::save;
+
+  /**
+   * @brief Decodes the first image straight into the document's channels
+   *
+   * 16-bit files load into Gray16 channels, everything else into Gray8;
+   * palette images expand to RGB. Progress is reported after each batch of
+   * strips or tile rows.
+   */
+  ps::core::ImageDocument load(const std::string& path,
+                               const LoadOptions& options) const override;
+
+  /**
+   * @brief Encodes the document's channels as chunky TIFF samples
+   *
+   * The channels are chosen as for PNG: the mode's Gray8 or Gray16 planes
+   * plus any following planes of the same format as extra samples (the
+   * first marked as alpha), or a single RGB8, RGBA8 or CMYK8 channel.
+   * Strips of about 256 KB, or tiles, are compressed in parallel and
+   * written in order, so the file does not depend on the thread count.
+   * options.compression_level applies to Deflate. Files that could pass
+   * 4 GB are written as BigTIFF.
+   */
+  void save(const std::string& path, const ps::core::ImageDocument& document,
+            const SaveOptions& options) const override;
+
+ private:
+  TIFFWriteOptions write_options_;
+};
+
+}  // namespace ps::io
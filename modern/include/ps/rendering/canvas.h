@@ -7,6 +7,7 @@
 
 #include "ps/core/image_document.h"
 #include "ps/core/selection_mask.h"
+#include "ps/rendering/mip_pyramid.h"
 #include "ps/rendering/viewport.h"
 
 namespace ps::rendering {
@@ -120,6 +121,14 @@ struct SelectionOverlay {
   const core::SelectionMask* mask = nullptr; ///< Selection mask to render
 };
 
+/**
+ * @brief How the canvas samples document pixels between screen pixels
+ */
+enum class SampleFilter {
+  Nearest,  ///< Nearest document pixel (sharp; exact at integer zooms)
+  Bilinear  ///< Weighted blend of the four nearest document pixels
+};
+
 /**
  * @brief Renders image documents to screen buffers with viewport transformations
  *
@@ -133,9 +142,18 @@ struct SelectionOverlay {
  *
  * The rendering pipeline is:
  * 1. Render background (checkerboard or solid color)
- * 2. Composite image channels through viewport transform
+ * 2. Composite image channels, or the document's cached layer composite,
+ *    through viewport transform
  * 3. Optionally render selection overlay
  *
+ * The viewport transform is evaluated once per screen row and column per
+ * frame, which yields the run of screen pixels over the image and the
+ * document pixel each one samples. Every document row is read once per
+ * frame as a span and each screen row is then a table lookup plus one
+ * blend of the run; rows are rendered on the ThreadPool. Below 100% zoom
+ * the layer composite is sampled from a MipPyramid level instead of full
+ * resolution.
+ *
  * Example usage:
  * @code
  *   Canvas canvas;
@@ -193,6 +211,32 @@ class Canvas {
                           CanvasBuffer& buffer,
                           const SelectionOverlay& overlay);
 
+  /**
+   * @brief Re-renders part of the canvas buffer
+   * @param doc Source document to render
+   * @param buffer Destination buffer holding a previous render
+   * @param overlay Selection overlay configuration
+   * @param area Screen rectangle to refresh; clipped to the buffer
+   *
+   * Pixels outside @p area are left as they are, so this is only valid
+   * when nothing but the pixels inside @p area changed since the previous
+   * render of @p buffer, e.g. after painting. The viewport and overlay
+   * must be the same as for that render.
+   */
+  void render_region(const core::ImageDocument& doc, CanvasBuffer& buffer,
+                     const SelectionOverlay& overlay, const core::Rect& area);
+
+  /**
+   * @brief Returns the screen rectangle that shows a changed image area
+   * @param image_area Area in document pixels, e.g. from
+   *                   ImageDocument::damage_since()
+   * @param buffer Buffer the canvas renders into
+   * @return Screen rectangle clipped to @p buffer; covers the mip blocks and
+   *         filter taps that depend on @p image_area
+   */
+  core::Rect screen_rect_for(const core::Rect& image_area,
+                             const CanvasBuffer& buffer) const;
+
   /**
    * @brief Sets the background color for areas outside the image
    * @param color New background color
@@ -219,20 +263,35 @@ class Canvas {
    */
   bool checkerboard_enabled() const { return checkerboard_enabled_; }
 
+  /**
+   * @brief Sets how document pixels are sampled
+   * @param filter Nearest (default) or Bilinear
+   */
+  void set_sample_filter(SampleFilter filter) { sample_filter_ = filter; }
+
+  /**
+   * @brief Returns how document pixels are sampled
+   */
+  SampleFilter sample_filter() const { return sample_filter_; }
+
  private:
   Viewport viewport_;
   RGBAPixel background_color_{128, 128, 128, 255};
   bool checkerboard_enabled_ = true;
+  SampleFilter sample_filter_ = SampleFilter::Nearest;
+  MipPyramid pyramid_;
 
-  void render_background(CanvasBuffer& buffer);
-  void render_checkerboard(CanvasBuffer& buffer, int checker_size = 8);
-  void render_image(const core::ImageDocument& doc, CanvasBuffer& buffer);
-  void render_layers(const core::ImageDocument& doc, CanvasBuffer& buffer);
+  void render_background(CanvasBuffer& buffer, const core::Rect& area);
+  void render_checkerboard(CanvasBuffer& buffer, const core::Rect& area,
+                           int checker_size = 8);
+  void render_image(const core::ImageDocument& doc, CanvasBuffer& buffer,
+                    const core::Rect& area);
+  void render_layers(const core::ImageDocument& doc, CanvasBuffer& buffer,
+                     const core::Rect& area);
   void render_selection_overlay(CanvasBuffer& buffer,
-                                const SelectionOverlay& overlay);
+                                const SelectionOverlay& overlay,
+                                const core::Rect& area);
 
-  RGBAPixel sample_image(const core::ImageDocument& doc, float x, float y);
-  RGBAPixel sample_layer(const core::Layer& layer, float x, float y);
   RGBAPixel blend_pixels(RGBAPixel bottom, RGBAPixel top);
 };
 
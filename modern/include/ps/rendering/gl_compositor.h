@@ -0,0 +1,123 @@
+#pragma once
+
+#include <memory>
+
+#include "ps/core/image_document.h"
+#include "ps/rendering/canvas.h"
+
+namespace ps::rendering {
+
+/**
+ * @brief OpenGL backend for Canvas that composites layers on the GPU
+ *
+ * GlCompositor keeps every layer of a document in textures and blends the
+ * layer stack with fragment shaders that follow the formulas of
+ * layer_blend.cpp for all twelve blend modes: the straight-alpha formula
+ * for RGBA8 layers and the separable premultiplied formula for
+ * RGBA8Premul and RGBA16Premul. The result is drawn through the Canvas
+ * viewport, background and sample filter, with the selection outline,
+ * into a texture the host displays directly.
+ *
+ * Documents are split into tiles of up to kTileSize pixels per axis, each
+ * with its own textures, so large documents stay within the texture size
+ * limit. Pixel changes reported through ImageDocument::mark_dirty() are
+ * synchronized with sub-image uploads and only the damaged tile areas are
+ * recomposited. Layer property or stack changes recomposite everything.
+ * Below 100% zoom, tiles are sampled from mipmaps instead of a MipPyramid.
+ *
+ * Canvas remains the reference implementation and the backend for
+ * headless use and channel-only documents. Results agree with it within a
+ * few levels per channel; ColorDodge and ColorBurn on RGBA8Premul layers
+ * differ more, because the GPU recovers straight colors at full precision.
+ *
+ * All methods must be called with the same OpenGL context current. The
+ * context needs OpenGL 2.0 with GLSL 1.20 and framebuffer objects (core,
+ * ARB or EXT).
+ *
+ * Example usage:
+ * @code
+ *   GlCompositor compositor;
+ *   if (compositor.initialize(SDL_GL_GetProcAddress)) {
+ *     compositor.render(doc, canvas, overlay, width, height);
+ *     ImGui::Image(compositor.texture(), size);
+ *   }
+ * @endcode
+ */
+class GlCompositor {
+ public:
+  /// Returns the address of an OpenGL function, or nullptr if unavailable
+  using ProcLoader = void* (*)(const char* name);
+
+  /// Maximum tile width and height in document pixels
+  static constexpr int kTileSize = 2048;
+
+  GlCompositor();
+
+  /**
+   * @brief Releases GPU resources; the context must still be current
+   */
+  ~GlCompositor();
+
+  GlCompositor(const GlCompositor&) = delete;
+  GlCompositor& operator=(const GlCompositor&) = delete;
+
+  /**
+   * @brief Loads OpenGL entry points and compiles the shaders
+   * @param loader Function lookup of the current context, such as
+   *               SDL_GL_GetProcAddress
+   * @return false if the context lacks a required feature; the caller
+   *         should keep using Canvas
+   * @throw std::runtime_error if a shader fails to compile or link
+   */
+  bool initialize(ProcLoader loader);
+
+  /**
+   * @brief Returns true after a successful initialize()
+   */
+  bool initialized() const;
+
+  /**
+   * @brief Deletes all textures, framebuffers and programs
+   *
+   * initialize() must be called again before the next render().
+   */
+  void release();
+
+  /**
+   * @brief Composites a document and draws it into texture()
+   * @param doc Document with at least one layer
+   * @param canvas Supplies viewport, background and sample filter
+   * @param overlay Selection outline, drawn like Canvas draws it
+   * @param width Width of the output in pixels
+   * @param height Height of the output in pixels
+   * @throw std::logic_error if not initialized
+   * @throw std::invalid_argument if @p doc has no layers
+   * @throw std::runtime_error if a framebuffer cannot be created
+   *
+   * Only layer pixels changed since the previous call are uploaded and
+   * recomposited. Leaves framebuffer 0 and program 0 bound.
+   */
+  void render(const core::ImageDocument& doc, const Canvas& canvas,
+              const SelectionOverlay& overlay, int width, int height);
+
+  /**
+   * @brief Returns the RGBA8 texture holding the last render(), or 0
+   *
+   * Row 0 of the texture is the top row of the canvas.
+   */
+  unsigned int texture() const;
+
+  /**
+   * @brief Copies the last render() back into a CPU buffer
+   * @param buffer Resized to the render size
+   *
+   * Slow; meant for comparing against Canvas.
+   */
+  void read_back(CanvasBuffer& buffer) const;
+
+ private:
+  struct Impl;
+  std::unique_ptr<Impl> impl_;
+};
+
+}  // namespace ps::rendering
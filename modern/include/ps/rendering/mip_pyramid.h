@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "ps/core/image_document.h"
+
+namespace ps::rendering {
+
+/**
+ * @brief Box-filtered reduced copies of a document's layer composite
+ *
+ * Level 0 is ImageDocument::composite() itself. Level k has
+ * ceil(size / 2^k) pixels per axis, and each of its pixels is the average
+ * of a 2×2 block of level k - 1 (edge pixels repeat at odd sizes). Levels
+ * are RGBA8Premul, so averaging weights colors by coverage, as a filter on
+ * premultiplied data must.
+ *
+ * Levels are built on first use and then kept in step with the document:
+ * update() collects the damage reported through ImageDocument::mark_dirty()
+ * and the next level() call recomputes only the affected blocks of that
+ * level and the ones below it. A full composite rebuild (layer properties,
+ * stack changes) rebuilds the levels.
+ *
+ * Example usage:
+ * @code
+ *   MipPyramid pyramid;
+ *   pyramid.update(doc);
+ *   const int index = std::min(MipPyramid::level_for_zoom(zoom),
+ *                              pyramid.level_count() - 1);
+ *   const core::ImageBuffer& level = pyramid.level(index);
+ * @endcode
+ */
+class MipPyramid {
+ public:
+  /**
+   * @brief Returns the finest level that is not magnified at @p zoom
+   *
+   * That is the largest k with 2^k <= 1 / zoom, or 0 when zoom >= 1.
+   */
+  static int level_for_zoom(float zoom);
+
+  /**
+   * @brief Synchronizes with the document's current composite
+   * @param doc Document whose composite() is reduced
+   *
+   * Cheap when nothing changed. Switching to another document, or a change
+   * of size or layer format, discards all levels.
+   */
+  void update(const core::ImageDocument& doc);
+
+  /**
+   * @brief Returns the number of levels including level 0
+   *
+   * Levels run down to a 1×1 image. Zero before the first update().
+   */
+  int level_count() const { return base_ ? static_cast<int>(levels_.size()) + 1 : 0; }
+
+  /**
+   * @brief Returns a level, bringing it and the ones above it up to date
+   * @param index 0 for the composite itself, up to level_count() - 1
+   * @throw std::out_of_range if @p index is invalid
+   */
+  const core::ImageBuffer& level(int index);
+
+  /**
+   * @brief Releases all levels
+   */
+  void clear();
+
+ private:
+  struct Level {
+    core::ImageBuffer buffer{core::Size{}, core::PixelFormat::RGBA8Premul};
+    core::Rect pending{};  ///< Area still to be recomputed from the level above
+  };
+
+  void reduce(const core::ImageBuffer& source, Level& target);
+
+  const core::ImageDocument* document_ = nullptr;
+  const core::ImageBuffer* base_ = nullptr;
+  core::Size size_{};
+  core::PixelFormat format_ = core::PixelFormat::RGBA8;
+  std::uint64_t generation_ = 0;
+  std::uint64_t revision_ = 0;
+  std::vector<Level> levels_;  ///< Level k is levels_[k - 1]
+};
+
+}  // namespace ps::rendering
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ps/core/image_document.h"
+#include "ps/rendering/canvas.h"
+
+namespace ps::rendering {
+
+/**
+ * @brief Renders a Canvas on a worker thread into a double-buffered CanvasBuffer
+ *
+ * submit() snapshots the document, the canvas settings and the selection
+ * overlay on the calling thread and returns at once. The worker renders the
+ * snapshot into a back buffer, and present() swaps it with front() when it
+ * is complete, so the UI thread keeps handling input while a heavy
+ * composite runs.
+ *
+ * The worker owns a copy of the document with its own composite cache and
+ * MipPyramid. After the first submit, only the buffers the document
+ * reports damaged are sent, and of a contiguous buffer only the damaged
+ * rectangle is copied; the worker pastes it into its copy, so pixel edits
+ * are rendered incrementally as with Canvas::render_region() and a stroke
+ * costs the UI thread a copy of its damage. A tiled buffer is sent whole,
+ * sharing its tiles: a tool that writes into a tile the worker still reads
+ * clones it first, so strokes never race with the render. Whole buffers
+ * are copied again only when the layer stack, the document size or the
+ * channel formats change. The selection mask is copied when its revision
+ * changes.
+ *
+ * When only the view changed (zoom, pan or size) and the previous full
+ * render took longer than kPreviewThresholdMs, the worker first presents a
+ * preview reprojected from the frame on screen, then the full render.
+ *
+ * All methods except the constructor and destructor must be called from
+ * the same thread, normally the UI thread.
+ *
+ * Example usage:
+ * @code
+ *   RenderThread renderer;
+ *   // each UI frame:
+ *   renderer.submit(doc, canvas, overlay, width, height);
+ *   core::Rect area;
+ *   if (renderer.present(area)) {
+ *     upload(renderer.front(), area);
+ *   }
+ * @endcode
+ */
+class RenderThread {
+ public:
+  /// Full renders slower than this get a reprojected preview on view changes
+  static constexpr double kPreviewThresholdMs = 20.0;
+
+  /**
+   * @brief Starts the worker thread
+   */
+  RenderThread();
+
+  /**
+   * @brief Stops the worker thread after its current render
+   */
+  ~RenderThread();
+
+  RenderThread(const RenderThread&) = delete;
+  RenderThread& operator=(const RenderThread&) = delete;
+
+  /**
+   * @brief Queues a render of the current state
+   * @param doc Document to render; may be edited as soon as this returns
+   * @param canvas Supplies viewport, background and sample filter
+   * @param overlay Selection outline to draw
+   * @param width Width of the output in pixels
+   * @param height Height of the output in pixels
+   *
+   * Does nothing if nothing changed since the previous submit(). A request
+   * the worker has not started yet is replaced.
+   */
+  void submit(const core::ImageDocument& doc, const Canvas& canvas,
+              const SelectionOverlay& overlay, int width, int height);
+
+  /**
+   * @brief Makes a finished frame the front buffer
+   * @param area Receives the screen rectangle in which front() changed
+   * @return false if no new frame is ready
+   * @throw Rethrows an exception thrown by the last render
+   */
+  bool present(core::Rect& area);
+
+  /**
+   * @brief Returns the last presented frame
+   *
+   * Valid until the next present().
+   */
+  const CanvasBuffer& front() const { return front_; }
+
+  /**
+   * @brief Returns true while a render is queued, running or unpresented
+   */
+  bool busy() const;
+
+  /**
+   * @brief Runs a function while the worker is guaranteed not to render
+   * @param fn Function to run, e.g. TileCache::trim()
+   * @return false without running @p fn if the worker is rendering
+   */
+  bool try_run_idle(const std::function<void()>& fn);
+
+ private:
+  struct Job;
+
+  // State of the last frame the worker rendered
+  struct Shown {
+    const core::ImageDocument* document = nullptr;
+    std::uint64_t composite_generation = 0;
+    std::uint64_t damage_revision = 0;
+    std::uint64_t mask_revision = 0;
+    float zoom = 0.0f;
+    ViewportPoint pan{};
+    int width = 0;
+    int height = 0;
+    RGBAPixel background{};
+    bool checkerboard = false;
+    SampleFilter filter = SampleFilter::Nearest;
+    bool overlay_enabled = false;
+    RGBAPixel overlay_color{};
+    int animation_frame = 0;
+    bool preview = false;  ///< Reprojected; needs a full render
+    bool valid = false;
+  };
+
+  // What the UI thread last submitted, to skip unchanged submits
+  struct Submitted {
+    const core::ImageDocument* document = nullptr;
+    core::Size size{};
+    core::PixelFormat format = core::PixelFormat::RGBA8;
+    core::StorageLayout layout = core::StorageLayout::Contiguous;
+    std::vector<std::uint64_t> layer_revisions;
+    std::vector<const core::Layer*> layers;
+    std::vector<core::PixelFormat> channel_formats;
+    int active_layer = -1;
+    std::uint64_t damage_revision = 0;
+    std::uint64_t mask_revision = 0;  ///< Revision of the worker's mask copy
+    bool mask_sent = false;
+    float zoom = 0.0f;
+    ViewportPoint pan{};
+    int width = 0;
+    int height = 0;
+    RGBAPixel background{};
+    bool checkerboard = false;
+    SampleFilter filter = SampleFilter::Nearest;
+    bool overlay_enabled = false;
+    RGBAPixel overlay_color{};
+    int animation_frame = 0;
+    bool valid = false;
+  };
+
+  void run();
+  void apply(std::unique_ptr<Job> job);
+  core::Rect render(const core::Rect& carry);  ///< Returns the changed area
+  void reproject(const Shown& from);
+
+  // Worker-only state
+  std::unique_ptr<core::ImageDocument> document_;
+  std::shared_ptr<const core::SelectionMask> mask_;
+  std::unique_ptr<Job> view_;  ///< Settings of the latest applied job
+  Canvas canvas_;
+  CanvasBuffer back_;
+  Shown shown_;
+  double full_render_ms_ = 0.0;
+
+  // Swapped by present() only while no render runs; the worker reads it
+  // for previews
+  CanvasBuffer front_;
+
+  // UI-thread-only state
+  Submitted submitted_;
+
+  // Shared state, guarded by mutex_
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::unique_ptr<Job> pending_;
+  bool refine_ = false;  ///< The last frame was a preview
+  bool rendering_ = false;
+  bool ready_ = false;   ///< back_ holds a frame that present() has not taken
+  core::Rect ready_area_{};
+  core::Rect carry_{};   ///< Area in which back_ lags behind front_
+  std::exception_ptr error_;
+  bool stop_ = false;
+
+  std::thread worker_;
+};
+
+}  // namespace ps::rendering
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "ps/core/image_document.h"
+#include "ps/tools/tool.h"
+
+namespace ps::tools {
+
+/**
+ * @brief Precomputed coverage of a round dab with a hardness falloff
+ *
+ * Holds one 8-bit coverage value for every pixel of the (2 * radius + 1)^2
+ * square around the dab center: 255 inside the hard core, falling linearly
+ * to 0 at the radius. Each row also records the columns
+ * with non-zero coverage, so StrokeScratch::add_dab() skips the empty
+ * corners.
+ */
+class DabStamp {
+ public:
+  /**
+   * @brief Computes the coverage of a dab
+   * @param radius Radius in pixels, at least 1
+   * @param hardness Edge hardness (0=soft, 100=hard)
+   */
+  DabStamp(int radius, int hardness);
+
+  int radius() const { return radius_; }
+  int hardness() const { return hardness_; }
+
+  /**
+   * @brief Returns the coverage of a row, indexed by dx + radius()
+   * @param dy Row offset from the center, in [-radius(), radius()]
+   */
+  const std::uint8_t* row(int dy) const {
+    return coverage_.data() +
+           static_cast<std::size_t>(dy + radius_) * (2 * radius_ + 1);
+  }
+
+  /**
+   * @brief Returns the first dx of a row with non-zero coverage
+   */
+  int row_begin(int dy) const { return spans_[dy + radius_].begin; }
+
+  /**
+   * @brief Returns one past the last dx of a row with non-zero coverage
+   */
+  int row_end(int dy) const { return spans_[dy + radius_].end; }
+
+ private:
+  struct Span {
+    int begin = 0;
+    int end = 0;
+  };
+
+  int radius_;
+  int hardness_;
+  std::vector<std::uint8_t> coverage_;
+  std::vector<Span> spans_;
+};
+
+/**
+ * @brief Process-wide cache of recently used dab stamps
+ *
+ * A stroke uses one stamp for all of its dabs, so a small cache keyed by
+ * (radius, hardness) removes the per-pixel square root and falloff from
+ * painting. Returned stamps stay valid after they are evicted. Thread-safe.
+ */
+class DabStampCache {
+ public:
+  /// Number of stamps kept; the least recently used one is evicted
+  static constexpr std::size_t kCapacity = 8;
+
+  static DabStampCache& instance();
+
+  /**
+   * @brief Returns the stamp for a radius and hardness, computing it once
+   * @param radius Radius in pixels, at least 1
+   * @param hardness Edge hardness (0=soft, 100=hard)
+   */
+  std::shared_ptr<const DabStamp> get(int radius, int hardness);
+
+ private:
+  DabStampCache() = default;
+
+  std::mutex mutex_;
+  std::vector<std::shared_ptr<const DabStamp>> stamps_;  ///< Most recent first
+};
+
+/**
+ * @brief Returns the part of a dab's square that lies inside the document
+ * @param size Document size
+ * @param center Dab center
+ * @param radius Dab radius in pixels
+ * @return Clipped area, empty if the dab misses the document
+ */
+Rect dab_area(core::Size size, Point center, int radius);
+
+/**
+ * @brief Returns the distance between dabs for a tool's size and spacing
+ * @return options.spacing percent of options.size, at least one pixel
+ */
+float dab_spacing(const ToolOptions& options);
+
+/**
+ * @brief Places dabs at a fixed distance along a stroke path
+ *
+ * Mouse events arrive at irregular distances: fast strokes would leave gaps
+ * between dabs at the event positions and slow strokes would pile dabs onto
+ * each other. DabSpacer walks the polyline through the events instead and
+ * places a dab every @c spacing pixels of path length, carrying the
+ * distance left over at the end of one segment into the next. The result
+ * depends only on the path, not on how often it was sampled.
+ *
+ * Example usage:
+ * @code
+ *   spacer.reset(pt);
+ *   place_dab(pt);
+ *   // on each mouse move:
+ *   spacer.advance(pt, dab_spacing(options), place_dab);
+ * @endcode
+ */
+class DabSpacer {
+ public:
+  /**
+   * @brief Starts a path at a point; the caller places its first dab
+   */
+  void reset(Point pt) {
+    x_ = static_cast<float>(pt.x);
+    y_ = static_cast<float>(pt.y);
+    travelled_ = 0.0f;
+  }
+
+  /**
+   * @brief Extends the path to a point, placing the dabs along the way
+   * @param to End of the new segment
+   * @param spacing Distance between dabs in pixels, greater than 0
+   * @param place Called with the center of each dab, in path order
+   */
+  template <typename PlaceDab>
+  void advance(Point to, float spacing, PlaceDab&& place) {
+    const float dx = static_cast<float>(to.x) - x_;
+    const float dy = static_cast<float>(to.y) - y_;
+    const float length = std::sqrt(dx * dx + dy * dy);
+    if (length == 0.0f) {
+      return;
+    }
+
+    // Distance along this segment of the next dab
+    float next = std::max(0.0f, spacing - travelled_);
+    for (; next <= length; next += spacing) {
+      const float t = next / length;
+      place(Point(static_cast<int>(std::lround(x_ + dx * t)),
+                  static_cast<int>(std::lround(y_ + dy * t))));
+    }
+    travelled_ = length - (next - spacing);
+
+    x_ = static_cast<float>(to.x);
+    y_ = static_cast<float>(to.y);
+  }
+
+ private:
+  float x_ = 0.0f;
+  float y_ = 0.0f;
+  float travelled_ = 0.0f;  ///< Path length since the last dab
+};
+
+}  // namespace ps::tools
@@ -1,8 +1,9 @@
 #pragma once
 
 #include <memory>
-#include <vector>
 
+#include "ps/tools/brush_dab.h"
+#include "ps/tools/stroke_scratch.h"
 #include "ps/tools/tool.h"
 
 namespace ps::tools {
@@ -10,24 +11,29 @@ namespace ps::tools {
 /**
  * @brief Command that captures and undoes a brush stroke
  *
- * BrushStrokeCommand saves all affected channels in the affected area
- * before the stroke is applied, allowing full undo/redo functionality.
+ * BrushStrokeCommand saves the pixels under each dab the first time the
+ * stroke touches them (see ImageCommand::save_region()), so starting a
+ * stroke costs the same at any document size. Undo and redo swap the saved
+ * blocks with the document.
  */
 class BrushStrokeCommand : public core::ImageCommand {
  public:
   /**
    * @brief Constructs a brush stroke command
    * @param doc Document being modified
-   * @param affected_area Rectangular region touched by the stroke
    */
-  BrushStrokeCommand(core::ImageDocument& doc, const Rect& affected_area);
+  explicit BrushStrokeCommand(core::ImageDocument& doc);
   ~BrushStrokeCommand() override = default;
 
   void execute() override;
+  void redo() override;
   std::string name() const override { return "Brush Stroke"; }
 
- private:
-  Rect affected_area_;  ///< Bounding box of the stroke
+  /**
+   * @brief Saves the pixels in an area before the stroke modifies it
+   * @param area Region about to be painted
+   */
+  void capture(const Rect& area);
 };
 
 /**
@@ -41,9 +47,12 @@ class BrushStrokeCommand : public core::ImageCommand {
  * - Circular brush shape with distance-based falloff
  * - Full undo/redo via BrushStrokeCommand
  *
- * The brush applies paint by placing overlapping circular "dabs" as the
- * user drags the mouse. Each dab is blended with existing pixels based
- * on opacity and hardness settings.
+ * The brush applies paint by placing overlapping circular "dabs" along
+ * the path the user drags, ToolOptions::spacing percent of the size apart.
+ * Dabs of a cached DabStamp accumulate in a StrokeScratch by maximum
+ * coverage, which is blended into the document by flush_stroke() and
+ * end_stroke(), so a stroke's opacity does not compound where it overlaps
+ * itself.
  *
  * @note Currently paints white; future versions will support color selection
  */
@@ -65,17 +74,11 @@ class BrushTool : public Tool {
   void begin_stroke(core::ImageDocument& doc, Point pt) override;
   void continue_stroke(core::ImageDocument& doc, Point pt) override;
   std::unique_ptr<core::Command> end_stroke(core::ImageDocument& doc) override;
+  void flush_stroke(core::ImageDocument& doc) override;
 
  private:
-  /**
-   * @brief Records a point in the brush stroke with pressure information
-   */
-  struct StrokePoint {
-    Point position;      ///< Location of the point
-    int pressure = 100;  ///< Pressure value (0-100), affects size/opacity
-  };
-
-  std::vector<StrokePoint> stroke_points_;  ///< All points in current stroke
+  DabSpacer spacer_;                        ///< Places dabs along the stroke
+  StrokeScratch scratch_;                   ///< Coverage of the current stroke
   Rect affected_area_;                      ///< Bounding box of modified pixels
   bool stroke_active_ = false;              ///< Whether a stroke is in progress
   std::unique_ptr<BrushStrokeCommand> current_command_;  ///< Command for current stroke
@@ -4,10 +4,42 @@
 #include <memory>
 #include <vector>
 
+#include "ps/tools/brush_dab.h"
+#include "ps/tools/stroke_scratch.h"
 #include "ps/tools/tool.h"
 
 namespace ps::tools {
 
+/**
+ * @brief Undo command shared by the pencil, eraser and paint bucket tools
+ *
+ * Like BrushStrokeCommand, it saves only the pixels each operation is about
+ * to modify, on first touch, and swaps them with the document on undo/redo.
+ */
+class StrokeCommand : public core::ImageCommand {
+ public:
+  /**
+   * @brief Constructs a stroke command
+   * @param doc Document being modified
+   * @param name Name shown in the undo/redo menu
+   */
+  StrokeCommand(core::ImageDocument& doc, std::string name);
+  ~StrokeCommand() override = default;
+
+  void execute() override {}
+  void redo() override;
+  std::string name() const override { return name_; }
+
+  /**
+   * @brief Saves the pixels in an area before the tool modifies it
+   * @param area Region about to be painted
+   */
+  void capture(const Rect& area);
+
+ private:
+  std::string name_;
+};
+
 /**
  * @brief Hard-edged drawing tool for precise lines
  */
@@ -24,11 +56,14 @@ class PencilTool : public Tool {
   void begin_stroke(core::ImageDocument& doc, Point pt) override;
   void continue_stroke(core::ImageDocument& doc, Point pt) override;
   std::unique_ptr<core::Command> end_stroke(core::ImageDocument& doc) override;
+  void flush_stroke(core::ImageDocument& doc) override;
 
  private:
   Rect affected_area_{};
   bool stroke_active_ = false;
-  std::unique_ptr<core::Command> current_command_;
+  std::unique_ptr<StrokeCommand> current_command_;
+  DabSpacer spacer_;
+  StrokeScratch scratch_;
 
   void apply_pencil_dab(core::ImageDocument& doc, Point pt);
   void expand_affected_area(Point pt);
@@ -51,11 +86,14 @@ class EraserTool : public Tool {
   void begin_stroke(core::ImageDocument& doc, Point pt) override;
   void continue_stroke(core::ImageDocument& doc, Point pt) override;
   std::unique_ptr<core::Command> end_stroke(core::ImageDocument& doc) override;
+  void flush_stroke(core::ImageDocument& doc) override;
 
  private:
   Rect affected_area_{};
   bool stroke_active_ = false;
-  std::unique_ptr<core::Command> current_command_;
+  std::unique_ptr<StrokeCommand> current_command_;
+  DabSpacer spacer_;
+  StrokeScratch scratch_;
 
   void apply_eraser_dab(core::ImageDocument& doc, Point pt);
   void expand_affected_area(Point pt);
@@ -81,7 +119,7 @@ class PaintBucketTool : public Tool {
 
  private:
   bool stroke_active_ = false;
-  std::unique_ptr<core::Command> current_command_;
+  std::unique_ptr<StrokeCommand> current_command_;
 };
 
 /**
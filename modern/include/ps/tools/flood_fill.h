@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+
+#include "ps/core/image_document.h"
+#include "ps/tools/tool.h"
+
+namespace ps::tools {
+
+/**
+ * @brief Horizontal run of filled pixels, columns [x0, x1) of row y
+ */
+struct FillSpan {
+  int y = 0;
+  int x0 = 0;
+  int x1 = 0;
+};
+
+/**
+ * @brief Pixels found by flood_fill()
+ */
+struct FloodFillResult {
+  std::vector<FillSpan> spans;  ///< Sorted by row, then column
+  core::Rect bounds{};          ///< Smallest rectangle containing the spans
+};
+
+/**
+ * @brief Finds the pixels whose color is close to that of a seed pixel
+ * @param doc Document whose channels are compared as RGB (grayscale and
+ *            CMYK are converted like the eyedropper converts them; without
+ *            the channels of its mode every pixel reads as black)
+ * @param seed Pixel whose color is matched
+ * @param tolerance Largest sum of absolute RGB differences that matches
+ * @param contiguous If true, only matching pixels connected to the seed
+ *                   through matching 4-neighbours; if false, every matching
+ *                   pixel of the document
+ * @return No spans if the seed lies outside the document
+ *
+ * Colors are compared a row at a time. The contiguous fill marks whole
+ * spans per step and compares each row the first time the fill reaches
+ * it, so large flat regions cost little more than reading their pixels.
+ * The non-contiguous fill compares all rows in parallel on the
+ * ThreadPool. Shared by MagicWandTool and PaintBucketTool.
+ */
+FloodFillResult flood_fill(const core::ImageDocument& doc, Point seed, int tolerance,
+                           bool contiguous = true);
+
+}  // namespace ps::tools
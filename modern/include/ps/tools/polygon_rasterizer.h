@@ -0,0 +1,84 @@
+#pragma once
+
+#include <vector>
+
+#include "ps/core/selection_mask.h"
+#include "ps/tools/tool.h"
+
+namespace ps::tools {
+
+/**
+ * @brief Even-odd scanline rasterizer for a closed polygon built point by point
+ *
+ * The polygon is closed by an edge from the last point back to the first.
+ * Each row keeps an active edge table: the x positions at which edges
+ * cross the row, sorted. Appending a point replaces the closing edge with
+ * two new edges, which only touches the tables of the rows those three
+ * edges span, and update() rewrites only those rows of the mask. The cost
+ * of a new point therefore depends on the rows it affects, not on the
+ * length of the path.
+ *
+ * Rows are sampled at integer y and filled from floor() of an entering
+ * crossing to ceil() of the leaving one, inclusive. Nothing is drawn until
+ * there are three points.
+ *
+ * Example usage:
+ * @code
+ *   PolygonRasterizer lasso;
+ *   lasso.reset(mask.size());
+ *   for (Point pt : path) {
+ *     lasso.add_point(pt);
+ *     lasso.update(mask);
+ *   }
+ * @endcode
+ */
+class PolygonRasterizer {
+ public:
+  /**
+   * @brief Removes all points
+   * @param size Size of the mask that update() writes
+   */
+  void reset(core::Size size);
+
+  /**
+   * @brief Appends a point to the polygon
+   */
+  void add_point(Point pt);
+
+  /**
+   * @brief Returns the number of points added since reset()
+   */
+  std::size_t point_count() const { return points_.size(); }
+
+  /**
+   * @brief Writes the rows changed since the previous update() into a mask
+   * @param mask Mask that holds the rest of the polygon from earlier
+   *             updates; selected pixels are set to 255, others in the
+   *             polygon's column range to 0
+   */
+  void update(core::SelectionMask& mask);
+
+ private:
+  // Crossing of an edge with a row
+  struct Crossing {
+    float x = 0.0f;
+    int edge = 0;  ///< Index of the edge's first point, or kClosingEdge
+  };
+
+  static constexpr int kClosingEdge = -1;
+
+  void add_edge(Point from, Point to, int edge);
+  void remove_edge(Point from, Point to, int edge);
+  void mark_rows(int y0, int y1);
+
+  core::Size size_{};
+  std::vector<Point> points_{};
+  std::vector<std::vector<Crossing>> rows_{};  ///< Sorted by x
+  int left_ = 0;    ///< First column the polygon can fill
+  int right_ = -1;  ///< Last column the polygon can fill
+  int dirty_top_ = 0;
+  int dirty_bottom_ = 0;  ///< Rows [dirty_top_, dirty_bottom_) need rewriting
+  std::vector<std::uint8_t> row_{};
+};
+
+}  // namespace ps::tools
@@ -1,8 +1,7 @@
 #pragma once
 
-#include <vector>
-
 #include "ps/core/selection_command.h"
+#include "ps/tools/polygon_rasterizer.h"
 #include "ps/tools/tool.h"
 
 namespace ps::tools {
@@ -60,11 +59,9 @@ class LassoSelectionTool : public Tool {
   std::unique_ptr<core::Command> end_stroke(core::ImageDocument& doc) override;
 
  private:
-  std::vector<Point> points_{};
+  PolygonRasterizer polygon_{};
   core::SelectionMask before_selection_{};
   bool stroke_active_ = false;
-
-  void update_selection(core::ImageDocument& doc);
 };
 
 /**
@@ -81,7 +78,6 @@ class MagicWandTool : public Tool {
 
  private:
   core::SelectionMask before_selection_{};
-  core::SelectionMask after_selection_{};
   bool stroke_active_ = false;
 };
 
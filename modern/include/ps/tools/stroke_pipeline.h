@@ -0,0 +1,161 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "ps/core/spsc_queue.h"
+#include "ps/tools/tool.h"
+
+namespace ps::tools {
+
+/**
+ * @brief Runs tool strokes on a worker thread fed by a lock-free queue
+ *
+ * The UI thread records input with begin_stroke(), continue_stroke() and
+ * end_stroke(), which push events onto an SpscQueue and return at once;
+ * only end_stroke() waits, for the stroke to finish, and hands back the
+ * tool's undo command. The worker drains the queue and calls the Tool
+ * methods, so painting a large brush no longer stalls the frame that
+ * received the mouse event.
+ *
+ * Input is coalesced on both sides: a move to the position of the
+ * previous event is dropped, and the worker paints everything queued in
+ * one batch under the document lock, then calls Tool::flush_stroke() once.
+ * Tools report damage with ImageDocument::mark_dirty() as usual, so a
+ * batch becomes visible to the canvas as a whole, on the next frame that
+ * takes the lock.
+ *
+ * The document and the tool belong to the worker while it paints. The UI
+ * thread must hold lock_document() whenever it reads or modifies either
+ * one, including rendering, undo and TileCache::trim(). While the UI
+ * thread waits for the lock, the worker stops after the event it is
+ * painting, so a frame waits for at most one event. end_stroke() must be
+ * called without holding the lock.
+ *
+ * Example usage:
+ * @code
+ *   StrokePipeline strokes;
+ *   // each UI frame:
+ *   auto document_lock = strokes.lock_document();
+ *   if (pressed) strokes.begin_stroke(tool, doc, pt);
+ *   if (dragged) strokes.continue_stroke(pt);
+ *   if (released) {
+ *     document_lock.unlock();
+ *     auto cmd = strokes.end_stroke();
+ *     document_lock.lock();
+ *     if (cmd) undo_stack.push(std::move(cmd));
+ *   }
+ * @endcode
+ */
+class StrokePipeline {
+ public:
+  /// Events that fit in the queue; the UI pushes at most a few per frame
+  static constexpr std::size_t kQueueCapacity = 1024;
+
+  /**
+   * @brief Starts the worker thread
+   */
+  StrokePipeline();
+
+  /**
+   * @brief Paints the queued events, then stops the worker thread
+   */
+  ~StrokePipeline();
+
+  StrokePipeline(const StrokePipeline&) = delete;
+  StrokePipeline& operator=(const StrokePipeline&) = delete;
+
+  /**
+   * @brief Queues the start of a stroke
+   * @param tool Tool that paints the stroke; must outlive end_stroke()
+   * @param doc Document to paint on; must outlive end_stroke()
+   * @param pt Position of the first event
+   * @param pressure Pressure (0-100), recorded for pressure-aware tools
+   * @throw std::logic_error if a stroke is already active
+   */
+  void begin_stroke(Tool& tool, core::ImageDocument& doc, Point pt,
+                    int pressure = 100);
+
+  /**
+   * @brief Queues a move of the active stroke
+   *
+   * Ignored if no stroke is active or @p pt repeats the previous position.
+   */
+  void continue_stroke(Point pt, int pressure = 100);
+
+  /**
+   * @brief Ends the active stroke once all of its events are painted
+   * @return The tool's undo command, or nullptr
+   * @throw Rethrows an exception thrown by the tool during the stroke
+   */
+  std::unique_ptr<core::Command> end_stroke();
+
+  /**
+   * @brief Returns true between begin_stroke() and end_stroke()
+   */
+  bool active() const { return active_; }
+
+  /**
+   * @brief Returns true while queued events are not painted yet
+   */
+  bool busy() const;
+
+  /**
+   * @brief Takes the lock that guards the document and the tool
+   */
+  std::unique_lock<std::mutex> lock_document();
+
+ private:
+  struct Event {
+    enum class Type { Begin, Move, End };
+
+    Type type = Type::Move;
+    Tool* tool = nullptr;
+    core::ImageDocument* document = nullptr;
+    Point position;
+    int pressure = 100;
+  };
+
+  void push(const Event& event);
+  void run();
+  void handle(const Event& event);
+  void flush();  ///< Tool::flush_stroke() of the active stroke
+
+  // UI-thread-only state
+  bool active_ = false;
+  Event last_{};  ///< Last pushed event, to drop repeated positions
+
+  // Worker-only state
+  Tool* tool_ = nullptr;
+  core::ImageDocument* document_ = nullptr;
+  std::exception_ptr stroke_error_;
+
+  core::SpscQueue<Event, kQueueCapacity> queue_;
+
+  // Held by the worker while it paints and by the UI thread while it uses
+  // the document; ui_waiting_ asks the worker to let go
+  std::mutex document_mutex_;
+  std::atomic<int> ui_waiting_{0};
+  std::atomic<bool> painting_{false};
+
+  // Wakes the worker, guarded by wake_mutex_
+  std::mutex wake_mutex_;
+  std::condition_variable wake_cv_;
+  bool stop_ = false;
+
+  // Result of the last stroke, guarded by done_mutex_
+  std::mutex done_mutex_;
+  std::condition_variable done_cv_;
+  bool done_ = false;
+  std::unique_ptr<core::Command> command_;
+  std::exception_ptr error_;
+
+  std::thread worker_;
+};
+
+}  // namespace ps::tools
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "ps/core/image_document.h"
+#include "ps/tools/brush_dab.h"
+#include "ps/tools/tool.h"
+
+namespace ps::tools {
+
+/**
+ * @brief Single-channel coverage buffer that accumulates one stroke
+ *
+ * Dabs are not blended into the document one by one. add_dab() only raises
+ * the stroke's coverage to the dab's where the dab is stronger (max
+ * coverage), so overlapping dabs cost one byte per pixel instead of a blend
+ * per channel, and a stroke never gets more opaque than its opacity, no
+ * matter how often it crosses itself. composite() blends the coverage
+ * changed since its last call into every document channel, starting from
+ * the pixels as they were before the stroke:
+ *
+ *   value = original + opacity * coverage * (target - original)
+ *
+ * Coverage is stored in blocks of kBlockSize pixels square, allocated when
+ * a dab first touches them, so the scratch only spans the stroke. Each
+ * block keeps a copy of the original channel pixels under it and the area
+ * changed since the last composite(), which only blends those areas.
+ *
+ * Example usage:
+ * @code
+ *   scratch.begin(doc, opacity, 255);
+ *   scratch.add_dab(*stamp, pt);     // per dab
+ *   scratch.composite();             // per frame, for the preview
+ *   scratch.end();                   // at end_stroke()
+ * @endcode
+ */
+class StrokeScratch {
+ public:
+  /// Width and height of a coverage block in pixels
+  static constexpr int kBlockSize = 64;
+
+  /**
+   * @brief Starts a stroke, discarding any previous one
+   * @param doc Document whose channels the stroke paints; must outlive end()
+   * @param opacity Stroke opacity (0-1)
+   * @param target Value the channels are blended towards
+   */
+  void begin(core::ImageDocument& doc, float opacity, std::uint8_t target);
+
+  /**
+   * @brief Adds a dab to the coverage
+   * @param stamp Coverage of the dab
+   * @param center Dab center
+   * @param flow Scale (0-1) applied to the dab's coverage, e.g. pressure
+   *
+   * The document is not changed until composite(). Callers save the area
+   * for undo before that, using dab_area().
+   */
+  void add_dab(const DabStamp& stamp, Point center, float flow = 1.0f);
+
+  /**
+   * @brief Blends the coverage added since the last call into the document
+   * @return The area written, also reported to ImageDocument::mark_dirty()
+   */
+  core::Rect composite();
+
+  /**
+   * @brief Composites the rest of the stroke and frees the scratch
+   */
+  void end();
+
+  /**
+   * @brief Returns true between begin() and end()
+   */
+  bool active() const { return document_ != nullptr; }
+
+  /**
+   * @brief Returns the bounding box of all dabs since begin()
+   */
+  const core::Rect& bounds() const { return bounds_; }
+
+ private:
+  struct Block {
+    std::vector<std::uint8_t> coverage;  ///< kBlockSize^2 values
+    std::vector<std::vector<std::uint8_t>> original;  ///< Per channel, row-major
+    core::Rect pending{};  ///< Coverage not composited yet, in image coordinates
+  };
+
+  Block& block_at(int column, int row);
+
+  core::ImageDocument* document_ = nullptr;
+  float opacity_ = 1.0f;
+  std::uint8_t target_ = 255;
+  int columns_ = 0;
+  int rows_ = 0;
+  std::vector<std::unique_ptr<Block>> blocks_;  ///< Row-major, null if untouched
+  std::vector<std::size_t> pending_blocks_;  ///< Blocks with pending coverage
+  core::Rect bounds_{};
+  core::Rect pending_{};  ///< Union of the blocks' pending areas
+};
+
+}  // namespace ps::tools
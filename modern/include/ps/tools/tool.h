@@ -36,6 +36,7 @@ struct ToolOptions {
 
   int spacing = 25;      ///< Spacing between dabs (0-100, percentage of size)
   int fadeout = 0;       ///< Fadeout distance in pixels (0 = no fadeout)
+  bool contiguous = true;  ///< Fill tools: only the region connected to the clicked pixel
 };
 
 /**
@@ -156,6 +157,17 @@ class Tool {
    */
   virtual std::unique_ptr<core::Command> end_stroke(core::ImageDocument& doc) = 0;
 
+  /**
+   * @brief Brings the document up to date with the stroke so far
+   * @param doc Document being modified
+   *
+   * Painting tools that accumulate a stroke in a StrokeScratch composite it
+   * here; StrokePipeline calls this once per batch of input, for the
+   * preview. end_stroke() composites whatever is left. Tools that modify
+   * the document directly need not override it.
+   */
+  virtual void flush_stroke(core::ImageDocument& /*doc*/) {}
+
   /**
    * @brief Indicates whether the tool requires an active document
    * @return true if the tool needs a document to operate
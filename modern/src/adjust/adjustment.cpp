@@ -0,0 +1,532 @@
+#include "ps/adjust/adjustment.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <utility>
+
+#include "ps/core/resample.h"
+#include "ps/core/thread_pool.h"
+#include "channel_region.h"
+#include "target_clones.h"
+
+namespace ps::adjust {
+namespace {
+
+using core::ImageBuffer;
+using core::ImageDocument;
+using core::PixelFormat;
+using core::Rect;
+using core::Size;
+
+// Four independent lookups per step, so the loads of one do not wait on
+// the stores of the previous
+template <typename Sample>
+inline void map_row_impl(Sample* dst, const Sample* src, const Sample* table, int count) {
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    const Sample a = table[src[i]];
+    const Sample b = table[src[i + 1]];
+    const Sample c = table[src[i + 2]];
+    const Sample d = table[src[i + 3]];
+    dst[i] = a;
+    dst[i + 1] = b;
+    dst[i + 2] = c;
+    dst[i + 3] = d;
+  }
+  for (; i < count; ++i) {
+    dst[i] = table[src[i]];
+  }
+}
+
+PS_TARGET_CLONES
+void map_row(std::uint8_t* dst, const std::uint8_t* src, const std::uint8_t* table, int count) {
+  map_row_impl(dst, src, table, count);
+}
+
+PS_TARGET_CLONES
+void map_row(std::uint16_t* dst, const std::uint16_t* src, const std::uint16_t* table,
+             int count) {
+  map_row_impl(dst, src, table, count);
+}
+
+// The original's ROUND, which rounds halves to even
+long round_even(double value) {
+  return std::lrint(value);
+}
+
+void check_level(int level, const char* what) {
+  if (level < 0 || level > 255) {
+    throw std::invalid_argument(std::string(what) + " must be within 0..255");
+  }
+}
+
+// Division rounding down; the original truncated, which rounded falling
+// lines (reversed output levels) one level high
+int floor_div(int numerator, int denominator) {
+  const int quotient = numerator / denominator;
+  return quotient * denominator > numerator ? quotient - 1 : quotient;
+}
+
+// SetLUTLine: y1 + (dy × (x - x1) + dx / 2) / dx over [x1, x2]
+void set_line(Lut& lut, int x1, int x2, int y1, int y2) {
+  const int dx = x2 - x1;
+  const int dy = y2 - y1;
+  const int half = dx / 2;
+  for (int x = x1; x <= x2; ++x) {
+    lut[x] = static_cast<std::uint8_t>(y1 + floor_div(dy * (x - x1) + half, dx));
+  }
+}
+
+// SetGammaTable; g is the gamma in hundredths
+Lut gamma_table(int g) {
+  Lut lut;
+  for (int x = 0; x < 256; ++x) {
+    lut[x] = static_cast<std::uint8_t>(round_even(255.0 * std::pow(x / 255.0, 100.0 / g)));
+  }
+  if (g > 100) {
+    // The curve starts vertically; up to x1 it is replaced by a cubic that
+    // leaves the origin with a finite slope and meets the curve smoothly
+    const double gamma = 100.0 / g;
+    const long x1 = round_even(255.0 * std::exp2(1.0 + 1.0 / gamma / (gamma - 1.0)));
+    if (x1 >= 2) {
+      const double y1 = lut[x1];
+      const double s0 = std::exp2(1.0 / gamma);
+      const double s1 = gamma * y1 / static_cast<double>(x1);
+      for (long x = 1; x < x1; ++x) {
+        const double b = static_cast<double>(x) / x1;
+        const double c = static_cast<double>(x1 - x) / x1;
+        const double d = s0 * x1 * b * c * c + (y1 * (2.0 - b + c) - s1 * x1 * c) * b * b;
+        lut[x] = static_cast<std::uint8_t>(std::clamp(std::floor(d + 0.5), 0.0, 255.0));
+      }
+    }
+  }
+  return lut;
+}
+
+// SetLUTGamma
+void set_gamma(Lut& lut, int x1, int x2, int y1, int y2, double gamma) {
+  const int dx = x2 - x1;
+  const int dy = y2 - y1;
+  const int g = static_cast<int>(round_even(gamma * 100.0));
+  if (g == 100 || dx <= 1 || dy == 0) {
+    set_line(lut, x1, x2, y1, y2);
+    return;
+  }
+  const Lut table = gamma_table(g);
+  const int half = dx / 2;
+  for (int j = x1; j <= x2; ++j) {
+    const int x = ((j - x1) * 255 + half) / dx;
+    lut[j] = static_cast<std::uint8_t>(y1 + floor_div(table[x] * dy + 127, 255));
+  }
+}
+
+// The 8-bit table spread over 16-bit samples, interpolating between
+// neighbouring entries; the identity table maps every sample to itself
+std::vector<std::uint16_t> wide_table(const Lut& lut) {
+  std::vector<std::uint16_t> table(65536);
+  for (std::uint32_t v = 0; v < 65536; ++v) {
+    const std::uint32_t position = v * 255;
+    const std::uint32_t i = position / 65535;
+    const std::int64_t fraction = position % 65535;
+    const std::int64_t a = lut[i];
+    const std::int64_t b = lut[std::min<std::uint32_t>(i + 1, 255)];
+    const std::int64_t scaled = (a * 65535 + (b - a) * fraction) * 257;
+    table[v] = static_cast<std::uint16_t>((scaled + 65535 / 2) / 65535);
+  }
+  return table;
+}
+
+std::vector<std::size_t> target_channels(const ImageDocument& doc,
+                                         const AdjustmentOptions& options) {
+  return core::detail::target_channels(doc, options.channels, "adjustments");
+}
+
+struct ChannelPass {
+  ImageBuffer* buffer = nullptr;
+  const std::uint8_t* narrow = nullptr;  ///< Gray8 table
+  std::vector<std::uint16_t> wide;       ///< Gray16 table
+};
+
+template <typename Sample>
+void map_tile(ImageBuffer& buffer, const Sample* table, const Rect& rect,
+              const std::uint8_t* weights, std::vector<Sample>& result) {
+  result.resize(static_cast<std::size_t>(rect.width));
+  for (int y = 0; y < rect.height; ++y) {
+    auto* row = reinterpret_cast<Sample*>(buffer.mutable_pixel_row(rect.x, rect.y + y));
+    if (weights == nullptr) {
+      map_row(row, row, table, rect.width);
+    } else {
+      map_row(result.data(), row, table, rect.width);
+      core::detail::blend_row(row, result.data(),
+                              weights + static_cast<std::size_t>(y) * rect.width, rect.width);
+    }
+  }
+}
+
+}  // namespace
+
+Lut identity_lut() {
+  Lut lut;
+  for (int i = 0; i < 256; ++i) {
+    lut[i] = static_cast<std::uint8_t>(i);
+  }
+  return lut;
+}
+
+bool is_identity(const Lut& lut) {
+  for (int i = 0; i < 256; ++i) {
+    if (lut[i] != i) {
+      return false;
+    }
+  }
+  return true;
+}
+
+Lut compose(const Lut& first, const Lut& second) {
+  Lut lut;
+  for (int i = 0; i < 256; ++i) {
+    lut[i] = second[first[i]];
+  }
+  return lut;
+}
+
+Lut levels_lut(int input_low, int input_high, double gamma, int output_low, int output_high) {
+  check_level(input_low, "input levels");
+  check_level(input_high, "input levels");
+  check_level(output_low, "output levels");
+  check_level(output_high, "output levels");
+  if (input_low >= input_high) {
+    throw std::invalid_argument("the input black level must be below the white level");
+  }
+  if (!(gamma > 0.0)) {
+    throw std::invalid_argument("levels gamma must be positive");
+  }
+  Lut lut;
+  std::fill(lut.begin(), lut.begin() + input_low, static_cast<std::uint8_t>(output_low));
+  set_gamma(lut, input_low, input_high, output_low, output_high, gamma);
+  std::fill(lut.begin() + input_high + 1, lut.end(), static_cast<std::uint8_t>(output_high));
+  return lut;
+}
+
+Lut curves_lut(std::vector<CurvePoint> points) {
+  if (points.size() < 2) {
+    throw std::invalid_argument("curves need at least two points");
+  }
+  std::sort(points.begin(), points.end(),
+            [](const CurvePoint& a, const CurvePoint& b) { return a.input < b.input; });
+  for (std::size_t i = 0; i < points.size(); ++i) {
+    check_level(points[i].input, "curve points");
+    check_level(points[i].output, "curve points");
+    if (i > 0 && points[i].input == points[i - 1].input) {
+      throw std::invalid_argument("curve points must have distinct inputs");
+    }
+  }
+
+  // Second derivatives of the natural spline, by the tridiagonal algorithm
+  const std::size_t n = points.size();
+  std::vector<double> second(n, 0.0);
+  std::vector<double> upper(n, 0.0);
+  for (std::size_t i = 1; i + 1 < n; ++i) {
+    const double h0 = points[i].input - points[i - 1].input;
+    const double h1 = points[i + 1].input - points[i].input;
+    const double rhs = 6.0 * ((points[i + 1].output - points[i].output) / h1 -
+                              (points[i].output - points[i - 1].output) / h0);
+    const double diagonal = 2.0 * (h0 + h1) - h0 * upper[i - 1];
+    upper[i] = h1 / diagonal;
+    second[i] = (rhs - h0 * second[i - 1]) / diagonal;
+  }
+  for (std::size_t i = n - 2; i >= 1; --i) {
+    second[i] -= upper[i] * second[i + 1];
+  }
+
+  Lut lut;
+  std::size_t segment = 0;
+  for (int x = 0; x < 256; ++x) {
+    double y;
+    if (x <= points.front().input) {
+      y = points.front().output;
+    } else if (x >= points.back().input) {
+      y = points.back().output;
+    } else {
+      while (x > points[segment + 1].input) {
+        ++segment;
+      }
+      const CurvePoint& p0 = points[segment];
+      const CurvePoint& p1 = points[segment + 1];
+      const double h = p1.input - p0.input;
+      const double a = (p1.input - x) / h;
+      const double b = (x - p0.input) / h;
+      y = a * p0.output + b * p1.output +
+          ((a * a * a - a) * second[segment] + (b * b * b - b) * second[segment + 1]) * h * h /
+              6.0;
+    }
+    lut[x] = static_cast<std::uint8_t>(std::clamp(std::floor(y + 0.5), 0.0, 255.0));
+  }
+  return lut;
+}
+
+Lut brightness_contrast_lut(int brightness, int contrast, int mean) {
+  constexpr int kRange = 100;
+  if (brightness < -kRange || brightness > kRange || contrast < -kRange || contrast > kRange) {
+    throw std::invalid_argument("brightness and contrast must be within -100..100");
+  }
+  check_level(mean, "the mean");
+
+  Lut lut;
+  int pivot_in = mean;
+  int pivot_out = mean;
+  if (contrast >= 0) {
+    pivot_in -= brightness;
+    const int gap = 255 - contrast * 255 / kRange;
+    const int half = gap / 2;
+    for (int gray = 0; gray < 256; ++gray) {
+      int level;
+      if (gap == 0) {
+        level = gray >= pivot_in ? 255 : 0;
+      } else if (gray >= pivot_in) {
+        level = pivot_out + (255 * (gray - pivot_in) + half) / gap;
+      } else {
+        level = pivot_out - (255 * (pivot_in - gray) + half) / gap;
+      }
+      lut[gray] = static_cast<std::uint8_t>(std::clamp(level, 0, 255));
+    }
+  } else {
+    pivot_out += brightness;
+    const int gap = 255 + contrast * 255 / kRange;
+    for (int gray = 0; gray < 256; ++gray) {
+      const int level = gray >= pivot_in ? pivot_out + (gap * (gray - pivot_in) + 127) / 255
+                                         : pivot_out - (gap * (pivot_in - gray) + 127) / 255;
+      lut[gray] = static_cast<std::uint8_t>(std::clamp(level, 0, 255));
+    }
+  }
+  return lut;
+}
+
+Lut posterize_lut(int levels) {
+  if (levels < 2 || levels > 255) {
+    throw std::invalid_argument("posterize needs 2 to 255 levels");
+  }
+  Lut lut;
+  for (int gray = 0; gray < 256; ++gray) {
+    lut[gray] = static_cast<std::uint8_t>(((gray * levels) >> 8) * 255 / (levels - 1));
+  }
+  return lut;
+}
+
+Lut invert_lut() {
+  Lut lut;
+  for (int gray = 0; gray < 256; ++gray) {
+    lut[gray] = static_cast<std::uint8_t>(255 - gray);
+  }
+  return lut;
+}
+
+Lut threshold_lut(int level) {
+  Lut lut;
+  for (int gray = 0; gray < 256; ++gray) {
+    lut[gray] = gray >= level ? 255 : 0;
+  }
+  return lut;
+}
+
+Lut equalize_lut(const Histogram& histogram) {
+  const auto& counts = histogram.counts;
+  int first = 0;
+  while (first < 256 && counts[first] == 0) {
+    ++first;
+  }
+  int last = 255;
+  while (last >= 0 && counts[last] == 0) {
+    --last;
+  }
+  if (first >= last) {
+    throw std::invalid_argument("cannot equalize an image with a single level");
+  }
+
+  Lut lut;
+  std::fill(lut.begin(), lut.begin() + first, 0);
+  std::fill(lut.begin() + last + 1, lut.end(), 255);
+  double count = -static_cast<double>(counts[first] / 2) -
+                 static_cast<double>((counts[last] + 1) / 2);
+  for (int j = first; j <= last; ++j) {
+    count += static_cast<double>(counts[j]);
+  }
+  std::uint64_t left = 0;
+  for (int j = first; j <= last; ++j) {
+    if (j > first) {
+      left += counts[j] / 2;
+    }
+    lut[j] = static_cast<std::uint8_t>(round_even(255.0 * static_cast<double>(left) / count));
+    left += (counts[j] + 1) / 2;
+  }
+  return lut;
+}
+
+Adjustment::Adjustment(std::string name) : name_(std::move(name)), common_(identity_lut()) {}
+
+Adjustment& Adjustment::then(const Lut& lut) {
+  common_ = compose(common_, lut);
+  for (auto& [channel, table] : channels_) {
+    table = compose(table, lut);
+  }
+  return *this;
+}
+
+Adjustment& Adjustment::then(std::size_t channel, const Lut& lut) {
+  auto it = channels_.find(channel);
+  if (it == channels_.end()) {
+    it = channels_.emplace(channel, common_).first;
+  }
+  it->second = compose(it->second, lut);
+  return *this;
+}
+
+const Lut& Adjustment::lut(std::size_t channel) const {
+  const auto it = channels_.find(channel);
+  return it != channels_.end() ? it->second : common_;
+}
+
+bool Adjustment::is_identity() const {
+  if (!ps::adjust::is_identity(common_)) {
+    return false;
+  }
+  return std::all_of(channels_.begin(), channels_.end(),
+                     [](const auto& entry) { return ps::adjust::is_identity(entry.second); });
+}
+
+Rect adjustment_area(const ImageDocument& doc, const AdjustmentOptions& options) {
+  return core::detail::operation_area(doc, options.area, options.use_selection);
+}
+
+Rect apply_adjustment(ImageDocument& doc, const Adjustment& adjustment,
+                      const AdjustmentOptions& options) {
+  const std::vector<std::size_t> channels = target_channels(doc, options);
+  const Rect area = adjustment_area(doc, options);
+  if (area.is_empty()) {
+    return Rect{};
+  }
+
+  std::vector<ChannelPass> passes;
+  for (std::size_t index : channels) {
+    const Lut& lut = adjustment.lut(index);
+    if (is_identity(lut)) {
+      continue;
+    }
+    ChannelPass pass;
+    pass.buffer = &doc.channel_at(index).buffer;
+    if (pass.buffer->format() == PixelFormat::Gray16) {
+      pass.wide = wide_table(lut);
+    } else {
+      pass.narrow = lut.data();
+    }
+    passes.push_back(std::move(pass));
+  }
+  if (passes.empty()) {
+    return Rect{};
+  }
+
+  const core::SelectionMask* selection =
+      core::detail::operation_selection(doc, options.use_selection);
+
+  // Every channel is mapped while the tile's selection weights are at hand
+  core::detail::for_each_selected_tile(
+      area, selection, [&](const Rect& rect, const std::uint8_t* weights) {
+        thread_local std::vector<std::uint8_t> narrow;
+        thread_local std::vector<std::uint16_t> wide;
+        for (const ChannelPass& pass : passes) {
+          if (pass.narrow != nullptr) {
+            map_tile<std::uint8_t>(*pass.buffer, pass.narrow, rect, weights, narrow);
+          } else {
+            map_tile<std::uint16_t>(*pass.buffer, pass.wide.data(), rect, weights, wide);
+          }
+        }
+      });
+  doc.mark_dirty(area);
+  return area;
+}
+
+AdjustmentCommand::AdjustmentCommand(ImageDocument& doc, Adjustment adjustment,
+                                     AdjustmentOptions options)
+    : ImageCommand(doc), adjustment_(std::move(adjustment)), options_(std::move(options)) {}
+
+void AdjustmentCommand::execute() {
+  const Rect area = adjustment_area(document_, options_);
+  if (area.is_empty() || adjustment_.is_identity()) {
+    return;
+  }
+  save_region(area.x, area.y, area.width, area.height);
+  apply_adjustment(document_, adjustment_, options_);
+}
+
+void AdjustmentCommand::redo() {
+  // After undo() the saved blocks hold the adjusted pixels
+  swap_regions();
+}
+
+AdjustmentPreview preview_adjustment(const ImageDocument& doc, const Adjustment& adjustment,
+                                     const AdjustmentOptions& options, int max_edge) {
+  if (max_edge < 1) {
+    throw std::invalid_argument("preview edge must be at least 1");
+  }
+  const std::vector<std::size_t> channels = target_channels(doc, options);
+  const Size size = doc.size();
+  const Rect image{0, 0, size.width, size.height};
+  const Rect area = options.area.is_empty() ? image : options.area.intersected(image);
+
+  if (area.is_empty()) {
+    return AdjustmentPreview{ImageDocument(Size{}, doc.mode()), 1, area};
+  }
+
+  const int factor = std::max((area.width + max_edge - 1) / max_edge,
+                              (area.height + max_edge - 1) / max_edge);
+  const Size proxy_size{(area.width + factor - 1) / factor,
+                        (area.height + factor - 1) / factor};
+  const bool whole = area.x == 0 && area.y == 0 && area.width == size.width &&
+                     area.height == size.height;
+
+  // The adjustment works on single samples, so the proxy needs no margin
+  auto reduce = [&](const ImageBuffer& source) {
+    if (factor == 1) {
+      return core::detail::crop(source, area);
+    }
+    return whole ? core::resized(source, proxy_size, core::ResampleFilter::Box)
+                 : core::resized(core::detail::crop(source, area), proxy_size,
+                                 core::ResampleFilter::Box);
+  };
+
+  AdjustmentPreview preview{ImageDocument(proxy_size, doc.mode()), factor, area};
+  ImageDocument& proxy = preview.image;
+  AdjustmentOptions proxy_options;
+  proxy_options.use_selection = options.use_selection;
+  Adjustment proxy_adjustment(adjustment.name());
+  for (std::size_t i = 0; i < channels.size(); ++i) {
+    const core::ImageChannel& channel = doc.channel_at(channels[i]);
+    proxy.add_channel(channel.name, reduce(channel.buffer));
+    proxy_adjustment.then(i, adjustment.lut(channels[i]));
+  }
+
+  const bool selected = options.use_selection && doc.selection().has_selection();
+  if (selected) {
+    ImageBuffer mask(Size{area.width, area.height}, PixelFormat::Gray8,
+                     core::StorageLayout::Contiguous, core::BufferInit::Uninitialized);
+    for (int y = 0; y < area.height; ++y) {
+      doc.selection().read_row(area.x, area.y + y, area.width, mask.mutable_pixel_row(0, y));
+    }
+    const ImageBuffer reduced =
+        factor == 1 ? std::move(mask)
+                    : core::resized(mask, proxy_size, core::ResampleFilter::Box);
+    for (int y = 0; y < proxy_size.height; ++y) {
+      proxy.selection().write_row(0, y, proxy_size.width, reduced.pixel_row(0, y));
+    }
+  }
+
+  // A selection that vanishes in the proxy leaves the area unchanged; it
+  // must not fall back to adjusting everything
+  if (!selected || proxy.selection().has_selection()) {
+    apply_adjustment(proxy, proxy_adjustment, proxy_options);
+  }
+  return preview;
+}
+
+}  // namespace ps::adjust
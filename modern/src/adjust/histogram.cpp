@@ -0,0 +1,287 @@
+#include "ps/adjust/histogram.h"
+
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+
+#include "ps/core/pixel_conversion.h"
+#include "ps/core/thread_pool.h"
+
+namespace ps::adjust {
+namespace {
+
+using core::ImageBuffer;
+using core::PixelFormat;
+using core::Size;
+
+// Rows per task
+constexpr int kBandRows = 64;
+
+// The original's gGrayLUT: gray = r[R] + g[G] + b[B] for 30/59/11 weights,
+// with each step of the gray scale given to one of the three tables
+struct GrayTables {
+  std::uint8_t r[256];
+  std::uint8_t g[256];
+  std::uint8_t b[256];
+
+  GrayTables() {
+    r[0] = g[0] = b[0] = 0;
+    int wr = 0;
+    int wg = 0;
+    int wb = 0;
+    for (int gray = 1; gray < 256; ++gray) {
+      wr += 30;
+      wg += 59;
+      wb += 11;
+      r[gray] = r[gray - 1];
+      g[gray] = g[gray - 1];
+      b[gray] = b[gray - 1];
+      if (wr >= wg && wr >= wb) {
+        wr -= 100;
+        ++r[gray];
+      } else if (wg >= wb) {
+        wg -= 100;
+        ++g[gray];
+      } else {
+        wb -= 100;
+        ++b[gray];
+      }
+    }
+  }
+};
+
+const GrayTables& gray_tables() {
+  static const GrayTables tables;
+  return tables;
+}
+
+// Partial counts for one band; two tables per histogram, so consecutive
+// equal levels increment different counters
+struct Partial {
+  std::uint32_t counts[2][256] = {};
+
+  void add_to(Histogram& histogram) const {
+    for (int i = 0; i < 256; ++i) {
+      histogram.counts[i] += static_cast<std::uint64_t>(counts[0][i]) + counts[1][i];
+    }
+  }
+};
+
+void count_row(Partial& partial, const std::uint8_t* levels, const std::uint8_t* mask,
+               int count) {
+  int i = 0;
+  if (mask == nullptr) {
+    for (; i + 1 < count; i += 2) {
+      ++partial.counts[0][levels[i]];
+      ++partial.counts[1][levels[i + 1]];
+    }
+    for (; i < count; ++i) {
+      ++partial.counts[0][levels[i]];
+    }
+    return;
+  }
+  for (; i < count; ++i) {
+    partial.counts[i & 1][levels[i]] += mask[i] >> 7;
+  }
+}
+
+void check_selection(const core::SelectionMask* selection, Size size) {
+  if (selection != nullptr &&
+      (selection->size().width != size.width || selection->size().height != size.height)) {
+    throw std::invalid_argument("histogram selection size differs from the image");
+  }
+}
+
+}  // namespace
+
+std::uint64_t Histogram::total() const {
+  std::uint64_t total = 0;
+  for (std::uint64_t count : counts) {
+    total += count;
+  }
+  return total;
+}
+
+double Histogram::mean() const {
+  std::uint64_t total = 0;
+  double sum = 0.0;
+  for (int level = 0; level < 256; ++level) {
+    total += counts[level];
+    sum += static_cast<double>(level) * static_cast<double>(counts[level]);
+  }
+  return total == 0 ? 0.0 : sum / static_cast<double>(total);
+}
+
+Histogram& Histogram::operator+=(const Histogram& other) {
+  for (int level = 0; level < 256; ++level) {
+    counts[level] += other.counts[level];
+  }
+  return *this;
+}
+
+Histogram channel_histogram(const ImageBuffer& buffer, const core::SelectionMask* selection) {
+  const PixelFormat format = buffer.format();
+  if (format != PixelFormat::Gray8 && format != PixelFormat::Gray16) {
+    throw std::invalid_argument("channel histograms need Gray8 or Gray16 channels");
+  }
+  const Size size = buffer.size();
+  check_selection(selection, size);
+
+  Histogram histogram;
+  std::mutex merge;
+  core::ThreadPool::instance().parallel_for(0, size.height, kBandRows, [&](int y0, int y1) {
+    thread_local std::vector<std::uint8_t> row;
+    thread_local std::vector<std::uint8_t> levels;
+    thread_local std::vector<std::uint8_t> mask;
+    row.resize(static_cast<std::size_t>(size.width) * core::bytes_per_pixel(format));
+    levels.resize(static_cast<std::size_t>(size.width));
+    mask.resize(static_cast<std::size_t>(size.width));
+    Partial partial;
+    for (int y = y0; y < y1; ++y) {
+      buffer.read_pixels(0, y, size.width, row.data());
+      const std::uint8_t* data = row.data();
+      if (format == PixelFormat::Gray16) {
+        data = levels.data();
+        const auto* wide = reinterpret_cast<const std::uint16_t*>(row.data());
+        for (int x = 0; x < size.width; ++x) {
+          levels[x] = static_cast<std::uint8_t>(wide[x] >> 8);
+        }
+      }
+      if (selection != nullptr) {
+        selection->read_row(0, y, size.width, mask.data());
+      }
+      count_row(partial, data, selection != nullptr ? mask.data() : nullptr, size.width);
+    }
+    std::lock_guard<std::mutex> lock(merge);
+    partial.add_to(histogram);
+  });
+  return histogram;
+}
+
+LayerHistogram layer_histogram(const core::Layer& layer, const core::SelectionMask* selection) {
+  const ImageBuffer& buffer = layer.buffer();
+  const PixelFormat format = buffer.format();
+  const Size size = buffer.size();
+  check_selection(selection, size);
+  const GrayTables& gray = gray_tables();
+
+  LayerHistogram histogram;
+  std::mutex merge;
+  core::ThreadPool::instance().parallel_for(0, size.height, kBandRows, [&](int y0, int y1) {
+    thread_local std::vector<std::uint8_t> row;
+    thread_local std::vector<std::uint8_t> rgba;
+    thread_local std::vector<std::uint8_t> mask;
+    thread_local std::vector<std::uint8_t> planes;
+    const std::size_t width = static_cast<std::size_t>(size.width);
+    row.resize(width * core::bytes_per_pixel(format));
+    rgba.resize(width * 4);
+    mask.resize(width);
+    planes.resize(width * 4);
+    std::uint8_t* red = planes.data();
+    std::uint8_t* green = red + width;
+    std::uint8_t* blue = green + width;
+    std::uint8_t* weights = blue + width;
+    Partial partial[4];
+    for (int y = y0; y < y1; ++y) {
+      const std::uint8_t* pixels = rgba.data();
+      if (format == PixelFormat::RGBA8) {
+        buffer.read_pixels(0, y, size.width, rgba.data());
+      } else {
+        buffer.read_pixels(0, y, size.width, row.data());
+        core::convert_rgba_span(row.data(), format, rgba.data(), PixelFormat::RGBA8,
+                                size.width);
+      }
+      if (selection != nullptr) {
+        selection->read_row(0, y, size.width, mask.data());
+      }
+      // Split into planes, with a weight of 128 or more for every pixel
+      // that counts
+      for (std::size_t x = 0; x < width; ++x) {
+        red[x] = pixels[x * 4];
+        green[x] = pixels[x * 4 + 1];
+        blue[x] = pixels[x * 4 + 2];
+        const bool selected = selection == nullptr || mask[x] >= 128;
+        weights[x] = pixels[x * 4 + 3] != 0 && selected ? 255 : 0;
+      }
+      count_row(partial[1], red, weights, size.width);
+      count_row(partial[2], green, weights, size.width);
+      count_row(partial[3], blue, weights, size.width);
+      for (std::size_t x = 0; x < width; ++x) {
+        red[x] = static_cast<std::uint8_t>(gray.r[red[x]] + gray.g[green[x]] + gray.b[blue[x]]);
+      }
+      count_row(partial[0], red, weights, size.width);
+    }
+    std::lock_guard<std::mutex> lock(merge);
+    partial[0].add_to(histogram.luminosity);
+    partial[1].add_to(histogram.red);
+    partial[2].add_to(histogram.green);
+    partial[3].add_to(histogram.blue);
+  });
+  return histogram;
+}
+
+HistogramCache::Entry* HistogramCache::find(const core::ImageDocument& doc,
+                                            const core::Layer* layer, std::size_t channel,
+                                            bool use_selection, Entry& key) {
+  const core::SelectionMask& selection = doc.selection();
+  key.doc = &doc;
+  key.layer = layer;
+  key.channel = channel;
+  key.buffer = layer != nullptr ? &layer->buffer() : &doc.channel_at(channel).buffer;
+  key.size = key.buffer->size();
+  key.layer_revision = layer != nullptr ? layer->revision() : 0;
+  key.selection_revision = use_selection && selection.has_selection() ? selection.revision() : 0;
+  key.damage_revision = doc.damage_revision();
+
+  for (Entry& entry : entries_) {
+    if (entry.doc == &doc && entry.layer == layer && (layer != nullptr || entry.channel == channel)) {
+      const bool fresh = entry.buffer == key.buffer && entry.size.width == key.size.width &&
+                         entry.size.height == key.size.height &&
+                         entry.layer_revision == key.layer_revision &&
+                         entry.selection_revision == key.selection_revision &&
+                         !doc.damaged_since(entry.damage_revision, layer);
+      return fresh ? &entry : nullptr;
+    }
+  }
+  return nullptr;
+}
+
+HistogramCache::Entry& HistogramCache::store(Entry&& key) {
+  for (Entry& entry : entries_) {
+    if (entry.doc == key.doc && entry.layer == key.layer &&
+        (key.layer != nullptr || entry.channel == key.channel)) {
+      entry = std::move(key);
+      return entry;
+    }
+  }
+  entries_.push_back(std::move(key));
+  return entries_.back();
+}
+
+const Histogram& HistogramCache::channel(const core::ImageDocument& doc, std::size_t index,
+                                         bool use_selection) {
+  Entry key;
+  if (const Entry* entry = find(doc, nullptr, index, use_selection, key)) {
+    return entry->histogram;
+  }
+  key.histogram =
+      channel_histogram(*key.buffer, key.selection_revision != 0 ? &doc.selection() : nullptr);
+  return store(std::move(key)).histogram;
+}
+
+const LayerHistogram& HistogramCache::layer(const core::ImageDocument& doc,
+                                            const core::Layer& layer, bool use_selection) {
+  Entry key;
+  if (const Entry* entry = find(doc, &layer, 0, use_selection, key)) {
+    return entry->layer_histogram;
+  }
+  key.layer_histogram =
+      layer_histogram(layer, key.selection_revision != 0 ? &doc.selection() : nullptr);
+  return store(std::move(key)).layer_histogram;
+}
+
+void HistogramCache::clear() {
+  entries_.clear();
+}
+
+}  // namespace ps::adjust
@@ -1,46 +1,115 @@
 #include <SDL.h>
 #include <SDL_opengl.h>
+#include <unistd.h>
 
 #include "imgui.h"
 #include "imgui_impl_opengl2.h"
 #include "imgui_impl_sdl2.h"
 
 #include <algorithm>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <exception>
 #include <functional>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "ps/core/image_document.h"
 #include "ps/core/selection_command.h"
+#include "ps/core/tile_cache.h"
 #include "ps/core/undo_stack.h"
 #include "ps/rendering/canvas.h"
+#include "ps/rendering/gl_compositor.h"
+#include "ps/rendering/render_thread.h"
 #include "ps/rendering/viewport.h"
+#include "ps/tools/stroke_pipeline.h"
 #include "ps/tools/tool_manager.h"
 
 namespace {
 constexpr int kWindowWidth = 1280;
 constexpr int kWindowHeight = 720;
+constexpr Uint32 kMarchingAntsIntervalMs = 100;  // One step of the selection outline
+constexpr int kFramesAfterInput = 3;  // Lets ImGui settle hover and layout changes
 
 // Canvas state
 std::unique_ptr<ps::core::ImageDocument> g_document;
 std::unique_ptr<ps::core::UndoStack> g_undo_stack;
 std::unique_ptr<ps::rendering::Canvas> g_canvas;
-ps::rendering::CanvasBuffer g_render_buffer;
+std::unique_ptr<ps::rendering::GlCompositor> g_gpu_compositor;  // Null if unsupported
+bool g_use_gpu = false;
+std::unique_ptr<ps::rendering::RenderThread> g_render_thread;
+std::unique_ptr<ps::tools::StrokePipeline> g_strokes;  // Paints tool input off the UI thread
 GLuint g_texture_id = 0;
+int g_texture_width = 0;
+int g_texture_height = 0;
 bool g_is_drawing = false;
-int g_selection_frame = 0;
+
+bool g_overlay_enabled = false;  // The marching ants need periodic frames
+
+// What the GPU compositor's texture currently shows. It is re-rendered
+// only when one of these changes, and only the damaged part when nothing
+// but document pixels changed. The CPU path keeps the same kind of state
+// inside g_render_thread.
+struct CanvasState {
+  const ps::core::ImageDocument* document = nullptr;
+  std::vector<const ps::core::Layer*> layers;  ///< Stack order
+  std::vector<std::uint64_t> layer_revisions;  ///< Visibility, opacity, blend mode
+  int active_layer = -1;
+  std::uint64_t damage_revision = 0;
+  std::uint64_t selection_revision = 0;
+  float zoom = 0.0f;
+  ps::rendering::ViewportPoint pan{};
+  int width = 0;
+  int height = 0;
+  bool overlay_enabled = false;
+  Uint32 ants_frame = 0;
+  bool valid = false;  ///< The canvas shows g_gpu_compositor's texture
+};
+CanvasState g_canvas_state;
+
+// Double-buffered pixel buffer objects for texture uploads. Writing into
+// a freshly orphaned buffer lets glTexSubImage2D return without waiting
+// for the GPU to finish with the previous upload. Left unset when the
+// context has no PBO support; uploads then read client memory directly.
+struct PixelUploader {
+  PFNGLGENBUFFERSPROC gen_buffers = nullptr;
+  PFNGLDELETEBUFFERSPROC delete_buffers = nullptr;
+  PFNGLBINDBUFFERPROC bind_buffer = nullptr;
+  PFNGLBUFFERDATAPROC buffer_data = nullptr;
+  PFNGLMAPBUFFERPROC map_buffer = nullptr;
+  PFNGLUNMAPBUFFERPROC unmap_buffer = nullptr;
+  GLuint buffers[2] = {0, 0};
+  int next = 0;
+
+  bool available() const { return buffers[0] != 0; }
+};
+PixelUploader g_uploader;
 
 std::size_t document_memory_usage(const ps::core::ImageDocument& doc) {
   std::size_t total_bytes = 0;
   for (const auto& channel : doc.channels()) {
-    total_bytes += channel.buffer.byte_size();
+    total_bytes += channel.buffer.allocated_bytes();
+  }
+  for (const auto& layer : doc.layers()) {
+    total_bytes += layer->buffer().allocated_bytes();
   }
   return total_bytes;
 }
 
+// Default tile cache budget: half of physical memory, like the legacy
+// "Photoshop uses N% of RAM" preference.
+std::size_t default_tile_budget() {
+  const long pages = ::sysconf(_SC_PHYS_PAGES);
+  const long page_size = ::sysconf(_SC_PAGESIZE);
+  if (pages <= 0 || page_size <= 0) {
+    return 0;
+  }
+  return static_cast<std::size_t>(pages) * static_cast<std::size_t>(page_size) / 2;
+}
+
 std::string format_bytes(std::size_t bytes) {
   static const char* kUnits[] = {"B", "KB", "MB", "GB"};
   double size = static_cast<double>(bytes);
@@ -64,23 +133,26 @@ void create_test_image() {
   g_document = std::make_unique<ps::core::ImageDocument>(
       ps::core::Size{800, 600}, ps::core::ColorMode::RGB);
 
-  g_document->add_channel("Red", ps::core::PixelFormat::RGB8);
-  g_document->add_channel("Green", ps::core::PixelFormat::RGB8);
-  g_document->add_channel("Blue", ps::core::PixelFormat::RGB8);
+  g_document->add_channel("Red", ps::core::PixelFormat::Gray8);
+  g_document->add_channel("Green", ps::core::PixelFormat::Gray8);
+  g_document->add_channel("Blue", ps::core::PixelFormat::Gray8);
 
-  auto& red_channel = g_document->channel_at(0);
-  auto& green_channel = g_document->channel_at(1);
-  auto& blue_channel = g_document->channel_at(2);
+  std::uint8_t* red = g_document->channel_at(0).buffer.data();
+  std::uint8_t* green = g_document->channel_at(1).buffer.data();
+  std::uint8_t* blue = g_document->channel_at(2).buffer.data();
 
   for (int y = 0; y < 600; ++y) {
     for (int x = 0; x < 800; ++x) {
-      const int idx = (y * 800 + x) * 3;
-      red_channel.buffer.data()[idx] = static_cast<uint8_t>((x * 255) / 800);
-      green_channel.buffer.data()[idx + 1] = static_cast<uint8_t>((y * 255) / 600);
-      blue_channel.buffer.data()[idx + 2] = 128;
+      const int idx = y * 800 + x;
+      red[idx] = static_cast<uint8_t>((x * 255) / 800);
+      green[idx] = static_cast<uint8_t>((y * 255) / 600);
+      blue[idx] = 128;
     }
   }
 
+  // Store pixels in copy-on-write tiles so they can be paged by TileCache
+  g_document->set_storage_layout(ps::core::StorageLayout::Tiled);
+
   g_canvas->viewport().set_viewport_size(ps::rendering::ViewportSize(800, 600));
   g_canvas->viewport().center_on_image(g_document->size());
 }
@@ -97,25 +169,184 @@ void create_gl_texture() {
   glBindTexture(GL_TEXTURE_2D, 0);
 }
 
-void update_canvas_texture() {
-  if (g_render_buffer.pixels.empty()) return;
+void init_pixel_uploader() {
+  int major = 0;
+  int minor = 0;
+  const char* version = reinterpret_cast<const char*>(glGetString(GL_VERSION));
+  if (version) {
+    std::sscanf(version, "%d.%d", &major, &minor);
+  }
+  // Pixel buffer objects are core in OpenGL 2.1
+  if ((major < 2 || (major == 2 && minor < 1)) &&
+      !SDL_GL_ExtensionSupported("GL_ARB_pixel_buffer_object")) {
+    return;
+  }
+
+  PixelUploader& up = g_uploader;
+  up.gen_buffers = reinterpret_cast<PFNGLGENBUFFERSPROC>(SDL_GL_GetProcAddress("glGenBuffers"));
+  up.delete_buffers =
+      reinterpret_cast<PFNGLDELETEBUFFERSPROC>(SDL_GL_GetProcAddress("glDeleteBuffers"));
+  up.bind_buffer = reinterpret_cast<PFNGLBINDBUFFERPROC>(SDL_GL_GetProcAddress("glBindBuffer"));
+  up.buffer_data = reinterpret_cast<PFNGLBUFFERDATAPROC>(SDL_GL_GetProcAddress("glBufferData"));
+  up.map_buffer = reinterpret_cast<PFNGLMAPBUFFERPROC>(SDL_GL_GetProcAddress("glMapBuffer"));
+  up.unmap_buffer =
+      reinterpret_cast<PFNGLUNMAPBUFFERPROC>(SDL_GL_GetProcAddress("glUnmapBuffer"));
+  if (!up.gen_buffers || !up.delete_buffers || !up.bind_buffer || !up.buffer_data ||
+      !up.map_buffer || !up.unmap_buffer) {
+    return;
+  }
+  up.gen_buffers(2, up.buffers);
+}
+
+// Copies a screen rectangle of a rendered frame into the canvas texture
+void upload_canvas_texture(const ps::rendering::CanvasBuffer& frame,
+                           const ps::core::Rect& area) {
+  if (frame.pixels.empty() || area.is_empty()) return;
 
   if (g_texture_id == 0) {
     create_gl_texture();
   }
 
   glBindTexture(GL_TEXTURE_2D, g_texture_id);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, g_render_buffer.width,
-               g_render_buffer.height, 0, GL_RGBA, GL_UNSIGNED_BYTE,
-               g_render_buffer.data());
+
+  // Texture storage is only (re)allocated when the canvas changes size
+  if (g_texture_width != frame.width || g_texture_height != frame.height) {
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, frame.width, frame.height, 0, GL_RGBA,
+                 GL_UNSIGNED_BYTE, frame.data());
+    g_texture_width = frame.width;
+    g_texture_height = frame.height;
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return;
+  }
+
+  const std::size_t row_bytes = static_cast<std::size_t>(area.width) * 4;
+  const std::size_t stride = static_cast<std::size_t>(frame.width) * 4;
+  const std::uint8_t* first_row = frame.data() +
+                                  static_cast<std::size_t>(area.y) * stride +
+                                  static_cast<std::size_t>(area.x) * 4;
+
+  bool uploaded = false;
+  if (g_uploader.available()) {
+    PixelUploader& up = g_uploader;
+    up.bind_buffer(GL_PIXEL_UNPACK_BUFFER, up.buffers[up.next]);
+    up.next ^= 1;
+
+    // Orphan the previous contents instead of waiting for the GPU to read them
+    up.buffer_data(GL_PIXEL_UNPACK_BUFFER,
+                   static_cast<GLsizeiptr>(row_bytes * area.height), nullptr,
+                   GL_STREAM_DRAW);
+    auto* mapped = static_cast<std::uint8_t*>(
+        up.map_buffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY));
+    if (mapped) {
+      for (int y = 0; y < area.height; ++y) {
+        std::memcpy(mapped + y * row_bytes, first_row + y * stride, row_bytes);
+      }
+      uploaded = up.unmap_buffer(GL_PIXEL_UNPACK_BUFFER) == GL_TRUE;
+      if (uploaded) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, area.x, area.y, area.width, area.height,
+                        GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+      }
+    }
+    up.bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  }
+
+  if (!uploaded) {
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, frame.width);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, area.x, area.y, area.width, area.height,
+                    GL_RGBA, GL_UNSIGNED_BYTE, first_row);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  }
   glBindTexture(GL_TEXTURE_2D, 0);
 }
 
+// Brings the canvas texture up to date with the document, viewport and
+// selection outline. Returns true if a new frame is shown.
+bool refresh_canvas(int width, int height) {
+  ps::core::ImageDocument& doc = *g_document;
+  const ps::core::SelectionMask& selection = doc.selection();
+
+  g_overlay_enabled = selection.has_selection();
+  const Uint32 ants_frame = g_overlay_enabled ? SDL_GetTicks() / kMarchingAntsIntervalMs : 0;
+  ps::rendering::SelectionOverlay overlay;
+  overlay.enabled = g_overlay_enabled;
+  overlay.mask = &selection;
+  overlay.animation_frame = static_cast<int>(ants_frame);
+
+  // The GPU path composites layers itself; channel-only documents stay on the CPU
+  if (g_use_gpu && g_gpu_compositor && doc.layer_count() > 0) {
+    const CanvasState& last = g_canvas_state;
+    CanvasState state;
+    state.document = &doc;
+    for (const auto& layer : doc.layers()) {
+      state.layers.push_back(layer.get());
+      state.layer_revisions.push_back(layer->revision());
+    }
+    state.active_layer = doc.active_layer_index();
+    state.damage_revision = doc.damage_revision();
+    state.selection_revision = selection.revision();
+    state.zoom = g_canvas->viewport().zoom();
+    state.pan = g_canvas->viewport().pan_offset();
+    state.width = width;
+    state.height = height;
+    state.overlay_enabled = g_overlay_enabled;
+    state.ants_frame = ants_frame;
+    state.valid = true;
+
+    const bool changed =
+        !last.valid || last.document != state.document ||
+        last.layers != state.layers || last.layer_revisions != state.layer_revisions ||
+        last.active_layer != state.active_layer ||
+        last.selection_revision != state.selection_revision ||
+        last.zoom != state.zoom || last.pan.x != state.pan.x || last.pan.y != state.pan.y ||
+        last.width != state.width || last.height != state.height ||
+        last.overlay_enabled != state.overlay_enabled || last.ants_frame != state.ants_frame ||
+        last.damage_revision != state.damage_revision;
+    if (!changed) {
+      return false;
+    }
+    g_canvas_state = std::move(state);
+    try {
+      // Uploads and recomposites only the damage; the view pass is cheap
+      g_gpu_compositor->render(doc, *g_canvas, overlay, width, height);
+      return true;
+    } catch (const std::exception& e) {
+      SDL_Log("GPU compositing disabled: %s", e.what());
+      g_gpu_compositor.reset();
+      g_use_gpu = false;
+      g_canvas_state = CanvasState{};
+      return refresh_canvas(width, height);
+    }
+  }
+  g_canvas_state = CanvasState{};
+
+  // The worker renders off the UI thread; frames are shown as they finish
+  g_render_thread->submit(doc, *g_canvas, overlay, width, height);
+  ps::core::Rect area;
+  if (!g_render_thread->present(area)) {
+    return false;
+  }
+  upload_canvas_texture(g_render_thread->front(), area);
+  return true;
+}
+
 void cleanup_canvas() {
   if (g_texture_id != 0) {
     glDeleteTextures(1, &g_texture_id);
     g_texture_id = 0;
+    g_texture_width = 0;
+    g_texture_height = 0;
+  }
+  if (g_uploader.available()) {
+    g_uploader.delete_buffers(2, g_uploader.buffers);
+    g_uploader = PixelUploader{};
+  }
+  g_gpu_compositor.reset();
+  g_canvas_state = CanvasState{};
+  if (g_strokes && g_strokes->active()) {
+    g_strokes->end_stroke();
   }
+  g_strokes.reset();
+  g_render_thread.reset();
   g_document.reset();
   g_undo_stack.reset();
   g_canvas.reset();
@@ -125,11 +356,11 @@ void apply_selection_change(ps::core::ImageDocument& doc,
                             ps::core::UndoStack& undo_stack,
                             const char* label,
                             const std::function<void(ps::core::SelectionMask&)>& op) {
-  ps::core::SelectionMask before = doc.selection();
-  ps::core::SelectionMask after = before;
-  op(after);
-  undo_stack.push(std::make_unique<ps::core::SelectionCommand>(
-      doc, std::move(before), std::move(after), label));
+  // The copy shares the mask pixels until op() changes the selection
+  const ps::core::SelectionMask before = doc.selection();
+  op(doc.selection());
+  undo_stack.push(std::make_unique<ps::core::SelectionCommand>(doc, before, doc.selection(),
+                                                               label));
 }
 }
 
@@ -182,14 +413,44 @@ int main(int, char**) {
 
   // Initialize canvas system
   g_undo_stack = std::make_unique<ps::core::UndoStack>();
+  g_undo_stack->set_memory_budget(std::size_t(1) << 30);  // 1 GB of history
   g_canvas = std::make_unique<ps::rendering::Canvas>();
+  g_render_thread = std::make_unique<ps::rendering::RenderThread>();
+  g_strokes = std::make_unique<ps::tools::StrokePipeline>();
   ps::tools::ToolManager::instance().register_default_tools();
+  ps::core::TileCache::instance().set_memory_budget(default_tile_budget());
   create_test_image();
+  init_pixel_uploader();
 
+  g_gpu_compositor = std::make_unique<ps::rendering::GlCompositor>();
+  try {
+    if (!g_gpu_compositor->initialize(SDL_GL_GetProcAddress)) {
+      g_gpu_compositor.reset();
+    }
+  } catch (const std::exception& e) {
+    SDL_Log("GPU compositing unavailable: %s", e.what());
+    g_gpu_compositor.reset();
+  }
+
+  // Frames are only produced while something changes: after input, while
+  // the render thread is busy and for each step of the marching ants.
+  // Otherwise the loop sleeps in SDL_WaitEvent.
+  int frames_to_render = kFramesAfterInput;
   bool running = true;
   while (running) {
     SDL_Event event;
-    while (SDL_PollEvent(&event)) {
+    bool have_event = false;
+    if (frames_to_render > 0) {
+      have_event = SDL_PollEvent(&event) != 0;
+    } else if (g_overlay_enabled) {
+      const Uint32 wait = kMarchingAntsIntervalMs - SDL_GetTicks() % kMarchingAntsIntervalMs;
+      have_event = SDL_WaitEventTimeout(&event, static_cast<int>(wait)) != 0;
+    } else {
+      have_event = SDL_WaitEvent(&event) != 0;
+    }
+
+    for (; have_event; have_event = SDL_PollEvent(&event) != 0) {
+      frames_to_render = kFramesAfterInput;
       ImGui_ImplSDL2_ProcessEvent(&event);
       if (event.type == SDL_QUIT) {
         running = false;
@@ -204,6 +465,10 @@ int main(int, char**) {
     ImGui_ImplSDL2_NewFrame();
     ImGui::NewFrame();
 
+    // The stroke worker paints between frames; while the frame is built the
+    // document, the tools and their options belong to the UI thread
+    auto document_lock = g_strokes->lock_document();
+
     if (ImGui::BeginMainMenuBar()) {
       if (ImGui::BeginMenu("File")) {
         ImGui::MenuItem("New...", nullptr, false, false);
@@ -239,6 +504,12 @@ int main(int, char**) {
             apply_selection_change(*g_document, *g_undo_stack, "Feather Selection",
                                    [](ps::core::SelectionMask& mask) { mask.feather(3); });
           }
+          if (ImGui::MenuItem("Gaussian Feather (3px)")) {
+            apply_selection_change(*g_document, *g_undo_stack, "Feather Selection",
+                                   [](ps::core::SelectionMask& mask) {
+                                     mask.feather(3, ps::core::FeatherShape::Gaussian);
+                                   });
+          }
           if (ImGui::MenuItem("Grow (3px)")) {
             apply_selection_change(*g_document, *g_undo_stack, "Grow Selection",
                                    [](ps::core::SelectionMask& mask) { mask.grow(3); });
@@ -250,6 +521,7 @@ int main(int, char**) {
         } else {
           ImGui::MenuItem("Invert", nullptr, false, false);
           ImGui::MenuItem("Feather", nullptr, false, false);
+          ImGui::MenuItem("Gaussian Feather", nullptr, false, false);
           ImGui::MenuItem("Grow", nullptr, false, false);
           ImGui::MenuItem("Shrink", nullptr, false, false);
         }
@@ -287,6 +559,11 @@ int main(int, char**) {
         }
         ImGui::EndMenu();
       }
+      if (ImGui::BeginMenu("View")) {
+        ImGui::MenuItem("GPU Compositing", nullptr, &g_use_gpu,
+                        g_gpu_compositor != nullptr);
+        ImGui::EndMenu();
+      }
       if (ImGui::BeginMenu("Window")) {
         ImGui::MenuItem("Tools", nullptr, false, false);
         ImGui::MenuItem("Layers", nullptr, false, false);
@@ -356,6 +633,7 @@ int main(int, char**) {
         changed |= ImGui::SliderInt("Opacity", &options.opacity, 0, 100);
         changed |= ImGui::SliderInt("Spacing", &options.spacing, 0, 100);
         changed |= ImGui::SliderInt("Fadeout", &options.fadeout, 0, 1000);
+        changed |= ImGui::Checkbox("Contiguous", &options.contiguous);
 
         const char* blend_labels[] = {"Normal", "Color Only", "Darken Only", "Lighten Only"};
         int blend_index = static_cast<int>(options.blend_mode);
@@ -526,19 +804,16 @@ int main(int, char**) {
             ps::rendering::ViewportSize(static_cast<int>(canvas_size.x),
                                        static_cast<int>(canvas_size.y)));
 
-        g_render_buffer.resize(static_cast<int>(canvas_size.x),
-                              static_cast<int>(canvas_size.y));
-
-        ps::rendering::SelectionOverlay overlay;
-        overlay.enabled = g_document->selection().has_selection();
-        overlay.mask = &g_document->selection();
-        overlay.animation_frame = g_selection_frame++;
-
-        g_canvas->render_with_overlay(*g_document, g_render_buffer, overlay);
-        update_canvas_texture();
+        if (refresh_canvas(static_cast<int>(canvas_size.x),
+                           static_cast<int>(canvas_size.y)) ||
+            g_render_thread->busy() || g_strokes->busy()) {
+          frames_to_render = kFramesAfterInput;
+        }
 
-        if (g_texture_id) {
-          ImGui::Image(reinterpret_cast<void*>(static_cast<intptr_t>(g_texture_id)),
+        const GLuint texture =
+            g_canvas_state.valid ? g_gpu_compositor->texture() : g_texture_id;
+        if (texture) {
+          ImGui::Image(reinterpret_cast<void*>(static_cast<intptr_t>(texture)),
                       canvas_size);
         }
 
@@ -600,21 +875,31 @@ int main(int, char**) {
             const ps::tools::Point tool_pt(static_cast<int>(ip.x),
                                           static_cast<int>(ip.y));
 
+            // Ends the queued stroke; the worker needs the document for that
+            const auto finish_stroke = [&] {
+              document_lock.unlock();
+              auto cmd = g_strokes->end_stroke();
+              document_lock.lock();
+              if (cmd) {
+                g_undo_stack->push(std::move(cmd));
+              }
+              g_is_drawing = false;
+            };
+
             if (ImGui::IsMouseClicked(ImGuiMouseButton_Left)) {
-              active_tool->begin_stroke(*g_document, tool_pt);
+              if (g_strokes->active()) {
+                finish_stroke();  // Released outside the canvas
+              }
+              g_strokes->begin_stroke(*active_tool, *g_document, tool_pt);
               g_is_drawing = true;
             }
 
             if (g_is_drawing && ImGui::IsMouseDragging(ImGuiMouseButton_Left)) {
-              active_tool->continue_stroke(*g_document, tool_pt);
+              g_strokes->continue_stroke(tool_pt);
             }
 
             if (g_is_drawing && ImGui::IsMouseReleased(ImGuiMouseButton_Left)) {
-              auto cmd = active_tool->end_stroke(*g_document);
-              if (cmd) {
-                g_undo_stack->push(std::move(cmd));
-              }
-              g_is_drawing = false;
+              finish_stroke();
             }
           }
         }
@@ -635,12 +920,20 @@ int main(int, char**) {
         ImGui::SameLine();
         ImGui::Text("| Memory: %s", format_bytes(document_memory_usage(*g_document)).c_str());
         ImGui::SameLine();
+        ImGui::Text("| Undo: %s", format_bytes(g_undo_stack->memory_usage()).c_str());
+        ImGui::SameLine();
+        const ps::core::TileCacheStats tile_stats = ps::core::TileCache::instance().stats();
+        ImGui::Text("| Tiles: %s resident / %s paged",
+                    format_bytes(tile_stats.resident_bytes).c_str(),
+                    format_bytes(tile_stats.paged_bytes).c_str());
+        ImGui::SameLine();
         ImGui::Text("| Image: (%.0f, %.0f)", ip.x, ip.y);
         ImGui::SameLine();
         ImGui::Text("| Zoom: %.0f%%", g_canvas->viewport().zoom() * 100.0f);
       }
     }
     ImGui::End();
+    document_lock.unlock();
 
     ImGui::Render();
     glViewport(0, 0, static_cast<int>(io.DisplaySize.x), static_cast<int>(io.DisplaySize.y));
@@ -648,6 +941,18 @@ int main(int, char**) {
     glClear(GL_COLOR_BUFFER_BIT);
     ImGui_ImplOpenGL2_RenderDrawData(ImGui::GetDrawData());
     SDL_GL_SwapWindow(window);
+
+    // Safe point: no tile pointers are held between frames, and the stroke
+    // worker holds none while the document is locked. Skipped while the
+    // render thread reads tiles; a later frame trims instead.
+    {
+      auto trim_lock = g_strokes->lock_document();
+      g_render_thread->try_run_idle([] { ps::core::TileCache::instance().trim(); });
+    }
+
+    if (frames_to_render > 0) {
+      --frames_to_render;
+    }
   }
 
   cleanup_canvas();
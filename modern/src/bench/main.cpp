@@ -0,0 +1,465 @@
+// ps_modern_bench: micro-benchmarks of the core hot paths.
+//
+// Each benchmark runs one operation of ps_modern_core on synthetic images
+// of several sizes, so a change in the compositor, selection, tools, undo
+// or PNG code shows up as a change in its timings. Results are printed as
+// Google Benchmark JSON unless another --benchmark_format is given;
+// --benchmark_out=<file> writes them to a file instead, and
+// --benchmark_filter=<regex> picks benchmarks by name.
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ps/core/image_document.h"
+#include "ps/core/layer.h"
+#include "ps/core/layer_blend.h"
+#include "ps/core/pixel_conversion.h"
+#include "ps/core/selection_mask.h"
+#include "ps/core/thread_pool.h"
+#include "ps/core/undo_stack.h"
+#include "ps/io/png_format.h"
+#include "ps/rendering/canvas.h"
+#include "ps/tools/brush_tool.h"
+#include "ps/tools/drawing_tools.h"
+#include "ps/tools/flood_fill.h"
+
+namespace {
+
+using ps::core::BlendMode;
+using ps::core::ImageBuffer;
+using ps::core::ImageDocument;
+using ps::core::PixelFormat;
+using ps::core::Size;
+
+constexpr int kBlendModeCount = static_cast<int>(BlendMode::Exclusion) + 1;
+
+const char* blend_mode_name(BlendMode mode) {
+  switch (mode) {
+    case BlendMode::Normal: return "Normal";
+    case BlendMode::Multiply: return "Multiply";
+    case BlendMode::Screen: return "Screen";
+    case BlendMode::Overlay: return "Overlay";
+    case BlendMode::Darken: return "Darken";
+    case BlendMode::Lighten: return "Lighten";
+    case BlendMode::ColorDodge: return "ColorDodge";
+    case BlendMode::ColorBurn: return "ColorBurn";
+    case BlendMode::HardLight: return "HardLight";
+    case BlendMode::SoftLight: return "SoftLight";
+    case BlendMode::Difference: return "Difference";
+    case BlendMode::Exclusion: return "Exclusion";
+  }
+  return "?";
+}
+
+// Cheap deterministic noise, so every run sees the same pixels.
+std::uint8_t noise(std::uint32_t x, std::uint32_t y, std::uint32_t seed) {
+  std::uint32_t h = x * 0x9E3779B1u ^ y * 0x85EBCA77u ^ seed * 0xC2B2AE3Du;
+  h ^= h >> 15;
+  h *= 0x2C1B3C6Du;
+  h ^= h >> 12;
+  return static_cast<std::uint8_t>(h);
+}
+
+// Smooth gradients with a little noise: compresses like a photograph and
+// leaves large regions for flood fills to find.
+std::uint8_t sample(int x, int y, int channel, int seed) {
+  const int smooth = ((x >> 2) + (y >> 3) * (channel + 1) + seed * 40) & 0xFF;
+  return static_cast<std::uint8_t>(smooth ^ (noise(x, y, channel + seed * 4) & 0x07));
+}
+
+// Fills every pixel of a buffer of any layout span by span.
+void fill_pattern(ImageBuffer& buffer, int seed, bool translucent) {
+  const Size size = buffer.size();
+  const int bpp = static_cast<int>(ps::core::bytes_per_pixel(buffer.format()));
+  for (int y = 0; y < size.height; ++y) {
+    for (int x = 0; x < size.width;) {
+      const int span = buffer.span_width(x);
+      std::uint8_t* row = buffer.mutable_pixel_row(x, y);
+      for (int i = 0; i < span; ++i) {
+        for (int c = 0; c < bpp; ++c) {
+          std::uint8_t v = sample(x + i, y, c, seed);
+          if (c == 3 && bpp == 4) {
+            v = translucent ? static_cast<std::uint8_t>(128 + (v >> 1)) : 255;
+          }
+          row[i * bpp + c] = v;
+        }
+      }
+      x += span;
+    }
+  }
+}
+
+ImageDocument make_rgb_document(int width, int height) {
+  ImageDocument doc(Size{width, height}, ps::core::ColorMode::RGB);
+  const char* names[] = {"Red", "Green", "Blue"};
+  for (const char* name : names) {
+    doc.add_channel(name, PixelFormat::Gray8);
+  }
+  for (std::size_t c = 0; c < doc.channels().size(); ++c) {
+    fill_pattern(doc.channels()[c].buffer, static_cast<int>(c), false);
+  }
+  return doc;
+}
+
+// An RGB document with an opaque background and translucent layers in a
+// mix of blend modes above it.
+ImageDocument make_layered_document(int width, int height, int layer_count) {
+  ImageDocument doc = make_rgb_document(width, height);
+  for (int i = 0; i < layer_count; ++i) {
+    ps::core::Layer& layer = doc.add_layer("Layer " + std::to_string(i));
+    fill_pattern(layer.buffer(), i + 1, i > 0);
+    layer.set_blend_mode(static_cast<BlendMode>(i % kBlendModeCount));
+    layer.set_opacity(i > 0 ? 75 : 100);
+  }
+  return doc;
+}
+
+std::vector<ps::tools::Point> zigzag_path(int width, int height) {
+  std::vector<ps::tools::Point> path;
+  const int margin = width / 8;
+  for (int i = 0; i <= 8; ++i) {
+    const int x = margin + (width - 2 * margin) * i / 8;
+    const int y = (i % 2 == 0) ? height / 4 : height * 3 / 4;
+    path.emplace_back(x, y);
+  }
+  return path;
+}
+
+double path_length(const std::vector<ps::tools::Point>& path) {
+  double length = 0.0;
+  for (std::size_t i = 1; i < path.size(); ++i) {
+    const double dx = path[i].x - path[i - 1].x;
+    const double dy = path[i].y - path[i - 1].y;
+    length += std::sqrt(dx * dx + dy * dy);
+  }
+  return length;
+}
+
+std::unique_ptr<ps::core::Command> brush_stroke(ps::tools::BrushTool& brush, ImageDocument& doc,
+                                                const std::vector<ps::tools::Point>& path) {
+  brush.begin_stroke(doc, path.front());
+  for (std::size_t i = 1; i < path.size(); ++i) {
+    brush.continue_stroke(doc, path[i]);
+  }
+  return brush.end_stroke(doc);
+}
+
+void set_pixel_counters(benchmark::State& state, std::int64_t pixels, std::int64_t bytes) {
+  state.SetItemsProcessed(state.iterations() * pixels);
+  state.SetBytesProcessed(state.iterations() * bytes);
+}
+
+// --- Compositing ------------------------------------------------------------
+
+// Args: blend mode, edge length in pixels.
+void BM_CompositeLayer(benchmark::State& state) {
+  const auto mode = static_cast<BlendMode>(state.range(0));
+  const int edge = static_cast<int>(state.range(1));
+  ImageBuffer src(Size{edge, edge}, PixelFormat::RGBA8);
+  ImageBuffer dst(Size{edge, edge}, PixelFormat::RGBA8);
+  fill_pattern(src, 1, true);
+  fill_pattern(dst, 2, false);
+  for (auto _ : state) {
+    ps::core::composite_layer(src.data(), dst.data(), edge, edge, 80, mode);
+    benchmark::ClobberMemory();
+  }
+  state.SetLabel(blend_mode_name(mode));
+  set_pixel_counters(state, std::int64_t{edge} * edge, std::int64_t{edge} * edge * 4);
+}
+
+void composite_layer_args(benchmark::internal::Benchmark* bench) {
+  for (int mode = 0; mode < kBlendModeCount; ++mode) {
+    for (int edge : {512, 2048}) {
+      bench->Args({mode, edge});
+    }
+  }
+}
+BENCHMARK(BM_CompositeLayer)->Apply(composite_layer_args)->Unit(benchmark::kMicrosecond);
+
+// True if the RGB channels hold exactly the color of composite(): the
+// flattened channels and the canvas must agree for every blend mode.
+bool channels_match_composite(const ImageDocument& doc) {
+  const ImageBuffer& composite = doc.composite();
+  const Size size = doc.size();
+  std::vector<std::uint8_t> rgba(static_cast<std::size_t>(size.width) * 4);
+  for (int y = 0; y < size.height; ++y) {
+    ps::core::convert_rgba_span(composite.pixel_row(0, y), composite.format(), rgba.data(),
+                                PixelFormat::RGBA8, size.width);
+    for (int c = 0; c < 3; ++c) {
+      const ImageBuffer& channel = doc.channels()[c].buffer;
+      for (int x = 0; x < size.width;) {
+        const int span = channel.span_width(x);
+        const std::uint8_t* plane = channel.pixel_row(x, y);
+        for (int i = 0; i < span; ++i) {
+          if (plane[i] != rgba[(x + i) * 4 + c]) {
+            return false;
+          }
+        }
+        x += span;
+      }
+    }
+  }
+  return true;
+}
+
+// Args: edge length, layer count. The result is checked against
+// composite() once before timing.
+void BM_FlattenToChannels(benchmark::State& state) {
+  const int edge = static_cast<int>(state.range(0));
+  ImageDocument doc = make_layered_document(edge, edge, static_cast<int>(state.range(1)));
+  doc.flatten_to_channels();
+  if (!channels_match_composite(doc)) {
+    state.SkipWithError("flatten_to_channels differs from composite()");
+    return;
+  }
+  for (auto _ : state) {
+    doc.flatten_to_channels();
+    benchmark::ClobberMemory();
+  }
+  set_pixel_counters(state, std::int64_t{edge} * edge, std::int64_t{edge} * edge * 3);
+}
+BENCHMARK(BM_FlattenToChannels)
+    ->ArgsProduct({{1024, 4096}, {1, 4}})
+    ->Unit(benchmark::kMillisecond);
+
+// Args: edge length, zoom in percent. Renders a 1920 × 1080 view of the
+// document; the composite cache is dropped each time so every render
+// composites the layer stack again.
+void BM_CanvasRender(benchmark::State& state) {
+  const int edge = static_cast<int>(state.range(0));
+  const float zoom = static_cast<float>(state.range(1)) / 100.0f;
+  ImageDocument doc = make_layered_document(edge, edge, 3);
+  ps::rendering::Canvas canvas(ps::rendering::Viewport(ps::rendering::ViewportSize{1920, 1080}));
+  canvas.viewport().set_zoom(zoom);
+  canvas.viewport().center_on_image(doc.size());
+  ps::rendering::CanvasBuffer buffer(1920, 1080);
+  for (auto _ : state) {
+    doc.invalidate_composite();
+    canvas.render(doc, buffer);
+    benchmark::DoNotOptimize(buffer.pixels.data());
+  }
+  set_pixel_counters(state, std::int64_t{1920} * 1080, std::int64_t{1920} * 1080 * 4);
+}
+BENCHMARK(BM_CanvasRender)
+    ->ArgsProduct({{1024, 4096}, {12, 25, 50, 100, 200, 400}})
+    ->Unit(benchmark::kMillisecond);
+
+// --- Selection --------------------------------------------------------------
+
+enum class MaskOperation { Feather, Grow, Shrink };
+
+// Args: edge length, radius. Runs on an elliptical selection, restored
+// between iterations outside the timing.
+template <MaskOperation Op>
+void BM_SelectionMask(benchmark::State& state) {
+  const int edge = static_cast<int>(state.range(0));
+  const int radius = static_cast<int>(state.range(1));
+  ps::core::SelectionMask original(Size{edge, edge});
+  original.fill_ellipse(edge / 8, edge / 8, edge * 3 / 4, edge * 3 / 4);
+  for (auto _ : state) {
+    state.PauseTiming();
+    ps::core::SelectionMask mask = original;
+    state.ResumeTiming();
+    switch (Op) {
+      case MaskOperation::Feather: mask.feather(radius); break;
+      case MaskOperation::Grow: mask.grow(radius); break;
+      case MaskOperation::Shrink: mask.shrink(radius); break;
+    }
+    benchmark::DoNotOptimize(mask);
+  }
+  set_pixel_counters(state, std::int64_t{edge} * edge, std::int64_t{edge} * edge);
+}
+BENCHMARK_TEMPLATE(BM_SelectionMask, MaskOperation::Feather)
+    ->ArgsProduct({{1024, 4096}, {1, 4, 16, 64}})
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_SelectionMask, MaskOperation::Grow)
+    ->ArgsProduct({{1024, 4096}, {1, 4, 16, 64}})
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_SelectionMask, MaskOperation::Shrink)
+    ->ArgsProduct({{1024, 4096}, {1, 4, 16, 64}})
+    ->Unit(benchmark::kMillisecond);
+
+// --- Tools ------------------------------------------------------------------
+
+// Args: edge length, contiguous (0 or 1). The magic wand's region search
+// from the middle of the document, with its default tolerance.
+void BM_FloodFill(benchmark::State& state) {
+  const int edge = static_cast<int>(state.range(0));
+  const bool contiguous = state.range(1) != 0;
+  const ImageDocument doc = make_rgb_document(edge, edge);
+  std::int64_t filled = 0;
+  for (auto _ : state) {
+    const ps::tools::FloodFillResult result =
+        ps::tools::flood_fill(doc, ps::tools::Point(edge / 2, edge / 2), 32, contiguous);
+    filled = 0;
+    for (const ps::tools::FillSpan& span : result.spans) {
+      filled += span.x1 - span.x0;
+    }
+    benchmark::DoNotOptimize(filled);
+  }
+  state.counters["filled_pixels"] = static_cast<double>(filled);
+  set_pixel_counters(state, std::int64_t{edge} * edge, std::int64_t{edge} * edge * 3);
+}
+BENCHMARK(BM_FloodFill)
+    ->ArgsProduct({{1024, 4096}, {1, 0}})
+    ->Unit(benchmark::kMillisecond);
+
+// Arg: edge length. A paint bucket click including its undo command.
+void BM_PaintBucket(benchmark::State& state) {
+  const int edge = static_cast<int>(state.range(0));
+  ImageDocument doc = make_rgb_document(edge, edge);
+  ps::tools::PaintBucketTool bucket;
+  ps::tools::ToolOptions options = bucket.options();
+  options.size = 32;
+  bucket.set_options(options);
+  const ps::tools::Point seed(edge / 2, edge / 2);
+  for (auto _ : state) {
+    bucket.begin_stroke(doc, seed);
+    std::unique_ptr<ps::core::Command> command = bucket.end_stroke(doc);
+    state.PauseTiming();
+    if (command) {
+      command->undo();
+    }
+    command.reset();
+    state.ResumeTiming();
+  }
+  set_pixel_counters(state, std::int64_t{edge} * edge, std::int64_t{edge} * edge * 3);
+}
+BENCHMARK(BM_PaintBucket)->Arg(1024)->Arg(4096)->Unit(benchmark::kMillisecond);
+
+// Args: edge length, brush size, hardness. One zigzag stroke across the
+// document; items are dabs.
+void BM_BrushStroke(benchmark::State& state) {
+  const int edge = static_cast<int>(state.range(0));
+  ImageDocument doc = make_rgb_document(edge, edge);
+  ps::tools::BrushTool brush;
+  ps::tools::ToolOptions options = brush.options();
+  options.size = static_cast<int>(state.range(1));
+  options.hardness = static_cast<int>(state.range(2));
+  options.opacity = 50;
+  brush.set_options(options);
+  const std::vector<ps::tools::Point> path = zigzag_path(edge, edge);
+  const double step = std::max(1.0, options.size * options.spacing / 100.0);
+  const auto dabs = static_cast<std::int64_t>(path_length(path) / step) + 1;
+  for (auto _ : state) {
+    std::unique_ptr<ps::core::Command> command = brush_stroke(brush, doc, path);
+    state.PauseTiming();
+    command.reset();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * dabs);
+  state.counters["dabs"] = static_cast<double>(dabs);
+}
+BENCHMARK(BM_BrushStroke)
+    ->ArgsProduct({{1024, 4096}, {5, 25, 100}, {100, 0}})
+    ->Unit(benchmark::kMillisecond);
+
+// --- Undo -------------------------------------------------------------------
+
+// Args: edge length, brush size. Pushes brush strokes onto an undo stack
+// and reports the memory it holds per stroke once background compression
+// is done.
+void BM_UndoStackStroke(benchmark::State& state) {
+  const int edge = static_cast<int>(state.range(0));
+  const int strokes = 16;
+  ImageDocument doc = make_rgb_document(edge, edge);
+  ps::tools::BrushTool brush;
+  ps::tools::ToolOptions options = brush.options();
+  options.size = static_cast<int>(state.range(1));
+  brush.set_options(options);
+  const std::vector<ps::tools::Point> path = zigzag_path(edge, edge);
+  std::size_t memory = 0;
+  for (auto _ : state) {
+    ps::core::UndoStack stack;
+    for (int i = 0; i < strokes; ++i) {
+      stack.push(brush_stroke(brush, doc, path));
+    }
+    stack.wait_for_compression();
+    memory = stack.memory_usage();
+    state.PauseTiming();
+    stack.clear();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * strokes);
+  state.counters["bytes_per_stroke"] = static_cast<double>(memory) / strokes;
+}
+BENCHMARK(BM_UndoStackStroke)
+    ->ArgsProduct({{1024, 4096}, {5, 25, 100}})
+    ->Unit(benchmark::kMillisecond);
+
+// --- PNG --------------------------------------------------------------------
+
+// Unique per run, so concurrent runs do not share files.
+std::string temp_png_path(const char* name) {
+  static const std::string run = std::to_string(std::random_device{}());
+  const std::string file = "ps_modern_bench_" + run + "_" + name + ".png";
+  return (std::filesystem::temp_directory_path() / file).string();
+}
+
+// Args: edge length, ThreadPool threads. The encoder deflates blocks on
+// the pool, so this shows how saves scale with the thread count.
+void BM_PngSave(benchmark::State& state) {
+  const int edge = static_cast<int>(state.range(0));
+  const ImageDocument doc = make_rgb_document(edge, edge);
+  const ps::io::PNGFormat png;
+  const std::string path = temp_png_path("save");
+  ps::core::ThreadPool& pool = ps::core::ThreadPool::instance();
+  const std::size_t threads = pool.thread_count();
+  pool.set_thread_count(static_cast<std::size_t>(state.range(1)));
+  for (auto _ : state) {
+    png.save(path, doc);
+  }
+  pool.set_thread_count(threads);
+  std::remove(path.c_str());
+  set_pixel_counters(state, std::int64_t{edge} * edge, std::int64_t{edge} * edge * 3);
+}
+BENCHMARK(BM_PngSave)
+    ->ArgsProduct({{1024, 4096}, {1, 2, 4, 8}})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+// Arg: edge length.
+void BM_PngLoad(benchmark::State& state) {
+  const int edge = static_cast<int>(state.range(0));
+  const ps::io::PNGFormat png;
+  const std::string path = temp_png_path("load");
+  png.save(path, make_rgb_document(edge, edge));
+  for (auto _ : state) {
+    ImageDocument doc = png.load(path);
+    benchmark::DoNotOptimize(doc);
+  }
+  std::remove(path.c_str());
+  set_pixel_counters(state, std::int64_t{edge} * edge, std::int64_t{edge} * edge * 3);
+}
+BENCHMARK(BM_PngLoad)->Arg(1024)->Arg(4096)->Unit(benchmark::kMillisecond);
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  // JSON by default; a --benchmark_format given on the command line comes
+  // later and wins.
+  std::vector<char*> args;
+  std::string format = "--benchmark_format=json";
+  args.push_back(argv[0]);
+  args.push_back(format.data());
+  for (int i = 1; i < argc; ++i) {
+    args.push_back(argv[i]);
+  }
+  int count = static_cast<int>(args.size());
+  benchmark::Initialize(&count, args.data());
+  if (benchmark::ReportUnrecognizedArguments(count, args.data())) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
@@ -0,0 +1,112 @@
+#include "ps/core/buffer_pool.h"
+
+#include <iterator>
+
+namespace ps::core {
+
+BufferPool& BufferPool::instance() {
+  // Never destroyed, so buffers released during static destruction are safe
+  static BufferPool* instance = new BufferPool();
+  return *instance;
+}
+
+std::size_t BufferPool::class_size_for(std::size_t bytes) {
+  // Round up to the next of 1, 1.25, 1.5 or 1.75 times a power of two
+  std::size_t power = kMinPooledBytes;
+  while (power * 2 <= bytes) {
+    power *= 2;
+  }
+  const std::size_t step = power / 4;
+  return (bytes + step - 1) / step * step;
+}
+
+PixelStorage BufferPool::acquire(std::size_t bytes) {
+  PixelStorage storage;
+  if (bytes < kMinPooledBytes) {
+    storage.resize(bytes);
+    return storage;
+  }
+
+  const std::size_t class_size = class_size_for(bytes);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = free_lists_.find(class_size);
+    if (it != free_lists_.end() && !it->second.empty()) {
+      storage.swap(it->second.back());
+      it->second.pop_back();
+      cached_bytes_ -= storage.capacity();
+      ++hits_;
+    } else {
+      ++misses_;
+    }
+  }
+
+  if (storage.capacity() < class_size) {
+    storage.reserve(class_size);
+  }
+  storage.resize(bytes);
+  return storage;
+}
+
+void BufferPool::release(PixelStorage&& storage) {
+  const std::size_t capacity = storage.capacity();
+  if (capacity < kMinPooledBytes) {
+    PixelStorage().swap(storage);
+    return;
+  }
+
+  // Only storage that exactly matches a class is reused, so a hit always
+  // has room for any request of that class without reallocating.
+  const std::size_t class_size = class_size_for(capacity);
+  PixelStorage recycled;
+  recycled.swap(storage);
+  recycled.clear();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (class_size != capacity || cached_bytes_ + capacity > capacity_bytes_) {
+    return;  // freed when recycled goes out of scope
+  }
+  cached_bytes_ += capacity;
+  free_lists_[class_size].push_back(std::move(recycled));
+}
+
+void BufferPool::set_capacity(std::size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  capacity_bytes_ = bytes;
+  shrink_to(bytes);
+}
+
+std::size_t BufferPool::capacity() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return capacity_bytes_;
+}
+
+void BufferPool::clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  shrink_to(0);
+}
+
+BufferPoolStats BufferPool::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  BufferPoolStats stats;
+  stats.cached_bytes = cached_bytes_;
+  stats.capacity_bytes = capacity_bytes_;
+  stats.hits = hits_;
+  stats.misses = misses_;
+  return stats;
+}
+
+void BufferPool::shrink_to(std::size_t bytes) {
+  // Drop the largest idle buffers first
+  while (cached_bytes_ > bytes && !free_lists_.empty()) {
+    auto it = std::prev(free_lists_.end());
+    if (it->second.empty()) {
+      free_lists_.erase(it);
+      continue;
+    }
+    cached_bytes_ -= it->second.back().capacity();
+    it->second.pop_back();
+  }
+}
+
+}  // namespace ps::core
@@ -2,25 +2,47 @@
 
 #include <algorithm>
 
+#include "ps/core/pixel_conversion.h"
+
 namespace ps::core {
 
+namespace {
+
+// Returns the layer's pixels as straight RGBA8, converting into @p storage
+// only for premultiplied layers
+const ImageBuffer& straight_pixels(const Layer& layer, ImageBuffer& storage) {
+  if (layer.format() == PixelFormat::RGBA8) {
+    return layer.buffer();
+  }
+  storage = convert_rgba_buffer(layer.buffer(), PixelFormat::RGBA8);
+  return storage;
+}
+
+}  // namespace
+
 std::vector<std::unique_ptr<Layer>> split_layer_to_channels(
     const Layer& source, bool include_alpha) {
   std::vector<std::unique_ptr<Layer>> result;
 
   const Size size = source.size();
-  const uint8_t* src = source.buffer().data();
+
+  // Channel values are straight colors
+  ImageBuffer converted(Size{}, PixelFormat::RGBA8);
+  const uint8_t* src = straight_pixels(source, converted).data();
 
   // Create Red channel layer
-  auto red_layer = std::make_unique<Layer>(size, "Red");
+  auto red_layer = std::make_unique<Layer>(size, "Red", StorageLayout::Contiguous,
+                                       BufferInit::Uninitialized);
   uint8_t* red_dst = red_layer->buffer().data();
 
   // Create Green channel layer
-  auto green_layer = std::make_unique<Layer>(size, "Green");
+  auto green_layer = std::make_unique<Layer>(size, "Green", StorageLayout::Contiguous,
+                                       BufferInit::Uninitialized);
   uint8_t* green_dst = green_layer->buffer().data();
 
   // Create Blue channel layer
-  auto blue_layer = std::make_unique<Layer>(size, "Blue");
+  auto blue_layer = std::make_unique<Layer>(size, "Blue", StorageLayout::Contiguous,
+                                       BufferInit::Uninitialized);
   uint8_t* blue_dst = blue_layer->buffer().data();
 
   // Optionally create Alpha channel layer
@@ -28,11 +50,13 @@ std::vector<std::unique_ptr<Layer>> split_layer_to_channels(
   uint8_t* alpha_dst = nullptr;
 
   if (include_alpha) {
-    alpha_layer = std::make_unique<Layer>(size, "Alpha");
+    alpha_layer = std::make_unique<Layer>(size, "Alpha", StorageLayout::Contiguous,
+                                       BufferInit::Uninitialized);
     alpha_dst = alpha_layer->buffer().data();
   }
 
-  // Split channels
+  // Split channels; every destination byte is written, so the layers were
+  // allocated uninitialized
   const int pixel_count = size.width * size.height;
   for (int i = 0; i < pixel_count; ++i) {
     const int src_idx = i * 4;
@@ -104,13 +128,19 @@ std::unique_ptr<Layer> merge_channels_to_layer(
     return std::make_unique<Layer>(Size{1, 1}, "Merged");
   }
 
-  auto merged = std::make_unique<Layer>(size, "Merged");
+  auto merged = std::make_unique<Layer>(size, "Merged", StorageLayout::Contiguous,
+                                        BufferInit::Uninitialized);
   uint8_t* dst = merged->buffer().data();
 
-  const uint8_t* red_src = red_layer.buffer().data();
-  const uint8_t* green_src = green_layer.buffer().data();
-  const uint8_t* blue_src = blue_layer.buffer().data();
-  const uint8_t* alpha_src = alpha_layer ? alpha_layer->buffer().data() : nullptr;
+  // Premultiplied channel layers are read as straight RGBA8
+  ImageBuffer converted[4] = {
+      ImageBuffer(Size{}, PixelFormat::RGBA8), ImageBuffer(Size{}, PixelFormat::RGBA8),
+      ImageBuffer(Size{}, PixelFormat::RGBA8), ImageBuffer(Size{}, PixelFormat::RGBA8)};
+  const uint8_t* red_src = straight_pixels(red_layer, converted[0]).data();
+  const uint8_t* green_src = straight_pixels(green_layer, converted[1]).data();
+  const uint8_t* blue_src = straight_pixels(blue_layer, converted[2]).data();
+  const uint8_t* alpha_src =
+      alpha_layer ? straight_pixels(*alpha_layer, converted[3]).data() : nullptr;
 
   const int pixel_count = size.width * size.height;
   for (int i = 0; i < pixel_count; ++i) {
@@ -146,9 +176,9 @@ void split_document_channels(ImageDocument& doc) {
   for (auto& layer : channel_layers) {
     doc.add_layer(layer->name());
     Layer& added = doc.layer_at(doc.layer_count() - 1);
-    std::copy(layer->buffer().data(),
-              layer->buffer().data() + layer->buffer().byte_size(),
-              added.buffer().data());
+    added.buffer() = layer->buffer();
+    added.buffer().set_layout(doc.storage_layout());
+    added.set_format(doc.layer_format());
   }
 }
 
@@ -166,9 +196,9 @@ void merge_document_channels(ImageDocument& doc) {
 
   doc.add_layer("Merged Channels");
   Layer& added = doc.layer_at(doc.layer_count() - 1);
-  std::copy(merged->buffer().data(),
-            merged->buffer().data() + merged->buffer().byte_size(),
-            added.buffer().data());
+  added.buffer() = merged->buffer();
+  added.buffer().set_layout(doc.storage_layout());
+  added.set_format(doc.layer_format());
 }
 
 }  // namespace ps::core
@@ -0,0 +1,67 @@
+#include "channel_region.h"
+
+#include <stdexcept>
+#include <string>
+
+#include "target_clones.h"
+
+namespace ps::core::detail {
+
+std::vector<std::size_t> target_channels(const ImageDocument& doc,
+                                         const std::vector<std::size_t>& requested,
+                                         const char* what) {
+  std::vector<std::size_t> channels = requested;
+  if (channels.empty()) {
+    for (std::size_t i = 0; i < doc.channels().size(); ++i) {
+      channels.push_back(i);
+    }
+  }
+  for (std::size_t index : channels) {
+    const PixelFormat format = doc.channel_at(index).buffer.format();
+    if (format != PixelFormat::Gray8 && format != PixelFormat::Gray16) {
+      throw std::invalid_argument(std::string(what) +
+                                  " apply to Gray8 and Gray16 channels only");
+    }
+  }
+  return channels;
+}
+
+Rect operation_area(const ImageDocument& doc, const Rect& area, bool use_selection) {
+  const Size size = doc.size();
+  const Rect image{0, 0, size.width, size.height};
+  Rect clipped = area.is_empty() ? image : area.intersected(image);
+  if (use_selection && doc.selection().has_selection()) {
+    clipped = clipped.intersected(doc.selection().bounds());
+  }
+  return clipped;
+}
+
+PS_TARGET_CLONES
+void blend_row(std::uint8_t* dst, const std::uint8_t* result, const std::uint8_t* weights,
+               int count) {
+  for (int i = 0; i < count; ++i) {
+    dst[i] = static_cast<std::uint8_t>(dst[i] + (result[i] - dst[i]) * weights[i] / 255);
+  }
+}
+
+PS_TARGET_CLONES
+void blend_row(std::uint16_t* dst, const std::uint16_t* result, const std::uint8_t* weights,
+               int count) {
+  for (int i = 0; i < count; ++i) {
+    dst[i] = static_cast<std::uint16_t>(dst[i] + (result[i] - dst[i]) * weights[i] / 255);
+  }
+}
+
+ImageBuffer crop(const ImageBuffer& source, const Rect& area) {
+  ImageBuffer cropped(Size{area.width, area.height}, source.format(),
+                      StorageLayout::Contiguous, BufferInit::Uninitialized);
+  std::vector<std::uint8_t> row(static_cast<std::size_t>(area.width) *
+                                bytes_per_pixel(source.format()));
+  for (int y = 0; y < area.height; ++y) {
+    source.read_pixels(area.x, area.y + y, area.width, row.data());
+    cropped.write_pixels(0, y, area.width, row.data());
+  }
+  return cropped;
+}
+
+}  // namespace ps::core::detail
@@ -0,0 +1,95 @@
+#pragma once
+
+// Internal to ps_modern_core: the channel selection, area clipping,
+// selection-weighted blending and tile loop shared by filters and
+// adjustments.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "ps/core/image_document.h"
+#include "ps/core/thread_pool.h"
+
+namespace ps::core::detail {
+
+/**
+ * @brief Channels an operation runs on: @p requested, or all of them if
+ *        empty
+ * @param what Names the operation in the error, e.g. "filters"
+ * @throw std::invalid_argument if a channel is not Gray8 or Gray16
+ */
+std::vector<std::size_t> target_channels(const ImageDocument& doc,
+                                         const std::vector<std::size_t>& requested,
+                                         const char* what);
+
+/**
+ * @brief @p area (or the whole image if empty) clipped to the image and,
+ *        with @p use_selection, to the selection's bounds
+ */
+Rect operation_area(const ImageDocument& doc, const Rect& area, bool use_selection);
+
+/**
+ * @brief The selection an operation blends by, or nullptr to write every
+ *        pixel
+ */
+inline const SelectionMask* operation_selection(const ImageDocument& doc,
+                                                bool use_selection) {
+  return use_selection && doc.selection().has_selection() ? &doc.selection() : nullptr;
+}
+
+/**
+ * @brief dst = dst + (result - dst) × weight / 255, as the batch tool's
+ *        fill applies the selection
+ */
+void blend_row(std::uint8_t* dst, const std::uint8_t* result, const std::uint8_t* weights,
+               int count);
+void blend_row(std::uint16_t* dst, const std::uint16_t* result, const std::uint8_t* weights,
+               int count);
+
+/**
+ * @brief Copies @p area of a buffer into a new contiguous buffer
+ */
+ImageBuffer crop(const ImageBuffer& source, const Rect& area);
+
+/**
+ * @brief Calls fn(rect, weights) for every buffer tile of @p area on the
+ *        ThreadPool
+ *
+ * One task per buffer tile, so writes from different tasks never share a
+ * tile (or, for contiguous buffers, a row span). With a selection,
+ * @p weights holds its coverage of rect row by row and tiles it leaves
+ * entirely unselected are skipped; without one, weights is nullptr.
+ */
+template <typename Fn>
+void for_each_selected_tile(const Rect& area, const SelectionMask* selection, Fn&& fn) {
+  constexpr int kTile = ImageBuffer::kTileSize;
+  const int tx0 = area.x / kTile;
+  const int ty0 = area.y / kTile;
+  const int columns = (area.x + area.width - 1) / kTile - tx0 + 1;
+  const int rows = (area.y + area.height - 1) / kTile - ty0 + 1;
+
+  ThreadPool::instance().parallel_for(0, columns * rows, 1, [&](int t0, int t1) {
+    thread_local std::vector<std::uint8_t> weights;
+    for (int t = t0; t < t1; ++t) {
+      const Rect block{(tx0 + t % columns) * kTile, (ty0 + t / columns) * kTile, kTile, kTile};
+      const Rect rect = area.intersected(block);
+
+      if (selection != nullptr) {
+        weights.resize(static_cast<std::size_t>(rect.width) * rect.height);
+        for (int y = 0; y < rect.height; ++y) {
+          selection->read_row(rect.x, rect.y + y, rect.width,
+                              weights.data() + static_cast<std::size_t>(y) * rect.width);
+        }
+        if (std::all_of(weights.begin(), weights.end(),
+                        [](std::uint8_t w) { return w == 0; })) {
+          continue;
+        }
+      }
+      fn(rect, selection != nullptr ? weights.data() : nullptr);
+    }
+  });
+}
+
+}  // namespace ps::core::detail
@@ -3,6 +3,8 @@
 #include <algorithm>
 #include <cstring>
 
+#include "ps/core/packbits.h"
+
 namespace ps::core {
 
 ImageCommand::ImageCommand(ImageDocument& doc) : document_(doc) {}
@@ -12,15 +14,14 @@ void ImageCommand::save_channel(std::size_t index) {
     return;
   }
 
-  const auto& channel = document_.channel_at(index);
+  // Copying a tiled buffer only shares its tiles; they are duplicated
+  // lazily when the document channel is painted afterwards.
   ChannelBackup backup;
   backup.index = index;
-  backup.buffer = ImageBuffer(channel.buffer.size(), channel.buffer.format());
-
-  std::memcpy(backup.buffer.data(), channel.buffer.data(),
-              channel.buffer.byte_size());
+  backup.buffer = document_.channel_at(index).buffer;
 
   saved_channels_.push_back(std::move(backup));
+  update_footprint();
 }
 
 void ImageCommand::save_all_channels() {
@@ -31,18 +32,250 @@ void ImageCommand::save_all_channels() {
 }
 
 void ImageCommand::restore_channels() {
+  decompress();
   for (auto& backup : saved_channels_) {
     if (backup.index >= document_.channels().size()) {
       continue;
     }
 
     auto& channel = document_.channel_at(backup.index);
-    std::memcpy(channel.buffer.data(), backup.buffer.data(),
-                backup.buffer.byte_size());
+    channel.buffer = backup.buffer;
+    const Size size = channel.buffer.size();
+    document_.mark_dirty(Rect{0, 0, size.width, size.height});
+  }
+}
+
+void ImageCommand::save_region(int x, int y, int width, int height) {
+  const Size doc_size = document_.size();
+  const int x0 = std::max(0, x);
+  const int y0 = std::max(0, y);
+  const int x1 = std::min(doc_size.width, x + width);
+  const int y1 = std::min(doc_size.height, y + height);
+  if (x0 >= x1 || y0 >= y1) {
+    return;
+  }
+
+  auto& channels = document_.channels();
+  for (std::size_t i = 0; i < channels.size(); ++i) {
+    const ImageBuffer& buffer = channels[i].buffer;
+
+    if (i >= saved_regions_.size()) {
+      RegionBackup region;
+      region.index = i;
+      region.size = buffer.size();
+      region.format = buffer.format();
+      region.block_size =
+          buffer.is_tiled() ? ImageBuffer::kTileSize : kUndoBlockSize;
+      region.columns = (region.size.width + region.block_size - 1) / region.block_size;
+      const int rows = (region.size.height + region.block_size - 1) / region.block_size;
+      region.saved.assign(static_cast<std::size_t>(region.columns) * rows, false);
+      saved_regions_.push_back(std::move(region));
+    }
+
+    RegionBackup& region = saved_regions_[i];
+    if (buffer.size().width != region.size.width ||
+        buffer.size().height != region.size.height) {
+      continue;
+    }
+
+    const int block_size = region.block_size;
+    const int bx1 = (x1 - 1) / block_size + 1;
+    const int by1 = (y1 - 1) / block_size + 1;
+    const bool share_tiles =
+        buffer.is_tiled() && block_size == ImageBuffer::kTileSize;
+    const std::size_t bpp = bytes_per_pixel(region.format);
+
+    for (int by = y0 / block_size; by < by1; ++by) {
+      for (int bx = x0 / block_size; bx < bx1; ++bx) {
+        const std::size_t flag = static_cast<std::size_t>(by) * region.columns + bx;
+        if (region.saved[flag]) {
+          continue;
+        }
+        region.saved[flag] = true;
+
+        BlockBackup block;
+        block.x = bx * block_size;
+        block.y = by * block_size;
+        block.width = std::min(block_size, region.size.width - block.x);
+        block.height = std::min(block_size, region.size.height - block.y);
+
+        if (share_tiles) {
+          block.shares_tile = true;
+          block.tile = buffer.shared_tile(bx, by);
+        } else {
+          const std::size_t row_bytes = static_cast<std::size_t>(block.width) * bpp;
+          block.pixels.resize(row_bytes * block.height);
+          for (int r = 0; r < block.height; ++r) {
+            buffer.read_pixels(block.x, block.y + r, block.width,
+                               block.pixels.data() + r * row_bytes);
+          }
+        }
+        region.blocks.push_back(std::move(block));
+      }
+    }
+  }
+  update_footprint();
+}
+
+void ImageCommand::swap_regions() {
+  decompress();
+  Rect damage;
+  for (auto& region : saved_regions_) {
+    if (region.index >= document_.channels().size()) {
+      continue;
+    }
+
+    auto& buffer = document_.channel_at(region.index).buffer;
+    const Size size = buffer.size();
+    if (size.width != region.size.width || size.height != region.size.height ||
+        buffer.format() != region.format) {
+      continue;
+    }
+
+    for (auto& block : region.blocks) {
+      swap_block(buffer, block);
+      damage = damage.united(Rect{block.x, block.y, block.width, block.height});
+    }
+  }
+  document_.mark_dirty(damage);
+}
+
+void ImageCommand::swap_block(ImageBuffer& buffer, BlockBackup& block) {
+  const std::size_t bpp = bytes_per_pixel(buffer.format());
+  const std::size_t row_bytes = static_cast<std::size_t>(block.width) * bpp;
+
+  if (block.shares_tile) {
+    if (buffer.is_tiled()) {
+      buffer.swap_tile(block.x / ImageBuffer::kTileSize,
+                       block.y / ImageBuffer::kTileSize, block.tile);
+      return;
+    }
+
+    // The channel was converted to a contiguous layout after the block was
+    // saved; fall back to swapping bytes.
+    block.pixels.assign(row_bytes * block.height, 0);
+    if (block.tile) {
+      const Tile& tile = *block.tile;
+      const std::uint8_t* src = tile.data();
+      const std::size_t tile_row_bytes =
+          static_cast<std::size_t>(ImageBuffer::kTileSize) * bpp;
+      for (int r = 0; r < block.height; ++r) {
+        std::memcpy(block.pixels.data() + r * row_bytes, src + r * tile_row_bytes,
+                    row_bytes);
+      }
+    }
+    block.tile.reset();
+    block.shares_tile = false;
+  }
+
+  std::vector<std::uint8_t> current(row_bytes);
+  for (int r = 0; r < block.height; ++r) {
+    std::uint8_t* saved = block.pixels.data() + r * row_bytes;
+    buffer.read_pixels(block.x, block.y + r, block.width, current.data());
+    buffer.write_pixels(block.x, block.y + r, block.width, saved);
+    std::memcpy(saved, current.data(), row_bytes);
+  }
+}
+
+void ImageCommand::undo() {
+  restore_channels();
+  swap_regions();
+}
+
+std::size_t ImageCommand::memory_footprint() const {
+  return footprint_bytes_.load(std::memory_order_relaxed);
+}
+
+void ImageCommand::compress() {
+  for (auto& backup : saved_channels_) {
+    const ImageBuffer& buffer = backup.buffer;
+    if (!backup.packed.empty() || buffer.is_tiled() || buffer.byte_size() == 0) {
+      continue;
+    }
+
+    std::vector<std::uint8_t> packed = packbits_encode(buffer.data(), buffer.byte_size());
+    if (packed.size() >= buffer.byte_size()) {
+      continue;
+    }
+    backup.packed_size = buffer.size();
+    backup.packed = std::move(packed);
+    backup.buffer = ImageBuffer(Size{}, buffer.format());
+    compressed_ = true;
+  }
+
+  for (auto& region : saved_regions_) {
+    for (auto& block : region.blocks) {
+      if (block.shares_tile || block.packed || block.pixels.empty()) {
+        continue;
+      }
+
+      std::vector<std::uint8_t> packed =
+          packbits_encode(block.pixels.data(), block.pixels.size());
+      if (packed.size() >= block.pixels.size()) {
+        continue;
+      }
+      packed.shrink_to_fit();
+      block.pixels.swap(packed);
+      block.packed = true;
+      compressed_ = true;
+    }
+  }
+
+  update_footprint();
+}
+
+void ImageCommand::decompress() {
+  if (!compressed_) {
+    return;
+  }
+
+  for (auto& backup : saved_channels_) {
+    if (backup.packed.empty()) {
+      continue;
+    }
+
+    ImageBuffer buffer(backup.packed_size, backup.buffer.format());
+    packbits_decode(backup.packed.data(), backup.packed.size(), buffer.data(),
+                    buffer.byte_size());
+    backup.buffer = std::move(buffer);
+    std::vector<std::uint8_t>().swap(backup.packed);
   }
+
+  for (auto& region : saved_regions_) {
+    const std::size_t bpp = bytes_per_pixel(region.format);
+    for (auto& block : region.blocks) {
+      if (!block.packed) {
+        continue;
+      }
+
+      std::vector<std::uint8_t> pixels(static_cast<std::size_t>(block.width) *
+                                        block.height * bpp);
+      packbits_decode(block.pixels.data(), block.pixels.size(), pixels.data(),
+                      pixels.size());
+      block.pixels.swap(pixels);
+      block.packed = false;
+    }
+  }
+
+  compressed_ = false;
+  update_footprint();
 }
 
-void ImageCommand::undo() { restore_channels(); }
+void ImageCommand::update_footprint() {
+  std::size_t bytes = 0;
+  for (const auto& backup : saved_channels_) {
+    bytes += backup.buffer.allocated_bytes() + backup.packed.size();
+  }
+  for (const auto& region : saved_regions_) {
+    for (const auto& block : region.blocks) {
+      bytes += block.pixels.size();
+      if (block.tile) {
+        bytes += block.tile->byte_size();
+      }
+    }
+  }
+  footprint_bytes_.store(bytes, std::memory_order_relaxed);
+}
 
 FillCommand::FillCommand(ImageDocument& doc, std::size_t channel_index,
                          std::uint8_t value)
@@ -51,20 +284,29 @@ FillCommand::FillCommand(ImageDocument& doc, std::size_t channel_index,
       fill_value_(value) {}
 
 void FillCommand::execute() {
-  save_channel(channel_index_);
+  // Redo runs execute() again; the original backup is still valid
+  if (saved_channels_.empty()) {
+    save_channel(channel_index_);
+  }
 
   auto& channel = document_.channel_at(channel_index_);
-  std::memset(channel.buffer.data(), fill_value_, channel.buffer.byte_size());
+  channel.buffer.fill(fill_value_);
+  document_.mark_dirty(Rect{0, 0, channel.buffer.size().width,
+                            channel.buffer.size().height});
 }
 
 ClearCommand::ClearCommand(ImageDocument& doc, std::size_t channel_index)
     : ImageCommand(doc), channel_index_(channel_index) {}
 
 void ClearCommand::execute() {
-  save_channel(channel_index_);
+  if (saved_channels_.empty()) {
+    save_channel(channel_index_);
+  }
 
   auto& channel = document_.channel_at(channel_index_);
-  std::memset(channel.buffer.data(), 0, channel.buffer.byte_size());
+  channel.buffer.fill(0);
+  document_.mark_dirty(Rect{0, 0, channel.buffer.size().width,
+                            channel.buffer.size().height});
 }
 
 }  // namespace ps::core
@@ -0,0 +1,542 @@
+#include "ps/dither/dither.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include "ps/core/pixel_accessor.h"
+#include "ps/core/thread_pool.h"
+#include "target_clones.h"
+
+namespace ps::dither {
+namespace {
+
+using core::ImageBuffer;
+using core::ImageDocument;
+using core::PixelFormat;
+using core::Size;
+
+constexpr double kPi = 3.14159265358979323846;
+
+// Largest edge of a halftone tile, as the original's kMaxCellSize bounded
+// its cells
+constexpr int kMaxScreenTile = 512;
+
+// Columns a diffusion row advances between checks on the row above
+constexpr int kDiffusionBlock = 64;
+
+// Packs one bit per pixel, set where the darkness (the complement of the
+// level) exceeds the threshold
+PS_TARGET_CLONES
+void screen_row(const std::uint8_t* gray, const std::uint8_t* thresholds, std::uint8_t* bits,
+                int count) {
+  const int whole = count / 8;
+  for (int i = 0; i < whole; ++i) {
+    const std::uint8_t* g = gray + i * 8;
+    const std::uint8_t* t = thresholds + i * 8;
+    unsigned byte = 0;
+    for (int b = 0; b < 8; ++b) {
+      byte |= static_cast<unsigned>(static_cast<std::uint8_t>(~g[b]) > t[b]) << (7 - b);
+    }
+    bits[i] = static_cast<std::uint8_t>(byte);
+  }
+  if (whole * 8 < count) {
+    unsigned byte = 0;
+    for (int x = whole * 8; x < count; ++x) {
+      byte |= static_cast<unsigned>(static_cast<std::uint8_t>(~gray[x]) > thresholds[x])
+              << (7 - x % 8);
+    }
+    bits[whole] = static_cast<std::uint8_t>(byte);
+  }
+}
+
+PS_TARGET_CLONES
+void unpack_row(const std::uint8_t* bits, std::uint8_t* gray, int count) {
+  for (int x = 0; x < count; ++x) {
+    gray[x] = ((bits[x / 8] >> (7 - x % 8)) & 1) ? 0 : 255;
+  }
+}
+
+bool is_blank(const std::uint8_t* bytes, std::size_t count) {
+  return std::all_of(bytes, bytes + count, [](std::uint8_t value) { return value == 0; });
+}
+
+// Repeats a tile row across @p count columns
+void expand_row(const std::uint8_t* tile_row, int tile_width, std::uint8_t* out, int count) {
+  for (int x = 0; x < count; x += tile_width) {
+    std::memcpy(out + x, tile_row, static_cast<std::size_t>(std::min(tile_width, count - x)));
+  }
+}
+
+void require_gray(const ImageBuffer& gray) {
+  if (gray.format() != PixelFormat::Gray8) {
+    throw std::invalid_argument("bitmap conversion needs a Gray8 channel");
+  }
+}
+
+// Runs @p body(y0, y1) over bands of tile rows on the ThreadPool, so no
+// two tasks write one tile
+template <typename Body>
+void for_each_band(int height, Body&& body) {
+  constexpr int kBand = ImageBuffer::kTileSize;
+  const int bands = (height + kBand - 1) / kBand;
+  core::ThreadPool::instance().parallel_for(0, bands, 1, [&](int b0, int b1) {
+    body(b0 * kBand, std::min(height, b1 * kBand));
+  });
+}
+
+/**
+ * Schedules the rows of an error diffusion. Workers claim rows in order;
+ * row y reads the errors row y - 1 leaves below it, so it may process a
+ * column once row y - 1 is a column past it. Rows finish in order, which
+ * bounds the rows in flight by the number of workers.
+ */
+class Wavefront {
+ public:
+  explicit Wavefront(int rows) : columns_done_(new std::atomic<int>[rows]) {
+    for (int y = 0; y < rows; ++y) {
+      columns_done_[y].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  int claim() { return next_row_.fetch_add(1, std::memory_order_relaxed); }
+
+  // Blocks until row y - 1 has finished @p columns columns. The row above
+  // was claimed earlier by a running worker, so it always gets there.
+  void wait(int y, int columns) const {
+    if (y == 0) {
+      return;
+    }
+    while (columns_done_[y - 1].load(std::memory_order_acquire) < columns) {
+      std::this_thread::yield();
+    }
+  }
+
+  void publish(int y, int columns) {
+    columns_done_[y].store(columns, std::memory_order_release);
+  }
+
+ private:
+  std::atomic<int> next_row_{0};
+  std::unique_ptr<std::atomic<int>[]> columns_done_;
+};
+
+/**
+ * Floyd-Steinberg over @p height rows of @p width pixels with @p Channels
+ * components, on the ThreadPool in wavefront order.
+ *
+ * load(y, values) fills row y's levels (Channels per pixel, interleaved);
+ * quantize(x, values, chosen, out) records the output for one pixel's
+ * adjusted levels in the row's @p out_bytes of output, zeroed per row, and
+ * returns the levels it stands for in chosen; store(y, out) is called when
+ * row y is done. Errors are kept in sixteenths in a ring of rows, more
+ * than the rows in flight can touch.
+ */
+template <int Channels, typename Load, typename Quantize, typename Store>
+void diffuse(int height, int width, std::size_t out_bytes, Load&& load, Quantize&& quantize,
+             Store&& store) {
+  if (height <= 0 || width <= 0) {
+    return;
+  }
+  auto& pool = core::ThreadPool::instance();
+  const int workers =
+      std::clamp(static_cast<int>(pool.thread_count()), 1, height);
+  const int ring = workers + 2;
+  const std::size_t stride = (static_cast<std::size_t>(width) + 2) * Channels;
+  std::vector<int> errors(stride * ring, 0);
+  Wavefront wave(height);
+
+  pool.parallel_for(0, workers, 1, [&](int, int) {
+    std::vector<int> values(static_cast<std::size_t>(width) * Channels);
+    std::vector<std::uint8_t> out(out_bytes);
+    for (int y = wave.claim(); y < height; y = wave.claim()) {
+      int* current = errors.data() + stride * static_cast<std::size_t>(y % ring);
+      int* below = errors.data() + stride * static_cast<std::size_t>((y + 1) % ring);
+      std::fill(below, below + stride, 0);
+      std::fill(out.begin(), out.end(), 0);
+      load(y, values.data());
+
+      int carry[Channels] = {};
+      for (int x0 = 0; x0 < width; x0 += kDiffusionBlock) {
+        const int x1 = std::min(width, x0 + kDiffusionBlock);
+        wave.wait(y, std::min(width, x1 + 1));
+        for (int x = x0; x < x1; ++x) {
+          int* value = values.data() + static_cast<std::size_t>(x) * Channels;
+          const std::size_t at = (static_cast<std::size_t>(x) + 1) * Channels;
+          for (int c = 0; c < Channels; ++c) {
+            value[c] += (current[at + c] + carry[c] + 8) >> 4;
+          }
+          int chosen[Channels];
+          quantize(x, value, chosen, out.data());
+          for (int c = 0; c < Channels; ++c) {
+            const int error = value[c] - chosen[c];
+            carry[c] = 7 * error;
+            below[at - Channels + c] += 3 * error;
+            below[at + c] += 5 * error;
+            below[at + Channels + c] += error;
+          }
+        }
+        wave.publish(y, x1);
+      }
+      store(y, out.data());
+    }
+  });
+}
+
+std::vector<std::uint8_t> bayer_matrix() {
+  std::vector<std::uint8_t> matrix = {0};
+  for (int size = 1; size < 8; size *= 2) {
+    std::vector<std::uint8_t> next(static_cast<std::size_t>(size) * size * 4);
+    const int wide = size * 2;
+    for (int y = 0; y < size; ++y) {
+      for (int x = 0; x < size; ++x) {
+        const int m = 4 * matrix[static_cast<std::size_t>(y) * size + x];
+        next[static_cast<std::size_t>(y) * wide + x] = static_cast<std::uint8_t>(m);
+        next[static_cast<std::size_t>(y) * wide + x + size] = static_cast<std::uint8_t>(m + 2);
+        next[static_cast<std::size_t>(y + size) * wide + x] = static_cast<std::uint8_t>(m + 3);
+        next[static_cast<std::size_t>(y + size) * wide + x + size] =
+            static_cast<std::uint8_t>(m + 1);
+      }
+    }
+    matrix = std::move(next);
+  }
+  return matrix;  // 0..63
+}
+
+// Order in which the pixels of a dot turn black, from cell coordinates in
+// -1..1 (the original's DotScreenProc and its siblings)
+double spot(ScreenShape shape, double x, double y) {
+  const double ax = std::fabs(x);
+  const double ay = std::fabs(y);
+  switch (shape) {
+    case ScreenShape::Round:
+      // Round black dots up to 50%, round white dots after
+      return ax + ay <= 1.0 ? ax * ax + ay * ay
+                            : 2.0 - ((1.0 - ax) * (1.0 - ax) + (1.0 - ay) * (1.0 - ay));
+    case ScreenShape::Ellipse:
+      return ax * ax + 0.6 * ay * ay;
+    case ScreenShape::Line:
+      return ay;
+    case ScreenShape::Square:
+      return std::max(ax, ay);
+    case ScreenShape::Cross:
+      return std::min(ax, ay);
+  }
+  return 0.0;
+}
+
+// The palette entry nearest each 8 × 8 × 8 cube of colors, so matching a
+// color is one lookup
+class InverseMap {
+ public:
+  explicit InverseMap(const Palette& palette) : map_(32 * 32 * 32) {
+    core::ThreadPool::instance().parallel_for(0, 32, 1, [&](int r0, int r1) {
+      for (int r = r0; r < r1; ++r) {
+        for (int g = 0; g < 32; ++g) {
+          for (int b = 0; b < 32; ++b) {
+            const int cr = r * 8 + 4;
+            const int cg = g * 8 + 4;
+            const int cb = b * 8 + 4;
+            int best = 0;
+            int best_distance = 1 << 30;
+            for (std::size_t i = 0; i < palette.size(); ++i) {
+              const int dr = palette[i][0] - cr;
+              const int dg = palette[i][1] - cg;
+              const int db = palette[i][2] - cb;
+              const int distance = dr * dr + dg * dg + db * db;
+              if (distance < best_distance) {
+                best_distance = distance;
+                best = static_cast<int>(i);
+              }
+            }
+            map_[(r << 10) | (g << 5) | b] = static_cast<std::uint8_t>(best);
+          }
+        }
+      }
+    });
+  }
+
+  std::uint8_t operator()(int r, int g, int b) const {
+    return map_[((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3)];
+  }
+
+ private:
+  std::vector<std::uint8_t> map_;
+};
+
+}  // namespace
+
+Screen::Screen(int width, int height, std::vector<std::uint8_t> thresholds)
+    : width_(width), height_(height), thresholds_(std::move(thresholds)) {}
+
+Screen Screen::threshold() {
+  return Screen(1, 1, {127});
+}
+
+Screen Screen::pattern() {
+  std::vector<std::uint8_t> thresholds = bayer_matrix();
+  for (std::uint8_t& t : thresholds) {
+    t = static_cast<std::uint8_t>(t * 255 / 64);
+  }
+  return Screen(8, 8, std::move(thresholds));
+}
+
+Screen Screen::halftone(const HalftoneScreen& spec) {
+  const double period = std::clamp(spec.period, 1.0, 64.0);
+  const double theta = spec.angle * kPi / 180.0;
+  const double target_j = period * std::cos(theta);
+  const double target_k = period * std::sin(theta);
+
+  // The screen's step (j, k) repeats after (j² + k²) / gcd(j, k) pixels in
+  // x and y; take the step nearest the requested one whose tile fits
+  int step_j = 1;
+  int step_k = 0;
+  double best = 1e300;
+  for (int j = -64; j <= 64; ++j) {
+    for (int k = -64; k <= 64; ++k) {
+      const int norm = j * j + k * k;
+      if (norm == 0 || norm / std::gcd(j, k) > kMaxScreenTile) {
+        continue;
+      }
+      const double distance = (j - target_j) * (j - target_j) + (k - target_k) * (k - target_k);
+      if (distance < best) {
+        best = distance;
+        step_j = j;
+        step_k = k;
+      }
+    }
+  }
+  const int norm = step_j * step_j + step_k * step_k;
+  const int size = norm / std::gcd(step_j, step_k);
+
+  // Cell coordinates of each pixel center along (j, -k) and (k, j), which
+  // is counterclockwise on screen where y grows downwards
+  struct Entry {
+    std::int64_t priority;
+    std::uint32_t order;
+    std::uint32_t index;
+  };
+  std::vector<Entry> entries(static_cast<std::size_t>(size) * size);
+  for (int y = 0; y < size; ++y) {
+    for (int x = 0; x < size; ++x) {
+      const double px = x + 0.5;
+      const double py = y + 0.5;
+      double u = (px * step_j - py * step_k) / norm;
+      double v = (px * step_k + py * step_j) / norm;
+      u = 2.0 * (u - std::floor(u)) - 1.0;
+      v = 2.0 * (v - std::floor(v)) - 1.0;
+      const std::uint32_t index = static_cast<std::uint32_t>(y * size + x);
+      // Equal spots of different dots compare equal, so the hash decides
+      // and the dots of the tile grow in turn
+      std::uint32_t hash = index * 2654435761u;
+      hash ^= hash >> 15;
+      entries[index] = Entry{std::llround(spot(spec.shape, u, v) * 1e6), hash, index};
+    }
+  }
+  std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+    return a.priority != b.priority ? a.priority < b.priority : a.order < b.order;
+  });
+
+  const std::size_t count = entries.size();
+  std::vector<std::uint8_t> thresholds(count);
+  for (std::size_t rank = 0; rank < count; ++rank) {
+    thresholds[entries[rank].index] = static_cast<std::uint8_t>(rank * 255 / count);
+  }
+  return Screen(size, size, std::move(thresholds));
+}
+
+ImageBuffer screen_bitmap(const ImageBuffer& gray, const Screen& screen) {
+  require_gray(gray);
+  const Size size = gray.size();
+  ImageBuffer bitmap(size, PixelFormat::Bitmap1, gray.layout(), core::BufferInit::Zero);
+
+  for_each_band(size.height, [&](int y0, int y1) {
+    std::vector<std::uint8_t> levels(static_cast<std::size_t>(size.width));
+    std::vector<std::uint8_t> thresholds(static_cast<std::size_t>(size.width));
+    std::vector<std::uint8_t> bits(core::row_bytes(PixelFormat::Bitmap1, size.width));
+    for (int y = y0; y < y1; ++y) {
+      gray.read_pixels(0, y, size.width, levels.data());
+      expand_row(screen.row(y), screen.width(), thresholds.data(), size.width);
+      screen_row(levels.data(), thresholds.data(), bits.data(), size.width);
+      // White rows stay unwritten, so white tiles are never allocated
+      if (!is_blank(bits.data(), bits.size())) {
+        bitmap.write_pixels(0, y, size.width, bits.data());
+      }
+    }
+  });
+  return bitmap;
+}
+
+ImageBuffer to_bitmap(const ImageBuffer& gray, const BitmapOptions& options) {
+  require_gray(gray);
+  switch (options.method) {
+    case DitherMethod::Threshold:
+      return screen_bitmap(gray, Screen::threshold());
+    case DitherMethod::Pattern:
+      return screen_bitmap(gray, Screen::pattern());
+    case DitherMethod::Halftone:
+      return screen_bitmap(gray, Screen::halftone(options.screen));
+    case DitherMethod::Diffusion:
+      break;
+  }
+
+  const Size size = gray.size();
+  ImageBuffer bitmap(size, PixelFormat::Bitmap1, gray.layout(), core::BufferInit::Zero);
+  const std::size_t row_bytes = core::row_bytes(PixelFormat::Bitmap1, size.width);
+  // Rows of one tile finish on different workers; the mutex keeps them
+  // from allocating it twice
+  std::mutex write_mutex;
+
+  diffuse<1>(
+      size.height, size.width, row_bytes,
+      [&](int y, int* values) {
+        for (int x = 0; x < size.width;) {
+          const int span = gray.span_width(x);
+          const std::uint8_t* levels = gray.pixel_row(x, y);
+          std::copy(levels, levels + span, values + x);
+          x += span;
+        }
+      },
+      [](int x, const int* value, int* chosen, std::uint8_t* bits) {
+        if (value[0] < 128) {
+          bits[x / 8] |= static_cast<std::uint8_t>(0x80 >> (x % 8));
+          chosen[0] = 0;
+        } else {
+          chosen[0] = 255;
+        }
+      },
+      [&](int y, const std::uint8_t* bits) {
+        if (!is_blank(bits, row_bytes)) {
+          std::lock_guard<std::mutex> lock(write_mutex);
+          bitmap.write_pixels(0, y, size.width, bits);
+        }
+      });
+  return bitmap;
+}
+
+ImageBuffer bitmap_to_gray(const ImageBuffer& bitmap) {
+  if (bitmap.format() != PixelFormat::Bitmap1) {
+    throw std::invalid_argument("bitmap_to_gray needs a Bitmap1 buffer");
+  }
+  const Size size = bitmap.size();
+  ImageBuffer gray(size, PixelFormat::Gray8, bitmap.layout(), core::BufferInit::Zero);
+  for_each_band(size.height, [&](int y0, int y1) {
+    std::vector<std::uint8_t> bits(core::row_bytes(PixelFormat::Bitmap1, size.width));
+    std::vector<std::uint8_t> levels(static_cast<std::size_t>(size.width));
+    for (int y = y0; y < y1; ++y) {
+      bitmap.read_pixels(0, y, size.width, bits.data());
+      unpack_row(bits.data(), levels.data(), size.width);
+      gray.write_pixels(0, y, size.width, levels.data());
+    }
+  });
+  return gray;
+}
+
+Palette uniform_palette(int levels) {
+  if (levels < 2 || levels > 6) {
+    throw std::invalid_argument("uniform palettes have 2..6 levels per channel");
+  }
+  Palette palette;
+  for (int r = 0; r < levels; ++r) {
+    for (int g = 0; g < levels; ++g) {
+      for (int b = 0; b < levels; ++b) {
+        palette.push_back({static_cast<std::uint8_t>(r * 255 / (levels - 1)),
+                           static_cast<std::uint8_t>(g * 255 / (levels - 1)),
+                           static_cast<std::uint8_t>(b * 255 / (levels - 1))});
+      }
+    }
+  }
+  return palette;
+}
+
+IndexedImage to_indexed(const ImageDocument& doc, const Palette& palette, DitherMethod method) {
+  if (palette.empty() || palette.size() > 256) {
+    throw std::invalid_argument("indexed palettes have 1..256 colors");
+  }
+  if (method == DitherMethod::Halftone) {
+    throw std::invalid_argument("halftone screens convert to bitmaps only");
+  }
+  if (core::channel_layout(doc) == core::ChannelLayout::None) {
+    throw std::invalid_argument("the document lacks the channels of its mode");
+  }
+
+  const InverseMap nearest(palette);
+  const Size size = doc.size();
+  const std::size_t width = static_cast<std::size_t>(size.width);
+  ImageBuffer indices(size, PixelFormat::Indexed8, doc.storage_layout(), core::BufferInit::Zero);
+
+  core::dispatch_channels(doc, [&](const auto& pixels) {
+    using Accessor = std::decay_t<decltype(pixels)>;
+
+    if (method == DitherMethod::Diffusion) {
+      std::mutex write_mutex;  // As in to_bitmap()
+      diffuse<3>(
+          size.height, size.width, width,
+          [&](int y, int* values) {
+            std::vector<std::uint8_t> planes(width * Accessor::kPlanes);
+            pixels.read_planes(y, 0, size.width, planes.data());
+            for (std::size_t x = 0; x < width; ++x) {
+              pixels.rgb(planes.data(), width, x, values[x * 3], values[x * 3 + 1],
+                         values[x * 3 + 2]);
+            }
+          },
+          [&](int x, int* value, int* chosen, std::uint8_t* out) {
+            // Errors are measured from the color in gamut, so they cannot
+            // pile up past it
+            for (int c = 0; c < 3; ++c) {
+              value[c] = std::clamp(value[c], 0, 255);
+            }
+            const std::uint8_t index = nearest(value[0], value[1], value[2]);
+            for (int c = 0; c < 3; ++c) {
+              chosen[c] = palette[index][c];
+            }
+            out[x] = index;
+          },
+          [&](int y, const std::uint8_t* out) {
+            std::lock_guard<std::mutex> lock(write_mutex);
+            indices.write_pixels(0, y, size.width, out);
+          });
+      return;
+    }
+
+    // Pattern spreads each color over one step of an evenly spaced
+    // palette of the same size
+    const bool pattern = method == DitherMethod::Pattern;
+    const int levels =
+        std::max(2, static_cast<int>(std::lround(std::cbrt(static_cast<double>(palette.size())))));
+    const int spread = 255 / (levels - 1);
+    const std::vector<std::uint8_t> bayer = bayer_matrix();
+
+    for_each_band(size.height, [&](int y0, int y1) {
+      std::vector<std::uint8_t> planes(width * Accessor::kPlanes);
+      std::vector<std::uint8_t> out(width);
+      for (int y = y0; y < y1; ++y) {
+        pixels.read_planes(y, 0, size.width, planes.data());
+        const std::uint8_t* offsets = bayer.data() + (y % 8) * 8;
+        for (std::size_t x = 0; x < width; ++x) {
+          int r, g, b;
+          pixels.rgb(planes.data(), width, x, r, g, b);
+          if (pattern) {
+            const int offset = (2 * offsets[x % 8] + 1 - 64) * spread / 128;
+            r = std::clamp(r + offset, 0, 255);
+            g = std::clamp(g + offset, 0, 255);
+            b = std::clamp(b + offset, 0, 255);
+          }
+          out[x] = nearest(r, g, b);
+        }
+        indices.write_pixels(0, y, size.width, out.data());
+      }
+    });
+  });
+  return IndexedImage{std::move(indices), palette};
+}
+
+}  // namespace ps::dither
@@ -0,0 +1,410 @@
+#include "ps/filters/convolution.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <stdexcept>
+
+#include "target_clones.h"
+
+namespace ps::filters {
+namespace {
+
+PS_TARGET_CLONES
+void load_row(float* dst, const std::uint8_t* src, int count) {
+  for (int i = 0; i < count; ++i) {
+    dst[i] = src[i];
+  }
+}
+
+PS_TARGET_CLONES
+void load_row(float* dst, const std::uint16_t* src, int count) {
+  for (int i = 0; i < count; ++i) {
+    dst[i] = src[i];
+  }
+}
+
+// dst = src * weight
+PS_TARGET_CLONES
+void multiply_row(float* dst, const float* src, float weight, int count) {
+  for (int i = 0; i < count; ++i) {
+    dst[i] = src[i] * weight;
+  }
+}
+
+// dst += src * weight
+PS_TARGET_CLONES
+void multiply_add_row(float* dst, const float* src, float weight, int count) {
+  for (int i = 0; i < count; ++i) {
+    dst[i] += src[i] * weight;
+  }
+}
+
+PS_TARGET_CLONES
+void store_row(std::uint8_t* dst, const float* src, int count) {
+  for (int i = 0; i < count; ++i) {
+    dst[i] = static_cast<std::uint8_t>(std::min(std::max(src[i], 0.0f), 255.0f) + 0.5f);
+  }
+}
+
+PS_TARGET_CLONES
+void store_row(std::uint16_t* dst, const float* src, int count) {
+  for (int i = 0; i < count; ++i) {
+    dst[i] = static_cast<std::uint16_t>(std::min(std::max(src[i], 0.0f), 65535.0f) + 0.5f);
+  }
+}
+
+// One output row of a 3 by 3 filter; up, mid and down point at the pixel
+// above, at and below dst[0] and are readable one pixel either side
+template <NeighborhoodKind Kind, typename Sample>
+inline void neighborhood_row(Sample* dst, const Sample* up, const Sample* mid,
+                             const Sample* down, int count, int max_value) {
+  for (int i = 0; i < count; ++i) {
+    const int center = mid[i];
+    const int cross = up[i] + down[i] + mid[i - 1] + mid[i + 1];
+    int value = 0;
+    if constexpr (Kind == NeighborhoodKind::Blur) {
+      value = (4 * center + cross + 4) >> 3;
+    } else if constexpr (Kind == NeighborhoodKind::BlurMore) {
+      const int corners = up[i - 1] + up[i + 1] + down[i - 1] + down[i + 1];
+      const int sum = 2 * (center + cross) + corners + 7;
+      // BlurMoreLine divides by 14 as a multiply by 4681 / 65536
+      value = sizeof(Sample) == 1 ? (sum * 4681) >> 16 : sum / 14;
+    } else if constexpr (Kind == NeighborhoodKind::Sharpen) {
+      value = std::min(std::max((8 * center - cross + 2) >> 2, 0), max_value);
+    } else {
+      const int corners = up[i - 1] + up[i + 1] + down[i - 1] + down[i + 1];
+      value = std::min(std::max((12 * center - cross - corners + 2) >> 2, 0), max_value);
+    }
+    dst[i] = static_cast<Sample>(value);
+  }
+}
+
+PS_TARGET_CLONES
+void neighborhood_row(NeighborhoodKind kind, std::uint8_t* dst, const std::uint8_t* up,
+                      const std::uint8_t* mid, const std::uint8_t* down, int count) {
+  switch (kind) {
+    case NeighborhoodKind::Blur:
+      neighborhood_row<NeighborhoodKind::Blur>(dst, up, mid, down, count, 255);
+      break;
+    case NeighborhoodKind::BlurMore:
+      neighborhood_row<NeighborhoodKind::BlurMore>(dst, up, mid, down, count, 255);
+      break;
+    case NeighborhoodKind::Sharpen:
+      neighborhood_row<NeighborhoodKind::Sharpen>(dst, up, mid, down, count, 255);
+      break;
+    case NeighborhoodKind::SharpenMore:
+      neighborhood_row<NeighborhoodKind::SharpenMore>(dst, up, mid, down, count, 255);
+      break;
+  }
+}
+
+PS_TARGET_CLONES
+void neighborhood_row(NeighborhoodKind kind, std::uint16_t* dst, const std::uint16_t* up,
+                      const std::uint16_t* mid, const std::uint16_t* down, int count) {
+  switch (kind) {
+    case NeighborhoodKind::Blur:
+      neighborhood_row<NeighborhoodKind::Blur>(dst, up, mid, down, count, 65535);
+      break;
+    case NeighborhoodKind::BlurMore:
+      neighborhood_row<NeighborhoodKind::BlurMore>(dst, up, mid, down, count, 65535);
+      break;
+    case NeighborhoodKind::Sharpen:
+      neighborhood_row<NeighborhoodKind::Sharpen>(dst, up, mid, down, count, 65535);
+      break;
+    case NeighborhoodKind::SharpenMore:
+      neighborhood_row<NeighborhoodKind::SharpenMore>(dst, up, mid, down, count, 65535);
+      break;
+  }
+}
+
+// acc += src * weight
+PS_TARGET_CLONES
+void multiply_add_row(int* acc, const std::uint8_t* src, int weight, int count) {
+  for (int i = 0; i < count; ++i) {
+    acc[i] += src[i] * weight;
+  }
+}
+
+PS_TARGET_CLONES
+void multiply_add_row(int* acc, const std::uint16_t* src, int weight, int count) {
+  for (int i = 0; i < count; ++i) {
+    acc[i] += src[i] * weight;
+  }
+}
+
+// Rounds numerator / denominator to the nearest integer, halves upwards,
+// for either sign of the numerator
+long long divide_rounded(long long numerator, long long denominator) {
+  const long long twice = 2 * numerator + denominator;
+  const long long quotient = twice / (2 * denominator);
+  return twice % (2 * denominator) < 0 ? quotient - 1 : quotient;
+}
+
+void check_taps(const std::vector<float>& taps) {
+  if (taps.empty() || taps.size() % 2 == 0) {
+    throw std::invalid_argument("separable kernels need an odd number of taps");
+  }
+}
+
+}  // namespace
+
+NeighborhoodFilter::NeighborhoodFilter(NeighborhoodKind kind) : kind_(kind) {}
+
+std::string NeighborhoodFilter::name() const {
+  switch (kind_) {
+    case NeighborhoodKind::Blur:
+      return "Blur";
+    case NeighborhoodKind::BlurMore:
+      return "Blur More";
+    case NeighborhoodKind::Sharpen:
+      return "Sharpen";
+    case NeighborhoodKind::SharpenMore:
+      return "Sharpen More";
+  }
+  return "Filter";
+}
+
+void NeighborhoodFilter::process(const FilterTile<std::uint8_t>& tile) const {
+  for (int y = 0; y < tile.height; ++y) {
+    const std::uint8_t* mid = tile.src + y * tile.src_stride;
+    neighborhood_row(kind_, tile.dst + y * tile.dst_stride, mid - tile.src_stride, mid,
+                     mid + tile.src_stride, tile.width);
+  }
+}
+
+void NeighborhoodFilter::process(const FilterTile<std::uint16_t>& tile) const {
+  for (int y = 0; y < tile.height; ++y) {
+    const std::uint16_t* mid = tile.src + y * tile.src_stride;
+    neighborhood_row(kind_, tile.dst + y * tile.dst_stride, mid - tile.src_stride, mid,
+                     mid + tile.src_stride, tile.width);
+  }
+}
+
+std::unique_ptr<Filter> NeighborhoodFilter::scaled(double) const {
+  return std::make_unique<NeighborhoodFilter>(*this);
+}
+
+SeparableFilter::SeparableFilter(std::string name, std::vector<float> row_taps,
+                                 std::vector<float> column_taps)
+    : name_(std::move(name)),
+      row_taps_(std::move(row_taps)),
+      column_taps_(std::move(column_taps)) {
+  check_taps(row_taps_);
+  check_taps(column_taps_);
+}
+
+int SeparableFilter::halo() const {
+  return static_cast<int>(std::max(row_taps_.size(), column_taps_.size()) / 2);
+}
+
+template <typename Sample>
+void SeparableFilter::convolve(const FilterTile<Sample>& tile, float* out) const {
+  const int rx = static_cast<int>(row_taps_.size() / 2);
+  const int ry = static_cast<int>(column_taps_.size() / 2);
+  const int width = tile.width;
+
+  // Horizontal pass over the tile's rows and its vertical halo, then a
+  // vertical pass over the intermediate rows
+  thread_local std::vector<float> line;
+  thread_local std::vector<float> rows;
+  line.resize(static_cast<std::size_t>(width) + 2 * rx);
+  rows.resize(static_cast<std::size_t>(tile.height + 2 * ry) * width);
+  for (int j = -ry; j < tile.height + ry; ++j) {
+    load_row(line.data(), tile.src + j * tile.src_stride - rx, width + 2 * rx);
+    float* dst = rows.data() + static_cast<std::size_t>(j + ry) * width;
+    multiply_row(dst, line.data(), row_taps_[0], width);
+    for (std::size_t k = 1; k < row_taps_.size(); ++k) {
+      multiply_add_row(dst, line.data() + k, row_taps_[k], width);
+    }
+  }
+  for (int y = 0; y < tile.height; ++y) {
+    float* dst = out + static_cast<std::size_t>(y) * width;
+    multiply_row(dst, rows.data() + static_cast<std::size_t>(y) * width, column_taps_[0], width);
+    for (std::size_t k = 1; k < column_taps_.size(); ++k) {
+      multiply_add_row(dst, rows.data() + (y + k) * width, column_taps_[k], width);
+    }
+  }
+}
+
+void SeparableFilter::process(const FilterTile<std::uint8_t>& tile) const {
+  thread_local std::vector<float> out;
+  out.resize(static_cast<std::size_t>(tile.width) * tile.height);
+  convolve(tile, out.data());
+  for (int y = 0; y < tile.height; ++y) {
+    store_row(tile.dst + y * tile.dst_stride, out.data() + static_cast<std::size_t>(y) * tile.width,
+              tile.width);
+  }
+}
+
+void SeparableFilter::process(const FilterTile<std::uint16_t>& tile) const {
+  thread_local std::vector<float> out;
+  out.resize(static_cast<std::size_t>(tile.width) * tile.height);
+  convolve(tile, out.data());
+  for (int y = 0; y < tile.height; ++y) {
+    store_row(tile.dst + y * tile.dst_stride, out.data() + static_cast<std::size_t>(y) * tile.width,
+              tile.width);
+  }
+}
+
+std::unique_ptr<Filter> SeparableFilter::scaled(double) const {
+  return std::make_unique<SeparableFilter>(*this);
+}
+
+GaussianBlurFilter::GaussianBlurFilter(double radius)
+    : SeparableFilter("Gaussian Blur", kernel(radius), kernel(radius)), radius_(radius) {}
+
+std::vector<float> GaussianBlurFilter::kernel(double radius) {
+  if (!(radius >= 0.0)) {
+    throw std::invalid_argument("blur radius must not be negative");
+  }
+  // Below this the outer taps of a 3-tap kernel round to zero anyway
+  if (radius < 0.05) {
+    return {1.0f};
+  }
+
+  const int reach = static_cast<int>(std::ceil(5.0 * radius));
+  std::vector<double> curve(2 * static_cast<std::size_t>(reach) + 1);
+  double total = 0.0;
+  for (int j = -reach; j <= reach; ++j) {
+    const double t = j / radius;
+    curve[j + reach] = std::exp(-0.5 * t * t);
+    total += curve[j + reach];
+  }
+
+  // Trim taps that WeightedFilter's 16-bit weights would round to zero
+  int trim = 0;
+  while (trim < reach && curve[trim] / total * 65536.0 < 0.5) {
+    ++trim;
+  }
+  std::vector<float> taps(curve.begin() + trim, curve.end() - trim);
+  double kept = 0.0;
+  for (float tap : taps) {
+    kept += tap;
+  }
+  for (float& tap : taps) {
+    tap = static_cast<float>(tap / kept);
+  }
+  return taps;
+}
+
+std::unique_ptr<Filter> GaussianBlurFilter::scaled(double factor) const {
+  return std::make_unique<GaussianBlurFilter>(radius_ * factor);
+}
+
+GaussianDetailFilter::GaussianDetailFilter(Mode mode, double radius, int amount)
+    : mode_(mode), amount_(amount), blur_(radius) {
+  if (amount < 0) {
+    throw std::invalid_argument("unsharp mask amount must not be negative");
+  }
+}
+
+std::string GaussianDetailFilter::name() const {
+  return mode_ == Mode::HighPass ? "High Pass" : "Unsharp Mask";
+}
+
+template <typename Sample>
+void GaussianDetailFilter::run(const FilterTile<Sample>& tile) const {
+  // The blur is rounded to samples first, as the original kept it in the
+  // destination buffer before DoHighPassLine or DoUnsharpMaskLine ran
+  thread_local std::vector<Sample> blurred;
+  blurred.resize(static_cast<std::size_t>(tile.width) * tile.height);
+  FilterTile<Sample> blur_tile = tile;
+  blur_tile.dst = blurred.data();
+  blur_tile.dst_stride = tile.width;
+  blur_.process(blur_tile);
+
+  const int half = (tile.max_value + 1) / 2;
+  // DoUnsharpMaskLine's 4096ths, applied as (difference × factor × 16 +
+  // 0x8000) >> 16
+  const long long factor = static_cast<long long>(amount_) * 4096 / 100;
+  for (int y = 0; y < tile.height; ++y) {
+    const Sample* src = tile.src + y * tile.src_stride;
+    const Sample* blur = blurred.data() + static_cast<std::size_t>(y) * tile.width;
+    Sample* dst = tile.dst + y * tile.dst_stride;
+    for (int x = 0; x < tile.width; ++x) {
+      long long value;
+      if (mode_ == Mode::HighPass) {
+        value = static_cast<long long>(src[x]) - blur[x] + half;
+      } else {
+        const long long difference = static_cast<long long>(blur[x]) - src[x];
+        long long shifted = difference * factor * 16 + 0x8000;
+        // Floor division by 65536, like the SWAP of the signed product
+        shifted = shifted >= 0 ? shifted >> 16 : -((-shifted + 65535) >> 16);
+        value = src[x] - shifted;
+      }
+      dst[x] = static_cast<Sample>(std::clamp<long long>(value, 0, tile.max_value));
+    }
+  }
+}
+
+void GaussianDetailFilter::process(const FilterTile<std::uint8_t>& tile) const {
+  run(tile);
+}
+
+void GaussianDetailFilter::process(const FilterTile<std::uint16_t>& tile) const {
+  run(tile);
+}
+
+std::unique_ptr<Filter> GaussianDetailFilter::scaled(double factor) const {
+  return std::make_unique<GaussianDetailFilter>(mode_, blur_.radius() * factor, amount_);
+}
+
+ConvolutionFilter::ConvolutionFilter(std::vector<int> weights, int size, int scale, int offset)
+    : weights_(std::move(weights)), size_(size), scale_(scale), offset_(offset) {
+  if (size < 1 || size % 2 == 0) {
+    throw std::invalid_argument("convolution kernel size must be odd");
+  }
+  if (weights_.size() != static_cast<std::size_t>(size) * size) {
+    throw std::invalid_argument("convolution kernel needs size * size weights");
+  }
+  if (scale < 1) {
+    throw std::invalid_argument("convolution scale must be at least 1");
+  }
+  // Sums are accumulated in 32 bits, which 16-bit samples bound
+  long long magnitude = 0;
+  for (int weight : weights_) {
+    magnitude += std::llabs(weight);
+  }
+  if (magnitude * 65535 > 0x7fffffffLL) {
+    throw std::invalid_argument("convolution weights are too large");
+  }
+}
+
+template <typename Sample>
+void ConvolutionFilter::run(const FilterTile<Sample>& tile) const {
+  const int radius = size_ / 2;
+  thread_local std::vector<int> sums;
+  sums.resize(tile.width);
+  for (int y = 0; y < tile.height; ++y) {
+    std::fill(sums.begin(), sums.end(), 0);
+    for (int ky = 0; ky < size_; ++ky) {
+      const Sample* row = tile.src + (y + ky - radius) * tile.src_stride - radius;
+      for (int kx = 0; kx < size_; ++kx) {
+        const int weight = weights_[static_cast<std::size_t>(ky) * size_ + kx];
+        if (weight != 0) {
+          multiply_add_row(sums.data(), row + kx, weight, tile.width);
+        }
+      }
+    }
+    Sample* dst = tile.dst + y * tile.dst_stride;
+    for (int x = 0; x < tile.width; ++x) {
+      const long long value = divide_rounded(sums[x], scale_) + offset_;
+      dst[x] = static_cast<Sample>(std::clamp<long long>(value, 0, tile.max_value));
+    }
+  }
+}
+
+void ConvolutionFilter::process(const FilterTile<std::uint8_t>& tile) const {
+  run(tile);
+}
+
+void ConvolutionFilter::process(const FilterTile<std::uint16_t>& tile) const {
+  run(tile);
+}
+
+std::unique_ptr<Filter> ConvolutionFilter::scaled(double) const {
+  return std::make_unique<ConvolutionFilter>(*this);
+}
+
+}  // namespace ps::filters
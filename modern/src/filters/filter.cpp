@@ -0,0 +1,245 @@
+#include "ps/filters/filter.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "ps/core/image_view.h"
+#include "ps/core/thread_pool.h"
+#include "channel_region.h"
+
+namespace ps::filters {
+namespace {
+
+using core::ImageBuffer;
+using core::ImageDocument;
+using core::PixelFormat;
+using core::Rect;
+using core::Size;
+
+std::vector<std::size_t> target_channels(const ImageDocument& doc,
+                                         const FilterOptions& options) {
+  return core::detail::target_channels(doc, options.channels, "filters");
+}
+
+template <typename Sample>
+void filter_channel(ImageBuffer& buffer, const Filter& filter, const Rect& area,
+                    const core::SelectionMask* selection) {
+  auto& pool = core::ThreadPool::instance();
+  const Size size = buffer.size();
+  const int halo = std::max(0, filter.halo());
+  const int plane_width = area.width + 2 * halo;
+  const int plane_height = area.height + 2 * halo;
+  std::vector<Sample> plane(static_cast<std::size_t>(plane_width) * plane_height);
+
+  // Area plus halo, with rows and columns past the image repeating its edges
+  const int left = area.x - halo;
+  const int x0 = std::max(0, left);
+  const int x1 = std::min(size.width, area.x + area.width + halo);
+  pool.parallel_for(0, plane_height, 16, [&](int r0, int r1) {
+    for (int r = r0; r < r1; ++r) {
+      const int y = std::clamp(area.y - halo + r, 0, size.height - 1);
+      Sample* row = plane.data() + static_cast<std::size_t>(r) * plane_width;
+      buffer.read_pixels(x0, y, x1 - x0, reinterpret_cast<std::uint8_t*>(row + (x0 - left)));
+      std::fill(row, row + (x0 - left), row[x0 - left]);
+      std::fill(row + (x1 - left), row + plane_width, row[x1 - left - 1]);
+    }
+  });
+
+  const int max_value = static_cast<int>((1u << (8 * sizeof(Sample))) - 1);
+
+  core::detail::for_each_selected_tile(
+      area, selection, [&](const Rect& rect, const std::uint8_t* weights) {
+        thread_local std::vector<Sample> result;
+        result.resize(static_cast<std::size_t>(rect.width) * rect.height);
+
+        FilterTile<Sample> tile;
+        tile.src = plane.data() +
+                   static_cast<std::size_t>(rect.y - area.y + halo) * plane_width +
+                   (rect.x - area.x + halo);
+        tile.src_stride = plane_width;
+        tile.dst = result.data();
+        tile.dst_stride = rect.width;
+        tile.width = rect.width;
+        tile.height = rect.height;
+        tile.area = rect;
+        tile.max_value = max_value;
+        filter.process(tile);
+
+        for (int y = 0; y < rect.height; ++y) {
+          auto* dst = reinterpret_cast<Sample*>(buffer.mutable_pixel_row(rect.x, rect.y + y));
+          const Sample* src = result.data() + static_cast<std::size_t>(y) * rect.width;
+          if (weights != nullptr) {
+            core::detail::blend_row(dst, src, weights + static_cast<std::size_t>(y) * rect.width,
+                                    rect.width);
+          } else {
+            std::memcpy(dst, src, rect.width * sizeof(Sample));
+          }
+        }
+      });
+}
+
+// Averages factor × factor blocks of a channel; proxy pixel (i, j) covers
+// the source block at (left + i × factor, top + j × factor), clipped to
+// the image
+template <typename Sample>
+ImageBuffer reduce_channel(const ImageBuffer& source, int left, int top, Size proxy_size,
+                           int factor) {
+  ImageBuffer proxy(proxy_size, source.format(), core::StorageLayout::Contiguous,
+                    core::BufferInit::Uninitialized);
+  const Size size = source.size();
+  core::ThreadPool::instance().parallel_for(0, proxy_size.height, 4, [&](int r0, int r1) {
+    std::vector<Sample> line;
+    std::vector<std::uint64_t> sums(proxy_size.width);
+    std::vector<Sample> out(proxy_size.width);
+    for (int r = r0; r < r1; ++r) {
+      const int y0 = std::max(0, top + r * factor);
+      const int y1 = std::min(size.height, top + (r + 1) * factor);
+      const int x_begin = std::max(0, left);
+      const int x_end = std::min(size.width, left + proxy_size.width * factor);
+      line.resize(x_end - x_begin);
+      std::fill(sums.begin(), sums.end(), 0);
+      for (int y = y0; y < y1; ++y) {
+        source.read_pixels(x_begin, y, x_end - x_begin,
+                           reinterpret_cast<std::uint8_t*>(line.data()));
+        for (int x = x_begin; x < x_end; ++x) {
+          sums[(x - left) / factor] += line[x - x_begin];
+        }
+      }
+      for (int i = 0; i < proxy_size.width; ++i) {
+        const int bx0 = std::max(0, left + i * factor);
+        const int bx1 = std::min(size.width, left + (i + 1) * factor);
+        const std::uint64_t n = static_cast<std::uint64_t>(bx1 - bx0) * (y1 - y0);
+        out[i] = static_cast<Sample>(n > 0 ? (sums[i] + n / 2) / n : 0);
+      }
+      proxy.write_pixels(0, r, proxy_size.width, reinterpret_cast<const std::uint8_t*>(out.data()));
+    }
+  });
+  return proxy;
+}
+
+ImageBuffer reduce_channel(const ImageBuffer& source, int left, int top, Size proxy_size,
+                           int factor) {
+  return source.format() == PixelFormat::Gray16
+             ? reduce_channel<std::uint16_t>(source, left, top, proxy_size, factor)
+             : reduce_channel<std::uint8_t>(source, left, top, proxy_size, factor);
+}
+
+}  // namespace
+
+Rect filter_area(const ImageDocument& doc, const FilterOptions& options) {
+  return core::detail::operation_area(doc, options.area, options.use_selection);
+}
+
+Rect apply_filter(ImageDocument& doc, const Filter& filter, const FilterOptions& options) {
+  const std::vector<std::size_t> channels = target_channels(doc, options);
+  const Rect area = filter_area(doc, options);
+  if (area.is_empty() || channels.empty()) {
+    return Rect{};
+  }
+
+  const core::SelectionMask* selection =
+      core::detail::operation_selection(doc, options.use_selection);
+  for (std::size_t index : channels) {
+    ImageBuffer& buffer = doc.channel_at(index).buffer;
+    if (buffer.format() == PixelFormat::Gray16) {
+      filter_channel<std::uint16_t>(buffer, filter, area, selection);
+    } else {
+      filter_channel<std::uint8_t>(buffer, filter, area, selection);
+    }
+  }
+  doc.mark_dirty(area);
+  return area;
+}
+
+FilterCommand::FilterCommand(ImageDocument& doc, std::shared_ptr<const Filter> filter,
+                             FilterOptions options)
+    : ImageCommand(doc), filter_(std::move(filter)), options_(std::move(options)) {}
+
+void FilterCommand::execute() {
+  const Rect area = filter_area(document_, options_);
+  if (area.is_empty()) {
+    return;
+  }
+  save_region(area.x, area.y, area.width, area.height);
+  apply_filter(document_, *filter_, options_);
+}
+
+void FilterCommand::redo() {
+  // After undo() the saved blocks hold the filtered pixels
+  swap_regions();
+}
+
+FilterPreview preview_filter(const ImageDocument& doc, const Filter& filter,
+                             const FilterOptions& options, int max_edge) {
+  if (max_edge < 1) {
+    throw std::invalid_argument("preview edge must be at least 1");
+  }
+  const std::vector<std::size_t> channels = target_channels(doc, options);
+  const Size size = doc.size();
+  const Rect image{0, 0, size.width, size.height};
+  const Rect area = options.area.is_empty() ? image : options.area.intersected(image);
+
+  if (area.is_empty()) {
+    return FilterPreview{ImageDocument(Size{}, doc.mode()), 1, area};
+  }
+
+  const int factor = std::max((area.width + max_edge - 1) / max_edge,
+                              (area.height + max_edge - 1) / max_edge);
+  const std::unique_ptr<Filter> proxy_filter = filter.scaled(1.0 / factor);
+  const int margin = std::max(0, proxy_filter->halo());
+
+  // The reduction covers the area plus enough real neighbours for the
+  // scaled filter's halo, so the preview's edges match the full result
+  const Size inner{(area.width + factor - 1) / factor, (area.height + factor - 1) / factor};
+  const int before_x = std::min(margin, area.x / factor);
+  const int before_y = std::min(margin, area.y / factor);
+  const int after_x = std::clamp(
+      (size.width - (area.x + inner.width * factor) + factor - 1) / factor, 0, margin);
+  const int after_y = std::clamp(
+      (size.height - (area.y + inner.height * factor) + factor - 1) / factor, 0, margin);
+  const int left = area.x - before_x * factor;
+  const int top = area.y - before_y * factor;
+  const Size proxy_size{before_x + inner.width + after_x, before_y + inner.height + after_y};
+
+  ImageDocument proxy(proxy_size, doc.mode());
+  for (std::size_t index : channels) {
+    const core::ImageChannel& channel = doc.channel_at(index);
+    proxy.add_channel(channel.name,
+                      reduce_channel(channel.buffer, left, top, proxy_size, factor));
+  }
+
+  const bool selected = options.use_selection && doc.selection().has_selection();
+  if (selected) {
+    const Rect covered =
+        image.intersected(Rect{left, top, proxy_size.width * factor, proxy_size.height * factor});
+    ImageBuffer mask(Size{covered.width, covered.height}, PixelFormat::Gray8,
+                     core::StorageLayout::Contiguous, core::BufferInit::Uninitialized);
+    for (int y = 0; y < covered.height; ++y) {
+      doc.selection().read_row(covered.x, covered.y + y, covered.width,
+                               mask.mutable_pixel_row(0, y));
+    }
+    const ImageBuffer reduced = reduce_channel(mask, 0, 0, proxy_size, factor);
+    for (int y = 0; y < proxy_size.height; ++y) {
+      proxy.selection().write_row(0, y, proxy_size.width, reduced.pixel_row(0, y));
+    }
+  }
+
+  // A selection that vanishes in the proxy leaves the area unchanged; it
+  // must not fall back to filtering everything
+  const Rect inner_area{before_x, before_y, inner.width, inner.height};
+  if (!selected || proxy.selection().has_selection()) {
+    FilterOptions proxy_options;
+    proxy_options.area = inner_area;
+    proxy_options.use_selection = options.use_selection;
+    apply_filter(proxy, *proxy_filter, proxy_options);
+  }
+
+  FilterPreview preview{ImageDocument(inner, doc.mode()), factor, area};
+  for (const core::ImageChannel& channel : proxy.channels()) {
+    preview.image.add_channel(channel.name, core::detail::crop(channel.buffer, inner_area));
+  }
+  return preview;
+}
+
+}  // namespace ps::filters
@@ -1,7 +1,36 @@
 #include "ps/core/image_buffer.h"
 
+#include <algorithm>
+#include <cstring>
+#include <unordered_set>
+
+#include "ps/core/buffer_pool.h"
+
 namespace ps::core {
 
+namespace {
+
+// Backing store for reads from unallocated tiles. Large enough for one tile
+// row of the widest pixel format.
+const std::uint8_t* zero_row() {
+  static const std::vector<std::uint8_t> zeros(
+      static_cast<std::size_t>(ImageBuffer::kTileSize) * 16, 0);
+  return zeros.data();
+}
+
+void recycle(PixelStorage& storage) {
+  if (storage.capacity() > 0) {
+    BufferPool::instance().release(std::move(storage));
+  }
+}
+
+bool is_all_zero(const std::uint8_t* data, std::size_t count) {
+  return std::all_of(data, data + count,
+                     [](std::uint8_t value) { return value == 0; });
+}
+
+}  // namespace
+
 std::size_t bytes_per_pixel(PixelFormat format) {
   switch (format) {
     case PixelFormat::Gray8:
@@ -12,12 +41,100 @@ std::size_t bytes_per_pixel(PixelFormat format) {
       return 4;
     case PixelFormat::CMYK8:
       return 4;
+    case PixelFormat::RGBA8Premul:
+      return 4;
+    case PixelFormat::RGBA16Premul:
+      return 8;
+    case PixelFormat::Gray16:
+      return 2;
+    case PixelFormat::Bitmap1:
+      return 0;
+    case PixelFormat::Indexed8:
+      return 1;
   }
   return 0;
 }
 
-ImageBuffer::ImageBuffer(Size size, PixelFormat format) {
-  resize(size, format);
+std::size_t row_bytes(PixelFormat format, int width) {
+  const std::size_t pixels = static_cast<std::size_t>(width);
+  return format == PixelFormat::Bitmap1 ? (pixels + 7) / 8 : pixels * bytes_per_pixel(format);
+}
+
+ImageBuffer::ImageBuffer(Size size, PixelFormat format, StorageLayout layout,
+                         BufferInit init)
+    : layout_(layout) {
+  resize(size, format, init);
+}
+
+ImageBuffer::ImageBuffer(const ImageBuffer& other)
+    : size_(other.size_),
+      format_(other.format_),
+      layout_(other.layout_),
+      tile_columns_(other.tile_columns_),
+      tile_rows_(other.tile_rows_),
+      tiles_(other.tiles_) {
+  if (!other.pixels_.empty()) {
+    pixels_ = BufferPool::instance().acquire(other.pixels_.size());
+    std::memcpy(pixels_.data(), other.pixels_.data(), other.pixels_.size());
+  }
+}
+
+ImageBuffer& ImageBuffer::operator=(const ImageBuffer& other) {
+  if (this != &other) {
+    size_ = other.size_;
+    format_ = other.format_;
+    layout_ = other.layout_;
+    if (other.pixels_.empty()) {
+      recycle(pixels_);
+    } else {
+      if (pixels_.capacity() < other.pixels_.size()) {
+        recycle(pixels_);
+        pixels_ = BufferPool::instance().acquire(other.pixels_.size());
+      } else {
+        pixels_.resize(other.pixels_.size());
+      }
+      std::memcpy(pixels_.data(), other.pixels_.data(), other.pixels_.size());
+    }
+    tile_columns_ = other.tile_columns_;
+    tile_rows_ = other.tile_rows_;
+    tiles_ = other.tiles_;
+    recycle(flat_cache_);
+    flat_cache_valid_ = false;
+  }
+  return *this;
+}
+
+ImageBuffer::ImageBuffer(ImageBuffer&& other) noexcept
+    : size_(other.size_),
+      format_(other.format_),
+      layout_(other.layout_),
+      pixels_(std::move(other.pixels_)),
+      tile_columns_(other.tile_columns_),
+      tile_rows_(other.tile_rows_),
+      tiles_(std::move(other.tiles_)),
+      flat_cache_(std::move(other.flat_cache_)),
+      flat_cache_valid_(other.flat_cache_valid_.exchange(false)) {}
+
+ImageBuffer& ImageBuffer::operator=(ImageBuffer&& other) noexcept {
+  if (this != &other) {
+    recycle(pixels_);
+    recycle(flat_cache_);
+    size_ = other.size_;
+    format_ = other.format_;
+    layout_ = other.layout_;
+    pixels_ = std::move(other.pixels_);
+    tile_columns_ = other.tile_columns_;
+    tile_rows_ = other.tile_rows_;
+    tiles_ = std::move(other.tiles_);
+    flat_cache_ = std::move(other.flat_cache_);
+    flat_cache_valid_ = other.flat_cache_valid_.exchange(false);
+  }
+  return *this;
+}
+
+ImageBuffer::~ImageBuffer() {
+  recycle(pixels_);
+  recycle(flat_cache_);
 }
 
 Size ImageBuffer::size() const {
@@ -28,25 +145,240 @@ PixelFormat ImageBuffer::format() const {
   return format_;
 }
 
+void ImageBuffer::set_layout(StorageLayout layout) {
+  if (layout == layout_) {
+    return;
+  }
+
+  const std::size_t row_bytes = run_bytes(size_.width);
+
+  if (layout == StorageLayout::Tiled) {
+    layout_ = StorageLayout::Tiled;
+    update_tile_grid();
+    tiles_.assign(static_cast<std::size_t>(tile_columns_) * tile_rows_, nullptr);
+
+    const std::size_t tile_row_bytes = run_bytes(kTileSize);
+    for (int ty = 0; ty < tile_rows_; ++ty) {
+      const int y0 = ty * kTileSize;
+      const int rows = std::min(kTileSize, size_.height - y0);
+      for (int tx = 0; tx < tile_columns_; ++tx) {
+        const int x0 = tx * kTileSize;
+        const std::size_t span_bytes = run_bytes(std::min(kTileSize, size_.width - x0));
+
+        bool empty = true;
+        for (int r = 0; r < rows && empty; ++r) {
+          const std::uint8_t* src =
+              pixels_.data() + (y0 + r) * row_bytes + run_bytes(x0);
+          empty = is_all_zero(src, span_bytes);
+        }
+        if (empty) {
+          continue;
+        }
+
+        std::uint8_t* dst = mutable_tile_data(tx, ty);
+        for (int r = 0; r < rows; ++r) {
+          std::memcpy(dst + r * tile_row_bytes,
+                      pixels_.data() + (y0 + r) * row_bytes + run_bytes(x0),
+                      span_bytes);
+        }
+      }
+    }
+
+    recycle(pixels_);
+  } else {
+    // flatten_into() writes every byte, so the storage needs no clearing
+    PixelStorage pixels = BufferPool::instance().acquire(byte_size());
+    flatten_into(pixels.data());
+    recycle(pixels_);
+    pixels_.swap(pixels);
+    tiles_.clear();
+    tile_columns_ = 0;
+    tile_rows_ = 0;
+    layout_ = StorageLayout::Contiguous;
+  }
+
+  recycle(flat_cache_);
+  flat_cache_valid_ = false;
+}
+
 std::uint8_t* ImageBuffer::data() {
+  if (layout_ == StorageLayout::Tiled) {
+    set_layout(StorageLayout::Contiguous);
+  }
   return pixels_.data();
 }
 
 const std::uint8_t* ImageBuffer::data() const {
-  return pixels_.data();
+  if (layout_ == StorageLayout::Contiguous) {
+    return pixels_.data();
+  }
+
+  if (!flat_cache_valid_) {
+    if (flat_cache_.capacity() < byte_size()) {
+      recycle(flat_cache_);
+      flat_cache_ = BufferPool::instance().acquire(byte_size());
+    } else {
+      flat_cache_.resize(byte_size());
+    }
+    flatten_into(flat_cache_.data());
+    flat_cache_valid_ = true;
+  }
+  return flat_cache_.data();
 }
 
 std::size_t ImageBuffer::byte_size() const {
-  return pixels_.size();
+  return run_bytes(size_.width) * static_cast<std::size_t>(size_.height);
+}
+
+std::size_t ImageBuffer::allocated_bytes() const {
+  if (layout_ == StorageLayout::Contiguous) {
+    return pixels_.size();
+  }
+
+  std::unordered_set<const Tile*> distinct;
+  for (const auto& tile : tiles_) {
+    if (tile) {
+      distinct.insert(tile.get());
+    }
+  }
+  return distinct.size() * tile_byte_size();
 }
 
-void ImageBuffer::resize(Size size, PixelFormat format) {
+void ImageBuffer::resize(Size size, PixelFormat format, BufferInit init) {
   size_ = size;
   format_ = format;
+  recycle(flat_cache_);
+  flat_cache_valid_ = false;
 
-  const auto pixel_count = static_cast<std::size_t>(size.width) *
-                           static_cast<std::size_t>(size.height);
-  pixels_.assign(pixel_count * bytes_per_pixel(format_), 0);
+  if (layout_ == StorageLayout::Tiled) {
+    update_tile_grid();
+    tiles_.assign(static_cast<std::size_t>(tile_columns_) * tile_rows_, nullptr);
+    return;
+  }
+
+  const std::size_t bytes = byte_size();
+  if (pixels_.capacity() < bytes) {
+    recycle(pixels_);
+    pixels_ = BufferPool::instance().acquire(bytes);
+  } else {
+    pixels_.resize(bytes);
+  }
+  if (init == BufferInit::Zero && bytes > 0) {
+    std::memset(pixels_.data(), 0, bytes);
+  }
+}
+
+void ImageBuffer::fill(std::uint8_t value) {
+  flat_cache_valid_ = false;
+
+  if (layout_ == StorageLayout::Contiguous) {
+    std::fill(pixels_.begin(), pixels_.end(), value);
+    return;
+  }
+
+  std::shared_ptr<Tile> shared;
+  if (value != 0 && !tiles_.empty()) {
+    shared = std::make_shared<Tile>(tile_byte_size());
+    std::memset(shared->data(), value, shared->byte_size());
+  }
+  std::fill(tiles_.begin(), tiles_.end(), shared);
+}
+
+int ImageBuffer::span_width(int x) const {
+  if (layout_ == StorageLayout::Contiguous) {
+    return size_.width - x;
+  }
+  const int tile_end = (x / kTileSize + 1) * kTileSize;
+  return std::min(size_.width, tile_end) - x;
+}
+
+const std::uint8_t* ImageBuffer::pixel_row(int x, int y) const {
+  if (layout_ == StorageLayout::Contiguous) {
+    return pixels_.data() + static_cast<std::size_t>(y) * run_bytes(size_.width) + run_bytes(x);
+  }
+
+  const std::uint8_t* tile = tile_data(x / kTileSize, y / kTileSize);
+  if (!tile) {
+    return zero_row();
+  }
+  return tile + static_cast<std::size_t>(y % kTileSize) * run_bytes(kTileSize) +
+         run_bytes(x % kTileSize);
+}
+
+std::uint8_t* ImageBuffer::mutable_pixel_row(int x, int y) {
+  if (layout_ == StorageLayout::Contiguous) {
+    return pixels_.data() + static_cast<std::size_t>(y) * run_bytes(size_.width) + run_bytes(x);
+  }
+
+  std::uint8_t* tile = mutable_tile_data(x / kTileSize, y / kTileSize);
+  return tile + static_cast<std::size_t>(y % kTileSize) * run_bytes(kTileSize) +
+         run_bytes(x % kTileSize);
+}
+
+void ImageBuffer::read_pixels(int x, int y, int count, std::uint8_t* dst) const {
+  const int end = x + count;
+  while (x < end) {
+    const int span = std::min(end - x, span_width(x));
+    std::memcpy(dst, pixel_row(x, y), run_bytes(span));
+    dst += run_bytes(span);
+    x += span;
+  }
+}
+
+void ImageBuffer::write_pixels(int x, int y, int count, const std::uint8_t* src) {
+  const int end = x + count;
+  while (x < end) {
+    const int span = std::min(end - x, span_width(x));
+    std::memcpy(mutable_pixel_row(x, y), src, run_bytes(span));
+    src += run_bytes(span);
+    x += span;
+  }
+}
+
+std::size_t ImageBuffer::tile_byte_size() const {
+  return run_bytes(kTileSize) * kTileSize;
+}
+
+const std::uint8_t* ImageBuffer::tile_data(int tx, int ty) const {
+  const Tile* tile = tiles_[static_cast<std::size_t>(ty) * tile_columns_ + tx].get();
+  return tile ? tile->data() : nullptr;
+}
+
+std::uint8_t* ImageBuffer::mutable_tile_data(int tx, int ty) {
+  return writable_tile(tx, ty)->data();
+}
+
+std::shared_ptr<Tile> ImageBuffer::shared_tile(int tx, int ty) const {
+  return tiles_[static_cast<std::size_t>(ty) * tile_columns_ + tx];
+}
+
+void ImageBuffer::swap_tile(int tx, int ty, std::shared_ptr<Tile>& tile) {
+  flat_cache_valid_ = false;
+  tiles_[static_cast<std::size_t>(ty) * tile_columns_ + tx].swap(tile);
+}
+
+std::shared_ptr<Tile>& ImageBuffer::writable_tile(int tx, int ty) {
+  flat_cache_valid_.store(false, std::memory_order_relaxed);
+
+  auto& tile = tiles_[static_cast<std::size_t>(ty) * tile_columns_ + tx];
+  if (!tile) {
+    tile = std::make_shared<Tile>(tile_byte_size());
+  } else if (tile.use_count() > 1) {
+    tile = std::make_shared<Tile>(*tile);
+  }
+  return tile;
+}
+
+void ImageBuffer::update_tile_grid() {
+  tile_columns_ = (size_.width + kTileSize - 1) / kTileSize;
+  tile_rows_ = (size_.height + kTileSize - 1) / kTileSize;
+}
+
+void ImageBuffer::flatten_into(std::uint8_t* dst) const {
+  const std::size_t row_bytes = run_bytes(size_.width);
+  for (int y = 0; y < size_.height; ++y) {
+    read_pixels(0, y, size_.width, dst + y * row_bytes);
+  }
 }
 
 }  // namespace ps::core
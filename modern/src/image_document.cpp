@@ -1,9 +1,78 @@
 #include "ps/core/image_document.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <stdexcept>
+#include <utility>
+
+#include "ps/core/layer_blend.h"
+#include "ps/core/pixel_accessor.h"
+#include "ps/core/pixel_conversion.h"
+#include "ps/core/thread_pool.h"
 
 namespace ps::core {
 
+namespace {
+
+// Returns @p count pixels of @p source starting at (x, y) in @p format,
+// converted through @p temp if the buffer holds another RGBA format.
+// @p count must not exceed source.span_width(x).
+const uint8_t* layer_span(const ImageBuffer& source, int x, int y, int count,
+                          PixelFormat format, std::vector<uint8_t>& temp) {
+  const uint8_t* pixels = source.pixel_row(x, y);
+  if (source.format() == format) {
+    return pixels;
+  }
+  temp.resize(static_cast<std::size_t>(count) * bytes_per_pixel(format));
+  convert_rgba_span(pixels, source.format(), temp.data(), format, count);
+  return temp.data();
+}
+
+// Generations are unique across documents, so a consumer that switches to
+// another document cannot mistake its composite for the one it cached
+std::uint64_t next_composite_generation() {
+  static std::atomic<std::uint64_t> counter{0};
+  return counter.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+// Copies the planes read by a PixelAccessor into a new opaque layer
+template <typename Accessor>
+void planes_to_layer(ImageDocument& doc, const Accessor& planes, const std::string& name) {
+  const Size size = doc.size();
+  const PixelFormat format = doc.layer_format();
+  Layer& layer = doc.add_layer(name);
+  ImageBuffer& dst_buffer = layer.buffer();
+  const std::size_t width = static_cast<std::size_t>(size.width);
+  std::vector<uint8_t> row(width * 4);
+  std::vector<uint8_t> plane_rows(width * Accessor::kPlanes);
+  std::vector<uint8_t> converted(width * bytes_per_pixel(format));
+
+  for (int y = 0; y < size.height; ++y) {
+    // Channels are opaque; the fourth RGB channel is not used as alpha
+    planes.read_planes(y, 0, size.width, plane_rows.data());
+    for (std::size_t x = 0; x < width; ++x) {
+      int r, g, b;
+      planes.rgb(plane_rows.data(), width, x, r, g, b);
+      row[x * 4] = static_cast<uint8_t>(r);
+      row[x * 4 + 1] = static_cast<uint8_t>(g);
+      row[x * 4 + 2] = static_cast<uint8_t>(b);
+      row[x * 4 + 3] = 255;  // Fully opaque
+    }
+    if (format == PixelFormat::RGBA8) {
+      dst_buffer.write_pixels(0, y, size.width, row.data());
+    } else {
+      // Opaque pixels convert exactly
+      convert_rgba_span(row.data(), PixelFormat::RGBA8, converted.data(),
+                        format, size.width);
+      dst_buffer.write_pixels(0, y, size.width, converted.data());
+    }
+  }
+  doc.mark_dirty(Rect{0, 0, size.width, size.height}, &layer);
+}
+
+}  // namespace
+
 ImageDocument::ImageDocument(Size size, ColorMode mode)
     : size_(size), mode_(mode), selection_(size) {}
 
@@ -15,6 +84,12 @@ ColorMode ImageDocument::mode() const {
   return mode_;
 }
 
+void ImageDocument::set_mode(ColorMode mode) {
+  mode_ = mode;
+  invalidate_composite();
+  mark_dirty(Rect{0, 0, size_.width, size_.height});
+}
+
 const std::vector<ImageChannel>& ImageDocument::channels() const {
   return channels_;
 }
@@ -23,8 +98,40 @@ std::vector<ImageChannel>& ImageDocument::channels() {
   return channels_;
 }
 
+void ImageDocument::set_storage_layout(StorageLayout layout) {
+  storage_layout_ = layout;
+  for (auto& channel : channels_) {
+    channel.buffer.set_layout(layout);
+  }
+  for (auto& layer : layers_) {
+    layer->buffer().set_layout(layout);
+  }
+}
+
+void ImageDocument::set_layer_format(PixelFormat format) {
+  if (!is_rgba_format(format)) {
+    throw std::invalid_argument("layer format must be RGBA");
+  }
+  layer_format_ = format;
+  for (auto& layer : layers_) {
+    layer->set_format(format);
+  }
+}
+
 ImageChannel& ImageDocument::add_channel(const std::string& name, PixelFormat format) {
-  channels_.push_back({name, ImageBuffer(size_, format)});
+  channels_.push_back({name, ImageBuffer(size_, format, storage_layout_)});
+  // Like a new layer, the buffer may reuse the address of a removed channel
+  mark_dirty(Rect{0, 0, size_.width, size_.height});
+  return channels_.back();
+}
+
+ImageChannel& ImageDocument::add_channel(const std::string& name, ImageBuffer buffer) {
+  if (buffer.size().width != size_.width || buffer.size().height != size_.height) {
+    throw std::invalid_argument("channel size does not match document");
+  }
+  buffer.set_layout(storage_layout_);
+  channels_.push_back({name, std::move(buffer)});
+  mark_dirty(Rect{0, 0, size_.width, size_.height});
   return channels_.back();
 }
 
@@ -55,10 +162,14 @@ std::size_t ImageDocument::layer_count() const {
 }
 
 Layer& ImageDocument::add_layer(const std::string& name) {
-  layers_.push_back(std::make_unique<Layer>(size_, name));
+  layers_.push_back(std::make_unique<Layer>(size_, name, storage_layout_,
+                                            BufferInit::Zero, layer_format_));
   if (active_layer_index_ < 0) {
     active_layer_index_ = 0;
   }
+  // A new layer may reuse the address of a removed one; caches keyed on
+  // the pointer must not take its pixels for the old layer's
+  mark_dirty(Rect{0, 0, size_.width, size_.height}, layers_.back().get());
   return *layers_.back();
 }
 
@@ -67,12 +178,14 @@ Layer& ImageDocument::insert_layer(std::size_t index, const std::string& name) {
     throw std::out_of_range("layer index out of range");
   }
   auto it = layers_.begin() + index;
-  layers_.insert(it, std::make_unique<Layer>(size_, name));
+  layers_.insert(it, std::make_unique<Layer>(size_, name, storage_layout_,
+                                             BufferInit::Zero, layer_format_));
   if (active_layer_index_ < 0) {
     active_layer_index_ = 0;
   } else if (static_cast<std::size_t>(active_layer_index_) >= index) {
     active_layer_index_++;
   }
+  mark_dirty(Rect{0, 0, size_.width, size_.height}, layers_[index].get());
   return *layers_[index];
 }
 
@@ -169,90 +282,330 @@ void ImageDocument::flatten_to_channels() {
     return;
   }
 
-  // Create a temporary RGBA buffer for compositing
-  ImageBuffer composite(size_, PixelFormat::RGBA8);
-  std::fill(composite.data(), composite.data() + composite.byte_size(), 0);
+  // Only RGB documents have the planes that receive the composite
+  if (mode_ != ColorMode::RGB || channels_.size() < 3) {
+    return;
+  }
+
+  for (int c = 0; c < 3; ++c) {
+    ImageBuffer& plane = channels_[c].buffer;
+    if (plane.format() != PixelFormat::Gray8) {
+      // Every pixel is rewritten below
+      plane.resize(size_, PixelFormat::Gray8, BufferInit::Uninitialized);
+    }
+  }
 
-  // Composite all visible layers (will be implemented with blend modes)
+  std::vector<const Layer*> visible;
   for (const auto& layer : layers_) {
-    if (!layer->visible()) {
-      continue;
+    if (layer->visible()) {
+      visible.push_back(layer.get());
     }
+  }
 
-    // For now, simple alpha blending (will be enhanced with blend modes)
-    const uint8_t* src = layer->buffer().data();
-    uint8_t* dst = composite.data();
-    const float layer_opacity = layer->opacity() / 100.0f;
-
-    for (int i = 0; i < size_.width * size_.height; ++i) {
-      const int idx = i * 4;
-      const float src_alpha = (src[idx + 3] / 255.0f) * layer_opacity;
-      const float dst_alpha = dst[idx + 3] / 255.0f;
-      const float out_alpha = src_alpha + dst_alpha * (1.0f - src_alpha);
-
-      if (out_alpha > 0.0f) {
-        for (int c = 0; c < 3; ++c) {
-          const float src_val = src[idx + c] / 255.0f;
-          const float dst_val = dst[idx + c] / 255.0f;
-          const float out_val = (src_val * src_alpha + dst_val * dst_alpha * (1.0f - src_alpha)) / out_alpha;
-          dst[idx + c] = static_cast<uint8_t>(out_val * 255.0f);
+  // The document is composited one tile at a time: the whole layer stack
+  // is blended into a tile-sized scratch block that stays in cache, which
+  // is then split into the Gray8 planes. Tiles match the ImageBuffer tile
+  // grid, so workers never write to the same plane tile.
+  constexpr int kTile = ImageBuffer::kTileSize;
+  const int columns = (size_.width + kTile - 1) / kTile;
+  const int rows = (size_.height + kTile - 1) / kTile;
+
+  // Premultiplied layers are composited in their own format and converted
+  // back to straight RGBA8 before the split
+  const PixelFormat format = layer_format_;
+  const bool straight = format == PixelFormat::RGBA8;
+  const std::size_t pixel_bytes = bytes_per_pixel(format);
+
+  ThreadPool::instance().parallel_for(0, columns * rows, 1, [&](int first, int last) {
+    thread_local std::vector<uint8_t> composite;
+    thread_local std::vector<uint8_t> converted;
+    thread_local std::vector<uint8_t> planes;
+    thread_local std::vector<uint8_t> temp;
+
+    for (int t = first; t < last; ++t) {
+      const int x0 = (t % columns) * kTile;
+      const int y0 = (t / columns) * kTile;
+      const int width = std::min(kTile, size_.width - x0);
+      const int height = std::min(kTile, size_.height - y0);
+      const std::size_t row_bytes = static_cast<std::size_t>(width) * pixel_bytes;
+
+      composite.assign(row_bytes * height, 0);
+
+      // Composite all visible layers with the kernels composite() uses
+      for (const Layer* layer : visible) {
+        const ImageBuffer& source = layer->buffer();
+
+        for (int r = 0; r < height; ++r) {
+          uint8_t* dst = composite.data() + r * row_bytes;
+          for (int x = x0; x < x0 + width;) {
+            const int span = std::min(x0 + width - x, source.span_width(x));
+            const uint8_t* src = layer_span(source, x, y0 + r, span, format, temp);
+            composite_span(src, dst + (x - x0) * pixel_bytes, span,
+                           layer->opacity(), layer->blend_mode(), format);
+            x += span;
+          }
         }
-        dst[idx + 3] = static_cast<uint8_t>(out_alpha * 255.0f);
+      }
+
+      const uint8_t* rgba = composite.data();
+      if (!straight) {
+        converted.resize(static_cast<std::size_t>(width) * height * 4);
+        convert_rgba_span(composite.data(), format, converted.data(),
+                          PixelFormat::RGBA8, width * height);
+        rgba = converted.data();
+      }
+
+      // Split composited RGBA into tightly packed Gray8 channel planes
+      planes.resize(static_cast<std::size_t>(width) * 3);
+      uint8_t* red = planes.data();
+      uint8_t* green = red + width;
+      uint8_t* blue = green + width;
+      for (int r = 0; r < height; ++r) {
+        const uint8_t* src = rgba + static_cast<std::size_t>(r) * width * 4;
+        for (int i = 0; i < width; ++i) {
+          red[i] = src[i * 4];
+          green[i] = src[i * 4 + 1];
+          blue[i] = src[i * 4 + 2];
+        }
+        channels_[0].buffer.write_pixels(x0, y0 + r, width, red);
+        channels_[1].buffer.write_pixels(x0, y0 + r, width, green);
+        channels_[2].buffer.write_pixels(x0, y0 + r, width, blue);
       }
     }
+  });
+  mark_dirty(Rect{0, 0, size_.width, size_.height});
+}
+
+void ImageDocument::channels_to_layer(const std::string& name) {
+  if (channels_.empty()) {
+    return;
   }
 
-  // Split composited RGBA into separate channels
+  // Channels are Gray8 (or Gray16) planes; interleave them row by row into
+  // RGBA
   if (mode_ == ColorMode::RGB && channels_.size() >= 3) {
-    for (int i = 0; i < size_.width * size_.height; ++i) {
-      const int src_idx = i * 4;
-      const int dst_idx = i * 3;  // RGB8 format stores 3 bytes per pixel
-
-      channels_[0].buffer.data()[dst_idx] = composite.data()[src_idx];      // R
-      channels_[0].buffer.data()[dst_idx + 1] = composite.data()[src_idx];  // R (replicated)
-      channels_[0].buffer.data()[dst_idx + 2] = composite.data()[src_idx];  // R (replicated)
+    planes_to_layer(*this, PixelAccessor<ChannelLayout::RGB>(*this), name);
+  } else if (mode_ == ColorMode::CMYK && channels_.size() >= 4) {
+    planes_to_layer(*this, PixelAccessor<ChannelLayout::CMYK>(*this), name);
+  } else if (mode_ == ColorMode::Grayscale) {
+    planes_to_layer(*this, PixelAccessor<ChannelLayout::Gray>(*this), name);
+  }
+}
 
-      channels_[1].buffer.data()[dst_idx] = composite.data()[src_idx + 1];     // G
-      channels_[1].buffer.data()[dst_idx + 1] = composite.data()[src_idx + 1]; // G (replicated)
-      channels_[1].buffer.data()[dst_idx + 2] = composite.data()[src_idx + 1]; // G (replicated)
+ImageDocument ImageDocument::snapshot() const {
+  ImageDocument copy(size_, mode_);
+  copy.storage_layout_ = storage_layout_;
+  copy.layer_format_ = layer_format_;
+  copy.channels_ = channels_;
+  copy.selection_ = selection_;
+  copy.layers_.reserve(layers_.size());
+  for (const auto& layer : layers_) {
+    copy.layers_.push_back(std::make_unique<Layer>(*layer));
+  }
+  copy.active_layer_index_ = active_layer_index_;
+  return copy;
+}
 
-      channels_[2].buffer.data()[dst_idx] = composite.data()[src_idx + 2];     // B
-      channels_[2].buffer.data()[dst_idx + 1] = composite.data()[src_idx + 2]; // B (replicated)
-      channels_[2].buffer.data()[dst_idx + 2] = composite.data()[src_idx + 2]; // B (replicated)
+void ImageDocument::swap_pixels(DocumentPixels& pixels) {
+  if (pixels.channels.size() != channels_.size() || pixels.layers.size() != layers_.size()) {
+    throw std::invalid_argument("swap_pixels: channel or layer count differs");
+  }
+  auto check = [&](Size size) {
+    if (size.width != pixels.size.width || size.height != pixels.size.height) {
+      throw std::invalid_argument("swap_pixels: buffer size differs");
     }
+  };
+  for (const ImageBuffer& buffer : pixels.channels) {
+    check(buffer.size());
+  }
+  for (const ImageBuffer& buffer : pixels.layers) {
+    check(buffer.size());
+  }
+  check(pixels.selection.size());
+
+  for (std::size_t i = 0; i < channels_.size(); ++i) {
+    std::swap(channels_[i].buffer, pixels.channels[i]);
+  }
+  for (std::size_t i = 0; i < layers_.size(); ++i) {
+    layers_[i]->swap_buffer(pixels.layers[i]);
   }
+  std::swap(selection_, pixels.selection);
+  std::swap(size_, pixels.size);
+
+  invalidate_composite();
+  mark_dirty(Rect{0, 0, size_.width, size_.height});
 }
 
-void ImageDocument::channels_to_layer(const std::string& name) {
-  if (channels_.empty()) {
+void ImageDocument::mark_dirty(const Rect& area, const Layer* layer) {
+  const Rect clipped = area.intersected(Rect{0, 0, size_.width, size_.height});
+  if (clipped.is_empty()) {
     return;
   }
 
-  Layer& layer = add_layer(name);
-  uint8_t* dst = layer.buffer().data();
+  ++damage_revision_;
+  damage_log_.push_back(DamageEntry{damage_revision_, clipped, layer});
+  if (damage_log_.size() > kMaxDamageEntries) {
+    damage_floor_ = damage_log_.front().revision;
+    damage_log_.pop_front();
+  }
+}
 
-  if (mode_ == ColorMode::RGB && channels_.size() >= 3) {
-    for (int i = 0; i < size_.width * size_.height; ++i) {
-      const int src_idx = i * 3;  // RGB8 format
-      const int dst_idx = i * 4;  // RGBA8 format
-
-      dst[dst_idx] = channels_[0].buffer.data()[src_idx];      // R
-      dst[dst_idx + 1] = channels_[1].buffer.data()[src_idx + 1]; // G
-      dst[dst_idx + 2] = channels_[2].buffer.data()[src_idx + 2]; // B
-      dst[dst_idx + 3] = 255;  // Fully opaque
+Rect ImageDocument::damage_since(std::uint64_t revision) const {
+  if (revision < damage_floor_) {
+    return Rect{0, 0, size_.width, size_.height};
+  }
+
+  Rect damage;
+  for (auto it = damage_log_.rbegin();
+       it != damage_log_.rend() && it->revision > revision; ++it) {
+    damage = damage.united(it->area);
+  }
+  return damage;
+}
+
+bool ImageDocument::damaged_since(std::uint64_t revision, const Layer* layer) const {
+  if (revision < damage_floor_) {
+    return true;
+  }
+  for (auto it = damage_log_.rbegin();
+       it != damage_log_.rend() && it->revision > revision; ++it) {
+    if (it->layer == nullptr || it->layer == layer) {
+      return true;
+    }
+  }
+  return false;
+}
+
+const ImageBuffer& ImageDocument::composite() const {
+  CompositeCache& cache = composite_cache_;
+  const Rect bounds{0, 0, size_.width, size_.height};
+  const std::size_t count = layers_.size();
+  const std::size_t active = std::min(
+      count, static_cast<std::size_t>(std::max(0, active_layer_index_)));
+
+  const Size cached_size = cache.full.size();
+  bool rebuild_below = !cache.valid || cache.active_index != active_layer_index_ ||
+                       cache.stack.size() != count ||
+                       cache.full.format() != layer_format_ ||
+                       cached_size.width != size_.width ||
+                       cached_size.height != size_.height;
+  bool rebuild_full = rebuild_below;
+
+  // Replaced or re-ordered layers and property changes invalidate the
+  // cache that contains them
+  for (std::size_t i = 0; i < count && !rebuild_below; ++i) {
+    const LayerState& state = cache.stack[i];
+    if (state.layer != layers_[i].get() ||
+        state.revision != layers_[i]->revision()) {
+      if (i < active) {
+        rebuild_below = true;
+      }
+      rebuild_full = true;
+    }
+  }
+  if (!rebuild_full && cache.revision < damage_floor_) {
+    rebuild_below = true;
+    rebuild_full = true;
+  }
+
+  // Pixel damage since the last update; channel damage (no layer) does not
+  // affect the layer composite
+  Rect below_damage;
+  Rect full_damage;
+  if (!rebuild_below) {
+    for (auto it = damage_log_.rbegin();
+         it != damage_log_.rend() && it->revision > cache.revision; ++it) {
+      if (!it->layer) {
+        continue;
+      }
+      for (std::size_t i = 0; i < count; ++i) {
+        if (layers_[i].get() == it->layer) {
+          if (i < active) {
+            below_damage = below_damage.united(it->area);
+          }
+          full_damage = full_damage.united(it->area);
+          break;
+        }
+      }
     }
-  } else if (mode_ == ColorMode::Grayscale && !channels_.empty()) {
-    for (int i = 0; i < size_.width * size_.height; ++i) {
-      const int src_idx = i * 3;
-      const int dst_idx = i * 4;
-      const uint8_t gray = channels_[0].buffer.data()[src_idx];
-
-      dst[dst_idx] = gray;
-      dst[dst_idx + 1] = gray;
-      dst[dst_idx + 2] = gray;
-      dst[dst_idx + 3] = 255;
+  }
+
+  if (active > 0) {
+    if (rebuild_below) {
+      cache.below.resize(size_, layer_format_, BufferInit::Uninitialized);
+      composite_region(cache.below, nullptr, 0, active, bounds);
+    } else if (!below_damage.is_empty()) {
+      composite_region(cache.below, nullptr, 0, active, below_damage);
     }
   }
+
+  const ImageBuffer* base = active > 0 ? &cache.below : nullptr;
+  if (rebuild_full) {
+    cache.full.resize(size_, layer_format_, BufferInit::Uninitialized);
+    composite_region(cache.full, base, active, count, bounds);
+    cache.generation = next_composite_generation();
+  } else if (!full_damage.is_empty()) {
+    composite_region(cache.full, base, active, count, full_damage);
+  }
+
+  cache.stack.resize(count);
+  for (std::size_t i = 0; i < count; ++i) {
+    cache.stack[i] = LayerState{layers_[i].get(), layers_[i]->revision()};
+  }
+  cache.active_index = active_layer_index_;
+  cache.revision = damage_revision_;
+  cache.valid = true;
+  return cache.full;
+}
+
+void ImageDocument::invalidate_composite() {
+  composite_cache_.valid = false;
+}
+
+void ImageDocument::composite_region(ImageBuffer& dst, const ImageBuffer* base,
+                                     std::size_t first_layer,
+                                     std::size_t end_layer,
+                                     const Rect& area) const {
+  const Rect rect = area.intersected(Rect{0, 0, size_.width, size_.height});
+  if (rect.is_empty()) {
+    return;
+  }
+
+  // The cache buffers are contiguous, so each row of the rect is one span
+  const PixelFormat format = dst.format();
+  const std::size_t pixel_bytes = bytes_per_pixel(format);
+  const std::size_t row_bytes = static_cast<std::size_t>(rect.width) * pixel_bytes;
+  const int grain = std::max(1, 16384 / rect.width);
+
+  ThreadPool::instance().parallel_for(
+      rect.y, rect.y + rect.height, grain, [&](int y0, int y1) {
+        thread_local std::vector<uint8_t> temp;
+        for (int y = y0; y < y1; ++y) {
+          uint8_t* row = dst.mutable_pixel_row(rect.x, y);
+          if (base) {
+            std::memcpy(row, base->pixel_row(rect.x, y), row_bytes);
+          } else {
+            std::memset(row, 0, row_bytes);
+          }
+
+          for (std::size_t i = first_layer; i < end_layer; ++i) {
+            const Layer& layer = *layers_[i];
+            if (!layer.visible()) {
+              continue;
+            }
+
+            const ImageBuffer& source = layer.buffer();
+            const int end = rect.x + rect.width;
+            for (int x = rect.x; x < end;) {
+              const int span = std::min(end - x, source.span_width(x));
+              composite_span(layer_span(source, x, y, span, format, temp),
+                             row + (x - rect.x) * pixel_bytes, span,
+                             layer.opacity(), layer.blend_mode(), format);
+              x += span;
+            }
+          }
+        }
+      });
 }
 
 }  // namespace ps::core
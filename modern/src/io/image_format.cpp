@@ -2,6 +2,11 @@
 
 #include <algorithm>
 #include <cctype>
+#include <stdexcept>
+#include <type_traits>
+
+#include "ps/core/image_view.h"
+#include "ps/core/thread_pool.h"
 
 namespace ps::io {
 
@@ -17,4 +22,156 @@ std::string file_extension(const std::string& path) {
   return extension;
 }
 
+ps::core::ImageDocument ImageFormat::load_thumbnail(const std::string& path,
+                                                     int max_edge) const {
+  // Checked before the possibly long load
+  thumbnail_size(ps::core::Size{1, 1}, max_edge);
+  return make_thumbnail(load(path), max_edge);
+}
+
+ps::core::Size thumbnail_size(ps::core::Size size, int max_edge) {
+  if (max_edge <= 0) {
+    throw std::invalid_argument("thumbnail edge must be positive");
+  }
+  const int longest = std::max(size.width, size.height);
+  if (longest <= max_edge) {
+    return size;
+  }
+  const auto scale = [&](int edge) {
+    const std::int64_t scaled =
+        (static_cast<std::int64_t>(edge) * max_edge + longest / 2) / longest;
+    return static_cast<int>(std::max<std::int64_t>(1, scaled));
+  };
+  return ps::core::Size{scale(size.width), scale(size.height)};
+}
+
+// ThumbnailBuilder implementation
+
+namespace {
+
+// Maps each of source_edge positions onto one of target_edge, in blocks
+// that differ in length by at most one
+void map_edge(int source_edge, int target_edge, std::vector<int>& target_of,
+              std::vector<std::uint32_t>& counts) {
+  target_of.resize(static_cast<std::size_t>(source_edge));
+  counts.assign(static_cast<std::size_t>(target_edge), 0);
+  for (int i = 0; i < source_edge; ++i) {
+    const auto target = static_cast<int>(static_cast<std::int64_t>(i) * target_edge / source_edge);
+    target_of[i] = target;
+    ++counts[target];
+  }
+}
+
+}  // namespace
+
+ThumbnailBuilder::ThumbnailBuilder(ps::core::Size source_size,
+                                   ps::core::ImageDocument& thumbnail)
+    : thumbnail_(thumbnail), source_size_(source_size) {
+  const ps::core::Size size = thumbnail.size();
+  if (size.width <= 0 || size.height <= 0 || size.width > source_size.width ||
+      size.height > source_size.height) {
+    throw std::invalid_argument("thumbnail must be smaller than its source");
+  }
+  map_edge(source_size.width, size.width, column_of_, column_counts_);
+  map_edge(source_size.height, size.height, row_of_, row_counts_);
+
+  for (const auto& channel : thumbnail.channels()) {
+    ChannelState& state = channels_.emplace_back();
+    ps::core::dispatch_format(channel.buffer.format(), [&](auto format) {
+      state.components = ps::core::FormatTraits<decltype(format)::value>::kComponents;
+    });
+    state.sums.assign(static_cast<std::size_t>(size.width) * state.components, 0);
+  }
+}
+
+void ThumbnailBuilder::add_row(int channel, int y, const std::uint8_t* row, std::size_t stride) {
+  accumulate(channel, y, row, stride);
+}
+
+void ThumbnailBuilder::add_row(int channel, int y, const std::uint16_t* row,
+                               std::size_t stride) {
+  accumulate(channel, y, row, stride);
+}
+
+template <typename Sample>
+void ThumbnailBuilder::accumulate(int channel, int y, const Sample* row, std::size_t stride) {
+  if (channel < 0 || static_cast<std::size_t>(channel) >= channels_.size() || y < 0 ||
+      y >= source_size_.height) {
+    throw std::out_of_range("thumbnail row out of range");
+  }
+  ps::core::ImageBuffer& buffer = thumbnail_.channels()[channel].buffer;
+  if (ps::core::bytes_per_pixel(buffer.format()) !=
+      sizeof(Sample) * static_cast<std::size_t>(channels_[channel].components)) {
+    throw std::invalid_argument("thumbnail row has the wrong sample type");
+  }
+
+  ChannelState& state = channels_[channel];
+  const auto components = static_cast<std::size_t>(state.components);
+  std::uint64_t* sums = state.sums.data();
+  const auto add = [&](auto count) {
+    constexpr std::size_t kCount = decltype(count)::value;
+    for (int x = 0; x < source_size_.width; ++x) {
+      std::uint64_t* sum = sums + static_cast<std::size_t>(column_of_[x]) * kCount;
+      const Sample* pixel = row + static_cast<std::size_t>(x) * stride;
+      for (std::size_t c = 0; c < kCount; ++c) {
+        sum[c] += pixel[c];
+      }
+    }
+  };
+  // The component count is a constant in the loop that runs per pixel
+  if (components == 1) {
+    add(std::integral_constant<std::size_t, 1>{});
+  } else if (components == 3) {
+    add(std::integral_constant<std::size_t, 3>{});
+  } else {
+    add(std::integral_constant<std::size_t, 4>{});
+  }
+
+  // The last source row of a block completes a thumbnail row
+  const int target = row_of_[y];
+  if (y + 1 < source_size_.height && row_of_[y + 1] == target) {
+    return;
+  }
+  const int width = thumbnail_.size().width;
+  std::vector<Sample> pixels(static_cast<std::size_t>(width) * components);
+  for (int x = 0; x < width; ++x) {
+    const std::uint64_t count =
+        static_cast<std::uint64_t>(column_counts_[x]) * row_counts_[target];
+    for (std::size_t c = 0; c < components; ++c) {
+      std::uint64_t& sum = sums[static_cast<std::size_t>(x) * components + c];
+      pixels[static_cast<std::size_t>(x) * components + c] =
+          static_cast<Sample>((sum + count / 2) / count);
+      sum = 0;
+    }
+  }
+  buffer.write_pixels(0, target, width, reinterpret_cast<const std::uint8_t*>(pixels.data()));
+}
+
+ps::core::ImageDocument make_thumbnail(const ps::core::ImageDocument& document, int max_edge) {
+  const ps::core::Size size = document.size();
+  const ps::core::Size reduced = thumbnail_size(size, max_edge);
+  ps::core::ImageDocument thumbnail(reduced, document.mode());
+  for (const auto& channel : document.channels()) {
+    thumbnail.add_channel(channel.name, channel.buffer.format());
+  }
+
+  ThumbnailBuilder builder(size, thumbnail);
+  const int channel_count = static_cast<int>(document.channels().size());
+  ps::core::ThreadPool::instance().parallel_for(0, channel_count, 1, [&](int c0, int c1) {
+    for (int c = c0; c < c1; ++c) {
+      const ps::core::ImageBuffer& buffer = document.channels()[c].buffer;
+      ps::core::dispatch_format(buffer.format(), [&](auto format) {
+        using Traits = ps::core::FormatTraits<decltype(format)::value>;
+        std::vector<typename Traits::Sample> row(static_cast<std::size_t>(size.width) *
+                                                 Traits::kComponents);
+        for (int y = 0; y < size.height; ++y) {
+          buffer.read_pixels(0, y, size.width, reinterpret_cast<std::uint8_t*>(row.data()));
+          builder.add_row(c, y, row.data(), Traits::kComponents);
+        }
+      });
+    }
+  });
+  return thumbnail;
+}
+
 }  // namespace ps::io
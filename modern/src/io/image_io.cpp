@@ -1,8 +1,11 @@
 #include "ps/io/image_io.h"
 
+#include <cstdio>
 #include <stdexcept>
 
+#include "ps/io/native_format.h"
 #include "ps/io/png_format.h"
+#include "ps/io/tiff_format.h"
 
 namespace ps::io {
 
@@ -13,28 +16,100 @@ void ImageIO::register_format(std::unique_ptr<ImageFormat> format) {
   formats_.push_back(std::move(format));
 }
 
-ps::core::ImageDocument ImageIO::load(const std::string& path) const {
-  for (const auto& format : formats_) {
+const ImageFormat& ImageIO::reader_for(const FormatList& formats, const std::string& path) {
+  // A file that cannot be opened goes by its extension, and the format
+  // reports the error
+  std::uint8_t header[ImageFormat::kSignatureSize];
+  std::size_t size = 0;
+  if (std::FILE* file = std::fopen(path.c_str(), "rb")) {
+    size = std::fread(header, 1, sizeof(header), file);
+    std::fclose(file);
+  }
+  if (size > 0) {
+    for (const auto& format : formats) {
+      if (format->can_read_signature(header, size)) {
+        return *format;
+      }
+    }
+  }
+  for (const auto& format : formats) {
     if (format->can_read(path)) {
-      return format->load(path);
+      return *format;
     }
   }
   throw std::runtime_error("no registered image format can read " + path);
 }
 
-void ImageIO::save(const std::string& path, const ps::core::ImageDocument& document) const {
-  for (const auto& format : formats_) {
+const ImageFormat& ImageIO::writer_for(const FormatList& formats, const std::string& path,
+                                       const ps::core::ImageDocument& document) {
+  for (const auto& format : formats) {
     if (format->can_write(path, document)) {
-      format->save(path, document);
-      return;
+      return *format;
     }
   }
   throw std::runtime_error("no registered image format can write " + path);
 }
 
+ps::core::ImageDocument ImageIO::load(const std::string& path,
+                                     const LoadOptions& options) const {
+  return reader_for(formats_, path).load(path, options);
+}
+
+void ImageIO::save(const std::string& path, const ps::core::ImageDocument& document,
+                   const SaveOptions& options) const {
+  writer_for(formats_, path, document).save(path, document, options);
+}
+
+ImageInfo ImageIO::probe(const std::string& path) const {
+  return reader_for(formats_, path).probe(path);
+}
+
+ps::core::ImageDocument ImageIO::load_thumbnail(const std::string& path, int max_edge) const {
+  return reader_for(formats_, path).load_thumbnail(path, max_edge);
+}
+
+LoadTask ImageIO::load_async(const std::string& path, LoadOptions options,
+                             IOCallbacks callbacks) const {
+  auto body = [formats = formats_, path, options = std::move(options)](
+                  IOTask::State& state, const std::function<void(float)>& report) {
+    LoadOptions worker_options = options;
+    worker_options.progress = [&](const ps::core::ImageDocument& document,
+                                  const ps::core::Rect& rows) {
+      report(static_cast<float>(rows.y + rows.height) /
+             static_cast<float>(document.size().height));
+      if (options.progress) {
+        options.progress(document, rows);
+      }
+    };
+    state.document.emplace(reader_for(formats, path).load(path, worker_options));
+  };
+  return LoadTask(IOTask::submit(std::move(callbacks), std::move(body)));
+}
+
+SaveTask ImageIO::save_async(const std::string& path, const ps::core::ImageDocument& document,
+                             SaveOptions options, IOCallbacks callbacks) const {
+  // shared_ptr because the job is held in a copyable std::function
+  auto snapshot = std::make_shared<ps::core::ImageDocument>(document.snapshot());
+  auto body = [formats = formats_, path, options = std::move(options), snapshot](
+                  IOTask::State&, const std::function<void(float)>& report) {
+    const int height = snapshot->size().height;
+    SaveOptions worker_options = options;
+    worker_options.progress = [&](const ps::core::Rect& rows) {
+      report(static_cast<float>(rows.y + rows.height) / static_cast<float>(height));
+      if (options.progress) {
+        options.progress(rows);
+      }
+    };
+    writer_for(formats, path, *snapshot).save(path, *snapshot, worker_options);
+  };
+  return SaveTask(IOTask::submit(std::move(callbacks), std::move(body)));
+}
+
 ImageIO create_default_image_io() {
   ImageIO io;
   io.register_format(std::make_unique<PNGFormat>());
+  io.register_format(std::make_unique<NativeFormat>());
+  io.register_format(std::make_unique<TIFFFormat>());
   return io;
 }
 
@@ -0,0 +1,151 @@
+#include "ps/io/io_task.h"
+
+#include <algorithm>
+
+#include "ps/io/io_worker_pool.h"
+
+namespace ps::io {
+
+namespace {
+
+bool is_final(IOStatus status) {
+  return status == IOStatus::Succeeded || status == IOStatus::Failed ||
+         status == IOStatus::Cancelled;
+}
+
+}  // namespace
+
+IOStatus IOTask::status() const {
+  if (!state_) {
+    throw std::logic_error("I/O task handle is empty");
+  }
+  std::lock_guard<std::mutex> lock(state_->mutex);
+  return state_->status;
+}
+
+bool IOTask::done() const {
+  return is_final(status());
+}
+
+float IOTask::progress() const {
+  if (!state_) {
+    throw std::logic_error("I/O task handle is empty");
+  }
+  return state_->progress.load(std::memory_order_relaxed);
+}
+
+void IOTask::cancel() {
+  if (state_) {
+    state_->cancel_requested.store(true, std::memory_order_relaxed);
+  }
+}
+
+void IOTask::wait() const {
+  if (!state_) {
+    throw std::logic_error("I/O task handle is empty");
+  }
+  std::unique_lock<std::mutex> lock(state_->mutex);
+  state_->done_cv.wait(lock, [this] { return is_final(state_->status); });
+}
+
+bool IOTask::wait_for(std::chrono::milliseconds timeout) const {
+  if (!state_) {
+    throw std::logic_error("I/O task handle is empty");
+  }
+  std::unique_lock<std::mutex> lock(state_->mutex);
+  return state_->done_cv.wait_for(lock, timeout, [this] { return is_final(state_->status); });
+}
+
+std::string IOTask::error() const {
+  if (!state_) {
+    return {};
+  }
+  std::lock_guard<std::mutex> lock(state_->mutex);
+  return state_->error;
+}
+
+void IOTask::rethrow_failure() const {
+  wait();
+  std::lock_guard<std::mutex> lock(state_->mutex);
+  if (state_->status == IOStatus::Cancelled) {
+    throw IOCancelled();
+  }
+  if (state_->status == IOStatus::Failed) {
+    std::rethrow_exception(state_->exception);
+  }
+}
+
+std::shared_ptr<IOTask::State> IOTask::submit(
+    IOCallbacks callbacks,
+    std::function<void(State& state, const std::function<void(float)>& report)> body) {
+  auto state = std::make_shared<State>();
+  state->callbacks = std::move(callbacks);
+
+  IOWorkerPool::instance().submit([state, body = std::move(body)](bool cancelled) {
+    State& task = *state;
+    IOStatus result = IOStatus::Cancelled;
+    std::exception_ptr exception;
+    std::string error;
+
+    if (!cancelled && !task.cancel_requested.load(std::memory_order_relaxed)) {
+      {
+        std::lock_guard<std::mutex> lock(task.mutex);
+        task.status = IOStatus::Running;
+      }
+      const auto report = [&task](float fraction) {
+        if (task.cancel_requested.load(std::memory_order_relaxed)) {
+          throw IOCancelled();
+        }
+        fraction = std::clamp(fraction, 0.0f, 1.0f);
+        task.progress.store(fraction, std::memory_order_relaxed);
+        if (task.callbacks.progress) {
+          task.callbacks.progress(fraction);
+        }
+      };
+      try {
+        body(task, report);
+        result = IOStatus::Succeeded;
+        task.progress.store(1.0f, std::memory_order_relaxed);
+      } catch (const IOCancelled&) {
+        result = IOStatus::Cancelled;
+      } catch (const std::exception& e) {
+        result = IOStatus::Failed;
+        exception = std::current_exception();
+        error = e.what();
+      } catch (...) {
+        result = IOStatus::Failed;
+        exception = std::current_exception();
+        error = "unknown error";
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(task.mutex);
+      task.status = result;
+      task.exception = std::move(exception);
+      task.error = std::move(error);
+    }
+    task.done_cv.notify_all();
+    if (task.callbacks.completed) {
+      task.callbacks.completed(result);
+    }
+  });
+  return state;
+}
+
+ps::core::ImageDocument LoadTask::take() {
+  rethrow_failure();
+  std::lock_guard<std::mutex> lock(state_->mutex);
+  if (!state_->document) {
+    throw std::logic_error("loaded document was already taken");
+  }
+  ps::core::ImageDocument document = std::move(*state_->document);
+  state_->document.reset();
+  return document;
+}
+
+void SaveTask::get() const {
+  rethrow_failure();
+}
+
+}  // namespace ps::io
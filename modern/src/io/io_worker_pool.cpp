@@ -0,0 +1,67 @@
+#include "ps/io/io_worker_pool.h"
+
+#include <algorithm>
+
+namespace ps::io {
+
+IOWorkerPool& IOWorkerPool::instance() {
+  static IOWorkerPool instance;
+  return instance;
+}
+
+IOWorkerPool::IOWorkerPool() {
+  const std::size_t count = std::clamp<std::size_t>(std::thread::hardware_concurrency(), 2,
+                                                    kMaxThreads);
+  for (std::size_t i = 0; i < count; ++i) {
+    workers_.emplace_back([this] { worker_main(); });
+  }
+}
+
+IOWorkerPool::~IOWorkerPool() {
+  std::deque<Job> pending;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+    pending.swap(jobs_);
+  }
+  cv_.notify_all();
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+  for (Job& job : pending) {
+    job(true);
+  }
+}
+
+void IOWorkerPool::submit(Job job) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!stop_) {
+      jobs_.push_back(std::move(job));
+      job = nullptr;
+    }
+  }
+  if (job) {
+    job(true);
+    return;
+  }
+  cv_.notify_one();
+}
+
+void IOWorkerPool::worker_main() {
+  for (;;) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+      if (stop_) {
+        return;
+      }
+      job = std::move(jobs_.front());
+      jobs_.pop_front();
+    }
+    job(false);
+  }
+}
+
+}  // namespace ps::io
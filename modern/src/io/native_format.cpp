@@ -0,0 +1,972 @@
+#include "ps/io/native_format.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include <zlib.h>
+
+#include "ps/core/pixel_conversion.h"
+#include "ps/core/thread_pool.h"
+#include "ps/core/tile.h"
+
+namespace ps::io {
+namespace {
+
+// File layout, all integers little-endian:
+//
+//   0   magic[8]
+//   8   u32 version
+//   12  u32 flags (kLittleEndianSamples)
+//   16  u64 index offset
+//   24  u64 index size
+//   32  u32 index CRC-32
+//   36  u32 reserved
+//   40  blobs: u32 encoding, u32 stored size, stored bytes
+//       index (see write_index())
+constexpr unsigned char kMagic[8] = {0x89, 'P', 'S', 'N', '\r', '\n', 0x1a, '\n'};
+constexpr std::uint32_t kVersion = 1;
+constexpr std::uint32_t kLittleEndianSamples = 1;
+constexpr std::size_t kHeaderSize = 40;
+constexpr std::size_t kBlobHeaderSize = 8;
+constexpr std::uint32_t kBlobRaw = 0;
+constexpr std::uint32_t kBlobDeflate = 1;
+
+/// Tiles prepared on the ThreadPool before each sequential write
+constexpr std::size_t kBatchTiles = 64;
+
+[[noreturn]] void corrupt(const std::string& path) {
+  throw std::runtime_error("corrupt native document " + path);
+}
+
+bool is_little_endian() {
+  const std::uint16_t probe = 1;
+  std::uint8_t first = 0;
+  std::memcpy(&first, &probe, 1);
+  return first == 1;
+}
+
+std::uint32_t load_u32(const std::uint8_t* p) {
+  return static_cast<std::uint32_t>(p[0]) | static_cast<std::uint32_t>(p[1]) << 8 |
+         static_cast<std::uint32_t>(p[2]) << 16 | static_cast<std::uint32_t>(p[3]) << 24;
+}
+
+std::uint64_t load_u64(const std::uint8_t* p) {
+  return static_cast<std::uint64_t>(load_u32(p)) |
+         static_cast<std::uint64_t>(load_u32(p + 4)) << 32;
+}
+
+void store_u32(std::uint8_t* p, std::uint32_t value) {
+  for (int i = 0; i < 4; ++i) {
+    p[i] = static_cast<std::uint8_t>(value >> (8 * i));
+  }
+}
+
+void store_u64(std::uint8_t* p, std::uint64_t value) {
+  store_u32(p, static_cast<std::uint32_t>(value));
+  store_u32(p + 4, static_cast<std::uint32_t>(value >> 32));
+}
+
+bool read_fully(int fd, std::uint8_t* data, std::size_t size, std::uint64_t offset) {
+  while (size > 0) {
+    const ssize_t count = ::pread(fd, data, size, static_cast<off_t>(offset));
+    if (count <= 0) {
+      return false;
+    }
+    data += count;
+    size -= static_cast<std::size_t>(count);
+    offset += static_cast<std::uint64_t>(count);
+  }
+  return true;
+}
+
+bool write_fully(int fd, const std::uint8_t* data, std::size_t size, std::uint64_t offset) {
+  while (size > 0) {
+    const ssize_t count = ::pwrite(fd, data, size, static_cast<off_t>(offset));
+    if (count <= 0) {
+      return false;
+    }
+    data += count;
+    size -= static_cast<std::size_t>(count);
+    offset += static_cast<std::uint64_t>(count);
+  }
+  return true;
+}
+
+/**
+ * @brief Header fields after the magic
+ */
+struct NativeHeader {
+  std::uint32_t flags = 0;
+  std::uint64_t index_offset = 0;
+  std::uint64_t index_size = 0;
+  std::uint32_t index_crc = 0;
+};
+
+std::array<std::uint8_t, kHeaderSize> encode_header(const NativeHeader& header) {
+  std::array<std::uint8_t, kHeaderSize> bytes{};
+  std::memcpy(bytes.data(), kMagic, sizeof(kMagic));
+  store_u32(bytes.data() + 8, kVersion);
+  store_u32(bytes.data() + 12, header.flags);
+  store_u64(bytes.data() + 16, header.index_offset);
+  store_u64(bytes.data() + 24, header.index_size);
+  store_u32(bytes.data() + 32, header.index_crc);
+  return bytes;
+}
+
+// False if the bytes are not a native header this build can read
+bool decode_header(const std::uint8_t* bytes, NativeHeader& header) {
+  if (std::memcmp(bytes, kMagic, sizeof(kMagic)) != 0 || load_u32(bytes + 8) != kVersion) {
+    return false;
+  }
+  header.flags = load_u32(bytes + 12);
+  header.index_offset = load_u64(bytes + 16);
+  header.index_size = load_u64(bytes + 24);
+  header.index_crc = load_u32(bytes + 32);
+  return true;
+}
+
+/**
+ * @brief A native file mapped into memory; the source of its lazy tiles
+ *
+ * Tile keys are blob offsets. Blobs appended by incremental saves lie past
+ * the mapping and are read with pread() instead.
+ */
+class NativeFile : public ps::core::TileSource {
+ public:
+  static std::shared_ptr<NativeFile> open(const std::string& path) {
+    auto file = std::shared_ptr<NativeFile>(new NativeFile(path));
+    file->fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file->fd_ < 0) {
+      throw std::runtime_error("cannot open " + path);
+    }
+    struct stat info {};
+    if (::fstat(file->fd_, &info) != 0) {
+      throw std::runtime_error("cannot open " + path);
+    }
+    file->device_ = info.st_dev;
+    file->inode_ = info.st_ino;
+    file->map_size_ = static_cast<std::size_t>(info.st_size);
+    if (file->map_size_ < kHeaderSize) {
+      corrupt(path);
+    }
+    void* map = ::mmap(nullptr, file->map_size_, PROT_READ, MAP_SHARED, file->fd_, 0);
+    if (map == MAP_FAILED) {
+      throw std::runtime_error("cannot map " + path);
+    }
+    file->map_ = static_cast<const std::uint8_t*>(map);
+    return file;
+  }
+
+  ~NativeFile() override {
+    if (map_) {
+      ::munmap(const_cast<std::uint8_t*>(map_), map_size_);
+    }
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  NativeFile(const NativeFile&) = delete;
+  NativeFile& operator=(const NativeFile&) = delete;
+
+  const std::string& path() const { return path_; }
+  const std::uint8_t* map() const { return map_; }
+  std::size_t map_size() const { return map_size_; }
+
+  /// Offset of the index this process last read or wrote
+  std::uint64_t index_offset() const { return index_offset_.load(std::memory_order_relaxed); }
+  void set_index_offset(std::uint64_t offset) const {
+    index_offset_.store(offset, std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Returns true if path is this file and nobody else has saved it
+   *        since, so new blobs can be appended to it
+   */
+  bool is_current(const std::string& path) const {
+    struct stat info {};
+    if (::stat(path.c_str(), &info) != 0 || info.st_dev != device_ || info.st_ino != inode_) {
+      return false;
+    }
+    std::uint8_t bytes[kHeaderSize];
+    NativeHeader header;
+    return read_fully(fd_, bytes, sizeof(bytes), 0) && decode_header(bytes, header) &&
+           header.index_offset == index_offset();
+  }
+
+  /**
+   * @brief Returns a blob with its header, as stored in the file
+   */
+  std::vector<std::uint8_t> read_blob(std::uint64_t offset) const {
+    std::uint8_t header[kBlobHeaderSize];
+    read(offset, header, sizeof(header));
+    std::vector<std::uint8_t> blob(kBlobHeaderSize + load_u32(header + 4));
+    read(offset, blob.data(), blob.size());
+    return blob;
+  }
+
+  /**
+   * @brief Returns the stored size of a blob, including its header
+   */
+  std::size_t blob_size(std::uint64_t offset) const {
+    std::uint8_t header[kBlobHeaderSize];
+    read(offset, header, sizeof(header));
+    return kBlobHeaderSize + load_u32(header + 4);
+  }
+
+  void read_tile(std::uint64_t key, std::uint8_t* dst, std::size_t byte_size) const override {
+    std::uint8_t header[kBlobHeaderSize];
+    read(key, header, sizeof(header));
+    const std::uint32_t encoding = load_u32(header);
+    const std::uint32_t stored = load_u32(header + 4);
+
+    // Blobs inside the mapping are decoded in place
+    const std::uint8_t* data = nullptr;
+    std::vector<std::uint8_t> copy;
+    if (key + kBlobHeaderSize + stored <= map_size_) {
+      data = map_ + key + kBlobHeaderSize;
+    } else {
+      copy.resize(stored);
+      read(key + kBlobHeaderSize, copy.data(), stored);
+      data = copy.data();
+    }
+
+    if (encoding == kBlobRaw && stored == byte_size) {
+      std::memcpy(dst, data, byte_size);
+      return;
+    }
+    uLongf length = static_cast<uLongf>(byte_size);
+    if (encoding != kBlobDeflate || ::uncompress(dst, &length, data, stored) != Z_OK ||
+        length != byte_size) {
+      corrupt(path_);
+    }
+  }
+
+ private:
+  explicit NativeFile(const std::string& path) : path_(path) {}
+
+  void read(std::uint64_t offset, std::uint8_t* dst, std::size_t size) const {
+    if (offset + size <= map_size_) {
+      std::memcpy(dst, map_ + offset, size);
+    } else if (!read_fully(fd_, dst, size, offset)) {
+      corrupt(path_);
+    }
+  }
+
+  std::string path_;
+  int fd_ = -1;
+  dev_t device_ = 0;
+  ino_t inode_ = 0;
+  const std::uint8_t* map_ = nullptr;
+  std::size_t map_size_ = 0;
+  mutable std::atomic<std::uint64_t> index_offset_{0};
+};
+
+/**
+ * @brief Appends little-endian fields to the index
+ */
+class IndexWriter {
+ public:
+  void u8(std::uint8_t value) { bytes_.push_back(value); }
+  void u32(std::uint32_t value) {
+    const std::size_t at = grow(4);
+    store_u32(bytes_.data() + at, value);
+  }
+  void i32(int value) { u32(static_cast<std::uint32_t>(value)); }
+  void u64(std::uint64_t value) {
+    const std::size_t at = grow(8);
+    store_u64(bytes_.data() + at, value);
+  }
+  void string(const std::string& value) {
+    u32(static_cast<std::uint32_t>(value.size()));
+    bytes_.insert(bytes_.end(), value.begin(), value.end());
+  }
+
+  const std::vector<std::uint8_t>& bytes() const { return bytes_; }
+
+ private:
+  std::size_t grow(std::size_t count) {
+    bytes_.resize(bytes_.size() + count);
+    return bytes_.size() - count;
+  }
+
+  std::vector<std::uint8_t> bytes_;
+};
+
+/**
+ * @brief Reads index fields, treating any overrun as corruption
+ */
+class IndexReader {
+ public:
+  IndexReader(const std::uint8_t* data, std::size_t size, const std::string& path)
+      : data_(data), end_(data + size), path_(path) {}
+
+  std::uint8_t u8() { return *take(1); }
+  std::uint32_t u32() { return load_u32(take(4)); }
+  int i32() { return static_cast<int>(u32()); }
+  std::uint64_t u64() { return load_u64(take(8)); }
+  std::string string() {
+    const std::uint32_t size = u32();
+    const std::uint8_t* text = take(size);
+    return std::string(reinterpret_cast<const char*>(text), size);
+  }
+  void skip(std::size_t count) { take(count); }
+
+  // Reads an enum stored as u8, rejecting values past last
+  template <typename Enum>
+  Enum enumeration(Enum last) {
+    const std::uint8_t value = u8();
+    if (value > static_cast<std::uint8_t>(last)) {
+      corrupt(path_);
+    }
+    return static_cast<Enum>(value);
+  }
+
+ private:
+  const std::uint8_t* take(std::size_t count) {
+    if (static_cast<std::size_t>(end_ - data_) < count) {
+      corrupt(path_);
+    }
+    const std::uint8_t* at = data_;
+    data_ += count;
+    return at;
+  }
+
+  const std::uint8_t* data_;
+  const std::uint8_t* end_;
+  const std::string& path_;
+};
+
+/**
+ * @brief Writes at increasing offsets of a file descriptor
+ */
+class BlobWriter {
+ public:
+  BlobWriter(int fd, std::uint64_t offset, const std::string& path)
+      : fd_(fd), offset_(offset), path_(path) {}
+
+  std::uint64_t append(const std::vector<std::uint8_t>& bytes) {
+    const std::uint64_t at = offset_;
+    if (!write_fully(fd_, bytes.data(), bytes.size(), at)) {
+      throw std::runtime_error("cannot write " + path_);
+    }
+    offset_ += bytes.size();
+    return at;
+  }
+
+  std::uint64_t offset() const { return offset_; }
+
+ private:
+  int fd_;
+  std::uint64_t offset_;
+  const std::string& path_;
+};
+
+// Compresses pixels into a blob with its header, stored raw if deflate
+// does not make them smaller
+std::vector<std::uint8_t> encode_blob(const std::uint8_t* data, std::size_t size, int level) {
+  std::vector<std::uint8_t> blob(kBlobHeaderSize + compressBound(static_cast<uLong>(size)));
+  uLongf length = static_cast<uLongf>(blob.size() - kBlobHeaderSize);
+  std::uint32_t encoding = kBlobDeflate;
+  if (level == 0 ||
+      compress2(blob.data() + kBlobHeaderSize, &length, data, static_cast<uLong>(size), level) !=
+          Z_OK ||
+      length >= size) {
+    encoding = kBlobRaw;
+    length = static_cast<uLongf>(size);
+    std::memcpy(blob.data() + kBlobHeaderSize, data, size);
+  }
+  blob.resize(kBlobHeaderSize + length);
+  store_u32(blob.data(), encoding);
+  store_u32(blob.data() + 4, static_cast<std::uint32_t>(length));
+  return blob;
+}
+
+bool all_zero(const std::uint8_t* data, std::size_t size) {
+  for (std::size_t i = 0; i < size; ++i) {
+    if (data[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Copies tile (tx, ty) of a contiguous buffer into tile layout, with the
+// parts past the right and bottom edges zeroed
+void gather_tile(const ps::core::ImageBuffer& buffer, int tx, int ty, std::uint8_t* dst) {
+  constexpr int kTile = ps::core::ImageBuffer::kTileSize;
+  const std::size_t bpp = ps::core::bytes_per_pixel(buffer.format());
+  const std::size_t row_bytes = static_cast<std::size_t>(kTile) * bpp;
+  std::memset(dst, 0, row_bytes * kTile);
+  const int x0 = tx * kTile;
+  const int y0 = ty * kTile;
+  const int width = std::min(kTile, buffer.size().width - x0);
+  const int height = std::min(kTile, buffer.size().height - y0);
+  for (int y = 0; y < height; ++y) {
+    buffer.read_pixels(x0, y0 + y, width, dst + static_cast<std::size_t>(y) * row_bytes);
+  }
+}
+
+// Tile grid of a buffer, whatever its layout
+int tile_columns(const ps::core::ImageBuffer& buffer) {
+  return (buffer.size().width + ps::core::ImageBuffer::kTileSize - 1) /
+         ps::core::ImageBuffer::kTileSize;
+}
+
+int tile_rows(const ps::core::ImageBuffer& buffer) {
+  return (buffer.size().height + ps::core::ImageBuffer::kTileSize - 1) /
+         ps::core::ImageBuffer::kTileSize;
+}
+
+std::size_t tile_bytes(const ps::core::ImageBuffer& buffer) {
+  const auto edge = static_cast<std::size_t>(ps::core::ImageBuffer::kTileSize);
+  return edge * edge * ps::core::bytes_per_pixel(buffer.format());
+}
+
+/**
+ * @brief One distinct tile of the document and where it ends up
+ */
+struct TileJob {
+  const ps::core::ImageBuffer* buffer = nullptr;
+  int tx = 0;
+  int ty = 0;
+  std::shared_ptr<ps::core::Tile> tile;  ///< Null for contiguous buffers
+  std::shared_ptr<const NativeFile> copy_from;  ///< Copy this blob as is
+  std::uint64_t copy_key = 0;
+  std::vector<std::uint8_t> blob;        ///< Prepared bytes; empty if all zero
+  std::uint64_t offset = 0;              ///< Final blob offset, 0 if none
+  std::vector<std::uint64_t*> slots;     ///< Index entries that refer to it
+};
+
+void prepare_blob(TileJob& job, int level) {
+  if (job.copy_from) {
+    job.blob = job.copy_from->read_blob(job.copy_key);
+    return;
+  }
+  const std::size_t size = tile_bytes(*job.buffer);
+  const std::uint8_t* data = nullptr;
+  std::vector<std::uint8_t> gathered;
+  if (job.tile) {
+    data = static_cast<const ps::core::Tile&>(*job.tile).data();
+  } else {
+    gathered.resize(size);
+    gather_tile(*job.buffer, job.tx, job.ty, gathered.data());
+    data = gathered.data();
+  }
+  // All-zero tiles are left out and load as unallocated
+  if (!all_zero(data, size)) {
+    job.blob = encode_blob(data, size, level);
+  }
+}
+
+/**
+ * @brief Index entries of one buffer
+ */
+struct BufferEntries {
+  const ps::core::ImageBuffer* buffer = nullptr;
+  std::vector<std::uint64_t> offsets;  ///< Blob per tile slot, 0 if empty
+};
+
+// Owns a file being written; unless committed, truncates an incremental
+// save back to its original length or removes a new file
+class SaveTarget {
+ public:
+  SaveTarget(int fd, std::string remove_path, std::uint64_t restore_size)
+      : fd_(fd), remove_path_(std::move(remove_path)), restore_size_(restore_size) {}
+
+  ~SaveTarget() {
+    if (!committed_) {
+      if (remove_path_.empty()) {
+        [[maybe_unused]] const int result = ::ftruncate(fd_, static_cast<off_t>(restore_size_));
+      } else {
+        std::remove(remove_path_.c_str());
+      }
+    }
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  SaveTarget(const SaveTarget&) = delete;
+  SaveTarget& operator=(const SaveTarget&) = delete;
+
+  int fd() const { return fd_; }
+
+  /// Flushes and closes; throws if the data did not reach the file
+  void close(const std::string& path) {
+    const bool synced = ::fsync(fd_) == 0;
+    const bool closed = ::close(fd_) == 0;
+    fd_ = -1;
+    if (!synced || !closed) {
+      throw std::runtime_error("cannot write " + path);
+    }
+  }
+
+  void commit() { committed_ = true; }
+
+ private:
+  int fd_;
+  std::string remove_path_;
+  std::uint64_t restore_size_;
+  bool committed_ = false;
+};
+
+// Checks the header and the index CRC, and returns a reader at the start
+// of the index
+IndexReader open_index(const NativeFile& file, NativeHeader& header) {
+  const std::string& path = file.path();
+  if (!decode_header(file.map(), header)) {
+    throw std::runtime_error(path + " is not a native document");
+  }
+  if (((header.flags & kLittleEndianSamples) != 0) != is_little_endian()) {
+    throw std::runtime_error(path + " was written on a machine with another byte order");
+  }
+  if (header.index_offset < kHeaderSize || header.index_offset > file.map_size() ||
+      header.index_size > file.map_size() - header.index_offset) {
+    corrupt(path);
+  }
+  const std::uint8_t* index_data = file.map() + header.index_offset;
+  const std::size_t index_size = static_cast<std::size_t>(header.index_size);
+  if (crc32(0L, index_data, static_cast<uInt>(index_size)) != header.index_crc) {
+    corrupt(path);
+  }
+  return IndexReader(index_data, index_size, path);
+}
+
+/**
+ * @brief The document fields at the start of the index
+ */
+struct IndexPrefix {
+  ps::core::Size size{};
+  ps::core::ColorMode mode = ps::core::ColorMode::RGB;
+  ps::core::PixelFormat layer_format = ps::core::PixelFormat::RGBA8;
+  int active_layer = -1;
+  ps::core::Rect selection_bounds{};
+  std::uint64_t selection_blob = 0;
+};
+
+IndexPrefix read_prefix(IndexReader& index, const std::string& path) {
+  IndexPrefix prefix;
+  prefix.size = ps::core::Size{index.i32(), index.i32()};
+  prefix.mode = index.enumeration(ps::core::ColorMode::CMYK);
+  prefix.layer_format = index.enumeration(ps::core::PixelFormat::Gray16);
+  prefix.active_layer = index.i32();
+  if (prefix.size.width <= 0 || prefix.size.height <= 0) {
+    corrupt(path);
+  }
+  prefix.selection_bounds = ps::core::Rect{index.i32(), index.i32(), index.i32(), index.i32()};
+  prefix.selection_blob = index.u64();
+  return prefix;
+}
+
+void write_buffer(IndexWriter& index, const BufferEntries& entries) {
+  const ps::core::ImageBuffer& buffer = *entries.buffer;
+  index.u8(static_cast<std::uint8_t>(buffer.format()));
+  index.i32(buffer.size().width);
+  index.i32(buffer.size().height);
+  for (std::uint64_t offset : entries.offsets) {
+    index.u64(offset);
+  }
+}
+
+}  // namespace
+
+std::string NativeFormat::name() const {
+  return "Native";
+}
+
+bool NativeFormat::can_read(const std::string& path) const {
+  return file_extension(path) == "psn";
+}
+
+bool NativeFormat::can_read_signature(const std::uint8_t* header, std::size_t size) const {
+  return size >= sizeof(kMagic) && std::memcmp(header, kMagic, sizeof(kMagic)) == 0;
+}
+
+ImageInfo NativeFormat::probe(const std::string& path) const {
+  const std::shared_ptr<NativeFile> file = NativeFile::open(path);
+  NativeHeader header;
+  IndexReader index = open_index(*file, header);
+  const IndexPrefix prefix = read_prefix(index, path);
+
+  ImageInfo info;
+  info.format = name();
+  info.size = prefix.size;
+  info.mode = prefix.mode;
+  // Tile offsets are skipped; no tile is read
+  const std::uint32_t channel_count = index.u32();
+  for (std::uint32_t c = 0; c < channel_count; ++c) {
+    index.string();
+    const auto format = index.enumeration(ps::core::PixelFormat::Gray16);
+    const ps::core::Size buffer_size{index.i32(), index.i32()};
+    if (buffer_size.width <= 0 || buffer_size.height <= 0) {
+      corrupt(path);
+    }
+    if (c == 0) {
+      info.bit_depth = format == ps::core::PixelFormat::Gray16 ? 16 : 8;
+    }
+    constexpr int kTile = ps::core::ImageBuffer::kTileSize;
+    const std::size_t tiles = static_cast<std::size_t>((buffer_size.width + kTile - 1) / kTile) *
+                              static_cast<std::size_t>((buffer_size.height + kTile - 1) / kTile);
+    index.skip(tiles * 8);
+  }
+  info.channel_count = static_cast<int>(channel_count);
+  info.layer_count = static_cast<int>(index.u32());
+  return info;
+}
+
+bool NativeFormat::can_write(const std::string& path,
+                             const ps::core::ImageDocument& document) const {
+  const ps::core::Size size = document.size();
+  return file_extension(path) == "psn" && size.width > 0 && size.height > 0;
+}
+
+ps::core::ImageDocument NativeFormat::load(const std::string& path,
+                                           const LoadOptions& options) const {
+  const std::shared_ptr<NativeFile> file = NativeFile::open(path);
+  NativeHeader header;
+  IndexReader index = open_index(*file, header);
+  file->set_index_offset(header.index_offset);
+
+  const IndexPrefix prefix = read_prefix(index, path);
+  const ps::core::Size size = prefix.size;
+  const ps::core::ColorMode mode = prefix.mode;
+  const ps::core::PixelFormat layer_format = prefix.layer_format;
+  const int active_layer = prefix.active_layer;
+  const ps::core::Rect selection_bounds = prefix.selection_bounds;
+  const std::uint64_t selection_blob = prefix.selection_blob;
+
+  ps::core::ImageDocument document(size, mode);
+  document.set_storage_layout(ps::core::StorageLayout::Tiled);
+  document.set_layer_format(layer_format);
+
+  // Blobs shared by several slots (filled areas) become one shared tile
+  std::unordered_map<std::uint64_t, std::shared_ptr<ps::core::Tile>> tiles;
+  const auto read_tiles = [&](ps::core::ImageBuffer& buffer) {
+    const std::size_t byte_size = buffer.tile_byte_size();
+    for (int ty = 0; ty < buffer.tile_rows(); ++ty) {
+      for (int tx = 0; tx < buffer.tile_columns(); ++tx) {
+        const std::uint64_t offset = index.u64();
+        if (offset == 0) {
+          continue;
+        }
+        if (offset < kHeaderSize || offset >= header.index_offset) {
+          corrupt(path);
+        }
+        std::shared_ptr<ps::core::Tile>& tile = tiles[offset];
+        if (!tile) {
+          tile = std::make_shared<ps::core::Tile>(byte_size, file, offset);
+        } else if (tile->byte_size() != byte_size) {
+          corrupt(path);
+        }
+        std::shared_ptr<ps::core::Tile> shared = tile;
+        buffer.swap_tile(tx, ty, shared);
+      }
+    }
+  };
+  const auto read_shape = [&](ps::core::PixelFormat& format, ps::core::Size& buffer_size) {
+    format = index.enumeration(ps::core::PixelFormat::Gray16);
+    buffer_size = ps::core::Size{index.i32(), index.i32()};
+    if (buffer_size.width <= 0 || buffer_size.height <= 0) {
+      corrupt(path);
+    }
+  };
+
+  const std::uint32_t channel_count = index.u32();
+  for (std::uint32_t c = 0; c < channel_count; ++c) {
+    const std::string name = index.string();
+    ps::core::PixelFormat format;
+    ps::core::Size buffer_size;
+    read_shape(format, buffer_size);
+    ps::core::ImageBuffer buffer(buffer_size, format, ps::core::StorageLayout::Tiled);
+    read_tiles(buffer);
+    document.add_channel(name, std::move(buffer));
+  }
+
+  const std::uint32_t layer_count = index.u32();
+  for (std::uint32_t l = 0; l < layer_count; ++l) {
+    ps::core::Layer& layer = document.add_layer(index.string());
+    layer.set_visible(index.u8() != 0);
+    layer.set_opacity(index.i32());
+    layer.set_blend_mode(index.enumeration(ps::core::BlendMode::Exclusion));
+    ps::core::PixelFormat format;
+    ps::core::Size buffer_size;
+    read_shape(format, buffer_size);
+    if (buffer_size.width != size.width || buffer_size.height != size.height ||
+        !ps::core::is_rgba_format(format)) {
+      corrupt(path);
+    }
+    // A layer can have been switched to a format other than the document's
+    layer.set_format(format);
+    read_tiles(layer.buffer());
+  }
+  if (active_layer >= 0 && static_cast<std::uint32_t>(active_layer) < layer_count) {
+    document.set_active_layer(active_layer);
+  }
+
+  if (selection_blob != 0) {
+    const ps::core::Rect& bounds = selection_bounds;
+    if (bounds.is_empty() || bounds.x < 0 || bounds.y < 0 ||
+        bounds.width > size.width - bounds.x || bounds.height > size.height - bounds.y ||
+        selection_blob < kHeaderSize || selection_blob >= header.index_offset) {
+      corrupt(path);
+    }
+    std::vector<std::uint8_t> mask(static_cast<std::size_t>(bounds.width) * bounds.height);
+    file->read_tile(selection_blob, mask.data(), mask.size());
+    ps::core::SelectionMask& selection = document.selection();
+    for (int y = 0; y < bounds.height; ++y) {
+      selection.write_row(bounds.x, bounds.y + y, bounds.width,
+                          mask.data() + static_cast<std::size_t>(y) * bounds.width);
+    }
+  }
+
+  if (options.progress) {
+    options.progress(document, ps::core::Rect{0, 0, size.width, size.height});
+  }
+  return document;
+}
+
+void NativeFormat::save(const std::string& path, const ps::core::ImageDocument& document,
+                        const SaveOptions& options) const {
+  if (options.compression_level < 0 || options.compression_level > 9) {
+    throw std::invalid_argument("compression level must be between 0 and 9");
+  }
+  const ps::core::Size size = document.size();
+
+  std::vector<BufferEntries> buffers;
+  for (const auto& channel : document.channels()) {
+    buffers.push_back(BufferEntries{&channel.buffer, {}});
+  }
+  for (const auto& layer : document.layers()) {
+    buffers.push_back(BufferEntries{&layer->buffer(), {}});
+  }
+
+  // Every index slot with pixels, and the native file its tile came from
+  struct SlotRef {
+    std::size_t buffer = 0;
+    int tx = 0;
+    int ty = 0;
+    std::shared_ptr<ps::core::Tile> tile;  ///< Null for contiguous buffers
+    std::shared_ptr<const NativeFile> file;
+    std::uint64_t key = 0;
+  };
+  std::vector<SlotRef> refs;
+  for (std::size_t b = 0; b < buffers.size(); ++b) {
+    const ps::core::ImageBuffer& buffer = *buffers[b].buffer;
+    const int columns = tile_columns(buffer);
+    buffers[b].offsets.assign(static_cast<std::size_t>(columns) * tile_rows(buffer), 0);
+    for (int ty = 0; ty < tile_rows(buffer); ++ty) {
+      for (int tx = 0; tx < columns; ++tx) {
+        SlotRef ref{b, tx, ty, nullptr, nullptr, 0};
+        if (buffer.is_tiled()) {
+          ref.tile = buffer.shared_tile(tx, ty);
+          if (!ref.tile) {
+            continue;
+          }
+          ref.file = std::dynamic_pointer_cast<const NativeFile>(ref.tile->source(ref.key));
+        }
+        refs.push_back(std::move(ref));
+      }
+    }
+  }
+
+  // Append to the file when the document came from it and nobody has saved
+  // over it since
+  std::shared_ptr<const NativeFile> base;
+  const NativeFile* checked = nullptr;
+  for (const SlotRef& ref : refs) {
+    if (ref.file && ref.file.get() != checked && ref.file->path() == path) {
+      checked = ref.file.get();
+      if (ref.file->is_current(path)) {
+        base = ref.file;
+        break;
+      }
+    }
+  }
+
+  int fd = -1;
+  std::uint64_t end = kHeaderSize;
+  if (base) {
+    std::unordered_map<std::uint64_t, bool> counted;
+    std::uint64_t reused_bytes = 0;
+    for (const SlotRef& ref : refs) {
+      if (ref.file == base && !counted[ref.key]) {
+        counted[ref.key] = true;
+        reused_bytes += base->blob_size(ref.key);
+      }
+    }
+    // Rewrite once unreferenced blobs would make up more than half the file
+    fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+    struct stat info {};
+    if (fd >= 0 && ::fstat(fd, &info) == 0 &&
+        static_cast<std::uint64_t>(info.st_size) - kHeaderSize <= 2 * reused_bytes) {
+      end = static_cast<std::uint64_t>(info.st_size);
+    } else {
+      if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+      }
+      base.reset();
+    }
+  }
+  std::string temp_path;
+  if (!base) {
+    temp_path = path + ".partial";
+    fd = ::open(temp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      throw std::runtime_error("cannot create " + path);
+    }
+  }
+  SaveTarget target(fd, temp_path, end);
+
+  // One job per distinct tile, slots sharing a tile share its blob. Tiles
+  // from other native files are copied without recompressing.
+  std::vector<TileJob> jobs;
+  std::unordered_map<const ps::core::Tile*, std::size_t> job_for_tile;
+  for (SlotRef& ref : refs) {
+    BufferEntries& entries = buffers[ref.buffer];
+    std::uint64_t* slot = &entries.offsets[static_cast<std::size_t>(ref.ty) *
+                                               tile_columns(*entries.buffer) + ref.tx];
+    if (base && ref.file == base) {
+      *slot = ref.key;
+      continue;
+    }
+    if (ref.tile) {
+      const auto found = job_for_tile.find(ref.tile.get());
+      if (found != job_for_tile.end()) {
+        jobs[found->second].slots.push_back(slot);
+        continue;
+      }
+      job_for_tile.emplace(ref.tile.get(), jobs.size());
+    }
+    TileJob& job = jobs.emplace_back();
+    job.buffer = entries.buffer;
+    job.tx = ref.tx;
+    job.ty = ref.ty;
+    job.tile = std::move(ref.tile);
+    job.copy_from = std::move(ref.file);
+    job.copy_key = ref.key;
+    job.slots.push_back(slot);
+  }
+
+  // Blobs are prepared a batch at a time on the ThreadPool and written in
+  // order, which keeps the file independent of the thread count
+  BlobWriter writer(target.fd(), end, path);
+  const int level = options.compression_level;
+  ps::core::ThreadPool& pool = ps::core::ThreadPool::instance();
+  for (std::size_t first = 0; first < jobs.size(); first += kBatchTiles) {
+    const std::size_t last = std::min(jobs.size(), first + kBatchTiles);
+    pool.parallel_for(static_cast<int>(first), static_cast<int>(last), 1, [&](int j0, int j1) {
+      for (int j = j0; j < j1; ++j) {
+        prepare_blob(jobs[j], level);
+      }
+    });
+    for (std::size_t j = first; j < last; ++j) {
+      TileJob& job = jobs[j];
+      if (!job.blob.empty()) {
+        job.offset = writer.append(job.blob);
+        std::vector<std::uint8_t>().swap(job.blob);
+      }
+      for (std::uint64_t* slot : job.slots) {
+        *slot = job.offset;
+      }
+    }
+    if (options.progress) {
+      const auto rows = static_cast<int>(static_cast<std::uint64_t>(size.height) * last /
+                                         jobs.size());
+      options.progress(ps::core::Rect{0, 0, size.width, rows});
+    }
+  }
+
+  // The selection is stored as the mask values inside its bounds
+  const ps::core::SelectionMask& selection = document.selection();
+  const ps::core::Rect bounds = selection.bounds();
+  std::uint64_t selection_blob = 0;
+  if (!bounds.is_empty()) {
+    std::vector<std::uint8_t> mask(static_cast<std::size_t>(bounds.width) * bounds.height);
+    for (int y = 0; y < bounds.height; ++y) {
+      selection.read_row(bounds.x, bounds.y + y, bounds.width,
+                         mask.data() + static_cast<std::size_t>(y) * bounds.width);
+    }
+    selection_blob = writer.append(encode_blob(mask.data(), mask.size(), std::max(1, level)));
+  }
+
+  IndexWriter index;
+  index.i32(size.width);
+  index.i32(size.height);
+  index.u8(static_cast<std::uint8_t>(document.mode()));
+  index.u8(static_cast<std::uint8_t>(document.layer_format()));
+  index.i32(document.active_layer_index());
+  index.i32(bounds.x);
+  index.i32(bounds.y);
+  index.i32(bounds.width);
+  index.i32(bounds.height);
+  index.u64(selection_blob);
+  std::size_t b = 0;
+  index.u32(static_cast<std::uint32_t>(document.channels().size()));
+  for (const auto& channel : document.channels()) {
+    index.string(channel.name);
+    write_buffer(index, buffers[b++]);
+  }
+  index.u32(static_cast<std::uint32_t>(document.layers().size()));
+  for (const auto& layer : document.layers()) {
+    index.string(layer->name());
+    index.u8(layer->visible() ? 1 : 0);
+    index.i32(layer->opacity());
+    index.u8(static_cast<std::uint8_t>(layer->blend_mode()));
+    write_buffer(index, buffers[b++]);
+  }
+
+  NativeHeader header;
+  header.flags = is_little_endian() ? kLittleEndianSamples : 0;
+  header.index_size = index.bytes().size();
+  header.index_crc = static_cast<std::uint32_t>(
+      crc32(0L, index.bytes().data(), static_cast<uInt>(index.bytes().size())));
+  header.index_offset = writer.append(index.bytes());
+
+  // The header is switched to the new index only once everything it refers
+  // to is on disk, so an interrupted save leaves the old index valid
+  if (base && ::fdatasync(target.fd()) != 0) {
+    throw std::runtime_error("cannot write " + path);
+  }
+  const auto header_bytes = encode_header(header);
+  if (!write_fully(target.fd(), header_bytes.data(), header_bytes.size(), 0)) {
+    throw std::runtime_error("cannot write " + path);
+  }
+  if (base) {
+    // The header may already be on disk, so the appended data must stay
+    target.commit();
+  }
+  target.close(path);
+  if (!base && std::rename(temp_path.c_str(), path.c_str()) != 0) {
+    throw std::runtime_error("cannot replace " + path);
+  }
+  target.commit();
+
+  // The tiles now live in the file: clean ones can be dropped from memory
+  // and the next save appends only what changes
+  std::shared_ptr<const NativeFile> saved = base;
+  if (!saved) {
+    saved = NativeFile::open(path);
+  }
+  saved->set_index_offset(header.index_offset);
+  for (const TileJob& job : jobs) {
+    if (job.tile && job.offset != 0) {
+      job.tile->set_source(saved, job.offset);
+    }
+  }
+}
+
+}  // namespace ps::io
@@ -1,35 +1,667 @@
 #include "ps/io/png_format.h"
 
+#include <algorithm>
+#include <array>
+#include <csetjmp>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <functional>
 #include <stdexcept>
+#include <type_traits>
 #include <vector>
 
 #include <png.h>
+#include <zlib.h>
+
+#include "ps/core/image_view.h"
+#include "ps/core/thread_pool.h"
 
 namespace ps::io {
 namespace {
 
-const ps::core::ImageBuffer& primary_buffer(const ps::core::ImageDocument& document) {
-  if (document.channels().empty()) {
-    throw std::runtime_error("image document has no channels");
+/**
+ * @brief How a document's channels map onto PNG samples
+ */
+struct PNGLayout {
+  int color_type = 0;                                ///< PNG_COLOR_TYPE_* value
+  int bit_depth = 8;                                 ///< 8 or 16
+  std::vector<const ps::core::ImageBuffer*> planes;  ///< One per sample, planar
+  const ps::core::ImageBuffer* interleaved = nullptr;  ///< Legacy single buffer
+};
+
+bool is_plane(const ps::core::ImageChannel& channel, ps::core::PixelFormat format) {
+  return channel.buffer.format() == format &&
+         (format == ps::core::PixelFormat::Gray8 || format == ps::core::PixelFormat::Gray16);
+}
+
+// Gray8 or Gray16 channel planes become samples: three (+ alpha) in RGB
+// mode, one (+ alpha) in grayscale mode. A document holding a single
+// interleaved channel is written as that buffer's format.
+bool png_layout(const ps::core::ImageDocument& document, PNGLayout& layout) {
+  const auto& channels = document.channels();
+  if (channels.empty()) {
+    return false;
+  }
+
+  const std::size_t color_planes =
+      document.mode() == ps::core::ColorMode::RGB ? 3 :
+      document.mode() == ps::core::ColorMode::Grayscale ? 1 : 0;
+  const ps::core::PixelFormat format = channels.front().buffer.format();
+  if (color_planes > 0 && channels.size() >= color_planes) {
+    const std::size_t plane_count =
+        channels.size() > color_planes && is_plane(channels[color_planes], format)
+            ? color_planes + 1
+            : color_planes;
+    bool planar = true;
+    for (std::size_t c = 0; c < plane_count; ++c) {
+      planar = planar && is_plane(channels[c], format);
+    }
+
+    if (planar) {
+      const bool alpha = plane_count > color_planes;
+      if (color_planes == 3) {
+        layout.color_type = alpha ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB;
+      } else {
+        layout.color_type = alpha ? PNG_COLOR_TYPE_GRAY_ALPHA : PNG_COLOR_TYPE_GRAY;
+      }
+      layout.bit_depth = format == ps::core::PixelFormat::Gray16 ? 16 : 8;
+      for (std::size_t c = 0; c < plane_count; ++c) {
+        layout.planes.push_back(&channels[c].buffer);
+      }
+      return true;
+    }
+  }
+
+  if (format == ps::core::PixelFormat::RGB8 || format == ps::core::PixelFormat::RGBA8) {
+    layout.color_type =
+        format == ps::core::PixelFormat::RGB8 ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGB_ALPHA;
+    layout.interleaved = &channels.front().buffer;
+    return true;
+  }
+  return false;
+}
+
+bool is_little_endian() {
+  const std::uint16_t probe = 1;
+  std::uint8_t first = 0;
+  std::memcpy(&first, &probe, 1);
+  return first == 1;
+}
+
+// libpng reports errors by calling this and then longjmp()ing back to the
+// last setjmp(). The message is kept for the exception thrown once control
+// is back in C++ code.
+void on_png_error(png_structp png, png_const_charp message) {
+  auto* error = static_cast<std::string*>(png_get_error_ptr(png));
+  *error = message ? message : "PNG error";
+  png_longjmp(png, 1);
+}
+
+void on_png_warning(png_structp, png_const_charp) {}
+
+// The read struct lives in this RAII owner. Every libpng call that can
+// fail is wrapped in a small function below whose only locals are
+// trivially destructible, so the longjmp() out of a failed call never
+// skips a destructor.
+class PNGReader {
+ public:
+  explicit PNGReader(const std::string& path) : file_(std::fopen(path.c_str(), "rb")) {
+    if (!file_) {
+      throw std::runtime_error("cannot open " + path);
+    }
+    png_ = png_create_read_struct(PNG_LIBPNG_VER_STRING, &error_, on_png_error,
+                                  on_png_warning);
+    info_ = png_ ? png_create_info_struct(png_) : nullptr;
+    if (!info_) {
+      destroy();
+      throw std::runtime_error("out of memory creating the PNG decoder");
+    }
+  }
+
+  ~PNGReader() { destroy(); }
+
+  PNGReader(const PNGReader&) = delete;
+  PNGReader& operator=(const PNGReader&) = delete;
+
+  png_structp png() const { return png_; }
+  png_infop info() const { return info_; }
+  std::FILE* file() const { return file_; }
+
+  [[noreturn]] void fail() const { throw std::runtime_error(error_); }
+
+ private:
+  void destroy() {
+    if (png_) {
+      png_destroy_read_struct(&png_, info_ ? &info_ : nullptr, nullptr);
+    }
+    if (file_) {
+      std::fclose(file_);
+      file_ = nullptr;
+    }
+  }
+
+  std::FILE* file_ = nullptr;
+  png_structp png_ = nullptr;
+  png_infop info_ = nullptr;
+  std::string error_;
+};
+
+/**
+ * @brief Decoded PNG properties, after the expansions set up by read_header()
+ */
+struct PNGHeader {
+  png_uint_32 width = 0;
+  png_uint_32 height = 0;
+  int samples = 0;    ///< 1 (gray), 2 (gray + alpha), 3 (RGB) or 4 (RGBA)
+  int bit_depth = 0;  ///< 8 or 16
+  bool color = false;
+  int passes = 1;     ///< 7 for Adam7-interlaced files
+  int file_bit_depth = 8;  ///< Sample or palette index depth in the file
+};
+
+bool read_header(const PNGReader& reader, PNGHeader& header) {
+  png_structp png = reader.png();
+  png_infop info = reader.info();
+  if (setjmp(png_jmpbuf(png))) {
+    return false;
+  }
+
+  png_init_io(png, reader.file());
+  png_read_info(png, info);
+
+  // Keep the native bit depth and sample count, expanding only what the
+  // channels cannot store: palettes, sub-byte gray and tRNS transparency
+  const int color_type = png_get_color_type(png, info);
+  header.file_bit_depth = png_get_bit_depth(png, info);
+  if (color_type == PNG_COLOR_TYPE_PALETTE) {
+    png_set_palette_to_rgb(png);
+  }
+  if (color_type == PNG_COLOR_TYPE_GRAY && png_get_bit_depth(png, info) < 8) {
+    png_set_expand_gray_1_2_4_to_8(png);
+  }
+  if (png_get_valid(png, info, PNG_INFO_tRNS)) {
+    png_set_tRNS_to_alpha(png);
+  }
+  if (png_get_bit_depth(png, info) == 16 && is_little_endian()) {
+    png_set_swap(png);  // Gray16 samples are native-endian
+  }
+  header.passes = png_set_interlace_handling(png);
+  png_read_update_info(png, info);
+
+  header.width = png_get_image_width(png, info);
+  header.height = png_get_image_height(png, info);
+  header.samples = png_get_channels(png, info);
+  header.bit_depth = png_get_bit_depth(png, info);
+  header.color = (png_get_color_type(png, info) & PNG_COLOR_MASK_COLOR) != 0;
+  return true;
+}
+
+bool read_row(const PNGReader& reader, png_bytep row) {
+  if (setjmp(png_jmpbuf(reader.png()))) {
+    return false;
   }
-  return document.channels().front().buffer;
+  png_read_row(reader.png(), row, nullptr);
+  return true;
 }
 
-png_uint_32 pixel_format_for_buffer(ps::core::PixelFormat format) {
-  switch (format) {
-    case ps::core::PixelFormat::Gray8:
-      return PNG_FORMAT_GRAY;
-    case ps::core::PixelFormat::RGB8:
-      return PNG_FORMAT_RGB;
-    case ps::core::PixelFormat::RGBA8:
-      return PNG_FORMAT_RGBA;
+bool read_end(const PNGReader& reader) {
+  if (setjmp(png_jmpbuf(reader.png()))) {
+    return false;
+  }
+  png_read_end(reader.png(), nullptr);
+  return true;
+}
+
+// Calls fn with a runtime PNG sample count (1-4) as a compile-time
+// constant, so the (de)interleaving loops below unroll per count
+template <typename Fn>
+void with_sample_count(int samples, Fn&& fn) {
+  switch (samples) {
+    case 1:
+      fn(std::integral_constant<int, 1>{});
+      break;
+    case 2:
+      fn(std::integral_constant<int, 2>{});
+      break;
+    case 3:
+      fn(std::integral_constant<int, 3>{});
+      break;
+    case 4:
+      fn(std::integral_constant<int, 4>{});
+      break;
     default:
+      throw std::runtime_error("unsupported PNG sample count");
+  }
+}
+
+// Adds the channels load() gives a file with this header
+void add_channels(ps::core::ImageDocument& document, const PNGHeader& header,
+                  ps::core::StorageLayout layout, ps::core::BufferInit init) {
+  const ps::core::Size size = document.size();
+  const ps::core::PixelFormat format =
+      header.bit_depth == 16 ? ps::core::PixelFormat::Gray16 : ps::core::PixelFormat::Gray8;
+  const bool alpha = header.samples == 2 || header.samples == 4;
+  static const char* kColorNames[] = {"Red", "Green", "Blue"};
+  for (int c = 0; c < header.samples; ++c) {
+    const bool is_alpha = alpha && c + 1 == header.samples;
+    const char* name = is_alpha ? "Alpha" : (header.color ? kColorNames[c] : "Gray");
+    document.add_channel(name, ps::core::ImageBuffer(size, format, layout, init));
+  }
+}
+
+ps::core::ColorMode color_mode(const PNGHeader& header) {
+  return header.color ? ps::core::ColorMode::RGB : ps::core::ColorMode::Grayscale;
+}
+
+// Splits one interleaved PNG row into row y of the planes
+template <int Samples, typename View>
+void split_samples(const typename View::Sample* row, int y, const std::vector<View>& planes) {
+  for (int c = 0; c < Samples; ++c) {
+    planes[c].for_each_span(y, [&](int x, typename View::Sample* pixels, int count) {
+      const typename View::Sample* src = row + static_cast<std::size_t>(x) * Samples + c;
+      for (int i = 0; i < count; ++i, src += Samples) {
+        pixels[i] = *src;
+      }
+    });
+  }
+}
+
+// Interleaves row y of the planes into one PNG row
+template <int Samples, typename View>
+void join_samples(const std::vector<View>& planes, int y,
+                  std::remove_const_t<typename View::Sample>* row) {
+  for (int c = 0; c < Samples; ++c) {
+    planes[c].for_each_span(y, [&](int x, const typename View::Sample* pixels, int count) {
+      auto* dst = row + static_cast<std::size_t>(x) * Samples + c;
+      for (int i = 0; i < count; ++i, dst += Samples) {
+        *dst = pixels[i];
+      }
+    });
+  }
+}
+
+// Decodes every row into the document's channels, which are in Format
+template <ps::core::PixelFormat Format, int Samples>
+void decode_rows(const PNGReader& reader, const PNGHeader& header,
+                 ps::core::ImageDocument& document, const LoadProgress& progress) {
+  using View = ps::core::MutableImageView<Format>;
+  using Sample = typename View::Sample;
+  std::vector<View> planes;
+  for (auto& channel : document.channels()) {
+    planes.emplace_back(channel.buffer);
+  }
+
+  const int width = static_cast<int>(header.width);
+  const int height = static_cast<int>(header.height);
+  std::vector<Sample> row(static_cast<std::size_t>(width) * Samples);
+  for (int pass = 0; pass < header.passes; ++pass) {
+    int band_start = 0;
+    for (int y = 0; y < height; ++y) {
+      // Later Adam7 passes only fill in some pixels of the row
+      if (pass > 0) {
+        join_samples<Samples>(planes, y, row.data());
+      }
+      if (!read_row(reader, reinterpret_cast<png_bytep>(row.data()))) {
+        reader.fail();
+      }
+      split_samples<Samples>(row.data(), y, planes);
+
+      if (progress && ((y + 1) % ps::core::ImageBuffer::kTileSize == 0 || y + 1 == height)) {
+        progress(document, ps::core::Rect{0, band_start, width, y + 1 - band_start});
+        band_start = y + 1;
+      }
+    }
+  }
+}
+
+// Feeds decoded rows to a thumbnail. For interlaced files only the first
+// Adam7 pass is decoded: it holds every 8th pixel of every 8th row, a
+// reduced image that is complete before the other six passes start.
+template <typename Sample, int Samples>
+void reduce_rows(const PNGReader& reader, const PNGHeader& header, bool first_pass,
+                 ThumbnailBuilder& builder) {
+  const int width = static_cast<int>(header.width);
+  const int height = static_cast<int>(header.height);
+  const int step = first_pass ? 8 : 1;
+  std::vector<Sample> row(static_cast<std::size_t>(width) * Samples);
+  for (int y = 0; y < height; ++y) {
+    // Rows outside the first pass return at once without decoding
+    if (!read_row(reader, reinterpret_cast<png_bytep>(row.data()))) {
+      reader.fail();
+    }
+    if (y % step != 0) {
+      continue;
+    }
+    for (int c = 0; c < Samples; ++c) {
+      builder.add_row(c, y / step, row.data() + c, static_cast<std::size_t>(Samples) * step);
+    }
+  }
+}
+
+// Saving bypasses libpng: each block of rows is filtered and deflated on
+// its own ThreadPool task, pigz-style, and the raw deflate blocks are
+// concatenated into the single zlib stream of the IDAT chunks.
+
+/// Filtered bytes per deflate block
+constexpr std::size_t kBlockBytes = 256 * 1024;
+/// deflate window; each block is primed with this much of the one before
+constexpr int kWindowBits = 15;
+constexpr std::size_t kWindowSize = std::size_t{1} << kWindowBits;
+
+/**
+ * @brief Owns the file while a PNG is written; removes it unless finished
+ */
+class PNGWriter {
+ public:
+  explicit PNGWriter(const std::string& path)
+      : path_(path), file_(std::fopen(path.c_str(), "wb")) {
+    if (!file_) {
+      throw std::runtime_error("cannot create " + path);
+    }
+  }
+
+  // Unwinding before finish() (write error, cancelled progress callback)
+  // leaves no partial file behind
+  ~PNGWriter() {
+    if (file_) {
+      std::fclose(file_);
+    }
+    if (!done_) {
+      std::remove(path_.c_str());
+    }
+  }
+
+  PNGWriter(const PNGWriter&) = delete;
+  PNGWriter& operator=(const PNGWriter&) = delete;
+
+  void write(const void* data, std::size_t size) {
+    if (size > 0 && std::fwrite(data, 1, size, file_) != size) {
+      throw std::runtime_error("cannot write " + path_);
+    }
+  }
+
+  /**
+   * @brief Starts a chunk of the given data size; add the data with
+   *        chunk_data() and close it with end_chunk()
+   */
+  void begin_chunk(const char* type, std::size_t size) {
+    write_u32(static_cast<std::uint32_t>(size));
+    write(type, 4);
+    crc_ = crc32(0L, reinterpret_cast<const Bytef*>(type), 4);
+  }
+
+  void chunk_data(const std::uint8_t* data, std::size_t size) {
+    // crc32() restarts when given a null buffer
+    if (size > 0) {
+      write(data, size);
+      crc_ = crc32(crc_, data, static_cast<uInt>(size));
+    }
+  }
+
+  void end_chunk() { write_u32(static_cast<std::uint32_t>(crc_)); }
+
+  void write_chunk(const char* type, const std::uint8_t* data, std::size_t size) {
+    begin_chunk(type, size);
+    chunk_data(data, size);
+    end_chunk();
+  }
+
+  /**
+   * @brief Closes the file once everything is written
+   */
+  void finish() {
+    const bool flushed = std::fflush(file_) == 0;
+    const bool closed = std::fclose(file_) == 0;
+    file_ = nullptr;
+    if (!flushed || !closed) {
+      throw std::runtime_error("cannot write " + path_);
+    }
+    done_ = true;
+  }
+
+ private:
+  void write_u32(std::uint32_t value) {
+    const std::uint8_t bytes[4] = {
+        static_cast<std::uint8_t>(value >> 24), static_cast<std::uint8_t>(value >> 16),
+        static_cast<std::uint8_t>(value >> 8), static_cast<std::uint8_t>(value)};
+    write(bytes, sizeof(bytes));
+  }
+
+  std::string path_;
+  std::FILE* file_ = nullptr;
+  uLong crc_ = 0;
+  bool done_ = false;
+};
+
+/// Writes raw (unfiltered) row y in PNG byte order
+using RowReader = std::function<void(int y, std::uint8_t* row)>;
+
+// Rows of Gray8/Gray16 planes, interleaved and made big-endian
+template <ps::core::PixelFormat Format, int Samples>
+RowReader plane_rows(const PNGLayout& layout) {
+  using View = ps::core::ImageView<Format>;
+  using Sample = typename View::Traits::Sample;
+  std::vector<View> planes;
+  for (const ps::core::ImageBuffer* plane : layout.planes) {
+    planes.emplace_back(*plane);
+  }
+  const bool swap = sizeof(Sample) == 2 && is_little_endian();
+  const std::size_t count = static_cast<std::size_t>(planes.front().width()) * Samples;
+  return [planes = std::move(planes), swap, count](int y, std::uint8_t* row) {
+    // The row storage holds Samples (see filter_block())
+    auto* samples = reinterpret_cast<Sample*>(row);
+    join_samples<Samples>(planes, y, samples);
+    if constexpr (sizeof(Sample) == 2) {
+      if (swap) {
+        for (std::size_t i = 0; i < count; ++i) {
+          samples[i] = static_cast<Sample>((samples[i] >> 8) | (samples[i] << 8));
+        }
+      }
+    }
+  };
+}
+
+// Rows of an RGB8 or RGBA8 buffer, copied as is
+template <ps::core::PixelFormat Format>
+RowReader interleaved_rows(const ps::core::ImageBuffer& buffer) {
+  using View = ps::core::ImageView<Format>;
+  return [view = View(buffer)](int y, std::uint8_t* row) {
+    view.for_each_span(y, [&](int x, const typename View::Sample* pixels, int count) {
+      std::memcpy(row + static_cast<std::size_t>(x) * View::kComponents, pixels,
+                  static_cast<std::size_t>(count) * View::kComponents);
+    });
+  };
+}
+
+RowReader row_reader(const PNGLayout& layout) {
+  if (layout.interleaved) {
+    return layout.interleaved->format() == ps::core::PixelFormat::RGB8
+               ? interleaved_rows<ps::core::PixelFormat::RGB8>(*layout.interleaved)
+               : interleaved_rows<ps::core::PixelFormat::RGBA8>(*layout.interleaved);
+  }
+  RowReader reader;
+  ps::core::dispatch_format(layout.planes.front()->format(), [&](auto tag) {
+    if constexpr (ps::core::FormatTraits<decltype(tag)::value>::kComponents == 1) {
+      with_sample_count(static_cast<int>(layout.planes.size()), [&](auto samples) {
+        reader = plane_rows<decltype(tag)::value, decltype(samples)::value>(layout);
+      });
+    }
+  });
+  return reader;
+}
+
+int paeth(int left, int up, int up_left) {
+  const int p = left + up - up_left;
+  const int pa = std::abs(p - left);
+  const int pb = std::abs(p - up);
+  const int pc = std::abs(p - up_left);
+  return pa <= pb && pa <= pc ? left : pb <= pc ? up : up_left;
+}
+
+// Writes the filter type byte and the filtered row to out; prev is the
+// raw row above, all zero for the first row
+void apply_filter(RowFilter filter, const std::uint8_t* row, const std::uint8_t* prev,
+                  std::size_t size, std::size_t bpp, std::uint8_t* out) {
+  *out++ = static_cast<std::uint8_t>(filter);
+  switch (filter) {
+    case RowFilter::None:
+      std::memcpy(out, row, size);
+      break;
+    case RowFilter::Sub:
+      std::memcpy(out, row, bpp);
+      for (std::size_t i = bpp; i < size; ++i) {
+        out[i] = static_cast<std::uint8_t>(row[i] - row[i - bpp]);
+      }
+      break;
+    case RowFilter::Up:
+      for (std::size_t i = 0; i < size; ++i) {
+        out[i] = static_cast<std::uint8_t>(row[i] - prev[i]);
+      }
+      break;
+    case RowFilter::Average:
+      for (std::size_t i = 0; i < bpp; ++i) {
+        out[i] = static_cast<std::uint8_t>(row[i] - (prev[i] >> 1));
+      }
+      for (std::size_t i = bpp; i < size; ++i) {
+        out[i] = static_cast<std::uint8_t>(row[i] - ((row[i - bpp] + prev[i]) >> 1));
+      }
+      break;
+    case RowFilter::Paeth:
+      for (std::size_t i = 0; i < bpp; ++i) {
+        out[i] = static_cast<std::uint8_t>(row[i] - prev[i]);
+      }
+      for (std::size_t i = bpp; i < size; ++i) {
+        out[i] = static_cast<std::uint8_t>(
+            row[i] - paeth(row[i - bpp], prev[i], prev[i - bpp]));
+      }
+      break;
+    case RowFilter::Adaptive:
+      break;
+  }
+}
+
+// Sum of the residuals read as signed bytes, the usual heuristic for
+// choosing a filter
+std::size_t residual_sum(const std::uint8_t* filtered, std::size_t size) {
+  std::size_t sum = 0;
+  for (std::size_t i = 0; i < size; ++i) {
+    sum += static_cast<std::size_t>(std::abs(static_cast<std::int8_t>(filtered[i])));
+  }
+  return sum;
+}
+
+/**
+ * @brief A band of rows compressed independently of the others
+ */
+struct DeflateBlock {
+  int y0 = 0;
+  int y1 = 0;
+  std::vector<std::uint8_t> filtered;    ///< Filter byte + filtered row, per row
+  std::vector<std::uint8_t> compressed;  ///< Raw deflate data
+  uLong adler = 1;                       ///< Adler-32 of filtered
+};
+
+// Filters rows [y0, y1) of the block; the row above y0 is read again so
+// blocks need nothing from each other
+void filter_block(DeflateBlock& block, const RowReader& read_row, std::size_t row_bytes,
+                  std::size_t bpp, RowFilter filter) {
+  // 16-bit rows are written as uint16_t, so back the rows with that type
+  const std::size_t words = (row_bytes + 1) / 2;
+  std::vector<std::uint16_t> prev_storage(words, 0);
+  std::vector<std::uint16_t> row_storage(words);
+  auto* prev = reinterpret_cast<std::uint8_t*>(prev_storage.data());
+  auto* row = reinterpret_cast<std::uint8_t*>(row_storage.data());
+  if (block.y0 > 0) {
+    read_row(block.y0 - 1, prev);
+  }
+
+  std::vector<std::uint8_t> candidate;
+  if (filter == RowFilter::Adaptive) {
+    candidate.resize(row_bytes + 1);
+  }
+  block.filtered.resize(static_cast<std::size_t>(block.y1 - block.y0) * (row_bytes + 1));
+  std::uint8_t* out = block.filtered.data();
+  for (int y = block.y0; y < block.y1; ++y, out += row_bytes + 1) {
+    read_row(y, row);
+    if (filter != RowFilter::Adaptive) {
+      apply_filter(filter, row, prev, row_bytes, bpp, out);
+    } else {
+      std::size_t best = SIZE_MAX;
+      for (RowFilter type : {RowFilter::None, RowFilter::Sub, RowFilter::Up, RowFilter::Average,
+                             RowFilter::Paeth}) {
+        apply_filter(type, row, prev, row_bytes, bpp, candidate.data());
+        const std::size_t sum = residual_sum(candidate.data() + 1, row_bytes);
+        if (sum < best) {
+          best = sum;
+          std::memcpy(out, candidate.data(), row_bytes + 1);
+        }
+      }
+    }
+    std::swap(prev, row);
+  }
+  block.adler = adler32(1L, block.filtered.data(), static_cast<uInt>(block.filtered.size()));
+}
+
+class Deflater {
+ public:
+  Deflater(int level, int strategy) {
+    if (deflateInit2(&stream_, level, Z_DEFLATED, -kWindowBits, 8, strategy) != Z_OK) {
+      throw std::runtime_error("out of memory creating the PNG encoder");
+    }
+  }
+  ~Deflater() { deflateEnd(&stream_); }
+
+  Deflater(const Deflater&) = delete;
+  Deflater& operator=(const Deflater&) = delete;
+
+  z_stream& stream() { return stream_; }
+
+ private:
+  z_stream stream_{};
+};
+
+// Compresses the block as raw deflate data primed with the dictionary.
+// Every block but the last ends in a sync flush, which byte-aligns it
+// without marking it final, so the blocks concatenate into one stream.
+void deflate_block(DeflateBlock& block, const std::uint8_t* dictionary,
+                   std::size_t dictionary_size, int level, int strategy, bool last) {
+  Deflater deflater(level, strategy);
+  z_stream& stream = deflater.stream();
+  if (dictionary_size > 0) {
+    deflateSetDictionary(&stream, dictionary, static_cast<uInt>(dictionary_size));
+  }
+
+  stream.next_in = block.filtered.data();
+  stream.avail_in = static_cast<uInt>(block.filtered.size());
+  block.compressed.resize(deflateBound(&stream, stream.avail_in) + 16);
+  const int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+  std::size_t written = 0;
+  for (;;) {
+    stream.next_out = block.compressed.data() + written;
+    stream.avail_out = static_cast<uInt>(block.compressed.size() - written);
+    const int result = deflate(&stream, flush);
+    written = block.compressed.size() - stream.avail_out;
+    if (result == Z_STREAM_END || (result == Z_OK && !last && stream.avail_out > 0)) {
       break;
+    }
+    if (result != Z_OK && result != Z_BUF_ERROR) {
+      throw std::runtime_error("PNG compression failed");
+    }
+    block.compressed.resize(block.compressed.size() * 2);
   }
-  throw std::runtime_error("unsupported pixel format for PNG");
+  block.compressed.resize(written);
 }
 
+// zlib stream header for a 32 KB window, FLEVEL set from the level
+std::array<std::uint8_t, 2> zlib_header(int level) {
+  const unsigned cmf = 0x78;
+  const unsigned flevel = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+  unsigned flg = flevel << 6;
+  flg += (31 - ((cmf << 8) | flg) % 31) % 31;
+  return {static_cast<std::uint8_t>(cmf), static_cast<std::uint8_t>(flg)};
+}
 }  // namespace
 
 std::string PNGFormat::name() const {
@@ -40,57 +672,208 @@ bool PNGFormat::can_read(const std::string& path) const {
   return file_extension(path) == "png";
 }
 
+bool PNGFormat::can_read_signature(const std::uint8_t* header, std::size_t size) const {
+  return size >= 8 && png_sig_cmp(header, 0, 8) == 0;
+}
+
+ImageInfo PNGFormat::probe(const std::string& path) const {
+  PNGReader reader(path);
+  PNGHeader header;
+  if (!read_header(reader, header)) {
+    reader.fail();
+  }
+  ImageInfo info;
+  info.format = name();
+  info.size = ps::core::Size{static_cast<int>(header.width), static_cast<int>(header.height)};
+  info.mode = color_mode(header);
+  info.bit_depth = header.file_bit_depth;
+  info.channel_count = header.samples;
+  return info;
+}
+
+ps::core::ImageDocument PNGFormat::load_thumbnail(const std::string& path, int max_edge) const {
+  PNGReader reader(path);
+  PNGHeader header;
+  if (!read_header(reader, header)) {
+    reader.fail();
+  }
+  const ps::core::Size size{static_cast<int>(header.width), static_cast<int>(header.height)};
+  const ps::core::Size reduced = thumbnail_size(size, max_edge);
+
+  // The first Adam7 pass is used when it is at least as large as the result
+  const ps::core::Size first_pass{(size.width + 7) / 8, (size.height + 7) / 8};
+  const bool use_first_pass = header.passes > 1 && reduced.width <= first_pass.width &&
+                              reduced.height <= first_pass.height;
+  if (header.passes > 1 && !use_first_pass) {
+    return ImageFormat::load_thumbnail(path, max_edge);
+  }
+
+  ps::core::ImageDocument thumbnail(reduced, color_mode(header));
+  add_channels(thumbnail, header, ps::core::StorageLayout::Contiguous,
+               ps::core::BufferInit::Zero);
+  ThumbnailBuilder builder(use_first_pass ? first_pass : size, thumbnail);
+  with_sample_count(header.samples, [&](auto samples) {
+    if (header.bit_depth == 16) {
+      reduce_rows<std::uint16_t, decltype(samples)::value>(reader, header, use_first_pass,
+                                                           builder);
+    } else {
+      reduce_rows<std::uint8_t, decltype(samples)::value>(reader, header, use_first_pass,
+                                                          builder);
+    }
+  });
+  // The rest of an interlaced file is never read
+  if (!use_first_pass && !read_end(reader)) {
+    reader.fail();
+  }
+  return thumbnail;
+}
+
 bool PNGFormat::can_write(const std::string& path,
                           const ps::core::ImageDocument& document) const {
   if (file_extension(path) != "png") {
     return false;
   }
-  if (document.channels().empty()) {
-    return false;
+  PNGLayout layout;
+  return png_layout(document, layout);
+}
+
+ps::core::ImageDocument PNGFormat::load(const std::string& path,
+                                        const LoadOptions& options) const {
+  PNGReader reader(path);
+  PNGHeader header;
+  if (!read_header(reader, header)) {
+    reader.fail();
   }
-  const auto format = document.channels().front().buffer.format();
-  return format == ps::core::PixelFormat::Gray8 || format == ps::core::PixelFormat::RGB8 ||
-         format == ps::core::PixelFormat::RGBA8;
+
+  const ps::core::Size size{static_cast<int>(header.width), static_cast<int>(header.height)};
+  const ps::core::PixelFormat format =
+      header.bit_depth == 16 ? ps::core::PixelFormat::Gray16 : ps::core::PixelFormat::Gray8;
+
+  // The channels exist before the first row is decoded, so progress
+  // callbacks can show the document as it fills in. Every pixel is
+  // decoded, so contiguous storage starts uninitialized.
+  ps::core::ImageDocument document(size, color_mode(header));
+  document.set_storage_layout(options.layout);
+  add_channels(document, header, options.layout, ps::core::BufferInit::Uninitialized);
+
+  ps::core::dispatch_format(format, [&](auto tag) {
+    with_sample_count(header.samples, [&](auto samples) {
+      decode_rows<decltype(tag)::value, decltype(samples)::value>(reader, header, document,
+                                                                  options.progress);
+    });
+  });
+  if (!read_end(reader)) {
+    reader.fail();
+  }
+  return document;
 }
 
-ps::core::ImageDocument PNGFormat::load(const std::string& path) const {
-  png_image image;
-  std::memset(&image, 0, sizeof(image));
-  image.version = PNG_IMAGE_VERSION;
 
-  if (!png_image_begin_read_from_file(&image, path.c_str())) {
-    throw std::runtime_error(image.message);
+void PNGFormat::save(const std::string& path, const ps::core::ImageDocument& document,
+                     const SaveOptions& options) const {
+  if (options.compression_level < 0 || options.compression_level > 9) {
+    throw std::invalid_argument("PNG compression level must be between 0 and 9");
+  }
+  PNGLayout layout;
+  if (!png_layout(document, layout)) {
+    throw std::runtime_error("document has no channels that can be saved as PNG");
   }
 
-  image.format = PNG_FORMAT_RGBA;
-  std::vector<png_byte> buffer(PNG_IMAGE_SIZE(image));
+  const ps::core::Size size = document.size();
+  const RowReader read_row = row_reader(layout);
+  const std::size_t samples =
+      layout.interleaved ? ps::core::bytes_per_pixel(layout.interleaved->format())
+                         : layout.planes.size();
+  const std::size_t bpp = samples * static_cast<std::size_t>(layout.bit_depth / 8);
+  const std::size_t row_bytes = static_cast<std::size_t>(size.width) * bpp;
 
-  if (!png_image_finish_read(&image, nullptr, buffer.data(), 0, nullptr)) {
-    const std::string message = image.message;
-    png_image_free(&image);
-    throw std::runtime_error(message);
+  PNGWriter writer(path);
+  static const std::uint8_t kSignature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  writer.write(kSignature, sizeof(kSignature));
+  std::uint8_t ihdr[13] = {};
+  for (int i = 0; i < 4; ++i) {
+    ihdr[i] = static_cast<std::uint8_t>(static_cast<std::uint32_t>(size.width) >> (24 - 8 * i));
+    ihdr[4 + i] =
+        static_cast<std::uint8_t>(static_cast<std::uint32_t>(size.height) >> (24 - 8 * i));
   }
+  ihdr[8] = static_cast<std::uint8_t>(layout.bit_depth);
+  ihdr[9] = static_cast<std::uint8_t>(layout.color_type);
+  writer.write_chunk("IHDR", ihdr, sizeof(ihdr));
 
-  ps::core::ImageDocument document({static_cast<int>(image.width),
-                                    static_cast<int>(image.height)},
-                                   ps::core::ColorMode::RGB);
-  auto& channel = document.add_channel("Composite", ps::core::PixelFormat::RGBA8);
-  std::memcpy(channel.buffer.data(), buffer.data(), buffer.size());
-  return document;
-}
+  // Block boundaries depend only on the row size, so the file is the same
+  // for any thread count. Blocks are processed a batch at a time to bound
+  // memory; each batch is filtered, then deflated, across the ThreadPool.
+  const int level = options.compression_level;
+  const int strategy = options.filter == RowFilter::None ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+  const int rows_per_block =
+      static_cast<int>(std::max<std::size_t>(1, kBlockBytes / (row_bytes + 1)));
+  ps::core::ThreadPool& pool = ps::core::ThreadPool::instance();
+  const std::size_t batch_size = std::max<std::size_t>(2, 2 * pool.thread_count());
 
-void PNGFormat::save(const std::string& path, const ps::core::ImageDocument& document) const {
-  const auto& buffer = primary_buffer(document);
-  png_image image;
-  std::memset(&image, 0, sizeof(image));
-  image.version = PNG_IMAGE_VERSION;
-  image.width = static_cast<png_uint_32>(buffer.size().width);
-  image.height = static_cast<png_uint_32>(buffer.size().height);
-  image.format = pixel_format_for_buffer(buffer.format());
+  const std::array<std::uint8_t, 2> header = zlib_header(level);
+  std::vector<DeflateBlock> batch;
+  std::vector<std::uint8_t> window;  // Tail of the previous batch's last block
+  uLong adler = adler32(0L, nullptr, 0);
+  for (int y = 0; y < size.height;) {
+    const int batch_start = y;
+    batch.clear();
+    while (batch.size() < batch_size && y < size.height) {
+      DeflateBlock& block = batch.emplace_back();
+      block.y0 = y;
+      block.y1 = std::min(size.height, y + rows_per_block);
+      y = block.y1;
+    }
+    const int count = static_cast<int>(batch.size());
+    const bool last_batch = y == size.height;
 
-  if (!png_image_write_to_file(&image, path.c_str(), 0, buffer.data(), 0, nullptr)) {
-    throw std::runtime_error(image.message);
+    pool.parallel_for(0, count, 1, [&](int b0, int b1) {
+      for (int b = b0; b < b1; ++b) {
+        filter_block(batch[b], read_row, row_bytes, bpp, options.filter);
+      }
+    });
+    pool.parallel_for(0, count, 1, [&](int b0, int b1) {
+      for (int b = b0; b < b1; ++b) {
+        const std::vector<std::uint8_t>& before = b == 0 ? window : batch[b - 1].filtered;
+        const std::size_t dictionary = std::min(kWindowSize, before.size());
+        deflate_block(batch[b], before.data() + before.size() - dictionary, dictionary, level,
+                      strategy, last_batch && b + 1 == count);
+      }
+    });
+
+    // One IDAT chunk per block, the zlib header in the first and the
+    // combined Adler-32 after the last
+    for (int b = 0; b < count; ++b) {
+      const DeflateBlock& block = batch[b];
+      adler = adler32_combine(adler, block.adler, static_cast<z_off_t>(block.filtered.size()));
+      const bool first = batch_start == 0 && b == 0;
+      const bool last = last_batch && b + 1 == count;
+      std::uint8_t trailer[4] = {};
+      for (int i = 0; i < 4; ++i) {
+        trailer[i] = static_cast<std::uint8_t>(adler >> (24 - 8 * i));
+      }
+      writer.begin_chunk("IDAT", (first ? header.size() : 0) + block.compressed.size() +
+                                     (last ? sizeof(trailer) : 0));
+      if (first) {
+        writer.chunk_data(header.data(), header.size());
+      }
+      writer.chunk_data(block.compressed.data(), block.compressed.size());
+      if (last) {
+        writer.chunk_data(trailer, sizeof(trailer));
+      }
+      writer.end_chunk();
+    }
+
+    const std::vector<std::uint8_t>& tail = batch.back().filtered;
+    const std::size_t keep = std::min(kWindowSize, tail.size());
+    window.assign(tail.end() - static_cast<std::ptrdiff_t>(keep), tail.end());
+
+    if (options.progress) {
+      options.progress(ps::core::Rect{0, batch_start, size.width, y - batch_start});
+    }
   }
+
+  writer.write_chunk("IEND", nullptr, 0);
+  writer.finish();
 }
 
 }  // namespace ps::io
@@ -0,0 +1,1584 @@
+#include "ps/io/tiff_format.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include <zlib.h>
+
+#include "ps/core/image_view.h"
+#include "ps/core/packbits.h"
+#include "ps/core/thread_pool.h"
+
+namespace ps::io {
+namespace {
+
+// Tags read or written
+constexpr std::uint16_t kNewSubfileType = 254;
+constexpr std::uint16_t kImageWidth = 256;
+constexpr std::uint16_t kImageLength = 257;
+constexpr std::uint16_t kBitsPerSample = 258;
+constexpr std::uint16_t kCompressionTag = 259;
+constexpr std::uint16_t kPhotometricTag = 262;
+constexpr std::uint16_t kFillOrder = 266;
+constexpr std::uint16_t kStripOffsets = 273;
+constexpr std::uint16_t kSamplesPerPixel = 277;
+constexpr std::uint16_t kRowsPerStrip = 278;
+constexpr std::uint16_t kStripByteCounts = 279;
+constexpr std::uint16_t kXResolution = 282;
+constexpr std::uint16_t kYResolution = 283;
+constexpr std::uint16_t kPlanarConfiguration = 284;
+constexpr std::uint16_t kResolutionUnit = 296;
+constexpr std::uint16_t kPredictor = 317;
+constexpr std::uint16_t kColorMap = 320;
+constexpr std::uint16_t kTileWidth = 322;
+constexpr std::uint16_t kTileLength = 323;
+constexpr std::uint16_t kTileOffsets = 324;
+constexpr std::uint16_t kTileByteCounts = 325;
+constexpr std::uint16_t kInkSet = 332;
+constexpr std::uint16_t kExtraSamples = 338;
+constexpr std::uint16_t kSampleFormat = 339;
+
+// Field types
+constexpr std::uint16_t kByte = 1;
+constexpr std::uint16_t kShort = 3;
+constexpr std::uint16_t kLong = 4;
+constexpr std::uint16_t kRational = 5;
+constexpr std::uint16_t kUndefined = 7;
+constexpr std::uint16_t kLong8 = 16;
+constexpr std::uint16_t kIFD8 = 18;
+
+// PhotometricInterpretation values
+constexpr std::uint16_t kWhiteIsZero = 0;
+constexpr std::uint16_t kBlackIsZero = 1;
+constexpr std::uint16_t kRGB = 2;
+constexpr std::uint16_t kPalette = 3;
+constexpr std::uint16_t kSeparated = 5;
+
+// Deflate as first registered by Adobe; readers accept both codes
+constexpr std::uint16_t kOldDeflate = 32946;
+
+/// Decoded bytes held in memory per batch of strips or tiles
+constexpr std::size_t kBatchBytes = std::size_t{16} << 20;
+/// Size of written strips, and of the pieces uncompressed strips are read in
+constexpr std::size_t kStripBytes = 256 * 1024;
+/// Directories followed when looking for a reduced-resolution image
+constexpr std::size_t kMaxDirectories = 64;
+
+bool is_little_endian() {
+  const std::uint16_t probe = 1;
+  std::uint8_t first = 0;
+  std::memcpy(&first, &probe, 1);
+  return first == 1;
+}
+
+std::size_t type_size(std::uint16_t type) {
+  switch (type) {
+    case 1:  // BYTE
+    case 2:  // ASCII
+    case 6:  // SBYTE
+    case 7:  // UNDEFINED
+      return 1;
+    case 3:  // SHORT
+    case 8:  // SSHORT
+      return 2;
+    case 4:   // LONG
+    case 9:   // SLONG
+    case 11:  // FLOAT
+    case 13:  // IFD
+      return 4;
+    case 5:   // RATIONAL
+    case 10:  // SRATIONAL
+    case 12:  // DOUBLE
+    case 16:  // LONG8
+    case 17:  // SLONG8
+    case 18:  // IFD8
+      return 8;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * @brief A whole file mapped read-only
+ */
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      throw std::runtime_error("cannot open " + path);
+    }
+    struct stat info {};
+    if (::fstat(fd, &info) != 0) {
+      ::close(fd);
+      throw std::runtime_error("cannot open " + path);
+    }
+    size_ = static_cast<std::size_t>(info.st_size);
+    if (size_ > 0) {
+      void* map = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED) {
+        ::close(fd);
+        throw std::runtime_error("cannot map " + path);
+      }
+      data_ = static_cast<const std::uint8_t*>(map);
+    }
+    // The mapping stays valid without the descriptor
+    ::close(fd);
+  }
+
+  ~MappedFile() {
+    if (data_) {
+      ::munmap(const_cast<std::uint8_t*>(data_), size_);
+    }
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const std::uint8_t* data() const { return data_; }
+  std::size_t size() const { return size_; }
+
+ private:
+  const std::uint8_t* data_ = nullptr;
+  std::size_t size_ = 0;
+};
+
+/**
+ * @brief Where a tag's values are stored
+ */
+struct TIFFEntry {
+  std::uint16_t type = 0;
+  std::uint64_t count = 0;
+  std::uint64_t offset = 0;  ///< File offset of the first value
+};
+
+/**
+ * @brief Reads a mapped TIFF in its byte order, treating anything outside
+ *        the file as corruption
+ */
+class TIFFReader {
+ public:
+  TIFFReader(const MappedFile& file, const std::string& path) : file_(file), path_(path) {
+    if (file.size() < 8) {
+      fail();
+    }
+    const std::uint8_t* data = file.data();
+    if (data[0] == 'I' && data[1] == 'I') {
+      little_endian_ = true;
+    } else if (data[0] != 'M' || data[1] != 'M') {
+      throw std::runtime_error(path + " is not a TIFF file");
+    }
+    const std::uint16_t version = u16(2);
+    if (version == 43 && u16(4) == 8 && u16(6) == 0) {
+      big_ = true;
+      first_ifd_ = u64(8);
+    } else if (version == 42) {
+      first_ifd_ = u32(4);
+    } else {
+      throw std::runtime_error(path + " is not a TIFF file");
+    }
+  }
+
+  [[noreturn]] void fail() const { throw std::runtime_error("corrupt TIFF file " + path_); }
+
+  bool little_endian() const { return little_endian_; }
+
+  const std::uint8_t* bytes(std::uint64_t offset, std::uint64_t size) const {
+    if (offset > file_.size() || size > file_.size() - offset) {
+      fail();
+    }
+    return file_.data() + offset;
+  }
+
+  std::uint16_t u16(std::uint64_t offset) const { return static_cast<std::uint16_t>(load(offset, 2)); }
+  std::uint32_t u32(std::uint64_t offset) const { return static_cast<std::uint32_t>(load(offset, 4)); }
+  std::uint64_t u64(std::uint64_t offset) const { return load(offset, 8); }
+
+  /// Offset of the first image's directory
+  std::uint64_t first_directory() const { return first_ifd_; }
+
+  /**
+   * @brief Reads the tags of the directory at @p offset
+   * @param next Set to the offset of the next directory, 0 after the last
+   */
+  std::map<std::uint16_t, TIFFEntry> directory(std::uint64_t offset, std::uint64_t& next) const {
+    const std::uint64_t count = big_ ? u64(offset) : u16(offset);
+    const std::uint64_t entry_size = big_ ? 20 : 12;
+    const std::uint64_t first_entry = offset + (big_ ? 8 : 2);
+    if (count > file_.size() / entry_size) {
+      fail();
+    }
+    bytes(first_entry, count * entry_size);
+    const std::uint64_t link = first_entry + count * entry_size;
+    next = big_ ? u64(link) : u32(link);
+
+    std::map<std::uint16_t, TIFFEntry> entries;
+    for (std::uint64_t i = 0; i < count; ++i) {
+      const std::uint64_t at = first_entry + i * entry_size;
+      TIFFEntry entry;
+      entry.type = u16(at + 2);
+      entry.count = big_ ? u64(at + 4) : u32(at + 4);
+      const std::uint64_t value_at = at + (big_ ? 12 : 8);
+      const std::size_t size = type_size(entry.type);
+      if (size == 0) {
+        continue;  // Unknown types are skipped, as the spec asks
+      }
+      if (entry.count > file_.size() / size + 1) {
+        fail();
+      }
+      const bool inline_value = entry.count * size <= (big_ ? 8u : 4u);
+      entry.offset = inline_value ? value_at : (big_ ? u64(value_at) : u32(value_at));
+      bytes(entry.offset, entry.count * size);
+      entries.emplace(u16(at), entry);
+    }
+    return entries;
+  }
+
+  /**
+   * @brief Returns the values of an integer field
+   */
+  std::vector<std::uint64_t> values(const TIFFEntry& entry) const {
+    std::vector<std::uint64_t> result(static_cast<std::size_t>(entry.count));
+    const std::size_t size = type_size(entry.type);
+    if (entry.type != kByte && entry.type != kUndefined && entry.type != kShort &&
+        entry.type != kLong && entry.type != kLong8 && entry.type != kIFD8 &&
+        entry.type != 13) {
+      fail();
+    }
+    for (std::size_t i = 0; i < result.size(); ++i) {
+      result[i] = load(entry.offset + i * size, size);
+    }
+    return result;
+  }
+
+ private:
+  std::uint64_t load(std::uint64_t offset, std::size_t size) const {
+    const std::uint8_t* p = bytes(offset, size);
+    std::uint64_t value = 0;
+    for (std::size_t i = 0; i < size; ++i) {
+      const std::size_t shift = little_endian_ ? 8 * i : 8 * (size - 1 - i);
+      value |= static_cast<std::uint64_t>(p[i]) << shift;
+    }
+    return value;
+  }
+
+  const MappedFile& file_;
+  const std::string& path_;
+  bool little_endian_ = false;
+  bool big_ = false;
+  std::uint64_t first_ifd_ = 0;
+};
+
+/**
+ * @brief An image of a file, validated for decoding
+ */
+struct TIFFImage {
+  bool reduced = false;          ///< NewSubfileType bit 0: a reduced copy of another image
+  int width = 0;
+  int height = 0;
+  int bits = 1;
+  int samples = 1;               ///< Samples per pixel in the file
+  int color_samples = 1;         ///< Samples that are not extra samples
+  std::uint16_t compression = 1;
+  std::uint16_t photometric = kBlackIsZero;
+  bool planar = false;           ///< PlanarConfiguration 2: one plane per chunk
+  bool predictor = false;        ///< Horizontal differencing
+  bool lsb_first = false;        ///< FillOrder 2, for 1-bit images
+  bool tiled = false;
+  int chunk_width = 0;           ///< Tile width, or the image width for strips
+  int chunk_height = 0;          ///< Tile length, or rows per strip
+  int across = 1;                ///< Chunks per row of chunks
+  int down = 1;                  ///< Rows of chunks per plane
+  std::vector<std::uint64_t> offsets;
+  std::vector<std::uint64_t> byte_counts;
+  std::vector<std::uint16_t> color_map;  ///< 3 × 256 entries for palettes
+
+  int chunk_samples() const { return planar ? 1 : samples; }
+  /// Samples per pixel after decoding; palettes expand to RGB
+  int decoded_samples() const { return photometric == kPalette ? 3 : chunk_samples(); }
+  std::size_t row_bytes() const {
+    return (static_cast<std::size_t>(chunk_width) * chunk_samples() * bits + 7) / 8;
+  }
+  /// Rows stored in chunk row r; strips at the bottom can be shorter
+  int chunk_rows(int r) const {
+    return tiled ? chunk_height : std::min(chunk_height, height - r * chunk_height);
+  }
+};
+
+TIFFImage read_image(const TIFFReader& reader, const std::map<std::uint16_t, TIFFEntry>& tags) {
+  const auto values = [&](std::uint16_t tag) {
+    const auto found = tags.find(tag);
+    return found == tags.end() ? std::vector<std::uint64_t>{} : reader.values(found->second);
+  };
+  const auto value = [&](std::uint16_t tag, std::uint64_t fallback) {
+    const std::vector<std::uint64_t> found = values(tag);
+    return found.empty() ? fallback : found.front();
+  };
+  const auto unsupported = [](const std::string& what) {
+    throw std::runtime_error("unsupported TIFF " + what);
+  };
+
+  TIFFImage image;
+  image.reduced = (value(kNewSubfileType, 0) & 1) != 0;
+  const std::uint64_t width = value(kImageWidth, 0);
+  const std::uint64_t height = value(kImageLength, 0);
+  const int int_max = std::numeric_limits<int>::max();
+  if (width == 0 || height == 0 || width > static_cast<std::uint64_t>(int_max) ||
+      height > static_cast<std::uint64_t>(int_max)) {
+    reader.fail();
+  }
+  image.width = static_cast<int>(width);
+  image.height = static_cast<int>(height);
+
+  image.samples = static_cast<int>(value(kSamplesPerPixel, 1));
+  if (image.samples < 1 || image.samples > 64) {
+    reader.fail();
+  }
+  const std::vector<std::uint64_t> bits = values(kBitsPerSample);
+  image.bits = bits.empty() ? 1 : static_cast<int>(bits.front());
+  for (std::uint64_t b : bits) {
+    if (b != bits.front()) {
+      unsupported("mixed sample depths");
+    }
+  }
+  if (image.bits != 1 && image.bits != 8 && image.bits != 16) {
+    unsupported("bit depth " + std::to_string(image.bits));
+  }
+  for (std::uint64_t format : values(kSampleFormat)) {
+    if (format != 1) {
+      unsupported("sample format");
+    }
+  }
+
+  image.compression = static_cast<std::uint16_t>(value(kCompressionTag, 1));
+  if (image.compression == kOldDeflate) {
+    image.compression = static_cast<std::uint16_t>(TIFFCompression::Deflate);
+  }
+  if (image.compression != static_cast<std::uint16_t>(TIFFCompression::None) &&
+      image.compression != static_cast<std::uint16_t>(TIFFCompression::LZW) &&
+      image.compression != static_cast<std::uint16_t>(TIFFCompression::Deflate) &&
+      image.compression != static_cast<std::uint16_t>(TIFFCompression::PackBits)) {
+    unsupported("compression " + std::to_string(image.compression));
+  }
+
+  image.photometric = static_cast<std::uint16_t>(value(kPhotometricTag, kBlackIsZero));
+  switch (image.photometric) {
+    case kWhiteIsZero:
+    case kBlackIsZero:
+      image.color_samples = 1;
+      break;
+    case kRGB:
+      image.color_samples = 3;
+      break;
+    case kSeparated:
+      if (value(kInkSet, 1) != 1) {
+        unsupported("ink set");
+      }
+      image.color_samples = 4;
+      break;
+    case kPalette: {
+      image.color_samples = 1;
+      const std::vector<std::uint64_t> map = values(kColorMap);
+      if (image.bits != 8 || image.samples != 1 || map.size() != 3 * 256) {
+        unsupported("palette");
+      }
+      image.color_map.assign(map.begin(), map.end());
+      break;
+    }
+    default:
+      unsupported("photometric interpretation " + std::to_string(image.photometric));
+  }
+  if (image.samples < image.color_samples) {
+    reader.fail();
+  }
+  if (image.bits == 1 && image.samples != 1) {
+    unsupported("bilevel samples");
+  }
+
+  image.planar = value(kPlanarConfiguration, 1) == 2 && image.samples > 1;
+  const std::uint64_t predictor = value(kPredictor, 1);
+  if (predictor == 2 && image.bits >= 8) {
+    image.predictor = true;
+  } else if (predictor != 1) {
+    unsupported("predictor");
+  }
+  image.lsb_first = value(kFillOrder, 1) == 2;
+
+  image.tiled = tags.count(kTileOffsets) > 0;
+  if (image.tiled) {
+    const std::uint64_t tile_width = value(kTileWidth, 0);
+    const std::uint64_t tile_length = value(kTileLength, 0);
+    if (tile_width == 0 || tile_length == 0 || tile_width > 65536 || tile_length > 65536) {
+      reader.fail();
+    }
+    image.chunk_width = static_cast<int>(tile_width);
+    image.chunk_height = static_cast<int>(tile_length);
+    image.offsets = values(kTileOffsets);
+    image.byte_counts = values(kTileByteCounts);
+  } else {
+    image.chunk_width = image.width;
+    image.chunk_height = static_cast<int>(
+        std::min<std::uint64_t>(value(kRowsPerStrip, height), height));
+    if (image.chunk_height == 0) {
+      image.chunk_height = image.height;
+    }
+    image.offsets = values(kStripOffsets);
+    image.byte_counts = values(kStripByteCounts);
+  }
+  image.across = (image.width + image.chunk_width - 1) / image.chunk_width;
+  image.down = static_cast<int>((height + image.chunk_height - 1) / image.chunk_height);
+
+  const std::size_t planes = image.planar ? static_cast<std::size_t>(image.samples) : 1;
+  const std::size_t chunks = planes * image.across * image.down;
+  if (image.offsets.size() < chunks) {
+    reader.fail();
+  }
+  if (image.byte_counts.size() < chunks) {
+    // Old writers leave out the byte counts of uncompressed files; they are
+    // filled in below
+    if (image.compression != static_cast<std::uint16_t>(TIFFCompression::None)) {
+      reader.fail();
+    }
+    image.byte_counts.assign(chunks, 0);
+  }
+
+  // Check every chunk is in the file and could decode to its size before
+  // the document is allocated, so a damaged size cannot claim gigabytes
+  std::uint64_t max_ratio = 1;
+  switch (static_cast<TIFFCompression>(image.compression)) {
+    case TIFFCompression::None:
+      break;
+    case TIFFCompression::PackBits:
+      max_ratio = 64;  // 2 bytes repeat one byte 128 times
+      break;
+    case TIFFCompression::LZW:
+      max_ratio = 2731;  // 12 bits for a string of up to 4094 bytes
+      break;
+    case TIFFCompression::Deflate:
+      max_ratio = 1032;
+      break;
+  }
+  for (std::size_t c = 0; c < chunks; ++c) {
+    const int row = static_cast<int>(c % (static_cast<std::size_t>(image.across) * image.down)) /
+                    image.across;
+    const std::uint64_t expected = image.row_bytes() * image.chunk_rows(row);
+    if (image.byte_counts[c] == 0 && max_ratio == 1) {
+      image.byte_counts[c] = expected;
+    }
+    reader.bytes(image.offsets[c], image.byte_counts[c]);
+    if ((image.byte_counts[c] + 1) * max_ratio < expected) {
+      reader.fail();
+    }
+  }
+  return image;
+}
+
+// Inflates a zlib stream; trailing data after the expected bytes is ignored
+bool inflate_chunk(const std::uint8_t* src, std::size_t size, std::uint8_t* dst,
+                   std::size_t expected) {
+  z_stream stream{};
+  if (inflateInit(&stream) != Z_OK) {
+    throw std::runtime_error("out of memory creating the TIFF decoder");
+  }
+  stream.next_in = const_cast<Bytef*>(src);
+  stream.avail_in = static_cast<uInt>(size);
+  stream.next_out = dst;
+  stream.avail_out = static_cast<uInt>(expected);
+  int result = Z_OK;
+  while (result == Z_OK && stream.avail_out > 0) {
+    result = inflate(&stream, Z_NO_FLUSH);
+  }
+  const bool complete = stream.avail_out == 0;
+  inflateEnd(&stream);
+  return complete && (result == Z_OK || result == Z_STREAM_END || result == Z_BUF_ERROR);
+}
+
+constexpr int kLZWClear = 256;
+constexpr int kLZWEnd = 257;
+constexpr int kLZWFirst = 258;
+constexpr int kLZWMaxBits = 12;
+constexpr int kLZWTableSize = 1 << kLZWMaxBits;
+
+// TIFF LZW: codes are packed MSB first and widen one code early, when the
+// next free entry reaches 2^bits - 1 (TIFF 6.0, section 13)
+bool lzw_decode(const std::uint8_t* src, std::size_t size, std::uint8_t* dst,
+                std::size_t expected) {
+  // Pre-6.0 files used LSB-first codes, which libtiff detects this way
+  if (size >= 2 && src[0] == 0 && (src[1] & 1) != 0) {
+    throw std::runtime_error("unsupported TIFF old-style LZW");
+  }
+
+  std::uint16_t prefix[kLZWTableSize];
+  std::uint8_t suffix[kLZWTableSize];
+  std::uint8_t first[kLZWTableSize];
+  std::uint16_t length[kLZWTableSize];
+  for (int i = 0; i < 256; ++i) {
+    prefix[i] = 0;
+    suffix[i] = static_cast<std::uint8_t>(i);
+    first[i] = static_cast<std::uint8_t>(i);
+    length[i] = 1;
+  }
+
+  std::size_t in = 0;
+  std::uint32_t bit_buffer = 0;
+  int bit_count = 0;
+  int bits = 9;
+  const auto next_code = [&]() {
+    while (bit_count < bits) {
+      if (in == size) {
+        return kLZWEnd;
+      }
+      bit_buffer = (bit_buffer << 8) | src[in++];
+      bit_count += 8;
+    }
+    bit_count -= bits;
+    const int code = static_cast<int>((bit_buffer >> bit_count) & ((1u << bits) - 1));
+    bit_buffer &= (1u << bit_count) - 1;
+    return code;
+  };
+
+  std::size_t out = 0;
+  int next = kLZWFirst;
+  int previous = -1;
+  while (out < expected) {
+    int code = next_code();
+    if (code == kLZWEnd) {
+      break;
+    }
+    if (code == kLZWClear) {
+      bits = 9;
+      next = kLZWFirst;
+      previous = -1;
+      continue;
+    }
+    if (previous < 0) {
+      // The first code after a clear is a literal
+      if (code > 255) {
+        return false;
+      }
+      dst[out++] = static_cast<std::uint8_t>(code);
+      previous = code;
+      continue;
+    }
+    if (code > next || (code == next && next == kLZWTableSize)) {
+      return false;
+    }
+    if (next < kLZWTableSize) {
+      prefix[next] = static_cast<std::uint16_t>(previous);
+      suffix[next] = code < next ? first[code] : first[previous];
+      first[next] = first[previous];
+      length[next] = static_cast<std::uint16_t>(length[previous] + 1);
+      ++next;
+      if (next >= (1 << bits) - 1 && bits < kLZWMaxBits) {
+        ++bits;
+      }
+    }
+
+    // Strings are stored back to front; keep what fits in the chunk
+    const std::size_t count = length[code];
+    std::size_t at = out + count;
+    for (int c = code;; c = prefix[c]) {
+      --at;
+      if (at < expected) {
+        dst[at] = suffix[c];
+      }
+      if (at == out) {
+        break;
+      }
+    }
+    out += count;
+    previous = code;
+  }
+  return out >= expected;
+}
+
+void lzw_encode(const std::uint8_t* data, std::size_t size, std::vector<std::uint8_t>& out) {
+  std::uint32_t bit_buffer = 0;
+  int bit_count = 0;
+  int bits = 9;
+  const auto put = [&](int code) {
+    bit_buffer = (bit_buffer << bits) | static_cast<std::uint32_t>(code);
+    bit_count += bits;
+    while (bit_count >= 8) {
+      bit_count -= 8;
+      out.push_back(static_cast<std::uint8_t>(bit_buffer >> bit_count));
+    }
+    bit_buffer &= (1u << bit_count) - 1;
+  };
+
+  // The string table is a trie: each code lists its extensions through
+  // first_child/sibling, so a Clear only has to forget the 256 roots
+  std::vector<std::uint16_t> first_child(kLZWTableSize, 0);
+  std::vector<std::uint16_t> sibling(kLZWTableSize, 0);
+  std::vector<std::uint8_t> last_byte(kLZWTableSize, 0);
+  int next = kLZWFirst;
+
+  put(kLZWClear);
+  if (size > 0) {
+    int current = data[0];
+    for (std::size_t i = 1; i < size; ++i) {
+      const std::uint8_t byte = data[i];
+      int child = first_child[current];
+      while (child != 0 && last_byte[child] != byte) {
+        child = sibling[child];
+      }
+      if (child != 0) {
+        current = child;
+        continue;
+      }
+      put(current);
+      last_byte[next] = byte;
+      first_child[next] = 0;
+      sibling[next] = first_child[current];
+      first_child[current] = static_cast<std::uint16_t>(next);
+      ++next;
+      if (next == kLZWTableSize - 2) {
+        put(kLZWClear);
+        std::fill(first_child.begin(), first_child.begin() + 256, 0);
+        bits = 9;
+        next = kLZWFirst;
+      } else if (next >= (1 << bits)) {
+        ++bits;
+      }
+      current = byte;
+    }
+    put(current);
+    // The decoder adds an entry for this code too, and may widen for it
+    ++next;
+    if (next == kLZWTableSize - 2) {
+      put(kLZWClear);
+      bits = 9;
+    } else if (next >= (1 << bits)) {
+      ++bits;
+    }
+  }
+  put(kLZWEnd);
+  if (bit_count > 0) {
+    out.push_back(static_cast<std::uint8_t>(bit_buffer << (8 - bit_count)));
+  }
+}
+
+bool decompress(std::uint16_t compression, const std::uint8_t* src, std::size_t size,
+                std::uint8_t* dst, std::size_t expected) {
+  switch (static_cast<TIFFCompression>(compression)) {
+    case TIFFCompression::None:
+      if (size < expected) {
+        return false;
+      }
+      std::memcpy(dst, src, expected);
+      return true;
+    case TIFFCompression::LZW:
+      return lzw_decode(src, size, dst, expected);
+    case TIFFCompression::Deflate:
+      return inflate_chunk(src, size, dst, expected);
+    case TIFFCompression::PackBits:
+      return ps::core::packbits_decode(src, size, dst, expected) != 0;
+  }
+  return false;
+}
+
+/**
+ * @brief A strip, tile or piece of an uncompressed strip being decoded
+ */
+struct ReadChunk {
+  int plane = 0;  ///< Channel of a planar chunk
+  int x = 0;      ///< Top-left pixel in the image
+  int y = 0;
+  int rows = 0;   ///< Rows stored, including any past the bottom edge
+  std::uint64_t offset = 0;
+  std::uint64_t size = 0;
+  /// Decoded samples, decoded_samples() per pixel. 16-bit samples are
+  /// written as uint16_t, so the storage has that type.
+  std::vector<std::uint16_t> storage;
+};
+
+template <typename Sample>
+void decode_chunk(const TIFFReader& reader, const TIFFImage& image, ReadChunk& chunk) {
+  const std::size_t row_bytes = image.row_bytes();
+  const std::size_t expected = row_bytes * chunk.rows;
+  const std::uint8_t* src = reader.bytes(chunk.offset, chunk.size);
+
+  std::vector<std::uint16_t> raw((expected + 1) / 2);
+  auto* bytes = reinterpret_cast<std::uint8_t*>(raw.data());
+  if (!decompress(image.compression, src, static_cast<std::size_t>(chunk.size), bytes,
+                  expected)) {
+    reader.fail();
+  }
+
+  const std::size_t pixels = static_cast<std::size_t>(image.chunk_width) * chunk.rows;
+  if (image.bits == 1) {
+    // Bilevel rows are padded to whole bytes
+    chunk.storage.assign((pixels + 1) / 2, 0);
+    auto* out = reinterpret_cast<std::uint8_t*>(chunk.storage.data());
+    const std::uint8_t white_bit = image.photometric == kWhiteIsZero ? 0 : 1;
+    for (int r = 0; r < chunk.rows; ++r) {
+      const std::uint8_t* row = bytes + r * row_bytes;
+      for (int x = 0; x < image.chunk_width; ++x) {
+        const int shift = image.lsb_first ? x & 7 : 7 - (x & 7);
+        const std::uint8_t bit = (row[x >> 3] >> shift) & 1;
+        *out++ = bit == white_bit ? 255 : 0;
+      }
+    }
+    return;
+  }
+
+  auto* samples = reinterpret_cast<Sample*>(bytes);
+  const std::size_t count = pixels * image.chunk_samples();
+  if constexpr (sizeof(Sample) == 2) {
+    if (reader.little_endian() != is_little_endian()) {
+      for (std::size_t i = 0; i < count; ++i) {
+        samples[i] = static_cast<Sample>((samples[i] >> 8) | (samples[i] << 8));
+      }
+    }
+  }
+  if (image.predictor) {
+    const std::size_t stride = static_cast<std::size_t>(image.chunk_samples());
+    const std::size_t row_samples = static_cast<std::size_t>(image.chunk_width) * stride;
+    for (int r = 0; r < chunk.rows; ++r) {
+      Sample* row = samples + r * row_samples;
+      for (std::size_t i = stride; i < row_samples; ++i) {
+        row[i] = static_cast<Sample>(row[i] + row[i - stride]);
+      }
+    }
+  }
+  if (image.photometric == kWhiteIsZero) {
+    for (std::size_t i = 0; i < count; ++i) {
+      samples[i] = static_cast<Sample>(~samples[i]);
+    }
+  }
+
+  if (image.photometric == kPalette) {
+    chunk.storage.assign((pixels * 3 + 1) / 2, 0);
+    auto* out = reinterpret_cast<std::uint8_t*>(chunk.storage.data());
+    for (std::size_t i = 0; i < pixels; ++i) {
+      for (int c = 0; c < 3; ++c) {
+        *out++ = static_cast<std::uint8_t>(image.color_map[c * 256 + samples[i]] >> 8);
+      }
+    }
+    return;
+  }
+  chunk.storage = std::move(raw);
+}
+
+// Copies the part of each chunk inside columns [x0, x1) into the channels,
+// whose row 0 is image row y_origin
+template <ps::core::PixelFormat Format>
+void scatter_chunks(const TIFFImage& image, const std::vector<ReadChunk>& chunks, int x0,
+                    int x1, int y_origin, ps::core::ImageDocument& document) {
+  using View = ps::core::MutableImageView<Format>;
+  using Sample = typename View::Sample;
+  const int stride = image.decoded_samples();
+  for (const ReadChunk& chunk : chunks) {
+    const int left = std::max(x0, chunk.x);
+    const int right = std::min({x1, chunk.x + image.chunk_width, image.width});
+    const int rows = std::min(chunk.rows, image.height - chunk.y);
+    if (left >= right) {
+      continue;
+    }
+    const auto* samples = reinterpret_cast<const Sample*>(chunk.storage.data());
+    const int first = image.planar ? chunk.plane : 0;
+    const int last = image.planar ? chunk.plane + 1 : stride;
+    for (int c = first; c < last; ++c) {
+      const int component = image.planar ? 0 : c;
+      View view(document.channels()[c].buffer,
+                ps::core::Rect{left, chunk.y - y_origin, right - left, rows});
+      for (int r = 0; r < rows; ++r) {
+        const Sample* row = samples + (static_cast<std::size_t>(r) * image.chunk_width +
+                                       (left - chunk.x)) * stride + component;
+        view.for_each_span(r, [&](int x, Sample* pixels, int count) {
+          const Sample* src = row + static_cast<std::size_t>(x) * stride;
+          if (stride == 1) {
+            std::memcpy(pixels, src, static_cast<std::size_t>(count) * sizeof(Sample));
+            return;
+          }
+          for (int i = 0; i < count; ++i, src += stride) {
+            pixels[i] = *src;
+          }
+        });
+      }
+    }
+  }
+}
+
+// Splits the image into rows of chunks: a strip, a piece of an
+// uncompressed strip, or a row of tiles, each across every plane
+std::vector<std::vector<ReadChunk>> plan_chunk_rows(const TIFFImage& image) {
+  const int planes = image.planar ? image.samples : 1;
+  const std::size_t per_plane = static_cast<std::size_t>(image.across) * image.down;
+  const std::size_t row_bytes = image.row_bytes();
+  const bool split = !image.tiled &&
+                     image.compression == static_cast<std::uint16_t>(TIFFCompression::None);
+  const int piece_rows =
+      split ? static_cast<int>(std::max<std::size_t>(1, kStripBytes / std::max<std::size_t>(
+                                                                        1, row_bytes)))
+            : image.chunk_height;
+
+  std::vector<std::vector<ReadChunk>> chunk_rows;
+  for (int r = 0; r < image.down; ++r) {
+    const int rows = image.chunk_rows(r);
+    for (int start = 0; start < rows; start += piece_rows) {
+      std::vector<ReadChunk>& row = chunk_rows.emplace_back();
+      for (int p = 0; p < planes; ++p) {
+        for (int a = 0; a < image.across; ++a) {
+          const std::size_t index = p * per_plane + static_cast<std::size_t>(r) * image.across + a;
+          ReadChunk chunk;
+          chunk.plane = p;
+          chunk.x = a * image.chunk_width;
+          chunk.y = r * image.chunk_height + start;
+          chunk.rows = split ? std::min(piece_rows, rows - start) : rows;
+          chunk.offset = image.offsets[index] + (split ? start * row_bytes : 0);
+          chunk.size = split ? chunk.rows * row_bytes : image.byte_counts[index];
+          row.push_back(std::move(chunk));
+        }
+      }
+    }
+  }
+  return chunk_rows;
+}
+
+/**
+ * @brief The rows of chunks of an image, grouped into batches of about
+ *        kBatchBytes of decoded samples
+ */
+struct DecodePlan {
+  std::vector<std::vector<ReadChunk>> chunk_rows;
+  std::size_t rows_per_batch = 1;  ///< Rows of chunks per batch
+  int batch_height = 0;            ///< Most image rows a batch covers
+};
+
+template <typename Sample>
+DecodePlan plan_decode(const TIFFImage& image) {
+  DecodePlan plan;
+  plan.chunk_rows = plan_chunk_rows(image);
+  const std::vector<ReadChunk>& first = plan.chunk_rows.front();
+  const std::size_t row_size = first.size() * image.chunk_width * first.front().rows *
+                               image.decoded_samples() * sizeof(Sample);
+  plan.rows_per_batch = std::max<std::size_t>(1, kBatchBytes / row_size);
+  plan.batch_height = static_cast<int>(std::min<std::uint64_t>(
+      image.height, static_cast<std::uint64_t>(first.front().rows) * plan.rows_per_batch));
+  return plan;
+}
+
+/**
+ * @brief Decodes the image a batch at a time
+ * @param document Receives the pixels: the whole image, or with @p banded
+ *                 only the current batch, starting at its row 0
+ * @param on_batch Called with the image rows [y0, y1) of each batch once
+ *                 they are in @p document
+ */
+template <ps::core::PixelFormat Format>
+void decode_image(const TIFFReader& reader, const TIFFImage& image, DecodePlan& plan,
+                  ps::core::ImageDocument& document, bool banded,
+                  const std::function<void(int y0, int y1)>& on_batch) {
+  using Sample = typename ps::core::FormatTraits<Format>::Sample;
+  const int bands = (image.width + ps::core::ImageBuffer::kTileSize - 1) /
+                    ps::core::ImageBuffer::kTileSize;
+  ps::core::ThreadPool& pool = ps::core::ThreadPool::instance();
+
+  std::vector<ReadChunk> batch;
+  for (std::size_t first = 0; first < plan.chunk_rows.size(); first += plan.rows_per_batch) {
+    const std::size_t last = std::min(plan.chunk_rows.size(), first + plan.rows_per_batch);
+    batch.clear();
+    for (std::size_t r = first; r < last; ++r) {
+      for (ReadChunk& chunk : plan.chunk_rows[r]) {
+        batch.push_back(std::move(chunk));
+      }
+    }
+    const int y0 = batch.front().y;
+    const int y1 = std::min(image.height, batch.back().y + batch.back().rows);
+
+    pool.parallel_for(0, static_cast<int>(batch.size()), 1, [&](int c0, int c1) {
+      for (int c = c0; c < c1; ++c) {
+        decode_chunk<Sample>(reader, image, batch[c]);
+      }
+    });
+    // Bands of whole buffer tiles, so no two tasks write the same tile
+    pool.parallel_for(0, bands, 1, [&](int b0, int b1) {
+      scatter_chunks<Format>(image, batch, b0 * ps::core::ImageBuffer::kTileSize,
+                             std::min(image.width, b1 * ps::core::ImageBuffer::kTileSize),
+                             banded ? y0 : 0, document);
+    });
+    on_batch(y0, y1);
+  }
+}
+
+// Channel names, and the mode, of the document an image loads into
+std::vector<std::string> channel_names(const TIFFImage& image, ps::core::ColorMode& mode) {
+  mode = ps::core::ColorMode::Grayscale;
+  std::vector<std::string> names = {"Gray"};
+  if (image.photometric == kRGB || image.photometric == kPalette) {
+    mode = ps::core::ColorMode::RGB;
+    names = {"Red", "Green", "Blue"};
+  } else if (image.photometric == kSeparated) {
+    mode = ps::core::ColorMode::CMYK;
+    names = {"Cyan", "Magenta", "Yellow", "Black"};
+  }
+  for (int extra = 1; extra <= image.samples - image.color_samples; ++extra) {
+    names.push_back(extra == 1 ? "Alpha" : "Alpha " + std::to_string(extra));
+  }
+  return names;
+}
+
+ps::core::PixelFormat channel_format(const TIFFImage& image) {
+  return image.bits == 16 ? ps::core::PixelFormat::Gray16 : ps::core::PixelFormat::Gray8;
+}
+
+// Decodes a band of rows at a time and feeds it to a thumbnail, so the
+// full-size image is never held
+template <ps::core::PixelFormat Format>
+void reduce_image(const TIFFReader& reader, const TIFFImage& image,
+                  ps::core::ImageDocument& thumbnail) {
+  using Sample = typename ps::core::FormatTraits<Format>::Sample;
+  DecodePlan plan = plan_decode<Sample>(image);
+  const ps::core::Size band_size{image.width, plan.batch_height};
+  ps::core::ImageDocument band(band_size, thumbnail.mode());
+  for (const auto& channel : thumbnail.channels()) {
+    band.add_channel(channel.name, ps::core::ImageBuffer(band_size, Format,
+                                                         ps::core::StorageLayout::Contiguous,
+                                                         ps::core::BufferInit::Uninitialized));
+  }
+
+  ThumbnailBuilder builder(ps::core::Size{image.width, image.height}, thumbnail);
+  const int channel_count = static_cast<int>(band.channels().size());
+  decode_image<Format>(reader, image, plan, band, true, [&](int y0, int y1) {
+    ps::core::ThreadPool::instance().parallel_for(0, channel_count, 1, [&](int c0, int c1) {
+      for (int c = c0; c < c1; ++c) {
+        const ps::core::ImageBuffer& buffer = band.channels()[c].buffer;
+        for (int y = y0; y < y1; ++y) {
+          builder.add_row(c, y, reinterpret_cast<const Sample*>(buffer.pixel_row(0, y - y0)), 1);
+        }
+      }
+    });
+  });
+}
+
+/**
+ * @brief How a document's channels map onto TIFF samples
+ */
+struct TIFFLayout {
+  std::uint16_t photometric = kBlackIsZero;
+  int bits = 8;
+  int samples = 1;
+  int extra_samples = 0;
+  std::vector<const ps::core::ImageBuffer*> planes;  ///< One per sample
+  const ps::core::ImageBuffer* interleaved = nullptr;
+};
+
+bool is_plane(const ps::core::ImageChannel& channel, ps::core::PixelFormat format) {
+  return channel.buffer.format() == format &&
+         (format == ps::core::PixelFormat::Gray8 || format == ps::core::PixelFormat::Gray16);
+}
+
+bool tiff_layout(const ps::core::ImageDocument& document, TIFFLayout& layout) {
+  const auto& channels = document.channels();
+  if (channels.empty()) {
+    return false;
+  }
+  const ps::core::PixelFormat format = channels.front().buffer.format();
+  std::size_t color_planes = 1;
+  layout.photometric = kBlackIsZero;
+  if (document.mode() == ps::core::ColorMode::RGB) {
+    color_planes = 3;
+    layout.photometric = kRGB;
+  } else if (document.mode() == ps::core::ColorMode::CMYK) {
+    color_planes = 4;
+    layout.photometric = kSeparated;
+  }
+
+  std::size_t plane_count = 0;
+  while (plane_count < channels.size() && is_plane(channels[plane_count], format)) {
+    ++plane_count;
+  }
+  if (plane_count >= color_planes) {
+    layout.bits = format == ps::core::PixelFormat::Gray16 ? 16 : 8;
+    layout.samples = static_cast<int>(plane_count);
+    layout.extra_samples = static_cast<int>(plane_count - color_planes);
+    for (std::size_t c = 0; c < plane_count; ++c) {
+      layout.planes.push_back(&channels[c].buffer);
+    }
+    return true;
+  }
+
+  layout.bits = 8;
+  layout.interleaved = &channels.front().buffer;
+  switch (format) {
+    case ps::core::PixelFormat::RGB8:
+      layout.photometric = kRGB;
+      layout.samples = 3;
+      return true;
+    case ps::core::PixelFormat::RGBA8:
+      layout.photometric = kRGB;
+      layout.samples = 4;
+      layout.extra_samples = 1;
+      return true;
+    case ps::core::PixelFormat::CMYK8:
+      layout.photometric = kSeparated;
+      layout.samples = 4;
+      return true;
+    default:
+      return false;
+  }
+}
+
+/// Writes `width` pixels of row y from column x as interleaved samples
+using RegionReader = std::function<void(int x, int y, int width, std::uint8_t* dst)>;
+
+template <ps::core::PixelFormat Format>
+RegionReader plane_region(const TIFFLayout& layout) {
+  using View = ps::core::ImageView<Format>;
+  using Sample = typename View::Traits::Sample;
+  return [planes = layout.planes](int x, int y, int width, std::uint8_t* dst) {
+    // The chunk storage holds Samples (see encode_chunk())
+    auto* samples = reinterpret_cast<Sample*>(dst);
+    const std::size_t stride = planes.size();
+    for (std::size_t c = 0; c < stride; ++c) {
+      View view(*planes[c], ps::core::Rect{x, y, width, 1});
+      view.for_each_span(0, [&](int offset, const Sample* pixels, int count) {
+        Sample* out = samples + static_cast<std::size_t>(offset) * stride + c;
+        for (int i = 0; i < count; ++i, out += stride) {
+          *out = pixels[i];
+        }
+      });
+    }
+  };
+}
+
+RegionReader region_reader(const TIFFLayout& layout) {
+  if (layout.interleaved) {
+    const ps::core::ImageBuffer* buffer = layout.interleaved;
+    const std::size_t bpp = ps::core::bytes_per_pixel(buffer->format());
+    return [buffer, bpp](int x, int y, int width, std::uint8_t* dst) {
+      for (int done = 0; done < width;) {
+        const int count = std::min(width - done, buffer->span_width(x + done));
+        std::memcpy(dst + done * bpp, buffer->pixel_row(x + done, y), count * bpp);
+        done += count;
+      }
+    };
+  }
+  return layout.bits == 16 ? plane_region<ps::core::PixelFormat::Gray16>(layout)
+                           : plane_region<ps::core::PixelFormat::Gray8>(layout);
+}
+
+/**
+ * @brief A strip or tile being encoded
+ */
+struct WriteChunk {
+  int x = 0;
+  int y = 0;
+  int rows = 0;
+  std::vector<std::uint8_t> bytes;  ///< Compressed data
+};
+
+struct ChunkShape {
+  int width = 0;            ///< Pixels per chunk row
+  std::size_t bpp = 0;      ///< Bytes per pixel
+  std::size_t row_bytes = 0;
+};
+
+template <typename Sample>
+void predict_rows(std::uint8_t* data, int rows, const ChunkShape& shape, int samples) {
+  // Rows are backed by uint16_t storage, so 16-bit access is aligned
+  auto* values = reinterpret_cast<Sample*>(data);
+  const std::size_t row_samples = shape.row_bytes / sizeof(Sample);
+  for (int r = 0; r < rows; ++r) {
+    Sample* row = values + r * row_samples;
+    for (std::size_t i = row_samples; i-- > static_cast<std::size_t>(samples);) {
+      row[i] = static_cast<Sample>(row[i] - row[i - samples]);
+    }
+  }
+}
+
+void encode_chunk(WriteChunk& chunk, const RegionReader& read_region, const ChunkShape& shape,
+                  const TIFFLayout& layout, const TIFFWriteOptions& write_options,
+                  int width, int height, int level) {
+  // Tiles past the right or bottom edge are padded with zeros
+  std::vector<std::uint16_t> storage((shape.row_bytes * chunk.rows + 1) / 2, 0);
+  auto* data = reinterpret_cast<std::uint8_t*>(storage.data());
+  const int columns = std::min(shape.width, width - chunk.x);
+  const int rows = std::min(chunk.rows, height - chunk.y);
+  for (int r = 0; r < rows; ++r) {
+    read_region(chunk.x, chunk.y + r, columns, data + r * shape.row_bytes);
+  }
+
+  const TIFFCompression compression = write_options.compression;
+  const std::size_t size = shape.row_bytes * chunk.rows;
+  if (write_options.predictor &&
+      (compression == TIFFCompression::LZW || compression == TIFFCompression::Deflate)) {
+    if (layout.bits == 16) {
+      predict_rows<std::uint16_t>(data, chunk.rows, shape, layout.samples);
+    } else {
+      predict_rows<std::uint8_t>(data, chunk.rows, shape, layout.samples);
+    }
+  }
+
+  switch (compression) {
+    case TIFFCompression::None:
+      chunk.bytes.assign(data, data + size);
+      break;
+    case TIFFCompression::LZW:
+      chunk.bytes.reserve(size / 2);
+      lzw_encode(data, size, chunk.bytes);
+      break;
+    case TIFFCompression::PackBits:
+      // Rows are packed separately, as the spec requires
+      chunk.bytes.reserve(size + size / 128 + chunk.rows);
+      for (int r = 0; r < chunk.rows; ++r) {
+        ps::core::packbits_encode(data + r * shape.row_bytes, shape.row_bytes, chunk.bytes);
+      }
+      break;
+    case TIFFCompression::Deflate: {
+      uLongf length = compressBound(static_cast<uLong>(size));
+      chunk.bytes.resize(length);
+      if (compress2(chunk.bytes.data(), &length, data, static_cast<uLong>(size), level) !=
+          Z_OK) {
+        throw std::runtime_error("TIFF compression failed");
+      }
+      chunk.bytes.resize(length);
+      break;
+    }
+  }
+}
+
+/**
+ * @brief A tag of the directory being written, values in native order
+ */
+struct TIFFField {
+  std::uint16_t tag = 0;
+  std::uint16_t type = 0;
+  std::uint64_t count = 0;
+  std::vector<std::uint8_t> data;
+};
+
+template <typename T>
+TIFFField make_field(std::uint16_t tag, std::uint16_t type, const std::vector<T>& values) {
+  TIFFField field;
+  field.tag = tag;
+  field.type = type;
+  field.count = values.size();
+  field.data.resize(values.size() * sizeof(T));
+  std::memcpy(field.data.data(), values.data(), field.data.size());
+  return field;
+}
+
+/**
+ * @brief Owns the file while a TIFF is written; removes it unless finished
+ */
+class TIFFWriter {
+ public:
+  explicit TIFFWriter(const std::string& path)
+      : path_(path), file_(std::fopen(path.c_str(), "wb")) {
+    if (!file_) {
+      throw std::runtime_error("cannot create " + path);
+    }
+  }
+
+  ~TIFFWriter() {
+    if (file_) {
+      std::fclose(file_);
+    }
+    if (!done_) {
+      std::remove(path_.c_str());
+    }
+  }
+
+  TIFFWriter(const TIFFWriter&) = delete;
+  TIFFWriter& operator=(const TIFFWriter&) = delete;
+
+  std::uint64_t position() const { return position_; }
+
+  void write(const void* data, std::size_t size) {
+    if (size > 0 && std::fwrite(data, 1, size, file_) != size) {
+      throw std::runtime_error("cannot write " + path_);
+    }
+    position_ += size;
+  }
+
+  template <typename T>
+  void write_value(T value) {
+    write(&value, sizeof(value));
+  }
+
+  /// Pads to an even offset, where TIFF wants every value to start
+  void align() {
+    if (position_ % 2 != 0) {
+      write_value<std::uint8_t>(0);
+    }
+  }
+
+  /// Overwrites bytes written earlier
+  void patch(std::uint64_t offset, const void* data, std::size_t size) {
+    if (fseeko(file_, static_cast<off_t>(offset), SEEK_SET) != 0 ||
+        std::fwrite(data, 1, size, file_) != size ||
+        fseeko(file_, static_cast<off_t>(position_), SEEK_SET) != 0) {
+      throw std::runtime_error("cannot write " + path_);
+    }
+  }
+
+  void finish() {
+    const bool flushed = std::fflush(file_) == 0;
+    const bool closed = std::fclose(file_) == 0;
+    file_ = nullptr;
+    if (!flushed || !closed) {
+      throw std::runtime_error("cannot write " + path_);
+    }
+    done_ = true;
+  }
+
+ private:
+  std::string path_;
+  std::FILE* file_ = nullptr;
+  std::uint64_t position_ = 0;
+  bool done_ = false;
+};
+
+// Writes the directory, its out-of-line values after it, and points the
+// header at it
+void write_directory(TIFFWriter& writer, std::vector<TIFFField> fields, bool big,
+                     std::uint64_t header_link) {
+  std::sort(fields.begin(), fields.end(),
+            [](const TIFFField& a, const TIFFField& b) { return a.tag < b.tag; });
+  writer.align();
+  const std::uint64_t directory = writer.position();
+  const std::size_t inline_size = big ? 8 : 4;
+  const std::uint64_t entries_size = (big ? 8 : 2) + fields.size() * (big ? 20 : 12) +
+                                     inline_size;
+
+  std::uint64_t value_offset = directory + entries_size;
+  if (big) {
+    writer.write_value<std::uint64_t>(fields.size());
+  } else {
+    writer.write_value<std::uint16_t>(static_cast<std::uint16_t>(fields.size()));
+  }
+  for (const TIFFField& field : fields) {
+    writer.write_value(field.tag);
+    writer.write_value(field.type);
+    if (big) {
+      writer.write_value<std::uint64_t>(field.count);
+    } else {
+      writer.write_value<std::uint32_t>(static_cast<std::uint32_t>(field.count));
+    }
+    std::uint8_t value[8] = {};
+    if (field.data.size() <= inline_size) {
+      std::memcpy(value, field.data.data(), field.data.size());
+    } else if (big) {
+      std::memcpy(value, &value_offset, 8);
+      value_offset += (field.data.size() + 1) & ~std::size_t{1};
+    } else {
+      const auto offset32 = static_cast<std::uint32_t>(value_offset);
+      std::memcpy(value, &offset32, 4);
+      value_offset += (field.data.size() + 1) & ~std::size_t{1};
+    }
+    writer.write(value, inline_size);
+  }
+  const std::uint8_t no_next[8] = {};
+  writer.write(no_next, inline_size);
+  for (const TIFFField& field : fields) {
+    if (field.data.size() > inline_size) {
+      writer.write(field.data.data(), field.data.size());
+      writer.align();
+    }
+  }
+
+  if (big) {
+    writer.patch(header_link, &directory, 8);
+  } else {
+    const auto directory32 = static_cast<std::uint32_t>(directory);
+    writer.patch(header_link, &directory32, 4);
+  }
+}
+
+}  // namespace
+
+TIFFFormat::TIFFFormat(TIFFWriteOptions write_options) : write_options_(write_options) {
+  if (write_options_.tile_size < 0 || write_options_.tile_size % 16 != 0) {
+    throw std::invalid_argument("TIFF tile size must be a multiple of 16");
+  }
+}
+
+std::string TIFFFormat::name() const {
+  return "TIFF";
+}
+
+bool TIFFFormat::can_read(const std::string& path) const {
+  const std::string extension = file_extension(path);
+  return extension == "tif" || extension == "tiff";
+}
+
+bool TIFFFormat::can_write(const std::string& path,
+                           const ps::core::ImageDocument& document) const {
+  TIFFLayout layout;
+  return can_read(path) && tiff_layout(document, layout);
+}
+
+bool TIFFFormat::can_read_signature(const std::uint8_t* header, std::size_t size) const {
+  if (size < 4) {
+    return false;
+  }
+  const bool little = header[0] == 'I' && header[1] == 'I';
+  const bool big = header[0] == 'M' && header[1] == 'M';
+  const int version = little ? header[2] | header[3] << 8 : header[2] << 8 | header[3];
+  return (little || big) && (version == 42 || version == 43);
+}
+
+ImageInfo TIFFFormat::probe(const std::string& path) const {
+  const MappedFile file(path);
+  const TIFFReader reader(file, path);
+  std::uint64_t next = 0;
+  const TIFFImage image = read_image(reader, reader.directory(reader.first_directory(), next));
+
+  ImageInfo info;
+  info.format = name();
+  info.size = ps::core::Size{image.width, image.height};
+  info.channel_count = static_cast<int>(channel_names(image, info.mode).size());
+  info.bit_depth = image.bits;
+  return info;
+}
+
+ps::core::ImageDocument TIFFFormat::load(const std::string& path,
+                                         const LoadOptions& options) const {
+  const MappedFile file(path);
+  const TIFFReader reader(file, path);
+  std::uint64_t next = 0;
+  const TIFFImage image = read_image(reader, reader.directory(reader.first_directory(), next));
+
+  const ps::core::Size size{image.width, image.height};
+  const ps::core::PixelFormat format = channel_format(image);
+  ps::core::ColorMode mode = ps::core::ColorMode::Grayscale;
+  const std::vector<std::string> names = channel_names(image, mode);
+
+  // Every pixel is decoded, so contiguous storage starts uninitialized
+  ps::core::ImageDocument document(size, mode);
+  document.set_storage_layout(options.layout);
+  for (const std::string& name : names) {
+    document.add_channel(name, ps::core::ImageBuffer(size, format, options.layout,
+                                                     ps::core::BufferInit::Uninitialized));
+  }
+
+  const auto report = [&](int y0, int y1) {
+    if (options.progress) {
+      options.progress(document, ps::core::Rect{0, y0, image.width, y1 - y0});
+    }
+  };
+  if (format == ps::core::PixelFormat::Gray16) {
+    DecodePlan plan = plan_decode<std::uint16_t>(image);
+    decode_image<ps::core::PixelFormat::Gray16>(reader, image, plan, document, false, report);
+  } else {
+    DecodePlan plan = plan_decode<std::uint8_t>(image);
+    decode_image<ps::core::PixelFormat::Gray8>(reader, image, plan, document, false, report);
+  }
+  return document;
+}
+
+ps::core::ImageDocument TIFFFormat::load_thumbnail(const std::string& path,
+                                                   int max_edge) const {
+  const MappedFile file(path);
+  const TIFFReader reader(file, path);
+  std::uint64_t next = 0;
+  TIFFImage image = read_image(reader, reader.directory(reader.first_directory(), next));
+  const ps::core::Size size = thumbnail_size(ps::core::Size{image.width, image.height}, max_edge);
+
+  // Reduced-resolution copies follow the main image in the directory chain;
+  // the smallest that is still at least the thumbnail's size is decoded
+  // instead. Copies this reader cannot decode, or with other samples, are
+  // skipped, and a damaged chain ends the search.
+  std::set<std::uint64_t> visited = {reader.first_directory()};
+  while (next != 0 && visited.size() < kMaxDirectories && visited.insert(next).second) {
+    std::map<std::uint16_t, TIFFEntry> tags;
+    TIFFImage candidate;
+    try {
+      tags = reader.directory(next, next);
+    } catch (const std::runtime_error&) {
+      break;
+    }
+    try {
+      candidate = read_image(reader, tags);
+    } catch (const std::runtime_error&) {
+      continue;
+    }
+    if (candidate.reduced && candidate.width >= size.width && candidate.height >= size.height &&
+        static_cast<std::uint64_t>(candidate.width) * candidate.height <
+            static_cast<std::uint64_t>(image.width) * image.height &&
+        candidate.photometric == image.photometric && candidate.samples == image.samples &&
+        candidate.bits == image.bits) {
+      image = std::move(candidate);
+    }
+  }
+
+  ps::core::ColorMode mode = ps::core::ColorMode::Grayscale;
+  const std::vector<std::string> names = channel_names(image, mode);
+  const ps::core::PixelFormat format = channel_format(image);
+  ps::core::ImageDocument thumbnail(size, mode);
+  for (const std::string& name : names) {
+    thumbnail.add_channel(name, format);
+  }
+  if (format == ps::core::PixelFormat::Gray16) {
+    reduce_image<ps::core::PixelFormat::Gray16>(reader, image, thumbnail);
+  } else {
+    reduce_image<ps::core::PixelFormat::Gray8>(reader, image, thumbnail);
+  }
+  return thumbnail;
+}
+
+void TIFFFormat::save(const std::string& path, const ps::core::ImageDocument& document,
+                      const SaveOptions& options) const {
+  if (options.compression_level < 0 || options.compression_level > 9) {
+    throw std::invalid_argument("TIFF compression level must be between 0 and 9");
+  }
+  TIFFLayout layout;
+  if (!tiff_layout(document, layout)) {
+    throw std::runtime_error("document has no channels that can be saved as TIFF");
+  }
+
+  const ps::core::Size size = document.size();
+  const RegionReader read_region = region_reader(layout);
+  const bool tiled = write_options_.tile_size > 0;
+  ChunkShape shape;
+  shape.width = tiled ? write_options_.tile_size : size.width;
+  shape.bpp = static_cast<std::size_t>(layout.samples) * (layout.bits / 8);
+  shape.row_bytes = static_cast<std::size_t>(shape.width) * shape.bpp;
+  const int chunk_height =
+      tiled ? write_options_.tile_size
+            : static_cast<int>(std::min<std::size_t>(
+                  size.height, std::max<std::size_t>(1, kStripBytes / shape.row_bytes)));
+  const int across = (size.width + shape.width - 1) / shape.width;
+  const int down = (size.height + chunk_height - 1) / chunk_height;
+  const std::size_t chunk_count = static_cast<std::size_t>(across) * down;
+
+  // LZW can grow incompressible data by half; switch to BigTIFF before
+  // offsets could pass 4 GB
+  const std::uint64_t raw_bytes = static_cast<std::uint64_t>(shape.row_bytes) * chunk_height *
+                                  chunk_count;
+  const bool big = raw_bytes + raw_bytes / 2 + chunk_count * 16 + (1u << 20) >
+                   std::numeric_limits<std::uint32_t>::max();
+
+  TIFFWriter writer(path);
+  const char order = is_little_endian() ? 'I' : 'M';
+  writer.write_value(order);
+  writer.write_value(order);
+  std::uint64_t header_link = 4;
+  if (big) {
+    writer.write_value<std::uint16_t>(43);
+    writer.write_value<std::uint16_t>(8);
+    writer.write_value<std::uint16_t>(0);
+    header_link = writer.position();
+    writer.write_value<std::uint64_t>(0);
+  } else {
+    writer.write_value<std::uint16_t>(42);
+    writer.write_value<std::uint32_t>(0);
+  }
+
+  // Chunks are encoded a batch at a time across the ThreadPool and written
+  // in order, so the file is the same for any thread count
+  ps::core::ThreadPool& pool = ps::core::ThreadPool::instance();
+  const std::size_t chunk_bytes = shape.row_bytes * chunk_height;
+  const std::size_t batch_size = std::max<std::size_t>(
+      2 * pool.thread_count(), kBatchBytes / std::max<std::size_t>(1, chunk_bytes));
+  std::vector<std::uint64_t> offsets;
+  std::vector<std::uint64_t> byte_counts;
+  offsets.reserve(chunk_count);
+  byte_counts.reserve(chunk_count);
+  std::vector<WriteChunk> batch;
+  int rows_reported = 0;
+  for (std::size_t first = 0; first < chunk_count; first += batch_size) {
+    const std::size_t last = std::min(chunk_count, first + batch_size);
+    batch.assign(last - first, WriteChunk{});
+    for (std::size_t c = first; c < last; ++c) {
+      WriteChunk& chunk = batch[c - first];
+      chunk.x = static_cast<int>(c % across) * shape.width;
+      chunk.y = static_cast<int>(c / across) * chunk_height;
+      chunk.rows = tiled ? chunk_height : std::min(chunk_height, size.height - chunk.y);
+    }
+    pool.parallel_for(0, static_cast<int>(batch.size()), 1, [&](int c0, int c1) {
+      for (int c = c0; c < c1; ++c) {
+        encode_chunk(batch[c], read_region, shape, layout, write_options_, size.width,
+                     size.height, options.compression_level);
+      }
+    });
+    for (const WriteChunk& chunk : batch) {
+      writer.align();
+      offsets.push_back(writer.position());
+      byte_counts.push_back(chunk.bytes.size());
+      writer.write(chunk.bytes.data(), chunk.bytes.size());
+    }
+
+    const int rows = std::min(size.height, static_cast<int>(last / across) * chunk_height);
+    if (options.progress && rows > rows_reported) {
+      options.progress(ps::core::Rect{0, rows_reported, size.width, rows - rows_reported});
+      rows_reported = rows;
+    }
+  }
+
+  const auto unsigned_field = [big](std::uint16_t tag, const std::vector<std::uint64_t>& values) {
+    if (big) {
+      return make_field(tag, kLong8, values);
+    }
+    return make_field(tag, kLong, std::vector<std::uint32_t>(values.begin(), values.end()));
+  };
+  const auto short_field = [](std::uint16_t tag, std::uint16_t value, std::size_t count = 1) {
+    return make_field(tag, kShort, std::vector<std::uint16_t>(count, value));
+  };
+  const auto long_field = [](std::uint16_t tag, std::uint32_t value) {
+    return make_field(tag, kLong, std::vector<std::uint32_t>{value});
+  };
+
+  const bool predictor =
+      write_options_.predictor && (write_options_.compression == TIFFCompression::LZW ||
+                                   write_options_.compression == TIFFCompression::Deflate);
+  std::vector<TIFFField> fields;
+  fields.push_back(long_field(kNewSubfileType, 0));
+  fields.push_back(long_field(kImageWidth, static_cast<std::uint32_t>(size.width)));
+  fields.push_back(long_field(kImageLength, static_cast<std::uint32_t>(size.height)));
+  fields.push_back(short_field(kBitsPerSample, static_cast<std::uint16_t>(layout.bits),
+                               static_cast<std::size_t>(layout.samples)));
+  fields.push_back(short_field(kCompressionTag,
+                               static_cast<std::uint16_t>(write_options_.compression)));
+  fields.push_back(short_field(kPhotometricTag, layout.photometric));
+  fields.push_back(short_field(kSamplesPerPixel, static_cast<std::uint16_t>(layout.samples)));
+  // The document has no resolution, so files say 72 dpi like the original
+  for (std::uint16_t tag : {kXResolution, kYResolution}) {
+    TIFFField resolution = make_field(tag, kRational, std::vector<std::uint32_t>{72, 1});
+    resolution.count = 1;  // One numerator/denominator pair
+    fields.push_back(std::move(resolution));
+  }
+  fields.push_back(short_field(kPlanarConfiguration, 1));
+  fields.push_back(short_field(kResolutionUnit, 2));
+  if (predictor) {
+    fields.push_back(short_field(kPredictor, 2));
+  }
+  if (tiled) {
+    fields.push_back(long_field(kTileWidth, static_cast<std::uint32_t>(shape.width)));
+    fields.push_back(long_field(kTileLength, static_cast<std::uint32_t>(chunk_height)));
+    fields.push_back(unsigned_field(kTileOffsets, offsets));
+    fields.push_back(unsigned_field(kTileByteCounts, byte_counts));
+  } else {
+    fields.push_back(unsigned_field(kStripOffsets, offsets));
+    fields.push_back(long_field(kRowsPerStrip, static_cast<std::uint32_t>(chunk_height)));
+    fields.push_back(unsigned_field(kStripByteCounts, byte_counts));
+  }
+  if (layout.photometric == kSeparated) {
+    fields.push_back(short_field(kInkSet, 1));
+  }
+  if (layout.extra_samples > 0) {
+    // The first extra sample is unassociated alpha, the rest unspecified
+    std::vector<std::uint16_t> extra(static_cast<std::size_t>(layout.extra_samples), 0);
+    extra.front() = 2;
+    fields.push_back(make_field(kExtraSamples, kShort, extra));
+  }
+  write_directory(writer, std::move(fields), big, header_link);
+  writer.finish();
+}
+
+}  // namespace ps::io
@@ -1,17 +1,68 @@
 #include "ps/core/layer.h"
 
 #include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <utility>
+
+#include "ps/core/pixel_conversion.h"
 
 namespace ps::core {
 
-Layer::Layer(Size size, const std::string& name)
-    : name_(name), size_(size), buffer_(size, PixelFormat::RGBA8) {
-  // Initialize buffer to transparent (all zeros)
-  std::fill(buffer_.data(), buffer_.data() + buffer_.byte_size(), 0);
+namespace {
+
+std::uint64_t next_revision() {
+  static std::atomic<std::uint64_t> counter{0};
+  return counter.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+}  // namespace
+
+Layer::Layer(Size size, const std::string& name, StorageLayout layout,
+             BufferInit init, PixelFormat format)
+    : name_(name),
+      revision_(next_revision()),
+      size_(size),
+      buffer_(size, format, layout, init) {
+  // A zero-filled ImageBuffer is fully transparent in every RGBA format
+  if (!is_rgba_format(format)) {
+    throw std::invalid_argument("Layer: pixel format must be RGBA");
+  }
+}
+
+void Layer::set_format(PixelFormat format) {
+  if (!is_rgba_format(format)) {
+    throw std::invalid_argument("Layer: pixel format must be RGBA");
+  }
+  if (format == buffer_.format()) {
+    return;
+  }
+  buffer_ = convert_rgba_buffer(buffer_, format);
+  revision_ = next_revision();
+}
+
+void Layer::swap_buffer(ImageBuffer& buffer) {
+  if (!is_rgba_format(buffer.format())) {
+    throw std::invalid_argument("Layer: pixel format must be RGBA");
+  }
+  std::swap(buffer_, buffer);
+  size_ = buffer_.size();
+  revision_ = next_revision();
+}
+
+void Layer::set_visible(bool visible) {
+  visible_ = visible;
+  revision_ = next_revision();
 }
 
 void Layer::set_opacity(int opacity) {
   opacity_ = std::clamp(opacity, 0, 100);
+  revision_ = next_revision();
+}
+
+void Layer::set_blend_mode(BlendMode mode) {
+  blend_mode_ = mode;
+  revision_ = next_revision();
 }
 
 }  // namespace ps::core
@@ -2,6 +2,11 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include "ps/core/thread_pool.h"
+#include "target_clones.h"
 
 namespace ps::core {
 
@@ -17,7 +22,10 @@ inline uint8_t to_byte(float val) {
   return static_cast<uint8_t>(std::clamp(val * 255.0f, 0.0f, 255.0f));
 }
 
-// Blend mode implementations (operate on normalized float values)
+// Blend mode implementations (operate on normalized float values). Every
+// arm is computed and the result selected, so the loops that call them
+// have no data-dependent branches and vectorize; the arms not taken
+// (including a division by zero) do not affect the result.
 
 float blend_multiply(float src, float dst) {
   return src * dst;
@@ -28,11 +36,9 @@ float blend_screen(float src, float dst) {
 }
 
 float blend_overlay(float src, float dst) {
-  if (dst < 0.5f) {
-    return 2.0f * src * dst;
-  } else {
-    return 1.0f - 2.0f * (1.0f - src) * (1.0f - dst);
-  }
+  const float low = 2.0f * src * dst;
+  const float high = 1.0f - 2.0f * (1.0f - src) * (1.0f - dst);
+  return dst < 0.5f ? low : high;
 }
 
 float blend_darken(float src, float dst) {
@@ -44,36 +50,27 @@ float blend_lighten(float src, float dst) {
 }
 
 float blend_color_dodge(float src, float dst) {
-  if (src >= 1.0f) {
-    return 1.0f;
-  }
-  return std::min(1.0f, dst / (1.0f - src));
+  const float dodged = std::min(1.0f, dst / (1.0f - src));
+  return src >= 1.0f ? 1.0f : dodged;
 }
 
 float blend_color_burn(float src, float dst) {
-  if (src <= 0.0f) {
-    return 0.0f;
-  }
-  return 1.0f - std::min(1.0f, (1.0f - dst) / src);
+  const float burned = 1.0f - std::min(1.0f, (1.0f - dst) / src);
+  return src <= 0.0f ? 0.0f : burned;
 }
 
 float blend_hard_light(float src, float dst) {
-  if (src < 0.5f) {
-    return 2.0f * src * dst;
-  } else {
-    return 1.0f - 2.0f * (1.0f - src) * (1.0f - dst);
-  }
+  const float low = 2.0f * src * dst;
+  const float high = 1.0f - 2.0f * (1.0f - src) * (1.0f - dst);
+  return src < 0.5f ? low : high;
 }
 
 float blend_soft_light(float src, float dst) {
-  if (src < 0.5f) {
-    return dst - (1.0f - 2.0f * src) * dst * (1.0f - dst);
-  } else {
-    float d = (dst < 0.25f) ?
-      ((16.0f * dst - 12.0f) * dst + 4.0f) * dst :
-      std::sqrt(dst);
-    return dst + (2.0f * src - 1.0f) * (d - dst);
-  }
+  const float darker = dst - (1.0f - 2.0f * src) * dst * (1.0f - dst);
+  const float curve = ((16.0f * dst - 12.0f) * dst + 4.0f) * dst;
+  const float d = dst < 0.25f ? curve : std::sqrt(dst);
+  const float lighter = dst + (2.0f * src - 1.0f) * (d - dst);
+  return src < 0.5f ? darker : lighter;
 }
 
 float blend_difference(float src, float dst) {
@@ -84,142 +81,434 @@ float blend_exclusion(float src, float dst) {
   return dst + src - 2.0f * dst * src;
 }
 
-}  // namespace
+// Per-channel blend function for each mode, selected at compile time
+template <BlendMode Mode>
+inline float blend_channel(float src, float dst) {
+  switch (Mode) {
+    case BlendMode::Multiply: return blend_multiply(src, dst);
+    case BlendMode::Screen: return blend_screen(src, dst);
+    case BlendMode::Overlay: return blend_overlay(src, dst);
+    case BlendMode::Darken: return blend_darken(src, dst);
+    case BlendMode::Lighten: return blend_lighten(src, dst);
+    case BlendMode::ColorDodge: return blend_color_dodge(src, dst);
+    case BlendMode::ColorBurn: return blend_color_burn(src, dst);
+    case BlendMode::HardLight: return blend_hard_light(src, dst);
+    case BlendMode::SoftLight: return blend_soft_light(src, dst);
+    case BlendMode::Difference: return blend_difference(src, dst);
+    case BlendMode::Exclusion: return blend_exclusion(src, dst);
+    case BlendMode::Normal:
+    default:
+      return src;
+  }
+}
 
-void blend_pixel(uint8_t src_r, uint8_t src_g, uint8_t src_b, uint8_t src_a,
-                 uint8_t& dst_r, uint8_t& dst_g, uint8_t& dst_b, uint8_t& dst_a,
-                 int opacity, BlendMode mode) {
-  // Convert to float
-  float sr = to_float(src_r);
-  float sg = to_float(src_g);
-  float sb = to_float(src_b);
-  float sa = to_float(src_a) * (opacity / 100.0f);
+constexpr int kBlendModeCount = static_cast<int>(BlendMode::Exclusion) + 1;
+
+// Lookup tables for the two alpha cases whose result depends only on two
+// bytes. Each entry is produced by running the float reference arithmetic
+// below on that input, so table lookups are bit-identical to computing.
+struct BlendTables {
+  // Effective source alpha 0: new colour byte for (dst_a << 8 | dst_c).
+  // Row 0 doubles as the byte -> float -> byte round trip used for alpha.
+  std::uint8_t transparent[256 * 256];
+  // Effective source alpha 1: new colour byte for (src_c << 8 | dst_c)
+  std::uint8_t opaque[kBlendModeCount][256 * 256];
+};
+
+// Reference composite of one pixel for a fixed mode. Every kernel below
+// reduces to this arithmetic, in this order; the file is built with FP
+// contraction disabled so vector clones round exactly like scalar code.
+template <BlendMode Mode>
+inline __attribute__((always_inline)) void blend_reference(
+    const uint8_t* src, uint8_t* dst, float sa) {
+  float dr = to_float(dst[0]);
+  float dg = to_float(dst[1]);
+  float db = to_float(dst[2]);
+  float da = to_float(dst[3]);
+
+  const float br = blend_channel<Mode>(to_float(src[0]), dr);
+  const float bg = blend_channel<Mode>(to_float(src[1]), dg);
+  const float bb = blend_channel<Mode>(to_float(src[2]), db);
+
+  const float out_alpha = sa + da * (1.0f - sa);
+
+  // Selected rather than branched on, like the blend functions; a fully
+  // transparent result keeps the destination
+  const bool covered = out_alpha > 0.0f;
+  dr = covered ? (br * sa + dr * da * (1.0f - sa)) / out_alpha : dr;
+  dg = covered ? (bg * sa + dg * da * (1.0f - sa)) / out_alpha : dg;
+  db = covered ? (bb * sa + db * da * (1.0f - sa)) / out_alpha : db;
+  da = covered ? out_alpha : da;
+
+  dst[0] = to_byte(dr);
+  dst[1] = to_byte(dg);
+  dst[2] = to_byte(db);
+  dst[3] = to_byte(da);
+}
 
-  float dr = to_float(dst_r);
-  float dg = to_float(dst_g);
-  float db = to_float(dst_b);
-  float da = to_float(dst_a);
+template <BlendMode Mode>
+void build_opaque_table(std::uint8_t* table) {
+  for (int s = 0; s < 256; ++s) {
+    for (int d = 0; d < 256; ++d) {
+      const uint8_t src[4] = {static_cast<uint8_t>(s), static_cast<uint8_t>(s),
+                              static_cast<uint8_t>(s), 255};
+      uint8_t dst[4] = {static_cast<uint8_t>(d), static_cast<uint8_t>(d),
+                        static_cast<uint8_t>(d), 255};
+      blend_reference<Mode>(src, dst, 1.0f);
+      table[s << 8 | d] = dst[0];
+    }
+  }
+}
+
+const BlendTables& blend_tables() {
+  static const BlendTables* tables = [] {
+    auto* t = new BlendTables;
+    for (int a = 0; a < 256; ++a) {
+      for (int d = 0; d < 256; ++d) {
+        const uint8_t src[4] = {0, 0, 0, 0};
+        uint8_t dst[4] = {static_cast<uint8_t>(d), static_cast<uint8_t>(d),
+                          static_cast<uint8_t>(d), static_cast<uint8_t>(a)};
+        blend_reference<BlendMode::Normal>(src, dst, 0.0f);
+        t->transparent[a << 8 | d] = dst[0];
+      }
+    }
+    build_opaque_table<BlendMode::Normal>(t->opaque[0]);
+    build_opaque_table<BlendMode::Multiply>(t->opaque[1]);
+    build_opaque_table<BlendMode::Screen>(t->opaque[2]);
+    build_opaque_table<BlendMode::Overlay>(t->opaque[3]);
+    build_opaque_table<BlendMode::Darken>(t->opaque[4]);
+    build_opaque_table<BlendMode::Lighten>(t->opaque[5]);
+    build_opaque_table<BlendMode::ColorDodge>(t->opaque[6]);
+    build_opaque_table<BlendMode::ColorBurn>(t->opaque[7]);
+    build_opaque_table<BlendMode::HardLight>(t->opaque[8]);
+    build_opaque_table<BlendMode::SoftLight>(t->opaque[9]);
+    build_opaque_table<BlendMode::Difference>(t->opaque[10]);
+    build_opaque_table<BlendMode::Exclusion>(t->opaque[11]);
+    return t;
+  }();
+  return *tables;
+}
 
-  // Apply blend mode to get blended color
-  float br, bg, bb;
+// Pixels per block of blend_span
+constexpr int kBlendBlock = 64;
+
+// Composites a span of RGBA8 pixels with one mode, a block at a time.
+// Blocks whose source pixels are all fully opaque or all fully
+// transparent (after opacity) are table lookups. Any other block runs the
+// float reference over every pixel; it has no branches, so the loop
+// vectorizes, and it gives the tables' result for their pixels too.
+template <BlendMode Mode>
+inline __attribute__((always_inline)) void blend_span(
+    const uint8_t* src, uint8_t* dst, int count, float opacity_scale,
+    const BlendTables& tables) {
+  const std::uint8_t* opaque = tables.opaque[static_cast<int>(Mode)];
+  const std::uint8_t* transparent = tables.transparent;
+
+  for (int first = 0; first < count; first += kBlendBlock) {
+    const int n = std::min(kBlendBlock, count - first);
+    const uint8_t* s = src + first * 4;
+    uint8_t* d = dst + first * 4;
+
+    bool all_opaque = true;
+    bool all_transparent = true;
+    for (int i = 0; i < n; ++i) {
+      const float sa = to_float(s[i * 4 + 3]) * opacity_scale;
+      all_opaque &= sa == 1.0f;
+      all_transparent &= sa == 0.0f;
+    }
+
+    if (all_opaque) {
+      for (int i = 0; i < n; ++i, s += 4, d += 4) {
+        d[0] = opaque[s[0] << 8 | d[0]];
+        d[1] = opaque[s[1] << 8 | d[1]];
+        d[2] = opaque[s[2] << 8 | d[2]];
+        d[3] = 255;
+      }
+    } else if (all_transparent) {
+      for (int i = 0; i < n; ++i, d += 4) {
+        const std::uint8_t* row = transparent + (d[3] << 8);
+        d[0] = row[d[0]];
+        d[1] = row[d[1]];
+        d[2] = row[d[2]];
+        d[3] = transparent[d[3]];
+      }
+    } else {
+      for (int i = 0; i < n; ++i) {
+        blend_reference<Mode>(s + i * 4, d + i * 4, to_float(s[i * 4 + 3]) * opacity_scale);
+      }
+    }
+  }
+}
 
+// One dispatch per call: the mode switch sits outside the pixel loop, and
+// the whole function is cloned per instruction set
+PS_TARGET_CLONES
+void blend_span_dispatch(const uint8_t* src, uint8_t* dst, int count,
+                         float opacity_scale, BlendMode mode,
+                         const BlendTables& tables) {
   switch (mode) {
+    case BlendMode::Multiply:
+      blend_span<BlendMode::Multiply>(src, dst, count, opacity_scale, tables);
+      break;
+    case BlendMode::Screen:
+      blend_span<BlendMode::Screen>(src, dst, count, opacity_scale, tables);
+      break;
+    case BlendMode::Overlay:
+      blend_span<BlendMode::Overlay>(src, dst, count, opacity_scale, tables);
+      break;
+    case BlendMode::Darken:
+      blend_span<BlendMode::Darken>(src, dst, count, opacity_scale, tables);
+      break;
+    case BlendMode::Lighten:
+      blend_span<BlendMode::Lighten>(src, dst, count, opacity_scale, tables);
+      break;
+    case BlendMode::ColorDodge:
+      blend_span<BlendMode::ColorDodge>(src, dst, count, opacity_scale, tables);
+      break;
+    case BlendMode::ColorBurn:
+      blend_span<BlendMode::ColorBurn>(src, dst, count, opacity_scale, tables);
+      break;
+    case BlendMode::HardLight:
+      blend_span<BlendMode::HardLight>(src, dst, count, opacity_scale, tables);
+      break;
+    case BlendMode::SoftLight:
+      blend_span<BlendMode::SoftLight>(src, dst, count, opacity_scale, tables);
+      break;
+    case BlendMode::Difference:
+      blend_span<BlendMode::Difference>(src, dst, count, opacity_scale, tables);
+      break;
+    case BlendMode::Exclusion:
+      blend_span<BlendMode::Exclusion>(src, dst, count, opacity_scale, tables);
+      break;
     case BlendMode::Normal:
-      br = sr;
-      bg = sg;
-      bb = sb;
+    default:
+      blend_span<BlendMode::Normal>(src, dst, count, opacity_scale, tables);
       break;
+  }
+}
 
+// Premultiplied kernels. Components are stored as T with kMax meaning 1.0.
+// The separable modes reduce to sums of products of premultiplied values
+// and run on integers only; the remaining modes need the straight colors
+// and go through float.
+template <typename T>
+struct PremulTraits;
+
+template <>
+struct PremulTraits<std::uint8_t> {
+  static constexpr std::uint32_t kMax = 255;
+  // Rounded a * b / 255
+  static std::uint32_t mul(std::uint32_t a, std::uint32_t b) {
+    const std::uint32_t t = a * b + 128;
+    return (t + (t >> 8)) >> 8;
+  }
+};
+
+template <>
+struct PremulTraits<std::uint16_t> {
+  static constexpr std::uint32_t kMax = 65535;
+  // Rounded a * b / 65535
+  static std::uint32_t mul(std::uint32_t a, std::uint32_t b) {
+    const std::uint32_t t = a * b + 32768;
+    return (t + (t >> 16)) >> 16;
+  }
+};
+
+// New premultiplied color for one component. sc and sa already include the
+// layer opacity; raw_c and raw_a are the source as stored, before opacity.
+template <typename Traits, BlendMode Mode>
+inline __attribute__((always_inline)) std::int32_t blend_premul_channel(
+    std::uint32_t sc, std::uint32_t dc, std::uint32_t sa, std::uint32_t da,
+    std::uint32_t raw_c, std::uint32_t raw_a) {
+  constexpr std::uint32_t kMax = Traits::kMax;
+  const std::uint32_t inv_sa = kMax - sa;
+  const std::uint32_t inv_da = kMax - da;
+
+  switch (Mode) {
+    case BlendMode::Normal:
+      return static_cast<std::int32_t>(sc + Traits::mul(dc, inv_sa));
     case BlendMode::Multiply:
-      br = blend_multiply(sr, dr);
-      bg = blend_multiply(sg, dg);
-      bb = blend_multiply(sb, db);
-      break;
+      return static_cast<std::int32_t>(Traits::mul(sc, dc) + Traits::mul(sc, inv_da) +
+                                       Traits::mul(dc, inv_sa));
+    case BlendMode::Screen:
+      return static_cast<std::int32_t>(sc + dc - Traits::mul(sc, dc));
+    case BlendMode::Darken:
+      return static_cast<std::int32_t>(
+          std::min(Traits::mul(sc, da), Traits::mul(dc, sa)) +
+          Traits::mul(sc, inv_da) + Traits::mul(dc, inv_sa));
+    case BlendMode::Lighten:
+      return static_cast<std::int32_t>(
+          std::max(Traits::mul(sc, da), Traits::mul(dc, sa)) +
+          Traits::mul(sc, inv_da) + Traits::mul(dc, inv_sa));
+    case BlendMode::Difference:
+      return static_cast<std::int32_t>(sc + dc) -
+             2 * static_cast<std::int32_t>(
+                     std::min(Traits::mul(sc, da), Traits::mul(dc, sa)));
+    case BlendMode::Exclusion:
+      return static_cast<std::int32_t>(sc + dc) -
+             2 * static_cast<std::int32_t>(Traits::mul(sc, dc));
+    default: {
+      // The straight source color comes from the stored components: sc and
+      // sa were rounded after scaling by opacity, which the division would
+      // magnify
+      const float scale = 1.0f / kMax;
+      const float fsa = sa * scale;
+      const float fda = da * scale;
+      const float src = raw_a > 0 ? static_cast<float>(raw_c) / raw_a : 0.0f;
+      const float dst = da > 0 ? static_cast<float>(dc) / da : 0.0f;
+      const float out = sc * scale * (1.0f - fda) + dc * scale * (1.0f - fsa) +
+                        fsa * fda * blend_channel<Mode>(src, dst);
+      return static_cast<std::int32_t>(out * kMax + 0.5f);
+    }
+  }
+}
 
+template <typename T, BlendMode Mode>
+inline __attribute__((always_inline)) void blend_premul_span(
+    const uint8_t* src, uint8_t* dst, int count, std::uint32_t opacity) {
+  using Traits = PremulTraits<T>;
+  constexpr std::size_t kPixelBytes = 4 * sizeof(T);
+
+  for (int i = 0; i < count; ++i, src += kPixelBytes, dst += kPixelBytes) {
+    T s[4];
+    T d[4];
+    std::memcpy(s, src, kPixelBytes);
+    std::memcpy(d, dst, kPixelBytes);
+
+    const std::uint32_t sa = Traits::mul(s[3], opacity);
+    const std::uint32_t da = d[3];
+    const std::uint32_t out_alpha = sa + Traits::mul(da, Traits::kMax - sa);
+
+    for (int c = 0; c < 3; ++c) {
+      const std::uint32_t sc = Traits::mul(s[c], opacity);
+      const std::int32_t value =
+          blend_premul_channel<Traits, Mode>(sc, d[c], sa, da, s[c], s[3]);
+      // Rounding may push a component just outside [0, alpha]
+      d[c] = static_cast<T>(std::clamp<std::int32_t>(
+          value, 0, static_cast<std::int32_t>(out_alpha)));
+    }
+    d[3] = static_cast<T>(out_alpha);
+    std::memcpy(dst, d, kPixelBytes);
+  }
+}
+
+template <typename T>
+inline __attribute__((always_inline)) void blend_premul_switch(
+    const uint8_t* src, uint8_t* dst, int count, std::uint32_t opacity,
+    BlendMode mode) {
+  switch (mode) {
+    case BlendMode::Multiply:
+      blend_premul_span<T, BlendMode::Multiply>(src, dst, count, opacity);
+      break;
     case BlendMode::Screen:
-      br = blend_screen(sr, dr);
-      bg = blend_screen(sg, dg);
-      bb = blend_screen(sb, db);
+      blend_premul_span<T, BlendMode::Screen>(src, dst, count, opacity);
       break;
-
     case BlendMode::Overlay:
-      br = blend_overlay(sr, dr);
-      bg = blend_overlay(sg, dg);
-      bb = blend_overlay(sb, db);
+      blend_premul_span<T, BlendMode::Overlay>(src, dst, count, opacity);
       break;
-
     case BlendMode::Darken:
-      br = blend_darken(sr, dr);
-      bg = blend_darken(sg, dg);
-      bb = blend_darken(sb, db);
+      blend_premul_span<T, BlendMode::Darken>(src, dst, count, opacity);
       break;
-
     case BlendMode::Lighten:
-      br = blend_lighten(sr, dr);
-      bg = blend_lighten(sg, dg);
-      bb = blend_lighten(sb, db);
+      blend_premul_span<T, BlendMode::Lighten>(src, dst, count, opacity);
       break;
-
     case BlendMode::ColorDodge:
-      br = blend_color_dodge(sr, dr);
-      bg = blend_color_dodge(sg, dg);
-      bb = blend_color_dodge(sb, db);
+      blend_premul_span<T, BlendMode::ColorDodge>(src, dst, count, opacity);
       break;
-
     case BlendMode::ColorBurn:
-      br = blend_color_burn(sr, dr);
-      bg = blend_color_burn(sg, dg);
-      bb = blend_color_burn(sb, db);
+      blend_premul_span<T, BlendMode::ColorBurn>(src, dst, count, opacity);
       break;
-
     case BlendMode::HardLight:
-      br = blend_hard_light(sr, dr);
-      bg = blend_hard_light(sg, dg);
-      bb = blend_hard_light(sb, db);
+      blend_premul_span<T, BlendMode::HardLight>(src, dst, count, opacity);
       break;
-
     case BlendMode::SoftLight:
-      br = blend_soft_light(sr, dr);
-      bg = blend_soft_light(sg, dg);
-      bb = blend_soft_light(sb, db);
+      blend_premul_span<T, BlendMode::SoftLight>(src, dst, count, opacity);
       break;
-
     case BlendMode::Difference:
-      br = blend_difference(sr, dr);
-      bg = blend_difference(sg, dg);
-      bb = blend_difference(sb, db);
+      blend_premul_span<T, BlendMode::Difference>(src, dst, count, opacity);
       break;
-
     case BlendMode::Exclusion:
-      br = blend_exclusion(sr, dr);
-      bg = blend_exclusion(sg, dg);
-      bb = blend_exclusion(sb, db);
+      blend_premul_span<T, BlendMode::Exclusion>(src, dst, count, opacity);
       break;
-
+    case BlendMode::Normal:
     default:
-      br = sr;
-      bg = sg;
-      bb = sb;
+      blend_premul_span<T, BlendMode::Normal>(src, dst, count, opacity);
       break;
   }
+}
 
-  // Composite with alpha
-  const float out_alpha = sa + da * (1.0f - sa);
+PS_TARGET_CLONES
+void blend_premul8_dispatch(const uint8_t* src, uint8_t* dst, int count,
+                            std::uint32_t opacity, BlendMode mode) {
+  blend_premul_switch<std::uint8_t>(src, dst, count, opacity, mode);
+}
+
+PS_TARGET_CLONES
+void blend_premul16_dispatch(const uint8_t* src, uint8_t* dst, int count,
+                             std::uint32_t opacity, BlendMode mode) {
+  blend_premul_switch<std::uint16_t>(src, dst, count, opacity, mode);
+}
+
+}  // namespace
 
-  if (out_alpha > 0.0f) {
-    dr = (br * sa + dr * da * (1.0f - sa)) / out_alpha;
-    dg = (bg * sa + dg * da * (1.0f - sa)) / out_alpha;
-    db = (bb * sa + db * da * (1.0f - sa)) / out_alpha;
-    da = out_alpha;
+void blend_pixel(uint8_t src_r, uint8_t src_g, uint8_t src_b, uint8_t src_a,
+                 uint8_t& dst_r, uint8_t& dst_g, uint8_t& dst_b, uint8_t& dst_a,
+                 int opacity, BlendMode mode) {
+  const uint8_t src[4] = {src_r, src_g, src_b, src_a};
+  uint8_t dst[4] = {dst_r, dst_g, dst_b, dst_a};
+  composite_span(src, dst, 1, opacity, mode);
+  dst_r = dst[0];
+  dst_g = dst[1];
+  dst_b = dst[2];
+  dst_a = dst[3];
+}
+
+void composite_span(const uint8_t* src, uint8_t* dst, int count, int opacity,
+                    BlendMode mode) {
+  if (count <= 0) {
+    return;
   }
+  blend_span_dispatch(src, dst, count, opacity / 100.0f, mode, blend_tables());
+}
 
-  // Convert back to bytes
-  dst_r = to_byte(dr);
-  dst_g = to_byte(dg);
-  dst_b = to_byte(db);
-  dst_a = to_byte(da);
+void composite_span(const uint8_t* src, uint8_t* dst, int count, int opacity,
+                    BlendMode mode, PixelFormat format) {
+  if (count <= 0) {
+    return;
+  }
+  opacity = std::clamp(opacity, 0, 100);
+  switch (format) {
+    case PixelFormat::RGBA8:
+      blend_span_dispatch(src, dst, count, opacity / 100.0f, mode, blend_tables());
+      return;
+    case PixelFormat::RGBA8Premul:
+      blend_premul8_dispatch(src, dst, count, (opacity * 255u + 50) / 100, mode);
+      return;
+    case PixelFormat::RGBA16Premul:
+      blend_premul16_dispatch(src, dst, count, (opacity * 65535u + 50) / 100, mode);
+      return;
+    default:
+      break;
+  }
+  throw std::invalid_argument("composite_span needs an RGBA layer format");
 }
 
 void composite_layer(const uint8_t* src_buffer, uint8_t* dst_buffer,
-                     int width, int height, int opacity, BlendMode mode) {
-  const int pixel_count = width * height;
-
-  for (int i = 0; i < pixel_count; ++i) {
-    const int idx = i * 4;
-
-    blend_pixel(
-      src_buffer[idx],     // src_r
-      src_buffer[idx + 1], // src_g
-      src_buffer[idx + 2], // src_b
-      src_buffer[idx + 3], // src_a
-      dst_buffer[idx],     // dst_r
-      dst_buffer[idx + 1], // dst_g
-      dst_buffer[idx + 2], // dst_b
-      dst_buffer[idx + 3], // dst_a
-      opacity,
-      mode
-    );
+                     int width, int height, int opacity, BlendMode mode,
+                     PixelFormat format) {
+  if (width <= 0 || height <= 0) {
+    return;
   }
+
+  // Bands of roughly kBandPixels pixels amortize the scheduling cost
+  constexpr int kBandPixels = 64 * 1024;
+  const int band_rows = std::max(1, kBandPixels / width);
+  const std::size_t row_bytes = static_cast<std::size_t>(width) * bytes_per_pixel(format);
+
+  ThreadPool::instance().parallel_for(0, height, band_rows, [&](int y0, int y1) {
+    composite_span(src_buffer + y0 * row_bytes, dst_buffer + y0 * row_bytes,
+                   (y1 - y0) * width, opacity, mode, format);
+  });
 }
 
 }  // namespace ps::core
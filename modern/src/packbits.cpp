@@ -0,0 +1,84 @@
+#include "ps/core/packbits.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace ps::core {
+
+namespace {
+
+constexpr std::size_t kMaxPacket = 128;
+
+}  // namespace
+
+std::vector<std::uint8_t> packbits_encode(const std::uint8_t* data, std::size_t size) {
+  std::vector<std::uint8_t> out;
+  out.reserve(size + size / kMaxPacket + 1);
+  packbits_encode(data, size, out);
+  return out;
+}
+
+void packbits_encode(const std::uint8_t* data, std::size_t size,
+                     std::vector<std::uint8_t>& out) {
+  std::size_t i = 0;
+  while (i < size) {
+    // Measure the run starting at i
+    std::size_t run = 1;
+    while (i + run < size && run < kMaxPacket && data[i + run] == data[i]) {
+      ++run;
+    }
+
+    if (run >= 3) {
+      out.push_back(static_cast<std::uint8_t>(1 - static_cast<int>(run)));
+      out.push_back(data[i]);
+      i += run;
+      continue;
+    }
+
+    // Literal packet: extend until a run of three starts or the packet fills
+    std::size_t end = i + run;
+    while (end < size && end - i < kMaxPacket) {
+      if (end + 2 < size && data[end] == data[end + 1] && data[end] == data[end + 2]) {
+        break;
+      }
+      ++end;
+    }
+
+    const std::size_t count = end - i;
+    out.push_back(static_cast<std::uint8_t>(count - 1));
+    out.insert(out.end(), data + i, data + end);
+    i = end;
+  }
+}
+
+std::size_t packbits_decode(const std::uint8_t* src, std::size_t src_size,
+                            std::uint8_t* dst, std::size_t dst_size) {
+  std::size_t in = 0;
+  std::size_t produced = 0;
+  while (produced < dst_size) {
+    if (in >= src_size) {
+      return 0;
+    }
+
+    const int header = static_cast<std::int8_t>(src[in++]);
+    if (header >= 0) {
+      const std::size_t count = static_cast<std::size_t>(header) + 1;
+      if (in + count > src_size || produced + count > dst_size) {
+        return 0;
+      }
+      std::memcpy(dst + produced, src + in, count);
+      in += count;
+      produced += count;
+    } else if (header != -128) {
+      const std::size_t count = static_cast<std::size_t>(1 - header);
+      if (in >= src_size || produced + count > dst_size) {
+        return 0;
+      }
+      std::memset(dst + produced, src[in++], count);
+      produced += count;
+    }
+  }
+  return in;
+}
+
+}  // namespace ps::core
@@ -0,0 +1,196 @@
+#include "ps/core/pixel_conversion.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace ps::core {
+
+namespace {
+
+// Rounded a * b / 255 and a * b / 65535 without a division
+inline std::uint32_t mul_div_255(std::uint32_t a, std::uint32_t b) {
+  const std::uint32_t t = a * b + 128;
+  return (t + (t >> 8)) >> 8;
+}
+
+inline std::uint32_t mul_div_65535(std::uint32_t a, std::uint32_t b) {
+  const std::uint32_t t = a * b + 32768;
+  return (t + (t >> 16)) >> 16;
+}
+
+inline void load16(const std::uint8_t* src, std::uint16_t* px) {
+  std::memcpy(px, src, 4 * sizeof(std::uint16_t));
+}
+
+inline void store16(std::uint8_t* dst, const std::uint16_t* px) {
+  std::memcpy(dst, px, 4 * sizeof(std::uint16_t));
+}
+
+// Converts one pixel; src and dst may alias
+void convert_pixel(const std::uint8_t* src, PixelFormat src_format,
+                   std::uint8_t* dst, PixelFormat dst_format) {
+  // Decode into 16-bit straight or premultiplied components
+  std::uint32_t c[3];
+  std::uint32_t a = 0;
+  bool premul = false;
+  bool wide = false;
+  switch (src_format) {
+    case PixelFormat::RGBA8:
+    case PixelFormat::RGBA8Premul:
+      c[0] = src[0];
+      c[1] = src[1];
+      c[2] = src[2];
+      a = src[3];
+      premul = src_format == PixelFormat::RGBA8Premul;
+      break;
+    default: {
+      std::uint16_t px[4];
+      load16(src, px);
+      c[0] = px[0];
+      c[1] = px[1];
+      c[2] = px[2];
+      a = px[3];
+      premul = true;
+      wide = true;
+      break;
+    }
+  }
+
+  switch (dst_format) {
+    case PixelFormat::RGBA8: {
+      // Straight alpha: undo the premultiplication
+      std::uint8_t out[4];
+      std::uint32_t a8 = wide ? (a * 255 + 32767) / 65535 : a;
+      for (int i = 0; i < 3; ++i) {
+        std::uint32_t value = c[i];
+        if (premul) {
+          value = a == 0 ? 0 : std::min<std::uint32_t>(255, (value * 255 + a / 2) / a);
+        }
+        out[i] = static_cast<std::uint8_t>(value);
+      }
+      out[3] = static_cast<std::uint8_t>(a8);
+      std::memcpy(dst, out, 4);
+      break;
+    }
+    case PixelFormat::RGBA8Premul: {
+      std::uint8_t out[4];
+      for (int i = 0; i < 3; ++i) {
+        std::uint32_t value = c[i];
+        if (wide) {
+          value = (value * 255 + 32767) / 65535;
+        } else if (!premul) {
+          value = mul_div_255(value, a);
+        }
+        out[i] = static_cast<std::uint8_t>(value);
+      }
+      out[3] = static_cast<std::uint8_t>(wide ? (a * 255 + 32767) / 65535 : a);
+      std::memcpy(dst, out, 4);
+      break;
+    }
+    default: {
+      std::uint16_t out[4];
+      const std::uint32_t a16 = wide ? a : a * 257;
+      for (int i = 0; i < 3; ++i) {
+        std::uint32_t value = c[i];
+        if (!wide) {
+          value *= 257;
+          if (!premul) {
+            value = mul_div_65535(value, a16);
+          }
+        }
+        out[i] = static_cast<std::uint16_t>(value);
+      }
+      out[3] = static_cast<std::uint16_t>(a16);
+      store16(dst, out);
+      break;
+    }
+  }
+}
+
+void check_rgba(PixelFormat format) {
+  if (!is_rgba_format(format)) {
+    throw std::invalid_argument("pixel format is not an RGBA layer format");
+  }
+}
+
+}  // namespace
+
+bool is_rgba_format(PixelFormat format) {
+  return format == PixelFormat::RGBA8 || format == PixelFormat::RGBA8Premul ||
+         format == PixelFormat::RGBA16Premul;
+}
+
+bool is_premultiplied(PixelFormat format) {
+  return format == PixelFormat::RGBA8Premul || format == PixelFormat::RGBA16Premul;
+}
+
+void convert_rgba_span(const std::uint8_t* src, PixelFormat src_format,
+                       std::uint8_t* dst, PixelFormat dst_format, int count) {
+  check_rgba(src_format);
+  check_rgba(dst_format);
+
+  if (src_format == dst_format) {
+    if (src != dst) {
+      std::memmove(dst, src, static_cast<std::size_t>(count) * bytes_per_pixel(src_format));
+    }
+    return;
+  }
+
+  const std::size_t src_bpp = bytes_per_pixel(src_format);
+  const std::size_t dst_bpp = bytes_per_pixel(dst_format);
+  if (src_format == PixelFormat::RGBA8 && dst_format == PixelFormat::RGBA8Premul) {
+    // The common import path, kept free of per-pixel format switches
+    for (int i = 0; i < count; ++i, src += 4, dst += 4) {
+      const std::uint32_t a = src[3];
+      dst[0] = static_cast<std::uint8_t>(mul_div_255(src[0], a));
+      dst[1] = static_cast<std::uint8_t>(mul_div_255(src[1], a));
+      dst[2] = static_cast<std::uint8_t>(mul_div_255(src[2], a));
+      dst[3] = static_cast<std::uint8_t>(a);
+    }
+    return;
+  }
+
+  for (int i = 0; i < count; ++i, src += src_bpp, dst += dst_bpp) {
+    convert_pixel(src, src_format, dst, dst_format);
+  }
+}
+
+ImageBuffer convert_rgba_buffer(const ImageBuffer& src, PixelFormat format) {
+  check_rgba(src.format());
+  check_rgba(format);
+
+  if (src.format() == format) {
+    return src;
+  }
+
+  const Size size = src.size();
+  ImageBuffer dst(size, format, src.layout(), BufferInit::Uninitialized);
+  if (!src.is_tiled()) {
+    for (int y = 0; y < size.height; ++y) {
+      convert_rgba_span(src.pixel_row(0, y), src.format(),
+                        dst.mutable_pixel_row(0, y), format, size.width);
+    }
+    return dst;
+  }
+
+  // Unallocated tiles are transparent in every format and stay unallocated
+  for (int ty = 0; ty < src.tile_rows(); ++ty) {
+    for (int tx = 0; tx < src.tile_columns(); ++tx) {
+      if (!src.shared_tile(tx, ty)) {
+        continue;
+      }
+      const int x0 = tx * ImageBuffer::kTileSize;
+      const int y0 = ty * ImageBuffer::kTileSize;
+      const int width = std::min(ImageBuffer::kTileSize, size.width - x0);
+      const int height = std::min(ImageBuffer::kTileSize, size.height - y0);
+      for (int y = y0; y < y0 + height; ++y) {
+        convert_rgba_span(src.pixel_row(x0, y), src.format(),
+                          dst.mutable_pixel_row(x0, y), format, width);
+      }
+    }
+  }
+  return dst;
+}
+
+}  // namespace ps::core
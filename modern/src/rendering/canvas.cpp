@@ -4,261 +4,403 @@
 #include <cmath>
 
 #include "ps/core/layer_blend.h"
+#include "ps/core/pixel_accessor.h"
+#include "ps/core/pixel_conversion.h"
+#include "ps/core/thread_pool.h"
 
 namespace ps::rendering {
 
-Canvas::Canvas() : viewport_() {}
-
-Canvas::Canvas(const Viewport& viewport) : viewport_(viewport) {}
+namespace {
 
-void Canvas::render(const core::ImageDocument& doc, CanvasBuffer& buffer) {
-  render_background(buffer);
-  render_image(doc, buffer);
+// Rounded a * b / 255
+std::uint8_t mul_div_255(std::uint32_t a, std::uint32_t b) {
+  const std::uint32_t t = a * b + 128;
+  return static_cast<std::uint8_t>((t + (t >> 8)) >> 8);
 }
 
-void Canvas::render_with_overlay(const core::ImageDocument& doc,
-                                 CanvasBuffer& buffer,
-                                 const SelectionOverlay& overlay) {
-  render_background(buffer);
-  render_image(doc, buffer);
+// Screen rows and columns that show image pixels and the image pixels
+// they sample. Built once per frame, so the per-pixel work is a table
+// lookup instead of a viewport transform and bounds checks.
+struct ScanlineMap {
+  int x0 = 0;  ///< First screen column over the image
+  int x1 = 0;  ///< One past the last screen column over the image
+  int y0 = 0;  ///< First screen row over the image
+  int y1 = 0;  ///< One past the last screen row over the image
+  std::vector<int> columns;  ///< Image column per screen column (left tap)
+  std::vector<int> rows;     ///< Image row per screen row (top tap)
+  // Bilinear only: second taps and their weights (0-256)
+  std::vector<int> next_columns;
+  std::vector<int> next_rows;
+  std::vector<std::uint16_t> column_weights;
+  std::vector<std::uint16_t> row_weights;
+  int source_x0 = 0;  ///< Leftmost image column read
+  int source_x1 = 0;  ///< One past the rightmost image column read
+
+  bool empty() const { return x0 >= x1 || y0 >= y1; }
+};
+
+// Only screen pixels inside @p area are mapped. @p level selects a mip
+// level: screen coverage is still decided on the full-size image, but taps
+// index an image reduced by 2^level.
+ScanlineMap map_scanlines(const Viewport& viewport, core::Size image_size,
+                          const core::Rect& area, SampleFilter filter,
+                          int level = 0) {
+  ScanlineMap map;
+  const bool bilinear = filter == SampleFilter::Bilinear;
+  const ViewportPoint pan = viewport.pan_offset();
+  const float zoom = viewport.zoom();
+  const float scale = 1.0f / static_cast<float>(1 << level);
+
+  // Screen coordinate s shows image coordinate (s - pan) / zoom, exactly as
+  // Viewport::viewport_to_image() computes it. The mapping is monotonic, so
+  // the screen positions over the image form one contiguous run per axis.
+  const auto map_axis = [&](int begin, int end, int image_extent, float offset,
+                            int& first, int& last, std::vector<int>& taps,
+                            std::vector<int>& next_taps,
+                            std::vector<std::uint16_t>& weights) {
+    first = begin;
+    last = begin;
+    for (int s = begin; s < end; ++s) {
+      const float position = (static_cast<float>(s) - offset) / zoom;
+      if (position < 0.0f || position >= image_extent) {
+        if (last > first) {
+          break;
+        }
+        first = s + 1;
+        last = s + 1;
+        continue;
+      }
+      last = s + 1;
 
-  if (overlay.enabled) {
-    render_selection_overlay(buffer, overlay);
-  }
-}
+      const int source_extent = (image_extent + (1 << level) - 1) >> level;
+      if (!bilinear) {
+        taps.push_back(
+            std::min(static_cast<int>(position * scale), source_extent - 1));
+        continue;
+      }
 
-void Canvas::render_background(CanvasBuffer& buffer) {
-  if (checkerboard_enabled_) {
-    render_checkerboard(buffer);
-  } else {
-    buffer.clear(background_color_);
+      // Bilinear samples at pixel centers
+      const float center =
+          (static_cast<float>(s) + 0.5f - offset) / zoom * scale - 0.5f;
+      int tap = static_cast<int>(std::floor(center));
+      int weight = static_cast<int>((center - tap) * 256.0f + 0.5f);
+      if (tap < 0) {
+        tap = 0;
+        weight = 0;
+      } else if (tap >= source_extent - 1) {
+        tap = source_extent - 1;
+        weight = 0;
+      }
+      taps.push_back(tap);
+      next_taps.push_back(std::min(tap + 1, source_extent - 1));
+      weights.push_back(static_cast<std::uint16_t>(weight));
+    }
+  };
+
+  map_axis(area.x, area.x + area.width, image_size.width, pan.x, map.x0, map.x1,
+           map.columns,
+           map.next_columns, map.column_weights);
+  map_axis(area.y, area.y + area.height, image_size.height, pan.y, map.y0, map.y1,
+           map.rows,
+           map.next_rows, map.row_weights);
+
+  if (!map.columns.empty()) {
+    map.source_x0 = map.columns.front();
+    map.source_x1 = (bilinear ? map.next_columns.back() : map.columns.back()) + 1;
   }
+  return map;
 }
 
-void Canvas::render_checkerboard(CanvasBuffer& buffer, int checker_size) {
-  const RGBAPixel light{200, 200, 200, 255};
-  const RGBAPixel dark{150, 150, 150, 255};
-
-  for (int y = 0; y < buffer.height; ++y) {
-    for (int x = 0; x < buffer.width; ++x) {
-      const int checker_x = x / checker_size;
-      const int checker_y = y / checker_size;
-      const bool is_light = (checker_x + checker_y) % 2 == 0;
-
-      buffer.at(x, y) = is_light ? light : dark;
-    }
-  }
+RGBAPixel lerp(RGBAPixel a, RGBAPixel b, int weight) {
+  const auto mix = [weight](int from, int to) {
+    return static_cast<std::uint8_t>(from + (((to - from) * weight + 128) >> 8));
+  };
+  return RGBAPixel(mix(a.r, b.r), mix(a.g, b.g), mix(a.b, b.b), mix(a.a, b.a));
 }
 
-void Canvas::render_image(const core::ImageDocument& doc, CanvasBuffer& buffer) {
-  const core::Size doc_size = doc.size();
-  if (doc_size.width <= 0 || doc_size.height <= 0) {
+// Walks the mapped screen rows on the ThreadPool. fetch(y, x0, count,
+// scratch, out) reads image row y from x0 as RGBAPixels; each image row is
+// fetched once per run of screen rows that samples it. blend(samples, out,
+// count) then composites the run of samples for one screen row.
+template <typename Fetch, typename Blend>
+void render_mapped(const ScanlineMap& map, CanvasBuffer& buffer, Fetch fetch,
+                   Blend blend) {
+  if (map.empty()) {
     return;
   }
 
-  // Use layer-based rendering if layers exist
-  if (doc.layer_count() > 0) {
-    render_layers(doc, buffer);
-    return;
-  }
+  const bool bilinear = !map.column_weights.empty();
+  const int source_count = map.source_x1 - map.source_x0;
+  const int count = map.x1 - map.x0;
+  const int grain = std::max(1, 16384 / count);
+
+  core::ThreadPool::instance().parallel_for(map.y0, map.y1, grain, [&](int y_begin,
+                                                                       int y_end) {
+    // Two slots hold adjacent image rows, which have different parity
+    std::vector<RGBAPixel> source_rows[2] = {std::vector<RGBAPixel>(source_count),
+                                             std::vector<RGBAPixel>(source_count)};
+    int fetched[2] = {-1, -1};
+    std::vector<std::uint8_t> scratch;
+    std::vector<RGBAPixel> samples(count);
+
+    const auto source_row = [&](int iy) {
+      const int slot = iy & 1;
+      if (fetched[slot] != iy) {
+        fetch(iy, map.source_x0, source_count, scratch, source_rows[slot].data());
+        fetched[slot] = iy;
+      }
+      return source_rows[slot].data();
+    };
 
-  // Fall back to channel-based rendering
-  for (int y = 0; y < buffer.height; ++y) {
-    for (int x = 0; x < buffer.width; ++x) {
-      const ViewportPoint vp(static_cast<float>(x), static_cast<float>(y));
-      const ImagePoint ip = viewport_.viewport_to_image(vp);
-
-      if (ip.x >= 0 && ip.x < doc_size.width &&
-          ip.y >= 0 && ip.y < doc_size.height) {
-        const RGBAPixel sampled = sample_image(doc, ip.x, ip.y);
-        const RGBAPixel bg = buffer.at(x, y);
-        buffer.at(x, y) = blend_pixels(bg, sampled);
+    for (int y = y_begin; y < y_end; ++y) {
+      const int r = y - map.y0;
+      const RGBAPixel* top = source_row(map.rows[r]);
+
+      if (!bilinear) {
+        for (int i = 0; i < count; ++i) {
+          samples[i] = top[map.columns[i] - map.source_x0];
+        }
+      } else {
+        // Adjacent rows use different slots, so this keeps top valid
+        const RGBAPixel* bottom = source_row(map.next_rows[r]);
+        const int row_weight = map.row_weights[r];
+        for (int i = 0; i < count; ++i) {
+          const int left = map.columns[i] - map.source_x0;
+          const int right = map.next_columns[i] - map.source_x0;
+          const int weight = map.column_weights[i];
+          samples[i] = lerp(lerp(top[left], top[right], weight),
+                            lerp(bottom[left], bottom[right], weight), row_weight);
+        }
       }
+
+      blend(samples.data(), &buffer.at(map.x0, y), count);
     }
-  }
+  });
 }
 
-void Canvas::render_layers(const core::ImageDocument& doc, CanvasBuffer& buffer) {
-  const core::Size doc_size = doc.size();
-
-  for (int y = 0; y < buffer.height; ++y) {
-    for (int x = 0; x < buffer.width; ++x) {
-      const ViewportPoint vp(static_cast<float>(x), static_cast<float>(y));
-      const ImagePoint ip = viewport_.viewport_to_image(vp);
-
-      if (ip.x < 0 || ip.x >= doc_size.width ||
-          ip.y < 0 || ip.y >= doc_size.height) {
-        continue;
-      }
+// Reads @p count pixels of a composite row as 8-bit RGBA, premultiplied if
+// the composite is
+void fetch_composite_row(const core::ImageBuffer& composite, int y, int x0, int count,
+                         std::vector<std::uint8_t>& scratch, RGBAPixel* out) {
+  std::uint8_t* bytes = reinterpret_cast<std::uint8_t*>(out);
+  if (composite.format() == core::PixelFormat::RGBA16Premul) {
+    scratch.resize(static_cast<std::size_t>(count) * 8);
+    composite.read_pixels(x0, y, count, scratch.data());
+    core::convert_rgba_span(scratch.data(), core::PixelFormat::RGBA16Premul, bytes,
+                            core::PixelFormat::RGBA8Premul, count);
+    return;
+  }
+  composite.read_pixels(x0, y, count, bytes);
+}
 
-      RGBAPixel composite = buffer.at(x, y);
+}  // namespace
 
-      // Composite all visible layers from bottom to top
-      for (std::size_t i = 0; i < doc.layer_count(); ++i) {
-        const core::Layer& layer = doc.layer_at(i);
+Canvas::Canvas() : viewport_() {}
 
-        if (!layer.visible()) {
-          continue;
-        }
+Canvas::Canvas(const Viewport& viewport) : viewport_(viewport) {}
 
-        const RGBAPixel layer_pixel = sample_layer(layer, ip.x, ip.y);
+void Canvas::render(const core::ImageDocument& doc, CanvasBuffer& buffer) {
+  const core::Rect area{0, 0, buffer.width, buffer.height};
+  render_background(buffer, area);
+  render_image(doc, buffer, area);
+}
 
-        // Apply layer blending
-        std::uint8_t r = composite.r;
-        std::uint8_t g = composite.g;
-        std::uint8_t b = composite.b;
-        std::uint8_t a = composite.a;
+void Canvas::render_with_overlay(const core::ImageDocument& doc,
+                                 CanvasBuffer& buffer,
+                                 const SelectionOverlay& overlay) {
+  render_region(doc, buffer, overlay, core::Rect{0, 0, buffer.width, buffer.height});
+}
 
-        core::blend_pixel(
-          layer_pixel.r, layer_pixel.g, layer_pixel.b, layer_pixel.a,
-          r, g, b, a,
-          layer.opacity(),
-          layer.blend_mode()
-        );
+void Canvas::render_region(const core::ImageDocument& doc, CanvasBuffer& buffer,
+                           const SelectionOverlay& overlay, const core::Rect& area) {
+  const core::Rect clipped = area.intersected(core::Rect{0, 0, buffer.width, buffer.height});
+  if (clipped.is_empty()) {
+    return;
+  }
 
-        composite = RGBAPixel(r, g, b, a);
-      }
+  render_background(buffer, clipped);
+  render_image(doc, buffer, clipped);
 
-      buffer.at(x, y) = composite;
-    }
+  if (overlay.enabled) {
+    render_selection_overlay(buffer, overlay, clipped);
   }
 }
 
-void Canvas::render_selection_overlay(CanvasBuffer& buffer,
-                                      const SelectionOverlay& overlay) {
-  if (!overlay.mask) {
-    return;
+core::Rect Canvas::screen_rect_for(const core::Rect& image_area,
+                                   const CanvasBuffer& buffer) const {
+  if (image_area.is_empty()) {
+    return core::Rect{};
   }
 
-  const core::SelectionMask& mask = *overlay.mask;
-  if (!mask.has_selection()) {
+  // Zoomed out, a changed pixel alters its whole mip block; bilinear taps
+  // and rounding reach one block further
+  const int block = 1 << MipPyramid::level_for_zoom(viewport_.zoom());
+  const int x0 = (image_area.x / block - 1) * block;
+  const int y0 = (image_area.y / block - 1) * block;
+  const int x1 = ((image_area.x + image_area.width + block - 1) / block + 1) * block;
+  const int y1 = ((image_area.y + image_area.height + block - 1) / block + 1) * block;
+
+  const ViewportPoint top_left =
+      viewport_.image_to_viewport(ImagePoint(static_cast<float>(x0), static_cast<float>(y0)));
+  const ViewportPoint bottom_right =
+      viewport_.image_to_viewport(ImagePoint(static_cast<float>(x1), static_cast<float>(y1)));
+  const int sx0 = static_cast<int>(std::floor(top_left.x)) - 1;
+  const int sy0 = static_cast<int>(std::floor(top_left.y)) - 1;
+  const int sx1 = static_cast<int>(std::ceil(bottom_right.x)) + 1;
+  const int sy1 = static_cast<int>(std::ceil(bottom_right.y)) + 1;
+
+  return core::Rect{sx0, sy0, sx1 - sx0, sy1 - sy0}.intersected(
+      core::Rect{0, 0, buffer.width, buffer.height});
+}
+
+void Canvas::render_background(CanvasBuffer& buffer, const core::Rect& area) {
+  if (checkerboard_enabled_) {
+    render_checkerboard(buffer, area);
     return;
   }
+  for (int y = area.y; y < area.y + area.height; ++y) {
+    RGBAPixel* row = &buffer.at(area.x, y);
+    std::fill(row, row + area.width, background_color_);
+  }
+}
 
-  const core::Size mask_size = mask.size();
-  const int frame_offset = overlay.animation_frame % 8;
+void Canvas::render_checkerboard(CanvasBuffer& buffer, const core::Rect& area,
+                                 int checker_size) {
+  const RGBAPixel light{200, 200, 200, 255};
+  const RGBAPixel dark{150, 150, 150, 255};
 
-  for (int y = 0; y < buffer.height; ++y) {
+  // Every row is one of two patterns; build both once and copy them
+  std::vector<RGBAPixel> patterns[2];
+  for (int phase = 0; phase < 2; ++phase) {
+    patterns[phase].resize(buffer.width);
     for (int x = 0; x < buffer.width; ++x) {
-      const ViewportPoint vp(static_cast<float>(x), static_cast<float>(y));
-      const ImagePoint ip = viewport_.viewport_to_image(vp);
-      const int ix = static_cast<int>(std::floor(ip.x));
-      const int iy = static_cast<int>(std::floor(ip.y));
-
-      if (ix < 0 || iy < 0 || ix >= mask_size.width || iy >= mask_size.height) {
-        continue;
-      }
-
-      if (!mask.is_selected(ix, iy)) {
-        continue;
-      }
-
-      const bool edge =
-          !mask.is_selected(ix - 1, iy) ||
-          !mask.is_selected(ix + 1, iy) ||
-          !mask.is_selected(ix, iy - 1) ||
-          !mask.is_selected(ix, iy + 1);
-
-      if (!edge) {
-        continue;
-      }
-
-      const bool show_pixel = ((ix + iy + frame_offset) / 4) % 2 == 0;
-      if (show_pixel) {
-        const RGBAPixel bg = buffer.at(x, y);
-        buffer.at(x, y) = blend_pixels(bg, overlay.color);
-      }
+      const bool is_light = (x / checker_size + phase) % 2 == 0;
+      patterns[phase][x] = is_light ? light : dark;
     }
   }
-}
 
-RGBAPixel Canvas::sample_layer(const core::Layer& layer, float x, float y) {
-  const core::Size layer_size = layer.size();
-  const int ix = std::clamp(static_cast<int>(x), 0, layer_size.width - 1);
-  const int iy = std::clamp(static_cast<int>(y), 0, layer_size.height - 1);
-
-  const int pixel_index = iy * layer_size.width + ix;
-  const int byte_index = pixel_index * 4;  // RGBA8 format
+  for (int y = area.y; y < area.y + area.height; ++y) {
+    const std::vector<RGBAPixel>& row = patterns[(y / checker_size) % 2];
+    std::copy(row.begin() + area.x, row.begin() + area.x + area.width, &buffer.at(area.x, y));
+  }
+}
 
-  const std::uint8_t* data = layer.buffer().data();
+void Canvas::render_image(const core::ImageDocument& doc, CanvasBuffer& buffer,
+                          const core::Rect& area) {
+  if (doc.layer_count() > 0) {
+    render_layers(doc, buffer, area);
+    return;
+  }
 
-  return RGBAPixel(
-    data[byte_index],      // R
-    data[byte_index + 1],  // G
-    data[byte_index + 2],  // B
-    data[byte_index + 3]   // A
-  );
+  // Fall back to channel-based rendering. The color mode is resolved once
+  // here, so the row conversion is compiled per channel layout.
+  const ScanlineMap map = map_scanlines(viewport_, doc.size(), area, sample_filter_);
+  core::dispatch_channels(doc, [&](const auto& pixels) {
+    render_mapped(map, buffer,
+                  [&](int y, int x0, int count, std::vector<std::uint8_t>& scratch,
+                      RGBAPixel* out) {
+                    scratch.resize(static_cast<std::size_t>(count) * pixels.kPlanes);
+                    pixels.read_planes(y, x0, count, scratch.data());
+                    pixels.to_rgba(scratch.data(), count,
+                                   reinterpret_cast<std::uint8_t*>(out));
+                  },
+                  [&](const RGBAPixel* samples, RGBAPixel* out, int count) {
+                    for (int i = 0; i < count; ++i) {
+                      out[i] = blend_pixels(out[i], samples[i]);
+                    }
+                  });
+  });
 }
 
-RGBAPixel Canvas::sample_image(const core::ImageDocument& doc, float x, float y) {
-  const core::Size doc_size = doc.size();
-  const int ix = std::clamp(static_cast<int>(x), 0, doc_size.width - 1);
-  const int iy = std::clamp(static_cast<int>(y), 0, doc_size.height - 1);
-
-  const auto& channels = doc.channels();
-  if (channels.empty()) {
-    return RGBAPixel(0, 0, 0, 255);
+void Canvas::render_layers(const core::ImageDocument& doc, CanvasBuffer& buffer,
+                           const core::Rect& area) {
+  // The document caches the layer stack composite and only recomposites
+  // damaged areas, so a frame costs one lookup and blend per screen pixel
+  // regardless of the number of layers.
+  //
+  // Zoomed out, the canvas samples the mip level that is closest to the
+  // display size, so the work tracks the screen size rather than the
+  // document size and minification does not alias.
+  int level = 0;
+  const core::ImageBuffer* source = &doc.composite();
+  if (viewport_.zoom() < 1.0f) {
+    pyramid_.update(doc);
+    level = std::min(MipPyramid::level_for_zoom(viewport_.zoom()),
+                     pyramid_.level_count() - 1);
+    source = &pyramid_.level(level);
   }
+  const core::ImageBuffer& composite = *source;
+  const bool premultiplied = core::is_premultiplied(composite.format());
+
+  const ScanlineMap map =
+      map_scanlines(viewport_, doc.size(), area, sample_filter_, level);
+  render_mapped(map, buffer,
+                [&](int y, int x0, int count, std::vector<std::uint8_t>& scratch,
+                    RGBAPixel* out) {
+                  fetch_composite_row(composite, y, x0, count, scratch, out);
+                },
+                [&](const RGBAPixel* samples, RGBAPixel* out, int count) {
+                  if (!premultiplied) {
+                    core::composite_span(reinterpret_cast<const std::uint8_t*>(samples),
+                                         reinterpret_cast<std::uint8_t*>(out), count,
+                                         100, core::BlendMode::Normal);
+                    return;
+                  }
+                  // Source-over needs no division when the source is
+                  // premultiplied
+                  for (int i = 0; i < count; ++i) {
+                    const RGBAPixel pixel = samples[i];
+                    const std::uint32_t inv_alpha = 255 - pixel.a;
+                    RGBAPixel& dst = out[i];
+                    dst.r = static_cast<std::uint8_t>(pixel.r + mul_div_255(dst.r, inv_alpha));
+                    dst.g = static_cast<std::uint8_t>(pixel.g + mul_div_255(dst.g, inv_alpha));
+                    dst.b = static_cast<std::uint8_t>(pixel.b + mul_div_255(dst.b, inv_alpha));
+                    dst.a = static_cast<std::uint8_t>(pixel.a + mul_div_255(dst.a, inv_alpha));
+                  }
+                });
+}
 
-  const core::ColorMode mode = doc.mode();
-  const int pixel_index = iy * doc_size.width + ix;
+void Canvas::render_selection_overlay(CanvasBuffer& buffer,
+                                      const SelectionOverlay& overlay,
+                                      const core::Rect& area) {
+  if (!overlay.mask) {
+    return;
+  }
 
-  if (mode == core::ColorMode::Grayscale && channels.size() >= 1) {
-    const auto* data = channels[0].buffer.data();
-    const std::size_t bytes_per_pixel =
-        core::bytes_per_pixel(channels[0].buffer.format());
-    const std::uint8_t gray = data[pixel_index * bytes_per_pixel];
-    return RGBAPixel(gray, gray, gray, 255);
+  // Only outline pixels carry ants, and the mask keeps them as runs, so the
+  // cost follows the outline length instead of the selected area
+  const std::vector<core::SelectionMask::OutlineRun>& outline = overlay.mask->outline();
+  if (outline.empty()) {
+    return;
   }
 
-  if (mode == core::ColorMode::RGB && channels.size() >= 3) {
-    std::uint8_t r = 0, g = 0, b = 0, a = 255;
-
-    for (std::size_t c = 0; c < std::min(channels.size(), std::size_t(4)); ++c) {
-      const auto& channel = channels[c];
-      const auto* data = channel.buffer.data();
-      const std::size_t bytes_per_pixel =
-          core::bytes_per_pixel(channel.buffer.format());
-      const std::uint8_t value = data[pixel_index * bytes_per_pixel];
-
-      switch (c) {
-        case 0: r = value; break;
-        case 1: g = value; break;
-        case 2: b = value; break;
-        case 3: a = value; break;
+  const ScanlineMap map =
+      map_scanlines(viewport_, overlay.mask->size(), area, SampleFilter::Nearest);
+  const int frame_offset = overlay.animation_frame % 8;
+  const auto columns_begin = map.columns.begin();
+  const auto columns_end = map.columns.end();
+
+  for (int y = map.y0; y < map.y1; ++y) {
+    const int iy = map.rows[y - map.y0];
+    auto run = std::lower_bound(outline.begin(), outline.end(), iy,
+                                [](const core::SelectionMask::OutlineRun& r, int row) {
+                                  return r.y < row;
+                                });
+    for (; run != outline.end() && run->y == iy; ++run) {
+      // Screen columns are in image column order, so each run maps to one
+      // contiguous span of them
+      auto column = std::lower_bound(columns_begin, columns_end, run->x0);
+      for (; column != columns_end && *column < run->x1; ++column) {
+        const int ix = *column;
+        const bool show_pixel = ((ix + iy + frame_offset) / 4) % 2 == 0;
+        if (show_pixel) {
+          const int x = map.x0 + static_cast<int>(column - columns_begin);
+          const RGBAPixel bg = buffer.at(x, y);
+          buffer.at(x, y) = blend_pixels(bg, overlay.color);
+        }
       }
     }
-
-    return RGBAPixel(r, g, b, a);
   }
-
-  if (mode == core::ColorMode::CMYK && channels.size() >= 4) {
-    const auto* c_data = channels[0].buffer.data();
-    const auto* m_data = channels[1].buffer.data();
-    const auto* y_data = channels[2].buffer.data();
-    const auto* k_data = channels[3].buffer.data();
-
-    const std::size_t bytes_per_pixel =
-        core::bytes_per_pixel(channels[0].buffer.format());
-    const std::size_t idx = pixel_index * bytes_per_pixel;
-
-    const std::uint8_t c = c_data[idx];
-    const std::uint8_t m = m_data[idx];
-    const std::uint8_t y_val = y_data[idx];
-    const std::uint8_t k = k_data[idx];
-
-    // Simple CMYK to RGB conversion
-    const std::uint8_t r = static_cast<std::uint8_t>(
-        (255 - c) * (255 - k) / 255);
-    const std::uint8_t g = static_cast<std::uint8_t>(
-        (255 - m) * (255 - k) / 255);
-    const std::uint8_t b = static_cast<std::uint8_t>(
-        (255 - y_val) * (255 - k) / 255);
-
-    return RGBAPixel(r, g, b, 255);
-  }
-
-  return RGBAPixel(0, 0, 0, 255);
 }
 
 RGBAPixel Canvas::blend_pixels(RGBAPixel bottom, RGBAPixel top) {
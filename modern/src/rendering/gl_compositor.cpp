@@ -0,0 +1,933 @@
+#include "ps/rendering/gl_compositor.h"
+
+#if defined(__APPLE__)
+#include <OpenGL/gl.h>
+#include <OpenGL/glext.h>
+#else
+#include <GL/gl.h>
+#include <GL/glext.h>
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "ps/core/pixel_conversion.h"
+#include "ps/rendering/mip_pyramid.h"
+
+namespace ps::rendering {
+
+namespace {
+
+static_assert(static_cast<int>(core::BlendMode::Exclusion) == 11,
+              "the blend shader numbers modes like BlendMode");
+
+// Texels kept around each tile. Bilinear taps and the selection edge test
+// reach into neighbouring tiles, and a multiple of 16 keeps the first four
+// mip levels on the same 2×2 block grid as MipPyramid.
+constexpr int kApron = 16;
+
+// OpenGL 2.0 and framebuffer object entry points, loaded at runtime
+#define PS_GL_FUNCTIONS(X)                                              \
+  X(PFNGLACTIVETEXTUREPROC, ActiveTexture)                              \
+  X(PFNGLCREATESHADERPROC, CreateShader)                                \
+  X(PFNGLSHADERSOURCEPROC, ShaderSource)                                \
+  X(PFNGLCOMPILESHADERPROC, CompileShader)                              \
+  X(PFNGLGETSHADERIVPROC, GetShaderiv)                                  \
+  X(PFNGLGETSHADERINFOLOGPROC, GetShaderInfoLog)                        \
+  X(PFNGLDELETESHADERPROC, DeleteShader)                                \
+  X(PFNGLCREATEPROGRAMPROC, CreateProgram)                              \
+  X(PFNGLATTACHSHADERPROC, AttachShader)                                \
+  X(PFNGLBINDATTRIBLOCATIONPROC, BindAttribLocation)                    \
+  X(PFNGLLINKPROGRAMPROC, LinkProgram)                                  \
+  X(PFNGLGETPROGRAMIVPROC, GetProgramiv)                                \
+  X(PFNGLGETPROGRAMINFOLOGPROC, GetProgramInfoLog)                      \
+  X(PFNGLDELETEPROGRAMPROC, DeleteProgram)                              \
+  X(PFNGLUSEPROGRAMPROC, UseProgram)                                    \
+  X(PFNGLGETUNIFORMLOCATIONPROC, GetUniformLocation)                    \
+  X(PFNGLUNIFORM1IPROC, Uniform1i)                                      \
+  X(PFNGLUNIFORM1FPROC, Uniform1f)                                      \
+  X(PFNGLUNIFORM2FPROC, Uniform2f)                                      \
+  X(PFNGLUNIFORM4FPROC, Uniform4f)                                      \
+  X(PFNGLENABLEVERTEXATTRIBARRAYPROC, EnableVertexAttribArray)          \
+  X(PFNGLDISABLEVERTEXATTRIBARRAYPROC, DisableVertexAttribArray)        \
+  X(PFNGLVERTEXATTRIBPOINTERPROC, VertexAttribPointer)                  \
+  X(PFNGLGENFRAMEBUFFERSPROC, GenFramebuffers)                          \
+  X(PFNGLDELETEFRAMEBUFFERSPROC, DeleteFramebuffers)                    \
+  X(PFNGLBINDFRAMEBUFFERPROC, BindFramebuffer)                          \
+  X(PFNGLFRAMEBUFFERTEXTURE2DPROC, FramebufferTexture2D)                \
+  X(PFNGLCHECKFRAMEBUFFERSTATUSPROC, CheckFramebufferStatus)            \
+  X(PFNGLGENERATEMIPMAPPROC, GenerateMipmap)
+
+struct Functions {
+#define PS_GL_DECLARE(type, name) type name = nullptr;
+  PS_GL_FUNCTIONS(PS_GL_DECLARE)
+#undef PS_GL_DECLARE
+
+  // Tries the core name first and the EXT name of older drivers second
+  bool load(GlCompositor::ProcLoader loader) {
+    bool complete = true;
+    const auto find = [&](const char* name) {
+      void* address = loader(name);
+      if (!address) {
+        address = loader((std::string(name) + "EXT").c_str());
+      }
+      complete = complete && address != nullptr;
+      return address;
+    };
+#define PS_GL_LOAD(type, name) name = reinterpret_cast<type>(find("gl" #name));
+    PS_GL_FUNCTIONS(PS_GL_LOAD)
+#undef PS_GL_LOAD
+    return complete;
+  }
+};
+
+#undef PS_GL_FUNCTIONS
+
+// Quads are given in target pixels; the fragment shaders work from
+// gl_FragCoord, whose row 0 is the first row of the target texture
+const char* const kVertexShader = R"(
+#version 120
+attribute vec2 a_position;
+uniform vec2 u_target_size;
+void main() {
+  gl_Position = vec4(a_position / u_target_size * 2.0 - 1.0, 0.0, 1.0);
+}
+)";
+
+// Blends one layer onto a copy of the composite below it. The formulas
+// follow layer_blend.cpp: blend_reference() for straight RGBA8 and the
+// separable formula of the premultiplied kernels.
+const char* const kBlendShader = R"(
+#version 120
+uniform sampler2D u_layer;
+uniform sampler2D u_backdrop;
+uniform vec2 u_layer_size;
+uniform vec2 u_backdrop_size;
+uniform int u_mode;
+uniform float u_opacity;
+uniform bool u_premultiplied;
+
+float blend_channel(float s, float d) {
+  if (u_mode == 1) return s * d;
+  if (u_mode == 2) return 1.0 - (1.0 - s) * (1.0 - d);
+  if (u_mode == 3) return d < 0.5 ? 2.0 * s * d : 1.0 - 2.0 * (1.0 - s) * (1.0 - d);
+  if (u_mode == 4) return min(s, d);
+  if (u_mode == 5) return max(s, d);
+  if (u_mode == 6) return s >= 1.0 ? 1.0 : min(1.0, d / (1.0 - s));
+  if (u_mode == 7) return s <= 0.0 ? 0.0 : 1.0 - min(1.0, (1.0 - d) / s);
+  if (u_mode == 8) return s < 0.5 ? 2.0 * s * d : 1.0 - 2.0 * (1.0 - s) * (1.0 - d);
+  if (u_mode == 9) {
+    if (s < 0.5) return d - (1.0 - 2.0 * s) * d * (1.0 - d);
+    float k = d < 0.25 ? ((16.0 * d - 12.0) * d + 4.0) * d : sqrt(d);
+    return d + (2.0 * s - 1.0) * (k - d);
+  }
+  if (u_mode == 10) return abs(d - s);
+  if (u_mode == 11) return d + s - 2.0 * d * s;
+  return s;
+}
+
+vec3 blend(vec3 s, vec3 d) {
+  return vec3(blend_channel(s.r, d.r), blend_channel(s.g, d.g), blend_channel(s.b, d.b));
+}
+
+void main() {
+  vec4 src = texture2D(u_layer, gl_FragCoord.xy / u_layer_size);
+  vec4 dst = texture2D(u_backdrop, gl_FragCoord.xy / u_backdrop_size);
+
+  if (u_premultiplied) {
+    vec4 s = src * u_opacity;
+    vec3 sc = s.a > 0.0 ? s.rgb / s.a : vec3(0.0);
+    vec3 dc = dst.a > 0.0 ? dst.rgb / dst.a : vec3(0.0);
+    gl_FragColor = vec4(s.a * dst.a * blend(sc, dc) + s.rgb * (1.0 - dst.a) +
+                            dst.rgb * (1.0 - s.a),
+                        s.a + dst.a - s.a * dst.a);
+    return;
+  }
+
+  float sa = src.a * u_opacity;
+  float out_alpha = sa + dst.a * (1.0 - sa);
+  vec4 result = dst;
+  if (out_alpha > 0.0) {
+    result.rgb = (blend(src.rgb, dst.rgb) * sa + dst.rgb * dst.a * (1.0 - sa)) / out_alpha;
+    result.a = out_alpha;
+  }
+  // to_byte() truncates
+  gl_FragColor = floor(clamp(result, 0.0, 1.0) * 255.0 + 0.001) / 255.0;
+}
+)";
+
+// Draws one tile of the composite through the viewport over the
+// background, then the selection outline. The mapping is the one of
+// map_scanlines(): the top-left corner of a screen pixel picks the document
+// pixel, bilinear taps are centred and clamped to the image. Each screen
+// pixel is drawn by the tile that holds its document pixel.
+const char* const kDisplayShader = R"(
+#version 120
+uniform bool u_background_only;
+uniform bool u_checkerboard;
+uniform vec4 u_background;
+uniform vec2 u_pan;
+uniform float u_zoom;
+uniform vec2 u_extent;
+uniform vec4 u_owned;
+uniform vec2 u_origin;
+uniform sampler2D u_image;
+uniform float u_scale;
+uniform vec2 u_level_size;
+uniform bool u_bilinear;
+uniform bool u_premultiplied;
+uniform bool u_overlay;
+uniform sampler2D u_mask;
+uniform vec2 u_mask_size;
+uniform float u_ants_phase;
+uniform vec4 u_overlay_color;
+
+vec4 background(vec2 screen) {
+  if (!u_checkerboard) return u_background;
+  vec2 cell = floor(screen / 8.0);
+  return mod(cell.x + cell.y, 2.0) < 0.5 ? vec4(vec3(200.0 / 255.0), 1.0)
+                                       : vec4(vec3(150.0 / 255.0), 1.0);
+}
+
+bool selected(vec2 pixel) {
+  return texture2D(u_mask, (pixel - u_origin + 0.5) / u_mask_size).r > 0.5 / 255.0;
+}
+
+void main() {
+  vec2 screen = floor(gl_FragCoord.xy);
+  vec4 color = background(screen);
+  if (u_background_only) {
+    gl_FragColor = color;
+    return;
+  }
+
+  vec2 position = (screen - u_pan) / u_zoom;
+  vec2 pixel = floor(position);
+  if (any(lessThan(pixel, u_owned.xy)) || any(greaterThanEqual(pixel, u_owned.zw)) ||
+      any(greaterThanEqual(position, u_extent))) {
+    discard;
+  }
+
+  // Taps index the mip level; u_origin is texel 0 in document pixels
+  vec2 level_extent = ceil(u_extent * u_scale);
+  vec2 texel;
+  if (u_bilinear) {
+    vec2 center = (screen + 0.5 - u_pan) / u_zoom * u_scale - 0.5;
+    texel = clamp(center, vec2(0.0), level_extent - 1.0) + 0.5;
+  } else {
+    texel = min(floor(position * u_scale), level_extent - 1.0) + 0.5;
+  }
+  vec4 source = texture2D(u_image, (texel - u_origin * u_scale) / u_level_size);
+
+  if (u_premultiplied) {
+    color = vec4(source.rgb + color.rgb * (1.0 - source.a),
+                 source.a + color.a * (1.0 - source.a));
+  } else {
+    float out_alpha = source.a + color.a * (1.0 - source.a);
+    if (out_alpha > 0.0) {
+      color.rgb = (source.rgb * source.a + color.rgb * color.a * (1.0 - source.a)) / out_alpha;
+      color.a = out_alpha;
+    }
+    color = floor(clamp(color, 0.0, 1.0) * 255.0 + 0.001) / 255.0;
+  }
+
+  if (u_overlay && selected(pixel) &&
+      (!selected(pixel - vec2(1.0, 0.0)) || !selected(pixel + vec2(1.0, 0.0)) ||
+       !selected(pixel - vec2(0.0, 1.0)) || !selected(pixel + vec2(0.0, 1.0))) &&
+      mod(floor((pixel.x + pixel.y + u_ants_phase) / 4.0), 2.0) < 0.5) {
+    vec3 mixed = u_overlay_color.a >= 1.0
+                     ? u_overlay_color.rgb
+                     : floor((u_overlay_color.rgb * u_overlay_color.a +
+                              color.rgb * (1.0 - u_overlay_color.a)) * 255.0 + 0.001) /
+                           255.0;
+    color = vec4(mixed, max(color.a, u_overlay_color.a));
+  }
+  gl_FragColor = color;
+}
+)";
+
+struct TextureFormat {
+  GLint internal_format = GL_RGBA8;
+  GLenum type = GL_UNSIGNED_BYTE;
+};
+
+TextureFormat texture_format(core::PixelFormat format) {
+  if (format == core::PixelFormat::RGBA16Premul) {
+    return TextureFormat{GL_RGBA16, GL_UNSIGNED_SHORT};
+  }
+  return TextureFormat{GL_RGBA8, GL_UNSIGNED_BYTE};
+}
+
+GLuint create_texture(int width, int height, GLint internal_format, GLenum format,
+                      GLenum type) {
+  GLuint id = 0;
+  glGenTextures(1, &id);
+  glBindTexture(GL_TEXTURE_2D, id);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, type, nullptr);
+  return id;
+}
+
+void delete_texture(GLuint& id) {
+  if (id != 0) {
+    glDeleteTextures(1, &id);
+    id = 0;
+  }
+}
+
+// Texels of a tile, in document coordinates, whose (edge-clamped) pixel
+// lies in @p area
+core::Rect affected_texels(const core::Rect& texels, const core::Rect& area,
+                           core::Size size) {
+  if (area.is_empty()) {
+    return core::Rect{};
+  }
+  const int x0 = area.x <= 0 ? texels.x : area.x;
+  const int y0 = area.y <= 0 ? texels.y : area.y;
+  const int x1 = area.x + area.width >= size.width ? texels.x + texels.width
+                                                   : area.x + area.width;
+  const int y1 = area.y + area.height >= size.height ? texels.y + texels.height
+                                                     : area.y + area.height;
+  return core::Rect{x0, y0, x1 - x0, y1 - y0}.intersected(texels);
+}
+
+}  // namespace
+
+struct GlCompositor::Impl {
+  // A tile of the document with its composite and selection textures
+  struct Tile {
+    core::Rect area{};    ///< Document pixels this tile draws
+    core::Rect texels{};  ///< Document area of texel 0..size, area plus apron
+    GLuint composite = 0;
+    GLuint framebuffer = 0;
+    GLuint mask = 0;
+    bool mipmaps_stale = true;
+  };
+
+  struct LayerTextures {
+    const core::Layer* layer = nullptr;
+    std::uint64_t revision = 0;
+    std::vector<GLuint> tiles;  ///< One texture per Tile, same layout
+  };
+
+  struct BlendUniforms {
+    GLint target_size = -1, layer = -1, backdrop = -1, layer_size = -1,
+          backdrop_size = -1, mode = -1, opacity = -1, premultiplied = -1;
+  };
+
+  struct DisplayUniforms {
+    GLint target_size = -1, background_only = -1, checkerboard = -1, background = -1,
+          pan = -1, zoom = -1, extent = -1, owned = -1, origin = -1, image = -1,
+          scale = -1, level_size = -1, bilinear = -1, premultiplied = -1,
+          overlay = -1, mask = -1, mask_size = -1, ants_phase = -1,
+          overlay_color = -1;
+  };
+
+  Functions gl;
+  GLuint blend_program = 0;
+  GLuint display_program = 0;
+  BlendUniforms blend_uniforms;
+  DisplayUniforms display_uniforms;
+
+  GLuint scratch = 0;  ///< Copy of the composite below the layer being blended
+  int scratch_width = 0;
+  int scratch_height = 0;
+
+  GLuint target = 0;
+  GLuint target_framebuffer = 0;
+  int target_width = 0;
+  int target_height = 0;
+
+  // Mirror of the document
+  const core::ImageDocument* document = nullptr;
+  core::Size size{};
+  core::PixelFormat format = core::PixelFormat::RGBA8;
+  std::uint64_t damage_revision = 0;
+  std::vector<Tile> tiles;
+  std::vector<LayerTextures> layers;
+  std::uint64_t mask_revision = 0;
+  bool mask_valid = false;
+  bool mask_has_selection = false;
+
+  std::vector<std::uint8_t> staging;
+  std::vector<std::uint8_t> conversion;
+
+  GLuint compile_program(const char* fragment_source, const char* name);
+  void release_document();
+  void release_layer(LayerTextures& entry);
+  void build_tiles(const core::ImageDocument& doc);
+  void sync(const core::ImageDocument& doc);
+  void upload_layer(const core::Layer& layer, LayerTextures& entry, const core::Rect& area);
+  void upload_mask(const core::SelectionMask& mask);
+  void recomposite(const core::ImageDocument& doc, Tile& tile, std::size_t tile_index,
+                   const core::Rect& texels);
+  void ensure_target(int width, int height);
+  void draw_quad(float x0, float y0, float x1, float y1);
+  void display(const Canvas& canvas, const SelectionOverlay& overlay, bool show_overlay);
+};
+
+GLuint GlCompositor::Impl::compile_program(const char* fragment_source, const char* name) {
+  const auto compile = [&](GLenum type, const char* source) {
+    const GLuint shader = gl.CreateShader(type);
+    gl.ShaderSource(shader, 1, &source, nullptr);
+    gl.CompileShader(shader);
+    GLint ok = GL_FALSE;
+    gl.GetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (ok != GL_TRUE) {
+      char log[1024] = {};
+      gl.GetShaderInfoLog(shader, sizeof(log), nullptr, log);
+      gl.DeleteShader(shader);
+      throw std::runtime_error(std::string(name) + " shader: " + log);
+    }
+    return shader;
+  };
+
+  const GLuint vertex = compile(GL_VERTEX_SHADER, kVertexShader);
+  GLuint fragment = 0;
+  try {
+    fragment = compile(GL_FRAGMENT_SHADER, fragment_source);
+  } catch (...) {
+    gl.DeleteShader(vertex);
+    throw;
+  }
+
+  const GLuint program = gl.CreateProgram();
+  gl.AttachShader(program, vertex);
+  gl.AttachShader(program, fragment);
+  gl.BindAttribLocation(program, 0, "a_position");
+  gl.LinkProgram(program);
+  gl.DeleteShader(vertex);
+  gl.DeleteShader(fragment);
+
+  GLint ok = GL_FALSE;
+  gl.GetProgramiv(program, GL_LINK_STATUS, &ok);
+  if (ok != GL_TRUE) {
+    char log[1024] = {};
+    gl.GetProgramInfoLog(program, sizeof(log), nullptr, log);
+    gl.DeleteProgram(program);
+    throw std::runtime_error(std::string(name) + " program: " + log);
+  }
+  return program;
+}
+
+void GlCompositor::Impl::release_layer(LayerTextures& entry) {
+  for (GLuint& id : entry.tiles) {
+    delete_texture(id);
+  }
+  entry.tiles.clear();
+}
+
+void GlCompositor::Impl::release_document() {
+  for (LayerTextures& entry : layers) {
+    release_layer(entry);
+  }
+  layers.clear();
+  for (Tile& tile : tiles) {
+    delete_texture(tile.composite);
+    delete_texture(tile.mask);
+    if (tile.framebuffer != 0) {
+      gl.DeleteFramebuffers(1, &tile.framebuffer);
+    }
+  }
+  tiles.clear();
+  delete_texture(scratch);
+  scratch_width = 0;
+  scratch_height = 0;
+  document = nullptr;
+  mask_valid = false;
+}
+
+void GlCompositor::Impl::build_tiles(const core::ImageDocument& doc) {
+  document = &doc;
+  size = doc.size();
+  format = doc.layer_format();
+  const TextureFormat tf = texture_format(format);
+
+  for (int y = 0; y < size.height; y += kTileSize) {
+    for (int x = 0; x < size.width; x += kTileSize) {
+      Tile tile;
+      tile.area = core::Rect{x, y, std::min(kTileSize, size.width - x),
+                             std::min(kTileSize, size.height - y)};
+      tile.texels = core::Rect{x - kApron, y - kApron, tile.area.width + 2 * kApron,
+                               tile.area.height + 2 * kApron};
+      tile.composite =
+          create_texture(tile.texels.width, tile.texels.height, tf.internal_format, GL_RGBA, tf.type);
+      gl.GenFramebuffers(1, &tile.framebuffer);
+      gl.BindFramebuffer(GL_FRAMEBUFFER, tile.framebuffer);
+      gl.FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                              tile.composite, 0);
+      const GLenum status = gl.CheckFramebufferStatus(GL_FRAMEBUFFER);
+      tiles.push_back(tile);
+      if (status != GL_FRAMEBUFFER_COMPLETE) {
+        throw std::runtime_error("composite framebuffer is incomplete");
+      }
+      scratch_width = std::max(scratch_width, tile.texels.width);
+      scratch_height = std::max(scratch_height, tile.texels.height);
+    }
+  }
+  scratch = create_texture(scratch_width, scratch_height, tf.internal_format, GL_RGBA, tf.type);
+}
+
+void GlCompositor::Impl::upload_layer(const core::Layer& layer, LayerTextures& entry,
+                                      const core::Rect& area) {
+  const core::ImageBuffer& buffer = layer.buffer();
+  const core::PixelFormat source_format = buffer.format();
+  const std::size_t bpp = core::bytes_per_pixel(format);
+  const TextureFormat tf = texture_format(format);
+
+  for (std::size_t i = 0; i < tiles.size(); ++i) {
+    const Tile& tile = tiles[i];
+    const core::Rect rect = affected_texels(tile.texels, area, size);
+    if (rect.is_empty()) {
+      continue;
+    }
+
+    // Texels outside the document repeat its edge pixels, so filtering
+    // at the border clamps like Canvas does
+    const int inside_x0 = std::clamp(rect.x, 0, size.width - 1);
+    const int inside_x1 = std::clamp(rect.x + rect.width, inside_x0 + 1, size.width);
+    const int inside_count = inside_x1 - inside_x0;
+    const int left = inside_x0 - rect.x;
+    const std::size_t row_bytes = static_cast<std::size_t>(rect.width) * bpp;
+    staging.resize(row_bytes * rect.height);
+
+    for (int y = 0; y < rect.height; ++y) {
+      const int source_y = std::clamp(rect.y + y, 0, size.height - 1);
+      std::uint8_t* row = staging.data() + y * row_bytes;
+      std::uint8_t* inside = row + left * bpp;
+      if (source_format == format) {
+        buffer.read_pixels(inside_x0, source_y, inside_count, inside);
+      } else {
+        conversion.resize(inside_count * core::bytes_per_pixel(source_format));
+        buffer.read_pixels(inside_x0, source_y, inside_count, conversion.data());
+        core::convert_rgba_span(conversion.data(), source_format, inside, format,
+                                inside_count);
+      }
+      for (int x = 0; x < left; ++x) {
+        std::memcpy(row + x * bpp, inside, bpp);
+      }
+      const std::uint8_t* last = inside + (inside_count - 1) * bpp;
+      for (int x = left + inside_count; x < rect.width; ++x) {
+        std::memcpy(row + x * bpp, last, bpp);
+      }
+    }
+
+    if (entry.tiles[i] == 0) {
+      entry.tiles[i] = create_texture(tile.texels.width, tile.texels.height,
+                                      tf.internal_format, GL_RGBA, tf.type);
+    }
+    glBindTexture(GL_TEXTURE_2D, entry.tiles[i]);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, rect.x - tile.texels.x, rect.y - tile.texels.y,
+                    rect.width, rect.height, GL_RGBA, tf.type, staging.data());
+  }
+}
+
+void GlCompositor::Impl::upload_mask(const core::SelectionMask& mask) {
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  for (Tile& tile : tiles) {
+    const core::Rect& t = tile.texels;
+    staging.resize(static_cast<std::size_t>(t.width) * t.height);
+    for (int y = 0; y < t.height; ++y) {
+      mask.read_row(t.x, t.y + y, t.width,
+                    staging.data() + static_cast<std::size_t>(y) * t.width);
+    }
+    if (tile.mask == 0) {
+      tile.mask = create_texture(t.width, t.height, GL_LUMINANCE8, GL_LUMINANCE,
+                                 GL_UNSIGNED_BYTE);
+    }
+    glBindTexture(GL_TEXTURE_2D, tile.mask);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, t.width, t.height, GL_LUMINANCE,
+                    GL_UNSIGNED_BYTE, staging.data());
+  }
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+void GlCompositor::Impl::draw_quad(float x0, float y0, float x1, float y1) {
+  const GLfloat vertices[] = {x0, y0, x1, y0, x0, y1, x1, y1};
+  gl.VertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, vertices);
+  glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+}
+
+void GlCompositor::Impl::recomposite(const core::ImageDocument& doc, Tile& tile,
+                                     std::size_t tile_index, const core::Rect& texels) {
+  const core::Rect rect = texels.intersected(tile.texels);
+  if (rect.is_empty()) {
+    return;
+  }
+  const int x = rect.x - tile.texels.x;
+  const int y = rect.y - tile.texels.y;
+
+  // display() may have left the base level on a mip level
+  glBindTexture(GL_TEXTURE_2D, tile.composite);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+
+  gl.BindFramebuffer(GL_FRAMEBUFFER, tile.framebuffer);
+  glViewport(0, 0, tile.texels.width, tile.texels.height);
+  glEnable(GL_SCISSOR_TEST);
+  glScissor(x, y, rect.width, rect.height);
+  glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+  glClear(GL_COLOR_BUFFER_BIT);
+
+  const BlendUniforms& u = blend_uniforms;
+  gl.UseProgram(blend_program);
+  gl.Uniform2f(u.target_size, static_cast<float>(tile.texels.width),
+               static_cast<float>(tile.texels.height));
+  gl.Uniform2f(u.layer_size, static_cast<float>(tile.texels.width),
+               static_cast<float>(tile.texels.height));
+  gl.Uniform2f(u.backdrop_size, static_cast<float>(scratch_width),
+               static_cast<float>(scratch_height));
+  gl.Uniform1i(u.layer, 0);
+  gl.Uniform1i(u.backdrop, 1);
+  gl.Uniform1i(u.premultiplied, core::is_premultiplied(format) ? 1 : 0);
+
+  const auto& doc_layers = doc.layers();
+  for (std::size_t i = 0; i < doc_layers.size(); ++i) {
+    const core::Layer& layer = *doc_layers[i];
+    if (!layer.visible()) {
+      continue;
+    }
+
+    // The shader reads the composite so far from a copy, since a texture
+    // cannot be sampled while it is being rendered to
+    gl.ActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, scratch);
+    glCopyTexSubImage2D(GL_TEXTURE_2D, 0, x, y, x, y, rect.width, rect.height);
+    gl.ActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, layers[i].tiles[tile_index]);
+
+    gl.Uniform1i(u.mode, static_cast<int>(layer.blend_mode()));
+    gl.Uniform1f(u.opacity, layer.opacity() / 100.0f);
+    draw_quad(static_cast<float>(x), static_cast<float>(y),
+              static_cast<float>(x + rect.width), static_cast<float>(y + rect.height));
+  }
+
+  glDisable(GL_SCISSOR_TEST);
+  tile.mipmaps_stale = true;
+}
+
+void GlCompositor::Impl::sync(const core::ImageDocument& doc) {
+  const core::Size doc_size = doc.size();
+  if (&doc != document || doc_size.width != size.width ||
+      doc_size.height != size.height || doc.layer_format() != format) {
+    release_document();
+    build_tiles(doc);
+    damage_revision = doc.damage_revision();
+  }
+
+  const core::Rect damage = doc.damage_since(damage_revision);
+  damage_revision = doc.damage_revision();
+
+  // Damage is not recorded per layer, so every layer refreshes the damaged
+  // area; a replaced, moved or restyled layer is uploaded in full and the
+  // whole stack recomposited
+  const auto& doc_layers = doc.layers();
+  bool everything = false;
+  while (layers.size() > doc_layers.size()) {
+    release_layer(layers.back());
+    layers.pop_back();
+    everything = true;
+  }
+  layers.resize(doc_layers.size());
+
+  const core::Rect bounds{0, 0, size.width, size.height};
+  for (std::size_t i = 0; i < doc_layers.size(); ++i) {
+    const core::Layer& layer = *doc_layers[i];
+    LayerTextures& entry = layers[i];
+    if (entry.tiles.size() != tiles.size()) {
+      entry.tiles.assign(tiles.size(), 0);
+      entry.layer = nullptr;
+    }
+    if (entry.layer != &layer || entry.revision != layer.revision()) {
+      upload_layer(layer, entry, bounds);
+      entry.layer = &layer;
+      entry.revision = layer.revision();
+      everything = true;
+    } else if (!damage.is_empty()) {
+      upload_layer(layer, entry, damage);
+    }
+  }
+
+  for (std::size_t i = 0; i < tiles.size(); ++i) {
+    Tile& tile = tiles[i];
+    if (everything) {
+      recomposite(doc, tile, i, tile.texels);
+    } else if (!damage.is_empty()) {
+      recomposite(doc, tile, i, affected_texels(tile.texels, damage, size));
+    }
+  }
+}
+
+void GlCompositor::Impl::ensure_target(int width, int height) {
+  if (target != 0 && target_width == width && target_height == height) {
+    return;
+  }
+  delete_texture(target);
+  if (target_framebuffer == 0) {
+    gl.GenFramebuffers(1, &target_framebuffer);
+  }
+  target = create_texture(width, height, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
+  target_width = width;
+  target_height = height;
+  gl.BindFramebuffer(GL_FRAMEBUFFER, target_framebuffer);
+  gl.FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target, 0);
+  if (gl.CheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+    throw std::runtime_error("canvas framebuffer is incomplete");
+  }
+}
+
+void GlCompositor::Impl::display(const Canvas& canvas, const SelectionOverlay& overlay,
+                                 bool show_overlay) {
+  const Viewport& viewport = canvas.viewport();
+  const float zoom = viewport.zoom();
+  const ViewportPoint pan = viewport.pan_offset();
+  const RGBAPixel bg = canvas.background_color();
+  const bool bilinear = canvas.sample_filter() == SampleFilter::Bilinear;
+  const int level_for_zoom = MipPyramid::level_for_zoom(zoom);
+  const DisplayUniforms& u = display_uniforms;
+
+  gl.BindFramebuffer(GL_FRAMEBUFFER, target_framebuffer);
+  glViewport(0, 0, target_width, target_height);
+  gl.UseProgram(display_program);
+  gl.Uniform2f(u.target_size, static_cast<float>(target_width),
+               static_cast<float>(target_height));
+  gl.Uniform1i(u.checkerboard, canvas.checkerboard_enabled() ? 1 : 0);
+  gl.Uniform4f(u.background, bg.r / 255.0f, bg.g / 255.0f, bg.b / 255.0f, bg.a / 255.0f);
+  gl.Uniform1i(u.background_only, 1);
+  draw_quad(0.0f, 0.0f, static_cast<float>(target_width), static_cast<float>(target_height));
+
+  gl.Uniform1i(u.background_only, 0);
+  gl.Uniform2f(u.pan, pan.x, pan.y);
+  gl.Uniform1f(u.zoom, zoom);
+  gl.Uniform2f(u.extent, static_cast<float>(size.width), static_cast<float>(size.height));
+  gl.Uniform1i(u.image, 0);
+  gl.Uniform1i(u.mask, 1);
+  gl.Uniform1i(u.bilinear, bilinear ? 1 : 0);
+  gl.Uniform1i(u.premultiplied, core::is_premultiplied(format) ? 1 : 0);
+  gl.Uniform1i(u.overlay, show_overlay ? 1 : 0);
+  gl.Uniform1f(u.ants_phase, static_cast<float>(overlay.animation_frame % 8));
+  gl.Uniform4f(u.overlay_color, overlay.color.r / 255.0f, overlay.color.g / 255.0f,
+               overlay.color.b / 255.0f, overlay.color.a / 255.0f);
+
+  // Bilinear taps of zoomed-in pixels reach half a document pixel past the
+  // tile; discarding in the shader keeps each pixel to one tile
+  const float margin = std::ceil(zoom) + 2.0f;
+  for (Tile& tile : tiles) {
+    const core::Rect& area = tile.area;
+    const float sx0 = std::max(0.0f, std::floor(area.x * zoom + pan.x - margin));
+    const float sy0 = std::max(0.0f, std::floor(area.y * zoom + pan.y - margin));
+    const float sx1 = std::min(static_cast<float>(target_width),
+                               std::ceil((area.x + area.width) * zoom + pan.x + margin));
+    const float sy1 = std::min(static_cast<float>(target_height),
+                               std::ceil((area.y + area.height) * zoom + pan.y + margin));
+    if (sx0 >= sx1 || sy0 >= sy1) {
+      continue;
+    }
+
+    int max_level = 0;
+    while ((tile.texels.width >> (max_level + 1)) > 0 ||
+           (tile.texels.height >> (max_level + 1)) > 0) {
+      ++max_level;
+    }
+    const int level = std::min(level_for_zoom, max_level);
+
+    gl.ActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, tile.composite);
+    if (level > 0 && tile.mipmaps_stale) {
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+      gl.GenerateMipmap(GL_TEXTURE_2D);
+      tile.mipmaps_stale = false;
+    }
+    // Sampling the base level with a plain filter picks the mip level
+    // exactly, the way Canvas picks a MipPyramid level
+    const GLint filter = bilinear ? GL_LINEAR : GL_NEAREST;
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+
+    if (show_overlay) {
+      gl.ActiveTexture(GL_TEXTURE1);
+      glBindTexture(GL_TEXTURE_2D, tile.mask);
+      gl.ActiveTexture(GL_TEXTURE0);
+    }
+
+    gl.Uniform4f(u.owned, static_cast<float>(area.x), static_cast<float>(area.y),
+                 static_cast<float>(area.x + area.width),
+                 static_cast<float>(area.y + area.height));
+    gl.Uniform2f(u.origin, static_cast<float>(tile.texels.x),
+                 static_cast<float>(tile.texels.y));
+    gl.Uniform1f(u.scale, 1.0f / static_cast<float>(1 << level));
+    gl.Uniform2f(u.level_size, static_cast<float>(std::max(1, tile.texels.width >> level)),
+                 static_cast<float>(std::max(1, tile.texels.height >> level)));
+    gl.Uniform2f(u.mask_size, static_cast<float>(tile.texels.width),
+                 static_cast<float>(tile.texels.height));
+    draw_quad(sx0, sy0, sx1, sy1);
+  }
+}
+
+GlCompositor::GlCompositor() : impl_(std::make_unique<Impl>()) {}
+
+GlCompositor::~GlCompositor() {
+  release();
+}
+
+bool GlCompositor::initialize(ProcLoader loader) {
+  release();
+  Impl& s = *impl_;
+  if (!loader || !s.gl.load(loader)) {
+    return false;
+  }
+
+  GLint max_texture_size = 0;
+  glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+  if (max_texture_size < kTileSize + 2 * kApron) {
+    return false;
+  }
+
+  s.blend_program = s.compile_program(kBlendShader, "blend");
+  try {
+    s.display_program = s.compile_program(kDisplayShader, "display");
+  } catch (...) {
+    s.gl.DeleteProgram(s.blend_program);
+    s.blend_program = 0;
+    throw;
+  }
+
+  const auto locate = [&](GLuint program, const char* name) {
+    return s.gl.GetUniformLocation(program, name);
+  };
+  Impl::BlendUniforms& b = s.blend_uniforms;
+  b.target_size = locate(s.blend_program, "u_target_size");
+  b.layer = locate(s.blend_program, "u_layer");
+  b.backdrop = locate(s.blend_program, "u_backdrop");
+  b.layer_size = locate(s.blend_program, "u_layer_size");
+  b.backdrop_size = locate(s.blend_program, "u_backdrop_size");
+  b.mode = locate(s.blend_program, "u_mode");
+  b.opacity = locate(s.blend_program, "u_opacity");
+  b.premultiplied = locate(s.blend_program, "u_premultiplied");
+
+  Impl::DisplayUniforms& d = s.display_uniforms;
+  d.target_size = locate(s.display_program, "u_target_size");
+  d.background_only = locate(s.display_program, "u_background_only");
+  d.checkerboard = locate(s.display_program, "u_checkerboard");
+  d.background = locate(s.display_program, "u_background");
+  d.pan = locate(s.display_program, "u_pan");
+  d.zoom = locate(s.display_program, "u_zoom");
+  d.extent = locate(s.display_program, "u_extent");
+  d.owned = locate(s.display_program, "u_owned");
+  d.origin = locate(s.display_program, "u_origin");
+  d.image = locate(s.display_program, "u_image");
+  d.scale = locate(s.display_program, "u_scale");
+  d.level_size = locate(s.display_program, "u_level_size");
+  d.bilinear = locate(s.display_program, "u_bilinear");
+  d.premultiplied = locate(s.display_program, "u_premultiplied");
+  d.overlay = locate(s.display_program, "u_overlay");
+  d.mask = locate(s.display_program, "u_mask");
+  d.mask_size = locate(s.display_program, "u_mask_size");
+  d.ants_phase = locate(s.display_program, "u_ants_phase");
+  d.overlay_color = locate(s.display_program, "u_overlay_color");
+  return true;
+}
+
+bool GlCompositor::initialized() const {
+  return impl_->blend_program != 0;
+}
+
+void GlCompositor::release() {
+  Impl& s = *impl_;
+  if (!initialized()) {
+    return;
+  }
+  s.release_document();
+  delete_texture(s.target);
+  if (s.target_framebuffer != 0) {
+    s.gl.DeleteFramebuffers(1, &s.target_framebuffer);
+  }
+  s.target_width = 0;
+  s.target_height = 0;
+  s.gl.DeleteProgram(s.blend_program);
+  s.gl.DeleteProgram(s.display_program);
+  s.blend_program = 0;
+  s.display_program = 0;
+}
+
+void GlCompositor::render(const core::ImageDocument& doc, const Canvas& canvas,
+                          const SelectionOverlay& overlay, int width, int height) {
+  if (!initialized()) {
+    throw std::logic_error("GlCompositor::render called before initialize");
+  }
+  if (doc.layer_count() == 0) {
+    throw std::invalid_argument("GlCompositor renders layered documents only");
+  }
+  if (width <= 0 || height <= 0) {
+    return;
+  }
+
+  Impl& s = *impl_;
+  glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_VIEWPORT_BIT | GL_SCISSOR_BIT |
+               GL_TEXTURE_BIT);
+  glDisable(GL_BLEND);
+  glDisable(GL_DEPTH_TEST);
+  glDisable(GL_CULL_FACE);
+  glDisable(GL_SCISSOR_TEST);
+  s.gl.EnableVertexAttribArray(0);
+
+  const auto restore = [&] {
+    s.gl.DisableVertexAttribArray(0);
+    s.gl.UseProgram(0);
+    s.gl.BindFramebuffer(GL_FRAMEBUFFER, 0);
+    glPopAttrib();
+  };
+
+  try {
+    s.sync(doc);
+
+    // The mask texture is uploaded only when the selection changed
+    const core::SelectionMask* mask = overlay.mask;
+    bool show_overlay = false;
+    if (overlay.enabled && mask) {
+      if (!s.mask_valid || s.mask_revision != mask->revision()) {
+        s.mask_has_selection = mask->has_selection();
+        if (s.mask_has_selection) {
+          s.upload_mask(*mask);
+        }
+        s.mask_revision = mask->revision();
+        s.mask_valid = true;
+      }
+      show_overlay = s.mask_has_selection;
+    }
+
+    s.ensure_target(width, height);
+    s.display(canvas, overlay, show_overlay);
+  } catch (...) {
+    restore();
+    throw;
+  }
+  restore();
+}
+
+unsigned int GlCompositor::texture() const {
+  return impl_->target;
+}
+
+void GlCompositor::read_back(CanvasBuffer& buffer) const {
+  const Impl& s = *impl_;
+  if (s.target == 0) {
+    buffer.resize(0, 0);
+    return;
+  }
+  buffer.resize(s.target_width, s.target_height);
+  s.gl.BindFramebuffer(GL_FRAMEBUFFER, s.target_framebuffer);
+  glReadPixels(0, 0, s.target_width, s.target_height, GL_RGBA, GL_UNSIGNED_BYTE,
+               buffer.data());
+  s.gl.BindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+}  // namespace ps::rendering
@@ -0,0 +1,147 @@
+#include "ps/rendering/mip_pyramid.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "ps/core/pixel_conversion.h"
+#include "ps/core/resample.h"
+
+namespace ps::rendering {
+
+namespace {
+
+// Reads @p count pixels of a row as RGBA8Premul into @p out
+void read_premultiplied(const core::ImageBuffer& source, int x, int y, int count,
+                        std::vector<std::uint8_t>& scratch, std::uint8_t* out) {
+  const core::PixelFormat format = source.format();
+  if (format == core::PixelFormat::RGBA8Premul) {
+    source.read_pixels(x, y, count, out);
+    return;
+  }
+  scratch.resize(static_cast<std::size_t>(count) * core::bytes_per_pixel(format));
+  source.read_pixels(x, y, count, scratch.data());
+  core::convert_rgba_span(scratch.data(), format, out, core::PixelFormat::RGBA8Premul,
+                          count);
+}
+
+// Maps an area of level 0 onto level @p index, rounding outwards
+core::Rect scale_down(const core::Rect& area, int index) {
+  const int scale = 1 << index;
+  const int x0 = area.x >> index;
+  const int y0 = area.y >> index;
+  const int x1 = (area.x + area.width + scale - 1) >> index;
+  const int y1 = (area.y + area.height + scale - 1) >> index;
+  return core::Rect{x0, y0, x1 - x0, y1 - y0};
+}
+
+}  // namespace
+
+int MipPyramid::level_for_zoom(float zoom) {
+  int level = 0;
+  while (level < 30 && zoom > 0.0f &&
+         zoom * static_cast<float>(1 << (level + 1)) <= 1.0f) {
+    ++level;
+  }
+  return level;
+}
+
+void MipPyramid::update(const core::ImageDocument& doc) {
+  const core::ImageBuffer& composite = doc.composite();
+  const core::Size size = composite.size();
+
+  if (&doc != document_ || &composite != base_ || size.width != size_.width ||
+      size.height != size_.height || composite.format() != format_ ||
+      doc.composite_generation() != generation_) {
+    document_ = &doc;
+    base_ = &composite;
+    size_ = size;
+    format_ = composite.format();
+    generation_ = doc.composite_generation();
+    revision_ = doc.damage_revision();
+
+    // Every level is stale; buffers are kept so a rebuild of the same size
+    // does not reallocate
+    std::size_t count = 0;
+    for (int w = size.width, h = size.height; w > 1 || h > 1; ++count) {
+      w = (w + 1) / 2;
+      h = (h + 1) / 2;
+    }
+    levels_.resize(count);
+    int width = size.width;
+    int height = size.height;
+    for (Level& level : levels_) {
+      width = (width + 1) / 2;
+      height = (height + 1) / 2;
+      level.pending = core::Rect{0, 0, width, height};
+    }
+    return;
+  }
+
+  const core::Rect damage = doc.damage_since(revision_);
+  revision_ = doc.damage_revision();
+  if (damage.is_empty()) {
+    return;
+  }
+  for (std::size_t i = 0; i < levels_.size(); ++i) {
+    Level& level = levels_[i];
+    level.pending = level.pending.united(scale_down(damage, static_cast<int>(i) + 1));
+  }
+}
+
+const core::ImageBuffer& MipPyramid::level(int index) {
+  if (index < 0 || index >= level_count()) {
+    throw std::out_of_range("mip level out of range");
+  }
+  if (index == 0) {
+    return *base_;
+  }
+
+  // Coarser levels are reduced from finer ones, so resolve top down
+  for (int k = 1; k <= index; ++k) {
+    Level& target = levels_[k - 1];
+    if (!target.pending.is_empty()) {
+      reduce(k == 1 ? *base_ : levels_[k - 2].buffer, target);
+    }
+  }
+  return levels_[index - 1].buffer;
+}
+
+void MipPyramid::clear() {
+  document_ = nullptr;
+  base_ = nullptr;
+  size_ = core::Size{};
+  levels_.clear();
+}
+
+void MipPyramid::reduce(const core::ImageBuffer& source, Level& target) {
+  const core::Size source_size = source.size();
+  const core::Size size{(source_size.width + 1) / 2, (source_size.height + 1) / 2};
+  const core::Size current = target.buffer.size();
+  if (current.width != size.width || current.height != size.height) {
+    target.buffer.resize(size, core::PixelFormat::RGBA8Premul,
+                         core::BufferInit::Uninitialized);
+    target.pending = core::Rect{0, 0, size.width, size.height};
+  }
+
+  const core::Rect rect =
+      target.pending.intersected(core::Rect{0, 0, size.width, size.height});
+  target.pending = core::Rect{};
+  if (rect.is_empty()) {
+    return;
+  }
+
+  // A box filter at exactly half scale averages each 2×2 block, repeating
+  // the last row and column of odd sizes; the float sums are exact, so this
+  // rounds like (sum + 2) >> 2
+  const core::ResampleTable columns(source_size.width, size.width, core::ResampleFilter::Box,
+                                    0.5);
+  const core::ResampleTable rows(source_size.height, size.height, core::ResampleFilter::Box,
+                                 0.5);
+  core::resample(source, target.buffer, columns, rows, rect,
+                 [&source](int x, int y, int count, std::uint8_t* out) {
+                   thread_local std::vector<std::uint8_t> scratch;
+                   read_premultiplied(source, x, y, count, scratch, out);
+                 });
+}
+
+}  // namespace ps::rendering
@@ -0,0 +1,496 @@
+#include "ps/rendering/render_thread.h"
+
+#include <chrono>
+#include <cmath>
+#include <utility>
+
+#include "ps/core/thread_pool.h"
+
+namespace ps::rendering {
+
+namespace {
+
+bool same_pixel(RGBAPixel a, RGBAPixel b) {
+  return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+// Copies the pixels of a buffer inside an area into a contiguous buffer
+core::ImageBuffer copy_area(const core::ImageBuffer& buffer, const core::Rect& area) {
+  core::ImageBuffer patch(core::Size{area.width, area.height}, buffer.format(),
+                          core::StorageLayout::Contiguous, core::BufferInit::Uninitialized);
+  for (int y = 0; y < area.height; ++y) {
+    buffer.read_pixels(area.x, area.y + y, area.width, patch.mutable_pixel_row(0, y));
+  }
+  return patch;
+}
+
+void paste_area(core::ImageBuffer& buffer, const core::Rect& area,
+                const core::ImageBuffer& patch) {
+  for (int y = 0; y < area.height; ++y) {
+    buffer.write_pixels(area.x, area.y + y, area.width, patch.pixel_row(0, y));
+  }
+}
+
+}  // namespace
+
+// One submitted state. Pixel data is present only when the document
+// reported damage; everything else is always filled in.
+struct RenderThread::Job {
+  // Pixels of one damaged buffer
+  struct Patch {
+    int layer = -1;            ///< Layer index, or -1 for a channel
+    std::size_t channel = 0;   ///< Channel index when layer is -1
+    core::Rect area{};         ///< Damage the patch brings up to date
+    core::ImageBuffer pixels;  ///< Pixels inside area, or the whole buffer
+    bool whole = false;        ///< pixels is a tile-sharing copy of the buffer
+  };
+
+  struct LayerProperties {
+    bool visible = true;
+    int opacity = 100;
+    core::BlendMode blend_mode = core::BlendMode::Normal;
+  };
+
+  // Document structure; the worker recreates its copy when rebuild is set
+  bool rebuild = false;
+  core::Size size{};
+  core::ColorMode mode = core::ColorMode::RGB;
+  core::StorageLayout layout = core::StorageLayout::Contiguous;
+  core::PixelFormat format = core::PixelFormat::RGBA8;
+  std::vector<LayerProperties> layers;
+  int active_layer = -1;
+
+  // Whole buffers: layers with rebuild, channels also when their count or
+  // formats changed. Other damage comes as patches, applied in order.
+  bool full_layers = false;
+  bool full_channels = false;
+  std::vector<core::ImageBuffer> layer_buffers;
+  std::vector<core::ImageChannel> channels;
+  std::vector<Patch> patches;
+
+  Viewport viewport;
+  RGBAPixel background{};
+  bool checkerboard = false;
+  SampleFilter filter = SampleFilter::Nearest;
+  int width = 0;
+  int height = 0;
+
+  SelectionOverlay overlay;
+  std::shared_ptr<const core::SelectionMask> mask;  ///< Null if unchanged
+};
+
+RenderThread::RenderThread() : worker_([this] { run(); }) {}
+
+RenderThread::~RenderThread() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  worker_.join();
+}
+
+void RenderThread::submit(const core::ImageDocument& doc, const Canvas& canvas,
+                          const SelectionOverlay& overlay, int width, int height) {
+  const Submitted& last = submitted_;
+  const auto& layers = doc.layers();
+
+  Submitted next;
+  next.document = &doc;
+  next.size = doc.size();
+  next.format = doc.layer_format();
+  next.layout = doc.storage_layout();
+  for (const auto& layer : layers) {
+    next.layers.push_back(layer.get());
+    next.layer_revisions.push_back(layer->revision());
+  }
+  for (const auto& channel : doc.channels()) {
+    next.channel_formats.push_back(channel.buffer.format());
+  }
+  next.active_layer = doc.active_layer_index();
+  next.damage_revision = doc.damage_revision();
+  next.mask_revision = last.mask_revision;
+  next.mask_sent = last.mask_sent;
+  next.zoom = canvas.viewport().zoom();
+  next.pan = canvas.viewport().pan_offset();
+  next.width = width;
+  next.height = height;
+  next.background = canvas.background_color();
+  next.checkerboard = canvas.checkerboard_enabled();
+  next.filter = canvas.sample_filter();
+  next.overlay_enabled = overlay.enabled && overlay.mask;
+  next.overlay_color = overlay.color;
+  next.animation_frame = overlay.animation_frame;
+  next.valid = true;
+
+  const bool rebuild = !last.valid || last.document != next.document ||
+                       last.size.width != next.size.width ||
+                       last.size.height != next.size.height || last.format != next.format ||
+                       last.layout != next.layout || last.layers != next.layers;
+  const core::Rect damage =
+      rebuild ? core::Rect{0, 0, doc.size().width, doc.size().height}
+              : doc.damage_since(last.damage_revision);
+  const bool send_mask = next.overlay_enabled &&
+                         (!last.mask_sent || last.mask_revision != overlay.mask->revision());
+
+  if (!rebuild && damage.is_empty() && !send_mask &&
+      last.layer_revisions == next.layer_revisions &&
+      last.active_layer == next.active_layer && last.zoom == next.zoom &&
+      last.pan.x == next.pan.x && last.pan.y == next.pan.y && last.width == width &&
+      last.height == height && same_pixel(last.background, next.background) &&
+      last.checkerboard == next.checkerboard && last.filter == next.filter &&
+      last.overlay_enabled == next.overlay_enabled &&
+      same_pixel(last.overlay_color, next.overlay_color) &&
+      last.animation_frame == next.animation_frame) {
+    return;
+  }
+
+  auto job = std::make_unique<Job>();
+  job->rebuild = rebuild;
+  job->size = doc.size();
+  job->mode = doc.mode();
+  job->layout = next.layout;
+  job->format = next.format;
+  for (const auto& layer : layers) {
+    job->layers.push_back(
+        Job::LayerProperties{layer->visible(), layer->opacity(), layer->blend_mode()});
+  }
+  job->active_layer = next.active_layer;
+  if (rebuild) {
+    // Copies of tiled buffers share the tiles with the document
+    job->full_layers = true;
+    for (const auto& layer : layers) {
+      job->layer_buffers.push_back(layer->buffer());
+    }
+  }
+  if (rebuild || last.channel_formats != next.channel_formats) {
+    job->full_channels = true;
+    job->channels = doc.channels();
+  }
+  if (!damage.is_empty()) {
+    // Only the buffers damaged since the last submit, and of those only the
+    // damage; tiled buffers are cheaper to share whole, and bitmaps are
+    // sent whole because the damage need not start on a byte
+    const auto add_patch = [&](const core::ImageBuffer& buffer, int layer,
+                               std::size_t channel) {
+      Job::Patch patch;
+      patch.layer = layer;
+      patch.channel = channel;
+      patch.area = damage;
+      patch.whole = buffer.is_tiled() || core::bytes_per_pixel(buffer.format()) == 0;
+      patch.pixels = patch.whole ? buffer : copy_area(buffer, damage);
+      job->patches.push_back(std::move(patch));
+    };
+    if (!job->full_layers) {
+      for (std::size_t i = 0; i < layers.size(); ++i) {
+        if (doc.damaged_since(last.damage_revision, layers[i].get())) {
+          add_patch(layers[i]->buffer(), static_cast<int>(i), 0);
+        }
+      }
+    }
+    if (!job->full_channels && doc.damaged_since(last.damage_revision, nullptr)) {
+      for (std::size_t c = 0; c < doc.channels().size(); ++c) {
+        add_patch(doc.channels()[c].buffer, -1, c);
+      }
+    }
+  }
+  job->viewport = canvas.viewport();
+  job->background = next.background;
+  job->checkerboard = next.checkerboard;
+  job->filter = next.filter;
+  job->width = width;
+  job->height = height;
+  job->overlay = overlay;
+  job->overlay.enabled = next.overlay_enabled;
+  job->overlay.mask = nullptr;
+  if (send_mask) {
+    job->mask = std::make_shared<core::SelectionMask>(*overlay.mask);
+    next.mask_revision = overlay.mask->revision();
+    next.mask_sent = true;
+  }
+  submitted_ = std::move(next);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pending_) {
+      // Fold in what the replaced request would have delivered
+      Job& replaced = *pending_;
+      // Whole buffers of the new request supersede the replaced patches
+      std::vector<Job::Patch> patches;
+      for (Job::Patch& patch : replaced.patches) {
+        if (!(patch.layer >= 0 ? job->full_layers : job->full_channels)) {
+          patches.push_back(std::move(patch));
+        }
+      }
+      for (Job::Patch& patch : job->patches) {
+        patches.push_back(std::move(patch));
+      }
+      job->patches = std::move(patches);
+      job->rebuild = job->rebuild || replaced.rebuild;
+      if (replaced.full_layers && !job->full_layers) {
+        job->full_layers = true;
+        job->layer_buffers = std::move(replaced.layer_buffers);
+      }
+      if (replaced.full_channels && !job->full_channels) {
+        job->full_channels = true;
+        job->channels = std::move(replaced.channels);
+      }
+      if (!job->mask) {
+        job->mask = std::move(replaced.mask);
+      }
+    }
+    pending_ = std::move(job);
+  }
+  cv_.notify_one();
+}
+
+bool RenderThread::present(core::Rect& area) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (error_) {
+      std::exception_ptr error = std::move(error_);
+      error_ = nullptr;
+      std::rethrow_exception(error);
+    }
+    if (!ready_) {
+      return false;
+    }
+    std::swap(front_, back_);
+    area = ready_area_;
+    // back_ now holds the previous frame, which lacks this frame's changes
+    carry_ = ready_area_;
+    ready_ = false;
+  }
+  cv_.notify_one();
+  return true;
+}
+
+bool RenderThread::busy() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return rendering_ || ready_ || pending_ || refine_;
+}
+
+bool RenderThread::try_run_idle(const std::function<void()>& fn) {
+  // The worker only starts a render while holding the mutex
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (rendering_) {
+    return false;
+  }
+  fn();
+  return true;
+}
+
+void RenderThread::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    cv_.wait(lock, [this] { return stop_ || (!ready_ && (pending_ || refine_)); });
+    if (stop_) {
+      return;
+    }
+    std::unique_ptr<Job> job = std::move(pending_);
+    const core::Rect carry = carry_;
+    refine_ = false;
+    rendering_ = true;
+    lock.unlock();
+
+    core::Rect area;
+    std::exception_ptr error;
+    try {
+      if (job) {
+        apply(std::move(job));
+      }
+      area = render(carry);
+    } catch (...) {
+      error = std::current_exception();
+    }
+
+    lock.lock();
+    rendering_ = false;
+    if (error) {
+      error_ = error;
+      shown_ = Shown{};
+      continue;
+    }
+    if (area.is_empty()) {
+      continue;
+    }
+    ready_ = true;
+    ready_area_ = area;
+    carry_ = core::Rect{};
+    refine_ = shown_.preview;
+  }
+}
+
+void RenderThread::apply(std::unique_ptr<Job> job) {
+  if (job->rebuild || !document_) {
+    document_ = std::make_unique<core::ImageDocument>(job->size, job->mode);
+    document_->set_storage_layout(job->layout);
+    document_->set_layer_format(job->format);
+    for (std::size_t i = 0; i < job->layers.size(); ++i) {
+      document_->add_layer();
+    }
+  }
+
+  for (std::size_t i = 0; i < job->layers.size(); ++i) {
+    core::Layer& layer = document_->layer_at(i);
+    const Job::LayerProperties& properties = job->layers[i];
+    if (job->full_layers) {
+      layer.buffer() = std::move(job->layer_buffers[i]);
+    }
+    // Setters bump the layer revision, which rebuilds the composite
+    if (layer.visible() != properties.visible) {
+      layer.set_visible(properties.visible);
+    }
+    if (layer.opacity() != properties.opacity) {
+      layer.set_opacity(properties.opacity);
+    }
+    if (layer.blend_mode() != properties.blend_mode) {
+      layer.set_blend_mode(properties.blend_mode);
+    }
+  }
+  if (document_->active_layer_index() != job->active_layer) {
+    document_->set_active_layer(job->active_layer);
+  }
+
+  if (job->full_channels) {
+    document_->channels() = std::move(job->channels);
+    if (!job->rebuild) {
+      document_->mark_dirty(core::Rect{0, 0, job->size.width, job->size.height});
+    }
+  }
+  for (Job::Patch& patch : job->patches) {
+    core::Layer* layer = patch.layer >= 0 ? &document_->layer_at(patch.layer) : nullptr;
+    core::ImageBuffer& buffer =
+        layer ? layer->buffer() : document_->channel_at(patch.channel).buffer;
+    if (patch.whole) {
+      buffer = std::move(patch.pixels);
+    } else {
+      paste_area(buffer, patch.area, patch.pixels);
+    }
+    document_->mark_dirty(patch.area, layer);
+  }
+  if (job->mask) {
+    mask_ = std::move(job->mask);
+  }
+  job->layer_buffers.clear();
+  job->patches.clear();
+  view_ = std::move(job);
+}
+
+core::Rect RenderThread::render(const core::Rect& carry) {
+  if (!view_) {
+    return core::Rect{};
+  }
+  const auto start = std::chrono::steady_clock::now();
+  const Job& view = *view_;
+
+  canvas_.set_viewport(view.viewport);
+  canvas_.set_background_color(view.background);
+  canvas_.set_checkerboard_enabled(view.checkerboard);
+  canvas_.set_sample_filter(view.filter);
+
+  SelectionOverlay overlay = view.overlay;
+  overlay.mask = mask_.get();
+  overlay.enabled = overlay.enabled && overlay.mask;
+
+  Shown next;
+  next.document = document_.get();
+  if (document_->layer_count() > 0) {
+    // Brings the composite cache up to date; cheap when nothing changed
+    document_->composite();
+    next.composite_generation = document_->composite_generation();
+  }
+  next.damage_revision = document_->damage_revision();
+  next.mask_revision = overlay.enabled ? overlay.mask->revision() : 0;
+  next.zoom = view.viewport.zoom();
+  next.pan = view.viewport.pan_offset();
+  next.width = view.width;
+  next.height = view.height;
+  next.background = view.background;
+  next.checkerboard = view.checkerboard;
+  next.filter = view.filter;
+  next.overlay_enabled = overlay.enabled;
+  next.overlay_color = overlay.color;
+  next.animation_frame = overlay.animation_frame;
+  next.valid = true;
+
+  const Shown& last = shown_;
+  const bool same_content =
+      last.valid && last.document == next.document &&
+      last.composite_generation == next.composite_generation &&
+      last.mask_revision == next.mask_revision &&
+      same_pixel(last.background, next.background) &&
+      last.checkerboard == next.checkerboard && last.filter == next.filter &&
+      last.overlay_enabled == next.overlay_enabled &&
+      same_pixel(last.overlay_color, next.overlay_color);
+  const bool same_view = last.valid && last.zoom == next.zoom && last.pan.x == next.pan.x &&
+                         last.pan.y == next.pan.y && last.width == next.width &&
+                         last.height == next.height;
+  const bool full_redraw = !same_content || !same_view || last.preview ||
+                           last.animation_frame != next.animation_frame ||
+                           back_.width != view.width || back_.height != view.height;
+  const core::Rect full{0, 0, view.width, view.height};
+
+  core::Rect area;
+  if (!full_redraw) {
+    area = canvas_.screen_rect_for(document_->damage_since(last.damage_revision), back_);
+    if (area.is_empty()) {
+      return area;
+    }
+    // back_ also still lacks what changed in the frame on screen
+    canvas_.render_region(*document_, back_, overlay, area.united(carry));
+  } else if (same_content && !same_view && full_render_ms_ > kPreviewThresholdMs &&
+             front_.width == last.width && front_.height == last.height) {
+    back_.resize(view.width, view.height);
+    reproject(last);
+    next.preview = true;
+    area = full;
+  } else {
+    back_.resize(view.width, view.height);
+    canvas_.render_region(*document_, back_, overlay, full);
+    full_render_ms_ = std::chrono::duration<double, std::milli>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+    area = full;
+  }
+  shown_ = next;
+  return area;
+}
+
+void RenderThread::reproject(const Shown& from) {
+  // Each screen pixel takes the pixel of the frame on screen that showed
+  // the same image point; what was off screen gets the background color
+  const Viewport& viewport = canvas_.viewport();
+  const ViewportPoint pan = viewport.pan_offset();
+  const float scale = from.zoom / viewport.zoom();
+  const auto map_axis = [&](int count, float offset, float from_offset, int extent) {
+    std::vector<int> taps(static_cast<std::size_t>(count));
+    for (int s = 0; s < count; ++s) {
+      const float old_position = (s + 0.5f - offset) * scale + from_offset;
+      const int tap = static_cast<int>(std::floor(old_position));
+      taps[static_cast<std::size_t>(s)] = tap >= 0 && tap < extent ? tap : -1;
+    }
+    return taps;
+  };
+  const std::vector<int> columns = map_axis(back_.width, pan.x, from.pan.x, front_.width);
+  const std::vector<int> rows = map_axis(back_.height, pan.y, from.pan.y, front_.height);
+  const RGBAPixel background = canvas_.background_color();
+
+  core::ThreadPool::instance().parallel_for(0, back_.height, 16, [&](int y0, int y1) {
+    for (int y = y0; y < y1; ++y) {
+      RGBAPixel* out = &back_.at(0, y);
+      const int row = rows[static_cast<std::size_t>(y)];
+      if (row < 0) {
+        std::fill(out, out + back_.width, background);
+        continue;
+      }
+      const RGBAPixel* in = &front_.at(0, row);
+      for (int x = 0; x < back_.width; ++x) {
+        const int column = columns[static_cast<std::size_t>(x)];
+        out[x] = column >= 0 ? in[column] : background;
+      }
+    }
+  });
+}
+
+}  // namespace ps::rendering
@@ -0,0 +1,417 @@
+#include "ps/core/resample.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "ps/core/image_view.h"
+#include "ps/core/pixel_conversion.h"
+#include "ps/core/thread_pool.h"
+#include "target_clones.h"
+
+namespace ps::core {
+namespace {
+
+constexpr double kPi = 3.14159265358979323846;
+
+// Half-width of each filter at a scale of 1, in source pixels
+double filter_support(ResampleFilter filter) {
+  switch (filter) {
+    case ResampleFilter::Nearest:
+    case ResampleFilter::Box:
+      return 0.5;
+    case ResampleFilter::Bilinear:
+      return 1.0;
+    case ResampleFilter::Bicubic:
+      return 2.0;
+    case ResampleFilter::Lanczos3:
+      return 3.0;
+  }
+  return 0.5;
+}
+
+double sinc(double t) {
+  if (t == 0.0) {
+    return 1.0;
+  }
+  t *= kPi;
+  return std::sin(t) / t;
+}
+
+double filter_weight(ResampleFilter filter, double t) {
+  const double a = std::fabs(t);
+  switch (filter) {
+    case ResampleFilter::Nearest:
+    case ResampleFilter::Box:
+      // Half-open, so a sample on the boundary counts for one side only
+      return t >= -0.5 && t < 0.5 ? 1.0 : 0.0;
+    case ResampleFilter::Bilinear:
+      return a < 1.0 ? 1.0 - a : 0.0;
+    case ResampleFilter::Bicubic:
+      if (a < 1.0) {
+        return (1.5 * a - 2.5) * a * a + 1.0;
+      }
+      if (a < 2.0) {
+        return ((-0.5 * a + 2.5) * a - 4.0) * a + 2.0;
+      }
+      return 0.0;
+    case ResampleFilter::Lanczos3:
+      return a < 3.0 ? sinc(t) * sinc(t / 3.0) : 0.0;
+  }
+  return 0.0;
+}
+
+template <typename Sample>
+constexpr float max_sample() {
+  return sizeof(Sample) == 1 ? 255.0f : 65535.0f;
+}
+
+PS_TARGET_CLONES
+void load_row(float* dst, const std::uint8_t* src, int count) {
+  for (int i = 0; i < count; ++i) {
+    dst[i] = src[i];
+  }
+}
+
+PS_TARGET_CLONES
+void load_row(float* dst, const std::uint16_t* src, int count) {
+  for (int i = 0; i < count; ++i) {
+    dst[i] = src[i];
+  }
+}
+
+// dst = src * weight
+PS_TARGET_CLONES
+void multiply_row(float* dst, const float* src, float weight, int count) {
+  for (int i = 0; i < count; ++i) {
+    dst[i] = src[i] * weight;
+  }
+}
+
+// dst += src * weight
+PS_TARGET_CLONES
+void multiply_add_row(float* dst, const float* src, float weight, int count) {
+  for (int i = 0; i < count; ++i) {
+    dst[i] += src[i] * weight;
+  }
+}
+
+PS_TARGET_CLONES
+void store_row(std::uint8_t* dst, const float* src, int count) {
+  for (int i = 0; i < count; ++i) {
+    dst[i] = static_cast<std::uint8_t>(std::min(std::max(src[i], 0.0f), 255.0f) + 0.5f);
+  }
+}
+
+PS_TARGET_CLONES
+void store_row(std::uint16_t* dst, const float* src, int count) {
+  for (int i = 0; i < count; ++i) {
+    dst[i] = static_cast<std::uint16_t>(std::min(std::max(src[i], 0.0f), 65535.0f) + 0.5f);
+  }
+}
+
+// Target pixels [0, count) of one row from source pixels starting at
+// column origin of line
+template <int Components>
+inline void horizontal_row(float* dst, const float* line, const ResampleTable& columns,
+                           int x0, int count, int origin) {
+  const int taps = columns.taps();
+  for (int i = 0; i < count; ++i) {
+    const float* weights = columns.weights(x0 + i);
+    const float* src = line + static_cast<std::size_t>(columns.first(x0 + i) - origin) * Components;
+    float sum[Components] = {};
+    for (int t = 0; t < taps; ++t) {
+      for (int c = 0; c < Components; ++c) {
+        sum[c] += weights[t] * src[t * Components + c];
+      }
+    }
+    for (int c = 0; c < Components; ++c) {
+      dst[static_cast<std::size_t>(i) * Components + c] = sum[c];
+    }
+  }
+}
+
+PS_TARGET_CLONES
+void horizontal_row(int components, float* dst, const float* line, const ResampleTable& columns,
+                    int x0, int count, int origin) {
+  switch (components) {
+    case 1:
+      horizontal_row<1>(dst, line, columns, x0, count, origin);
+      break;
+    case 3:
+      horizontal_row<3>(dst, line, columns, x0, count, origin);
+      break;
+    default:
+      horizontal_row<4>(dst, line, columns, x0, count, origin);
+      break;
+  }
+}
+
+template <PixelFormat Format>
+void resample_rows(const ImageBuffer& source, ImageBuffer& target, const ResampleTable& columns,
+                   const ResampleTable& rows, const Rect& area, const ResampleReader& reader,
+                   int y0, int y1) {
+  using Sample = typename FormatTraits<Format>::Sample;
+  constexpr int kComponents = FormatTraits<Format>::kComponents;
+
+  const int width = area.width * kComponents;
+  const int taps = rows.taps();
+  const int source_x0 = columns.first(area.x);
+  const int source_count = columns.first(area.x + area.width - 1) + columns.taps() - source_x0;
+
+  // The last `taps` horizontally resampled source rows, source row r in
+  // slot r % taps
+  thread_local std::vector<Sample> raw;
+  thread_local std::vector<float> line;
+  thread_local std::vector<float> window;
+  thread_local std::vector<float> out;
+  thread_local std::vector<Sample> result;
+  raw.resize(static_cast<std::size_t>(source_count) * kComponents);
+  line.resize(raw.size());
+  window.resize(static_cast<std::size_t>(taps) * width);
+  out.resize(width);
+  result.resize(width);
+  auto slot = [&](int row) {
+    return window.data() + static_cast<std::size_t>(row % taps) * width;
+  };
+
+  int next_row = 0;  // Rows [next_row - taps, next_row) are in the window
+  bool empty = true;
+  for (int y = y0; y < y1; ++y) {
+    const int first = rows.first(y);
+    if (empty || first < next_row - taps) {
+      next_row = first;
+      empty = false;
+    }
+    // Horizontal pass over the source rows this target row adds
+    for (int sy = std::max(next_row, first); sy < first + taps; ++sy) {
+      auto* bytes = reinterpret_cast<std::uint8_t*>(raw.data());
+      if (reader) {
+        reader(source_x0, sy, source_count, bytes);
+      } else {
+        source.read_pixels(source_x0, sy, source_count, bytes);
+      }
+      load_row(line.data(), raw.data(), static_cast<int>(raw.size()));
+      horizontal_row(kComponents, slot(sy), line.data(), columns, area.x, area.width, source_x0);
+    }
+    next_row = std::max(next_row, first + taps);
+
+    // Vertical pass: whole rows per tap
+    const float* weights = rows.weights(y);
+    multiply_row(out.data(), slot(first), weights[0], width);
+    for (int t = 1; t < taps; ++t) {
+      multiply_add_row(out.data(), slot(first + t), weights[t], width);
+    }
+    store_row(result.data(), out.data(), width);
+    target.write_pixels(area.x, y, area.width, reinterpret_cast<const std::uint8_t*>(result.data()));
+  }
+}
+
+Size checked_size(Size size) {
+  if (size.width < 1 || size.height < 1) {
+    throw std::invalid_argument("resample size must be at least 1x1");
+  }
+  return size;
+}
+
+ImageBuffer resized_layer(const ImageBuffer& source, Size size, ResampleFilter filter) {
+  if (source.format() != PixelFormat::RGBA8) {
+    return resized(source, size, filter);
+  }
+  // Premultiply on the way in so transparent pixels carry no color
+  ImageBuffer premultiplied(size, PixelFormat::RGBA8Premul, source.layout(),
+                            BufferInit::Uninitialized);
+  const ResampleTable columns(source.size().width, size.width, filter);
+  const ResampleTable rows(source.size().height, size.height, filter);
+  resample(source, premultiplied, columns, rows, Rect{0, 0, size.width, size.height},
+           [&source](int x, int y, int count, std::uint8_t* out) {
+             thread_local std::vector<std::uint8_t> scratch;
+             scratch.resize(static_cast<std::size_t>(count) * 4);
+             source.read_pixels(x, y, count, scratch.data());
+             convert_rgba_span(scratch.data(), PixelFormat::RGBA8, out,
+                               PixelFormat::RGBA8Premul, count);
+           });
+  return convert_rgba_buffer(premultiplied, PixelFormat::RGBA8);
+}
+
+SelectionMask resized_selection(const SelectionMask& selection, Size size,
+                                ResampleFilter filter) {
+  SelectionMask result(size);
+  if (!selection.has_selection()) {
+    return result;
+  }
+  const Size source_size = selection.size();
+  ImageBuffer mask(source_size, PixelFormat::Gray8, StorageLayout::Contiguous,
+                   BufferInit::Uninitialized);
+  for (int y = 0; y < source_size.height; ++y) {
+    selection.read_row(0, y, source_size.width, mask.mutable_pixel_row(0, y));
+  }
+  const ImageBuffer reduced = resized(mask, size, filter);
+  for (int y = 0; y < size.height; ++y) {
+    result.write_row(0, y, size.width, reduced.pixel_row(0, y));
+  }
+  return result;
+}
+
+}  // namespace
+
+ResampleTable::ResampleTable(int source_size, int target_size, ResampleFilter filter)
+    : ResampleTable(source_size, target_size, filter,
+                    source_size > 0 ? static_cast<double>(target_size) / source_size : 1.0) {}
+
+ResampleTable::ResampleTable(int source_size, int target_size, ResampleFilter filter,
+                             double scale)
+    : source_size_(source_size) {
+  if (source_size < 1 || target_size < 1 || !(scale > 0.0)) {
+    throw std::invalid_argument("resample tables need positive sizes and scale");
+  }
+
+  // Weights per target pixel, folded onto the source pixels from begin[i]
+  const double stretch = std::max(1.0, 1.0 / scale);
+  const double support = filter_support(filter) * stretch;
+  std::vector<std::vector<double>> folded(static_cast<std::size_t>(target_size));
+  std::vector<int> begin(static_cast<std::size_t>(target_size));
+  first_.resize(static_cast<std::size_t>(target_size));
+  std::vector<double> window;
+  for (int i = 0; i < target_size; ++i) {
+    const double center = (i + 0.5) / scale - 0.5;
+    int lo = 0;
+    if (filter == ResampleFilter::Nearest) {
+      lo = std::clamp(static_cast<int>(std::floor((i + 0.5) / scale)), 0, source_size - 1);
+      window.assign(1, 1.0);
+    } else {
+      const int reach_lo = static_cast<int>(std::ceil(center - support));
+      const int reach_hi = static_cast<int>(std::floor(center + support));
+      lo = std::clamp(reach_lo, 0, source_size - 1);
+      const int hi = std::clamp(reach_hi, 0, source_size - 1);
+      window.assign(static_cast<std::size_t>(hi - lo + 1), 0.0);
+      for (int j = reach_lo; j <= reach_hi; ++j) {
+        window[static_cast<std::size_t>(std::clamp(j, lo, hi) - lo)] +=
+            filter_weight(filter, (j - center) / stretch);
+      }
+    }
+
+    double total = 0.0;
+    for (double w : window) {
+      total += w;
+    }
+    if (total == 0.0) {
+      // A box narrower than the source spacing; take the nearest pixel
+      lo = std::clamp(static_cast<int>(std::lround(center)), 0, source_size - 1);
+      window.assign(1, 1.0);
+      total = 1.0;
+    }
+    std::size_t first = 0;
+    std::size_t last = window.size() - 1;
+    while (window[first] == 0.0) {
+      ++first;
+    }
+    while (window[last] == 0.0) {
+      --last;
+    }
+    std::vector<double>& weights = folded[static_cast<std::size_t>(i)];
+    weights.assign(window.begin() + first, window.begin() + last + 1);
+    for (double& w : weights) {
+      w /= total;
+    }
+    begin[static_cast<std::size_t>(i)] = lo + static_cast<int>(first);
+    taps_ = std::max(taps_, static_cast<int>(weights.size()));
+  }
+
+  // Equal tap counts: windows that would pass the right edge start earlier
+  weights_.assign(static_cast<std::size_t>(target_size) * taps_, 0.0f);
+  for (int i = 0; i < target_size; ++i) {
+    const int start = begin[static_cast<std::size_t>(i)];
+    const int first = std::min(start, source_size - taps_);
+    first_[static_cast<std::size_t>(i)] = first;
+    const std::vector<double>& weights = folded[static_cast<std::size_t>(i)];
+    for (std::size_t t = 0; t < weights.size(); ++t) {
+      weights_[static_cast<std::size_t>(i) * taps_ + (start - first) + t] =
+          static_cast<float>(weights[t]);
+    }
+  }
+}
+
+void resample(const ImageBuffer& source, ImageBuffer& target, const ResampleTable& columns,
+              const ResampleTable& rows, const Rect& area, const ResampleReader& reader) {
+  const Size source_size = source.size();
+  const Size target_size = target.size();
+  if (columns.source_size() != source_size.width || rows.source_size() != source_size.height ||
+      columns.target_size() != target_size.width || rows.target_size() != target_size.height) {
+    throw std::invalid_argument("resample tables do not match the buffers");
+  }
+  if (!reader && source.format() != target.format()) {
+    throw std::invalid_argument("resample needs a reader to convert formats");
+  }
+  const Rect rect = area.intersected(Rect{0, 0, target_size.width, target_size.height});
+  if (rect.is_empty()) {
+    return;
+  }
+
+  // Bands of target rows; each resamples its source rows once, plus the
+  // rows it shares with the band above. Tiled targets get one band per row
+  // of tiles, so no two tasks write to (and allocate) the same tile.
+  const int band = target.is_tiled() ? ImageBuffer::kTileSize : 32;
+  const int first_band = rect.y / band;
+  const int band_count = (rect.y + rect.height - 1) / band - first_band + 1;
+  dispatch_format(target.format(), [&](auto format) {
+    ThreadPool::instance().parallel_for(0, band_count, 1, [&](int b0, int b1) {
+      for (int b = b0; b < b1; ++b) {
+        const int y0 = std::max(rect.y, (first_band + b) * band);
+        const int y1 = std::min(rect.y + rect.height, (first_band + b + 1) * band);
+        resample_rows<decltype(format)::value>(source, target, columns, rows, rect, reader, y0,
+                                               y1);
+      }
+    });
+  });
+}
+
+ImageBuffer resized(const ImageBuffer& source, Size size, ResampleFilter filter) {
+  checked_size(size);
+  ImageBuffer target(size, source.format(), source.layout(), BufferInit::Uninitialized);
+  const ResampleTable columns(source.size().width, size.width, filter);
+  const ResampleTable rows(source.size().height, size.height, filter);
+  resample(source, target, columns, rows, Rect{0, 0, size.width, size.height});
+  return target;
+}
+
+ResizeCommand::ResizeCommand(ImageDocument& doc, Size size, ResampleFilter filter)
+    : document_(doc), size_(checked_size(size)), filter_(filter) {}
+
+void ResizeCommand::execute() {
+  if (!resampled_) {
+    pixels_.size = size_;
+    pixels_.channels.clear();
+    for (const ImageChannel& channel : document_.channels()) {
+      pixels_.channels.push_back(resized(channel.buffer, size_, filter_));
+    }
+    pixels_.layers.clear();
+    for (const auto& layer : document_.layers()) {
+      pixels_.layers.push_back(resized_layer(layer->buffer(), size_, filter_));
+    }
+    pixels_.selection = resized_selection(document_.selection(), size_, filter_);
+    resampled_ = true;
+  }
+  document_.swap_pixels(pixels_);
+}
+
+void ResizeCommand::undo() {
+  document_.swap_pixels(pixels_);
+}
+
+void ResizeCommand::redo() {
+  document_.swap_pixels(pixels_);
+}
+
+std::size_t ResizeCommand::memory_footprint() const {
+  std::size_t bytes = pixels_.selection.memory_footprint();
+  for (const ImageBuffer& buffer : pixels_.channels) {
+    bytes += buffer.allocated_bytes();
+  }
+  for (const ImageBuffer& buffer : pixels_.layers) {
+    bytes += buffer.allocated_bytes();
+  }
+  return bytes;
+}
+
+}  // namespace ps::core
@@ -1,22 +1,90 @@
 #include "ps/core/selection_command.h"
 
+#include <algorithm>
+
+#include "ps/core/packbits.h"
+
 namespace ps::core {
 
 SelectionCommand::SelectionCommand(ImageDocument& doc,
-                                   SelectionMask before,
-                                   SelectionMask after,
+                                   const SelectionMask& before,
+                                   const SelectionMask& after,
                                    std::string label)
     : document_(doc),
-      before_(std::move(before)),
-      after_(std::move(after)),
-      label_(std::move(label)) {}
+      area_(before.difference_bounds(after)),
+      keep_before_(before.memory_footprint() == 0),
+      keep_after_(after.memory_footprint() == 0),
+      applied_(doc.selection().revision() == after.revision()),
+      label_(std::move(label)) {
+  if (keep_before_) {
+    before_ = before;
+  }
+  if (keep_after_) {
+    after_ = after;
+  }
+  if (area_.is_empty() || (keep_before_ && keep_after_)) {
+    return;
+  }
+
+  const std::size_t width = static_cast<std::size_t>(area_.width);
+  std::vector<std::uint8_t> row(width);
+  std::vector<std::uint8_t> other(width);
+  for (int y = area_.y; y < area_.y + area_.height; ++y) {
+    before.read_row(area_.x, y, area_.width, row.data());
+    after.read_row(area_.x, y, area_.width, other.data());
+    for (std::size_t i = 0; i < width; ++i) {
+      row[i] = static_cast<std::uint8_t>(row[i] ^ other[i]);
+    }
+    packbits_encode(row.data(), width, xor_);
+  }
+  xor_.shrink_to_fit();
+}
 
 void SelectionCommand::execute() {
-  document_.selection() = after_;
+  if (applied_) {
+    return;
+  }
+  if (keep_after_) {
+    document_.selection() = after_;
+  } else {
+    toggle();
+  }
+  applied_ = true;
 }
 
 void SelectionCommand::undo() {
-  document_.selection() = before_;
+  if (!applied_) {
+    return;
+  }
+  if (keep_before_) {
+    document_.selection() = before_;
+  } else {
+    toggle();
+  }
+  applied_ = false;
+}
+
+void SelectionCommand::toggle() {
+  SelectionMask& mask = document_.selection();
+  const std::size_t width = static_cast<std::size_t>(area_.width);
+  std::vector<std::uint8_t> diff(width);
+  std::vector<std::uint8_t> row(width);
+  std::size_t offset = 0;
+  for (int y = area_.y; y < area_.y + area_.height; ++y) {
+    offset += packbits_decode(xor_.data() + offset, xor_.size() - offset, diff.data(), width);
+    if (std::all_of(diff.begin(), diff.end(), [](std::uint8_t v) { return v == 0; })) {
+      continue;
+    }
+    mask.read_row(area_.x, y, area_.width, row.data());
+    for (std::size_t i = 0; i < width; ++i) {
+      row[i] = static_cast<std::uint8_t>(row[i] ^ diff[i]);
+    }
+    mask.write_row(area_.x, y, area_.width, row.data());
+  }
+}
+
+std::size_t SelectionCommand::memory_footprint() const {
+  return xor_.capacity() + before_.memory_footprint() + after_.memory_footprint();
 }
 
 }  // namespace ps::core
@@ -1,15 +1,98 @@
 #include "ps/core/selection_mask.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <cstring>
+#include <limits>
+
+#include "ps/core/thread_pool.h"
 
 namespace ps::core {
 
+namespace {
+
+std::uint64_t next_revision() {
+  static std::atomic<std::uint64_t> counter{0};
+  return counter.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+// Rows per block when bounds and outline are computed in parallel
+constexpr int kRowsPerBlock = 64;
+
+// Minimum number of pixels by which a side of the stored extent grows, so
+// that selections built pixel by pixel reallocate only occasionally
+constexpr int kMinExtentGrowth = 64;
+
+// Columns per strip in the vertical passes of feather, grow and shrink.
+// Their inner loops run across a strip, which the compiler vectorizes.
+constexpr int kStripWidth = 256;
+
+// Column distance of a pixel with no site in its column
+constexpr std::int32_t kNoSite = std::numeric_limits<std::int32_t>::max();
+
+// Young and van Vliet's recursive Gaussian, normalized so that
+// out = b * in + a1 * out[-1] + a2 * out[-2] + a3 * out[-3]
+struct RecursiveGaussian {
+  float b = 1.0f;
+  float a1 = 0.0f;
+  float a2 = 0.0f;
+  float a3 = 0.0f;
+};
+
+RecursiveGaussian recursive_gaussian(float sigma) {
+  const float q = sigma >= 2.5f ? 0.98711f * sigma - 0.96330f
+                                : 3.97156f - 4.14554f * std::sqrt(1.0f - 0.26891f * sigma);
+  const float q2 = q * q;
+  const float q3 = q2 * q;
+  const float b0 = 1.57825f + 2.44413f * q + 1.4281f * q2 + 0.422205f * q3;
+  RecursiveGaussian g;
+  g.a1 = (2.44413f * q + 2.85619f * q2 + 1.26661f * q3) / b0;
+  g.a2 = -(1.4281f * q2 + 1.26661f * q3) / b0;
+  g.a3 = 0.422205f * q3 / b0;
+  g.b = 1.0f - (g.a1 + g.a2 + g.a3);
+  return g;
+}
+
+bool contains(const Rect& outer, const Rect& inner) {
+  return inner.is_empty() ||
+         (inner.x >= outer.x && inner.y >= outer.y &&
+          inner.x + inner.width <= outer.x + outer.width &&
+          inner.y + inner.height <= outer.y + outer.height);
+}
+
+Rect expanded(const Rect& rect, int margin, Size limit) {
+  return Rect{rect.x - margin, rect.y - margin, rect.width + 2 * margin,
+              rect.height + 2 * margin}
+      .intersected(Rect{0, 0, limit.width, limit.height});
+}
+
+// Bounding box of the pixels of a size-sized image outside hole
+Rect complement_bounds(Size size, const Rect& hole) {
+  if (hole.is_empty()) {
+    return Rect{0, 0, size.width, size.height};
+  }
+  const int right = hole.x + hole.width;
+  const int bottom = hole.y + hole.height;
+  const bool all_rows = hole.x > 0 || right < size.width;
+  const bool all_columns = hole.y > 0 || bottom < size.height;
+  if (!all_rows && !all_columns) {
+    return Rect{};
+  }
+  const int left = all_columns || hole.x > 0 ? 0 : right;
+  const int top = all_rows || hole.y > 0 ? 0 : bottom;
+  const int x1 = all_columns || right < size.width ? size.width : hole.x;
+  const int y1 = all_rows || bottom < size.height ? size.height : hole.y;
+  return Rect{left, top, x1 - left, y1 - top};
+}
+
+}  // namespace
+
 SelectionMask::SelectionMask(Size size) { resize(size); }
 
 void SelectionMask::resize(Size size) {
   size_ = size;
-  mask_.assign(static_cast<std::size_t>(size_.width * size_.height), 0);
+  fill(0);
 }
 
 void SelectionMask::clear() {
@@ -17,26 +100,264 @@ void SelectionMask::clear() {
 }
 
 void SelectionMask::fill(std::uint8_t value) {
-  std::fill(mask_.begin(), mask_.end(), value);
+  revision_ = next_revision();
+  extent_ = Rect{};
+  outside_ = value;
+  pixels_.reset();
 }
 
 std::uint8_t SelectionMask::at(int x, int y) const {
   if (x < 0 || y < 0 || x >= size_.width || y >= size_.height) {
     return 0;
   }
-  return mask_[index_for(x, y)];
+  if (x < extent_.x || y < extent_.y || x >= extent_.x + extent_.width ||
+      y >= extent_.y + extent_.height) {
+    return outside_;
+  }
+  return pixels_ ? (*pixels_)[index_for(x, y)] : solid_;
 }
 
 void SelectionMask::set(int x, int y, std::uint8_t value) {
   if (x < 0 || y < 0 || x >= size_.width || y >= size_.height) {
     return;
   }
-  mask_[index_for(x, y)] = value;
+  revision_ = next_revision();
+  if (at(x, y) == value) {
+    return;
+  }
+  include(Rect{x, y, 1, 1}, true);
+  writable_pixels()[index_for(x, y)] = value;
+}
+
+void SelectionMask::read_row(int x, int y, int width, std::uint8_t* out) const {
+  if (width <= 0) {
+    return;
+  }
+  std::memset(out, 0, static_cast<std::size_t>(width));
+  if (y < 0 || y >= size_.height) {
+    return;
+  }
+  const int x0 = std::clamp(x, 0, size_.width);
+  const int x1 = std::clamp(x + width, 0, size_.width);
+  if (x1 <= x0) {
+    return;
+  }
+  std::memset(out + (x0 - x), outside_, static_cast<std::size_t>(x1 - x0));
+  if (y < extent_.y || y >= extent_.y + extent_.height) {
+    return;
+  }
+  const int e0 = std::max(x0, extent_.x);
+  const int e1 = std::min(x1, extent_.x + extent_.width);
+  if (e1 <= e0) {
+    return;
+  }
+  if (pixels_) {
+    std::memcpy(out + (e0 - x), pixels_->data() + index_for(e0, y),
+                static_cast<std::size_t>(e1 - e0));
+  } else {
+    std::memset(out + (e0 - x), solid_, static_cast<std::size_t>(e1 - e0));
+  }
+}
+
+void SelectionMask::write_row(int x, int y, int width, const std::uint8_t* values) {
+  if (y < 0 || y >= size_.height) {
+    return;
+  }
+  const int x0 = std::clamp(x, 0, size_.width);
+  const int x1 = std::clamp(x + width, 0, size_.width);
+  if (x1 <= x0) {
+    return;
+  }
+  revision_ = next_revision();
+
+  const std::uint8_t* first = values + (x0 - x);
+  const Rect area{x0, y, x1 - x0, 1};
+  if (area.intersected(extent_).is_empty() &&
+      std::all_of(first, first + area.width, [this](std::uint8_t v) { return v == outside_; })) {
+    return;
+  }
+  include(area, true);
+  std::memcpy(writable_pixels() + index_for(x0, y), first, static_cast<std::size_t>(area.width));
 }
 
-bool SelectionMask::has_selection() const {
-  return std::any_of(mask_.begin(), mask_.end(),
-                     [](std::uint8_t value) { return value > 0; });
+Rect SelectionMask::difference_bounds(const SelectionMask& other) const {
+  if (pixels_ == other.pixels_ && outside_ == other.outside_ && solid_ == other.solid_ &&
+      extent_.x == other.extent_.x && extent_.y == other.extent_.y &&
+      extent_.width == other.extent_.width && extent_.height == other.extent_.height) {
+    return Rect{};
+  }
+
+  // Outside both extents the masks hold their outside values
+  const Rect area = outside_ != other.outside_ ? Rect{0, 0, size_.width, size_.height}
+                                               : extent_.united(other.extent_);
+  const int blocks = (area.height + kRowsPerBlock - 1) / kRowsPerBlock;
+  std::vector<Rect> parts(static_cast<std::size_t>(blocks));
+  ThreadPool::instance().parallel_for(0, blocks, 1, [&](int b0, int b1) {
+    std::vector<std::uint8_t> mine(static_cast<std::size_t>(area.width));
+    std::vector<std::uint8_t> theirs(static_cast<std::size_t>(area.width));
+    for (int b = b0; b < b1; ++b) {
+      const int y_begin = area.y + b * kRowsPerBlock;
+      const int y_end = std::min(area.y + area.height, y_begin + kRowsPerBlock);
+      Rect part{};
+      for (int y = y_begin; y < y_end; ++y) {
+        read_row(area.x, y, area.width, mine.data());
+        other.read_row(area.x, y, area.width, theirs.data());
+        const auto first = std::mismatch(mine.begin(), mine.end(), theirs.begin());
+        if (first.first == mine.end()) {
+          continue;
+        }
+        int last = area.width - 1;
+        while (mine[static_cast<std::size_t>(last)] == theirs[static_cast<std::size_t>(last)]) {
+          --last;
+        }
+        const int x0 = static_cast<int>(first.first - mine.begin());
+        part = part.united(Rect{area.x + x0, y, last - x0 + 1, 1});
+      }
+      parts[static_cast<std::size_t>(b)] = part;
+    }
+  });
+
+  Rect result{};
+  for (const Rect& part : parts) {
+    result = result.united(part);
+  }
+  return result;
+}
+
+std::size_t SelectionMask::memory_footprint() const {
+  return pixels_ ? pixels_->size() : 0;
+}
+
+Rect SelectionMask::bounds() const {
+  if (bounds_revision_ == revision_) {
+    return bounds_;
+  }
+
+  Rect result = outside_ > 0 ? complement_bounds(size_, extent_) : Rect{};
+  if (!pixels_) {
+    if (solid_ > 0) {
+      result = result.united(extent_);
+    }
+  } else {
+    const int width = extent_.width;
+    const int blocks = (extent_.height + kRowsPerBlock - 1) / kRowsPerBlock;
+    std::vector<Rect> parts(static_cast<std::size_t>(blocks));
+    ThreadPool::instance().parallel_for(0, blocks, 1, [&](int b0, int b1) {
+      for (int b = b0; b < b1; ++b) {
+        const int y_begin = extent_.y + b * kRowsPerBlock;
+        const int y_end = std::min(extent_.y + extent_.height, y_begin + kRowsPerBlock);
+        int left = width;
+        int right = 0;
+        int top = -1;
+        int bottom = -1;
+        for (int y = y_begin; y < y_end; ++y) {
+          const std::uint8_t* row = pixels_->data() + index_for(extent_.x, y);
+          const std::uint8_t* first =
+              std::find_if(row, row + width, [](std::uint8_t v) { return v > 0; });
+          if (first == row + width) {
+            continue;
+          }
+          // Only the parts outside [left, right) can widen the box
+          const int x0 = static_cast<int>(first - row);
+          int x1 = x0 + 1;
+          for (int x = width - 1; x >= std::max(x1, right); --x) {
+            if (row[x] > 0) {
+              x1 = x + 1;
+              break;
+            }
+          }
+          left = std::min(left, x0);
+          right = std::max(right, x1);
+          if (top < 0) {
+            top = y;
+          }
+          bottom = y + 1;
+        }
+        if (top >= 0) {
+          parts[static_cast<std::size_t>(b)] =
+              Rect{extent_.x + left, top, right - left, bottom - top};
+        }
+      }
+    });
+    for (const Rect& part : parts) {
+      result = result.united(part);
+    }
+  }
+  bounds_ = result;
+  bounds_revision_ = revision_;
+  return bounds_;
+}
+
+const std::vector<SelectionMask::OutlineRun>& SelectionMask::outline() const {
+  if (outline_revision_ == revision_) {
+    return outline_;
+  }
+  outline_.clear();
+  outline_revision_ = revision_;
+
+  const Rect area = bounds();
+  if (area.is_empty()) {
+    return outline_;
+  }
+
+  // A solid rectangle is outlined by its border
+  if (!pixels_ && outside_ == 0) {
+    const int right = area.x + area.width;
+    for (int y = area.y; y < area.y + area.height; ++y) {
+      if (y == area.y || y + 1 == area.y + area.height || area.width <= 2) {
+        outline_.push_back(OutlineRun{y, area.x, right});
+      } else {
+        outline_.push_back(OutlineRun{y, area.x, area.x + 1});
+        outline_.push_back(OutlineRun{y, right - 1, right});
+      }
+    }
+    return outline_;
+  }
+
+  const int blocks = (area.height + kRowsPerBlock - 1) / kRowsPerBlock;
+  std::vector<std::vector<OutlineRun>> parts(static_cast<std::size_t>(blocks));
+  ThreadPool::instance().parallel_for(0, blocks, 1, [&](int b0, int b1) {
+    // Rows of the area with one pixel of padding on each side, which read
+    // as unselected outside the mask
+    const int padded = area.width + 2;
+    std::vector<std::uint8_t> rows(static_cast<std::size_t>(padded) * 3);
+    for (int b = b0; b < b1; ++b) {
+      std::vector<OutlineRun>& runs = parts[static_cast<std::size_t>(b)];
+      const int y_begin = area.y + b * kRowsPerBlock;
+      const int y_end = std::min(area.y + area.height, y_begin + kRowsPerBlock);
+      std::uint8_t* above = rows.data();
+      std::uint8_t* row = above + padded;
+      std::uint8_t* below = row + padded;
+      read_row(area.x - 1, y_begin - 1, padded, above);
+      read_row(area.x - 1, y_begin, padded, row);
+      for (int y = y_begin; y < y_end; ++y) {
+        read_row(area.x - 1, y + 1, padded, below);
+        int run_start = -1;
+        for (int i = 1; i <= area.width; ++i) {
+          const bool edge = row[i] > 0 && (row[i - 1] == 0 || row[i + 1] == 0 ||
+                                           above[i] == 0 || below[i] == 0);
+          if (edge && run_start < 0) {
+            run_start = i;
+          } else if (!edge && run_start >= 0) {
+            runs.push_back(OutlineRun{y, area.x + run_start - 1, area.x + i - 1});
+            run_start = -1;
+          }
+        }
+        if (run_start >= 0) {
+          runs.push_back(OutlineRun{y, area.x + run_start - 1, area.x + area.width});
+        }
+        std::uint8_t* oldest = above;
+        above = row;
+        row = below;
+        below = oldest;
+      }
+    }
+  });
+
+  for (const std::vector<OutlineRun>& runs : parts) {
+    outline_.insert(outline_.end(), runs.begin(), runs.end());
+  }
+  return outline_;
 }
 
 void SelectionMask::fill_rect(int x, int y, int width, int height,
@@ -44,16 +365,27 @@ void SelectionMask::fill_rect(int x, int y, int width, int height,
   if (width <= 0 || height <= 0) {
     return;
   }
+  revision_ = next_revision();
 
-  const int x0 = std::clamp(x, 0, size_.width);
-  const int y0 = std::clamp(y, 0, size_.height);
-  const int x1 = std::clamp(x + width, 0, size_.width);
-  const int y1 = std::clamp(y + height, 0, size_.height);
+  const Rect area = Rect{x, y, width, height}.intersected(Rect{0, 0, size_.width, size_.height});
+  if (area.is_empty()) {
+    return;
+  }
+  if (contains(area, extent_)) {
+    // Everything stored is overwritten; the rectangle becomes the extent
+    extent_ = area;
+    solid_ = value;
+    pixels_.reset();
+    return;
+  }
+  if (!pixels_ && solid_ == value && contains(extent_, area)) {
+    return;
+  }
 
-  for (int yy = y0; yy < y1; ++yy) {
-    for (int xx = x0; xx < x1; ++xx) {
-      set_unchecked(xx, yy, value);
-    }
+  include(area, true);
+  std::uint8_t* pixels = writable_pixels();
+  for (int yy = area.y; yy < area.y + area.height; ++yy) {
+    std::memset(pixels + index_for(area.x, yy), value, static_cast<std::size_t>(area.width));
   }
 }
 
@@ -62,6 +394,7 @@ void SelectionMask::fill_ellipse(int x, int y, int width, int height,
   if (width <= 0 || height <= 0) {
     return;
   }
+  revision_ = next_revision();
 
   const float rx = width / 2.0f;
   const float ry = height / 2.0f;
@@ -72,124 +405,450 @@ void SelectionMask::fill_ellipse(int x, int y, int width, int height,
   const float cx = x + rx;
   const float cy = y + ry;
 
-  const int x0 = std::clamp(x, 0, size_.width);
-  const int y0 = std::clamp(y, 0, size_.height);
-  const int x1 = std::clamp(x + width, 0, size_.width);
-  const int y1 = std::clamp(y + height, 0, size_.height);
-
-  for (int yy = y0; yy < y1; ++yy) {
-    for (int xx = x0; xx < x1; ++xx) {
-      const float dx = (xx + 0.5f - cx) / rx;
-      const float dy = (yy + 0.5f - cy) / ry;
-      if (dx * dx + dy * dy <= 1.0f) {
-        set_unchecked(xx, yy, value);
+  const Rect area = Rect{x, y, width, height}.intersected(Rect{0, 0, size_.width, size_.height});
+  if (area.is_empty()) {
+    return;
+  }
+  if (contains(area, extent_)) {
+    // Nothing stored lies outside the ellipse's box; start from a fresh one
+    std::vector<std::uint8_t> pixels(static_cast<std::size_t>(area.width) * area.height,
+                                     outside_);
+    for (int yy = extent_.y; yy < extent_.y + extent_.height; ++yy) {
+      const std::size_t offset =
+          static_cast<std::size_t>(yy - area.y) * area.width + (extent_.x - area.x);
+      if (pixels_) {
+        std::memcpy(pixels.data() + offset, pixels_->data() + index_for(extent_.x, yy),
+                    static_cast<std::size_t>(extent_.width));
+      } else {
+        std::memset(pixels.data() + offset, solid_, static_cast<std::size_t>(extent_.width));
       }
     }
+    extent_ = area;
+    pixels_ = std::make_shared<std::vector<std::uint8_t>>(std::move(pixels));
+  } else {
+    include(area, true);
+  }
+
+  // Each row of the ellipse is one span. Its ends are estimated, then moved
+  // to where the per-pixel test changes, so the result is the same as
+  // testing every pixel of the box.
+  const auto inside = [&](int xx, float dy_sq) {
+    const float dx = (xx + 0.5f - cx) / rx;
+    return dx * dx + dy_sq <= 1.0f;
+  };
+  const int x0 = area.x;
+  const int x1 = area.x + area.width;
+  std::uint8_t* pixels = writable_pixels();
+  for (int yy = area.y; yy < area.y + area.height; ++yy) {
+    const float dy = (yy + 0.5f - cy) / ry;
+    const float dy_sq = dy * dy;
+    if (dy_sq > 1.0f) {
+      continue;
+    }
+    const float half = rx * std::sqrt(1.0f - dy_sq);
+    int left = std::clamp(static_cast<int>(std::ceil(cx - half - 0.5f)), x0, x1);
+    while (left > x0 && inside(left - 1, dy_sq)) {
+      --left;
+    }
+    while (left < x1 && !inside(left, dy_sq)) {
+      ++left;
+    }
+    int right = std::clamp(static_cast<int>(std::floor(cx + half - 0.5f)) + 1, left, x1);
+    while (right < x1 && inside(right, dy_sq)) {
+      ++right;
+    }
+    while (right > left && !inside(right - 1, dy_sq)) {
+      --right;
+    }
+    if (right > left) {
+      std::memset(pixels + index_for(left, yy), value, static_cast<std::size_t>(right - left));
+    }
   }
 }
 
 void SelectionMask::invert() {
-  for (auto& value : mask_) {
-    value = static_cast<std::uint8_t>(255 - value);
+  revision_ = next_revision();
+  outside_ = static_cast<std::uint8_t>(255 - outside_);
+  if (!pixels_) {
+    solid_ = static_cast<std::uint8_t>(255 - solid_);
+    return;
+  }
+  std::uint8_t* pixels = writable_pixels();
+  const std::size_t count = pixels_->size();
+  for (std::size_t i = 0; i < count; ++i) {
+    pixels[i] = static_cast<std::uint8_t>(255 - pixels[i]);
   }
 }
 
-void SelectionMask::feather(int radius) {
-  if (radius <= 0 || mask_.empty()) {
-    return;
+bool SelectionMask::store_neighbourhood(int margin) {
+  if (extent_.is_empty()) {
+    return false;
+  }
+  if (outside_ != 0) {
+    include(Rect{0, 0, size_.width, size_.height}, false);
+  } else {
+    include(expanded(extent_, margin, size_), false);
   }
+  writable_pixels();
+  return true;
+}
 
-  std::vector<std::uint8_t> temp(mask_.size(), 0);
-  const int r = radius;
-  const int w = size_.width;
-  const int h = size_.height;
+void SelectionMask::include(const Rect& area, bool pad) {
+  Rect grown = extent_.united(area);
+  if (contains(extent_, grown)) {
+    return;
+  }
+  if (pad && !extent_.is_empty()) {
+    // Grow each side that moves by half the stored size, so selections
+    // built row by row or pixel by pixel reallocate only occasionally
+    const int grow_x = std::max(kMinExtentGrowth, extent_.width / 2);
+    const int grow_y = std::max(kMinExtentGrowth, extent_.height / 2);
+    const int left = grown.x < extent_.x ? std::max(0, grown.x - grow_x) : grown.x;
+    const int top = grown.y < extent_.y ? std::max(0, grown.y - grow_y) : grown.y;
+    int right = grown.x + grown.width;
+    int bottom = grown.y + grown.height;
+    if (right > extent_.x + extent_.width) {
+      right = std::min(size_.width, right + grow_x);
+    }
+    if (bottom > extent_.y + extent_.height) {
+      bottom = std::min(size_.height, bottom + grow_y);
+    }
+    grown = Rect{left, top, right - left, bottom - top};
+  }
 
-  for (int y = 0; y < h; ++y) {
-    for (int x = 0; x < w; ++x) {
-      int sum = 0;
-      int count = 0;
-      for (int yy = std::max(0, y - r); yy <= std::min(h - 1, y + r); ++yy) {
-        for (int xx = std::max(0, x - r); xx <= std::min(w - 1, x + r); ++xx) {
-          sum += at_unchecked(xx, yy);
-          ++count;
-        }
-      }
-      temp[index_for(x, y)] = static_cast<std::uint8_t>(sum / count);
+  std::vector<std::uint8_t> pixels(static_cast<std::size_t>(grown.width) * grown.height,
+                                   outside_);
+  for (int y = extent_.y; y < extent_.y + extent_.height; ++y) {
+    std::uint8_t* out = pixels.data() +
+                        static_cast<std::size_t>(y - grown.y) * grown.width +
+                        (extent_.x - grown.x);
+    if (pixels_) {
+      std::memcpy(out, pixels_->data() + index_for(extent_.x, y),
+                  static_cast<std::size_t>(extent_.width));
+    } else {
+      std::memset(out, solid_, static_cast<std::size_t>(extent_.width));
     }
   }
+  extent_ = grown;
+  pixels_ = std::make_shared<std::vector<std::uint8_t>>(std::move(pixels));
+}
+
+std::uint8_t* SelectionMask::writable_pixels() {
+  if (!pixels_) {
+    pixels_ = std::make_shared<std::vector<std::uint8_t>>(
+        static_cast<std::size_t>(extent_.width) * extent_.height, solid_);
+  } else if (pixels_.use_count() > 1) {
+    pixels_ = std::make_shared<std::vector<std::uint8_t>>(*pixels_);
+  }
+  return pixels_->data();
+}
 
-  mask_.swap(temp);
+void SelectionMask::feather(int radius, FeatherShape shape) {
+  revision_ = next_revision();
+  if (radius <= 0) {
+    return;
+  }
+  // Windows are clipped to the mask, so larger radii change nothing
+  const int r = std::min(radius, std::max(size_.width, size_.height));
+  // The Gaussian's tails are negligible beyond about 2.3 radii
+  if (!store_neighbourhood(shape == FeatherShape::Gaussian ? 3 * r + 2 : r)) {
+    return;
+  }
+  if (shape == FeatherShape::Gaussian) {
+    feather_gaussian(r);
+  } else {
+    feather_box(r);
+  }
 }
 
 void SelectionMask::grow(int radius) {
-  if (radius <= 0 || mask_.empty()) {
+  revision_ = next_revision();
+  if (radius <= 0) {
+    return;
+  }
+  if (!store_neighbourhood(std::min(radius, std::max(size_.width, size_.height)))) {
+    outside_ = outside_ > 0 ? 255 : 0;
+    return;
+  }
+
+  // A pixel is selected if a selected pixel lies within the radius
+  const std::int64_t r_sq = static_cast<std::int64_t>(radius) * radius;
+  threshold_distance(true, [r_sq](std::uint8_t, std::int64_t distance_sq) {
+    return distance_sq <= r_sq;
+  });
+}
+
+void SelectionMask::shrink(int radius) {
+  revision_ = next_revision();
+  if (radius <= 0) {
+    return;
+  }
+  // The nearest unselected pixel outside the extent is at most one pixel
+  // beyond it
+  if (!store_neighbourhood(1)) {
+    outside_ = outside_ > 0 ? 255 : 0;
     return;
   }
 
-  std::vector<std::uint8_t> result(mask_.size(), 0);
+  // A pixel stays selected if no unselected pixel lies within the radius
+  const std::int64_t r_sq = static_cast<std::int64_t>(radius) * radius;
+  threshold_distance(false, [r_sq](std::uint8_t value, std::int64_t distance_sq) {
+    return value > 0 && distance_sq > r_sq;
+  });
+}
+
+void SelectionMask::feather_box(int radius) {
+  const int w = extent_.width;
+  const int h = extent_.height;
   const int r = radius;
-  const int w = size_.width;
-  const int h = size_.height;
-  const int r_sq = r * r;
-
-  for (int y = 0; y < h; ++y) {
-    for (int x = 0; x < w; ++x) {
-      bool selected = false;
-      for (int yy = std::max(0, y - r); yy <= std::min(h - 1, y + r); ++yy) {
-        for (int xx = std::max(0, x - r); xx <= std::min(w - 1, x + r); ++xx) {
-          const int dx = xx - x;
-          const int dy = yy - y;
-          if (dx * dx + dy * dy <= r_sq && at_unchecked(xx, yy) > 0) {
-            selected = true;
-            break;
-          }
+  const auto offset = [w](int x, int y) { return static_cast<std::size_t>(y) * w + x; };
+  std::uint8_t* pixels = pixels_->data();
+
+  // Window sums along each row, then running sums of those down each
+  // column. Pixels outside the extent are unselected and add nothing to
+  // the sums, but the window areas are clipped to the mask.
+  std::vector<std::uint32_t> row_sums(pixels_->size());
+  ThreadPool::instance().parallel_for(0, h, 16, [&](int y0, int y1) {
+    for (int y = y0; y < y1; ++y) {
+      const std::uint8_t* in = pixels + offset(0, y);
+      std::uint32_t* out = row_sums.data() + offset(0, y);
+      std::uint32_t sum = 0;
+      for (int x = 0; x <= std::min(w - 1, r); ++x) {
+        sum += in[x];
+      }
+      for (int x = 0; x < w; ++x) {
+        out[x] = sum;
+        if (x + r + 1 < w) {
+          sum += in[x + r + 1];
         }
-        if (selected) {
-          break;
+        if (x - r >= 0) {
+          sum -= in[x - r];
         }
       }
-      result[index_for(x, y)] = selected ? 255 : 0;
     }
+  });
+
+  std::vector<double> columns(static_cast<std::size_t>(w));
+  for (int x = 0; x < w; ++x) {
+    const int image_x = extent_.x + x;
+    columns[static_cast<std::size_t>(x)] =
+        std::min(size_.width - 1, image_x + r) - std::max(0, image_x - r) + 1;
   }
 
-  mask_.swap(result);
+  const int strips = (w + kStripWidth - 1) / kStripWidth;
+  ThreadPool::instance().parallel_for(0, strips, 1, [&](int s0, int s1) {
+    std::vector<std::uint64_t> totals(kStripWidth);
+    for (int strip = s0; strip < s1; ++strip) {
+      const int x0 = strip * kStripWidth;
+      const int count = std::min(kStripWidth, w - x0);
+      std::fill(totals.begin(), totals.end(), 0);
+      for (int y = 0; y <= std::min(h - 1, r); ++y) {
+        const std::uint32_t* in = row_sums.data() + offset(x0, y);
+        for (int i = 0; i < count; ++i) {
+          totals[i] += in[i];
+        }
+      }
+      for (int y = 0; y < h; ++y) {
+        // The quotient is below 256 and far from rounding to the next
+        // integer, so the double division truncates like an integer one
+        const int image_y = extent_.y + y;
+        const double rows =
+            std::min(size_.height - 1, image_y + r) - std::max(0, image_y - r) + 1;
+        std::uint8_t* out = pixels + offset(x0, y);
+        const double* area = columns.data() + x0;
+        for (int i = 0; i < count; ++i) {
+          out[i] = static_cast<std::uint8_t>(static_cast<double>(totals[i]) / (area[i] * rows));
+        }
+        if (y + r + 1 < h) {
+          const std::uint32_t* in = row_sums.data() + offset(x0, y + r + 1);
+          for (int i = 0; i < count; ++i) {
+            totals[i] += in[i];
+          }
+        }
+        if (y - r >= 0) {
+          const std::uint32_t* in = row_sums.data() + offset(x0, y - r);
+          for (int i = 0; i < count; ++i) {
+            totals[i] -= in[i];
+          }
+        }
+      }
+    }
+  });
 }
 
-void SelectionMask::shrink(int radius) {
-  if (radius <= 0 || mask_.empty()) {
-    return;
-  }
+void SelectionMask::feather_gaussian(int radius) {
+  const int w = extent_.width;
+  const int h = extent_.height;
+  const auto offset = [w](int x, int y) { return static_cast<std::size_t>(y) * w + x; };
+  std::uint8_t* pixels = pixels_->data();
+  // Same variance as the (2r+1)-pixel box
+  const float side = 2.0f * static_cast<float>(radius) + 1.0f;
+  const RecursiveGaussian g = recursive_gaussian(std::sqrt((side * side - 1.0f) / 12.0f));
 
-  std::vector<std::uint8_t> result(mask_.size(), 0);
-  const int r = radius;
-  const int w = size_.width;
-  const int h = size_.height;
-  const int r_sq = r * r;
+  std::vector<float> image(pixels_->size());
+  ThreadPool::instance().parallel_for(0, h, 16, [&](int y0, int y1) {
+    for (int y = y0; y < y1; ++y) {
+      const std::uint8_t* in = pixels + offset(0, y);
+      float* row = image.data() + offset(0, y);
+      for (int x = 0; x < w; ++x) {
+        row[x] = in[x];
+      }
 
-  for (int y = 0; y < h; ++y) {
-    for (int x = 0; x < w; ++x) {
-      if (at_unchecked(x, y) == 0) {
-        continue;
+      // Causal then anti-causal pass; edges repeat the border pixel
+      float p1 = row[0];
+      float p2 = p1;
+      float p3 = p1;
+      for (int x = 0; x < w; ++x) {
+        const float v = g.b * row[x] + g.a1 * p1 + g.a2 * p2 + g.a3 * p3;
+        p3 = p2;
+        p2 = p1;
+        p1 = v;
+        row[x] = v;
+      }
+      p1 = row[w - 1];
+      p2 = p1;
+      p3 = p1;
+      for (int x = w - 1; x >= 0; --x) {
+        const float v = g.b * row[x] + g.a1 * p1 + g.a2 * p2 + g.a3 * p3;
+        p3 = p2;
+        p2 = p1;
+        p1 = v;
+        row[x] = v;
+      }
+    }
+  });
+
+  // Down the columns a strip at a time; the previous outputs are whole rows,
+  // and the first and last row keep their values as at the row ends above
+  const int strips = (w + kStripWidth - 1) / kStripWidth;
+  ThreadPool::instance().parallel_for(0, strips, 1, [&](int s0, int s1) {
+    for (int strip = s0; strip < s1; ++strip) {
+      const int x0 = strip * kStripWidth;
+      const int count = std::min(kStripWidth, w - x0);
+      const auto row = [&](int y) { return image.data() + offset(x0, y); };
+      for (int y = 0; y < h; ++y) {
+        float* out = row(y);
+        const float* p1 = row(std::max(0, y - 1));
+        const float* p2 = row(std::max(0, y - 2));
+        const float* p3 = row(std::max(0, y - 3));
+        for (int i = 0; i < count; ++i) {
+          out[i] = g.b * out[i] + g.a1 * p1[i] + g.a2 * p2[i] + g.a3 * p3[i];
+        }
       }
-      bool keep = true;
-      for (int yy = std::max(0, y - r); yy <= std::min(h - 1, y + r); ++yy) {
-        for (int xx = std::max(0, x - r); xx <= std::min(w - 1, x + r); ++xx) {
-          const int dx = xx - x;
-          const int dy = yy - y;
-          if (dx * dx + dy * dy <= r_sq && at_unchecked(xx, yy) == 0) {
-            keep = false;
+      for (int y = h - 1; y >= 0; --y) {
+        float* out = row(y);
+        const float* p1 = row(std::min(h - 1, y + 1));
+        const float* p2 = row(std::min(h - 1, y + 2));
+        const float* p3 = row(std::min(h - 1, y + 3));
+        for (int i = 0; i < count; ++i) {
+          out[i] = g.b * out[i] + g.a1 * p1[i] + g.a2 * p2[i] + g.a3 * p3[i];
+        }
+      }
+      for (int y = 0; y < h; ++y) {
+        const float* in = row(y);
+        std::uint8_t* out = pixels + offset(x0, y);
+        for (int i = 0; i < count; ++i) {
+          out[i] = static_cast<std::uint8_t>(std::clamp(in[i] + 0.5f, 0.0f, 255.0f));
+        }
+      }
+    }
+  });
+}
+
+template <typename Select>
+void SelectionMask::threshold_distance(bool to_selected, Select select) {
+  const int w = extent_.width;
+  const int h = extent_.height;
+  const auto offset = [w](int x, int y) { return static_cast<std::size_t>(y) * w + x; };
+  std::uint8_t* pixels = pixels_->data();
+  const auto is_site = [to_selected](std::uint8_t value) {
+    return (value > 0) == to_selected;
+  };
+
+  // Exact squared Euclidean distance transform (Felzenszwalb and
+  // Huttenlocher): distances to the nearest site along each column, then
+  // the lower envelope of the parabolas they span along each row
+  std::vector<std::int32_t> column_distance(pixels_->size());
+  const int strips = (w + kStripWidth - 1) / kStripWidth;
+  ThreadPool::instance().parallel_for(0, strips, 1, [&](int s0, int s1) {
+    for (int strip = s0; strip < s1; ++strip) {
+      const int x0 = strip * kStripWidth;
+      const int count = std::min(kStripWidth, w - x0);
+      for (int y = 0; y < h; ++y) {
+        const std::uint8_t* in = pixels + offset(x0, y);
+        std::int32_t* out = column_distance.data() + offset(x0, y);
+        const std::int32_t* above = y > 0 ? out - w : nullptr;
+        for (int i = 0; i < count; ++i) {
+          const std::int32_t previous = above && above[i] < kNoSite ? above[i] + 1 : kNoSite;
+          out[i] = is_site(in[i]) ? 0 : previous;
+        }
+      }
+      for (int y = h - 2; y >= 0; --y) {
+        std::int32_t* out = column_distance.data() + offset(x0, y);
+        const std::int32_t* below = out + w;
+        for (int i = 0; i < count; ++i) {
+          if (below[i] < kNoSite) {
+            out[i] = std::min(out[i], below[i] + 1);
+          }
+        }
+      }
+    }
+  });
+
+  ThreadPool::instance().parallel_for(0, h, 16, [&](int y0, int y1) {
+    std::vector<int> sites(static_cast<std::size_t>(w));
+    std::vector<double> bounds(static_cast<std::size_t>(w) + 1);
+    std::vector<std::int64_t> heights(static_cast<std::size_t>(w));
+    for (int y = y0; y < y1; ++y) {
+      const std::int32_t* distance = column_distance.data() + offset(0, y);
+      std::uint8_t* row = pixels + offset(0, y);
+
+      // sites[0..k] are the parabolas of the envelope; parabola j is lowest
+      // on [bounds[j], bounds[j + 1])
+      int k = -1;
+      for (int q = 0; q < w; ++q) {
+        if (distance[q] == kNoSite) {
+          continue;
+        }
+        const std::int64_t f = static_cast<std::int64_t>(distance[q]) * distance[q];
+        heights[static_cast<std::size_t>(q)] = f;
+        double start = -std::numeric_limits<double>::infinity();
+        while (k >= 0) {
+          const int v = sites[static_cast<std::size_t>(k)];
+          const std::int64_t fv = heights[static_cast<std::size_t>(v)];
+          start = static_cast<double>((f + static_cast<std::int64_t>(q) * q) -
+                                      (fv + static_cast<std::int64_t>(v) * v)) /
+                  (2.0 * (q - v));
+          if (start > bounds[static_cast<std::size_t>(k)]) {
             break;
           }
+          --k;
+          start = -std::numeric_limits<double>::infinity();
+        }
+        ++k;
+        sites[static_cast<std::size_t>(k)] = q;
+        bounds[static_cast<std::size_t>(k)] = start;
+      }
+
+      if (k < 0) {
+        for (int x = 0; x < w; ++x) {
+          row[x] = select(row[x], std::numeric_limits<std::int64_t>::max()) ? 255 : 0;
         }
-        if (!keep) {
-          break;
+        continue;
+      }
+      bounds[static_cast<std::size_t>(k) + 1] = std::numeric_limits<double>::infinity();
+      int j = 0;
+      for (int x = 0; x < w; ++x) {
+        while (bounds[static_cast<std::size_t>(j) + 1] < x) {
+          ++j;
         }
+        const int v = sites[static_cast<std::size_t>(j)];
+        const std::int64_t dx = x - v;
+        const std::int64_t distance_sq = dx * dx + heights[static_cast<std::size_t>(v)];
+        row[x] = select(row[x], distance_sq) ? 255 : 0;
       }
-      result[index_for(x, y)] = keep ? 255 : 0;
     }
-  }
-
-  mask_.swap(result);
+  });
 }
 
 }  // namespace ps::core
@@ -0,0 +1,509 @@
+#include "ps/core/separation.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+
+#include "ps/core/pixel_accessor.h"
+#include "ps/core/thread_pool.h"
+#include "target_clones.h"
+
+namespace ps::core {
+namespace {
+
+// Setups whose tables separation_tables() keeps
+constexpr std::size_t kCachedSetups = 4;
+
+// Without dot gain the model displays light × paper / 255, rounded; the
+// exact division below lets the loop vectorize, where table reads do not
+PS_TARGET_CLONES
+void plain_cmyk_to_rgba(const std::uint8_t* c, const std::uint8_t* m, const std::uint8_t* y,
+                        const std::uint8_t* k, std::uint8_t* rgba, int count) {
+  for (int i = 0; i < count; ++i) {
+    const std::uint32_t paper = 255u - k[i];
+    std::uint32_t red = (255u - c[i]) * paper + 128;
+    std::uint32_t green = (255u - m[i]) * paper + 128;
+    std::uint32_t blue = (255u - y[i]) * paper + 128;
+    red = (red + (red >> 8)) >> 8;
+    green = (green + (green >> 8)) >> 8;
+    blue = (blue + (blue >> 8)) >> 8;
+    // One 32-bit store per pixel keeps the loop in whole vector lanes
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    const std::uint32_t pixel = red << 24 | green << 16 | blue << 8 | 0xFFu;
+#else
+    const std::uint32_t pixel = red | green << 8 | blue << 16 | 0xFF000000u;
+#endif
+    std::memcpy(rgba + static_cast<std::size_t>(i) * 4, &pixel, 4);
+  }
+}
+
+void validate(const SeparationSetup& setup) {
+  if (setup.dot_gain < -25 || setup.dot_gain > 25) {
+    throw std::invalid_argument("dot gain must be within -25..25 percent");
+  }
+  if (setup.black_ink_limit < 0 || setup.black_ink_limit > 100) {
+    throw std::invalid_argument("black ink limit must be within 0..100 percent");
+  }
+  if (setup.total_ink_limit < 200 || setup.total_ink_limit > 400) {
+    throw std::invalid_argument("total ink limit must be within 200..400 percent");
+  }
+  if (setup.undercolor_addition < 0 || setup.undercolor_addition > 100) {
+    throw std::invalid_argument("undercolor addition must be within 0..100 percent");
+  }
+}
+
+/**
+ * The ink model, on fractions of full coverage. Dot gain a' = a + 4g ×
+ * a × (1 - a) adds g to a 50% dot and nothing to paper or solids; the
+ * inks then absorb as ideal process colors.
+ */
+class InkModel {
+ public:
+  explicit InkModel(const SeparationSetup& setup)
+      : setup_(setup), gain_(setup.dot_gain / 100.0) {
+    validate(setup);
+  }
+
+  double gained(double ink) const { return ink + 4.0 * gain_ * ink * (1.0 - ink); }
+
+  // Inverse of gained(): the smaller root of 4g a² - (1 + 4g) a + a' = 0
+  double ungained(double coverage) const {
+    if (gain_ == 0.0) {
+      return coverage;
+    }
+    const double b = 1.0 + 4.0 * gain_;
+    const double root = std::sqrt(std::max(0.0, b * b - 16.0 * gain_ * coverage));
+    return std::clamp((b - root) / (8.0 * gain_), 0.0, 1.0);
+  }
+
+  void rgb(const double ink[4], double out[3]) const {
+    const double black = 1.0 - gained(ink[3]);
+    for (int i = 0; i < 3; ++i) {
+      out[i] = (1.0 - gained(ink[i])) * black;
+    }
+  }
+
+  void cmyk(const double rgb[3], double ink[4]) const;
+
+ private:
+  // Black coverage for a gray component (the original's GCR table)
+  double black_generation(double gray) const {
+    double start;
+    switch (setup_.black_generation) {
+      case BlackGeneration::None:
+        return 0.0;
+      case BlackGeneration::Maximum:
+        return gray;
+      case BlackGeneration::Light:
+        start = 0.4;
+        break;
+      case BlackGeneration::Heavy:
+        start = 0.1;
+        break;
+      case BlackGeneration::Medium:
+      default:
+        start = 0.2;
+        break;
+    }
+    // Never more than the gray component, so the colors stay reachable
+    return gray <= start ? 0.0 : gray * (gray - start) / (1.0 - start);
+  }
+
+  SeparationSetup setup_;
+  double gain_;
+};
+
+void InkModel::cmyk(const double rgb[3], double ink[4]) const {
+  // Coverages that give the color with colored inks alone
+  double plain[3];
+  for (int i = 0; i < 3; ++i) {
+    plain[i] = 1.0 - std::clamp(rgb[i], 0.0, 1.0);
+  }
+  const double gray = std::min({plain[0], plain[1], plain[2]});
+
+  // Black replaces the gray component up to its limit; the colored inks
+  // make up what is left
+  const double black_limit = setup_.black_ink_limit / 100.0;
+  const double black_ink = std::min(ungained(black_generation(gray)), black_limit);
+  const double black = gained(black_ink);
+  double coverage[3];
+  for (int i = 0; i < 3; ++i) {
+    coverage[i] =
+        black >= 1.0 ? 0.0 : std::clamp(1.0 - (1.0 - plain[i]) / (1.0 - black), 0.0, 1.0);
+  }
+
+  // Undercolor addition restores part of the removed colors in the
+  // darkest half, like ApplyUCA
+  if (setup_.undercolor_addition > 0 && gray > 0.5) {
+    const double shadow = (gray - 0.5) / 0.5;
+    const double amount = setup_.undercolor_addition / 100.0 * shadow * shadow;
+    for (int i = 0; i < 3; ++i) {
+      coverage[i] += amount * (plain[i] - coverage[i]);
+    }
+  }
+
+  auto inks = [&](double extra, double out[4]) {
+    // Taking a further gray component out of the colored inks into black
+    // keeps the color exactly
+    for (int i = 0; i < 3; ++i) {
+      out[i] = ungained(std::max(0.0, (coverage[i] - extra) / (1.0 - extra)));
+    }
+    out[3] = ungained(1.0 - (1.0 - black) * (1.0 - extra));
+  };
+  inks(0.0, ink);
+  ink[3] = black_ink;
+
+  // Ink limit: move gray from the colored inks into black, as far as the
+  // black limit allows, until the total fits; whatever is still over comes
+  // off the colored inks evenly
+  const double limit = setup_.total_ink_limit / 100.0;
+  auto total = [](const double v[4]) { return v[0] + v[1] + v[2] + v[3]; };
+  if (total(ink) > limit) {
+    const double gray_left = std::min({coverage[0], coverage[1], coverage[2]});
+    const double black_room =
+        black >= 1.0 ? 0.0 : 1.0 - (1.0 - gained(black_limit)) / (1.0 - black);
+    double low = 0.0;
+    double high = std::clamp(std::min(gray_left, black_room), 0.0, 0.999);
+    double trial[4];
+    inks(high, trial);
+    for (int step = 0; step < 24 && total(trial) <= limit; ++step) {
+      const double middle = 0.5 * (low + high);
+      inks(middle, trial);
+      (total(trial) > limit ? low : high) = middle;
+      inks(high, trial);
+    }
+    inks(high, ink);
+    ink[3] = std::min(std::max(ink[3], black_ink), black_limit);
+    const double colored_limit = std::max(0.0, limit - ink[3]);
+    const double colored = ink[0] + ink[1] + ink[2];
+    if (colored > colored_limit) {
+      for (int i = 0; i < 3; ++i) {
+        ink[i] *= colored_limit / colored;
+      }
+    }
+  }
+}
+
+int to_level(double fraction) {
+  return static_cast<int>(std::floor(std::clamp(fraction, 0.0, 1.0) * 255.0 + 0.5));
+}
+
+std::uint16_t to_node(double fraction) {
+  return static_cast<std::uint16_t>(
+      std::floor(std::clamp(fraction, 0.0, 1.0) * 255.0 * 256.0 + 0.5));
+}
+
+struct TableCache {
+  std::mutex mutex;
+  std::vector<std::shared_ptr<const SeparationTables>> tables;  ///< Most recent first
+};
+
+TableCache& table_cache() {
+  static TableCache cache;
+  return cache;
+}
+
+struct CurrentSetup {
+  std::mutex mutex;
+  SeparationSetup setup;
+};
+
+CurrentSetup& current_setup() {
+  static CurrentSetup current;
+  return current;
+}
+
+const char* mode_name(ColorMode mode) {
+  switch (mode) {
+    case ColorMode::Grayscale:
+      return "Grayscale";
+    case ColorMode::RGB:
+      return "RGB Color";
+    case ColorMode::CMYK:
+      return "CMYK Color";
+  }
+  return "Mode";
+}
+
+// Converts rows of the source planes into Gray8 target channels, in
+// tile-aligned bands so no two tasks write one tile
+template <typename Accessor, typename Convert>
+std::vector<ImageChannel> convert_channels(const ImageDocument& doc, const Accessor& pixels,
+                                           const std::vector<const char*>& names,
+                                           Convert&& convert) {
+  const Size size = doc.size();
+  std::vector<ImageChannel> channels;
+  for (const char* name : names) {
+    channels.push_back(ImageChannel{
+        name, ImageBuffer(size, PixelFormat::Gray8, doc.storage_layout(), BufferInit::Zero)});
+  }
+  const int outputs = static_cast<int>(channels.size());
+  const std::size_t width = static_cast<std::size_t>(size.width);
+
+  constexpr int kBand = ImageBuffer::kTileSize;
+  const int bands = (size.height + kBand - 1) / kBand;
+  ThreadPool::instance().parallel_for(0, bands, 1, [&](int b0, int b1) {
+    std::vector<std::uint8_t> planes(width * Accessor::kPlanes);
+    std::vector<std::uint8_t> results(width * static_cast<std::size_t>(outputs));
+    for (int y = b0 * kBand; y < std::min(size.height, b1 * kBand); ++y) {
+      pixels.read_planes(y, 0, size.width, planes.data());
+      convert(planes.data(), results.data(), size.width);
+      for (int c = 0; c < outputs; ++c) {
+        channels[c].buffer.write_pixels(0, y, size.width, results.data() + c * width);
+      }
+    }
+  });
+
+  // Channels past the color ones (an RGB alpha) follow the new colors
+  for (std::size_t i = Accessor::kPlanes; i < doc.channels().size(); ++i) {
+    channels.push_back(doc.channel_at(i));
+  }
+  return channels;
+}
+
+std::vector<ImageChannel> converted_channels(const ImageDocument& doc, ColorMode mode,
+                                             const SeparationSetup& setup) {
+  const ChannelLayout layout = channel_layout(doc);
+  const std::shared_ptr<const SeparationTables> tables = separation_tables(setup);
+
+  if (mode == ColorMode::CMYK &&
+      (layout == ChannelLayout::RGB || layout == ChannelLayout::RGBA)) {
+    return convert_channels(
+        doc, PixelAccessor<ChannelLayout::RGB>(doc), {"Cyan", "Magenta", "Yellow", "Black"},
+        [&](const std::uint8_t* planes, std::uint8_t* out, int count) {
+          const std::size_t n = static_cast<std::size_t>(count);
+          tables->rgb_to_cmyk(planes, planes + n, planes + 2 * n, out, out + n, out + 2 * n,
+                              out + 3 * n, count);
+        });
+  }
+  if (mode == ColorMode::CMYK && layout == ChannelLayout::Gray) {
+    return convert_channels(
+        doc, PixelAccessor<ChannelLayout::Gray>(doc), {"Cyan", "Magenta", "Yellow", "Black"},
+        [&](const std::uint8_t* planes, std::uint8_t* out, int count) {
+          const std::size_t n = static_cast<std::size_t>(count);
+          tables->rgb_to_cmyk(planes, planes, planes, out, out + n, out + 2 * n, out + 3 * n,
+                              count);
+        });
+  }
+  if (layout == ChannelLayout::CMYK && mode != ColorMode::CMYK) {
+    const PixelAccessor<ChannelLayout::CMYK> pixels(doc, tables);
+    const bool gray = mode == ColorMode::Grayscale;
+    const std::vector<const char*> names =
+        gray ? std::vector<const char*>{"Gray"} : std::vector<const char*>{"Red", "Green", "Blue"};
+    return convert_channels(
+        doc, pixels, names, [&](const std::uint8_t* planes, std::uint8_t* out, int count) {
+          const std::size_t n = static_cast<std::size_t>(count);
+          for (std::size_t i = 0; i < n; ++i) {
+            int r, g, b;
+            pixels.rgb(planes, n, i, r, g, b);
+            if (gray) {
+              out[i] = static_cast<std::uint8_t>((30 * r + 59 * g + 11 * b + 50) / 100);
+            } else {
+              out[i] = static_cast<std::uint8_t>(r);
+              out[n + i] = static_cast<std::uint8_t>(g);
+              out[2 * n + i] = static_cast<std::uint8_t>(b);
+            }
+          }
+        });
+  }
+  throw std::invalid_argument(
+      "convert_mode converts Grayscale and RGB documents to CMYK and CMYK documents back");
+}
+
+}  // namespace
+
+bool SeparationSetup::operator==(const SeparationSetup& other) const {
+  return dot_gain == other.dot_gain && black_generation == other.black_generation &&
+         black_ink_limit == other.black_ink_limit && total_ink_limit == other.total_ink_limit &&
+         undercolor_addition == other.undercolor_addition;
+}
+
+void solve_cmyk(const SeparationSetup& setup, int r, int g, int b, int& c, int& m, int& y,
+                int& k) {
+  const InkModel model(setup);
+  const double rgb[3] = {r / 255.0, g / 255.0, b / 255.0};
+  double ink[4];
+  model.cmyk(rgb, ink);
+  c = to_level(ink[0]);
+  m = to_level(ink[1]);
+  y = to_level(ink[2]);
+  k = to_level(ink[3]);
+}
+
+void solve_rgb(const SeparationSetup& setup, int c, int m, int y, int k, int& r, int& g,
+               int& b) {
+  const InkModel model(setup);
+  const double ink[4] = {c / 255.0, m / 255.0, y / 255.0, k / 255.0};
+  double rgb[3];
+  model.rgb(ink, rgb);
+  r = to_level(rgb[0]);
+  g = to_level(rgb[1]);
+  b = to_level(rgb[2]);
+}
+
+SeparationTables::SeparationTables(const SeparationSetup& setup) : setup_(setup) {
+  const InkModel model(setup);
+  constexpr int n = kGridNodes;
+  constexpr double step = 1.0 / (n - 1);
+  to_cmyk_.resize(static_cast<std::size_t>(n) * n * n * 4);
+  shades_.resize(256 * 256);
+
+  auto& pool = ThreadPool::instance();
+  pool.parallel_for(0, n * n * n, 64, [&](int i0, int i1) {
+    for (int i = i0; i < i1; ++i) {
+      const double rgb[3] = {(i / (n * n)) * step, (i / n % n) * step, (i % n) * step};
+      double ink[4];
+      model.cmyk(rgb, ink);
+      for (int o = 0; o < 4; ++o) {
+        to_cmyk_[static_cast<std::size_t>(i) * 4 + o] = to_node(ink[o]);
+      }
+    }
+  });
+  // The model shades each primary by its own ink and black alone, the
+  // separability the display table relies on
+  for (int k = 0; k < 256; ++k) {
+    for (int v = 0; v < 256; ++v) {
+      const double ink[4] = {v / 255.0, 0.0, 0.0, k / 255.0};
+      double rgb[3];
+      model.rgb(ink, rgb);
+      shades_[static_cast<std::size_t>(k) * 256 + v] = static_cast<std::uint8_t>(to_level(rgb[0]));
+    }
+  }
+}
+
+// The row loops reuse the previous result while the color repeats, which
+// flat areas of real images do at length
+void SeparationTables::rgb_to_cmyk(const std::uint8_t* r, const std::uint8_t* g,
+                                   const std::uint8_t* b, std::uint8_t* c, std::uint8_t* m,
+                                   std::uint8_t* y, std::uint8_t* k, int count) const {
+  std::uint32_t last = 0xFFFFFFFFu;
+  std::uint8_t ink[4] = {};
+  for (int i = 0; i < count; ++i) {
+    const std::uint32_t color = (std::uint32_t{r[i]} << 16) | (std::uint32_t{g[i]} << 8) | b[i];
+    if (color != last) {
+      int cyan, magenta, yellow, black;
+      rgb_to_cmyk(r[i], g[i], b[i], cyan, magenta, yellow, black);
+      ink[0] = static_cast<std::uint8_t>(cyan);
+      ink[1] = static_cast<std::uint8_t>(magenta);
+      ink[2] = static_cast<std::uint8_t>(yellow);
+      ink[3] = static_cast<std::uint8_t>(black);
+      last = color;
+    }
+    c[i] = ink[0];
+    m[i] = ink[1];
+    y[i] = ink[2];
+    k[i] = ink[3];
+  }
+}
+
+void SeparationTables::cmyk_to_rgba(const std::uint8_t* c, const std::uint8_t* m,
+                                    const std::uint8_t* y, const std::uint8_t* k,
+                                    std::uint8_t* rgba, int count) const {
+  if (setup_.dot_gain == 0) {
+    plain_cmyk_to_rgba(c, m, y, k, rgba, count);
+    return;
+  }
+  for (int i = 0; i < count; ++i, rgba += 4) {
+    const std::uint8_t* row = shade_row(k[i]);
+    rgba[0] = row[c[i]];
+    rgba[1] = row[m[i]];
+    rgba[2] = row[y[i]];
+    rgba[3] = 255;
+  }
+}
+
+std::shared_ptr<const SeparationTables> separation_tables(const SeparationSetup& setup) {
+  TableCache& cache = table_cache();
+  {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    for (std::size_t i = 0; i < cache.tables.size(); ++i) {
+      if (cache.tables[i]->setup() == setup) {
+        std::rotate(cache.tables.begin(), cache.tables.begin() + i,
+                    cache.tables.begin() + i + 1);
+        return cache.tables.front();
+      }
+    }
+  }
+
+  // Built without the lock: the build runs on the ThreadPool, whose
+  // workers may be asking for tables themselves
+  auto tables = std::make_shared<const SeparationTables>(setup);
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  for (const auto& cached : cache.tables) {
+    if (cached->setup() == setup) {
+      return cached;
+    }
+  }
+  cache.tables.insert(cache.tables.begin(), tables);
+  if (cache.tables.size() > kCachedSetups) {
+    cache.tables.pop_back();
+  }
+  return tables;
+}
+
+SeparationSetup separation_setup() {
+  CurrentSetup& current = current_setup();
+  std::lock_guard<std::mutex> lock(current.mutex);
+  return current.setup;
+}
+
+void set_separation_setup(const SeparationSetup& setup) {
+  validate(setup);
+  CurrentSetup& current = current_setup();
+  std::lock_guard<std::mutex> lock(current.mutex);
+  current.setup = setup;
+}
+
+void convert_mode(ImageDocument& doc, ColorMode mode, const SeparationSetup& setup) {
+  if (doc.mode() == mode) {
+    return;
+  }
+  std::vector<ImageChannel> channels = converted_channels(doc, mode, setup);
+  std::swap(doc.channels(), channels);
+  doc.set_mode(mode);
+}
+
+ModeCommand::ModeCommand(ImageDocument& doc, ColorMode mode, const SeparationSetup& setup)
+    : document_(doc), mode_(mode), other_mode_(mode), setup_(setup) {}
+
+void ModeCommand::execute() {
+  if (document_.mode() == mode_) {
+    return;
+  }
+  channels_ = converted_channels(document_, mode_, setup_);
+  exchange();
+}
+
+void ModeCommand::undo() {
+  exchange();
+}
+
+void ModeCommand::redo() {
+  exchange();
+}
+
+std::string ModeCommand::name() const {
+  return mode_name(mode_);
+}
+
+std::size_t ModeCommand::memory_footprint() const {
+  std::size_t bytes = 0;
+  for (const ImageChannel& channel : channels_) {
+    bytes += channel.buffer.allocated_bytes();
+  }
+  return bytes;
+}
+
+void ModeCommand::exchange() {
+  if (channels_.empty()) {
+    return;
+  }
+  std::swap(document_.channels(), channels_);
+  const ColorMode mode = document_.mode();
+  document_.set_mode(other_mode_);
+  other_mode_ = mode;
+}
+
+}  // namespace ps::core
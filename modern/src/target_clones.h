@@ -0,0 +1,11 @@
+#pragma once
+
+// Internal to ps_modern_core. PS_TARGET_CLONES marks a hot loop that the
+// compiler vectorizes: on x86-64 the function is cloned for AVX2 / SSE4.1
+// and the clone matching the running CPU is selected at load time.
+// AArch64 always has NEON, which the default build already targets.
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define PS_TARGET_CLONES __attribute__((target_clones("avx2", "sse4.1", "default")))
+#else
+#define PS_TARGET_CLONES
+#endif
@@ -0,0 +1,183 @@
+#include "ps/core/thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+
+namespace ps::core {
+
+namespace {
+
+// Set while a thread is running a parallel_for() body
+thread_local bool t_in_parallel_body = false;
+
+}  // namespace
+
+struct ThreadPool::Loop {
+  const std::function<void(int, int)>* body = nullptr;
+  int end = 0;
+  int grain = 1;
+  std::atomic<int> next{0};
+  int active_workers = 0;  ///< Guarded by the pool mutex
+  std::mutex error_mutex;
+  std::exception_ptr error;
+};
+
+ThreadPool& ThreadPool::instance() {
+  static ThreadPool instance;
+  return instance;
+}
+
+ThreadPool::ThreadPool() {
+  set_thread_count(0);
+}
+
+ThreadPool::~ThreadPool() {
+  stop_workers();
+}
+
+void ThreadPool::set_thread_count(std::size_t count) {
+  if (count == 0) {
+    count = std::max<std::size_t>(1, std::thread::hardware_concurrency());
+  }
+  stop_workers();
+  start_workers(count);
+}
+
+std::size_t ThreadPool::thread_count() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return thread_count_;
+}
+
+void ThreadPool::parallel_for(int begin, int end, int grain,
+                              const std::function<void(int, int)>& body) {
+  if (begin >= end) {
+    return;
+  }
+  grain = std::max(1, grain);
+
+  std::size_t threads = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    threads = thread_count_;
+  }
+
+  // Deterministic, nested and single-chunk loops run inline, in order
+  if (threads <= 1 || t_in_parallel_body || end - begin <= grain) {
+    const bool was_in_body = t_in_parallel_body;
+    t_in_parallel_body = true;
+    try {
+      for (int i = begin; i < end; i += grain) {
+        body(i, std::min(end, i + grain));
+      }
+    } catch (...) {
+      t_in_parallel_body = was_in_body;
+      throw;
+    }
+    t_in_parallel_body = was_in_body;
+    return;
+  }
+
+  Loop loop;
+  loop.body = &body;
+  loop.end = end;
+  loop.grain = grain;
+  loop.next.store(begin, std::memory_order_relaxed);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    loops_.push_back(&loop);
+  }
+  work_cv_.notify_all();
+
+  run_chunks(loop);
+
+  // Every chunk is claimed; wait for workers still running theirs
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = std::find(loops_.begin(), loops_.end(), &loop);
+    if (it != loops_.end()) {
+      loops_.erase(it);
+    }
+    done_cv_.wait(lock, [&] { return loop.active_workers == 0; });
+  }
+
+  if (loop.error) {
+    std::rethrow_exception(loop.error);
+  }
+}
+
+void ThreadPool::start_workers(std::size_t count) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  thread_count_ = count;
+  stop_ = false;
+  // The calling thread is one of the count
+  for (std::size_t i = 1; i < count; ++i) {
+    workers_.emplace_back(&ThreadPool::worker_main, this);
+  }
+}
+
+void ThreadPool::stop_workers() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_cv_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+  workers_.clear();
+}
+
+void ThreadPool::worker_main() {
+  t_in_parallel_body = true;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    work_cv_.wait(lock, [this] { return stop_ || !loops_.empty(); });
+    if (stop_) {
+      return;
+    }
+
+    Loop* loop = loops_.front();
+    if (loop->next.load(std::memory_order_relaxed) >= loop->end) {
+      // Fully claimed; its caller finishes it
+      loops_.pop_front();
+      continue;
+    }
+
+    ++loop->active_workers;
+    lock.unlock();
+    run_chunks(*loop);
+    lock.lock();
+    if (--loop->active_workers == 0) {
+      done_cv_.notify_all();
+    }
+  }
+}
+
+void ThreadPool::run_chunks(Loop& loop) {
+  const bool was_in_body = t_in_parallel_body;
+  t_in_parallel_body = true;
+
+  while (true) {
+    const int chunk = loop.next.fetch_add(loop.grain, std::memory_order_relaxed);
+    if (chunk >= loop.end) {
+      break;
+    }
+    try {
+      (*loop.body)(chunk, std::min(loop.end, chunk + loop.grain));
+    } catch (...) {
+      std::lock_guard<std::mutex> error_lock(loop.error_mutex);
+      if (!loop.error) {
+        loop.error = std::current_exception();
+      }
+      // Skip the remaining chunks
+      loop.next.store(loop.end, std::memory_order_relaxed);
+    }
+  }
+
+  t_in_parallel_body = was_in_body;
+}
+
+}  // namespace ps::core
@@ -0,0 +1,347 @@
+#include "ps/core/tile_cache.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace ps::core {
+
+namespace {
+
+bool write_fully(int fd, const std::uint8_t* data, std::size_t size,
+                 std::int64_t offset) {
+  while (size > 0) {
+    const ssize_t written = ::pwrite(fd, data, size, offset);
+    if (written <= 0) {
+      return false;
+    }
+    data += written;
+    size -= static_cast<std::size_t>(written);
+    offset += written;
+  }
+  return true;
+}
+
+bool read_fully(int fd, std::uint8_t* data, std::size_t size,
+                std::int64_t offset) {
+  while (size > 0) {
+    const ssize_t count = ::pread(fd, data, size, offset);
+    if (count <= 0) {
+      return false;
+    }
+    data += count;
+    size -= static_cast<std::size_t>(count);
+    offset += count;
+  }
+  return true;
+}
+
+}  // namespace
+
+// Tile implementation
+
+Tile::Tile(std::size_t byte_size)
+    : byte_size_(byte_size), data_(new std::uint8_t[byte_size]()) {
+  TileCache::instance().register_tile(this);
+}
+
+Tile::Tile(std::size_t byte_size, std::shared_ptr<const TileSource> source, std::uint64_t key)
+    : byte_size_(byte_size), source_(std::move(source)), source_key_(key) {
+  if (!source_) {
+    throw std::invalid_argument("tile source must not be null");
+  }
+  dirty_.store(false, std::memory_order_relaxed);
+  source_current_.store(true, std::memory_order_relaxed);
+  TileCache::instance().register_tile(this);
+}
+
+Tile::Tile(const Tile& other)
+    : byte_size_(other.byte_size_), data_(new std::uint8_t[other.byte_size_]) {
+  std::memcpy(data_.load(std::memory_order_relaxed), other.data(), byte_size_);
+  TileCache::instance().register_tile(this);
+}
+
+Tile::~Tile() {
+  TileCache::instance().unregister_tile(this);
+}
+
+std::uint8_t* Tile::data() {
+  std::uint8_t* data = resident_data();
+  if (!dirty_.load(std::memory_order_relaxed)) {
+    dirty_.store(true, std::memory_order_relaxed);
+  }
+  if (source_current_.load(std::memory_order_relaxed)) {
+    source_current_.store(false, std::memory_order_relaxed);
+  }
+  return data;
+}
+
+const std::uint8_t* Tile::data() const {
+  return resident_data();
+}
+
+std::shared_ptr<const TileSource> Tile::source(std::uint64_t& key) const {
+  std::lock_guard<std::mutex> lock(TileCache::instance().mutex_);
+  if (!source_current_.load(std::memory_order_relaxed)) {
+    return nullptr;
+  }
+  key = source_key_;
+  return source_;
+}
+
+void Tile::set_source(std::shared_ptr<const TileSource> source, std::uint64_t key) const {
+  std::lock_guard<std::mutex> lock(TileCache::instance().mutex_);
+  source_ = std::move(source);
+  source_key_ = key;
+  source_current_.store(source_ != nullptr, std::memory_order_relaxed);
+}
+
+std::uint8_t* Tile::resident_data() const {
+  TileCache& cache = TileCache::instance();
+  std::uint8_t* data = data_.load(std::memory_order_acquire);
+  if (!data) {
+    data = cache.page_in(*this);
+  }
+
+  const std::uint64_t epoch = cache.epoch();
+  if (last_used_.load(std::memory_order_relaxed) != epoch) {
+    last_used_.store(epoch, std::memory_order_relaxed);
+  }
+  return data;
+}
+
+// TileCache implementation
+
+TileCache& TileCache::instance() {
+  static TileCache instance;
+  return instance;
+}
+
+TileCache::~TileCache() {
+  if (scratch_file_) {
+    std::fclose(scratch_file_);
+  }
+}
+
+void TileCache::set_memory_budget(std::size_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  budget_bytes_ = bytes;
+}
+
+std::size_t TileCache::memory_budget() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return budget_bytes_;
+}
+
+void TileCache::set_scratch_directory(const std::string& directory) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  scratch_directory_ = directory;
+}
+
+TileCacheStats TileCache::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  TileCacheStats stats;
+  stats.resident_bytes = resident_bytes_;
+  stats.paged_bytes = paged_bytes_;
+  stats.budget_bytes = budget_bytes_;
+  stats.tile_count = tiles_.size();
+  return stats;
+}
+
+std::size_t TileCache::trim() {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  std::size_t released = 0;
+  if (budget_bytes_ > 0 && resident_bytes_ > budget_bytes_) {
+    std::vector<Tile*> candidates;
+    candidates.reserve(tiles_.size());
+    for (Tile* tile : tiles_) {
+      if (tile->resident()) {
+        candidates.push_back(tile);
+      }
+    }
+
+    // Oldest first, mirroring the gVMOldestPage → gVMNewestPage chain
+    std::sort(candidates.begin(), candidates.end(), [](const Tile* a, const Tile* b) {
+      return a->last_used_.load(std::memory_order_relaxed) <
+             b->last_used_.load(std::memory_order_relaxed);
+    });
+
+    for (Tile* tile : candidates) {
+      if (resident_bytes_ <= budget_bytes_) {
+        break;
+      }
+      if (!page_out(tile)) {
+        break;
+      }
+      released += tile->byte_size_;
+    }
+  }
+
+  epoch_.fetch_add(1, std::memory_order_relaxed);
+  return released;
+}
+
+void TileCache::register_tile(Tile* tile) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  tile->registry_index_ = tiles_.size();
+  tile->last_used_.store(epoch(), std::memory_order_relaxed);
+  tiles_.push_back(tile);
+  if (tile->resident()) {
+    resident_bytes_ += tile->byte_size_;
+  } else {
+    paged_bytes_ += tile->byte_size_;
+  }
+}
+
+void TileCache::unregister_tile(Tile* tile) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  Tile* last = tiles_.back();
+  tiles_[tile->registry_index_] = last;
+  last->registry_index_ = tile->registry_index_;
+  tiles_.pop_back();
+
+  std::uint8_t* data = tile->data_.exchange(nullptr);
+  if (data) {
+    resident_bytes_ -= tile->byte_size_;
+    delete[] data;
+  } else {
+    paged_bytes_ -= tile->byte_size_;
+  }
+
+  if (tile->scratch_offset_ >= 0) {
+    release_slot(tile->scratch_offset_, tile->byte_size_);
+  }
+}
+
+std::uint8_t* TileCache::page_in(const Tile& tile) {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  std::uint8_t* data = tile.data_.load(std::memory_order_acquire);
+  if (data) {
+    // Another thread paged it in while we waited for the lock
+    return data;
+  }
+
+  if (tile.source_current_.load(std::memory_order_relaxed)) {
+    // Decoding can be slow, so it runs unlocked; if two threads decode the
+    // same tile, the first to finish installs its copy
+    const std::shared_ptr<const TileSource> source = tile.source_;
+    const std::uint64_t key = tile.source_key_;
+    lock.unlock();
+    std::unique_ptr<std::uint8_t[]> decoded(new std::uint8_t[tile.byte_size_]);
+    source->read_tile(key, decoded.get(), tile.byte_size_);
+    lock.lock();
+
+    data = tile.data_.load(std::memory_order_acquire);
+    if (data) {
+      return data;
+    }
+    data = decoded.release();
+    // Any scratch copy predates the source, so it must be rewritten if the
+    // tile is ever paged out after being modified
+    tile.dirty_.store(true, std::memory_order_relaxed);
+    paged_bytes_ -= tile.byte_size_;
+    resident_bytes_ += tile.byte_size_;
+    tile.data_.store(data, std::memory_order_release);
+    return data;
+  }
+
+  data = new std::uint8_t[tile.byte_size_];
+  if (!read_fully(scratch_fd_, data, tile.byte_size_, tile.scratch_offset_)) {
+    delete[] data;
+    throw std::runtime_error("tile cache: failed to read scratch file");
+  }
+
+  // The scratch slot is kept, so the tile is clean until it is written
+  tile.dirty_.store(false, std::memory_order_relaxed);
+  paged_bytes_ -= tile.byte_size_;
+  resident_bytes_ += tile.byte_size_;
+  tile.data_.store(data, std::memory_order_release);
+  return data;
+}
+
+bool TileCache::page_out(Tile* tile) {
+  std::uint8_t* data = tile->data_.load(std::memory_order_acquire);
+
+  // Tiles that still match their source are decoded again when needed
+  const bool from_source = tile->source_current_.load(std::memory_order_relaxed);
+  if (!from_source &&
+      (tile->dirty_.load(std::memory_order_relaxed) || tile->scratch_offset_ < 0)) {
+    if (tile->scratch_offset_ < 0) {
+      tile->scratch_offset_ = allocate_slot(tile->byte_size_);
+      if (tile->scratch_offset_ < 0) {
+        return false;
+      }
+    }
+    if (!write_fully(scratch_fd_, data, tile->byte_size_, tile->scratch_offset_)) {
+      return false;
+    }
+  }
+
+  tile->dirty_.store(false, std::memory_order_relaxed);
+  tile->data_.store(nullptr, std::memory_order_release);
+  delete[] data;
+
+  resident_bytes_ -= tile->byte_size_;
+  paged_bytes_ += tile->byte_size_;
+  return true;
+}
+
+bool TileCache::open_scratch_file() {
+  if (scratch_fd_ >= 0) {
+    return true;
+  }
+
+  if (scratch_directory_.empty()) {
+    scratch_file_ = std::tmpfile();
+    if (!scratch_file_) {
+      return false;
+    }
+    scratch_fd_ = ::fileno(scratch_file_);
+    return true;
+  }
+
+  std::string path = scratch_directory_ + "/ps_tiles_XXXXXX";
+  const int fd = ::mkstemp(path.data());
+  if (fd < 0) {
+    return false;
+  }
+  // Unlink immediately so the scratch file disappears with the process
+  ::unlink(path.c_str());
+  scratch_file_ = ::fdopen(fd, "w+b");
+  if (!scratch_file_) {
+    ::close(fd);
+    return false;
+  }
+  scratch_fd_ = fd;
+  return true;
+}
+
+std::int64_t TileCache::allocate_slot(std::size_t byte_size) {
+  auto it = free_slots_.find(byte_size);
+  if (it != free_slots_.end() && !it->second.empty()) {
+    const std::int64_t offset = it->second.back();
+    it->second.pop_back();
+    return offset;
+  }
+
+  if (!open_scratch_file()) {
+    return -1;
+  }
+
+  const std::int64_t offset = scratch_end_;
+  scratch_end_ += static_cast<std::int64_t>(byte_size);
+  return offset;
+}
+
+void TileCache::release_slot(std::int64_t offset, std::size_t byte_size) {
+  free_slots_[byte_size].push_back(offset);
+}
+
+}  // namespace ps::core
@@ -0,0 +1,85 @@
+#include "ps/tools/brush_dab.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace ps::tools {
+
+DabStamp::DabStamp(int radius, int hardness)
+    : radius_(std::max(1, radius)), hardness_(std::clamp(hardness, 0, 100)) {
+  const int diameter = 2 * radius_ + 1;
+  coverage_.assign(static_cast<std::size_t>(diameter) * diameter, 0);
+  spans_.assign(static_cast<std::size_t>(diameter), {});
+
+  const float hard = hardness_ / 100.0f;
+  for (int dy = -radius_; dy <= radius_; ++dy) {
+    std::uint8_t* out =
+        coverage_.data() + static_cast<std::size_t>(dy + radius_) * diameter;
+    Span& span = spans_[dy + radius_];
+    span.begin = radius_ + 1;
+    span.end = -radius_;
+
+    for (int dx = -radius_; dx <= radius_; ++dx) {
+      const float dist =
+          std::sqrt(static_cast<float>(dx * dx + dy * dy)) / radius_;
+      if (dist > 1.0f) {
+        continue;
+      }
+
+      float alpha = 1.0f;
+      if (hard < 1.0f && dist > hard) {
+        alpha = 1.0f - ((dist - hard) / (1.0f - hard));
+      }
+      out[dx + radius_] = static_cast<std::uint8_t>(alpha * 255.0f + 0.5f);
+      if (out[dx + radius_] > 0) {
+        span.begin = std::min(span.begin, dx);
+        span.end = dx + 1;
+      }
+    }
+    if (span.end <= span.begin) {
+      span.begin = 0;
+      span.end = 0;
+    }
+  }
+}
+
+DabStampCache& DabStampCache::instance() {
+  static DabStampCache cache;
+  return cache;
+}
+
+std::shared_ptr<const DabStamp> DabStampCache::get(int radius, int hardness) {
+  radius = std::max(1, radius);
+  hardness = std::clamp(hardness, 0, 100);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto it = stamps_.begin(); it != stamps_.end(); ++it) {
+    if ((*it)->radius() == radius && (*it)->hardness() == hardness) {
+      std::rotate(stamps_.begin(), it, it + 1);
+      return stamps_.front();
+    }
+  }
+
+  if (stamps_.size() >= kCapacity) {
+    stamps_.pop_back();
+  }
+  stamps_.insert(stamps_.begin(), std::make_shared<DabStamp>(radius, hardness));
+  return stamps_.front();
+}
+
+Rect dab_area(core::Size size, Point center, int radius) {
+  const int x_start = std::max(0, center.x - radius);
+  const int y_start = std::max(0, center.y - radius);
+  const int x_end = std::min(size.width, center.x + radius + 1);
+  const int y_end = std::min(size.height, center.y + radius + 1);
+  if (x_start >= x_end || y_start >= y_end) {
+    return Rect(0, 0, 0, 0);
+  }
+  return Rect(x_start, y_start, x_end - x_start, y_end - y_start);
+}
+
+float dab_spacing(const ToolOptions& options) {
+  return std::max(1.0f, options.size * options.spacing / 100.0f);
+}
+
+}  // namespace ps::tools
@@ -1,20 +1,13 @@
 #include "ps/tools/brush_tool.h"
 
 #include <algorithm>
-#include <cmath>
-#include <cstring>
 
 namespace ps::tools {
 
 // BrushStrokeCommand implementation
 
-BrushStrokeCommand::BrushStrokeCommand(core::ImageDocument& doc,
-                                        const Rect& affected_area)
-    : ImageCommand(doc), affected_area_(affected_area) {
-  // Save the current state of all channels BEFORE any modifications.
-  // This "before" state will be restored when undo() is called.
-  save_all_channels();
-}
+BrushStrokeCommand::BrushStrokeCommand(core::ImageDocument& doc)
+    : ImageCommand(doc) {}
 
 void BrushStrokeCommand::execute() {
   // The brush stroke was already applied during the user's interaction
@@ -22,6 +15,15 @@ void BrushStrokeCommand::execute() {
   // reapply it. This command exists primarily to enable undo/redo.
 }
 
+void BrushStrokeCommand::redo() {
+  // After undo() the saved blocks hold the painted pixels
+  swap_regions();
+}
+
+void BrushStrokeCommand::capture(const Rect& area) {
+  save_region(area.x, area.y, area.width, area.height);
+}
+
 // BrushTool implementation
 
 BrushTool::BrushTool() {
@@ -32,15 +34,16 @@ BrushTool::BrushTool() {
 }
 
 void BrushTool::begin_stroke(core::ImageDocument& doc, Point pt) {
-  stroke_points_.clear();
   affected_area_ = Rect(pt.x, pt.y, 0, 0);
   stroke_active_ = true;
 
-  // Create the undo command BEFORE making any modifications
-  // This captures the "before" state for undo
-  current_command_ = std::make_unique<BrushStrokeCommand>(doc, affected_area_);
+  // Create the undo command BEFORE making any modifications. Each dab
+  // captures the "before" state of the pixels it is about to touch.
+  current_command_ = std::make_unique<BrushStrokeCommand>(doc);
 
-  stroke_points_.push_back({pt, 100});
+  // Dabs accumulate in the scratch; opacity applies to the stroke as a whole
+  scratch_.begin(doc, options_.opacity / 100.0f, 255);
+  spacer_.reset(pt);
   apply_brush_dab(doc, pt, 100);
 }
 
@@ -49,13 +52,19 @@ void BrushTool::continue_stroke(core::ImageDocument& doc, Point pt) {
     return;
   }
 
-  stroke_points_.push_back({pt, 100});
-  apply_brush_dab(doc, pt, 100);
+  // Dabs follow the path at the configured spacing, however far apart the
+  // mouse events are
+  spacer_.advance(pt, dab_spacing(options_),
+                  [&](Point dab) { apply_brush_dab(doc, dab, 100); });
 }
 
-std::unique_ptr<core::Command> BrushTool::end_stroke(core::ImageDocument& doc) {
+void BrushTool::flush_stroke(core::ImageDocument&) {
+  scratch_.composite();
+}
+
+std::unique_ptr<core::Command> BrushTool::end_stroke(core::ImageDocument&) {
   stroke_active_ = false;
-  stroke_points_.clear();
+  scratch_.end();
 
   // Return the command that was created in begin_stroke()
   // If no stroke was started (shouldn't happen), return nullptr
@@ -80,48 +89,16 @@ void BrushTool::apply_brush_dab(core::ImageDocument& doc, Point pt,
     return;
   }
 
-  const core::Size doc_size = doc.size();
-  const int x_start = std::max(0, pt.x - radius);
-  const int y_start = std::max(0, pt.y - radius);
-  const int x_end = std::min(doc_size.width, pt.x + radius + 1);
-  const int y_end = std::min(doc_size.height, pt.y + radius + 1);
-
-  const float hardness = options_.hardness / 100.0f;
-  const float opacity = (options_.opacity * pressure) / 10000.0f;
-
-  for (auto& channel : doc.channels()) {
-    auto* data = channel.buffer.data();
-    const int bytes_per_pixel =
-        static_cast<int>(core::bytes_per_pixel(channel.buffer.format()));
-
-    for (int y = y_start; y < y_end; ++y) {
-      for (int x = x_start; x < x_end; ++x) {
-        const int dx = x - pt.x;
-        const int dy = y - pt.y;
-        const float dist =
-            std::sqrt(static_cast<float>(dx * dx + dy * dy)) / radius;
-
-        if (dist > 1.0f) {
-          continue;
-        }
-
-        float alpha = 1.0f;
-        if (hardness < 1.0f && dist > hardness) {
-          alpha = 1.0f - ((dist - hardness) / (1.0f - hardness));
-        }
-        alpha *= opacity;
-
-        const int pixel_index = (y * doc_size.width + x) * bytes_per_pixel;
-
-        for (int c = 0; c < bytes_per_pixel; ++c) {
-          const std::uint8_t old_value = data[pixel_index + c];
-          const std::uint8_t new_value = 255;
-          data[pixel_index + c] = static_cast<std::uint8_t>(
-              old_value + alpha * (new_value - old_value));
-        }
-      }
-    }
+  const Rect area = dab_area(doc.size(), pt, radius);
+  if (area.is_empty()) {
+    return;
   }
+  if (current_command_) {
+    current_command_->capture(area);
+  }
+
+  const auto stamp = DabStampCache::instance().get(radius, options_.hardness);
+  scratch_.add_dab(*stamp, pt, pressure / 100.0f);
 }
 
 void BrushTool::expand_affected_area(Point pt) {
@@ -1,8 +1,10 @@
 #include "ps/tools/drawing_tools.h"
 
 #include <algorithm>
-#include <cmath>
-#include <queue>
+
+#include "ps/core/pixel_accessor.h"
+#include "ps/tools/brush_dab.h"
+#include "ps/tools/flood_fill.h"
 
 namespace ps::tools {
 namespace {
@@ -14,164 +16,92 @@ struct RGBColor {
 };
 
 RGBColor sample_color(const core::ImageDocument& doc, int x, int y) {
-  const auto& channels = doc.channels();
   const core::Size size = doc.size();
-  if (channels.empty() || x < 0 || y < 0 || x >= size.width || y >= size.height) {
+  if (x < 0 || y < 0 || x >= size.width || y >= size.height) {
     return {};
   }
 
-  const int index = y * size.width + x;
-  const core::ColorMode mode = doc.mode();
+  return core::dispatch_channels(doc, [&](const auto& pixels) {
+    std::uint8_t planes[4] = {};
+    pixels.read_planes(y, x, 1, planes);
+    RGBColor color;
+    pixels.rgb(planes, 1, 0, color.r, color.g, color.b);
+    return color;
+  });
+}
 
-  if (mode == core::ColorMode::Grayscale && channels.size() >= 1) {
-    const auto* data = channels[0].buffer.data();
-    const std::size_t bytes = core::bytes_per_pixel(channels[0].buffer.format());
-    const std::uint8_t value = data[index * bytes];
-    return {value, value, value};
+void add_circular_dab(core::ImageDocument& doc, StrokeCommand* command,
+                      StrokeScratch& scratch, Point pt, int radius,
+                      int hardness) {
+  if (radius <= 0) {
+    return;
   }
 
-  if (mode == core::ColorMode::RGB && channels.size() >= 3) {
-    const std::size_t bytes = core::bytes_per_pixel(channels[0].buffer.format());
-    const std::uint8_t r = channels[0].buffer.data()[index * bytes];
-    const std::uint8_t g = channels[1].buffer.data()[index * bytes];
-    const std::uint8_t b = channels[2].buffer.data()[index * bytes];
-    return {r, g, b};
+  const Rect area = dab_area(doc.size(), pt, radius);
+  if (area.is_empty()) {
+    return;
   }
 
-  if (mode == core::ColorMode::CMYK && channels.size() >= 4) {
-    const std::size_t bytes = core::bytes_per_pixel(channels[0].buffer.format());
-    const std::size_t idx = index * bytes;
-    const std::uint8_t c = channels[0].buffer.data()[idx];
-    const std::uint8_t m = channels[1].buffer.data()[idx];
-    const std::uint8_t y_val = channels[2].buffer.data()[idx];
-    const std::uint8_t k = channels[3].buffer.data()[idx];
-    const std::uint8_t r = static_cast<std::uint8_t>((255 - c) * (255 - k) / 255);
-    const std::uint8_t g = static_cast<std::uint8_t>((255 - m) * (255 - k) / 255);
-    const std::uint8_t b = static_cast<std::uint8_t>((255 - y_val) * (255 - k) / 255);
-    return {r, g, b};
+  if (command) {
+    command->capture(area);
   }
-
-  return {};
+  const auto stamp = DabStampCache::instance().get(radius, hardness);
+  scratch.add_dab(*stamp, pt);
 }
 
-class StrokeCommand : public core::ImageCommand {
- public:
-  StrokeCommand(core::ImageDocument& doc, std::string name)
-      : ImageCommand(doc), name_(std::move(name)) {
-    save_all_channels();
+void apply_bucket_fill(core::ImageDocument& doc, StrokeCommand* command,
+                       Point pt, int tolerance, bool contiguous, float opacity,
+                       std::uint8_t target_value) {
+  if (doc.channels().empty()) {
+    return;
   }
 
-  void execute() override {}
-  std::string name() const override { return name_; }
-
- private:
-  std::string name_;
-};
-
-void apply_circular_dab(core::ImageDocument& doc, Point pt, int radius,
-                        float hardness, float opacity, std::uint8_t target_value) {
-  if (radius <= 0) {
+  // Find the region first so only its bounding box needs an undo backup
+  const FloodFillResult region = flood_fill(doc, pt, tolerance, contiguous);
+  if (region.spans.empty()) {
     return;
   }
-
-  const core::Size doc_size = doc.size();
-  const int x_start = std::max(0, pt.x - radius);
-  const int y_start = std::max(0, pt.y - radius);
-  const int x_end = std::min(doc_size.width, pt.x + radius + 1);
-  const int y_end = std::min(doc_size.height, pt.y + radius + 1);
+  const core::Rect& bounds = region.bounds;
+  if (command) {
+    command->capture(Rect(bounds.x, bounds.y, bounds.width, bounds.height));
+  }
+  doc.mark_dirty(bounds);
 
   for (auto& channel : doc.channels()) {
-    auto* data = channel.buffer.data();
+    auto& buffer = channel.buffer;
     const int bytes_per_pixel =
-        static_cast<int>(core::bytes_per_pixel(channel.buffer.format()));
-
-    for (int y = y_start; y < y_end; ++y) {
-      for (int x = x_start; x < x_end; ++x) {
-        const int dx = x - pt.x;
-        const int dy = y - pt.y;
-        const float dist =
-            std::sqrt(static_cast<float>(dx * dx + dy * dy)) / radius;
-
-        if (dist > 1.0f) {
-          continue;
-        }
-
-        float alpha = 1.0f;
-        if (hardness < 1.0f && dist > hardness) {
-          alpha = 1.0f - ((dist - hardness) / (1.0f - hardness));
-        }
-        alpha *= opacity;
-
-        const int pixel_index = (y * doc_size.width + x) * bytes_per_pixel;
-
-        for (int c = 0; c < bytes_per_pixel; ++c) {
-          const std::uint8_t old_value = data[pixel_index + c];
-          data[pixel_index + c] = static_cast<std::uint8_t>(
-              old_value + alpha * (target_value - old_value));
+        static_cast<int>(core::bytes_per_pixel(buffer.format()));
+
+    for (const FillSpan& span : region.spans) {
+      for (int x = span.x0; x < span.x1;) {
+        const int span_end = std::min(span.x1, x + buffer.span_width(x));
+        auto* data = buffer.mutable_pixel_row(x, span.y);
+
+        for (; x < span_end; ++x, data += bytes_per_pixel) {
+          for (int c = 0; c < bytes_per_pixel; ++c) {
+            const std::uint8_t old_value = data[c];
+            data[c] = static_cast<std::uint8_t>(
+                old_value + opacity * (target_value - old_value));
+          }
         }
       }
     }
   }
 }
 
-void apply_bucket_fill(core::ImageDocument& doc, Point pt, int tolerance,
-                       float opacity, std::uint8_t target_value) {
-  const core::Size size = doc.size();
-  if (doc.channels().empty() || pt.x < 0 || pt.y < 0 || pt.x >= size.width ||
-      pt.y >= size.height) {
-    return;
-  }
-
-  const RGBColor target_color = sample_color(doc, pt.x, pt.y);
-  std::vector<bool> visited(static_cast<std::size_t>(size.width * size.height),
-                            false);
-  std::queue<Point> queue;
-  queue.push(pt);
-
-  while (!queue.empty()) {
-    const Point current = queue.front();
-    queue.pop();
-
-    if (current.x < 0 || current.y < 0 || current.x >= size.width ||
-        current.y >= size.height) {
-      continue;
-    }
-
-    const int idx = current.y * size.width + current.x;
-    if (visited[idx]) {
-      continue;
-    }
-    visited[idx] = true;
-
-    const RGBColor color = sample_color(doc, current.x, current.y);
-    const int diff = std::abs(color.r - target_color.r) +
-                     std::abs(color.g - target_color.g) +
-                     std::abs(color.b - target_color.b);
-    if (diff > tolerance) {
-      continue;
-    }
-
-    for (auto& channel : doc.channels()) {
-      auto* data = channel.buffer.data();
-      const int bytes_per_pixel =
-          static_cast<int>(core::bytes_per_pixel(channel.buffer.format()));
-      const int pixel_index = idx * bytes_per_pixel;
+}  // namespace
 
-      for (int c = 0; c < bytes_per_pixel; ++c) {
-        const std::uint8_t old_value = data[pixel_index + c];
-        data[pixel_index + c] = static_cast<std::uint8_t>(
-            old_value + opacity * (target_value - old_value));
-      }
-    }
+StrokeCommand::StrokeCommand(core::ImageDocument& doc, std::string name)
+    : ImageCommand(doc), name_(std::move(name)) {}
 
-    queue.push(Point(current.x + 1, current.y));
-    queue.push(Point(current.x - 1, current.y));
-    queue.push(Point(current.x, current.y + 1));
-    queue.push(Point(current.x, current.y - 1));
-  }
+void StrokeCommand::redo() {
+  // After undo() the saved blocks hold the painted pixels
+  swap_regions();
 }
 
-}  // namespace
+void StrokeCommand::capture(const Rect& area) {
+  save_region(area.x, area.y, area.width, area.height);
+}
 
 PencilTool::PencilTool() {
   options_.size = 6;
@@ -184,6 +114,8 @@ void PencilTool::begin_stroke(core::ImageDocument& doc, Point pt) {
   affected_area_ = Rect(pt.x, pt.y, 0, 0);
   stroke_active_ = true;
   current_command_ = std::make_unique<StrokeCommand>(doc, "Pencil Stroke");
+  scratch_.begin(doc, options_.opacity / 100.0f, 255);
+  spacer_.reset(pt);
   apply_pencil_dab(doc, pt);
 }
 
@@ -191,11 +123,17 @@ void PencilTool::continue_stroke(core::ImageDocument& doc, Point pt) {
   if (!stroke_active_) {
     return;
   }
-  apply_pencil_dab(doc, pt);
+  spacer_.advance(pt, dab_spacing(options_),
+                  [&](Point dab) { apply_pencil_dab(doc, dab); });
+}
+
+void PencilTool::flush_stroke(core::ImageDocument&) {
+  scratch_.composite();
 }
 
 std::unique_ptr<core::Command> PencilTool::end_stroke(core::ImageDocument&) {
   stroke_active_ = false;
+  scratch_.end();
   affected_area_ = Rect(0, 0, 0, 0);
   return std::move(current_command_);
 }
@@ -203,8 +141,7 @@ std::unique_ptr<core::Command> PencilTool::end_stroke(core::ImageDocument&) {
 void PencilTool::apply_pencil_dab(core::ImageDocument& doc, Point pt) {
   expand_affected_area(pt);
   const int radius = std::max(1, options_.size / 2);
-  const float opacity = options_.opacity / 100.0f;
-  apply_circular_dab(doc, pt, radius, 1.0f, opacity, 255);
+  add_circular_dab(doc, current_command_.get(), scratch_, pt, radius, 100);
 }
 
 void PencilTool::expand_affected_area(Point pt) {
@@ -239,6 +176,8 @@ void EraserTool::begin_stroke(core::ImageDocument& doc, Point pt) {
   affected_area_ = Rect(pt.x, pt.y, 0, 0);
   stroke_active_ = true;
   current_command_ = std::make_unique<StrokeCommand>(doc, "Erase Stroke");
+  scratch_.begin(doc, options_.opacity / 100.0f, 0);
+  spacer_.reset(pt);
   apply_eraser_dab(doc, pt);
 }
 
@@ -246,11 +185,17 @@ void EraserTool::continue_stroke(core::ImageDocument& doc, Point pt) {
   if (!stroke_active_) {
     return;
   }
-  apply_eraser_dab(doc, pt);
+  spacer_.advance(pt, dab_spacing(options_),
+                  [&](Point dab) { apply_eraser_dab(doc, dab); });
+}
+
+void EraserTool::flush_stroke(core::ImageDocument&) {
+  scratch_.composite();
 }
 
 std::unique_ptr<core::Command> EraserTool::end_stroke(core::ImageDocument&) {
   stroke_active_ = false;
+  scratch_.end();
   affected_area_ = Rect(0, 0, 0, 0);
   return std::move(current_command_);
 }
@@ -258,9 +203,8 @@ std::unique_ptr<core::Command> EraserTool::end_stroke(core::ImageDocument&) {
 void EraserTool::apply_eraser_dab(core::ImageDocument& doc, Point pt) {
   expand_affected_area(pt);
   const int radius = std::max(1, options_.size / 2);
-  const float hardness = options_.hardness / 100.0f;
-  const float opacity = options_.opacity / 100.0f;
-  apply_circular_dab(doc, pt, radius, hardness, opacity, 0);
+  add_circular_dab(doc, current_command_.get(), scratch_, pt, radius,
+                   options_.hardness);
 }
 
 void EraserTool::expand_affected_area(Point pt) {
@@ -297,7 +241,8 @@ void PaintBucketTool::begin_stroke(core::ImageDocument& doc, Point pt) {
 
   const int tolerance = std::clamp(options_.size, 0, 255);
   const float opacity = options_.opacity / 100.0f;
-  apply_bucket_fill(doc, pt, tolerance, opacity, 255);
+  apply_bucket_fill(doc, current_command_.get(), pt, tolerance, options_.contiguous,
+                    opacity, 255);
 }
 
 void PaintBucketTool::continue_stroke(core::ImageDocument&, Point) {}
@@ -0,0 +1,191 @@
+#include "ps/tools/flood_fill.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+#include "ps/core/pixel_accessor.h"
+#include "ps/core/thread_pool.h"
+
+namespace ps::tools {
+namespace {
+
+// Rows per block when all rows are compared in parallel
+constexpr int kRowsPerBlock = 64;
+
+// States of a pixel in the contiguous fill
+constexpr std::uint8_t kNoMatch = 0;
+constexpr std::uint8_t kMatch = 1;
+constexpr std::uint8_t kFilled = 2;
+
+// Compares document rows against the color of the seed pixel, for one
+// channel layout
+template <core::ChannelLayout Layout>
+class RowMatcher {
+ public:
+  RowMatcher(const core::PixelAccessor<Layout>& pixels, core::Size size, Point seed,
+             int tolerance)
+      : pixels_(pixels), width_(size.width), tolerance_(tolerance) {
+    std::uint8_t value[4] = {};
+    pixels_.read_planes(seed.y, seed.x, 1, value);
+    pixels_.rgb(value, 1, 0, target_[0], target_[1], target_[2]);
+  }
+
+  /**
+   * @brief Writes kMatch or kNoMatch for every pixel of row y
+   * @param scratch Reused between calls of one thread
+   */
+  void match(int y, std::uint8_t* out, std::vector<std::uint8_t>& scratch) const {
+    // Without a full set of channels every pixel reads as black, like the
+    // seed, so every pixel matches
+    const std::size_t w = static_cast<std::size_t>(width_);
+    scratch.resize(w * core::PixelAccessor<Layout>::kPlanes);
+    const std::uint8_t* planes = scratch.data();
+    pixels_.read_planes(y, 0, width_, scratch.data());
+
+    // A plain loop over byte planes, which the compiler vectorizes
+    const int tolerance = tolerance_;
+    const int t0 = target_[0];
+    const int t1 = target_[1];
+    const int t2 = target_[2];
+    for (std::size_t i = 0; i < w; ++i) {
+      int r, g, b;
+      pixels_.rgb(planes, w, i, r, g, b);
+      const int diff = std::abs(r - t0) + std::abs(g - t1) + std::abs(b - t2);
+      out[i] = diff <= tolerance ? kMatch : kNoMatch;
+    }
+  }
+
+ private:
+  core::PixelAccessor<Layout> pixels_;
+  int width_ = 0;
+  int tolerance_ = 0;
+  int target_[3] = {};
+};
+
+template <typename Matcher>
+void fill_contiguous(const Matcher& matcher, core::Size size, Point seed,
+                     std::vector<FillSpan>& spans) {
+  // Rows are compared the first time the fill reaches them
+  std::vector<std::vector<std::uint8_t>> rows(static_cast<std::size_t>(size.height));
+  std::vector<std::uint8_t> scratch;
+  const auto row = [&](int y) {
+    std::vector<std::uint8_t>& states = rows[static_cast<std::size_t>(y)];
+    if (states.empty()) {
+      states.resize(static_cast<std::size_t>(size.width));
+      matcher.match(y, states.data(), scratch);
+    }
+    return states.data();
+  };
+
+  std::vector<Point> stack{seed};
+  while (!stack.empty()) {
+    const Point p = stack.back();
+    stack.pop_back();
+    std::uint8_t* states = row(p.y);
+    if (states[p.x] != kMatch) {
+      continue;
+    }
+
+    // Fill the whole run through p, then seed one point per run of
+    // unfilled matches next to it in the rows above and below
+    int x0 = p.x;
+    while (x0 > 0 && states[x0 - 1] == kMatch) {
+      --x0;
+    }
+    int x1 = p.x + 1;
+    while (x1 < size.width && states[x1] == kMatch) {
+      ++x1;
+    }
+    std::fill(states + x0, states + x1, kFilled);
+    spans.push_back(FillSpan{p.y, x0, x1});
+
+    for (const int y : {p.y - 1, p.y + 1}) {
+      if (y < 0 || y >= size.height) {
+        continue;
+      }
+      const std::uint8_t* next = row(y);
+      for (int x = x0; x < x1;) {
+        if (next[x] != kMatch) {
+          ++x;
+          continue;
+        }
+        stack.push_back(Point(x, y));
+        while (x < x1 && next[x] == kMatch) {
+          ++x;
+        }
+      }
+    }
+  }
+
+  std::sort(spans.begin(), spans.end(), [](const FillSpan& a, const FillSpan& b) {
+    return a.y != b.y ? a.y < b.y : a.x0 < b.x0;
+  });
+}
+
+template <typename Matcher>
+void fill_all(const Matcher& matcher, core::Size size, std::vector<FillSpan>& spans) {
+  const int blocks = (size.height + kRowsPerBlock - 1) / kRowsPerBlock;
+  std::vector<std::vector<FillSpan>> parts(static_cast<std::size_t>(blocks));
+  core::ThreadPool::instance().parallel_for(0, blocks, 1, [&](int b0, int b1) {
+    std::vector<std::uint8_t> states(static_cast<std::size_t>(size.width));
+    std::vector<std::uint8_t> scratch;
+    for (int b = b0; b < b1; ++b) {
+      std::vector<FillSpan>& runs = parts[static_cast<std::size_t>(b)];
+      const int y_end = std::min(size.height, (b + 1) * kRowsPerBlock);
+      for (int y = b * kRowsPerBlock; y < y_end; ++y) {
+        matcher.match(y, states.data(), scratch);
+        for (int x = 0; x < size.width;) {
+          if (states[static_cast<std::size_t>(x)] != kMatch) {
+            ++x;
+            continue;
+          }
+          const int x0 = x;
+          while (x < size.width && states[static_cast<std::size_t>(x)] == kMatch) {
+            ++x;
+          }
+          runs.push_back(FillSpan{y, x0, x});
+        }
+      }
+    }
+  });
+
+  for (const std::vector<FillSpan>& runs : parts) {
+    spans.insert(spans.end(), runs.begin(), runs.end());
+  }
+}
+
+}  // namespace
+
+FloodFillResult flood_fill(const core::ImageDocument& doc, Point seed, int tolerance,
+                           bool contiguous) {
+  FloodFillResult result;
+  const core::Size size = doc.size();
+  if (seed.x < 0 || seed.y < 0 || seed.x >= size.width || seed.y >= size.height) {
+    return result;
+  }
+
+  core::dispatch_channels(doc, [&](const auto& pixels) {
+    const RowMatcher matcher(pixels, size, seed, std::max(0, tolerance));
+    if (contiguous) {
+      fill_contiguous(matcher, size, seed, result.spans);
+    } else {
+      fill_all(matcher, size, result.spans);
+    }
+  });
+
+  if (!result.spans.empty()) {
+    int left = size.width;
+    int right = 0;
+    for (const FillSpan& span : result.spans) {
+      left = std::min(left, span.x0);
+      right = std::max(right, span.x1);
+    }
+    const int top = result.spans.front().y;
+    const int bottom = result.spans.back().y + 1;
+    result.bounds = core::Rect{left, top, right - left, bottom - top};
+  }
+  return result;
+}
+
+}  // namespace ps::tools
@@ -0,0 +1,114 @@
+#include "ps/tools/polygon_rasterizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace ps::tools {
+
+void PolygonRasterizer::reset(core::Size size) {
+  size_ = size;
+  points_.clear();
+  rows_.assign(static_cast<std::size_t>(std::max(0, size.height)), {});
+  left_ = 0;
+  right_ = -1;
+  dirty_top_ = 0;
+  dirty_bottom_ = 0;
+}
+
+void PolygonRasterizer::add_point(Point pt) {
+  if (!points_.empty()) {
+    if (points_.size() >= 2) {
+      remove_edge(points_.back(), points_.front(), kClosingEdge);
+    }
+    add_edge(points_.back(), pt, static_cast<int>(points_.size()) - 1);
+    add_edge(pt, points_.front(), kClosingEdge);
+  }
+  points_.push_back(pt);
+
+  // Spans are clamped to the mask, so even a polygon outside it can fill
+  // its first or last column
+  const int x = std::clamp(pt.x, 0, std::max(0, size_.width - 1));
+  if (right_ < left_) {
+    left_ = x;
+    right_ = x;
+  } else {
+    left_ = std::min(left_, x);
+    right_ = std::max(right_, x);
+  }
+}
+
+void PolygonRasterizer::update(core::SelectionMask& mask) {
+  // Rows stay dirty until the polygon is drawn for the first time
+  if (points_.size() < 3 || size_.width <= 0 || dirty_top_ >= dirty_bottom_) {
+    return;
+  }
+
+  const int width = right_ - left_ + 1;
+  row_.resize(static_cast<std::size_t>(width));
+  for (int y = dirty_top_; y < dirty_bottom_; ++y) {
+    std::memset(row_.data(), 0, row_.size());
+    const std::vector<Crossing>& crossings = rows_[static_cast<std::size_t>(y)];
+    for (std::size_t i = 0; i + 1 < crossings.size(); i += 2) {
+      int x_start = static_cast<int>(std::floor(crossings[i].x));
+      int x_end = static_cast<int>(std::ceil(crossings[i + 1].x));
+      x_start = std::clamp(x_start, 0, size_.width - 1);
+      x_end = std::clamp(x_end, 0, size_.width - 1);
+      if (x_end >= x_start) {
+        std::memset(row_.data() + (x_start - left_), 255,
+                    static_cast<std::size_t>(x_end - x_start + 1));
+      }
+    }
+    mask.write_row(left_, y, width, row_.data());
+  }
+  dirty_top_ = 0;
+  dirty_bottom_ = 0;
+}
+
+void PolygonRasterizer::add_edge(Point from, Point to, int edge) {
+  if (from.y == to.y) {
+    return;
+  }
+  const int y0 = std::max(0, std::min(from.y, to.y));
+  const int y1 = std::min(size_.height, std::max(from.y, to.y));
+  for (int y = y0; y < y1; ++y) {
+    const float t = static_cast<float>(y - from.y) / static_cast<float>(to.y - from.y);
+    const Crossing crossing{from.x + t * static_cast<float>(to.x - from.x), edge};
+    std::vector<Crossing>& crossings = rows_[static_cast<std::size_t>(y)];
+    crossings.insert(std::upper_bound(crossings.begin(), crossings.end(), crossing,
+                                      [](const Crossing& a, const Crossing& b) {
+                                        return a.x < b.x;
+                                      }),
+                     crossing);
+  }
+  mark_rows(y0, y1);
+}
+
+void PolygonRasterizer::remove_edge(Point from, Point to, int edge) {
+  if (from.y == to.y) {
+    return;
+  }
+  const int y0 = std::max(0, std::min(from.y, to.y));
+  const int y1 = std::min(size_.height, std::max(from.y, to.y));
+  for (int y = y0; y < y1; ++y) {
+    std::vector<Crossing>& crossings = rows_[static_cast<std::size_t>(y)];
+    crossings.erase(std::find_if(crossings.begin(), crossings.end(),
+                                 [edge](const Crossing& c) { return c.edge == edge; }));
+  }
+  mark_rows(y0, y1);
+}
+
+void PolygonRasterizer::mark_rows(int y0, int y1) {
+  if (y0 >= y1) {
+    return;
+  }
+  if (dirty_top_ >= dirty_bottom_) {
+    dirty_top_ = y0;
+    dirty_bottom_ = y1;
+  } else {
+    dirty_top_ = std::min(dirty_top_, y0);
+    dirty_bottom_ = std::max(dirty_bottom_, y1);
+  }
+}
+
+}  // namespace ps::tools
@@ -0,0 +1,190 @@
+#include "ps/tools/stroke_pipeline.h"
+
+#include <stdexcept>
+
+namespace ps::tools {
+
+StrokePipeline::StrokePipeline() : worker_([this] { run(); }) {}
+
+StrokePipeline::~StrokePipeline() {
+  {
+    std::lock_guard<std::mutex> lock(wake_mutex_);
+    stop_ = true;
+  }
+  wake_cv_.notify_all();
+  worker_.join();
+}
+
+void StrokePipeline::begin_stroke(Tool& tool, core::ImageDocument& doc,
+                                  Point pt, int pressure) {
+  if (active_) {
+    throw std::logic_error("StrokePipeline: a stroke is already active");
+  }
+  active_ = true;
+
+  Event event;
+  event.type = Event::Type::Begin;
+  event.tool = &tool;
+  event.document = &doc;
+  event.position = pt;
+  event.pressure = pressure;
+  push(event);
+}
+
+void StrokePipeline::continue_stroke(Point pt, int pressure) {
+  if (!active_ || (pt.x == last_.position.x && pt.y == last_.position.y &&
+                   pressure == last_.pressure)) {
+    return;
+  }
+
+  Event event;
+  event.type = Event::Type::Move;
+  event.position = pt;
+  event.pressure = pressure;
+  push(event);
+}
+
+std::unique_ptr<core::Command> StrokePipeline::end_stroke() {
+  if (!active_) {
+    return nullptr;
+  }
+  active_ = false;
+
+  Event event;
+  event.type = Event::Type::End;
+  event.position = last_.position;
+  push(event);
+
+  std::unique_lock<std::mutex> lock(done_mutex_);
+  done_cv_.wait(lock, [this] { return done_; });
+  done_ = false;
+  auto command = std::move(command_);
+  const std::exception_ptr error = error_;
+  error_ = nullptr;
+  lock.unlock();
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+  return command;
+}
+
+bool StrokePipeline::busy() const {
+  return painting_.load(std::memory_order_acquire) || !queue_.empty();
+}
+
+std::unique_lock<std::mutex> StrokePipeline::lock_document() {
+  ui_waiting_.fetch_add(1, std::memory_order_acq_rel);
+  std::unique_lock<std::mutex> lock(document_mutex_);
+  ui_waiting_.fetch_sub(1, std::memory_order_acq_rel);
+  return lock;
+}
+
+void StrokePipeline::push(const Event& event) {
+  // The worker empties the queue whenever the UI thread does not hold the
+  // document, so a full queue only means a burst is being painted
+  while (!queue_.try_push(event)) {
+    std::this_thread::yield();
+  }
+  last_ = event;
+
+  { std::lock_guard<std::mutex> lock(wake_mutex_); }
+  wake_cv_.notify_one();
+}
+
+void StrokePipeline::run() {
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(wake_mutex_);
+      wake_cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+      if (queue_.empty()) {
+        return;
+      }
+    }
+
+    // Paint everything queued as one batch, but hand the document to the
+    // UI thread as soon as it asks for it
+    {
+      std::lock_guard<std::mutex> lock(document_mutex_);
+      painting_.store(true, std::memory_order_release);
+      Event event;
+      while (ui_waiting_.load(std::memory_order_acquire) == 0 &&
+             queue_.try_pop(event)) {
+        handle(event);
+      }
+      flush();
+      painting_.store(false, std::memory_order_release);
+    }
+
+    while (ui_waiting_.load(std::memory_order_acquire) != 0) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+void StrokePipeline::flush() {
+  if (!tool_ || stroke_error_) {
+    return;
+  }
+  try {
+    tool_->flush_stroke(*document_);
+  } catch (...) {
+    stroke_error_ = std::current_exception();
+  }
+}
+
+void StrokePipeline::handle(const Event& event) {
+  switch (event.type) {
+    case Event::Type::Begin:
+      tool_ = event.tool;
+      document_ = event.document;
+      stroke_error_ = nullptr;
+      try {
+        tool_->begin_stroke(*document_, event.position);
+      } catch (...) {
+        stroke_error_ = std::current_exception();
+      }
+      break;
+
+    case Event::Type::Move:
+      if (tool_ && !stroke_error_) {
+        try {
+          tool_->continue_stroke(*document_, event.position);
+        } catch (...) {
+          stroke_error_ = std::current_exception();
+        }
+      }
+      break;
+
+    case Event::Type::End: {
+      // end_stroke() also resets the tool after an error
+      std::unique_ptr<core::Command> command;
+      if (tool_) {
+        try {
+          command = tool_->end_stroke(*document_);
+        } catch (...) {
+          if (!stroke_error_) {
+            stroke_error_ = std::current_exception();
+          }
+        }
+      }
+      if (stroke_error_) {
+        command.reset();
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(done_mutex_);
+        command_ = std::move(command);
+        error_ = stroke_error_;
+        done_ = true;
+      }
+      done_cv_.notify_all();
+      tool_ = nullptr;
+      document_ = nullptr;
+      stroke_error_ = nullptr;
+      break;
+    }
+  }
+}
+
+}  // namespace ps::tools
@@ -0,0 +1,229 @@
+#include "ps/tools/stroke_scratch.h"
+
+#include <algorithm>
+
+#include "target_clones.h"
+
+namespace ps::tools {
+namespace {
+
+// coverage = max(coverage, stamp)
+PS_TARGET_CLONES
+void accumulate_span(std::uint8_t* coverage, const std::uint8_t* stamp,
+                     int count) {
+  for (int i = 0; i < count; ++i) {
+    coverage[i] = std::max(coverage[i], stamp[i]);
+  }
+}
+
+// coverage = max(coverage, stamp * flow / 255)
+PS_TARGET_CLONES
+void accumulate_span(std::uint8_t* coverage, const std::uint8_t* stamp,
+                     int count, int flow) {
+  for (int i = 0; i < count; ++i) {
+    const std::uint8_t value =
+        static_cast<std::uint8_t>((stamp[i] * flow + 127) / 255);
+    coverage[i] = std::max(coverage[i], value);
+  }
+}
+
+PS_TARGET_CLONES
+void composite_span(std::uint8_t* dst, const std::uint8_t* original,
+                    const std::uint8_t* coverage, int count, float scale,
+                    std::uint8_t target) {
+  const float target_value = target;
+  for (int i = 0; i < count; ++i) {
+    const float alpha = coverage[i] * scale;
+    const float old_value = original[i];
+    dst[i] = static_cast<std::uint8_t>(
+        old_value + alpha * (target_value - old_value));
+  }
+}
+
+PS_TARGET_CLONES
+void composite_span(std::uint8_t* dst, const std::uint8_t* original,
+                    const std::uint8_t* coverage, int count,
+                    int bytes_per_pixel, float scale, std::uint8_t target) {
+  const float target_value = target;
+  for (int i = 0; i < count; ++i) {
+    const float alpha = coverage[i] * scale;
+    for (int c = 0; c < bytes_per_pixel; ++c, ++dst, ++original) {
+      const float old_value = *original;
+      *dst = static_cast<std::uint8_t>(
+          old_value + alpha * (target_value - old_value));
+    }
+  }
+}
+
+}  // namespace
+
+void StrokeScratch::begin(core::ImageDocument& doc, float opacity,
+                          std::uint8_t target) {
+  document_ = &doc;
+  opacity_ = std::clamp(opacity, 0.0f, 1.0f);
+  target_ = target;
+
+  const core::Size size = doc.size();
+  columns_ = (std::max(0, size.width) + kBlockSize - 1) / kBlockSize;
+  rows_ = (std::max(0, size.height) + kBlockSize - 1) / kBlockSize;
+  blocks_.clear();
+  blocks_.resize(static_cast<std::size_t>(columns_) * rows_);
+  pending_blocks_.clear();
+  bounds_ = core::Rect{};
+  pending_ = core::Rect{};
+}
+
+StrokeScratch::Block& StrokeScratch::block_at(int column, int row) {
+  auto& block = blocks_[static_cast<std::size_t>(row) * columns_ + column];
+  if (block) {
+    return *block;
+  }
+
+  // First touch: keep the pixels under the block as they are before the
+  // stroke, which composite() blends from
+  block = std::make_unique<Block>();
+  block->coverage.assign(static_cast<std::size_t>(kBlockSize) * kBlockSize, 0);
+
+  const core::Size size = document_->size();
+  const int x0 = column * kBlockSize;
+  const int y0 = row * kBlockSize;
+  const int width = std::min(kBlockSize, size.width - x0);
+  const int height = std::min(kBlockSize, size.height - y0);
+
+  for (const auto& channel : document_->channels()) {
+    const std::size_t bytes_per_pixel =
+        core::bytes_per_pixel(channel.buffer.format());
+    std::vector<std::uint8_t> original(
+        static_cast<std::size_t>(kBlockSize) * kBlockSize * bytes_per_pixel);
+    for (int y = 0; y < height; ++y) {
+      channel.buffer.read_pixels(
+          x0, y0 + y, width,
+          original.data() + static_cast<std::size_t>(y) * kBlockSize * bytes_per_pixel);
+    }
+    block->original.push_back(std::move(original));
+  }
+  return *block;
+}
+
+void StrokeScratch::add_dab(const DabStamp& stamp, Point center, float flow) {
+  if (!document_) {
+    return;
+  }
+
+  const int radius = stamp.radius();
+  const Rect area = dab_area(document_->size(), center, radius);
+  if (area.is_empty()) {
+    return;
+  }
+  const core::Rect dab{area.x, area.y, area.width, area.height};
+  bounds_ = bounds_.united(dab);
+  pending_ = pending_.united(dab);
+
+  // Mark the part of each block under the dab's square as pending
+  for (int row = area.y / kBlockSize;
+       row <= (area.y + area.height - 1) / kBlockSize; ++row) {
+    for (int column = area.x / kBlockSize;
+         column <= (area.x + area.width - 1) / kBlockSize; ++column) {
+      Block& block = block_at(column, row);
+      if (block.pending.is_empty()) {
+        pending_blocks_.push_back(static_cast<std::size_t>(row) * columns_ + column);
+      }
+      block.pending = block.pending.united(dab.intersected(core::Rect{
+          column * kBlockSize, row * kBlockSize, kBlockSize, kBlockSize}));
+    }
+  }
+
+  const int flow255 =
+      static_cast<int>(std::clamp(flow, 0.0f, 1.0f) * 255.0f + 0.5f);
+  for (int y = area.y; y < area.y + area.height; ++y) {
+    const int dy = y - center.y;
+    const std::uint8_t* row = stamp.row(dy);
+    const int x_end =
+        std::min(area.x + area.width, center.x + stamp.row_end(dy));
+    const int block_row = y / kBlockSize;
+    const int block_y = y - block_row * kBlockSize;
+
+    // One run per block the row crosses
+    for (int x = std::max(area.x, center.x + stamp.row_begin(dy)); x < x_end;) {
+      const int column = x / kBlockSize;
+      const int run_end = std::min(x_end, (column + 1) * kBlockSize);
+      Block& block = block_at(column, block_row);
+      std::uint8_t* coverage = block.coverage.data() +
+                               static_cast<std::size_t>(block_y) * kBlockSize +
+                               (x - column * kBlockSize);
+      const std::uint8_t* dab_row = row + (x - center.x + radius);
+      if (flow255 == 255) {
+        accumulate_span(coverage, dab_row, run_end - x);
+      } else {
+        accumulate_span(coverage, dab_row, run_end - x, flow255);
+      }
+      x = run_end;
+    }
+  }
+}
+
+core::Rect StrokeScratch::composite() {
+  const core::Rect area = pending_;
+  if (!document_ || area.is_empty()) {
+    return core::Rect{};
+  }
+  pending_ = core::Rect{};
+
+  const float scale = opacity_ / 255.0f;
+  auto& channels = document_->channels();
+  for (const std::size_t block_index : pending_blocks_) {
+    Block& block = *blocks_[block_index];
+    const core::Rect part = block.pending;
+    block.pending = core::Rect{};
+    const int block_x = static_cast<int>(block_index % columns_) * kBlockSize;
+    const int block_y = static_cast<int>(block_index / columns_) * kBlockSize;
+
+    for (std::size_t index = 0; index < channels.size(); ++index) {
+      auto& buffer = channels[index].buffer;
+      const int bytes_per_pixel =
+          static_cast<int>(core::bytes_per_pixel(buffer.format()));
+
+      for (int y = part.y; y < part.y + part.height; ++y) {
+        const std::size_t offset =
+            static_cast<std::size_t>(y - block_y) * kBlockSize + (part.x - block_x);
+        const std::uint8_t* coverage = block.coverage.data() + offset;
+        const std::uint8_t* original =
+            block.original[index].data() + offset * bytes_per_pixel;
+
+        // Walk the row in spans that are contiguous in memory (one tile at
+        // a time for tiled buffers).
+        for (int x = part.x; x < part.x + part.width;) {
+          const int count =
+              std::min(part.x + part.width - x, buffer.span_width(x));
+          std::uint8_t* dst = buffer.mutable_pixel_row(x, y);
+          if (bytes_per_pixel == 1) {
+            composite_span(dst, original, coverage, count, scale, target_);
+          } else {
+            composite_span(dst, original, coverage, count, bytes_per_pixel,
+                           scale, target_);
+          }
+          coverage += count;
+          original += static_cast<std::size_t>(count) * bytes_per_pixel;
+          x += count;
+        }
+      }
+    }
+  }
+  pending_blocks_.clear();
+
+  document_->mark_dirty(area);
+  return area;
+}
+
+void StrokeScratch::end() {
+  composite();
+  document_ = nullptr;
+  blocks_.clear();
+  blocks_.shrink_to_fit();
+  pending_blocks_.clear();
+  columns_ = 0;
+  rows_ = 0;
+  bounds_ = core::Rect{};
+}
+
+}  // namespace ps::tools
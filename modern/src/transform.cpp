@@ -0,0 +1,500 @@
+#include "ps/core/transform.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "ps/core/image_view.h"
+#include "ps/core/pixel_conversion.h"
+#include "ps/core/thread_pool.h"
+#include "target_clones.h"
+
+namespace ps::core {
+namespace {
+
+constexpr double kPi = 3.14159265358979323846;
+
+// Edge of the blocks a quarter turn transposes, in pixels; a divisor of
+// ImageBuffer::kTileSize
+constexpr int kBlock = 64;
+// Edge of the micro-kernels inside a block
+constexpr int kMicro = 8;
+
+template <std::size_t Bytes>
+struct Pixel {
+  std::uint8_t bytes[Bytes];
+};
+
+// dst pixel (r, c) = src pixel (c, r) for a rows × columns block of src
+template <std::size_t Bytes>
+inline void transpose_block(const std::uint8_t* src, std::size_t src_stride, std::uint8_t* dst,
+                            std::size_t dst_stride, int rows, int columns) {
+  using P = Pixel<Bytes>;
+  for (int r0 = 0; r0 < rows; r0 += kMicro) {
+    for (int c0 = 0; c0 < columns; c0 += kMicro) {
+      const P* in = reinterpret_cast<const P*>(src + r0 * src_stride) + c0;
+      P* out = reinterpret_cast<P*>(dst + c0 * dst_stride) + r0;
+      const std::size_t in_stride = src_stride / Bytes;
+      const std::size_t out_stride = dst_stride / Bytes;
+      if (r0 + kMicro <= rows && c0 + kMicro <= columns) {
+        // Fixed bounds, so the compiler unrolls this into register shuffles
+        for (int c = 0; c < kMicro; ++c) {
+          for (int r = 0; r < kMicro; ++r) {
+            out[c * out_stride + r] = in[r * in_stride + c];
+          }
+        }
+      } else {
+        const int rs = std::min(kMicro, rows - r0);
+        const int cs = std::min(kMicro, columns - c0);
+        for (int c = 0; c < cs; ++c) {
+          for (int r = 0; r < rs; ++r) {
+            out[c * out_stride + r] = in[r * in_stride + c];
+          }
+        }
+      }
+    }
+  }
+}
+
+PS_TARGET_CLONES
+void transpose_block(std::size_t pixel_bytes, const std::uint8_t* src, std::size_t src_stride,
+                     std::uint8_t* dst, std::size_t dst_stride, int rows, int columns) {
+  switch (pixel_bytes) {
+    case 1:
+      transpose_block<1>(src, src_stride, dst, dst_stride, rows, columns);
+      break;
+    case 2:
+      transpose_block<2>(src, src_stride, dst, dst_stride, rows, columns);
+      break;
+    case 3:
+      transpose_block<3>(src, src_stride, dst, dst_stride, rows, columns);
+      break;
+    case 4:
+      transpose_block<4>(src, src_stride, dst, dst_stride, rows, columns);
+      break;
+    default:
+      transpose_block<8>(src, src_stride, dst, dst_stride, rows, columns);
+      break;
+  }
+}
+
+template <std::size_t Bytes>
+inline void reverse_row(const std::uint8_t* src, std::uint8_t* dst, int count) {
+  using P = Pixel<Bytes>;
+  const P* in = reinterpret_cast<const P*>(src);
+  P* out = reinterpret_cast<P*>(dst);
+  for (int i = 0; i < count; ++i) {
+    out[i] = in[count - 1 - i];
+  }
+}
+
+PS_TARGET_CLONES
+void reverse_row(std::size_t pixel_bytes, const std::uint8_t* src, std::uint8_t* dst,
+                 int count) {
+  switch (pixel_bytes) {
+    case 1:
+      reverse_row<1>(src, dst, count);
+      break;
+    case 2:
+      reverse_row<2>(src, dst, count);
+      break;
+    case 3:
+      reverse_row<3>(src, dst, count);
+      break;
+    case 4:
+      reverse_row<4>(src, dst, count);
+      break;
+    default:
+      reverse_row<8>(src, dst, count);
+      break;
+  }
+}
+
+// Target rows [y0, y1) of a flip or half turn
+void flip_rows(const ImageBuffer& source, ImageBuffer& target, OrthogonalTransform transform,
+               int y0, int y1) {
+  const Size size = source.size();
+  const std::size_t bpp = bytes_per_pixel(source.format());
+  const bool mirror = transform != OrthogonalTransform::FlipVertical;
+  const bool upside_down = transform != OrthogonalTransform::FlipHorizontal;
+  thread_local std::vector<std::uint8_t> row;
+  thread_local std::vector<std::uint8_t> reversed;
+  row.resize(static_cast<std::size_t>(size.width) * bpp);
+  reversed.resize(row.size());
+  for (int y = y0; y < y1; ++y) {
+    source.read_pixels(0, upside_down ? size.height - 1 - y : y, size.width, row.data());
+    if (mirror) {
+      reverse_row(bpp, row.data(), reversed.data(), size.width);
+    }
+    target.write_pixels(0, y, size.width, mirror ? reversed.data() : row.data());
+  }
+}
+
+// Target rows [y0, y1) of a quarter turn, kBlock × kBlock pixels at a time
+void turn_rows(const ImageBuffer& source, ImageBuffer& target, OrthogonalTransform transform,
+               int y0, int y1) {
+  const Size size = source.size();
+  const Size target_size = target.size();
+  const std::size_t bpp = bytes_per_pixel(source.format());
+  const bool clockwise = transform == OrthogonalTransform::Rotate90;
+  thread_local std::vector<std::uint8_t> block;
+  thread_local std::vector<std::uint8_t> turned;
+  block.resize(static_cast<std::size_t>(kBlock) * kBlock * bpp);
+  turned.resize(block.size());
+
+  for (int by = y0; by < y1; by += kBlock) {
+    const int rows = std::min(kBlock, y1 - by);
+    for (int bx = 0; bx < target_size.width; bx += kBlock) {
+      const int columns = std::min(kBlock, target_size.width - bx);
+      // Block row i holds the source row that becomes target column bx + i:
+      // clockwise, target (x, y) is source (y, H - 1 - x); counter-clockwise
+      // it is source (W - 1 - y, x), so the block's columns run bottom up.
+      const std::size_t block_stride = static_cast<std::size_t>(rows) * bpp;
+      for (int i = 0; i < columns; ++i) {
+        const int source_y = clockwise ? size.height - 1 - (bx + i) : bx + i;
+        const int source_x = clockwise ? by : size.width - by - rows;
+        source.read_pixels(source_x, source_y, rows, block.data() + i * block_stride);
+      }
+      const std::size_t turned_stride = static_cast<std::size_t>(columns) * bpp;
+      transpose_block(bpp, block.data(), block_stride, turned.data(), turned_stride, columns,
+                      rows);
+      for (int j = 0; j < rows; ++j) {
+        const int y = clockwise ? by + j : by + rows - 1 - j;
+        target.write_pixels(bx, y, columns, turned.data() + j * turned_stride);
+      }
+    }
+  }
+}
+
+// Target rows [y0, y1) of an arbitrary rotation, by inverse mapping
+template <PixelFormat Format>
+void rotate_rows(const ImageBuffer& source, ImageBuffer& target, double cosine, double sine,
+                 std::uint8_t fill, int y0, int y1) {
+  using Sample = typename FormatTraits<Format>::Sample;
+  constexpr int kComponents = FormatTraits<Format>::kComponents;
+  constexpr float kMax = sizeof(Sample) == 1 ? 255.0f : 65535.0f;
+
+  const Size size = source.size();
+  const Size target_size = target.size();
+  Sample fill_sample;
+  std::memset(&fill_sample, fill, sizeof(Sample));
+  const float background = static_cast<float>(fill_sample);
+  auto fetch = [&](int x, int y, float* out) {
+    if (x < 0 || y < 0 || x >= size.width || y >= size.height) {
+      std::fill(out, out + kComponents, background);
+      return;
+    }
+    const Sample* pixel = reinterpret_cast<const Sample*>(source.pixel_row(x, y));
+    for (int c = 0; c < kComponents; ++c) {
+      out[c] = pixel[c];
+    }
+  };
+
+  // Contiguous sources are addressed directly
+  const Sample* base =
+      source.is_tiled() ? nullptr : reinterpret_cast<const Sample*>(source.pixel_row(0, 0));
+
+  thread_local std::vector<Sample> row;
+  row.resize(static_cast<std::size_t>(target_size.width) * kComponents);
+  const double source_cx = size.width / 2.0;
+  const double source_cy = size.height / 2.0;
+  const double target_cx = target_size.width / 2.0;
+  const double target_cy = target_size.height / 2.0;
+  // Positions step in 32.32 fixed point, which keeps the floor and the
+  // fraction cheap and drifts by well under 1/1000 pixel across a row
+  constexpr double kOne = 4294967296.0;
+  const std::int64_t step_u = std::llround(cosine * kOne);
+  const std::int64_t step_v = std::llround(-sine * kOne);
+  for (int y = y0; y < y1; ++y) {
+    // Source position, in pixel-center coordinates, of each target pixel's
+    // center: the target offset from the center turned back by the angle
+    const double dy = y + 0.5 - target_cy;
+    const double dx = 0.5 - target_cx;
+    std::int64_t u = std::llround((source_cx + cosine * dx + sine * dy - 0.5) * kOne);
+    std::int64_t v = std::llround((source_cy - sine * dx + cosine * dy - 0.5) * kOne);
+    for (int x = 0; x < target_size.width; ++x, u += step_u, v += step_v) {
+      Sample* out = row.data() + static_cast<std::size_t>(x) * kComponents;
+      const std::int64_t fu = u >> 32;
+      const std::int64_t fv = v >> 32;
+      if (fu < -1 || fv < -1 || fu >= size.width || fv >= size.height) {
+        std::fill(out, out + kComponents, fill_sample);
+        continue;
+      }
+      const int sx = static_cast<int>(fu);
+      const int sy = static_cast<int>(fv);
+      const float wx = static_cast<float>(static_cast<double>(u & 0xffffffff) / kOne);
+      const float wy = static_cast<float>(static_cast<double>(v & 0xffffffff) / kOne);
+      float p00[kComponents];
+      float p10[kComponents];
+      float p01[kComponents];
+      float p11[kComponents];
+      if (sx >= 0 && sy >= 0 && sx + 1 < size.width && sy + 1 < size.height &&
+          (base || source.span_width(sx) >= 2)) {
+        // Inside the source: both pixel pairs are adjacent in memory
+        const Sample* top = base ? base + (static_cast<std::size_t>(sy) * size.width + sx) *
+                                              kComponents
+                                 : reinterpret_cast<const Sample*>(source.pixel_row(sx, sy));
+        const Sample* bottom =
+            base ? top + static_cast<std::size_t>(size.width) * kComponents
+                 : reinterpret_cast<const Sample*>(source.pixel_row(sx, sy + 1));
+        for (int c = 0; c < kComponents; ++c) {
+          p00[c] = top[c];
+          p10[c] = top[kComponents + c];
+          p01[c] = bottom[c];
+          p11[c] = bottom[kComponents + c];
+        }
+      } else {
+        fetch(sx, sy, p00);
+        fetch(sx + 1, sy, p10);
+        fetch(sx, sy + 1, p01);
+        fetch(sx + 1, sy + 1, p11);
+      }
+      for (int c = 0; c < kComponents; ++c) {
+        const float top = p00[c] + (p10[c] - p00[c]) * wx;
+        const float bottom = p01[c] + (p11[c] - p01[c]) * wx;
+        const float value = top + (bottom - top) * wy;
+        out[c] = static_cast<Sample>(std::min(std::max(value, 0.0f), kMax) + 0.5f);
+      }
+    }
+    target.write_pixels(0, y, target_size.width,
+                        reinterpret_cast<const std::uint8_t*>(row.data()));
+  }
+}
+
+// Runs fn(y0, y1) over bands of target rows; tiled targets get one band
+// per row of tiles, so no two tasks write to (and allocate) the same tile
+template <typename Fn>
+void for_each_band(const ImageBuffer& target, Fn&& fn) {
+  const int height = target.size().height;
+  const int band = target.is_tiled() ? ImageBuffer::kTileSize : kBlock;
+  const int bands = (height + band - 1) / band;
+  ThreadPool::instance().parallel_for(0, bands, 1, [&](int b0, int b1) {
+    for (int b = b0; b < b1; ++b) {
+      fn(b * band, std::min(height, (b + 1) * band));
+    }
+  });
+}
+
+// Returns the number of clockwise quarter turns in degrees, or -1 if it is
+// not a whole number of them
+int quarter_turns(double degrees) {
+  const double turns = degrees / 90.0;
+  if (!std::isfinite(turns) || turns != std::round(turns)) {
+    return -1;
+  }
+  return static_cast<int>(std::fmod(std::fmod(turns, 4.0) + 4.0, 4.0));
+}
+
+ImageBuffer selection_buffer(const SelectionMask& selection) {
+  const Size size = selection.size();
+  ImageBuffer mask(size, PixelFormat::Gray8, StorageLayout::Contiguous,
+                   BufferInit::Uninitialized);
+  for (int y = 0; y < size.height; ++y) {
+    selection.read_row(0, y, size.width, mask.mutable_pixel_row(0, y));
+  }
+  return mask;
+}
+
+SelectionMask selection_from(const ImageBuffer& mask) {
+  const Size size = mask.size();
+  SelectionMask selection(size);
+  for (int y = 0; y < size.height; ++y) {
+    selection.write_row(0, y, size.width, mask.pixel_row(0, y));
+  }
+  return selection;
+}
+
+}  // namespace
+
+OrthogonalTransform inverse(OrthogonalTransform transform) {
+  switch (transform) {
+    case OrthogonalTransform::Rotate90:
+      return OrthogonalTransform::Rotate270;
+    case OrthogonalTransform::Rotate270:
+      return OrthogonalTransform::Rotate90;
+    default:
+      return transform;
+  }
+}
+
+Size transformed_size(Size size, OrthogonalTransform transform) {
+  if (transform == OrthogonalTransform::Rotate90 || transform == OrthogonalTransform::Rotate270) {
+    return Size{size.height, size.width};
+  }
+  return size;
+}
+
+ImageBuffer transformed(const ImageBuffer& source, OrthogonalTransform transform) {
+  const Size size = transformed_size(source.size(), transform);
+  ImageBuffer target(size, source.format(), source.layout(), BufferInit::Uninitialized);
+  if (size.width <= 0 || size.height <= 0) {
+    return target;
+  }
+  const bool turn =
+      transform == OrthogonalTransform::Rotate90 || transform == OrthogonalTransform::Rotate270;
+  for_each_band(target, [&](int y0, int y1) {
+    if (turn) {
+      turn_rows(source, target, transform, y0, y1);
+    } else {
+      flip_rows(source, target, transform, y0, y1);
+    }
+  });
+  return target;
+}
+
+Size rotated_size(Size size, double degrees) {
+  switch (quarter_turns(degrees)) {
+    case 0:
+    case 2:
+      return size;
+    case 1:
+    case 3:
+      return Size{size.height, size.width};
+    default:
+      break;
+  }
+  const double radians = degrees * kPi / 180.0;
+  const double c = std::fabs(std::cos(radians));
+  const double s = std::fabs(std::sin(radians));
+  // Slack so that rounding error does not add a column or row
+  const double slack = 1e-6;
+  return Size{std::max(1, static_cast<int>(std::ceil(size.width * c + size.height * s - slack))),
+              std::max(1, static_cast<int>(std::ceil(size.width * s + size.height * c - slack)))};
+}
+
+ImageBuffer rotated(const ImageBuffer& source, double degrees, std::uint8_t fill) {
+  switch (quarter_turns(degrees)) {
+    case 0:
+      return source;
+    case 1:
+      return transformed(source, OrthogonalTransform::Rotate90);
+    case 2:
+      return transformed(source, OrthogonalTransform::Rotate180);
+    case 3:
+      return transformed(source, OrthogonalTransform::Rotate270);
+    default:
+      break;
+  }
+  if (!std::isfinite(degrees)) {
+    throw std::invalid_argument("rotation angle must be finite");
+  }
+
+  const Size size = rotated_size(source.size(), degrees);
+  ImageBuffer target(size, source.format(), source.layout(), BufferInit::Uninitialized);
+  const Size source_size = source.size();
+  if (source_size.width <= 0 || source_size.height <= 0) {
+    target.fill(fill);
+    return target;
+  }
+  const double radians = degrees * kPi / 180.0;
+  const double cosine = std::cos(radians);
+  const double sine = std::sin(radians);
+  dispatch_format(target.format(), [&](auto format) {
+    for_each_band(target, [&](int y0, int y1) {
+      rotate_rows<decltype(format)::value>(source, target, cosine, sine, fill, y0, y1);
+    });
+  });
+  return target;
+}
+
+TransformCommand::TransformCommand(ImageDocument& doc, OrthogonalTransform transform)
+    : document_(doc), transform_(transform) {}
+
+void TransformCommand::execute() {
+  apply(transform_);
+}
+
+void TransformCommand::undo() {
+  apply(inverse(transform_));
+}
+
+std::string TransformCommand::name() const {
+  switch (transform_) {
+    case OrthogonalTransform::FlipHorizontal:
+      return "Flip Horizontal";
+    case OrthogonalTransform::FlipVertical:
+      return "Flip Vertical";
+    case OrthogonalTransform::Rotate180:
+      return "Rotate 180";
+    case OrthogonalTransform::Rotate90:
+      return "Rotate 90 CW";
+    case OrthogonalTransform::Rotate270:
+      return "Rotate 90 CCW";
+  }
+  return "Rotate";
+}
+
+void TransformCommand::apply(OrthogonalTransform transform) {
+  DocumentPixels pixels;
+  pixels.size = transformed_size(document_.size(), transform);
+  for (const ImageChannel& channel : document_.channels()) {
+    pixels.channels.push_back(transformed(channel.buffer, transform));
+  }
+  for (const auto& layer : document_.layers()) {
+    pixels.layers.push_back(transformed(layer->buffer(), transform));
+  }
+  const SelectionMask& selection = document_.selection();
+  pixels.selection = selection.has_selection()
+                         ? selection_from(transformed(selection_buffer(selection), transform))
+                         : SelectionMask(pixels.size);
+  document_.swap_pixels(pixels);
+}
+
+RotateCommand::RotateCommand(ImageDocument& doc, double degrees, std::uint8_t background)
+    : document_(doc), degrees_(degrees), background_(background) {
+  if (!std::isfinite(degrees)) {
+    throw std::invalid_argument("rotation angle must be finite");
+  }
+}
+
+void RotateCommand::execute() {
+  if (!rotated_) {
+    pixels_.size = rotated_size(document_.size(), degrees_);
+    pixels_.channels.clear();
+    for (const ImageChannel& channel : document_.channels()) {
+      pixels_.channels.push_back(rotated(channel.buffer, degrees_, background_));
+    }
+    pixels_.layers.clear();
+    for (const auto& layer : document_.layers()) {
+      const ImageBuffer& buffer = layer->buffer();
+      if (buffer.format() == PixelFormat::RGBA8) {
+        // Premultiplied, so transparent pixels carry no color into the
+        // interpolation
+        pixels_.layers.push_back(convert_rgba_buffer(
+            rotated(convert_rgba_buffer(buffer, PixelFormat::RGBA8Premul), degrees_),
+            PixelFormat::RGBA8));
+      } else {
+        pixels_.layers.push_back(rotated(buffer, degrees_));
+      }
+    }
+    const SelectionMask& selection = document_.selection();
+    pixels_.selection = selection.has_selection()
+                            ? selection_from(rotated(selection_buffer(selection), degrees_))
+                            : SelectionMask(pixels_.size);
+    rotated_ = true;
+  }
+  document_.swap_pixels(pixels_);
+}
+
+void RotateCommand::undo() {
+  document_.swap_pixels(pixels_);
+}
+
+void RotateCommand::redo() {
+  document_.swap_pixels(pixels_);
+}
+
+std::size_t RotateCommand::memory_footprint() const {
+  std::size_t bytes = pixels_.selection.memory_footprint();
+  for (const ImageBuffer& buffer : pixels_.channels) {
+    bytes += buffer.allocated_bytes();
+  }
+  for (const ImageBuffer& buffer : pixels_.layers) {
+    bytes += buffer.allocated_bytes();
+  }
+  return bytes;
+}
+
+}  // namespace ps::core
@@ -9,6 +9,17 @@ UndoStack::UndoStack(std::size_t max_depth)
   commands_.reserve(max_depth);
 }
 
+UndoStack::~UndoStack() {
+  {
+    std::lock_guard<std::mutex> lock(compress_mutex_);
+    stop_worker_ = true;
+  }
+  compress_cv_.notify_all();
+  if (worker_.joinable()) {
+    worker_.join();
+  }
+}
+
 void UndoStack::push(std::unique_ptr<Command> cmd) {
   if (!cmd) {
     return;
@@ -17,13 +28,18 @@ void UndoStack::push(std::unique_ptr<Command> cmd) {
   cmd->execute();
 
   if (current_index_ < commands_.size()) {
-    commands_.erase(commands_.begin() + current_index_, commands_.end());
+    erase_commands(current_index_, commands_.size());
   }
 
   commands_.push_back(std::move(cmd));
   current_index_ = commands_.size();
 
+  if (current_index_ > uncompressed_depth_) {
+    schedule_compression(current_index_ - 1 - uncompressed_depth_);
+  }
+
   trim_to_max_depth();
+  trim_to_budget();
 }
 
 void UndoStack::undo() {
@@ -32,7 +48,15 @@ void UndoStack::undo() {
   }
 
   --current_index_;
-  commands_[current_index_]->undo();
+  Command* cmd = commands_[current_index_].get();
+  claim(cmd);
+  cmd->decompress();
+  cmd->undo();
+
+  // The redo entry that just moved out of the uncompressed window
+  if (current_index_ + uncompressed_depth_ < commands_.size()) {
+    schedule_compression(current_index_ + uncompressed_depth_);
+  }
 }
 
 void UndoStack::redo() {
@@ -40,11 +64,23 @@ void UndoStack::redo() {
     return;
   }
 
-  commands_[current_index_]->redo();
+  Command* cmd = commands_[current_index_].get();
+  claim(cmd);
+  cmd->decompress();
+  cmd->redo();
   ++current_index_;
+
+  if (current_index_ > uncompressed_depth_) {
+    schedule_compression(current_index_ - 1 - uncompressed_depth_);
+  }
 }
 
 void UndoStack::clear() {
+  {
+    std::unique_lock<std::mutex> lock(compress_mutex_);
+    compress_queue_.clear();
+    compress_cv_.wait(lock, [this] { return compressing_ == nullptr; });
+  }
   commands_.clear();
   current_index_ = 0;
 }
@@ -82,15 +118,119 @@ void UndoStack::set_max_depth(std::size_t depth) {
   trim_to_max_depth();
 }
 
+void UndoStack::set_memory_budget(std::size_t bytes) {
+  memory_budget_ = bytes;
+  trim_to_budget();
+}
+
+std::size_t UndoStack::memory_usage() const {
+  std::size_t total = 0;
+  for (const auto& cmd : commands_) {
+    total += cmd->memory_footprint();
+  }
+  return total;
+}
+
+void UndoStack::set_uncompressed_depth(std::size_t depth) {
+  uncompressed_depth_ = depth;
+  for (std::size_t i = 0; i < commands_.size(); ++i) {
+    const std::size_t distance =
+        i < current_index_ ? current_index_ - 1 - i : i - current_index_;
+    if (distance >= uncompressed_depth_) {
+      schedule_compression(i);
+    }
+  }
+}
+
+void UndoStack::wait_for_compression() {
+  std::unique_lock<std::mutex> lock(compress_mutex_);
+  compress_cv_.wait(lock, [this] {
+    return compress_queue_.empty() && compressing_ == nullptr;
+  });
+}
+
 void UndoStack::trim_to_max_depth() {
   if (commands_.size() <= max_depth_) {
     return;
   }
 
   const std::size_t to_remove = commands_.size() - max_depth_;
-  commands_.erase(commands_.begin(), commands_.begin() + to_remove);
+  erase_commands(0, to_remove);
 
-  current_index_ = std::min(current_index_, commands_.size());
+  current_index_ = current_index_ > to_remove ? current_index_ - to_remove : 0;
+}
+
+void UndoStack::trim_to_budget() {
+  if (memory_budget_ == 0) {
+    return;
+  }
+
+  std::size_t usage = memory_usage();
+  std::size_t to_remove = 0;
+  while (usage > memory_budget_ && current_index_ - to_remove > 1) {
+    usage -= commands_[to_remove]->memory_footprint();
+    ++to_remove;
+  }
+
+  if (to_remove > 0) {
+    erase_commands(0, to_remove);
+    current_index_ -= to_remove;
+  }
+}
+
+void UndoStack::erase_commands(std::size_t first, std::size_t last) {
+  for (std::size_t i = first; i < last; ++i) {
+    claim(commands_[i].get());
+  }
+  commands_.erase(commands_.begin() + first, commands_.begin() + last);
+}
+
+void UndoStack::schedule_compression(std::size_t index) {
+  Command* cmd = commands_[index].get();
+  {
+    std::lock_guard<std::mutex> lock(compress_mutex_);
+    if (std::find(compress_queue_.begin(), compress_queue_.end(), cmd) !=
+        compress_queue_.end()) {
+      return;
+    }
+    compress_queue_.push_back(cmd);
+    if (!worker_.joinable()) {
+      worker_ = std::thread(&UndoStack::compression_worker, this);
+    }
+  }
+  compress_cv_.notify_all();
+}
+
+void UndoStack::claim(Command* cmd) {
+  std::unique_lock<std::mutex> lock(compress_mutex_);
+  auto it = std::find(compress_queue_.begin(), compress_queue_.end(), cmd);
+  if (it != compress_queue_.end()) {
+    compress_queue_.erase(it);
+  }
+  compress_cv_.wait(lock, [this, cmd] { return compressing_ != cmd; });
+}
+
+void UndoStack::compression_worker() {
+  std::unique_lock<std::mutex> lock(compress_mutex_);
+  while (true) {
+    compress_cv_.wait(lock, [this] {
+      return stop_worker_ || !compress_queue_.empty();
+    });
+    if (stop_worker_) {
+      return;
+    }
+
+    Command* cmd = compress_queue_.front();
+    compress_queue_.pop_front();
+    compressing_ = cmd;
+
+    lock.unlock();
+    cmd->compress();
+    lock.lock();
+
+    compressing_ = nullptr;
+    compress_cv_.notify_all();
+  }
 }
 
 }  // namespace ps::core